@@ -0,0 +1,117 @@
+#include "accounting.h"
+
+#define ACCOUNTING_HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+
+/* probes are bounded so a full table doesn't turn every exit into a scan */
+#define ACCOUNTING_MAX_PROBES 16
+
+VOID
+AccountingInitialise(_Out_ PCR3_ACCOUNTING Accounting)
+{
+        RtlZeroMemory(Accounting, sizeof(CR3_ACCOUNTING));
+}
+
+VOID
+AccountingUpdate(_Inout_ PCR3_ACCOUNTING Accounting,
+                 _In_ UINT64             Cr3,
+                 _In_ UINT64             Cycles)
+{
+        PHV_CR3_ACCOUNTING_ENTRY entry = NULL;
+        UINT64                   key   = Cr3 & ACCOUNTING_CR3_MASK;
+        UINT32                   slot  = 0;
+
+        Accounting->sequence++;
+        KeMemoryBarrierWithoutFence();
+
+        slot = (UINT32)((key * ACCOUNTING_HASH_MULTIPLIER) >> 32) &
+               (ACCOUNTING_SLOTS - 1);
+
+        for (UINT32 probe = 0; probe < ACCOUNTING_MAX_PROBES; probe++) {
+                entry = &Accounting->entries[slot];
+
+                if (entry->cr3 == key)
+                        goto found;
+
+                if (!entry->cr3) {
+                        entry->cr3 = key;
+                        Accounting->used++;
+                        goto found;
+                }
+
+                slot = (slot + 1) & (ACCOUNTING_SLOTS - 1);
+        }
+
+        entry = &Accounting->overflow;
+
+found:
+        entry->exits++;
+        entry->cycles += Cycles;
+
+        KeMemoryBarrierWithoutFence();
+        Accounting->sequence++;
+}
+
+/* returns FALSE if the copy was torn by a concurrent update */
+BOOLEAN
+AccountingSnapshot(_In_ PCR3_ACCOUNTING  Accounting,
+                   _Out_ PCR3_ACCOUNTING Copy)
+{
+        UINT64 sequence = Accounting->sequence;
+
+        if (sequence & 1)
+                return FALSE;
+
+        KeMemoryBarrierWithoutFence();
+        RtlCopyMemory(Copy, Accounting, sizeof(CR3_ACCOUNTING));
+        KeMemoryBarrierWithoutFence();
+
+        return Accounting->sequence == sequence ? TRUE : FALSE;
+}
+
+/*
+ * Folds a snapshot into Merged, which holds Count entries, returning the new
+ * count. Address spaces that don't fit within Capacity are added to Overflow.
+ */
+UINT32
+AccountingMerge(_Inout_ PHV_CR3_ACCOUNTING_ENTRY Merged,
+                _In_ UINT32                      Count,
+                _In_ UINT32                      Capacity,
+                _Inout_ PHV_CR3_ACCOUNTING_ENTRY Overflow,
+                _In_ PCR3_ACCOUNTING             Accounting)
+{
+        PHV_CR3_ACCOUNTING_ENTRY entry = NULL;
+        UINT32                   index = 0;
+
+        Overflow->exits += Accounting->overflow.exits;
+        Overflow->cycles += Accounting->overflow.cycles;
+
+        for (UINT32 slot = 0; slot < ACCOUNTING_SLOTS; slot++) {
+                entry = &Accounting->entries[slot];
+
+                if (!entry->cr3)
+                        continue;
+
+                for (index = 0; index < Count; index++) {
+                        if (Merged[index].cr3 == entry->cr3)
+                                break;
+                }
+
+                if (index == Count) {
+                        if (Count == Capacity) {
+                                Overflow->exits += entry->exits;
+                                Overflow->cycles += entry->cycles;
+                                continue;
+                        }
+
+                        Merged[Count].cr3    = entry->cr3;
+                        Merged[Count].exits  = 0;
+                        Merged[Count].cycles = 0;
+                        Count++;
+                }
+
+                Merged[index].exits += entry->exits;
+                Merged[index].cycles += entry->cycles;
+        }
+
+        return Count;
+}
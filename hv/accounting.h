@@ -0,0 +1,55 @@
+#ifndef ACCOUNTING_H
+#define ACCOUNTING_H
+
+#include "common.h"
+
+#include "ioctl.h"
+
+/*
+ * Per vcpu attribution of exits and the root mode cycles spent handling them
+ * to the guest address space they were taken in, keyed by the page directory
+ * base in guest cr3. Cycles are timed from entry to the exit dispatcher to
+ * just before it returns, so the cost of the transitions themselves is not
+ * included.
+ */
+
+/* a power of 2, enough for the processes that actually run on a core */
+#define ACCOUNTING_SLOTS 256
+
+/* drops the pcid (or pwt and pcd) bits so every pcid maps to one entry */
+#define ACCOUNTING_CR3_MASK 0x000FFFFFFFFFF000ull
+
+/*
+ * Only ever written by the core that owns it, see EXIT_SKETCH for how
+ * sequence is used. Once every slot is taken, exits in address spaces without
+ * one are counted in overflow instead, an empty slot having a cr3 of 0.
+ */
+typedef struct _CR3_ACCOUNTING {
+        volatile UINT64         sequence;
+        UINT32                  used;
+        UINT32                  reserved;
+        HV_CR3_ACCOUNTING_ENTRY overflow;
+        HV_CR3_ACCOUNTING_ENTRY entries[ACCOUNTING_SLOTS];
+
+} CR3_ACCOUNTING, *PCR3_ACCOUNTING;
+
+VOID
+AccountingInitialise(_Out_ PCR3_ACCOUNTING Accounting);
+
+VOID
+AccountingUpdate(_Inout_ PCR3_ACCOUNTING Accounting,
+                 _In_ UINT64             Cr3,
+                 _In_ UINT64             Cycles);
+
+BOOLEAN
+AccountingSnapshot(_In_ PCR3_ACCOUNTING  Accounting,
+                   _Out_ PCR3_ACCOUNTING Copy);
+
+UINT32
+AccountingMerge(_Inout_ PHV_CR3_ACCOUNTING_ENTRY Merged,
+                _In_ UINT32                      Count,
+                _In_ UINT32                      Capacity,
+                _Inout_ PHV_CR3_ACCOUNTING_ENTRY Overflow,
+                _In_ PCR3_ACCOUNTING             Accounting);
+
+#endif
@@ -26,6 +26,7 @@ PUBLIC __writemsr
 PUBLIC __lgdt
 PUBLIC __lar
 PUBLIC __sgdt
+PUBLIC __invept
 
 ; Wrapper function for the vmcall instruction. 
 
@@ -53,6 +54,15 @@ EXTERN StoreHostDebugRegisterState:PROC
 VMX_VCPU_STATE_OFF        EQU 0
 VMX_VCPU_STATE_RUNNING    EQU 1
 VMX_VCPU_STATE_TERMINATED EQU 2
+VMX_VCPU_STATE_EXCLUDED   EQU 3
+
+;	Layout of the top of the host stack, mirrors HOST_STACK_TOP in vmx.h. The
+;	offsets are relative to the stack pointer once pushfq and SAVE_GP have
+;	pushed the GUEST_CONTEXT structure.
+
+GUEST_CONTEXT_SIZE        EQU 88h
+HOST_STACK_SCRATCH        EQU GUEST_CONTEXT_SIZE
+HOST_STACK_VCPU           EQU GUEST_CONTEXT_SIZE + 8h
 
 .code _text
 
@@ -242,13 +252,18 @@ VmExitHandler PROC
 	; call LoadHostDebugRegisterState
 	; add rsp, 20h
 
-	; first argument for our exit handler is the guest register state, 
-	; so store the base of the stack in rcx
+	; first argument for our exit handler is the vcpu, which is stored at 
+	; the top of the host stack. The second is the guest register state, 
+	; which is the base of the stack. 
+	;
+	; The GUEST_CONTEXT leaves the stack 8 bytes off 16 byte alignment, 
+	; so allocate an extra 8 bytes alongside the shadow space.
 
-	mov rcx, rsp
-	sub rsp, 20h			
+	mov rcx, [rsp+HOST_STACK_VCPU]
+	mov rdx, rsp
+	sub rsp, 28h			
 	CALL VmExitDispatcher		
-	add rsp, 20h			
+	add rsp, 28h			
 
 	; check if the return value from our exit dispatcher is 1 (true)
 
@@ -295,30 +310,27 @@ VmExitHandler ENDP
 
 ExitVmx PROC
 
-	push rax	
-
 	; Ensure we set the vcpus status to TERMINATED
 
-	sub rsp, 020h
-	call VmmGetCoresVcpu
-	add rsp, 020h
+	mov rax, [rsp+HOST_STACK_VCPU]
 	mov [rax], dword ptr VMX_VCPU_STATE_TERMINATED
-	pop rax
 
 	; On vmentry, the processor will set the guests RSP and RIP to what
 	; was stored in the vmcs at vmexit. Since we have turned off vmx
 	; operation this will not occur, hence we must do it manually from
 	; state we stored from the vmcs before we exited vmx operation.
 
-	sub rsp, 020h 
+	mov rcx, [rsp+HOST_STACK_VCPU]
+	sub rsp, 028h 
 	call VmmReadGuestRsp
-	add rsp, 020h
-	mov [rsp+88h], rax
-	sub rsp, 020h
+	add rsp, 028h
+	mov [rsp+HOST_STACK_SCRATCH], rax
+	mov rcx, [rsp+HOST_STACK_VCPU]
+	sub rsp, 028h
 	call VmmReadGuestRip
-	add rsp, 020h
+	add rsp, 028h
 	mov rdx, rsp
-	mov rbx, [rsp+88h]
+	mov rbx, [rsp+HOST_STACK_SCRATCH]
 	mov rsp, rbx
 	push rax
 
@@ -327,7 +339,7 @@ ExitVmx PROC
 
 	mov rsp, rdx			                 
 	sub rbx,08h			
-	mov [rsp+88h], rbx	
+	mov [rsp+HOST_STACK_SCRATCH], rbx	
 	; RESTORE_DEBUG
 	RESTORE_GP			
 	popfq				
@@ -368,9 +380,13 @@ SaveStateAndVirtualizeCore PROC PUBLIC
 	mov rdx, rsp
 	call VirtualizeCore	
 
-	; We should never reach this ret instruction. If we do, VirtualizeCore will
-	; log the error and set the vcpu's vmm_state->state to terminated.
+	; We only return here if vmlaunch failed, in which case VirtualizeCore
+	; will have logged the error and set the vcpu's vmm_state->state to 
+	; terminated. Unwind our frame so we return to the IPI dispatcher with
+	; its registers intact.
 
+	add rsp, 28h
+	RESTORE_GP
 	ret
 
 SaveStateAndVirtualizeCore ENDP 
@@ -397,8 +413,12 @@ SaveStateAndVirtualizeCore ENDP
 
 VmxRestoreState PROC
 
-	add rsp, 28h
+	; The guest resumes on the stack SaveStateAndVirtualizeCore left, so the
+	; 28h bytes below the saved registers double as the shadow space for 
+	; this call.
+
 	call VmmGetCoresVcpu
+	add rsp, 28h
 	mov [rax], dword ptr VMX_VCPU_STATE_RUNNING
 
 	; call StoreHostDebugRegisterState
@@ -763,5 +783,42 @@ __sgdt PROC
 
 __sgdt ENDP
 
+;++
+;
+; UINT8
+; __invept(_In_ UINT32 Type, _In_ PVOID Descriptor)
+;
+; Routine Description:
+;
+;   Invalidates cached EPT translations as described by Type and the 128-bit
+;   descriptor at Descriptor.
+;
+; Return Value:
+;
+;   0 : The operation succeeded.
+;   1 : The operation failed with extended status available in the
+;       VM-instruction error field of the current VMCS.
+;   2 : The operation failed without status available.
+;
+;--
+
+__invept PROC
+
+    invept rcx, oword ptr [rdx]
+    jz invept_failed_with_status
+    jc invept_failed
+    xor rax, rax
+    ret
+
+invept_failed_with_status:
+    mov rax, 1
+    ret
+
+invept_failed:
+    mov rax, 2
+    ret
+
+__invept ENDP
+
 
 END
\ No newline at end of file
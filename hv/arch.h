@@ -8,7 +8,7 @@ EXTERN
 VOID
 VmxRestoreState();
 
-EXTERN UINT64 INLINE
+EXTERN UINT64
 SaveStateAndVirtualizeCore(_In_ PDPC_CALL_CONTEXT Context);
 
 EXTERN
@@ -26,7 +26,7 @@ __writecr0(_In_ UINT64 Value);
 EXTERN VOID
 __lgdt(_In_ PVOID Value);
 
-EXTERN NTSTATUS INLINE
+EXTERN NTSTATUS
 __vmx_vmcall(_In_ UINT64 VmCallNumber,
              _In_ UINT64 OptionalParam1,
              _In_ UINT64 OptionalParam2,
@@ -38,6 +38,9 @@ __lar(_In_ UINT64 Selector);
 EXTERN VOID
 __sgdt(_In_ SEGMENT_DESCRIPTOR_REGISTER_64* Gdtr);
 
+EXTERN UINT8
+__invept(_In_ UINT32 Type, _In_ PVOID Descriptor);
+
 EXTERN UINT16 __readcs(VOID);
 
 EXTERN UINT16 __readds(VOID);
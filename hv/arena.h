@@ -0,0 +1,100 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/*
+ * Each vcpu's VMX pages are carved out of a single physically contiguous,
+ * page aligned allocation. The layout calculation below has no kernel
+ * dependencies so it can be exercised from user mode.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#elif defined(_WIN32)
+#        include <windows.h>
+#else
+#        include <stdint.h>
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+#endif
+
+#define VMX_HOST_STACK_SIZE 0x8000
+
+/*
+ * The size of HOST_STACK_TOP at the very top of the host stack, see vmx.h.
+ * Kept a multiple of 16 so the host stack stays aligned.
+ */
+#define ARENA_HOST_STACK_TOP_SIZE 0x10
+
+/*
+ * Filled into the page below the host stack a ULONG at a time, the stack grows
+ * down towards it so an overflow overwrites the pattern and is caught on
+ * teardown. Every byte of the pattern is set, so an overflow that only writes
+ * zeroes is caught as well.
+ */
+#define ARENA_GUARD_PATTERN 0xCCCCCCCC
+
+#if defined(_KERNEL_MODE)
+C_ASSERT(VMX_HOST_STACK_SIZE % PAGE_SIZE == 0);
+C_ASSERT(ARENA_HOST_STACK_TOP_SIZE % 16 == 0);
+#endif
+
+/*
+ * Byte offsets of each region from the base of the arena. The host stack is
+ * placed last with the guard page directly below it.
+ */
+typedef struct _VCPU_ARENA_LAYOUT {
+        UINT32 vmxon;
+        UINT32 vmcs;
+        UINT32 msr_bitmap;
+        UINT32 virtual_apic;
+        /* bitmap A and B, one page each */
+        UINT32 io_bitmap;
+        UINT32 guard;
+        UINT32 stack;
+        UINT32 stack_size;
+        UINT32 size;
+
+} VCPU_ARENA_LAYOUT, *PVCPU_ARENA_LAYOUT;
+
+/*
+ * Returns 0 on success, or -1 if PageSize isn't a power of two or StackSize
+ * isn't a whole number of pages.
+ */
+static __inline int
+ArenaLayoutBuild(PVCPU_ARENA_LAYOUT Layout, UINT32 PageSize, UINT32 StackSize)
+{
+        UINT32 offset = 0;
+
+        if (!PageSize || PageSize & (PageSize - 1))
+                return -1;
+
+        if (!StackSize || StackSize & (PageSize - 1))
+                return -1;
+
+        Layout->vmxon = offset;
+        offset += PageSize;
+        Layout->vmcs = offset;
+        offset += PageSize;
+        Layout->msr_bitmap = offset;
+        offset += PageSize;
+        Layout->virtual_apic = offset;
+        offset += PageSize;
+        Layout->io_bitmap = offset;
+        offset += 2 * PageSize;
+        Layout->guard = offset;
+        offset += PageSize;
+        Layout->stack = offset;
+        offset += StackSize;
+
+        Layout->stack_size = StackSize;
+        Layout->size       = offset;
+        return 0;
+}
+
+/* The offset of HOST_STACK_TOP, which VMCS_HOST_RSP points at. */
+static __inline UINT32
+ArenaHostStackTop(const VCPU_ARENA_LAYOUT* Layout)
+{
+        return Layout->stack + Layout->stack_size - ARENA_HOST_STACK_TOP_SIZE;
+}
+
+#endif
@@ -0,0 +1,132 @@
+#include "bench.h"
+
+#include "vmx.h"
+#include "arch.h"
+#include "hw.h"
+#include "topology.h"
+
+#include <intrin.h>
+
+/*
+ * Samples are taken in batches at DISPATCH_LEVEL so the thread can't migrate
+ * mid sample, while still letting the core service DPCs between batches.
+ */
+#define BENCH_BATCH_SIZE 0x1000
+
+/* the POST diagnostic port, reads from it have no side effects */
+#define BENCH_IO_PORT 0x80
+
+STATIC
+BOOLEAN
+BenchIsCurrentCoreVirtualised()
+{
+        if (!vmm_state)
+                return FALSE;
+
+        return vmm_state[TopologyCurrentIndex()].state ==
+                       VMX_VCPU_STATE_RUNNING
+                   ? TRUE
+                   : FALSE;
+}
+
+STATIC
+BOOLEAN
+BenchHasTscAux()
+{
+        CPUID_EAX_80000001 cpuid = {0};
+
+        HwCpuidEx((INT32*)&cpuid, CPUID_EXTENDED_CPU_SIGNATURE, 0);
+        return cpuid.Edx.RdtscpAvailable ? TRUE : FALSE;
+}
+
+/*
+ * The lfences keep the operation from being reordered around either tsc read,
+ * at the cost of adding their own latency to every sample, which is what the
+ * NONE operation is there to measure.
+ */
+STATIC
+UINT32
+BenchSample(_In_ UINT32 Operation, _In_ UINT64 TscAux, _In_ UINT64 Cr8)
+{
+        INT32           registers[4] = {0};
+        volatile UINT64 sink         = 0;
+        UINT64          start        = 0;
+        UINT64          cycles       = 0;
+
+        _mm_lfence();
+        start = __rdtsc();
+        _mm_lfence();
+
+        switch (Operation) {
+        case HV_EXIT_BENCHMARK_CPUID: HwCpuidEx(registers, 0, 0); break;
+        case HV_EXIT_BENCHMARK_CPUID_HYPERVISOR:
+                HwCpuidEx(registers, 0x40000000, 0);
+                break;
+        case HV_EXIT_BENCHMARK_VMCALL_PING:
+                __vmx_vmcall(VMX_HYPERCALL_PING, 0, 0, 0);
+                break;
+        case HV_EXIT_BENCHMARK_RDMSR: sink = HwReadMsr(IA32_TSC_AUX); break;
+        case HV_EXIT_BENCHMARK_WRMSR: HwWriteMsr(IA32_TSC_AUX, TscAux); break;
+        case HV_EXIT_BENCHMARK_PORT_IO: sink = __inbyte(BENCH_IO_PORT); break;
+        case HV_EXIT_BENCHMARK_CR8_READ: sink = HwReadCr8(); break;
+        case HV_EXIT_BENCHMARK_CR8_WRITE: HwWriteCr8(Cr8); break;
+        default: break;
+        }
+
+        _mm_lfence();
+        cycles = __rdtsc() - start;
+
+        UNREFERENCED_PARAMETER(sink);
+        return cycles > MAXUINT32 ? MAXUINT32 : (UINT32)cycles;
+}
+
+/*
+ * Runs on the calling thread, which should already be pinned to the core it
+ * wants to measure. Every operation but the vmcall is also valid when the
+ * core isn't virtualised, measuring its native cost instead.
+ */
+NTSTATUS
+BenchRunExitBenchmark(_In_ UINT32   Operation,
+                      _Out_ UINT32* Samples,
+                      _In_ UINT32   SampleCount)
+{
+        NTSTATUS status  = STATUS_SUCCESS;
+        KIRQL    irql    = 0;
+        UINT64   tsc_aux = 0;
+        UINT32   batch   = 0;
+
+        if (Operation >= HV_EXIT_BENCHMARK_OPERATION_COUNT ||
+            SampleCount > HV_EXIT_BENCHMARK_MAX_SAMPLES)
+                return STATUS_INVALID_PARAMETER;
+
+        if ((Operation == HV_EXIT_BENCHMARK_RDMSR ||
+             Operation == HV_EXIT_BENCHMARK_WRMSR) &&
+            !BenchHasTscAux())
+                return STATUS_NOT_SUPPORTED;
+
+        for (UINT32 index = 0; index < SampleCount; index += batch) {
+                batch = min(SampleCount - index, BENCH_BATCH_SIZE);
+
+                KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+                /* a vmcall on a core that isn't in VMX operation would #UD */
+                if (Operation == HV_EXIT_BENCHMARK_VMCALL_PING &&
+                    !BenchIsCurrentCoreVirtualised()) {
+                        KeLowerIrql(irql);
+                        status = STATUS_NOT_SUPPORTED;
+                        break;
+                }
+
+                if (Operation == HV_EXIT_BENCHMARK_WRMSR)
+                        tsc_aux = HwReadMsr(IA32_TSC_AUX);
+
+                /* cr8 is the irql, so only ever write back the current one */
+                for (UINT32 sample = 0; sample < batch; sample++)
+                        Samples[index + sample] =
+                            BenchSample(Operation, tsc_aux, HwReadCr8());
+
+                KeLowerIrql(irql);
+        }
+
+        return status;
+}
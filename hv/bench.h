@@ -0,0 +1,12 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "common.h"
+#include "ioctl.h"
+
+NTSTATUS
+BenchRunExitBenchmark(_In_ UINT32  Operation,
+                      _Out_ UINT32* Samples,
+                      _In_ UINT32   SampleCount);
+
+#endif
@@ -0,0 +1,137 @@
+#include "bpindex.h"
+
+#define BP_INDEX_ALIGN(Size) (((Size) + 7) & ~7ull)
+
+UINT64
+BpIndexSize(_In_ UINT32 SiteCount)
+{
+        /* there are never more pages than sites */
+        return BP_INDEX_ALIGN(sizeof(BP_INDEX)) +
+               (UINT64)SiteCount * sizeof(BP_INDEX_PAGE) +
+               (UINT64)SiteCount * sizeof(UINT32) +
+               (UINT64)SiteCount * sizeof(UINT16);
+}
+
+/*
+ * Shell sort, the index is only rebuilt from PASSIVE_LEVEL when a breakpoint
+ * is added or removed, and there is no qsort in the kernel we can rely on.
+ */
+STATIC
+VOID
+BpIndexSortSites(_Inout_ PBP_INDEX_SITE Sites, _In_ UINT32 Count)
+{
+        UINT32 gap = 1;
+
+        while (gap < Count / 3)
+                gap = gap * 3 + 1;
+
+        for (; gap; gap /= 3) {
+                for (UINT32 index = gap; index < Count; index++) {
+                        BP_INDEX_SITE site     = Sites[index];
+                        UINT32        position = index;
+
+                        while (position >= gap &&
+                               Sites[position - gap].address > site.address) {
+                                Sites[position] = Sites[position - gap];
+                                position -= gap;
+                        }
+
+                        Sites[position] = site;
+                }
+        }
+}
+
+PBP_INDEX
+BpIndexBuild(_Inout_ PBP_INDEX_SITE Sites,
+             _In_ UINT32            Count,
+             _Out_ VOID*            Buffer)
+{
+        PBP_INDEX      index = (PBP_INDEX)Buffer;
+        PBP_INDEX_PAGE page  = NULL;
+        UINT64         frame = 0;
+
+        BpIndexSortSites(Sites, Count);
+
+        index->page_count = 0;
+        index->site_count = Count;
+        index->pages =
+            (PBP_INDEX_PAGE)((UINT8*)Buffer + BP_INDEX_ALIGN(sizeof(BP_INDEX)));
+        index->ids     = (UINT32*)(index->pages + Count);
+        index->offsets = (UINT16*)(index->ids + Count);
+
+        for (UINT32 site = 0; site < Count; site++) {
+                frame = Sites[site].address >> BP_INDEX_PAGE_SHIFT;
+
+                if (!page || page->frame != frame) {
+                        page        = &index->pages[index->page_count++];
+                        page->frame = frame;
+                        page->first = site;
+                        page->count = 0;
+                }
+
+                index->ids[site] = Sites[site].id;
+                index->offsets[site] =
+                    (UINT16)(Sites[site].address & BP_INDEX_PAGE_MASK);
+                page->count++;
+        }
+
+        return index;
+}
+
+const BP_INDEX_PAGE*
+BpIndexFindPage(_In_ const BP_INDEX* Index, _In_ UINT64 Frame)
+{
+        UINT32 low  = 0;
+        UINT32 high = Index->page_count;
+
+        /* lower bound, so the loop runs the same number of times on a miss */
+        while (low < high) {
+                UINT32 middle = low + (high - low) / 2;
+
+                if (Index->pages[middle].frame < Frame)
+                        low = middle + 1;
+                else
+                        high = middle;
+        }
+
+        if (low < Index->page_count && Index->pages[low].frame == Frame)
+                return &Index->pages[low];
+
+        return NULL;
+}
+
+UINT32
+BpIndexFindOffset(_In_ const BP_INDEX*      Index,
+                  _In_ const BP_INDEX_PAGE* Page,
+                  _In_ UINT32               Offset)
+{
+        UINT32 low  = Page->first;
+        UINT32 high = Page->first + Page->count;
+
+        while (low < high) {
+                UINT32 middle = low + (high - low) / 2;
+
+                if (Index->offsets[middle] < Offset)
+                        low = middle + 1;
+                else
+                        high = middle;
+        }
+
+        if (low < Page->first + Page->count && Index->offsets[low] == Offset)
+                return Index->ids[low];
+
+        return BP_INDEX_MISS;
+}
+
+UINT32
+BpIndexLookup(_In_ const BP_INDEX* Index, _In_ UINT64 Address)
+{
+        const BP_INDEX_PAGE* page =
+            BpIndexFindPage(Index, Address >> BP_INDEX_PAGE_SHIFT);
+
+        if (!page)
+                return BP_INDEX_MISS;
+
+        return BpIndexFindOffset(
+            Index, page, (UINT32)(Address & BP_INDEX_PAGE_MASK));
+}
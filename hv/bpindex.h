@@ -0,0 +1,102 @@
+#ifndef BPINDEX_H
+#define BPINDEX_H
+
+/*
+ * Lookup structure behind the EPT execute breakpoints, see ept.c. Every page
+ * holding a breakpoint is made non executable, so an EPT violation has to
+ * decide whether the faulting instruction is a breakpoint or simply shares a
+ * page with one. Both decisions are binary searches, first over the pages by
+ * guest physical frame and then over that pages breakpoint offsets, so the
+ * cost is O(log pages + log breakpoints on the page) no matter how many
+ * breakpoints are set.
+ *
+ * An index is immutable once built. The driver builds a new one whenever a
+ * breakpoint is added or removed and swaps it in, which lets the exit path
+ * read it without taking any lock.
+ *
+ * Like sketch.h this has no kernel dependencies, see tools/breakpoints.c.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#elif defined(_WIN32)
+#        include <windows.h>
+#else
+#        include <stddef.h>
+#        include <stdint.h>
+typedef uint8_t  UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef void     VOID;
+#        define _In_
+#        define _Out_
+#        define _Inout_
+#endif
+
+#if !defined(_KERNEL_MODE)
+#        define STATIC static
+#endif
+
+#define BP_INDEX_PAGE_SHIFT 12
+#define BP_INDEX_PAGE_MASK  0xFFF
+
+/* returned by the lookups when the address is not a breakpoint */
+#define BP_INDEX_MISS 0xFFFFFFFF
+
+/* an input to BpIndexBuild, id is handed back by the lookups on a hit */
+typedef struct _BP_INDEX_SITE {
+        UINT64 address;
+        UINT32 id;
+        UINT32 reserved;
+
+} BP_INDEX_SITE, *PBP_INDEX_SITE;
+
+typedef struct _BP_INDEX_PAGE {
+        /* guest physical address >> BP_INDEX_PAGE_SHIFT */
+        UINT64 frame;
+        /* this pages entries in offsets and ids, sorted by offset */
+        UINT32 first;
+        UINT32 count;
+
+} BP_INDEX_PAGE, *PBP_INDEX_PAGE;
+
+/*
+ * A single allocation of BpIndexSize bytes, the arrays follow the header and
+ * pages is sorted by frame.
+ */
+typedef struct _BP_INDEX {
+        UINT32         page_count;
+        UINT32         site_count;
+        PBP_INDEX_PAGE pages;
+        UINT32*        ids;
+        UINT16*        offsets;
+
+} BP_INDEX, *PBP_INDEX;
+
+UINT64
+BpIndexSize(_In_ UINT32 SiteCount);
+
+/*
+ * Sorts Sites in place and builds the index into Buffer, which must be at
+ * least BpIndexSize(Count) bytes and suitably aligned for a pointer. The
+ * addresses must be unique.
+ */
+PBP_INDEX
+BpIndexBuild(_Inout_ PBP_INDEX_SITE Sites,
+             _In_ UINT32            Count,
+             _Out_ VOID*            Buffer);
+
+/* returns NULL if there are no breakpoints on the page */
+const BP_INDEX_PAGE*
+BpIndexFindPage(_In_ const BP_INDEX* Index, _In_ UINT64 Frame);
+
+/* returns the id of the breakpoint at Offset on Page, or BP_INDEX_MISS */
+UINT32
+BpIndexFindOffset(_In_ const BP_INDEX*      Index,
+                  _In_ const BP_INDEX_PAGE* Page,
+                  _In_ UINT32               Offset);
+
+UINT32
+BpIndexLookup(_In_ const BP_INDEX* Index, _In_ UINT64 Address);
+
+#endif
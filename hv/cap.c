@@ -0,0 +1,193 @@
+#include "cap.h"
+#include "hw.h"
+
+/*
+ * The low 32 bits of a control capability msr are the allowed 0-settings, a
+ * bit set there must be 1 in the control. The high 32 bits are the allowed
+ * 1-settings, a bit clear there must be 0 in the control.
+ */
+STATIC
+UINT32
+CapAdjustControl(_In_ UINT32 Control, _In_ UINT64 Capability)
+{
+        Control &= (UINT32)(Capability >> 32);
+        Control |= (UINT32)Capability;
+        return Control;
+}
+
+VOID
+CapBuildVmcsTemplate(_In_ const VMX_CAPABILITIES* Capabilities,
+                     _In_ UINT32                  Flags,
+                     _Out_ PVMCS_TEMPLATE         Template)
+{
+        IA32_VMX_PROCBASED_CTLS_REGISTER  proc     = {0};
+        IA32_VMX_PROCBASED_CTLS2_REGISTER proc2    = {0};
+        IA32_VMX_PINBASED_CTLS_REGISTER   pin      = {0};
+        IA32_VMX_EXIT_CTLS_REGISTER       exit     = {0};
+        IA32_VMX_ENTRY_CTLS_REGISTER      entry    = {0};
+        IA32_APIC_BASE_REGISTER           apic     = {0};
+        int                               use_apic = 0;
+
+        apic.AsUInt = Capabilities->apic_base;
+        use_apic    = (Flags & CAP_TEMPLATE_APIC) &&
+                      CapHasLocalApic(Capabilities);
+
+        Template->apic_access_address = 0;
+
+        /*
+         * ActivateSecondaryControls activates the secondary processor-based
+         * VM-execution controls. If UseMsrBitmaps is not set, all RDMSR and
+         * WRMSR instructions cause vm-exits.
+         */
+        proc.ActivateSecondaryControls = 1;
+        proc.UseMsrBitmaps             = 1;
+
+        /*
+         * TPR shadowing is still quite buggy, so to allow us to work on further
+         * apic features we enable it aswell. (This is because TPR shadowing is
+         * required for further APIC virtualisation features.
+         */
+        if (use_apic)
+                proc.UseTprShadow = 1;
+
+        proc2.EnableRdtscp  = 1;
+        proc2.EnableInvpcid = 1;
+        proc2.EnableXsaves  = 1;
+
+        if (Flags & CAP_TEMPLATE_EPT)
+                proc2.EnableEpt = 1;
+
+        if (Flags & CAP_TEMPLATE_NMI)
+                pin.NmiExiting = 1;
+
+        /*
+         * If we are in X2 Apic Mode, leave MMIO apic register access
+         * virtualization disabled, otherwise trap accesses to the xapic page.
+         */
+        if (use_apic && !CapIsX2ApicEnabled(Capabilities))
+                proc2.VirtualizeApicAccesses = 1;
+
+        exit.AcknowledgeInterruptOnExit = 1;
+        exit.HostAddressSpaceSize       = 1;
+        exit.SaveDebugControls          = 1;
+
+        entry.Ia32EModeGuest    = 1;
+        entry.LoadDebugControls = 1;
+
+        Template->proc_ctls =
+            CapAdjustControl(proc.AsUInt, Capabilities->procbased_ctls);
+        Template->proc_ctls2 =
+            CapAdjustControl(proc2.AsUInt, Capabilities->procbased_ctls2);
+
+        /* processors without secondary controls can't virtualise the page */
+        proc2.AsUInt = Template->proc_ctls2;
+
+        if (proc2.VirtualizeApicAccesses)
+                Template->apic_access_address = apic.ApicBase << 12;
+
+        Template->pin_ctls =
+            CapAdjustControl(pin.AsUInt, Capabilities->pinbased_ctls);
+        Template->exit_ctls =
+            CapAdjustControl(exit.AsUInt, Capabilities->exit_ctls);
+        Template->entry_ctls =
+            CapAdjustControl(entry.AsUInt, Capabilities->entry_ctls);
+
+        /* start off by only exiting on divide by zero exceptions */
+        Template->exception_bitmap = 1U << DivideError;
+
+        /*
+         * The guest owns every bit of cr0 and cr4 for now, so accesses to them
+         * never cause exits and the read shadows are never consulted.
+         */
+        Template->cr0_guest_host_mask = 0;
+        Template->cr4_guest_host_mask = 0;
+}
+
+#if defined(_KERNEL_MODE)
+
+STATIC VMX_CAPABILITIES capabilities   = {0};
+STATIC VMCS_TEMPLATE    vmcs_template  = {0};
+STATIC UINT32           template_flags = 0;
+
+/*
+ * The capability msrs are identical on every core, so they are read once on
+ * whichever core we load on.
+ */
+NTSTATUS
+CapInitialise()
+{
+        CPUID_EAX_01 features = {0};
+        UINT32       flags    = 0;
+
+        HwCpuidEx((INT32*)&features, CPUID_VERSION_INFORMATION, 0);
+
+        capabilities.cpuid_01_ecx = features.CpuidFeatureInformationEcx.AsUInt;
+        capabilities.cpuid_01_edx = features.CpuidFeatureInformationEdx.AsUInt;
+
+        /* the capability msrs #GP if vmx isn't supported */
+        if (!features.CpuidFeatureInformationEcx.VirtualMachineExtensions)
+                return STATUS_NOT_SUPPORTED;
+
+        capabilities.basic          = HwReadMsr(IA32_VMX_BASIC);
+        capabilities.pinbased_ctls  = HwReadMsr(IA32_VMX_PINBASED_CTLS);
+        capabilities.procbased_ctls = HwReadMsr(IA32_VMX_PROCBASED_CTLS);
+        capabilities.exit_ctls      = HwReadMsr(IA32_VMX_EXIT_CTLS);
+        capabilities.entry_ctls     = HwReadMsr(IA32_VMX_ENTRY_CTLS);
+        capabilities.misc           = HwReadMsr(IA32_VMX_MISC);
+        capabilities.cr0_fixed0     = HwReadMsr(IA32_VMX_CR0_FIXED0);
+        capabilities.cr0_fixed1     = HwReadMsr(IA32_VMX_CR0_FIXED1);
+        capabilities.cr4_fixed0     = HwReadMsr(IA32_VMX_CR4_FIXED0);
+        capabilities.cr4_fixed1     = HwReadMsr(IA32_VMX_CR4_FIXED1);
+        capabilities.apic_base      = HwReadMsr(IA32_APIC_BASE);
+
+        if ((capabilities.procbased_ctls >> 32) &
+            IA32_VMX_PROCBASED_CTLS_ACTIVATE_SECONDARY_CONTROLS_FLAG)
+                capabilities.procbased_ctls2 =
+                    HwReadMsr(IA32_VMX_PROCBASED_CTLS2);
+
+        if ((capabilities.procbased_ctls2 >> 32) &
+            (IA32_VMX_PROCBASED_CTLS2_ENABLE_EPT_FLAG |
+             IA32_VMX_PROCBASED_CTLS2_ENABLE_VPID_FLAG))
+                capabilities.ept_vpid_cap = HwReadMsr(IA32_VMX_EPT_VPID_CAP);
+
+#if APIC
+        flags |= CAP_TEMPLATE_APIC;
+#endif
+        template_flags = flags;
+        CapBuildVmcsTemplate(&capabilities, flags, &vmcs_template);
+
+        DEBUG_LOG("VMCS template - pin: %lx, proc: %lx, proc2: %lx, exit: %lx, "
+                  "entry: %lx",
+                  vmcs_template.pin_ctls,
+                  vmcs_template.proc_ctls,
+                  vmcs_template.proc_ctls2,
+                  vmcs_template.exit_ctls,
+                  vmcs_template.entry_ctls);
+
+        return STATUS_SUCCESS;
+}
+
+const VMX_CAPABILITIES*
+CapGetCapabilities()
+{
+        return &capabilities;
+}
+
+const VMCS_TEMPLATE*
+CapGetVmcsTemplate()
+{
+        return &vmcs_template;
+}
+
+/*
+ * For features that can only be enabled once their own state has been set up
+ * after CapInitialise, such as ept. Must be called before any vmcs is written.
+ */
+VOID
+CapEnableTemplateFlags(_In_ UINT32 Flags)
+{
+        template_flags |= Flags;
+        CapBuildVmcsTemplate(&capabilities, template_flags, &vmcs_template);
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef CAP_H
+#define CAP_H
+
+/*
+ * The VMX capability msrs, cpuid features and apic mode are read once when
+ * the driver loads. The VMCS template each core replays is built from this
+ * snapshot by CapBuildVmcsTemplate, which has no kernel dependencies so it can
+ * be built in user mode against capability dumps taken from real processors,
+ * see tools/captemplate.c.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#else
+#        define STATIC static
+#        define VOID   void
+#        define _In_
+#        define _Out_
+#endif
+
+#include "ia32.h"
+
+/* build the template with TPR shadowing and apic access virtualisation */
+#define CAP_TEMPLATE_APIC 0x1
+/* enable ept, the pointer itself is written per vcpu from ept.c */
+#define CAP_TEMPLATE_EPT  0x2
+/* exit on NMIs, so freeze.c can park cores in root */
+#define CAP_TEMPLATE_NMI  0x4
+
+typedef struct _VMX_CAPABILITIES {
+        UINT64 basic;
+        UINT64 pinbased_ctls;
+        UINT64 procbased_ctls;
+        UINT64 exit_ctls;
+        UINT64 entry_ctls;
+        UINT64 misc;
+        UINT64 cr0_fixed0;
+        UINT64 cr0_fixed1;
+        UINT64 cr4_fixed0;
+        UINT64 cr4_fixed1;
+        /* only valid if the secondary controls can be activated */
+        UINT64 procbased_ctls2;
+        /* only valid if either ept or vpid can be enabled */
+        UINT64 ept_vpid_cap;
+        UINT64 apic_base;
+        UINT32 cpuid_01_ecx;
+        UINT32 cpuid_01_edx;
+
+} VMX_CAPABILITIES, *PVMX_CAPABILITIES;
+
+/*
+ * The final, capability adjusted, values of the control fields that are the
+ * same on every core. Per core fields such as the msr bitmap and virtual apic
+ * addresses are filled in when the template is replayed.
+ */
+typedef struct _VMCS_TEMPLATE {
+        UINT32 pin_ctls;
+        UINT32 proc_ctls;
+        UINT32 proc_ctls2;
+        UINT32 exit_ctls;
+        UINT32 entry_ctls;
+        UINT32 exception_bitmap;
+        UINT64 cr0_guest_host_mask;
+        UINT64 cr4_guest_host_mask;
+        /* only used if the template virtualises apic accesses */
+        UINT64 apic_access_address;
+
+} VMCS_TEMPLATE, *PVMCS_TEMPLATE;
+
+static __inline int
+CapHasLocalApic(const VMX_CAPABILITIES* Capabilities)
+{
+        return (Capabilities->cpuid_01_edx &
+                CPUID_FEATURE_INFORMATION_EDX_APIC_ON_CHIP_FLAG) != 0;
+}
+
+static __inline int
+CapIsX2ApicEnabled(const VMX_CAPABILITIES* Capabilities)
+{
+        return (Capabilities->apic_base &
+                IA32_APIC_BASE_ENABLE_X2APIC_MODE_FLAG) != 0;
+}
+
+VOID
+CapBuildVmcsTemplate(_In_ const VMX_CAPABILITIES* Capabilities,
+                     _In_ UINT32                  Flags,
+                     _Out_ PVMCS_TEMPLATE         Template);
+
+#if defined(_KERNEL_MODE)
+
+NTSTATUS
+CapInitialise();
+
+const VMX_CAPABILITIES*
+CapGetCapabilities();
+
+const VMCS_TEMPLATE*
+CapGetVmcsTemplate();
+
+VOID
+CapEnableTemplateFlags(_In_ UINT32 Flags);
+
+#endif
+
+#endif
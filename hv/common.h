@@ -1,8 +1,13 @@
 #pragma once
 
-#include <ntddk.h>
-#include <wdf.h>
-#include <wdm.h>
+#if defined(HWSIM)
+#        include "ntshim.h"
+#else
+#        include <ntddk.h>
+#        include <wdf.h>
+#        include <wdm.h>
+#        include <intrin.h>
+#endif
 
 #define DEBUG_LOG(fmt, ...) \
         DbgPrintEx(DPFLTR_IHVDRIVER_ID, 0, "hv-log: " fmt "\n", ##__VA_ARGS__)
@@ -11,7 +16,6 @@
 
 #define POOL_TAG_VMM_STATE         'smmv'
 #define POOL_TAG_DRIVER_STATE      'dsds'
-#define POOL_TAG_VMM_STACK         'kats'
 #define POOL_TAG_DPC_CONTEXT       'ccpd'
 #define POOL_TAG_STATUS_ARRAY      'tats'
 #define POOL_TAG_EPT_POINTER       'ptpe'
@@ -27,15 +31,16 @@
 #define INLINE inline
 #define EXTERN extern
 
-#define VMX_HYPERCALL_TERMINATE_VMX 0ull
-#define VMX_HYPERCALL_PING          1ull
+#define VMX_HYPERCALL_TERMINATE_VMX  0ull
+#define VMX_HYPERCALL_PING           1ull
+#define VMX_HYPERCALL_SET_SAMPLING   2ull
+#define VMX_HYPERCALL_INVALIDATE_EPT 3ull
+#define VMX_HYPERCALL_FREEZE         4ull
 
 #define VMCS_HOST_SELECTOR_MASK 0xF8
 
 #define CLEAR_CR3_RESERVED_BIT(value) ((value) & ~(1ull << 63))
 
-#define VMX_HOST_STACK_SIZE 0x8000
-
 #define VMX_STATUS_OK                         0
 #define VMX_STATUS_OPERATION_FAILED           1
 #define VMX_STATUS_OPERATION_FAILED_NO_STATUS 2
@@ -0,0 +1,260 @@
+#include "cond.h"
+
+#define COND_DEPTH_UNSEEN -1
+
+/*
+ * Records the stack depth on entry to Target, every path into an instruction
+ * has to agree on it.
+ */
+STATIC
+BOOLEAN
+CondMergeDepth(_Inout_ INT32* Depths, _In_ UINT32 Target, _In_ INT32 Depth)
+{
+        if (Depths[Target] == COND_DEPTH_UNSEEN)
+                Depths[Target] = Depth;
+
+        return Depths[Target] == Depth;
+}
+
+/*
+ * As jumps only go forwards, every path into an instruction has been seen by
+ * the time we reach it, so a single pass in order is enough.
+ */
+INT32
+CondVerify(_In_ const COND_PROGRAM* Program)
+{
+        INT32  depths[COND_MAX_INSTRUCTIONS + 1] = {0};
+        UINT32 count                             = Program->instruction_count;
+        INT32  depth                             = 0;
+        INT32  next                              = 0;
+
+        if (!count || count > COND_MAX_INSTRUCTIONS || Program->reserved)
+                return 0;
+
+        for (UINT32 index = 0; index <= count; index++)
+                depths[index] = COND_DEPTH_UNSEEN;
+
+        depths[0] = 0;
+
+        for (UINT32 pc = 0; pc < count; pc++) {
+                const COND_INSTRUCTION* instruction =
+                    &Program->instructions[pc];
+
+                depth = depths[pc];
+
+                /*
+                 * every instruction can be reached by falling through, so
+                 * depth is always known, but never trust that blindly
+                 */
+                if (depth == COND_DEPTH_UNSEEN || instruction->reserved ||
+                    instruction->reserved2)
+                        return pc;
+
+                switch (instruction->opcode) {
+                case COND_OP_CONST:
+                        if (instruction->operand)
+                                return pc;
+
+                        next = depth + 1;
+                        break;
+                case COND_OP_REGISTER:
+                        if (instruction->operand >= COND_REGISTER_COUNT ||
+                            instruction->immediate)
+                                return pc;
+
+                        next = depth + 1;
+                        break;
+                case COND_OP_LOAD:
+                        if (depth < 1 || instruction->immediate ||
+                            (instruction->operand != 1 &&
+                             instruction->operand != 2 &&
+                             instruction->operand != 4 &&
+                             instruction->operand != 8))
+                                return pc;
+
+                        next = depth;
+                        break;
+                case COND_OP_ADD:
+                case COND_OP_SUB:
+                case COND_OP_MUL:
+                case COND_OP_AND:
+                case COND_OP_OR:
+                case COND_OP_XOR:
+                case COND_OP_SHL:
+                case COND_OP_SHR:
+                case COND_OP_EQ:
+                case COND_OP_NE:
+                case COND_OP_LT:
+                case COND_OP_LE:
+                case COND_OP_GT:
+                case COND_OP_GE:
+                        if (depth < 2 || instruction->operand ||
+                            instruction->immediate)
+                                return pc;
+
+                        next = depth - 1;
+                        break;
+                case COND_OP_TEST:
+                        if (depth < 1 || instruction->operand ||
+                            instruction->immediate)
+                                return pc;
+
+                        next = depth;
+                        break;
+                case COND_OP_JZ:
+                case COND_OP_JNZ:
+                        if (depth < 1 || instruction->operand ||
+                            instruction->immediate > count - pc - 1)
+                                return pc;
+
+                        /* taken, the value stays on the stack */
+                        if (!CondMergeDepth(depths,
+                                            pc + 1 +
+                                                (UINT32)instruction->immediate,
+                                            depth))
+                                return pc;
+
+                        next = depth - 1;
+                        break;
+                default: return pc;
+                }
+
+                if (next > COND_MAX_STACK ||
+                    !CondMergeDepth(depths, pc + 1, next))
+                        return pc;
+        }
+
+        if (depths[count] != 1)
+                return count;
+
+        return -1;
+}
+
+COND_RESULT
+CondEvaluateValue(_In_ const COND_PROGRAM* Program,
+                  _In_ const UINT64*       Registers,
+                  _In_ COND_READ_ROUTINE   Read,
+                  _In_opt_ VOID*           ReadContext,
+                  _Out_ UINT64*            Value)
+{
+        UINT64 stack[COND_MAX_STACK] = {0};
+        UINT32 top                   = 0;
+        UINT64 left                  = 0;
+        UINT64 right                 = 0;
+
+        *Value = 0;
+
+        for (UINT32 pc = 0; pc < Program->instruction_count; pc++) {
+                const COND_INSTRUCTION* instruction =
+                    &Program->instructions[pc];
+
+                switch (instruction->opcode) {
+                case COND_OP_CONST:
+                        stack[top++] = instruction->immediate;
+                        continue;
+                case COND_OP_REGISTER:
+                        stack[top++] = Registers[instruction->operand];
+                        continue;
+                case COND_OP_LOAD:
+                        right = 0;
+
+                        if (!Read(ReadContext,
+                                  stack[top - 1],
+                                  instruction->operand,
+                                  &right))
+                                return COND_RESULT_FAULT;
+
+                        stack[top - 1] = right;
+                        continue;
+                case COND_OP_TEST:
+                        stack[top - 1] = stack[top - 1] != 0;
+                        continue;
+                case COND_OP_JZ:
+                        if (stack[top - 1])
+                                top--;
+                        else
+                                pc += (UINT32)instruction->immediate;
+
+                        continue;
+                case COND_OP_JNZ:
+                        if (!stack[top - 1])
+                                top--;
+                        else
+                                pc += (UINT32)instruction->immediate;
+
+                        continue;
+                default: break;
+                }
+
+                right = stack[--top];
+                left  = stack[top - 1];
+
+                switch (instruction->opcode) {
+                case COND_OP_ADD: left += right; break;
+                case COND_OP_SUB: left -= right; break;
+                case COND_OP_MUL: left *= right; break;
+                case COND_OP_AND: left &= right; break;
+                case COND_OP_OR: left |= right; break;
+                case COND_OP_XOR: left ^= right; break;
+                case COND_OP_SHL: left <<= right & 63; break;
+                case COND_OP_SHR: left >>= right & 63; break;
+                case COND_OP_EQ: left = left == right; break;
+                case COND_OP_NE: left = left != right; break;
+                case COND_OP_LT: left = left < right; break;
+                case COND_OP_LE: left = left <= right; break;
+                case COND_OP_GT: left = left > right; break;
+                case COND_OP_GE: left = left >= right; break;
+                default: break;
+                }
+
+                stack[top - 1] = left;
+        }
+
+        *Value = stack[0];
+        return COND_RESULT_TRUE;
+}
+
+COND_RESULT
+CondEvaluate(_In_ const COND_PROGRAM* Program,
+             _In_ const UINT64*       Registers,
+             _In_ COND_READ_ROUTINE   Read,
+             _In_opt_ VOID*           ReadContext)
+{
+        UINT64 value = 0;
+
+        if (CondEvaluateValue(Program, Registers, Read, ReadContext, &value) ==
+            COND_RESULT_FAULT)
+                return COND_RESULT_FAULT;
+
+        return value ? COND_RESULT_TRUE : COND_RESULT_FALSE;
+}
+
+#if defined(_KERNEL_MODE)
+
+/*
+ * Like LogSample this relies on the host cr3 mapping the same kernel half as
+ * the guest, so only kernel addresses can be read, and only if both ends are
+ * resident. Nothing stops another core paging the memory out between the
+ * check and the copy, so conditions are meant for nonpaged data, which is
+ * where anything worth testing at a breakpoint tends to live anyway.
+ */
+BOOLEAN
+CondReadKernel(_In_opt_ VOID* Context,
+               _In_ UINT64    Address,
+               _In_ UINT32    Size,
+               _Out_ UINT64*  Value)
+{
+        UNREFERENCED_PARAMETER(Context);
+
+        if (Address < (UINT64)MmSystemRangeStart || Address + Size < Address)
+                return FALSE;
+
+        if (!MmIsAddressValid((PVOID)Address) ||
+            !MmIsAddressValid((PVOID)(Address + Size - 1)))
+                return FALSE;
+
+        RtlCopyMemory(Value, (PVOID)Address, Size);
+        return TRUE;
+}
+
+#endif
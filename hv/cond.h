@@ -0,0 +1,188 @@
+#ifndef COND_H
+#define COND_H
+
+/*
+ * Breakpoint conditions, evaluated in VMX root on every hit so that a hit
+ * whose condition is false is never counted, see ept.c.
+ *
+ * A condition is a short program for a stack machine over 64 bit values. It
+ * can read the guests general purpose registers, rip and rflags, and guest
+ * memory through a callback supplied by the caller. Programs are compiled from
+ * expressions in user mode (see tools/condcompile.h) and must pass
+ * CondVerify before the driver will run them. A verified program:
+ *
+ *   - only jumps forwards, so it runs at most instruction_count instructions
+ *   - never underflows the stack or grows it past COND_MAX_STACK
+ *   - always finishes with exactly one value, the result, on the stack
+ *
+ * which leaves CondEvaluate free of any checks besides the memory reads.
+ *
+ * Like bpindex.h this has no kernel dependencies, see tools/condition.c.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#elif defined(_WIN32)
+#        include <windows.h>
+#else
+#        include <stddef.h>
+#        include <stdint.h>
+typedef uint8_t  UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t  INT32;
+typedef void     VOID;
+typedef UINT8    BOOLEAN;
+#        define _In_
+#        define _Out_
+#        define _Inout_
+#        define _In_opt_
+#endif
+
+#if !defined(_KERNEL_MODE)
+#        define STATIC static
+#endif
+
+#define COND_MAX_INSTRUCTIONS 64
+#define COND_MAX_STACK        16
+
+/*
+ * The first 16 are in instruction encoding order, as is GUEST_CONTEXT, so the
+ * driver can copy them straight across.
+ */
+typedef enum _COND_REGISTER {
+        COND_REGISTER_RAX,
+        COND_REGISTER_RCX,
+        COND_REGISTER_RDX,
+        COND_REGISTER_RBX,
+        COND_REGISTER_RSP,
+        COND_REGISTER_RBP,
+        COND_REGISTER_RSI,
+        COND_REGISTER_RDI,
+        COND_REGISTER_R8,
+        COND_REGISTER_R9,
+        COND_REGISTER_R10,
+        COND_REGISTER_R11,
+        COND_REGISTER_R12,
+        COND_REGISTER_R13,
+        COND_REGISTER_R14,
+        COND_REGISTER_R15,
+        COND_REGISTER_RFLAGS,
+        COND_REGISTER_RIP,
+        COND_REGISTER_COUNT
+
+} COND_REGISTER;
+
+/*
+ * Binary operators pop the right operand and then the left, and push the
+ * result. Comparisons are unsigned and push 1 or 0, shifts only use the low
+ * 6 bits of the count like the processor does.
+ */
+typedef enum _COND_OPCODE {
+        /* push immediate */
+        COND_OP_CONST,
+        /* push register operand */
+        COND_OP_REGISTER,
+        /* pop an address, push the operand byte sized value read from it */
+        COND_OP_LOAD,
+        COND_OP_ADD,
+        COND_OP_SUB,
+        COND_OP_MUL,
+        COND_OP_AND,
+        COND_OP_OR,
+        COND_OP_XOR,
+        COND_OP_SHL,
+        COND_OP_SHR,
+        COND_OP_EQ,
+        COND_OP_NE,
+        COND_OP_LT,
+        COND_OP_LE,
+        COND_OP_GT,
+        COND_OP_GE,
+        /* replace the top of the stack with 1 if it is non zero, else 0 */
+        COND_OP_TEST,
+        /*
+         * If the top of the stack is zero (JZ) or non zero (JNZ), leave it
+         * and skip the next immediate instructions, otherwise pop it. This is
+         * how && and || short circuit.
+         */
+        COND_OP_JZ,
+        COND_OP_JNZ,
+        COND_OP_COUNT
+
+} COND_OPCODE;
+
+typedef struct _COND_INSTRUCTION {
+        UINT8  opcode;
+        /* the register of REGISTER, the width in bytes of LOAD */
+        UINT8  operand;
+        UINT16 reserved;
+        UINT32 reserved2;
+        UINT64 immediate;
+
+} COND_INSTRUCTION, *PCOND_INSTRUCTION;
+
+typedef struct _COND_PROGRAM {
+        UINT32           instruction_count;
+        UINT32           reserved;
+        COND_INSTRUCTION instructions[COND_MAX_INSTRUCTIONS];
+
+} COND_PROGRAM, *PCOND_PROGRAM;
+
+typedef enum _COND_RESULT {
+        COND_RESULT_FALSE,
+        COND_RESULT_TRUE,
+        /* a memory read failed, the condition has no value */
+        COND_RESULT_FAULT
+
+} COND_RESULT;
+
+/*
+ * Reads Size (1, 2, 4 or 8) bytes at Address into the low bytes of Value,
+ * which is zeroed beforehand. Returns FALSE if the memory can't be read,
+ * which faults the evaluation.
+ */
+typedef BOOLEAN (*COND_READ_ROUTINE)(_In_opt_ VOID* Context,
+                                     _In_ UINT64    Address,
+                                     _In_ UINT32    Size,
+                                     _Out_ UINT64*  Value);
+
+/*
+ * Returns -1 if Program passes, otherwise the index of the first offending
+ * instruction, or instruction_count if the program can finish with anything
+ * but a single value on the stack.
+ */
+INT32
+CondVerify(_In_ const COND_PROGRAM* Program);
+
+/* Program must have passed CondVerify. */
+COND_RESULT
+CondEvaluate(_In_ const COND_PROGRAM* Program,
+             _In_ const UINT64*       Registers,
+             _In_ COND_READ_ROUTINE   Read,
+             _In_opt_ VOID*           ReadContext);
+
+/*
+ * As CondEvaluate, but for programs used as an expression rather than a
+ * condition, i.e a step traces memory operand. Returns COND_RESULT_FAULT, or
+ * COND_RESULT_TRUE with the result in Value.
+ */
+COND_RESULT
+CondEvaluateValue(_In_ const COND_PROGRAM* Program,
+                  _In_ const UINT64*       Registers,
+                  _In_ COND_READ_ROUTINE   Read,
+                  _In_opt_ VOID*           ReadContext,
+                  _Out_ UINT64*            Value);
+
+#if defined(_KERNEL_MODE)
+
+/* The COND_READ_ROUTINE for VMX root, only reads resident kernel memory. */
+BOOLEAN
+CondReadKernel(_In_opt_ VOID* Context,
+               _In_ UINT64    Address,
+               _In_ UINT32    Size,
+               _Out_ UINT64*  Value);
+
+#endif
+
+#endif
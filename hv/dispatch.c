@@ -2,12 +2,16 @@
 
 #include "vmx.h"
 #include "vmcs.h"
-#include <intrin.h>
 #include "arch.h"
 #include "log.h"
+#include "topology.h"
+#include "hw.h"
+#include "ept.h"
+#include "freeze.h"
+#include "step.h"
 
 #define CPUID_HYPERVISOR_INTERFACE_VENDOR 0x40000000
-#define CPUID_HYPERVISOR_INTERFACE_LOL    0x40000001
+#define CPUID_HYPERVISOR_INTERFACE_CORES  0x40000001
 
 #define VMX_CPUID_FUNCTION_LOW  0x40000000
 #define VMX_CPUID_FUNCTION_HIGH 0x400000FF
@@ -17,7 +21,9 @@
 #define CPUID_ECX 2
 #define CPUID_EDX 3
 
-#define VMX_BUGCHECK_INVALID_MTF_EXIT 0x0
+#define VMX_BUGCHECK_INVALID_MTF_EXIT         0x0
+#define VMX_BUGCHECK_UNEXPECTED_EPT_VIOLATION 0x1
+#define VMX_BUGCHECK_EPT_MISCONFIGURATION     0x2
 
 FORCEINLINE
 STATIC
@@ -144,38 +150,42 @@ ProbeGuestCurrentProtectionLevel()
 FORCEINLINE
 STATIC
 VOID
-InjectHardwareException(_In_ UINT8 Vector, _In_ UINT8 DeliverErrorCode)
+InjectHardwareException(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                        _In_ UINT8                  Vector,
+                        _In_ UINT8                  DeliverErrorCode)
 {
         VMENTRY_INTERRUPT_INFORMATION gp = {0};
         gp.DeliverErrorCode              = DeliverErrorCode;
         gp.InterruptionType              = HardwareException;
         gp.Valid                         = TRUE;
         gp.Vector                        = Vector;
-        VmxVmWrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, gp.AsUInt);
+        VmcsControlWrite(&Vcpu->controls,
+                         VMCS_CONTROL_ENTRY_INTERRUPTION_INFORMATION,
+                         gp.AsUInt);
 }
 
 FORCEINLINE
 STATIC
 VOID
-InjectGuestWithUdFault()
+InjectGuestWithUdFault(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        InjectHardwareException(InvalidOpcode, FALSE);
+        InjectHardwareException(Vcpu, InvalidOpcode, FALSE);
 }
 
 FORCEINLINE
 STATIC
 VOID
-InjectGuestWithGpFault()
+InjectGuestWithGpFault(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        InjectHardwareException(GeneralProtection, FALSE);
+        InjectHardwareException(Vcpu, GeneralProtection, FALSE);
 }
 
 FORCEINLINE
 STATIC
 VOID
-InjectGuestWithDbFault()
+InjectGuestWithDbFault(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        InjectHardwareException(Debug, FALSE);
+        InjectHardwareException(Vcpu, Debug, FALSE);
 }
 
 FORCEINLINE
@@ -200,11 +210,11 @@ HandleNotImplementedExit(_In_opt_ UINT64 BugCheckParameter1,
 FORCEINLINE
 STATIC
 VOID
-DispatchExitReasonMovToCr(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
+DispatchExitReasonMovToCr(_In_ PVIRTUAL_MACHINE_STATE         Vcpu,
+                          _In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
                           _In_ PGUEST_CONTEXT                 Context)
 {
-        PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[KeGetCurrentProcessorNumber()];
-        UINT64                 value = RetrieveValueInContextRegister(
+        UINT64 value = RetrieveValueInContextRegister(
             Context, Qualification->GeneralPurposeRegister);
 
         switch (Qualification->ControlRegister) {
@@ -215,27 +225,27 @@ DispatchExitReasonMovToCr(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
                 /* Setting any of the CR4 reserved bits causes a #GP */
                 if (cr0.Fields.Reserved1 || cr0.Fields.Reserved2 ||
                     cr0.Fields.Reserved3 || cr0.Fields.Reserved4) {
-                        InjectGuestWithGpFault();
+                        InjectGuestWithGpFault(Vcpu);
                         return;
                 }
 
                 /* Clearing the PG bit in 64 bit mode causes a #GP */
                 if (!cr0.Fields.PagingEnable) {
-                        InjectGuestWithGpFault();
+                        InjectGuestWithGpFault(Vcpu);
                         return;
                 }
 
                 /* Setting the PagingEnable bit with ProtectionEnable
                  * bit not set raises #GP */
                 if (cr0.Fields.PagingEnable && !cr0.Fields.ProtectionEnable) {
-                        InjectGuestWithGpFault();
+                        InjectGuestWithGpFault(Vcpu);
                         return;
                 }
 
                 /* Setting the CacheDisable flag while the
                  * NotWriteThrough flag is set raises #GP */
                 if (!cr0.Fields.CacheDisable && cr0.Fields.NotWriteThrough) {
-                        InjectGuestWithGpFault();
+                        InjectGuestWithGpFault(Vcpu);
                         return;
                 }
 
@@ -250,17 +260,17 @@ DispatchExitReasonMovToCr(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
 
                 /* Setting reserved bits raises #GP */
                 if (cr4.Reserved1 || cr4.Reserved2) {
-                        InjectGuestWithGpFault();
+                        InjectGuestWithGpFault(Vcpu);
                         return;
                 }
 
                 VmxVmWrite(VMCS_GUEST_CR4, value);
                 VmxVmWrite(VMCS_CTRL_CR4_READ_SHADOW, value);
-        case VMX_EXIT_QUALIFICATION_REGISTER_CR8: __writecr8(value);
+        case VMX_EXIT_QUALIFICATION_REGISTER_CR8: HwWriteCr8(value);
 #if APIC
                 /* again, for now this must be done... */
                 __write_vapic_32(
-                    vcpu->virtual_apic_va, IA32_X2APIC_TPR, (UINT32)value << 4);
+                    Vcpu->virtual_apic_va, IA32_X2APIC_TPR, (UINT32)value << 4);
 #endif
                 return;
         default: return;
@@ -273,11 +283,11 @@ DispatchExitReasonMovToCr(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
  */
 STATIC
 VOID
-DispatchExitReasonMovFromCr(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
+DispatchExitReasonMovFromCr(_In_ PVIRTUAL_MACHINE_STATE         Vcpu,
+                            _In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
                             _In_ PGUEST_CONTEXT                 Context)
 {
-        PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[KeGetCurrentProcessorNumber()];
-        UINT32                 tpr  = 0;
+        UINT32 tpr = 0;
 
         switch (Qualification->ControlRegister) {
         case VMX_EXIT_QUALIFICATION_REGISTER_CR0:
@@ -300,7 +310,7 @@ DispatchExitReasonMovFromCr(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
                 break;
         case VMX_EXIT_QUALIFICATION_REGISTER_CR8:;
 #if APIC
-                tpr = __read_vapic_32(vcpu->virtual_apic_va, IA32_X2APIC_TPR);
+                tpr = __read_vapic_32(Vcpu->virtual_apic_va, IA32_X2APIC_TPR);
 
                 WriteValueInContextRegister(
                     Context, Qualification->GeneralPurposeRegister, tpr >> 4);
@@ -308,7 +318,7 @@ DispatchExitReasonMovFromCr(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
                 WriteValueInContextRegister(
                     Context,
                     Qualification->GeneralPurposeRegister,
-                    __readcr8());
+                    HwReadCr8());
 #endif
                 break;
         default: break;
@@ -326,7 +336,8 @@ DispatchExitReasonMovFromCr(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
  */
 STATIC
 VOID
-DispatchExitReasonCLTS(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
+DispatchExitReasonCLTS(_In_ PVIRTUAL_MACHINE_STATE         Vcpu,
+                       _In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
                        _In_ PGUEST_CONTEXT                 Context)
 {
         CR0 cr0                 = {0};
@@ -334,7 +345,7 @@ DispatchExitReasonCLTS(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
         cr0.Fields.TaskSwitched = FALSE;
 
         if (ProbeGuestCurrentProtectionLevel() != CPL_KERNEL) {
-                InjectGuestWithGpFault();
+                InjectGuestWithGpFault(Vcpu);
                 return;
         }
 
@@ -344,25 +355,26 @@ DispatchExitReasonCLTS(_In_ VMX_EXIT_QUALIFICATION_MOV_CR* Qualification,
 
 STATIC
 BOOLEAN
-DispatchExitReasonControlRegisterAccess(_In_ PGUEST_CONTEXT Context)
+DispatchExitReasonControlRegisterAccess(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                                        _In_ PGUEST_CONTEXT         Context)
 {
         VMX_EXIT_QUALIFICATION_MOV_CR qualification = {0};
         qualification.AsUInt = VmxVmRead(VMCS_EXIT_QUALIFICATION);
 
         if (ProbeGuestCurrentProtectionLevel() != CPL_KERNEL) {
-                InjectGuestWithGpFault();
+                InjectGuestWithGpFault(Vcpu);
                 return FALSE;
         }
 
         switch (qualification.AccessType) {
         case VMX_EXIT_QUALIFICATION_ACCESS_MOV_TO_CR:
-                DispatchExitReasonMovToCr(&qualification, Context);
+                DispatchExitReasonMovToCr(Vcpu, &qualification, Context);
                 break;
         case VMX_EXIT_QUALIFICATION_ACCESS_MOV_FROM_CR:
-                DispatchExitReasonMovFromCr(&qualification, Context);
+                DispatchExitReasonMovFromCr(Vcpu, &qualification, Context);
                 break;
         case VMX_EXIT_QUALIFICATION_ACCESS_CLTS:
-                DispatchExitReasonCLTS(&qualification, Context);
+                DispatchExitReasonCLTS(Vcpu, &qualification, Context);
                 break;
         case VMX_EXIT_QUALIFICATION_ACCESS_LMSW: break;
         default: break;
@@ -409,38 +421,46 @@ IsCpuidFunctionAtHypervisorAltitude(_In_ UINT64 Rax)
 FORCEINLINE
 STATIC
 VOID
-DispatchExitReasonCPUID(_In_ PGUEST_CONTEXT GuestState)
+DispatchExitReasonCPUID(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                        _In_ PGUEST_CONTEXT         GuestState)
 {
         /* todo: implement some sort of caching mechanism */
-        PVIRTUAL_MACHINE_STATE state =
-            &vmm_state[KeGetCurrentProcessorNumber()];
-
         if (IsCpuidFunctionAtHypervisorAltitude(GuestState->rax)) {
                 switch (GuestState->rax) {
                 case CPUID_HYPERVISOR_INTERFACE_VENDOR:
-                        state->cache.cpuid.value[CPUID_EAX] = 'i';
-                        state->cache.cpuid.value[CPUID_EBX] = 'evol';
-                        state->cache.cpuid.value[CPUID_ECX] = 'trof';
-                        state->cache.cpuid.value[CPUID_EDX] = 'etin';
+                        Vcpu->cache.cpuid.value[CPUID_EAX] = 'i';
+                        Vcpu->cache.cpuid.value[CPUID_EBX] = 'evol';
+                        Vcpu->cache.cpuid.value[CPUID_ECX] = 'trof';
+                        Vcpu->cache.cpuid.value[CPUID_EDX] = 'etin';
+                        break;
+                /*
+                 * Only virtualised cores ever get here, so a guest can tell
+                 * which cores are excluded by where this leaf is answered.
+                 */
+                case CPUID_HYPERVISOR_INTERFACE_CORES:
+                        Vcpu->cache.cpuid.value[CPUID_EAX] = Vcpu->cold.index;
+                        Vcpu->cache.cpuid.value[CPUID_EBX] =
+                            VmxVirtualisedCoreCount();
+                        Vcpu->cache.cpuid.value[CPUID_ECX] =
+                            TopologyVcpuCount();
+                        Vcpu->cache.cpuid.value[CPUID_EDX] = 0;
                         break;
                 default:
-#if DEBUG
-                        HIGH_IRQL_LOG_SAFE(
-                            "Invalid HV CPUID Function identifier passed.");
-#endif
+                        HIGH_IRQL_LOG_SAFE(Vcpu,
+                                           TRACE_INVALID_HV_CPUID_FUNCTION);
                         break;
                 }
         }
         else {
-                __cpuidex(state->cache.cpuid.value,
+                HwCpuidEx(Vcpu->cache.cpuid.value,
                           (INT32)GuestState->rax,
                           (INT32)GuestState->rcx);
         }
 
-        GuestState->rax = state->cache.cpuid.value[CPUID_EAX];
-        GuestState->rbx = state->cache.cpuid.value[CPUID_EBX];
-        GuestState->rcx = state->cache.cpuid.value[CPUID_ECX];
-        GuestState->rdx = state->cache.cpuid.value[CPUID_EDX];
+        GuestState->rax = Vcpu->cache.cpuid.value[CPUID_EAX];
+        GuestState->rbx = Vcpu->cache.cpuid.value[CPUID_EBX];
+        GuestState->rcx = Vcpu->cache.cpuid.value[CPUID_ECX];
+        GuestState->rdx = Vcpu->cache.cpuid.value[CPUID_EDX];
 }
 
 FORCEINLINE
@@ -454,10 +474,9 @@ DispatchExitReasonWBINVD(_In_ PGUEST_CONTEXT Context)
 FORCEINLINE
 STATIC
 VOID
-DispatchVmCallTerminateVmx()
+DispatchVmCallTerminateVmx(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        PVIRTUAL_MACHINE_STATE state = &vmm_state[KeGetCurrentProcessorIndex()];
-        InterlockedExchange(&state->exit_state.exit_vmx, TRUE);
+        InterlockedExchange(&Vcpu->exit_state.exit_vmx, TRUE);
 }
 
 FORCEINLINE
@@ -468,16 +487,81 @@ DispatchVmCallPing()
         return STATUS_SUCCESS;
 }
 
+/*
+ * Arms or disarms this cores preemption timer for the sampling profiler, see
+ * VmxSetSampling. The timer value is saved on every exit, so it only counts
+ * down while the guest runs and other exits don't restart it.
+ */
+FORCEINLINE
 STATIC
 NTSTATUS
-VmCallDispatcher(_In_ UINT64     HypercallId,
-                 _In_opt_ UINT64 OptionalParameter1,
-                 _In_opt_ UINT64 OptionalParameter2,
-                 _In_opt_ UINT64 OptionalParameter3)
+DispatchVmCallSetSampling(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                          _In_ UINT64                 Ticks,
+                          _In_ UINT64                 Flags)
+{
+        PVCPU_LOG_STATE log = &Vcpu->cold.log_state;
+
+        /* vmcall exits from any cpl, only the kernel may sample the guest */
+        if (ProbeGuestCurrentProtectionLevel() != CPL_KERNEL)
+                return STATUS_ACCESS_DENIED;
+
+        if (!Ticks) {
+                log->sample_ticks = 0;
+                VmcsControlClear(
+                    &Vcpu->controls,
+                    VMCS_CONTROL_PIN_CTLS,
+                    IA32_VMX_PINBASED_CTLS_ACTIVATE_VMX_PREEMPTION_TIMER_FLAG);
+                VmcsControlClear(
+                    &Vcpu->controls,
+                    VMCS_CONTROL_EXIT_CTLS,
+                    IA32_VMX_EXIT_CTLS_SAVE_VMX_PREEMPTION_TIMER_VALUE_FLAG);
+                return STATUS_SUCCESS;
+        }
+
+        /* the guest can vmcall us directly, so don't trust Ticks */
+        if (!log->sample_ring || Ticks > MAXUINT32 ||
+            Ticks < LogSampleMinimumTicks())
+                return STATUS_INVALID_PARAMETER;
+
+        log->sample_ticks = (UINT32)Ticks;
+        log->sample_flags = (UINT32)Flags;
+
+        VmcsControlSet(
+            &Vcpu->controls,
+            VMCS_CONTROL_PIN_CTLS,
+            IA32_VMX_PINBASED_CTLS_ACTIVATE_VMX_PREEMPTION_TIMER_FLAG);
+        VmcsControlSet(
+            &Vcpu->controls,
+            VMCS_CONTROL_EXIT_CTLS,
+            IA32_VMX_EXIT_CTLS_SAVE_VMX_PREEMPTION_TIMER_VALUE_FLAG);
+        VmxVmWrite(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, Ticks);
+        return STATUS_SUCCESS;
+}
+
+STATIC
+NTSTATUS
+VmCallDispatcher(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                 _In_ UINT64                 HypercallId,
+                 _In_opt_ UINT64             OptionalParameter1,
+                 _In_opt_ UINT64             OptionalParameter2,
+                 _In_opt_ UINT64             OptionalParameter3)
 {
         switch (HypercallId) {
-        case VMX_HYPERCALL_TERMINATE_VMX: DispatchVmCallTerminateVmx(); break;
+        case VMX_HYPERCALL_TERMINATE_VMX: DispatchVmCallTerminateVmx(Vcpu); break;
         case VMX_HYPERCALL_PING: return DispatchVmCallPing();
+        case VMX_HYPERCALL_SET_SAMPLING:
+                return DispatchVmCallSetSampling(
+                    Vcpu, OptionalParameter1, OptionalParameter2);
+        case VMX_HYPERCALL_INVALIDATE_EPT:
+                if (EptIsEnabled())
+                        EptInvalidate();
+                break;
+        case VMX_HYPERCALL_FREEZE:
+                if (ProbeGuestCurrentProtectionLevel() != CPL_KERNEL)
+                        return STATUS_ACCESS_DENIED;
+
+                FreezeWorld(Vcpu->cold.index, OptionalParameter1);
+                break;
         default: break;
         }
 
@@ -507,20 +591,20 @@ RestoreGuestStateOnTerminateVmx(PVIRTUAL_MACHINE_STATE State)
          * As with the guest RSP and RIP, we need to restore the guests DEBUGCTL
          * msr.
          */
-        __writemsr(IA32_DEBUGCTL, VmxVmRead(VMCS_GUEST_DEBUGCTL));
+        HwWriteMsr(IA32_DEBUGCTL, VmxVmRead(VMCS_GUEST_DEBUGCTL));
 
         /*
          * Since vmx root operation makes use of the system cr3, we need to
          * ensure we write the value of the guests previous cr3 before the exit
          * took place to ensure they have access to the correct dtb
          */
-        __writecr3(VmxVmRead(VMCS_GUEST_CR3));
+        HwWriteCr3(VmxVmRead(VMCS_GUEST_CR3));
 
         /*
          * Do the same with the FS and GS base
          */
-        __writemsr(IA32_FS_BASE, VmxVmRead(VMCS_GUEST_FS_BASE));
-        __writemsr(IA32_GS_BASE, VmxVmRead(VMCS_GUEST_GS_BASE));
+        HwWriteMsr(IA32_FS_BASE, VmxVmRead(VMCS_GUEST_FS_BASE));
+        HwWriteMsr(IA32_GS_BASE, VmxVmRead(VMCS_GUEST_GS_BASE));
 
         /*
          * Write back the guest gdtr and idtrs
@@ -535,6 +619,12 @@ RestoreGuestStateOnTerminateVmx(PVIRTUAL_MACHINE_STATE State)
         idtr.Limit                          = VmxVmRead(VMCS_GUEST_IDTR_LIMIT);
         __lidt(&idtr);
 
+        /*
+         * Flush the processors copy of the vmcs back to its region, so it can
+         * be reloaded with its controls intact when resuming from sleep.
+         */
+        __vmx_vmclear(&State->cold.vmcs_region_pa);
+
         /*
         Execute the vmxoff instruction, leaving vmx operation
         */
@@ -551,7 +641,8 @@ DispatchExitReasonTprBelowThreshold(_In_ PGUEST_CONTEXT Context)
 }
 
 FORCEINLINE STATIC VOID
-InjectExceptionOnVmEntry(VMEXIT_INTERRUPT_INFORMATION* ExitInterrupt)
+InjectExceptionOnVmEntry(PVIRTUAL_MACHINE_STATE        Vcpu,
+                         VMEXIT_INTERRUPT_INFORMATION* ExitInterrupt)
 {
         VMENTRY_INTERRUPT_INFORMATION intr = {
             .Vector           = ExitInterrupt->Vector,
@@ -565,12 +656,38 @@ InjectExceptionOnVmEntry(VMEXIT_INTERRUPT_INFORMATION* ExitInterrupt)
          * that would've been pushed onto the stack by the exception.
          */
         if (ExitInterrupt->Valid && ExitInterrupt->ErrorCodeValid) {
-                VmxVmWrite(VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE,
-                           VmxVmRead(VMCS_VMEXIT_INTERRUPTION_ERROR_CODE));
+                VmcsControlWrite(
+                    &Vcpu->controls,
+                    VMCS_CONTROL_ENTRY_EXCEPTION_ERROR_CODE,
+                    (UINT32)VmxVmRead(VMCS_VMEXIT_INTERRUPTION_ERROR_CODE));
+        }
+
+        VmcsControlWrite(&Vcpu->controls,
+                         VMCS_CONTROL_ENTRY_INTERRUPTION_INFORMATION,
+                         intr.AsUInt);
+}
+
+/*
+ * Hands an NMI that isn't ours back to the guest. The NMI can arrive in the
+ * shadow of an sti, which some processors refuse to inject into, and as NMIs
+ * ignore that blocking anyway it is cleared first.
+ */
+FORCEINLINE
+STATIC
+VOID
+DispatchReflectNmi(_In_ PVIRTUAL_MACHINE_STATE        Vcpu,
+                   _In_ VMEXIT_INTERRUPT_INFORMATION* ExitInterrupt)
+{
+        VMX_INTERRUPTIBILITY_STATE interruptibility = {
+            .AsUInt = (UINT32)VmxVmRead(VMCS_GUEST_INTERRUPTIBILITY_STATE)};
+
+        if (interruptibility.BlockingBySti) {
+                interruptibility.BlockingBySti = FALSE;
+                VmxVmWrite(VMCS_GUEST_INTERRUPTIBILITY_STATE,
+                           interruptibility.AsUInt);
         }
 
-        VmxVmWrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD,
-                   intr.AsUInt);
+        InjectExceptionOnVmEntry(Vcpu, ExitInterrupt);
 }
 
 /*
@@ -600,20 +717,30 @@ ShouldExceptionAdvanceGuestRip(VMEXIT_INTERRUPT_INFORMATION* ExitInformation)
 FORCEINLINE
 STATIC
 BOOLEAN
-DispatchExitReasonExceptionOrNmi(_In_ PGUEST_CONTEXT Context)
+DispatchExitReasonExceptionOrNmi(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                                 _In_ PGUEST_CONTEXT         Context)
 {
         VMEXIT_INTERRUPT_INFORMATION intr = {
             .AsUInt = VmxVmRead(VMCS_VMEXIT_INTERRUPTION_INFORMATION)};
 
-#if DEBUG
-        HIGH_IRQL_LOG_SAFE("Core: %lx - Vector: %lx, Interruption type: %lx",
-                           KeGetCurrentProcessorNumber(),
-                           intr.Vector,
-                           intr.InterruptionType);
-#endif
+        HIGH_IRQL_LOG_SAFE(Vcpu,
+                           TRACE_EXCEPTION_OR_NMI_EXIT,
+                           (UINT64)intr.Vector,
+                           (UINT64)intr.InterruptionType);
+
+        /* only with NMI exiting, which is there for freeze.c */
+        if (intr.InterruptionType == NonMaskableInterrupt) {
+                if (!FreezeHandleNmiExit(Vcpu->cold.index,
+                                         VmxVmRead(VMCS_GUEST_RIP)))
+                        DispatchReflectNmi(Vcpu, &intr);
+
+                return FALSE;
+        }
 
         switch (intr.Vector) {
-        case EXCEPTION_DIVIDED_BY_ZERO: InjectExceptionOnVmEntry(&intr); break;
+        case EXCEPTION_DIVIDED_BY_ZERO:
+                InjectExceptionOnVmEntry(Vcpu, &intr);
+                break;
         case EXCEPTION_DEBUG:
         case EXCEPTION_NMI:
         case EXCEPTION_INT3:
@@ -634,7 +761,7 @@ DispatchExitReasonExceptionOrNmi(_In_ PGUEST_CONTEXT Context)
         case EXCEPTION_VIRTUALIZATION_FAULT:
         default:
                 HandleNotImplementedExit(
-                    STATUS_NOT_IMPLEMENTED, intr.Vector, NULL, NULL);
+                    STATUS_NOT_IMPLEMENTED, intr.Vector, 0, 0);
         }
 
         return ShouldExceptionAdvanceGuestRip(&intr);
@@ -649,25 +776,54 @@ DispatchExitReasonExceptionOrNmi(_In_ PGUEST_CONTEXT Context)
 FORCEINLINE
 STATIC
 VOID
-DispatchExitReasonMonitorTrapFlag(_In_ PGUEST_CONTEXT Context)
+DispatchExitReasonMonitorTrapFlag(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                                  _In_ PGUEST_CONTEXT         Context)
 {
-        PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[KeGetCurrentProcessorNumber()];
+        IA32_VMX_PROCBASED_CTLS_REGISTER proc    = {
+            .AsUInt = VmcsControlRead(&Vcpu->controls, VMCS_CONTROL_PROC_CTLS)};
+        BOOLEAN                          tracing = FALSE;
+
+        tracing = StepIsTracing(Vcpu->cold.index);
+
         /*
-         * Since we don't set the monitor trap flag vmcs ctrl, lets
-         * simply clear the mtf flag for the guest and continue
-         * execution.
+         * Stepped over an instruction on a breakpoint page. A step trace
+         * takes every instruction on those pages through here too, and keeps
+         * the trap flag set for itself.
          */
-        if (!vcpu->proc_ctls.MonitorTrapFlag) {
+        if (Vcpu->cold.ept_step) {
+                Vcpu->cold.ept_step = FALSE;
+                VmxVmWrite(VMCS_CTRL_EPT_POINTER,
+                           EptGetPointer(EPT_VIEW_BREAKPOINT));
+
+                if (!tracing) {
+                        VmcsControlClear(
+                            &Vcpu->controls,
+                            VMCS_CONTROL_PROC_CTLS,
+                            IA32_VMX_PROCBASED_CTLS_MONITOR_TRAP_FLAG_FLAG);
+                        return;
+                }
+        }
+
+        if (tracing) {
+                if (!StepNext(Vcpu->cold.index, Context))
+                        VmcsControlClear(
+                            &Vcpu->controls,
+                            VMCS_CONTROL_PROC_CTLS,
+                            IA32_VMX_PROCBASED_CTLS_MONITOR_TRAP_FLAG_FLAG);
+                return;
+        }
+
+        if (!proc.MonitorTrapFlag) {
                 RFLAGS flags    = {.AsUInt = Context->rflags};
                 flags.TrapFlag  = FALSE;
                 Context->rflags = flags.AsUInt;
         }
         else {
-                /* For now, just bugcheck */
+                /* nothing of ours sets it besides the above */
                 KeBugCheckEx(VMX_BUGCHECK_INVALID_MTF_EXIT,
                              VmxVmRead(VMCS_GUEST_RIP),
                              Context->rflags,
-                             vcpu->proc_ctls.AsUInt,
+                             proc.AsUInt,
                              0);
         }
 }
@@ -675,24 +831,24 @@ DispatchExitReasonMonitorTrapFlag(_In_ PGUEST_CONTEXT Context)
 FORCEINLINE
 STATIC
 VOID
-DispatchExitReasonWrmsr(_In_ PGUEST_CONTEXT Context)
+DispatchExitReasonWrmsr(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                        _In_ PGUEST_CONTEXT         Context)
 {
-        LARGE_INTEGER          msr  = {0};
-        PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[KeGetCurrentProcessorNumber()];
+        LARGE_INTEGER msr = {0};
 
         if (ProbeGuestCurrentProtectionLevel() != CPL_KERNEL) {
-                InjectGuestWithGpFault();
+                InjectGuestWithGpFault(Vcpu);
                 return;
         }
 
         if (Context->rcx == IA32_X2APIC_TPR) {
-                *(UINT32*)(vcpu->virtual_apic_va + APIC_TASK_PRIORITY) =
+                *(UINT32*)(Vcpu->virtual_apic_va + APIC_TASK_PRIORITY) =
                     (UINT32)Context->rcx << 4;
         }
         else {
                 msr.LowPart  = (UINT32)Context->rax;
                 msr.HighPart = (UINT32)Context->rdx;
-                __writemsr((UINT32)Context->rcx, msr.QuadPart);
+                HwWriteMsr((UINT32)Context->rcx, msr.QuadPart);
         }
 }
 
@@ -710,24 +866,23 @@ IsMsrReadX2Apic(UINT32 Ecx)
 FORCEINLINE
 STATIC
 VOID
-DispatchExitReasonRdmsr(_In_ PGUEST_CONTEXT Context)
+DispatchExitReasonRdmsr(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                        _In_ PGUEST_CONTEXT         Context)
 {
-        LARGE_INTEGER          msr  = {0};
-        PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[KeGetCurrentProcessorNumber()];
+        LARGE_INTEGER msr = {0};
 
         if (ProbeGuestCurrentProtectionLevel() != CPL_KERNEL) {
-                InjectGuestWithGpFault();
+                InjectGuestWithGpFault(Vcpu);
                 return;
         }
 
         if ((UINT32)Context->rcx == IA32_X2APIC_TPR) {
-                Context->rax = 0;
-                (UINT32) Context->rax =
-                    *(UINT32*)(vcpu->virtual_apic_va + APIC_TASK_PRIORITY) >> 4;
+                Context->rax =
+                    *(UINT32*)(Vcpu->virtual_apic_va + APIC_TASK_PRIORITY) >> 4;
                 Context->rdx = 0;
         }
         else {
-                msr.QuadPart = __readmsr((UINT32)Context->rcx);
+                msr.QuadPart = HwReadMsr((UINT32)Context->rcx);
                 Context->rax = msr.LowPart;
                 Context->rdx = msr.HighPart;
         }
@@ -858,9 +1013,9 @@ UpdateDirectionFlagRegister(_Inout_ PUINT64     Output,
                             _In_ UINT32         AccessSize)
 {
         if (Context->rflags & EFLAGS_DIRECTION_FLAG_BIT)
-                (UINT32)* Output -= Repetitions * AccessSize;
+                *Output -= Repetitions * AccessSize;
         else
-                (UINT32)* Output += Repetitions * AccessSize;
+                *Output += Repetitions * AccessSize;
 }
 
 #define KPCR_TSS_BASE_OFFSET 0x008
@@ -889,7 +1044,8 @@ IsIoPortAvailable(_In_ UINT64 GuestKpcr, _In_ UINT64 Port)
 FORCEINLINE
 STATIC
 VOID
-DispatchExitReasonIoInstruction(_In_ PGUEST_CONTEXT Context)
+DispatchExitReasonIoInstruction(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                                _In_ PGUEST_CONTEXT         Context)
 {
         VMX_EXIT_QUALIFICATION_IO_INSTRUCTION qual = {
             .AsUInt = VmxVmRead(VMCS_EXIT_QUALIFICATION)};
@@ -898,7 +1054,7 @@ DispatchExitReasonIoInstruction(_In_ PGUEST_CONTEXT Context)
 
         /* If CPL > IOPL, raise #GP */
         if (ProbeGuestCurrentProtectionLevel() > guest_flags.IoPrivilegeLevel) {
-                InjectGuestWithGpFault();
+                InjectGuestWithGpFault(Vcpu);
                 return;
         }
 
@@ -907,7 +1063,7 @@ DispatchExitReasonIoInstruction(_In_ PGUEST_CONTEXT Context)
          * allowed -> raise #GP
          */
         if (!IsIoPortAvailable(guest_kpcr, qual.PortNumber)) {
-                InjectGuestWithGpFault();
+                InjectGuestWithGpFault(Vcpu);
                 return;
         }
 
@@ -981,7 +1137,8 @@ ReadDebugRegister(_In_ PGUEST_CONTEXT Context, _In_ UINT8 Register)
 FORCEINLINE
 STATIC
 VOID
-DispatchExitReasonDebugRegisterAccess(_In_ PGUEST_CONTEXT Context)
+DispatchExitReasonDebugRegisterAccess(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                                      _In_ PGUEST_CONTEXT         Context)
 {
         VMX_EXIT_QUALIFICATION_MOV_DR qual = {
             .AsUInt = VmxVmRead(VMCS_EXIT_QUALIFICATION)};
@@ -989,7 +1146,7 @@ DispatchExitReasonDebugRegisterAccess(_In_ PGUEST_CONTEXT Context)
         DR7 dr7 = {.AsUInt = VmxVmRead(VMCS_GUEST_DR7)};
 
         if (ProbeGuestCurrentProtectionLevel() != CPL_KERNEL) {
-                InjectGuestWithGpFault();
+                InjectGuestWithGpFault(Vcpu);
                 return;
         }
 
@@ -998,13 +1155,13 @@ DispatchExitReasonDebugRegisterAccess(_In_ PGUEST_CONTEXT Context)
         if (cr4.DebuggingExtensions &&
                 qual.DebugRegister == VMX_EXIT_QUALIFICATION_REGISTER_DR4 ||
             qual.DebugRegister == VMX_EXIT_QUALIFICATION_REGISTER_DR5) {
-                InjectGuestWithUdFault();
+                InjectGuestWithUdFault(Vcpu);
                 return;
         }
 
         /* any dr register access while DR7.GD = 1, raise #DB */
         if (dr7.GeneralDetect) {
-                InjectGuestWithDbFault();
+                InjectGuestWithDbFault(Vcpu);
                 return;
         }
 
@@ -1038,27 +1195,25 @@ DispatchExitReasonDebugRegisterAccess(_In_ PGUEST_CONTEXT Context)
  */
 
 VOID
-LoadHostDebugRegisterState()
+LoadHostDebugRegisterState(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[KeGetCurrentProcessorIndex()];
-        __writedr(DEBUG_DR0, vcpu->debug_state.dr0);
-        __writedr(DEBUG_DR1, vcpu->debug_state.dr1);
-        __writedr(DEBUG_DR2, vcpu->debug_state.dr2);
-        __writedr(DEBUG_DR3, vcpu->debug_state.dr3);
-        __writedr(DEBUG_DR6, vcpu->debug_state.dr6);
-        __writedr(DEBUG_DR7, vcpu->debug_state.dr7);
+        HwWriteDr(DEBUG_DR0, Vcpu->cold.debug_state.dr0);
+        HwWriteDr(DEBUG_DR1, Vcpu->cold.debug_state.dr1);
+        HwWriteDr(DEBUG_DR2, Vcpu->cold.debug_state.dr2);
+        HwWriteDr(DEBUG_DR3, Vcpu->cold.debug_state.dr3);
+        HwWriteDr(DEBUG_DR6, Vcpu->cold.debug_state.dr6);
+        HwWriteDr(DEBUG_DR7, Vcpu->cold.debug_state.dr7);
 }
 
 VOID
-StoreHostDebugRegisterState()
+StoreHostDebugRegisterState(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[KeGetCurrentProcessorIndex()];
-        vcpu->debug_state.dr0       = __readdr(DEBUG_DR0);
-        vcpu->debug_state.dr1       = __readdr(DEBUG_DR1);
-        vcpu->debug_state.dr2       = __readdr(DEBUG_DR2);
-        vcpu->debug_state.dr3       = __readdr(DEBUG_DR3);
-        vcpu->debug_state.dr6       = __readdr(DEBUG_DR6);
-        vcpu->debug_state.dr7       = __readdr(DEBUG_DR7);
+        Vcpu->cold.debug_state.dr0 = HwReadDr(DEBUG_DR0);
+        Vcpu->cold.debug_state.dr1 = HwReadDr(DEBUG_DR1);
+        Vcpu->cold.debug_state.dr2 = HwReadDr(DEBUG_DR2);
+        Vcpu->cold.debug_state.dr3 = HwReadDr(DEBUG_DR3);
+        Vcpu->cold.debug_state.dr6 = HwReadDr(DEBUG_DR6);
+        Vcpu->cold.debug_state.dr7 = HwReadDr(DEBUG_DR7);
 }
 
 FORCEINLINE
@@ -1070,25 +1225,134 @@ DispatchExitReasonVirtualisedEoi(_In_ PGUEST_CONTEXT Context)
         __debugbreak();
 }
 
+/*
+ * The only pages we ever take away access to are the breakpoint pages, and
+ * only execute access, see ept.h. Everything else up to MAXPHYADDR is mapped,
+ * EptInitialise refuses to enable ept otherwise. The instruction is counted if
+ * it is a breakpoint whose condition holds and then run on the execute view
+ * under the monitor trap flag, which brings us back to
+ * DispatchExitReasonMonitorTrapFlag once it has retired.
+ *
+ * If an event is delivered on the entry, the trap is taken at the start of its
+ * handler instead and the instruction faults, and is counted, again later.
+ */
+FORCEINLINE
+STATIC
+VOID
+DispatchExitReasonEptViolation(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                               _In_ PGUEST_CONTEXT         Context)
+{
+        VMX_EXIT_QUALIFICATION_EPT_VIOLATION qualification    = {0};
+        VMX_INTERRUPTIBILITY_STATE           interruptibility = {0};
+        UINT64                               physical         = 0;
+        UINT64                               rip              = 0;
+        UINT32                               flags            = 0;
+
+        qualification.AsUInt = VmxVmRead(VMCS_EXIT_QUALIFICATION);
+        physical             = VmxVmRead(VMCS_GUEST_PHYSICAL_ADDRESS);
+        rip                  = VmxVmRead(VMCS_GUEST_RIP);
+
+        if (!qualification.ExecuteAccess || qualification.ReadAccess ||
+            qualification.WriteAccess)
+                KeBugCheckEx(VMX_BUGCHECK_UNEXPECTED_EPT_VIOLATION,
+                             physical,
+                             qualification.AsUInt,
+                             rip,
+                             0);
+
+        /* the fault unblocked nmis while an iret was returning from one */
+        if (qualification.NmiUnblocking) {
+                interruptibility.AsUInt =
+                    (UINT32)VmxVmRead(VMCS_GUEST_INTERRUPTIBILITY_STATE);
+                interruptibility.BlockingByNmi = TRUE;
+                VmxVmWrite(VMCS_GUEST_INTERRUPTIBILITY_STATE,
+                           interruptibility.AsUInt);
+        }
+
+        /* the other cores are stopped before this one steps over it */
+        if (EptRecordExecute(physical,
+                             rip,
+                             VmxVmRead(VMCS_EXIT_GUEST_LINEAR_ADDRESS),
+                             Context,
+                             &flags)) {
+                if (flags & HV_BREAKPOINT_FLAG_FREEZE)
+                        FreezeWorld(Vcpu->cold.index, 0);
+
+                /* the trace rides on the trap flag set below */
+                if (flags & HV_BREAKPOINT_FLAG_TRACE)
+                        StepBegin(Vcpu->cold.index, Context, rip);
+        }
+
+        Vcpu->cold.ept_step = TRUE;
+        VmxVmWrite(VMCS_CTRL_EPT_POINTER, EptGetPointer(EPT_VIEW_EXECUTE));
+        VmcsControlSet(&Vcpu->controls,
+                       VMCS_CONTROL_PROC_CTLS,
+                       IA32_VMX_PROCBASED_CTLS_MONITOR_TRAP_FLAG_FLAG);
+}
+
+/*
+ * Our tables are only ever identity maps, so this is a bug in building them
+ * rather than anything the guest did.
+ */
+FORCEINLINE
+STATIC
+VOID
+DispatchExitReasonEptMisconfiguration()
+{
+        KeBugCheckEx(VMX_BUGCHECK_EPT_MISCONFIGURATION,
+                     VmxVmRead(VMCS_GUEST_PHYSICAL_ADDRESS),
+                     VmxVmRead(VMCS_CTRL_EPT_POINTER),
+                     VmxVmRead(VMCS_GUEST_RIP),
+                     0);
+}
+
+/*
+ * With the timer value saved on exit, it stays at 0 once expired and would
+ * exit again straight away, so it has to be re-armed on every sample.
+ */
+FORCEINLINE
+STATIC
+VOID
+DispatchExitReasonPreemptionTimer(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        LogSample(Vcpu);
+        VmxVmWrite(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE,
+                   Vcpu->cold.log_state.sample_ticks);
+}
+
+/*
+ * Vcpu is loaded by VmExitHandler from the top of the host stack, see
+ * VmcsWriteHostStateFields. This saves every handler from having to look up
+ * the current vcpu itself.
+ */
 BOOLEAN
-VmExitDispatcher(_In_ PGUEST_CONTEXT Context)
+VmExitDispatcher(_In_ PVIRTUAL_MACHINE_STATE Vcpu, _In_ PGUEST_CONTEXT Context)
 {
-        UINT64                 additional_rip_offset = 0;
-        PVIRTUAL_MACHINE_STATE state = &vmm_state[KeGetCurrentProcessorIndex()];
+        UINT64             additional_rip_offset = 0;
+        UINT32             reason                = 0;
+        PEXIT_TRACE_RECORD record                = NULL;
+        UINT64             accounting_start      = 0;
+
+        accounting_start = LogCr3AccountingBegin(Vcpu);
+        reason           = (UINT32)VmxVmRead(VMCS_EXIT_REASON);
+        record = LogExitRecordBegin(Vcpu, reason, Context);
+        LogExitProfile(Vcpu, reason);
+
+        VmcsControlsOnExit(&Vcpu->controls, &Vcpu->cold.committed_controls);
 
-        switch (VmxVmRead(VMCS_EXIT_REASON)) {
+        switch (reason) {
         case VMX_EXIT_REASON_EXECUTE_CPUID:
-                DispatchExitReasonCPUID(Context);
+                DispatchExitReasonCPUID(Vcpu, Context);
                 break;
         case VMX_EXIT_REASON_EXECUTE_INVD:
                 DispatchExitReasonINVD(Context);
                 break;
         case VMX_EXIT_REASON_EXECUTE_VMCALL:
                 Context->rax = VmCallDispatcher(
-                    Context->rcx, Context->rdx, Context->r8, Context->r9);
+                    Vcpu, Context->rcx, Context->rdx, Context->r8, Context->r9);
                 break;
         case VMX_EXIT_REASON_MOV_CR:
-                if (DispatchExitReasonControlRegisterAccess(Context))
+                if (DispatchExitReasonControlRegisterAccess(Vcpu, Context))
                         goto no_rip_increment;
                 break;
         case VMX_EXIT_REASON_EXECUTE_WBINVD:
@@ -1109,29 +1373,40 @@ VmExitDispatcher(_In_ PGUEST_CONTEXT Context)
          * advanced the guest rip, else we do as normal.
          */
         case VMX_EXIT_REASON_EXCEPTION_OR_NMI:
-                if (!DispatchExitReasonExceptionOrNmi(Context))
+                if (!DispatchExitReasonExceptionOrNmi(Vcpu, Context))
                         goto no_rip_increment;
                 break;
 
         case VMX_EXIT_REASON_MONITOR_TRAP_FLAG:
-                DispatchExitReasonMonitorTrapFlag(Context);
+                DispatchExitReasonMonitorTrapFlag(Vcpu, Context);
                 goto no_rip_increment;
         case VMX_EXIT_REASON_EXECUTE_WRMSR:
-                DispatchExitReasonWrmsr(Context);
+                DispatchExitReasonWrmsr(Vcpu, Context);
                 break;
         case VMX_EXIT_REASON_EXECUTE_RDMSR:
-                DispatchExitReasonRdmsr(Context);
+                DispatchExitReasonRdmsr(Vcpu, Context);
                 break;
         case VMX_EXIT_REASON_EXECUTE_IO_INSTRUCTION:
-                DispatchExitReasonIoInstruction(Context);
+                DispatchExitReasonIoInstruction(Vcpu, Context);
                 break;
         case VMX_EXIT_REASON_MOV_DR:
-                DispatchExitReasonDebugRegisterAccess(Context);
+                DispatchExitReasonDebugRegisterAccess(Vcpu, Context);
                 break;
         case VMX_EXIT_REASON_VIRTUALIZED_EOI:
                 /* EOI induced exits are trap like */
                 DispatchExitReasonVirtualisedEoi(Context);
                 goto no_rip_increment;
+        /* the timer expires between instructions, there is nothing to skip */
+        case VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED:
+                DispatchExitReasonPreemptionTimer(Vcpu);
+                goto no_rip_increment;
+        /* fault like, the instruction is run again once it can be fetched */
+        case VMX_EXIT_REASON_EPT_VIOLATION:
+                DispatchExitReasonEptViolation(Vcpu, Context);
+                goto no_rip_increment;
+        case VMX_EXIT_REASON_EPT_MISCONFIGURATION:
+                DispatchExitReasonEptMisconfiguration();
+                goto no_rip_increment;
         default: break;
         }
 
@@ -1142,17 +1417,29 @@ VmExitDispatcher(_In_ PGUEST_CONTEXT Context)
         IncrementGuestRip();
 
 no_rip_increment:
+        if (record)
+                LogExitRecordEnd(Vcpu, record);
+
+        if (accounting_start)
+                LogCr3AccountingEnd(Vcpu, accounting_start);
+
         /*
          * If we are indeed exiting VMX operation, return TRUE to
          * indicate to our handler that we have indeed exited VMX
          * operation.
          */
-        if (InterlockedExchange(&state->exit_state.exit_vmx,
-                                state->exit_state.exit_vmx)) {
-                RestoreGuestStateOnTerminateVmx(state);
+        if (InterlockedExchange(&Vcpu->exit_state.exit_vmx,
+                                Vcpu->exit_state.exit_vmx)) {
+                RestoreGuestStateOnTerminateVmx(Vcpu);
                 return TRUE;
         }
 
+        /*
+         * Write back whatever controls the handlers changed, this is the only
+         * place they reach the vmcs while the guest is running.
+         */
+        VmcsControlsFlush(&Vcpu->controls, &Vcpu->cold.committed_controls);
+
         /* continue vmx operation as usual */
         return FALSE;
 }
\ No newline at end of file
@@ -6,13 +6,13 @@
 #include "vmx.h"
 
 BOOLEAN
-VmExitDispatcher(_In_ PGUEST_CONTEXT GuestState);
+VmExitDispatcher(_In_ PVIRTUAL_MACHINE_STATE Vcpu, _In_ PGUEST_CONTEXT Context);
 
 VOID
-LoadHostDebugRegisterState();
+LoadHostDebugRegisterState(_In_ PVIRTUAL_MACHINE_STATE Vcpu);
 
 VOID
-StoreHostDebugRegisterState();
+StoreHostDebugRegisterState(_In_ PVIRTUAL_MACHINE_STATE Vcpu);
 
 VOID
 __write_vapic_32(_In_ UINT64 VirtualApicPage,
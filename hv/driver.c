@@ -6,6 +6,16 @@
 
 #include <intrin.h>
 #include "arch.h"
+#include "mm.h"
+#include "log.h"
+#include "ioctl.h"
+#include "cap.h"
+#include "topology.h"
+#include "bench.h"
+#include "hw.h"
+#include "ept.h"
+#include "freeze.h"
+#include "step.h"
 
 UNICODE_STRING device_name = RTL_CONSTANT_STRING(L"\\Device\\hv");
 UNICODE_STRING device_link = RTL_CONSTANT_STRING(L"\\??\\hv-link");
@@ -14,11 +24,666 @@ NTSTATUS
 DeviceClose(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp)
 {
         UNREFERENCED_PARAMETER(DeviceObject);
-        BroadcastVmxTermination();
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
         return Irp->IoStatus.Status;
 }
 
+/*
+ * Cleanup is sent in the context of the process closing its last handle to
+ * the file object, which is where any user mode mappings made through it have
+ * to be torn down.
+ */
+NTSTATUS
+DeviceCleanup(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp)
+{
+        UNREFERENCED_PARAMETER(DeviceObject);
+
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+        LogExportUnmapRings(stack->FileObject);
+
+        Irp->IoStatus.Status      = STATUS_SUCCESS;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return STATUS_SUCCESS;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlQueryVirtualisedCores(_In_ PIRP               Irp,
+                                   _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+        if (Stack->Parameters.DeviceIoControl.OutputBufferLength <
+            sizeof(HV_VIRTUALISED_CORES))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        status = VmxQueryVirtualisedCores(Irp->AssociatedIrp.SystemBuffer);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("VmxQueryVirtualisedCores failed with status %x",
+                            status);
+                return status;
+        }
+
+        Irp->IoStatus.Information = sizeof(HV_VIRTUALISED_CORES);
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlSetCoreState(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS               status  = STATUS_UNSUCCESSFUL;
+        PHV_CORE_STATE_REQUEST request = NULL;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_CORE_STATE_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        request = Irp->AssociatedIrp.SystemBuffer;
+        status  = VmxSetCoreVirtualised(request->core,
+                                       request->virtualise ? TRUE : FALSE);
+
+        if (!NT_SUCCESS(status))
+                DEBUG_ERROR("VmxSetCoreVirtualised failed with status %x",
+                            status);
+
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlSetExitRecording(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS                   status  = STATUS_UNSUCCESSFUL;
+        PHV_EXIT_RECORDING_REQUEST request = NULL;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_EXIT_RECORDING_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        request = Irp->AssociatedIrp.SystemBuffer;
+        status  = LogSetExitRecording(request->enable ? TRUE : FALSE);
+
+        if (!NT_SUCCESS(status))
+                DEBUG_ERROR("LogSetExitRecording failed with status %x",
+                            status);
+
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlReadExitTrace(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS                   status  = STATUS_UNSUCCESSFUL;
+        HV_EXIT_TRACE_READ_REQUEST request = {0};
+        UINT32                     written = 0;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_EXIT_TRACE_READ_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        /* input and output share the system buffer, so copy the input out */
+        RtlCopyMemory(&request,
+                      Irp->AssociatedIrp.SystemBuffer,
+                      sizeof(HV_EXIT_TRACE_READ_REQUEST));
+
+        status = LogReadExitTrace(
+            request.core,
+            request.cursor,
+            Irp->AssociatedIrp.SystemBuffer,
+            Stack->Parameters.DeviceIoControl.OutputBufferLength,
+            &written);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("LogReadExitTrace failed with status %x", status);
+                return status;
+        }
+
+        Irp->IoStatus.Information = written;
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlRunExitBenchmark(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS                  status  = STATUS_UNSUCCESSFUL;
+        HV_EXIT_BENCHMARK_REQUEST request = {0};
+        UINT32                    count   = 0;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_EXIT_BENCHMARK_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        /* input and output share the system buffer, so copy the input out */
+        RtlCopyMemory(&request,
+                      Irp->AssociatedIrp.SystemBuffer,
+                      sizeof(HV_EXIT_BENCHMARK_REQUEST));
+
+        count = (UINT32)min(
+            Stack->Parameters.DeviceIoControl.OutputBufferLength /
+                sizeof(UINT32),
+            HV_EXIT_BENCHMARK_MAX_SAMPLES);
+
+        status = BenchRunExitBenchmark(
+            request.operation, Irp->AssociatedIrp.SystemBuffer, count);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("BenchRunExitBenchmark failed with status %x",
+                            status);
+                return status;
+        }
+
+        Irp->IoStatus.Information = count * sizeof(UINT32);
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlSetExitProfiling(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS                   status  = STATUS_UNSUCCESSFUL;
+        PHV_EXIT_PROFILING_REQUEST request = NULL;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_EXIT_PROFILING_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        request = Irp->AssociatedIrp.SystemBuffer;
+        status  = LogSetExitProfiling(request->enable ? TRUE : FALSE,
+                                     request->reset ? TRUE : FALSE);
+
+        if (!NT_SUCCESS(status))
+                DEBUG_ERROR("LogSetExitProfiling failed with status %x",
+                            status);
+
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlQueryExitHotspots(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS                 status  = STATUS_UNSUCCESSFUL;
+        HV_EXIT_HOTSPOTS_REQUEST request = {0};
+        UINT32                   written = 0;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_EXIT_HOTSPOTS_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        /* input and output share the system buffer, so copy the input out */
+        RtlCopyMemory(&request,
+                      Irp->AssociatedIrp.SystemBuffer,
+                      sizeof(HV_EXIT_HOTSPOTS_REQUEST));
+
+        status = LogQueryExitHotspots(
+            request.core,
+            Irp->AssociatedIrp.SystemBuffer,
+            Stack->Parameters.DeviceIoControl.OutputBufferLength,
+            &written);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("LogQueryExitHotspots failed with status %x",
+                            status);
+                return status;
+        }
+
+        Irp->IoStatus.Information = written;
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlSetCr3Accounting(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS                   status  = STATUS_UNSUCCESSFUL;
+        PHV_CR3_ACCOUNTING_REQUEST request = NULL;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_CR3_ACCOUNTING_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        request = Irp->AssociatedIrp.SystemBuffer;
+        status  = LogSetCr3Accounting(request->enable ? TRUE : FALSE,
+                                     request->reset ? TRUE : FALSE);
+
+        if (!NT_SUCCESS(status))
+                DEBUG_ERROR("LogSetCr3Accounting failed with status %x",
+                            status);
+
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlQueryCr3Accounting(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS status  = STATUS_UNSUCCESSFUL;
+        UINT32   written = 0;
+
+        status = LogQueryCr3Accounting(
+            Irp->AssociatedIrp.SystemBuffer,
+            Stack->Parameters.DeviceIoControl.OutputBufferLength,
+            &written);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("LogQueryCr3Accounting failed with status %x",
+                            status);
+                return status;
+        }
+
+        Irp->IoStatus.Information = written;
+        return status;
+}
+
+/*
+ * Attaching to the process loads its kernel page directory, which is the
+ * value guest cr3 holds while any of its threads run in kernel mode.
+ */
+STATIC
+NTSTATUS
+DispatchIoctlQueryProcessCr3(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS                 status    = STATUS_UNSUCCESSFUL;
+        PEPROCESS                process   = NULL;
+        KAPC_STATE               apc_state = {0};
+        HV_PROCESS_CR3_REQUEST   request   = {0};
+        PHV_PROCESS_CR3_RESPONSE response  = NULL;
+        UINT64                   cr3       = 0;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+                sizeof(HV_PROCESS_CR3_REQUEST) ||
+            Stack->Parameters.DeviceIoControl.OutputBufferLength <
+                sizeof(HV_PROCESS_CR3_RESPONSE))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        /* input and output share the system buffer, so copy the input out */
+        RtlCopyMemory(&request,
+                      Irp->AssociatedIrp.SystemBuffer,
+                      sizeof(HV_PROCESS_CR3_REQUEST));
+
+        status = PsLookupProcessByProcessId(
+            (HANDLE)(ULONG_PTR)request.process_id, &process);
+
+        if (!NT_SUCCESS(status))
+                return status;
+
+        KeStackAttachProcess(process, &apc_state);
+        cr3 = HwReadCr3();
+        KeUnstackDetachProcess(&apc_state);
+        ObDereferenceObject(process);
+
+        response      = Irp->AssociatedIrp.SystemBuffer;
+        response->cr3 = cr3 & ACCOUNTING_CR3_MASK;
+
+        Irp->IoStatus.Information = sizeof(HV_PROCESS_CR3_RESPONSE);
+        return STATUS_SUCCESS;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlSetSampling(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS             status  = STATUS_UNSUCCESSFUL;
+        PHV_SAMPLING_REQUEST request = NULL;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_SAMPLING_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        request = Irp->AssociatedIrp.SystemBuffer;
+        status  = LogSetSampling(request->interval, request->flags);
+
+        if (!NT_SUCCESS(status))
+                DEBUG_ERROR("LogSetSampling failed with status %x", status);
+
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlReadSamples(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS               status  = STATUS_UNSUCCESSFUL;
+        HV_SAMPLE_READ_REQUEST request = {0};
+        UINT32                 written = 0;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_SAMPLE_READ_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        /* input and output share the system buffer, so copy the input out */
+        RtlCopyMemory(&request,
+                      Irp->AssociatedIrp.SystemBuffer,
+                      sizeof(HV_SAMPLE_READ_REQUEST));
+
+        status = LogReadSamples(
+            request.core,
+            request.cursor,
+            Irp->AssociatedIrp.SystemBuffer,
+            Stack->Parameters.DeviceIoControl.OutputBufferLength,
+            &written);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("LogReadSamples failed with status %x", status);
+                return status;
+        }
+
+        Irp->IoStatus.Information = written;
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlSetBreakpoint(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS               status  = STATUS_UNSUCCESSFUL;
+        PHV_BREAKPOINT_REQUEST request = NULL;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_BREAKPOINT_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        request = Irp->AssociatedIrp.SystemBuffer;
+
+        if (request->flags &
+            ~(HV_BREAKPOINT_FLAG_FREEZE | HV_BREAKPOINT_FLAG_TRACE))
+                return STATUS_INVALID_PARAMETER;
+
+        if ((request->flags & HV_BREAKPOINT_FLAG_FREEZE) && !FreezeIsEnabled())
+                return STATUS_NOT_SUPPORTED;
+
+        if ((request->flags & HV_BREAKPOINT_FLAG_TRACE) && !StepIsEnabled())
+                return STATUS_NOT_SUPPORTED;
+
+        status = EptSetBreakpoint(
+            request->address, request->enable != 0, request->flags);
+
+        if (!NT_SUCCESS(status))
+                DEBUG_ERROR("EptSetBreakpoint failed with status %x", status);
+
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlSetBreakpointCondition(_In_ PIRP               Irp,
+                                    _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS                         status  = STATUS_UNSUCCESSFUL;
+        PHV_BREAKPOINT_CONDITION_REQUEST request = NULL;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_BREAKPOINT_CONDITION_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        request = Irp->AssociatedIrp.SystemBuffer;
+        status =
+            EptSetBreakpointCondition(request->address, &request->program);
+
+        if (!NT_SUCCESS(status))
+                DEBUG_ERROR("EptSetBreakpointCondition failed with status %x",
+                            status);
+
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlQueryBreakpoints(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS        status   = STATUS_UNSUCCESSFUL;
+        PHV_BREAKPOINTS response = Irp->AssociatedIrp.SystemBuffer;
+        UINT32          length   = 0;
+        UINT32          capacity = 0;
+
+        length = Stack->Parameters.DeviceIoControl.OutputBufferLength;
+
+        if (length < HV_BREAKPOINTS_SIZE(0))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        capacity = (UINT32)((length - HV_BREAKPOINTS_SIZE(0)) /
+                            sizeof(HV_BREAKPOINT));
+        status   = EptQueryBreakpoints(response, capacity);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("EptQueryBreakpoints failed with status %x",
+                            status);
+                return status;
+        }
+
+        Irp->IoStatus.Information =
+            (ULONG_PTR)HV_BREAKPOINTS_SIZE(response->breakpoint_count);
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlFreeze(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS           status  = STATUS_UNSUCCESSFUL;
+        PHV_FREEZE_REQUEST request = NULL;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_FREEZE_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        request = Irp->AssociatedIrp.SystemBuffer;
+
+        if (request->hold_cycles > HV_FREEZE_MAX_HOLD_CYCLES)
+                return STATUS_INVALID_PARAMETER;
+
+        if (!FreezeIsEnabled())
+                return STATUS_NOT_SUPPORTED;
+
+        status = VmxFreezeWorld(request->hold_cycles);
+
+        if (!NT_SUCCESS(status))
+                DEBUG_ERROR("VmxFreezeWorld failed with status %x", status);
+
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlQueryFreeze(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS              status   = STATUS_UNSUCCESSFUL;
+        PHV_FREEZE_STATISTICS response = Irp->AssociatedIrp.SystemBuffer;
+        UINT32                length   = 0;
+        UINT32                capacity = 0;
+
+        length = Stack->Parameters.DeviceIoControl.OutputBufferLength;
+
+        if (length < HV_FREEZE_STATISTICS_SIZE(0))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        capacity = (UINT32)((length - HV_FREEZE_STATISTICS_SIZE(0)) /
+                            sizeof(HV_FREEZE_CORE));
+        status   = FreezeQueryStatistics(response, capacity);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("FreezeQueryStatistics failed with status %x",
+                            status);
+                return status;
+        }
+
+        Irp->IoStatus.Information =
+            (ULONG_PTR)HV_FREEZE_STATISTICS_SIZE(response->core_count);
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlSetStepTrace(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS               status  = STATUS_UNSUCCESSFUL;
+        PHV_STEP_TRACE_REQUEST request = NULL;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_STEP_TRACE_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        request = Irp->AssociatedIrp.SystemBuffer;
+        status  = StepSetTrace(request);
+
+        if (!NT_SUCCESS(status))
+                DEBUG_ERROR("StepSetTrace failed with status %x", status);
+
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlReadStepTrace(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS                   status  = STATUS_UNSUCCESSFUL;
+        HV_STEP_TRACE_READ_REQUEST request = {0};
+        UINT32                     written = 0;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_STEP_TRACE_READ_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        /* input and output share the system buffer, so copy the input out */
+        RtlCopyMemory(&request,
+                      Irp->AssociatedIrp.SystemBuffer,
+                      sizeof(HV_STEP_TRACE_READ_REQUEST));
+
+        status = StepReadTrace(
+            request.core,
+            request.cursor,
+            Irp->AssociatedIrp.SystemBuffer,
+            Stack->Parameters.DeviceIoControl.OutputBufferLength,
+            &written);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("StepReadTrace failed with status %x", status);
+                return status;
+        }
+
+        Irp->IoStatus.Information = written;
+        return status;
+}
+
+STATIC
+NTSTATUS
+DispatchIoctlMapLogRings(_In_ PIRP Irp, _In_ PIO_STACK_LOCATION Stack)
+{
+        NTSTATUS           status  = STATUS_UNSUCCESSFUL;
+        HV_LOG_MAP_REQUEST request = {0};
+        UINT32             written = 0;
+
+        if (Stack->Parameters.DeviceIoControl.InputBufferLength <
+            sizeof(HV_LOG_MAP_REQUEST))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        /* input and output share the system buffer, so copy the input out */
+        RtlCopyMemory(&request,
+                      Irp->AssociatedIrp.SystemBuffer,
+                      sizeof(HV_LOG_MAP_REQUEST));
+
+        status = LogExportMapRings(
+            Stack->FileObject,
+            (HANDLE)request.event,
+            Irp->AssociatedIrp.SystemBuffer,
+            Stack->Parameters.DeviceIoControl.OutputBufferLength,
+            &written);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("LogExportMapRings failed with status %x", status);
+                return status;
+        }
+
+        Irp->IoStatus.Information = written;
+        return status;
+}
+
+NTSTATUS
+DeviceControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp)
+{
+        UNREFERENCED_PARAMETER(DeviceObject);
+
+        NTSTATUS           status = STATUS_UNSUCCESSFUL;
+        PIO_STACK_LOCATION stack  = IoGetCurrentIrpStackLocation(Irp);
+
+        Irp->IoStatus.Information = 0;
+
+        switch (stack->Parameters.DeviceIoControl.IoControlCode) {
+        case IOCTL_HV_MAP_LOG_RINGS:
+                status = DispatchIoctlMapLogRings(Irp, stack);
+                break;
+        case IOCTL_HV_UNMAP_LOG_RINGS:
+                status = LogExportUnmapRings(stack->FileObject);
+                break;
+        case IOCTL_HV_QUERY_VIRTUALISED_CORES:
+                status = DispatchIoctlQueryVirtualisedCores(Irp, stack);
+                break;
+        case IOCTL_HV_SET_CORE_STATE:
+                status = DispatchIoctlSetCoreState(Irp, stack);
+                break;
+        case IOCTL_HV_SET_EXIT_RECORDING:
+                status = DispatchIoctlSetExitRecording(Irp, stack);
+                break;
+        case IOCTL_HV_READ_EXIT_TRACE:
+                status = DispatchIoctlReadExitTrace(Irp, stack);
+                break;
+        case IOCTL_HV_RUN_EXIT_BENCHMARK:
+                status = DispatchIoctlRunExitBenchmark(Irp, stack);
+                break;
+        case IOCTL_HV_SET_EXIT_PROFILING:
+                status = DispatchIoctlSetExitProfiling(Irp, stack);
+                break;
+        case IOCTL_HV_QUERY_EXIT_HOTSPOTS:
+                status = DispatchIoctlQueryExitHotspots(Irp, stack);
+                break;
+        case IOCTL_HV_SET_CR3_ACCOUNTING:
+                status = DispatchIoctlSetCr3Accounting(Irp, stack);
+                break;
+        case IOCTL_HV_QUERY_CR3_ACCOUNTING:
+                status = DispatchIoctlQueryCr3Accounting(Irp, stack);
+                break;
+        case IOCTL_HV_QUERY_PROCESS_CR3:
+                status = DispatchIoctlQueryProcessCr3(Irp, stack);
+                break;
+        case IOCTL_HV_SET_SAMPLING:
+                status = DispatchIoctlSetSampling(Irp, stack);
+                break;
+        case IOCTL_HV_READ_SAMPLES:
+                status = DispatchIoctlReadSamples(Irp, stack);
+                break;
+        case IOCTL_HV_SET_BREAKPOINT:
+                status = DispatchIoctlSetBreakpoint(Irp, stack);
+                break;
+        case IOCTL_HV_QUERY_BREAKPOINTS:
+                status = DispatchIoctlQueryBreakpoints(Irp, stack);
+                break;
+        case IOCTL_HV_SET_BREAKPOINT_CONDITION:
+                status = DispatchIoctlSetBreakpointCondition(Irp, stack);
+                break;
+        case IOCTL_HV_FREEZE: status = DispatchIoctlFreeze(Irp, stack); break;
+        case IOCTL_HV_QUERY_FREEZE:
+                status = DispatchIoctlQueryFreeze(Irp, stack);
+                break;
+        case IOCTL_HV_SET_STEP_TRACE:
+                status = DispatchIoctlSetStepTrace(Irp, stack);
+                break;
+        case IOCTL_HV_READ_STEP_TRACE:
+                status = DispatchIoctlReadStepTrace(Irp, stack);
+                break;
+        default: status = STATUS_INVALID_DEVICE_REQUEST; break;
+        }
+
+        Irp->IoStatus.Status = status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+}
+
 NTSTATUS
 DeviceCreate(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp)
 {
@@ -34,14 +699,16 @@ DriverUnload(_In_ PDRIVER_OBJECT DriverObject)
         /* if this fails... Who cares!  xD*/
         BroadcastVmxTermination();
         UnregisterPowerCallback();
+        StepFree();
+        FreezeFree();
+        EptFree();
+        EptPoolFree();
         FreeGlobalDriverState();
 }
 
 NTSTATUS
 DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
 {
-        UNREFERENCED_PARAMETER(RegistryPath);
-
         NTSTATUS status = STATUS_SUCCESS;
 
         status = AllocateDriverState();
@@ -52,11 +719,73 @@ DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
                 return status;
         }
 
+        status = EptPoolInitialise();
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("EptPoolInitialise failed with status %x", status);
+                FreeGlobalDriverState();
+                return status;
+        }
+
+        LogExportInitialise();
+
+        status = CapInitialise();
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("CapInitialise failed with status %x", status);
+                EptPoolFree();
+                FreeGlobalDriverState();
+                return status;
+        }
+
+        /* breakpoints are the only thing that needs ept, so carry on without */
+        status = EptInitialise();
+
+        if (NT_SUCCESS(status))
+                CapEnableTemplateFlags(CAP_TEMPLATE_EPT);
+        else
+                DEBUG_LOG("EptInitialise failed with status %x, breakpoints "
+                          "are disabled.",
+                          status);
+
+        status = TopologyReadExclusions(RegistryPath);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("TopologyReadExclusions failed with status %x",
+                            status);
+                EptFree();
+                EptPoolFree();
+                FreeGlobalDriverState();
+                return status;
+        }
+
+        /* the same goes for stopping the world, which needs nmi exiting */
+        status = FreezeInitialise();
+
+        if (NT_SUCCESS(status))
+                CapEnableTemplateFlags(CAP_TEMPLATE_NMI);
+        else
+                DEBUG_LOG("FreezeInitialise failed with status %x, stopping "
+                          "the world is disabled.",
+                          status);
+
+        /* and for step traces, which need the monitor trap flag */
+        status = StepInitialise();
+
+        if (!NT_SUCCESS(status))
+                DEBUG_LOG("StepInitialise failed with status %x, step traces "
+                          "are disabled.",
+                          status);
+
         status = InitialisePowerCallback();
 
         if (!NT_SUCCESS(status)) {
                 DEBUG_ERROR("InitialisePowerCallback failed with status %x",
                             status);
+                StepFree();
+                FreezeFree();
+                EptFree();
+                EptPoolFree();
                 FreeGlobalDriverState();
                 return status;
         }
@@ -66,6 +795,10 @@ DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
         if (!NT_SUCCESS(status)) {
                 DEBUG_ERROR("SetupVmxOperation failed with status %x", status);
                 UnregisterPowerCallback();
+                StepFree();
+                FreezeFree();
+                EptFree();
+                EptPoolFree();
                 FreeGlobalDriverState();
                 return status;
         }
@@ -83,6 +816,10 @@ DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
                 BroadcastVmxTermination();
                 FreeVmxState();
                 UnregisterPowerCallback();
+                StepFree();
+                FreezeFree();
+                EptFree();
+                EptPoolFree();
                 FreeGlobalDriverState();
         }
 
@@ -94,14 +831,20 @@ DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
                 BroadcastVmxTermination();
                 FreeVmxState();
                 UnregisterPowerCallback();
+                StepFree();
+                FreezeFree();
+                EptFree();
+                EptPoolFree();
                 FreeGlobalDriverState();
                 IoDeleteDevice(&DriverObject->DeviceObject);
                 return status;
         }
 
-        DriverObject->MajorFunction[IRP_MJ_CREATE] = DeviceCreate;
-        DriverObject->MajorFunction[IRP_MJ_CLOSE]  = DeviceClose;
-        DriverObject->DriverUnload                 = DriverUnload;
+        DriverObject->MajorFunction[IRP_MJ_CREATE]         = DeviceCreate;
+        DriverObject->MajorFunction[IRP_MJ_CLOSE]          = DeviceClose;
+        DriverObject->MajorFunction[IRP_MJ_CLEANUP]        = DeviceCleanup;
+        DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DeviceControl;
+        DriverObject->DriverUnload                         = DriverUnload;
 
         DEBUG_LOG("Driver entry complete");
         return status;
@@ -0,0 +1,962 @@
+#include "ept.h"
+
+#include "ia32.h"
+#include "hw.h"
+#include "cap.h"
+#include "mm.h"
+#include "vmx.h"
+#include "vmcs.h"
+#include "arch.h"
+#include "bpindex.h"
+#include "cond.h"
+
+/*
+ * The first pdpt maps the first 512GB with 2MB pages, every pd page of which
+ * is allocated up front so any page in there can be split for a breakpoint.
+ * Every pdpt after it maps the next 512GB with 1GB pages, up to MAXPHYADDR.
+ */
+#define EPT_IDENTITY_PD_COUNT EPT_PDPTE_ENTRY_COUNT
+#define EPT_LARGE_PAGE_SIZE   0x200000ull
+#define EPT_HUGE_PAGE_SIZE    0x40000000ull
+#define EPT_PDPT_SPAN         (EPT_PDPTE_ENTRY_COUNT * EPT_HUGE_PAGE_SIZE)
+#define EPT_SPLIT_LIMIT       EPT_PDPT_SPAN
+
+/* a 4 level walk translates 48 bits of guest physical address */
+#define EPT_MAX_PHYSICAL_ADDRESS_WIDTH 48
+/* what to assume if cpuid doesn't report it, see SDM 4.1.4 */
+#define EPT_DEFAULT_PHYSICAL_ADDRESS_WIDTH 36
+
+/* the pml4, the pdpts and then the pds */
+#define EPT_HIERARCHY_PAGES(PdptCount) (1 + (PdptCount) + EPT_IDENTITY_PD_COUNT)
+
+#define EPT_READ_WRITE_EXECUTE                                  \
+        (EPT_PTE_READ_ACCESS_FLAG | EPT_PTE_WRITE_ACCESS_FLAG | \
+         EPT_PTE_EXECUTE_ACCESS_FLAG)
+
+#define POOL_TAG_EPT_BREAKPOINTS 'pbpe'
+#define POOL_TAG_EPT_CONDITION   'dcpe'
+
+typedef struct _EPT_HIERARCHY {
+        EPT_PML4E*   pml4;
+        /* pdpt_count pages of EPT_PDPTE_ENTRY_COUNT entries each */
+        EPT_PDPTE*   pdpt;
+        UINT32       pdpt_count;
+        /* EPT_IDENTITY_PD_COUNT pages of EPT_PDE_ENTRY_COUNT entries each */
+        EPT_PDE_2MB* pd;
+        UINT64       pointer;
+
+} EPT_HIERARCHY, *PEPT_HIERARCHY;
+
+/* a slot is in use while mdl, which keeps the page resident, is set */
+typedef struct _EPT_BREAKPOINT {
+        UINT64                 address;
+        UINT64                 physical;
+        PMDL                   mdl;
+        /* like the index, replaced rather than modified and freed the same */
+        PCOND_PROGRAM volatile condition;
+        volatile LONG64        hits;
+        volatile LONG64        misses;
+        volatile LONG64        faults;
+        /* HV_BREAKPOINT_FLAG_*, fixed for the life of the breakpoint */
+        UINT32                 flags;
+
+} EPT_BREAKPOINT, *PEPT_BREAKPOINT;
+
+/* the registers of a condition are the guest context, then rip */
+C_ASSERT(FIELD_OFFSET(GUEST_CONTEXT, rflags) ==
+         COND_REGISTER_RFLAGS * sizeof(UINT64));
+C_ASSERT(sizeof(GUEST_CONTEXT) == COND_REGISTER_RIP * sizeof(UINT64));
+
+typedef struct _EPT_MTRR_STATE {
+        IA32_MTRR_DEF_TYPE_REGISTER def_type;
+        UINT32                      variable_count;
+        IA32_MTRR_PHYSBASE_REGISTER base[IA32_MTRR_VARIABLE_COUNT];
+        IA32_MTRR_PHYSMASK_REGISTER mask[IA32_MTRR_VARIABLE_COUNT];
+
+} EPT_MTRR_STATE, *PEPT_MTRR_STATE;
+
+typedef struct _EPT_STATE {
+        BOOLEAN            enabled;
+        INVEPT_TYPE        invept_type;
+        EPT_HIERARCHY      views[EPT_VIEW_COUNT];
+        /*
+         * Serialises changes to the breakpoints. The exit path never takes it,
+         * it only reads the index, which is replaced rather than modified.
+         */
+        KGUARDED_MUTEX     lock;
+        PBP_INDEX volatile index;
+        /* instructions stepped over on a breakpoint page, hits included */
+        volatile LONG64    steps;
+        EPT_BREAKPOINT     breakpoints[EPT_MAX_BREAKPOINTS];
+
+} EPT_STATE, *PEPT_STATE;
+
+STATIC EPT_STATE ept_state = {0};
+
+STATIC
+VOID
+EptReadMtrrs(_Out_ PEPT_MTRR_STATE Mtrrs)
+{
+        IA32_MTRR_CAPABILITIES_REGISTER cap = {
+            .AsUInt = HwReadMsr(IA32_MTRR_CAPABILITIES)};
+
+        Mtrrs->def_type.AsUInt = HwReadMsr(IA32_MTRR_DEF_TYPE);
+        Mtrrs->variable_count =
+            min(cap.VariableRangeCount, IA32_MTRR_VARIABLE_COUNT);
+
+        for (UINT32 index = 0; index < Mtrrs->variable_count; index++) {
+                Mtrrs->base[index].AsUInt =
+                    HwReadMsr(IA32_MTRR_PHYSBASE0 + index * 2);
+                Mtrrs->mask[index].AsUInt =
+                    HwReadMsr(IA32_MTRR_PHYSMASK0 + index * 2);
+        }
+}
+
+/*
+ * The memory type of the large page of Size bytes at Base, as the MTRRs would
+ * have it. A large page can only have a single type, so wherever the MTRRs
+ * would give parts of the page different types, i.e the fixed ranges in the
+ * first megabyte or a variable range that isn't aligned to the page size, the
+ * page is made uncacheable. That is always safe, and is only ever slow for the
+ * handful of pages where firmware put a boundary.
+ */
+STATIC
+UINT8
+EptLargePageMemoryType(_In_ const EPT_MTRR_STATE* Mtrrs,
+                       _In_ UINT64                Base,
+                       _In_ UINT64                Size)
+{
+        UINT8  type       = MEMORY_TYPE_INVALID;
+        UINT64 range_base = 0;
+        UINT64 range_mask = 0;
+        UINT64 page_mask  = 0;
+
+        if (!Mtrrs->def_type.MtrrEnable)
+                return MEMORY_TYPE_UNCACHEABLE;
+
+        if (Base < Size && Mtrrs->def_type.FixedRangeMtrrEnable)
+                return MEMORY_TYPE_UNCACHEABLE;
+
+        for (UINT32 index = 0; index < Mtrrs->variable_count; index++) {
+                if (!Mtrrs->mask[index].Valid)
+                        continue;
+
+                range_base = Mtrrs->base[index].AsUInt &
+                             IA32_MTRR_PHYSBASE_PAGE_FRAME_NUMBER_FLAG;
+                range_mask = Mtrrs->mask[index].AsUInt &
+                             IA32_MTRR_PHYSMASK_PAGE_FRAME_NUMBER_FLAG;
+                page_mask  = range_mask & ~(Size - 1);
+
+                /* no address within the page lies in this range */
+                if ((Base & page_mask) != (range_base & page_mask))
+                        continue;
+
+                /* only part of the page does */
+                if (range_mask & (Size - 1))
+                        return MEMORY_TYPE_UNCACHEABLE;
+
+                /* 11.11.4.1, where ranges overlap uc wins and wt beats wb */
+                if (Mtrrs->base[index].Type == MEMORY_TYPE_UNCACHEABLE)
+                        return MEMORY_TYPE_UNCACHEABLE;
+
+                if (type == MEMORY_TYPE_INVALID ||
+                    Mtrrs->base[index].Type == MEMORY_TYPE_WRITE_THROUGH)
+                        type = (UINT8)Mtrrs->base[index].Type;
+        }
+
+        if (type == MEMORY_TYPE_INVALID)
+                return (UINT8)Mtrrs->def_type.DefaultMemoryType;
+
+        return type;
+}
+
+/* MAXPHYADDR, the number of bits in a physical address on this processor */
+STATIC
+UINT32
+EptPhysicalAddressWidth()
+{
+        CPUID_EAX_80000000 extended = {0};
+        CPUID_EAX_80000008 size     = {0};
+
+        HwCpuidEx((INT32*)&extended, CPUID_EXTENDED_FUNCTION_INFORMATION, 0);
+
+        if (extended.Eax.MaxExtendedFunctions <
+            CPUID_EXTENDED_VIRTUAL_PHYSICAL_ADDRESS_SIZE)
+                return EPT_DEFAULT_PHYSICAL_ADDRESS_WIDTH;
+
+        HwCpuidEx(
+            (INT32*)&size, CPUID_EXTENDED_VIRTUAL_PHYSICAL_ADDRESS_SIZE, 0);
+        return size.Eax.NumberOfPhysicalAddressBits;
+}
+
+/*
+ * Whether every range of memory the memory manager knows of lies below Limit.
+ * Must be called at PASSIVE_LEVEL.
+ */
+STATIC
+BOOLEAN
+EptMemoryMapFits(_In_ UINT64 Limit)
+{
+        PPHYSICAL_MEMORY_RANGE ranges = MmGetPhysicalMemoryRanges();
+        PPHYSICAL_MEMORY_RANGE range  = ranges;
+        BOOLEAN                fits   = TRUE;
+
+        if (!ranges)
+                return FALSE;
+
+        /* the array ends with an empty range */
+        for (; range->BaseAddress.QuadPart || range->NumberOfBytes.QuadPart;
+             range++) {
+                if (range->BaseAddress.QuadPart +
+                        range->NumberOfBytes.QuadPart >
+                    (LONG64)Limit) {
+                        fits = FALSE;
+                        break;
+                }
+        }
+
+        ExFreePool(ranges);
+        return fits;
+}
+
+STATIC
+UINT64
+EptPhysical(_In_ PVOID Address)
+{
+        return MmGetPhysicalAddress(Address).QuadPart;
+}
+
+/*
+ * Maps every guest physical address below Limit, which is a whole number of
+ * 1GB pages and at least the 512GB mapped with 2MB pages. Anything past that
+ * needs 1GB page support.
+ */
+STATIC
+NTSTATUS
+EptBuildIdentityMap(_Out_ PEPT_HIERARCHY     Hierarchy,
+                    _In_ const EPT_MTRR_STATE* Mtrrs,
+                    _In_ UINT64                Limit)
+{
+        EPT_POINTER pointer    = {0};
+        UINT64      base       = 0;
+        UINT32      pdpt_count = (UINT32)((Limit + EPT_PDPT_SPAN - 1) /
+                                     EPT_PDPT_SPAN);
+        UINT8*      pages =
+            ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                            EPT_HIERARCHY_PAGES(pdpt_count) * PAGE_SIZE,
+                            POOL_TAG_EPT_PML4);
+
+        if (!pages)
+                return STATUS_MEMORY_NOT_ALLOCATED;
+
+        Hierarchy->pml4       = (EPT_PML4E*)pages;
+        Hierarchy->pdpt       = (EPT_PDPTE*)(pages + PAGE_SIZE);
+        Hierarchy->pdpt_count = pdpt_count;
+        Hierarchy->pd =
+            (EPT_PDE_2MB*)(pages + (1 + pdpt_count) * PAGE_SIZE);
+
+        for (UINT32 pdpt = 0; pdpt < pdpt_count; pdpt++)
+                Hierarchy->pml4[pdpt].AsUInt =
+                    EPT_READ_WRITE_EXECUTE |
+                    EptPhysical(&Hierarchy->pdpt[pdpt * EPT_PDPTE_ENTRY_COUNT]);
+
+        for (UINT32 pd = 0; pd < EPT_IDENTITY_PD_COUNT; pd++)
+                Hierarchy->pdpt[pd].AsUInt =
+                    EPT_READ_WRITE_EXECUTE |
+                    EptPhysical(&Hierarchy->pd[pd * EPT_PDE_ENTRY_COUNT]);
+
+        for (UINT32 entry = 0;
+             entry < EPT_IDENTITY_PD_COUNT * EPT_PDE_ENTRY_COUNT;
+             entry++) {
+                base = entry * EPT_LARGE_PAGE_SIZE;
+
+                Hierarchy->pd[entry].AsUInt =
+                    base | EPT_READ_WRITE_EXECUTE |
+                    EPT_PDE_2MB_LARGE_PAGE_FLAG |
+                    ((UINT64)EptLargePageMemoryType(
+                         Mtrrs, base, EPT_LARGE_PAGE_SIZE)
+                     << EPT_PDE_2MB_MEMORY_TYPE_BIT);
+        }
+
+        /* the rest of the last pdpt, past Limit, is left not present */
+        for (UINT32 entry = EPT_PDPTE_ENTRY_COUNT;
+             entry < Limit / EPT_HUGE_PAGE_SIZE;
+             entry++) {
+                base = entry * EPT_HUGE_PAGE_SIZE;
+
+                Hierarchy->pdpt[entry].AsUInt =
+                    base | EPT_READ_WRITE_EXECUTE |
+                    EPT_PDPTE_1GB_LARGE_PAGE_FLAG |
+                    ((UINT64)EptLargePageMemoryType(
+                         Mtrrs, base, EPT_HUGE_PAGE_SIZE)
+                     << EPT_PDPTE_1GB_MEMORY_TYPE_BIT);
+        }
+
+        pointer.Fields.MemoryType      = MEMORY_TYPE_WRITE_BACK;
+        pointer.Fields.PageWalkLength  = EPT_PAGE_WALK_LENGTH_4;
+        pointer.Fields.PageFrameNumber = EptPhysical(Hierarchy->pml4) >>
+                                         PAGE_SHIFT;
+
+        Hierarchy->pointer = pointer.AsUInt;
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Returns the page table mapping Physical in the breakpoint view, splitting
+ * the large page that maps it if need be. Page tables come from the EPT page
+ * pool and are kept until EptFree, even once the last breakpoint on them has
+ * been removed.
+ */
+STATIC
+NTSTATUS
+EptSplitLargePage(_In_ UINT64 Physical, _Out_ EPT_PTE** Table)
+{
+        PEPT_HIERARCHY view  = &ept_state.views[EPT_VIEW_BREAKPOINT];
+        EPT_PDE_2MB*   large = &view->pd[Physical / EPT_LARGE_PAGE_SIZE];
+        PEPT_POOL_PAGE page  = NULL;
+        EPT_PTE*       table = NULL;
+        UINT64         base  = Physical & ~(EPT_LARGE_PAGE_SIZE - 1);
+        UINT64         type  = large->AsUInt & EPT_PDE_2MB_MEMORY_TYPE_FLAG;
+
+        if (!(large->AsUInt & EPT_PDE_2MB_LARGE_PAGE_FLAG)) {
+                *Table = (EPT_PTE*)EptPoolPhysicalToVirtual(
+                    large->AsUInt & EPT_PDE_PAGE_FRAME_NUMBER_FLAG);
+                return STATUS_SUCCESS;
+        }
+
+        page = EptPoolAllocatePage();
+
+        if (!page)
+                return STATUS_INSUFFICIENT_RESOURCES;
+
+        table = (EPT_PTE*)page->va;
+
+        for (UINT32 entry = 0; entry < EPT_PTE_ENTRY_COUNT; entry++)
+                table[entry].AsUInt = (base + entry * PAGE_SIZE) |
+                                      EPT_READ_WRITE_EXECUTE | type;
+
+        /* the table must be complete before the processor can walk it */
+        InterlockedExchange64((volatile LONG64*)&large->AsUInt,
+                              page->pa | EPT_READ_WRITE_EXECUTE);
+
+        *Table = table;
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Only ever changes the breakpoint view, and only takes effect on each core
+ * once it has invalidated its translations, see EptCommitBreakpoints.
+ */
+STATIC
+NTSTATUS
+EptSetPageExecutable(_In_ UINT64 Physical, _In_ BOOLEAN Executable)
+{
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        EPT_PTE* table  = NULL;
+        EPT_PTE* entry  = NULL;
+        UINT64   value  = 0;
+
+        status = EptSplitLargePage(Physical, &table);
+
+        if (!NT_SUCCESS(status))
+                return status;
+
+        entry = &table[(Physical >> PAGE_SHIFT) & (EPT_PTE_ENTRY_COUNT - 1)];
+        value = Executable ? entry->AsUInt | EPT_PTE_EXECUTE_ACCESS_FLAG :
+                             entry->AsUInt & ~EPT_PTE_EXECUTE_ACCESS_FLAG;
+
+        InterlockedExchange64((volatile LONG64*)&entry->AsUInt, value);
+        return STATUS_SUCCESS;
+}
+
+STATIC
+BOOLEAN
+EptPageHasBreakpoint(_In_ UINT64 Physical)
+{
+        for (UINT32 index = 0; index < EPT_MAX_BREAKPOINTS; index++) {
+                PEPT_BREAKPOINT breakpoint = &ept_state.breakpoints[index];
+
+                if (breakpoint->mdl &&
+                    (breakpoint->physical >> PAGE_SHIFT) ==
+                        (Physical >> PAGE_SHIFT))
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+/*
+ * Builds an index of the breakpoints as they are now and swaps it in. The
+ * previous index may still be in use by an exit handler, so it is handed back
+ * for EptCommitBreakpoints to free.
+ */
+STATIC
+NTSTATUS
+EptRebuildIndex(_Out_ PBP_INDEX* Previous)
+{
+        PBP_INDEX_SITE sites  = NULL;
+        PVOID          buffer = NULL;
+        UINT32         count  = 0;
+
+        sites = ExAllocatePool2(POOL_FLAG_PAGED,
+                                EPT_MAX_BREAKPOINTS * sizeof(BP_INDEX_SITE),
+                                POOL_TAG_EPT_BREAKPOINTS);
+
+        if (!sites)
+                return STATUS_MEMORY_NOT_ALLOCATED;
+
+        for (UINT32 index = 0; index < EPT_MAX_BREAKPOINTS; index++) {
+                if (!ept_state.breakpoints[index].mdl)
+                        continue;
+
+                sites[count].address = ept_state.breakpoints[index].physical;
+                sites[count].id      = index;
+                count++;
+        }
+
+        buffer = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                 BpIndexSize(count),
+                                 POOL_TAG_EPT_BREAKPOINTS);
+
+        if (!buffer) {
+                ExFreePoolWithTag(sites, POOL_TAG_EPT_BREAKPOINTS);
+                return STATUS_MEMORY_NOT_ALLOCATED;
+        }
+
+        BpIndexBuild(sites, count, buffer);
+        ExFreePoolWithTag(sites, POOL_TAG_EPT_BREAKPOINTS);
+
+        *Previous = InterlockedExchangePointer(
+            (PVOID volatile*)&ept_state.index, buffer);
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Has every virtualised core flush its translations of the breakpoint view.
+ * Each core does so from a vmcall made by the guest, so none of them can
+ * still be inside an exit handler that picked up Previous, which can then be
+ * freed.
+ */
+STATIC
+NTSTATUS
+EptCommitBreakpoints(_In_opt_ PBP_INDEX Previous)
+{
+        NTSTATUS status = VmxInvalidateEpt();
+
+        /* nothing is virtualised, so nothing can be using Previous either */
+        if (status == STATUS_DEVICE_NOT_READY)
+                status = STATUS_SUCCESS;
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("VmxInvalidateEpt failed with status %x", status);
+                return status;
+        }
+
+        if (Previous)
+                ExFreePoolWithTag(Previous, POOL_TAG_EPT_BREAKPOINTS);
+
+        return STATUS_SUCCESS;
+}
+
+STATIC
+PEPT_BREAKPOINT
+EptFindBreakpoint(_In_ UINT64 Address)
+{
+        for (UINT32 index = 0; index < EPT_MAX_BREAKPOINTS; index++) {
+                PEPT_BREAKPOINT breakpoint = &ept_state.breakpoints[index];
+
+                if (breakpoint->mdl && breakpoint->address == Address)
+                        return breakpoint;
+        }
+
+        return NULL;
+}
+
+STATIC
+NTSTATUS
+EptAddBreakpoint(_In_ UINT64 Address, _In_ UINT32 Flags)
+{
+        NTSTATUS        status     = STATUS_UNSUCCESSFUL;
+        PEPT_BREAKPOINT breakpoint = NULL;
+        PBP_INDEX       previous   = NULL;
+        PMDL            mdl        = NULL;
+        UINT64          physical   = 0;
+
+        if (EptFindBreakpoint(Address))
+                return STATUS_OBJECT_NAME_COLLISION;
+
+        for (UINT32 index = 0; index < EPT_MAX_BREAKPOINTS; index++) {
+                if (!ept_state.breakpoints[index].mdl) {
+                        breakpoint = &ept_state.breakpoints[index];
+                        break;
+                }
+        }
+
+        if (!breakpoint)
+                return STATUS_INSUFFICIENT_RESOURCES;
+
+        mdl = IoAllocateMdl((PVOID)Address, 1, FALSE, FALSE, NULL);
+
+        if (!mdl)
+                return STATUS_INSUFFICIENT_RESOURCES;
+
+        /* the breakpoint is on the physical page, so it must stay put */
+        __try {
+                MmProbeAndLockPages(mdl, KernelMode, IoReadAccess);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+                IoFreeMdl(mdl);
+                return STATUS_INVALID_ADDRESS;
+        }
+
+        physical = ((UINT64)MmGetMdlPfnArray(mdl)[0] << PAGE_SHIFT) |
+                   (Address & (PAGE_SIZE - 1));
+
+        /* only the part mapped with 2MB pages can be split */
+        if (physical >= EPT_SPLIT_LIMIT) {
+                status = STATUS_NOT_SUPPORTED;
+                goto end;
+        }
+
+        status = EptSetPageExecutable(physical, FALSE);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("EptSetPageExecutable failed with status %x",
+                            status);
+                goto end;
+        }
+
+        breakpoint->address   = Address;
+        breakpoint->physical  = physical;
+        breakpoint->condition = NULL;
+        breakpoint->hits      = 0;
+        breakpoint->misses    = 0;
+        breakpoint->faults    = 0;
+        breakpoint->flags     = Flags;
+        breakpoint->mdl       = mdl;
+
+        status = EptRebuildIndex(&previous);
+
+        if (!NT_SUCCESS(status)) {
+                breakpoint->mdl = NULL;
+
+                if (!EptPageHasBreakpoint(physical))
+                        EptSetPageExecutable(physical, TRUE);
+
+                goto end;
+        }
+
+        return EptCommitBreakpoints(previous);
+
+end:
+        MmUnlockPages(mdl);
+        IoFreeMdl(mdl);
+        return status;
+}
+
+STATIC
+NTSTATUS
+EptRemoveBreakpoint(_In_ PEPT_BREAKPOINT Breakpoint)
+{
+        NTSTATUS      status    = STATUS_UNSUCCESSFUL;
+        PBP_INDEX     previous  = NULL;
+        PMDL          mdl       = Breakpoint->mdl;
+        PCOND_PROGRAM condition = Breakpoint->condition;
+
+        Breakpoint->mdl = NULL;
+
+        status = EptRebuildIndex(&previous);
+
+        if (!NT_SUCCESS(status)) {
+                Breakpoint->mdl = mdl;
+                return status;
+        }
+
+        /* the page is already split, so this can't fail */
+        if (!EptPageHasBreakpoint(Breakpoint->physical))
+                EptSetPageExecutable(Breakpoint->physical, TRUE);
+
+        status = EptCommitBreakpoints(previous);
+
+        /* as with the index, leaked if an exit handler may still have it */
+        if (NT_SUCCESS(status) && condition)
+                ExFreePoolWithTag(condition, POOL_TAG_EPT_CONDITION);
+
+        Breakpoint->condition = NULL;
+
+        MmUnlockPages(mdl);
+        IoFreeMdl(mdl);
+        return status;
+}
+
+/* Must be called at PASSIVE_LEVEL. */
+NTSTATUS
+EptSetBreakpoint(_In_ UINT64 Address, _In_ BOOLEAN Enable, _In_ UINT32 Flags)
+{
+        NTSTATUS        status     = STATUS_SUCCESS;
+        PEPT_BREAKPOINT breakpoint = NULL;
+
+        if (!ept_state.enabled)
+                return STATUS_NOT_SUPPORTED;
+
+        /* a user mode address would resolve to a single process's page */
+        if (Address < (UINT64)MmSystemRangeStart)
+                return STATUS_INVALID_PARAMETER;
+
+        KeAcquireGuardedMutex(&ept_state.lock);
+
+        if (Enable) {
+                status = EptAddBreakpoint(Address, Flags);
+                goto end;
+        }
+
+        breakpoint = EptFindBreakpoint(Address);
+
+        if (!breakpoint) {
+                status = STATUS_NOT_FOUND;
+                goto end;
+        }
+
+        status = EptRemoveBreakpoint(breakpoint);
+
+end:
+        KeReleaseGuardedMutex(&ept_state.lock);
+        return status;
+}
+
+/*
+ * Must be called at PASSIVE_LEVEL. The program is verified here rather than
+ * trusting the caller, CondEvaluate itself checks nothing. The previous
+ * condition can be in use by an exit handler until every core has been
+ * through EptCommitBreakpoints, which serves as the grace period.
+ */
+NTSTATUS
+EptSetBreakpointCondition(_In_ UINT64              Address,
+                          _In_ const COND_PROGRAM* Program)
+{
+        NTSTATUS        status     = STATUS_SUCCESS;
+        PEPT_BREAKPOINT breakpoint = NULL;
+        PCOND_PROGRAM   condition  = NULL;
+        PCOND_PROGRAM   previous   = NULL;
+
+        if (!ept_state.enabled)
+                return STATUS_NOT_SUPPORTED;
+
+        if (Program->instruction_count) {
+                if (CondVerify(Program) >= 0)
+                        return STATUS_INVALID_PARAMETER;
+
+                condition = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                            sizeof(COND_PROGRAM),
+                                            POOL_TAG_EPT_CONDITION);
+
+                if (!condition)
+                        return STATUS_MEMORY_NOT_ALLOCATED;
+
+                RtlCopyMemory(condition, Program, sizeof(COND_PROGRAM));
+        }
+
+        KeAcquireGuardedMutex(&ept_state.lock);
+
+        breakpoint = EptFindBreakpoint(Address);
+
+        if (!breakpoint) {
+                status = STATUS_NOT_FOUND;
+                goto end;
+        }
+
+        previous = InterlockedExchangePointer(
+            (PVOID volatile*)&breakpoint->condition, condition);
+        condition = NULL;
+
+        InterlockedExchange64(&breakpoint->hits, 0);
+        InterlockedExchange64(&breakpoint->misses, 0);
+        InterlockedExchange64(&breakpoint->faults, 0);
+
+        status = EptCommitBreakpoints(NULL);
+
+        if (NT_SUCCESS(status) && previous)
+                ExFreePoolWithTag(previous, POOL_TAG_EPT_CONDITION);
+
+end:
+        KeReleaseGuardedMutex(&ept_state.lock);
+
+        if (condition)
+                ExFreePoolWithTag(condition, POOL_TAG_EPT_CONDITION);
+
+        return status;
+}
+
+NTSTATUS
+EptQueryBreakpoints(_Out_ PHV_BREAKPOINTS Breakpoints, _In_ UINT32 Capacity)
+{
+        PEPT_BREAKPOINT breakpoint = NULL;
+        PHV_BREAKPOINT  entry      = NULL;
+        UINT32          count      = 0;
+
+        if (!ept_state.enabled)
+                return STATUS_NOT_SUPPORTED;
+
+        KeAcquireGuardedMutex(&ept_state.lock);
+
+        for (UINT32 index = 0; index < EPT_MAX_BREAKPOINTS; index++) {
+                breakpoint = &ept_state.breakpoints[index];
+
+                if (!breakpoint->mdl)
+                        continue;
+
+                if (count == Capacity)
+                        break;
+
+                entry              = &Breakpoints->breakpoints[count++];
+                entry->address     = breakpoint->address;
+                entry->physical    = breakpoint->physical;
+                entry->hits        = breakpoint->hits;
+                entry->misses      = breakpoint->misses;
+                entry->faults      = breakpoint->faults;
+                entry->conditional = breakpoint->condition != NULL;
+                entry->flags       = breakpoint->flags;
+        }
+
+        Breakpoints->breakpoint_count = count;
+        Breakpoints->reserved         = 0;
+        Breakpoints->steps            = ept_state.steps;
+
+        KeReleaseGuardedMutex(&ept_state.lock);
+        return STATUS_SUCCESS;
+}
+
+/*
+ * The guest's rsp and rip are only in the VMCS, the rest of the registers a
+ * condition can read are laid out as it expects in the guest context.
+ */
+STATIC
+COND_RESULT
+EptEvaluateCondition(_In_ const COND_PROGRAM* Condition,
+                     _In_ PGUEST_CONTEXT      Context,
+                     _In_ UINT64              GuestRip)
+{
+        UINT64 registers[COND_REGISTER_COUNT] = {0};
+
+        RtlCopyMemory(registers, Context, sizeof(GUEST_CONTEXT));
+        registers[COND_REGISTER_RSP] = VmxVmRead(VMCS_GUEST_RSP);
+        registers[COND_REGISTER_RIP] = GuestRip;
+
+        return CondEvaluate(Condition, registers, CondReadKernel, NULL);
+}
+
+/*
+ * A fetch can fault on the tail of an instruction that starts on the page
+ * before, in which case the linear address is on a different page to rip and
+ * the instruction is not one of ours.
+ */
+BOOLEAN
+EptRecordExecute(_In_ UINT64         GuestPhysical,
+                 _In_ UINT64         GuestRip,
+                 _In_ UINT64         GuestLinear,
+                 _In_ PGUEST_CONTEXT Context,
+                 _Out_ UINT32*       Flags)
+{
+        const BP_INDEX*     index      = ept_state.index;
+        UINT32              id         = BP_INDEX_MISS;
+        PEPT_BREAKPOINT     breakpoint = NULL;
+        const COND_PROGRAM* condition  = NULL;
+
+        *Flags = 0;
+
+        InterlockedIncrement64(&ept_state.steps);
+
+        if ((GuestRip ^ GuestLinear) >> PAGE_SHIFT)
+                return FALSE;
+
+        id = BpIndexLookup(index,
+                           (GuestPhysical & ~(UINT64)(PAGE_SIZE - 1)) |
+                               (GuestRip & (PAGE_SIZE - 1)));
+
+        if (id == BP_INDEX_MISS)
+                return FALSE;
+
+        breakpoint = &ept_state.breakpoints[id];
+        condition  = breakpoint->condition;
+
+        if (condition) {
+                switch (EptEvaluateCondition(condition, Context, GuestRip)) {
+                case COND_RESULT_TRUE: break;
+                case COND_RESULT_FALSE:
+                        InterlockedIncrement64(&breakpoint->misses);
+                        return FALSE;
+                default:
+                        InterlockedIncrement64(&breakpoint->faults);
+                        return FALSE;
+                }
+        }
+
+        InterlockedIncrement64(&breakpoint->hits);
+        *Flags = breakpoint->flags;
+        return TRUE;
+}
+
+VOID
+EptInvalidate()
+{
+        INVEPT_DESCRIPTOR descriptor = {0};
+
+        descriptor.EptPointer = ept_state.views[EPT_VIEW_BREAKPOINT].pointer;
+        __invept(ept_state.invept_type, &descriptor);
+}
+
+BOOLEAN
+EptIsEnabled()
+{
+        return ept_state.enabled;
+}
+
+UINT64
+EptGetPointer(_In_ EPT_VIEW View)
+{
+        return ept_state.views[View].pointer;
+}
+
+/*
+ * Must be called after CapInitialise. Failing here is not fatal, we simply
+ * run without EPT and without breakpoints.
+ */
+NTSTATUS
+EptInitialise()
+{
+        NTSTATUS                       status   = STATUS_UNSUCCESSFUL;
+        PBP_INDEX                      previous = NULL;
+        EPT_MTRR_STATE                 mtrrs    = {0};
+        UINT32                         width    = 0;
+        UINT64                         limit    = 0;
+        const VMX_CAPABILITIES*        cap      = CapGetCapabilities();
+        IA32_VMX_EPT_VPID_CAP_REGISTER ept      = {.AsUInt =
+                                                       cap->ept_vpid_cap};
+
+        KeInitializeGuardedMutex(&ept_state.lock);
+
+        if (!((cap->procbased_ctls2 >> 32) &
+              IA32_VMX_PROCBASED_CTLS2_ENABLE_EPT_FLAG) ||
+            !(cap->cpuid_01_edx &
+              CPUID_FEATURE_INFORMATION_EDX_MEMORY_TYPE_RANGE_REGISTERS_FLAG))
+                return STATUS_NOT_SUPPORTED;
+
+        if (!ept.PageWalkLength4 || !ept.MemoryTypeWriteBack ||
+            !ept.Pde2MbPages || !ept.Invept)
+                return STATUS_NOT_SUPPORTED;
+
+        if (ept.InveptSingleContext)
+                ept_state.invept_type = InveptSingleContext;
+        else if (ept.InveptAllContexts)
+                ept_state.invept_type = InveptAllContext;
+        else
+                return STATUS_NOT_SUPPORTED;
+
+        /*
+         * A guest access to anything we don't map is an ept violation we
+         * can't handle, so either all of MAXPHYADDR is mapped or ept is left
+         * off altogether. Past 512GB that needs 1GB pages, and past 48 bits
+         * a 4 level walk can't reach.
+         */
+        width = EptPhysicalAddressWidth();
+
+        if (width > EPT_MAX_PHYSICAL_ADDRESS_WIDTH) {
+                DEBUG_LOG("MAXPHYADDR of %lu bits can't be mapped", width);
+                return STATUS_NOT_SUPPORTED;
+        }
+
+        limit = max(1ull << width, EPT_SPLIT_LIMIT);
+
+        if (limit > EPT_SPLIT_LIMIT && !ept.Pdpte1GbPages) {
+                DEBUG_LOG("MAXPHYADDR of %lu bits needs 1GB pages", width);
+                return STATUS_NOT_SUPPORTED;
+        }
+
+        if (!EptMemoryMapFits(limit)) {
+                DEBUG_LOG("Physical memory extends past MAXPHYADDR");
+                return STATUS_NOT_SUPPORTED;
+        }
+
+        EptReadMtrrs(&mtrrs);
+
+        for (UINT32 view = 0; view < EPT_VIEW_COUNT; view++) {
+                status = EptBuildIdentityMap(
+                    &ept_state.views[view], &mtrrs, limit);
+
+                if (!NT_SUCCESS(status)) {
+                        DEBUG_ERROR("EptBuildIdentityMap failed with status %x",
+                                    status);
+                        EptFree();
+                        return status;
+                }
+        }
+
+        /* the exit path can then always assume there is an index */
+        status = EptRebuildIndex(&previous);
+
+        if (!NT_SUCCESS(status)) {
+                EptFree();
+                return status;
+        }
+
+        ept_state.enabled = TRUE;
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Must be called at PASSIVE_LEVEL once VMX operation has been terminated on
+ * all cores, and before EptPoolFree.
+ */
+VOID
+EptFree()
+{
+        PEPT_HIERARCHY  view       = &ept_state.views[EPT_VIEW_BREAKPOINT];
+        PEPT_BREAKPOINT breakpoint = NULL;
+        PEPT_POOL_PAGE  page       = NULL;
+
+        ept_state.enabled = FALSE;
+
+        for (UINT32 index = 0; index < EPT_MAX_BREAKPOINTS; index++) {
+                breakpoint = &ept_state.breakpoints[index];
+
+                if (!breakpoint->mdl)
+                        continue;
+
+                MmUnlockPages(breakpoint->mdl);
+                IoFreeMdl(breakpoint->mdl);
+
+                if (breakpoint->condition)
+                        ExFreePoolWithTag(breakpoint->condition,
+                                          POOL_TAG_EPT_CONDITION);
+
+                RtlZeroMemory(breakpoint, sizeof(EPT_BREAKPOINT));
+        }
+
+        for (UINT32 entry = 0;
+             view->pd && entry < EPT_IDENTITY_PD_COUNT * EPT_PDE_ENTRY_COUNT;
+             entry++) {
+                if (view->pd[entry].AsUInt & EPT_PDE_2MB_LARGE_PAGE_FLAG)
+                        continue;
+
+                page = EptPoolPageFromPhysical(view->pd[entry].AsUInt &
+                                               EPT_PDE_PAGE_FRAME_NUMBER_FLAG);
+
+                if (page)
+                        EptPoolFreePage(page);
+        }
+
+        for (UINT32 index = 0; index < EPT_VIEW_COUNT; index++) {
+                if (ept_state.views[index].pml4)
+                        ExFreePoolWithTag(ept_state.views[index].pml4,
+                                          POOL_TAG_EPT_PML4);
+
+                RtlZeroMemory(&ept_state.views[index], sizeof(EPT_HIERARCHY));
+        }
+
+        if (ept_state.index) {
+                ExFreePoolWithTag(ept_state.index, POOL_TAG_EPT_BREAKPOINTS);
+                ept_state.index = NULL;
+        }
+
+        ept_state.steps = 0;
+}
@@ -0,0 +1,70 @@
+#ifndef EPT_H
+#define EPT_H
+
+#include "common.h"
+#include "ioctl.h"
+#include "vmx.h"
+
+/* matches HV_MAX_BREAKPOINTS */
+#define EPT_MAX_BREAKPOINTS 1024
+
+/*
+ * Two identity maps of guest physical memory are kept, both mapping every
+ * address below MAXPHYADDR read, write and execute, the first 512GB with 2MB
+ * pages and anything above that with 1GB pages. If that isn't possible ept
+ * isn't used at all.
+ *
+ * In the breakpoint view, which every core runs on, the pages holding a
+ * breakpoint are split into 4KB pages and made non executable, so breakpoints
+ * can only be set in the first 512GB. A core that takes an EPT violation on
+ * one of them switches its own EPTP to the execute view for the single
+ * instruction it steps over, so the breakpoint pages are never made executable
+ * for any other core in the meantime.
+ */
+typedef enum _EPT_VIEW {
+        EPT_VIEW_BREAKPOINT,
+        EPT_VIEW_EXECUTE,
+        EPT_VIEW_COUNT
+
+} EPT_VIEW;
+
+NTSTATUS
+EptInitialise();
+
+VOID
+EptFree();
+
+BOOLEAN
+EptIsEnabled();
+
+UINT64
+EptGetPointer(_In_ EPT_VIEW View);
+
+/* VMX root only, flushes this cores translations of the breakpoint view */
+VOID
+EptInvalidate();
+
+/*
+ * VMX root only. Accounts for an instruction fetch that faulted on a
+ * breakpoint page and returns TRUE if the instruction is a breakpoint whose
+ * condition, if it has one, holds for Context, along with its flags.
+ */
+BOOLEAN
+EptRecordExecute(_In_ UINT64         GuestPhysical,
+                 _In_ UINT64         GuestRip,
+                 _In_ UINT64         GuestLinear,
+                 _In_ PGUEST_CONTEXT Context,
+                 _Out_ UINT32*       Flags);
+
+/* Flags are HV_BREAKPOINT_FLAG_*, and only used when setting a breakpoint. */
+NTSTATUS
+EptSetBreakpoint(_In_ UINT64 Address, _In_ BOOLEAN Enable, _In_ UINT32 Flags);
+
+NTSTATUS
+EptSetBreakpointCondition(_In_ UINT64              Address,
+                          _In_ const COND_PROGRAM* Program);
+
+NTSTATUS
+EptQueryBreakpoints(_Out_ PHV_BREAKPOINTS Breakpoints, _In_ UINT32 Capacity);
+
+#endif
@@ -0,0 +1,416 @@
+#include "freeze.h"
+
+VOID
+FreezeInitialiseState(_Out_ PFREEZE_STATE State,
+                      _In_ PFREEZE_CORE   Cores,
+                      _In_ UINT32         CoreCount)
+{
+        FREEZE_STATISTICS empty = {0};
+
+        State->word       = 0;
+        State->owner      = FREEZE_NO_OWNER;
+        State->core_count = CoreCount;
+        State->start      = 0;
+        State->cores      = Cores;
+        State->statistics = empty;
+
+        State->statistics.min_latency = ~0ull;
+        State->statistics.last_owner  = FREEZE_NO_OWNER;
+
+        for (UINT32 index = 0; index < CoreCount; index++) {
+                Cores[index].signalled         = 0;
+                Cores[index].parked_generation = 0;
+                Cores[index].arrival           = FREEZE_NOT_PARKED;
+                Cores[index].guest_rip         = 0;
+        }
+}
+
+BOOLEAN
+FreezeTryBegin(_Inout_ PFREEZE_STATE State,
+               _In_ UINT32           Core,
+               _In_ UINT32           CoreCount)
+{
+        PFREEZE_CORE core = NULL;
+        UINT64       word = 0;
+
+        if (Core >= State->core_count)
+                return FALSE;
+
+        /* read first, so contenders don't keep the line bouncing */
+        if (State->owner != FREEZE_NO_OWNER ||
+            FREEZE_ATOMIC_COMPARE_EXCHANGE_32(
+                &State->owner, Core, FREEZE_NO_OWNER) != FREEZE_NO_OWNER)
+                return FALSE;
+
+        if (CoreCount > State->core_count)
+                CoreCount = State->core_count;
+
+        for (UINT32 index = 0; index < CoreCount; index++) {
+                core            = &State->cores[index];
+                core->arrival   = index == Core ? 0 : FREEZE_NOT_PARKED;
+                core->guest_rip = 0;
+
+                if (index != Core)
+                        core->signalled = 1;
+        }
+
+        State->start = FREEZE_READ_TSC();
+
+        /*
+         * Nobody else writes the word while the generation is even, and x64
+         * doesn't reorder stores, so the signals and start are visible to
+         * any core that sees the odd generation.
+         */
+        FREEZE_COMPILER_BARRIER();
+        word        = State->word;
+        State->word = (UINT64)(FREEZE_GENERATION(word) + 1) << 32;
+        return TRUE;
+}
+
+UINT32
+FreezeWaitForCores(_Inout_ PFREEZE_STATE State,
+                   _In_ UINT32           Expected,
+                   _In_ UINT64           TimeoutCycles)
+{
+        PFREEZE_STATISTICS statistics = &State->statistics;
+        UINT64             word       = 0;
+        UINT64             latency    = 0;
+        UINT32             parked     = 0;
+
+        for (;;) {
+                word   = State->word;
+                parked = FREEZE_PARKED(word);
+
+                if (parked >= Expected)
+                        break;
+
+                if (FREEZE_READ_TSC() - State->start > TimeoutCycles)
+                        break;
+
+                FREEZE_PAUSE();
+        }
+
+        latency = FREEZE_READ_TSC() - State->start;
+
+        statistics->stops++;
+        statistics->last_latency = latency;
+        statistics->last_owner   = State->owner;
+        statistics->last_parked  = parked;
+
+        if (parked < Expected) {
+                statistics->timeouts++;
+                return parked;
+        }
+
+        statistics->total_latency += latency;
+
+        if (latency < statistics->min_latency)
+                statistics->min_latency = latency;
+
+        if (latency > statistics->max_latency)
+                statistics->max_latency = latency;
+
+        return parked;
+}
+
+/*
+ * A core that arrives after a timeout has its increment overwritten here,
+ * which is fine as it then sees the new generation and leaves straight away.
+ */
+VOID
+FreezeEnd(_Inout_ PFREEZE_STATE State)
+{
+        UINT64 word = State->word;
+
+        FREEZE_COMPILER_BARRIER();
+        State->word = (UINT64)(FREEZE_GENERATION(word) + 1) << 32;
+        FREEZE_COMPILER_BARRIER();
+        State->owner = FREEZE_NO_OWNER;
+}
+
+BOOLEAN
+FreezeClaimSignal(_Inout_ PFREEZE_STATE State, _In_ UINT32 Core)
+{
+        if (Core >= State->core_count || !State->cores[Core].signalled)
+                return FALSE;
+
+        return FREEZE_ATOMIC_EXCHANGE_32(&State->cores[Core].signalled, 0) !=
+               0;
+}
+
+BOOLEAN
+FreezePark(_Inout_ PFREEZE_STATE State,
+           _In_ UINT32           Core,
+           _In_ UINT64           GuestRip)
+{
+        PFREEZE_CORE core       = NULL;
+        UINT64       word       = 0;
+        UINT32       generation = 0;
+
+        if (Core >= State->core_count)
+                return FALSE;
+
+        core       = &State->cores[Core];
+        word       = State->word;
+        generation = FREEZE_GENERATION(word);
+
+        if (!(generation & 1) || State->owner == Core ||
+            core->parked_generation == generation)
+                return FALSE;
+
+        /*
+         * Claimed before counting ourselves, so an NMI taken in between,
+         * which still finds the generation odd, can't count this core twice.
+         */
+        core->parked_generation = generation;
+
+        while (FREEZE_ATOMIC_COMPARE_EXCHANGE(&State->word, word + 1, word) !=
+               word) {
+                word = State->word;
+
+                /* released, or even restarted, before we got counted */
+                if (FREEZE_GENERATION(word) != generation)
+                        return FALSE;
+        }
+
+        core->arrival   = FREEZE_READ_TSC() - State->start;
+        core->guest_rip = GuestRip;
+
+        while (FREEZE_GENERATION(State->word) == generation)
+                FREEZE_PAUSE();
+
+        return TRUE;
+}
+
+#if defined(_KERNEL_MODE)
+
+#        include "cap.h"
+#        include "hw.h"
+#        include "topology.h"
+#        include "vmcs.h"
+
+#        define POOL_TAG_FREEZE 'zrfv'
+
+/* NMI delivery, asserted, to every local apic but our own */
+#        define FREEZE_ICR_NMI_ALL_EXCLUDING_SELF 0x000C4400
+#        define FREEZE_ICR_SEND_PENDING           0x00001000
+
+STATIC FREEZE_STATE     freeze_state        = {0};
+STATIC PFREEZE_CORE     freeze_cores        = NULL;
+STATIC PVOID            freeze_nmi_callback = NULL;
+/* the xapic page, or NULL in x2apic mode */
+STATIC volatile UINT32* freeze_apic         = NULL;
+STATIC BOOLEAN          freeze_enabled      = FALSE;
+
+/*
+ * Only the low half of the ICR is written, as the shorthand ignores the
+ * destination, which leaves whatever the guest had written to the high half
+ * in place for its own next IPI.
+ */
+STATIC
+VOID
+FreezeSendNmi()
+{
+        volatile UINT32* icr = NULL;
+
+        if (!freeze_apic) {
+                HwWriteMsr(IA32_X2APIC_ICR, FREEZE_ICR_NMI_ALL_EXCLUDING_SELF);
+                return;
+        }
+
+        icr = &freeze_apic[APIC_INTERRUPT_COMMAND_BITS_0_31 / sizeof(UINT32)];
+
+        while (*icr & FREEZE_ICR_SEND_PENDING)
+                FREEZE_PAUSE();
+
+        *icr = FREEZE_ICR_NMI_ALL_EXCLUDING_SELF;
+}
+
+/*
+ * Our NMI can also land while a core is in root, or on a core that isn't
+ * virtualised at all, where it goes through the host IDT to the kernels own
+ * handler and so to here. Anything we didn't signal is left to the other
+ * callbacks.
+ */
+STATIC
+BOOLEAN
+FreezeNmiCallback(_In_opt_ PVOID Context, _In_ BOOLEAN Handled)
+{
+        UINT32 core = TopologyCurrentIndex();
+
+        UNREFERENCED_PARAMETER(Context);
+        UNREFERENCED_PARAMETER(Handled);
+
+        if (!FreezeClaimSignal(&freeze_state, core))
+                return FALSE;
+
+        FreezePark(&freeze_state, core, 0);
+        return TRUE;
+}
+
+BOOLEAN
+FreezeIsEnabled()
+{
+        return freeze_enabled;
+}
+
+/*
+ * Must be called after CapInitialise, and before any vmcs is written, as
+ * stopping the world needs NMI exiting in the template. Failing here is not
+ * fatal, we simply run without it.
+ */
+NTSTATUS
+FreezeInitialise()
+{
+        const VMX_CAPABILITIES* cap      = CapGetCapabilities();
+        IA32_APIC_BASE_REGISTER apic     = {.AsUInt = cap->apic_base};
+        PHYSICAL_ADDRESS        physical = {0};
+        UINT32                  count    = 0;
+
+        if (!CapHasLocalApic(cap) ||
+            !((cap->pinbased_ctls >> 32) &
+              IA32_VMX_PINBASED_CTLS_NMI_EXITING_FLAG))
+                return STATUS_NOT_SUPPORTED;
+
+        /* indexed by TopologyCurrentIndex, which never reaches this */
+        count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+        freeze_cores = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                       count * sizeof(FREEZE_CORE),
+                                       POOL_TAG_FREEZE);
+
+        if (!freeze_cores)
+                return STATUS_MEMORY_NOT_ALLOCATED;
+
+        if (!CapIsX2ApicEnabled(cap)) {
+                physical.QuadPart = apic.ApicBase << PAGE_SHIFT;
+                freeze_apic       = MmMapIoSpaceEx(
+                    physical, PAGE_SIZE, PAGE_READWRITE | PAGE_NOCACHE);
+
+                if (!freeze_apic) {
+                        FreezeFree();
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+        }
+
+        FreezeInitialiseState(&freeze_state, freeze_cores, count);
+
+        freeze_nmi_callback = KeRegisterNmiCallback(FreezeNmiCallback, NULL);
+
+        if (!freeze_nmi_callback) {
+                FreezeFree();
+                return STATUS_UNSUCCESSFUL;
+        }
+
+        freeze_enabled = TRUE;
+        return STATUS_SUCCESS;
+}
+
+/* Must be called once no core is in VMX operation any more. */
+VOID
+FreezeFree()
+{
+        freeze_enabled = FALSE;
+
+        if (freeze_nmi_callback) {
+                KeDeregisterNmiCallback(freeze_nmi_callback);
+                freeze_nmi_callback = NULL;
+        }
+
+        if (freeze_apic) {
+                MmUnmapIoSpace((PVOID)freeze_apic, PAGE_SIZE);
+                freeze_apic = NULL;
+        }
+
+        if (freeze_cores) {
+                ExFreePoolWithTag(freeze_cores, POOL_TAG_FREEZE);
+                freeze_cores = NULL;
+        }
+}
+
+VOID
+FreezeWorld(_In_ UINT32 Core, _In_ UINT64 HoldCycles)
+{
+        UINT64 guest_rip = VmxVmRead(VMCS_GUEST_RIP);
+        UINT32 count     = TopologyVcpuCount();
+        UINT64 start     = 0;
+
+        if (!freeze_enabled || Core >= count)
+                return;
+
+        /* the freeze vmcall hands us this without the ioctl's check */
+        if (HoldCycles > HV_FREEZE_MAX_HOLD_CYCLES)
+                HoldCycles = HV_FREEZE_MAX_HOLD_CYCLES;
+
+        /*
+         * Two cores stopping at once each NMI the other, so whoever loses
+         * parks for the winner, and only then stops the world itself. The
+         * signal is left for its NMI to claim, which then finds us already
+         * parked.
+         */
+        while (!FreezeTryBegin(&freeze_state, Core, count)) {
+                FreezePark(&freeze_state, Core, guest_rip);
+                FREEZE_PAUSE();
+        }
+
+        freeze_state.cores[Core].guest_rip = guest_rip;
+
+        FreezeSendNmi();
+        FreezeWaitForCores(&freeze_state, count - 1, FREEZE_TIMEOUT_CYCLES);
+
+        start = __rdtsc();
+
+        while (__rdtsc() - start < HoldCycles)
+                FREEZE_PAUSE();
+
+        FreezeEnd(&freeze_state);
+}
+
+BOOLEAN
+FreezeHandleNmiExit(_In_ UINT32 Core, _In_ UINT64 GuestRip)
+{
+        if (!FreezeClaimSignal(&freeze_state, Core))
+                return FALSE;
+
+        FreezePark(&freeze_state, Core, GuestRip);
+        return TRUE;
+}
+
+/*
+ * Read without stopping anyone, so a stop in progress can show up half
+ * written.
+ */
+NTSTATUS
+FreezeQueryStatistics(_Out_ PHV_FREEZE_STATISTICS Statistics,
+                      _In_ UINT32                 Capacity)
+{
+        PFREEZE_STATISTICS statistics = &freeze_state.statistics;
+        UINT32             count      = TopologyVcpuCount();
+
+        if (!freeze_enabled)
+                return STATUS_NOT_SUPPORTED;
+
+        if (count > Capacity)
+                count = Capacity;
+
+        Statistics->stops         = statistics->stops;
+        Statistics->timeouts      = statistics->timeouts;
+        Statistics->total_latency = statistics->total_latency;
+        Statistics->min_latency   = statistics->min_latency;
+        Statistics->max_latency   = statistics->max_latency;
+        Statistics->last_latency  = statistics->last_latency;
+        Statistics->last_owner    = statistics->last_owner;
+        Statistics->last_parked   = statistics->last_parked;
+        Statistics->core_count    = count;
+        Statistics->reserved      = 0;
+
+        for (UINT32 index = 0; index < count; index++) {
+                Statistics->cores[index].arrival = freeze_cores[index].arrival;
+                Statistics->cores[index].guest_rip =
+                    freeze_cores[index].guest_rip;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef FREEZE_H
+#define FREEZE_H
+
+/*
+ * Stops every core but one, for as long as that core needs the rest of the
+ * system to hold still, i.e when a breakpoint is hit.
+ *
+ * The stopping core becomes the owner and bumps the generation to an odd
+ * value, then signals every other core with an NMI. Each core that takes it
+ * parks in VMX root, spinning on the generation, until the owner releases
+ * everyone at once by storing the next even generation. The generation and
+ * the number of cores parked for it share a single word, so a core arriving
+ * late for a generation that has already been released can never be counted
+ * towards the next one, and resuming also resets the count with that one
+ * store.
+ *
+ * Like lock.c the protocol only depends on a handful of atomic primitives,
+ * shimmed below so it can be stress tested in user mode, see tools/freeze.c.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#        define FREEZE_ATOMIC_COMPARE_EXCHANGE(Target, Exchange, Comparand) \
+                ((UINT64)InterlockedCompareExchange64(                      \
+                     (volatile LONG64*)(Target),                            \
+                     (LONG64)(Exchange),                                    \
+                     (LONG64)(Comparand)))
+#        define FREEZE_ATOMIC_COMPARE_EXCHANGE_32(Target, Exchange, Comparand) \
+                ((UINT32)InterlockedCompareExchange((volatile LONG*)(Target),  \
+                                                    (LONG)(Exchange),          \
+                                                    (LONG)(Comparand)))
+#        define FREEZE_ATOMIC_EXCHANGE_32(Target, Value)           \
+                ((UINT32)InterlockedExchange((volatile LONG*)(Target), \
+                                             (LONG)(Value)))
+#        define FREEZE_PAUSE()            YieldProcessor()
+#        define FREEZE_READ_TSC()         __rdtsc()
+#        define FREEZE_COMPILER_BARRIER() KeMemoryBarrierWithoutFence()
+#elif defined(_WIN32)
+#        include <windows.h>
+#        include <intrin.h>
+#        define FREEZE_ATOMIC_COMPARE_EXCHANGE(Target, Exchange, Comparand) \
+                ((UINT64)InterlockedCompareExchange64(                      \
+                     (volatile LONG64*)(Target),                            \
+                     (LONG64)(Exchange),                                    \
+                     (LONG64)(Comparand)))
+#        define FREEZE_ATOMIC_COMPARE_EXCHANGE_32(Target, Exchange, Comparand) \
+                ((UINT32)InterlockedCompareExchange((volatile LONG*)(Target),  \
+                                                    (LONG)(Exchange),          \
+                                                    (LONG)(Comparand)))
+#        define FREEZE_ATOMIC_EXCHANGE_32(Target, Value)           \
+                ((UINT32)InterlockedExchange((volatile LONG*)(Target), \
+                                             (LONG)(Value)))
+#        define FREEZE_PAUSE()            YieldProcessor()
+#        define FREEZE_READ_TSC()         __rdtsc()
+#        define FREEZE_COMPILER_BARRIER() _ReadWriteBarrier()
+#else
+#        include <stdint.h>
+#        include <x86intrin.h>
+typedef uint8_t  UINT8;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef void     VOID;
+typedef UINT8    BOOLEAN;
+#        define FREEZE_ATOMIC_COMPARE_EXCHANGE(Target, Exchange, Comparand) \
+                __sync_val_compare_and_swap((Target), (Comparand), (Exchange))
+#        define FREEZE_ATOMIC_COMPARE_EXCHANGE_32(Target, Exchange, Comparand) \
+                __sync_val_compare_and_swap((Target), (Comparand), (Exchange))
+#        define FREEZE_ATOMIC_EXCHANGE_32(Target, Value) \
+                __atomic_exchange_n((Target), (Value), __ATOMIC_ACQ_REL)
+#        define FREEZE_PAUSE()            _mm_pause()
+#        define FREEZE_READ_TSC()         __rdtsc()
+#        define FREEZE_COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+#        define TRUE                      1
+#        define FALSE                     0
+#        define _In_
+#        define _Out_
+#        define _Inout_
+#endif
+
+#if !defined(_KERNEL_MODE)
+#        define STATIC static
+#endif
+
+#define FREEZE_NO_OWNER 0xFFFFFFFF
+
+/* the arrival of a core that never parked for the last stop */
+#define FREEZE_NOT_PARKED 0xFFFFFFFFFFFFFFFFull
+
+#define FREEZE_GENERATION(Word) ((UINT32)((Word) >> 32))
+#define FREEZE_PARKED(Word)     ((UINT32)(Word))
+
+/* each core's slot on its own cache line, they are written as cores park */
+typedef struct _FREEZE_CORE {
+        /* set by the owner before it sends the NMI, see FreezeClaimSignal */
+        volatile UINT32 signalled;
+        /* the generation this core is parked for, or was last parked for */
+        volatile UINT32 parked_generation;
+        /* tsc cycles from the start of the last stop until this core parked */
+        UINT64          arrival;
+        UINT64          guest_rip;
+        UINT8           reserved[40];
+
+} FREEZE_CORE, *PFREEZE_CORE;
+
+/* only ever written by the owner of a stop, while it holds it */
+typedef struct _FREEZE_STATISTICS {
+        UINT64 stops;
+        /* stops where some core never parked in time */
+        UINT64 timeouts;
+        /*
+         * tsc cycles from the start of a stop until every core had parked,
+         * only for the stops that didn't time out
+         */
+        UINT64 total_latency;
+        UINT64 min_latency;
+        UINT64 max_latency;
+        UINT64 last_latency;
+        UINT32 last_owner;
+        UINT32 last_parked;
+
+} FREEZE_STATISTICS, *PFREEZE_STATISTICS;
+
+typedef struct _FREEZE_STATE {
+        /*
+         * The generation in the high half, odd while stopped, and the cores
+         * parked for it in the low half. Every parked core spins on it, so it
+         * gets a cache line to itself.
+         */
+        volatile UINT64   word;
+        UINT8             reserved[56];
+        volatile UINT32   owner;
+        UINT32            core_count;
+        UINT64            start;
+        PFREEZE_CORE      cores;
+        FREEZE_STATISTICS statistics;
+
+} FREEZE_STATE, *PFREEZE_STATE;
+
+VOID
+FreezeInitialiseState(_Out_ PFREEZE_STATE State,
+                      _In_ PFREEZE_CORE   Cores,
+                      _In_ UINT32         CoreCount);
+
+/*
+ * Makes Core the owner and starts a new stop, returning FALSE if another core
+ * already owns one. Every other core below CoreCount is marked as signalled,
+ * the caller then has to make sure each of them gets to FreezeClaimSignal.
+ */
+BOOLEAN
+FreezeTryBegin(_Inout_ PFREEZE_STATE State,
+               _In_ UINT32           Core,
+               _In_ UINT32           CoreCount);
+
+/*
+ * Called by the owner once the other cores have been signalled. Waits until
+ * Expected of them have parked, or TimeoutCycles have passed, and returns
+ * how many did.
+ */
+UINT32
+FreezeWaitForCores(_Inout_ PFREEZE_STATE State,
+                   _In_ UINT32           Expected,
+                   _In_ UINT64           TimeoutCycles);
+
+/* Releases every parked core with a single store and gives up ownership. */
+VOID
+FreezeEnd(_Inout_ PFREEZE_STATE State);
+
+/*
+ * Returns TRUE, and clears the signal, if Core was signalled by an owner.
+ * Anything that delivers the owners signal has to call this, an NMI for
+ * which it returns FALSE is not ours.
+ */
+BOOLEAN
+FreezeClaimSignal(_Inout_ PFREEZE_STATE State, _In_ UINT32 Core);
+
+/*
+ * Parks Core until the current stop ends, if there is one that Core doesn't
+ * own and hasn't already parked for, and returns whether it did. Safe to
+ * nest, i.e from an NMI taken while already parked.
+ */
+BOOLEAN
+FreezePark(_Inout_ PFREEZE_STATE State,
+           _In_ UINT32           Core,
+           _In_ UINT64           GuestRip);
+
+#if defined(_KERNEL_MODE)
+
+#        include "ioctl.h"
+
+/* how long a stop waits for every core before giving up on the stragglers */
+#        define FREEZE_TIMEOUT_CYCLES 0x40000000ull
+
+NTSTATUS
+FreezeInitialise();
+
+VOID
+FreezeFree();
+
+BOOLEAN
+FreezeIsEnabled();
+
+/*
+ * VMX root only. Stops every other core, holds them for HoldCycles, capped
+ * at HV_FREEZE_MAX_HOLD_CYCLES, then resumes them. If another core is already
+ * stopping the world this core parks for it first.
+ */
+VOID
+FreezeWorld(_In_ UINT32 Core, _In_ UINT64 HoldCycles);
+
+/*
+ * VMX root only, from an NMI exit. Returns FALSE if the NMI isn't ours and
+ * has to be reflected back into the guest.
+ */
+BOOLEAN
+FreezeHandleNmiExit(_In_ UINT32 Core, _In_ UINT64 GuestRip);
+
+NTSTATUS
+FreezeQueryStatistics(_Out_ PHV_FREEZE_STATISTICS Statistics,
+                      _In_ UINT32                 Capacity);
+
+#endif
+
+#endif
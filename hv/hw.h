@@ -0,0 +1,109 @@
+#ifndef HW_H
+#define HW_H
+
+/*
+ * Every access the exit handlers and vmcs setup make to the processor goes
+ * through the accessors below. In the driver they are the compiler intrinsics
+ * and cost nothing. In user mode they are plain functions backed by an in
+ * memory vmcs and a virtual msr, control and debug register file, see
+ * tools/hwsim.c, so code built on top of them can run without VT-x.
+ *
+ * Defining HWSIM alongside _KERNEL_MODE takes the user mode accessors for the
+ * whole driver, built against ntshim.h rather than the WDK with tools/ntsim.c
+ * standing in for the kernel.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#else
+#        include <stdint.h>
+typedef int32_t INT32;
+#        define STATIC static
+#        define VOID   void
+#        define _In_
+#        define _Out_
+#        define _Inout_
+#        define _In_opt_
+#        define _Inout_opt_
+#endif
+
+#include "ia32.h"
+
+#if defined(_KERNEL_MODE) && !defined(HWSIM)
+
+#        define HwReadMsr(Msr)         __readmsr(Msr)
+#        define HwWriteMsr(Msr, Value) __writemsr((Msr), (Value))
+#        define HwCpuidEx(Registers, Leaf, Subleaf) \
+                __cpuidex((INT32*)(Registers), (Leaf), (Subleaf))
+#        define HwReadCr0()           __readcr0()
+#        define HwReadCr3()           __readcr3()
+#        define HwReadCr4()           __readcr4()
+#        define HwReadCr8()           __readcr8()
+#        define HwWriteCr3(Value)     __writecr3(Value)
+#        define HwWriteCr4(Value)     __writecr4(Value)
+#        define HwWriteCr8(Value)     __writecr8(Value)
+#        define HwReadDr(Dr)          __readdr(Dr)
+#        define HwWriteDr(Dr, Value)  __writedr((Dr), (Value))
+
+/* group relative, the same as KeGetCurrentProcessorNumberEx */
+static __inline VOID
+HwCurrentProcessor(_Out_ UINT16* Group, _Out_ UINT8* Number)
+{
+        PROCESSOR_NUMBER number = {0};
+
+        KeGetCurrentProcessorNumberEx(&number);
+
+        *Group  = number.Group;
+        *Number = number.Number;
+}
+
+#else
+
+UINT64
+HwReadMsr(_In_ UINT32 Msr);
+
+VOID
+HwWriteMsr(_In_ UINT32 Msr, _In_ UINT64 Value);
+
+VOID
+HwCpuidEx(_Out_ INT32* Registers, _In_ INT32 Leaf, _In_ INT32 Subleaf);
+
+UINT64
+HwReadCr0();
+
+UINT64
+HwReadCr3();
+
+UINT64
+HwReadCr4();
+
+UINT64
+HwReadCr8();
+
+VOID
+HwWriteCr3(_In_ UINT64 Value);
+
+VOID
+HwWriteCr4(_In_ UINT64 Value);
+
+VOID
+HwWriteCr8(_In_ UINT64 Value);
+
+UINT64
+HwReadDr(_In_ UINT32 Dr);
+
+VOID
+HwWriteDr(_In_ UINT32 Dr, _In_ UINT64 Value);
+
+VOID
+HwCurrentProcessor(_Out_ UINT16* Group, _Out_ UINT8* Number);
+
+/* in the driver these live in vmcs.c and wrap vmread and vmwrite */
+UINT64
+VmxVmRead(_In_ UINT64 VmcsField);
+
+VOID
+VmxVmWrite(_In_ UINT64 VmcsField, _In_ UINT64 Value);
+
+#endif
+
+#endif
@@ -0,0 +1,616 @@
+#ifndef IOCTL_H
+#define IOCTL_H
+
+/*
+ * Interface between the driver and its user mode tools. Like trace.h this
+ * header is shared with user mode, so it must not pull in any kernel only
+ * headers.
+ */
+#include "trace.h"
+#include "cond.h"
+
+#if defined(_WIN32) && !defined(_KERNEL_MODE)
+#        include <winioctl.h>
+#endif
+
+#ifndef CTL_CODE
+#        define FILE_DEVICE_UNKNOWN 0x00000022
+#        define METHOD_BUFFERED     0
+#        define FILE_ANY_ACCESS     0
+#        define CTL_CODE(DeviceType, Function, Method, Access) \
+                (((DeviceType) << 16) | ((Access) << 14) |      \
+                 ((Function) << 2) | (Method))
+#endif
+
+#define HV_DEVICE_PATH "\\\\.\\hv-link"
+
+/*
+ * Maps the trace ring of every core read only into the calling process.
+ *
+ * Input:  HV_LOG_MAP_REQUEST
+ * Output: HV_LOG_MAP_RESPONSE, sized with HV_LOG_MAP_RESPONSE_SIZE
+ *
+ * Only a single consumer can have the rings mapped at any one time. The
+ * mapping is torn down when the handle used to create it is closed, when
+ * IOCTL_HV_UNMAP_LOG_RINGS is issued or when VMX operation is terminated.
+ */
+#define IOCTL_HV_MAP_LOG_RINGS \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_HV_UNMAP_LOG_RINGS \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_LOG_MAP_REQUEST {
+        /*
+         * Optional handle to an event owned by the caller. While the rings are
+         * mapped, it is signalled whenever new records have been committed to
+         * any of them. Pass 0 to poll the ring headers instead.
+         */
+        UINT64 event;
+
+} HV_LOG_MAP_REQUEST, *PHV_LOG_MAP_REQUEST;
+
+typedef struct _HV_LOG_MAP_RESPONSE {
+        UINT32 ring_count;
+        UINT32 reserved;
+        /*
+         * user mode address of each cores TRACE_RING_HEADER, or 0 for cores
+         * that were left unvirtualised
+         */
+        UINT64 rings[1];
+
+} HV_LOG_MAP_RESPONSE, *PHV_LOG_MAP_RESPONSE;
+
+#define HV_LOG_MAP_RESPONSE_SIZE(RingCount)             \
+        (sizeof(HV_LOG_MAP_RESPONSE) - sizeof(UINT64) + \
+         (UINT64)(RingCount) * sizeof(UINT64))
+
+/* matches TOPOLOGY_MAX_GROUPS */
+#define HV_MAX_PROCESSOR_GROUPS 32
+
+/*
+ * Reports which cores are currently in VMX operation. Cores listed in the
+ * ExcludedProcessors registry value are never virtualised, and neither is a
+ * core that failed to enter VMX operation.
+ *
+ * Output: HV_VIRTUALISED_CORES
+ */
+#define IOCTL_HV_QUERY_VIRTUALISED_CORES \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_VIRTUALISED_CORES {
+        UINT32 core_count;
+        UINT32 virtualised_count;
+        UINT32 group_count;
+        UINT32 reserved;
+        /*
+         * one affinity mask per processor group, bit n is set if the group
+         * relative processor n is virtualised
+         */
+        UINT64 virtualised[HV_MAX_PROCESSOR_GROUPS];
+
+} HV_VIRTUALISED_CORES, *PHV_VIRTUALISED_CORES;
+
+/*
+ * Takes a single core out of VMX operation, or puts a core previously taken
+ * out back in. The core is identified by its index, i.e the same index the
+ * log rings and CPUID leaf 0x40000001 use. Excluded cores cannot be changed.
+ *
+ * A core taken out of VMX operation is put back in when the system resumes
+ * from sleep.
+ *
+ * Input: HV_CORE_STATE_REQUEST
+ */
+#define IOCTL_HV_SET_CORE_STATE \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_CORE_STATE_REQUEST {
+        UINT32 core;
+        /* non zero to virtualise the core, zero to devirtualise it */
+        UINT32 virtualise;
+
+} HV_CORE_STATE_REQUEST, *PHV_CORE_STATE_REQUEST;
+
+/*
+ * Starts or stops recording an EXIT_TRACE_RECORD for every vm-exit. Each core
+ * gets its own exit ring the first time recording is enabled, which is kept
+ * until VMX operation is terminated. Recording is stopped whenever the log
+ * rings are torn down, i.e on sleep.
+ *
+ * Input: HV_EXIT_RECORDING_REQUEST
+ */
+#define IOCTL_HV_SET_EXIT_RECORDING \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_EXIT_RECORDING_REQUEST {
+        UINT32 enable;
+        UINT32 reserved;
+
+} HV_EXIT_RECORDING_REQUEST, *PHV_EXIT_RECORDING_REQUEST;
+
+/*
+ * Copies the records at or after cursor out of a single cores exit ring. The
+ * response holds as many records as fit in the output buffer, along with the
+ * cursor to pass in on the next call and the number of records that were
+ * overwritten before they could be read.
+ *
+ * Input:  HV_EXIT_TRACE_READ_REQUEST
+ * Output: HV_EXIT_TRACE_READ_RESPONSE, sized with
+ *         HV_EXIT_TRACE_READ_RESPONSE_SIZE
+ */
+#define IOCTL_HV_READ_EXIT_TRACE \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_EXIT_TRACE_READ_REQUEST {
+        UINT32 core;
+        UINT32 reserved;
+        UINT64 cursor;
+
+} HV_EXIT_TRACE_READ_REQUEST, *PHV_EXIT_TRACE_READ_REQUEST;
+
+typedef struct _HV_EXIT_TRACE_READ_RESPONSE {
+        UINT64            cursor;
+        UINT64            lost;
+        UINT32            record_count;
+        UINT32            reserved;
+        EXIT_TRACE_RECORD records[1];
+
+} HV_EXIT_TRACE_READ_RESPONSE, *PHV_EXIT_TRACE_READ_RESPONSE;
+
+#define HV_EXIT_TRACE_READ_RESPONSE_SIZE(RecordCount)           \
+        (sizeof(HV_EXIT_TRACE_READ_RESPONSE) -                   \
+         sizeof(EXIT_TRACE_RECORD) +                             \
+         (UINT64)(RecordCount) * sizeof(EXIT_TRACE_RECORD))
+
+/*
+ * Operations timed by IOCTL_HV_RUN_EXIT_BENCHMARK. NONE times an empty pair
+ * of tsc reads, i.e the overhead included in every other sample. The msr
+ * operations use IA32_TSC_AUX, which is written back with the value read.
+ */
+typedef enum _HV_EXIT_BENCHMARK_OPERATION {
+        HV_EXIT_BENCHMARK_NONE,
+        HV_EXIT_BENCHMARK_CPUID,
+        HV_EXIT_BENCHMARK_CPUID_HYPERVISOR,
+        HV_EXIT_BENCHMARK_VMCALL_PING,
+        HV_EXIT_BENCHMARK_RDMSR,
+        HV_EXIT_BENCHMARK_WRMSR,
+        HV_EXIT_BENCHMARK_PORT_IO,
+        HV_EXIT_BENCHMARK_CR8_READ,
+        HV_EXIT_BENCHMARK_CR8_WRITE,
+        HV_EXIT_BENCHMARK_OPERATION_COUNT
+
+} HV_EXIT_BENCHMARK_OPERATION;
+
+#define HV_EXIT_BENCHMARK_MAX_SAMPLES 0x10000
+
+/*
+ * Executes an operation from kernel mode on the calling thread's current
+ * core, once per sample, and returns the tsc cycles each execution took. The
+ * number of samples is the output buffer length divided by sizeof(UINT32), up
+ * to HV_EXIT_BENCHMARK_MAX_SAMPLES. The caller should pin itself to a single
+ * core first.
+ *
+ * Input:  HV_EXIT_BENCHMARK_REQUEST
+ * Output: UINT32 cycles[]
+ */
+#define IOCTL_HV_RUN_EXIT_BENCHMARK \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_EXIT_BENCHMARK_REQUEST {
+        UINT32 operation;
+        UINT32 reserved;
+
+} HV_EXIT_BENCHMARK_REQUEST, *PHV_EXIT_BENCHMARK_REQUEST;
+
+/*
+ * Starts or stops attributing every vm-exit to its (guest rip, exit reason)
+ * pair in a per core heavy hitters sketch, see sketch.h. Sketches are
+ * allocated the first time profiling is enabled, reset discards everything
+ * counted so far. Like exit recording, profiling is stopped whenever the log
+ * rings are torn down.
+ *
+ * Input: HV_EXIT_PROFILING_REQUEST
+ */
+#define IOCTL_HV_SET_EXIT_PROFILING \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_EXIT_PROFILING_REQUEST {
+        UINT32 enable;
+        UINT32 reset;
+
+} HV_EXIT_PROFILING_REQUEST, *PHV_EXIT_PROFILING_REQUEST;
+
+/*
+ * Returns the top exit causing instructions of a single core, highest count
+ * first, as many as fit in the output buffer. Each count overestimates the
+ * true number of exits by at most error. Merging cores is left to the caller.
+ *
+ * Input:  HV_EXIT_HOTSPOTS_REQUEST
+ * Output: HV_EXIT_HOTSPOTS, sized with HV_EXIT_HOTSPOTS_SIZE
+ */
+#define IOCTL_HV_QUERY_EXIT_HOTSPOTS \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_EXIT_HOTSPOTS_REQUEST {
+        UINT32 core;
+        UINT32 reserved;
+
+} HV_EXIT_HOTSPOTS_REQUEST, *PHV_EXIT_HOTSPOTS_REQUEST;
+
+typedef struct _HV_EXIT_HOTSPOT {
+        UINT64 guest_rip;
+        UINT64 count;
+        UINT64 error;
+        UINT32 reason;
+        UINT32 reserved;
+
+} HV_EXIT_HOTSPOT, *PHV_EXIT_HOTSPOT;
+
+typedef struct _HV_EXIT_HOTSPOTS {
+        /* every exit counted on this core, not just those returned */
+        UINT64          total;
+        UINT32          hotspot_count;
+        UINT32          reserved;
+        HV_EXIT_HOTSPOT hotspots[1];
+
+} HV_EXIT_HOTSPOTS, *PHV_EXIT_HOTSPOTS;
+
+#define HV_EXIT_HOTSPOTS_SIZE(HotspotCount)                     \
+        (sizeof(HV_EXIT_HOTSPOTS) - sizeof(HV_EXIT_HOTSPOT) +    \
+         (UINT64)(HotspotCount) * sizeof(HV_EXIT_HOTSPOT))
+
+/*
+ * Starts or stops attributing the exits of every core, along with the root
+ * mode cycles spent handling them, to the guest cr3 they were taken with.
+ * Behaves like IOCTL_HV_SET_EXIT_PROFILING otherwise.
+ *
+ * Input: HV_CR3_ACCOUNTING_REQUEST
+ */
+#define IOCTL_HV_SET_CR3_ACCOUNTING \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_CR3_ACCOUNTING_REQUEST {
+        UINT32 enable;
+        UINT32 reset;
+
+} HV_CR3_ACCOUNTING_REQUEST, *PHV_CR3_ACCOUNTING_REQUEST;
+
+typedef struct _HV_CR3_ACCOUNTING_ENTRY {
+        /* page directory base, without the pcid */
+        UINT64 cr3;
+        UINT64 exits;
+        UINT64 cycles;
+
+} HV_CR3_ACCOUNTING_ENTRY, *PHV_CR3_ACCOUNTING_ENTRY;
+
+/*
+ * Returns the accounting of every core merged by cr3, in no particular
+ * order. Address spaces that don't fit in the output buffer, or that a core
+ * had no room for, are summed into overflow.
+ *
+ * Output: HV_CR3_ACCOUNTING, sized with HV_CR3_ACCOUNTING_SIZE
+ */
+#define IOCTL_HV_QUERY_CR3_ACCOUNTING \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_CR3_ACCOUNTING {
+        UINT32                  entry_count;
+        UINT32                  reserved;
+        HV_CR3_ACCOUNTING_ENTRY overflow;
+        HV_CR3_ACCOUNTING_ENTRY entries[1];
+
+} HV_CR3_ACCOUNTING, *PHV_CR3_ACCOUNTING;
+
+#define HV_CR3_ACCOUNTING_SIZE(EntryCount)                          \
+        (sizeof(HV_CR3_ACCOUNTING) - sizeof(HV_CR3_ACCOUNTING_ENTRY) + \
+         (UINT64)(EntryCount) * sizeof(HV_CR3_ACCOUNTING_ENTRY))
+
+/*
+ * Returns the kernel page directory base of a process, so the entries
+ * returned by IOCTL_HV_QUERY_CR3_ACCOUNTING can be matched to processes.
+ * With kva shadowing enabled, exits taken in user mode are accounted to the
+ * processes user page directory, which this does not return.
+ *
+ * Input:  HV_PROCESS_CR3_REQUEST
+ * Output: HV_PROCESS_CR3_RESPONSE
+ */
+#define IOCTL_HV_QUERY_PROCESS_CR3 \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_PROCESS_CR3_REQUEST {
+        UINT64 process_id;
+
+} HV_PROCESS_CR3_REQUEST, *PHV_PROCESS_CR3_REQUEST;
+
+typedef struct _HV_PROCESS_CR3_RESPONSE {
+        UINT64 cr3;
+
+} HV_PROCESS_CR3_RESPONSE, *PHV_PROCESS_CR3_RESPONSE;
+
+/* also scan the guests kernel stack for return addresses on every sample */
+#define HV_SAMPLING_STACKS 0x1
+
+/*
+ * Shortest interval accepted, in tsc cycles. Anything much shorter would
+ * leave the guest spending most of its time in the sample handler.
+ */
+#define HV_SAMPLING_MIN_INTERVAL 0x20000
+
+/*
+ * Arms the vmx preemption timer of every virtualised core to expire every
+ * interval tsc cycles of guest execution, writing a SAMPLE_RECORD to the
+ * cores sample ring each time. An interval of 0 stops sampling. The timer
+ * only counts down while the guest runs, so time spent in root mode is never
+ * sampled. Sampling is stopped by a sleep transition.
+ *
+ * Input: HV_SAMPLING_REQUEST
+ */
+#define IOCTL_HV_SET_SAMPLING \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_SAMPLING_REQUEST {
+        UINT64 interval;
+        UINT32 flags;
+        UINT32 reserved;
+
+} HV_SAMPLING_REQUEST, *PHV_SAMPLING_REQUEST;
+
+/*
+ * Copies the samples at or after cursor out of a single cores sample ring,
+ * the same way IOCTL_HV_READ_EXIT_TRACE does for exit records.
+ *
+ * Input:  HV_SAMPLE_READ_REQUEST
+ * Output: HV_SAMPLE_READ_RESPONSE, sized with HV_SAMPLE_READ_RESPONSE_SIZE
+ */
+#define IOCTL_HV_READ_SAMPLES \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_SAMPLE_READ_REQUEST {
+        UINT32 core;
+        UINT32 reserved;
+        UINT64 cursor;
+
+} HV_SAMPLE_READ_REQUEST, *PHV_SAMPLE_READ_REQUEST;
+
+typedef struct _HV_SAMPLE_READ_RESPONSE {
+        UINT64        cursor;
+        UINT64        lost;
+        UINT32        record_count;
+        UINT32        reserved;
+        SAMPLE_RECORD records[1];
+
+} HV_SAMPLE_READ_RESPONSE, *PHV_SAMPLE_READ_RESPONSE;
+
+#define HV_SAMPLE_READ_RESPONSE_SIZE(RecordCount)                \
+        (sizeof(HV_SAMPLE_READ_RESPONSE) - sizeof(SAMPLE_RECORD) + \
+         (UINT64)(RecordCount) * sizeof(SAMPLE_RECORD))
+
+/* matches EPT_MAX_BREAKPOINTS */
+#define HV_MAX_BREAKPOINTS 1024
+
+/*
+ * Stop every other core for each hit, as IOCTL_HV_FREEZE does, so where they
+ * all were at the time shows up in IOCTL_HV_QUERY_FREEZE.
+ */
+#define HV_BREAKPOINT_FLAG_FREEZE 0x1
+
+/*
+ * Start a step trace on the core that hits it, as armed by
+ * IOCTL_HV_SET_STEP_TRACE. Hits while the tracer is disarmed, or the core is
+ * already tracing, are only counted.
+ */
+#define HV_BREAKPOINT_FLAG_TRACE 0x2
+
+/*
+ * Sets or clears an execute breakpoint on a kernel virtual address. The page
+ * holding it is locked in memory and made non executable through EPT, and
+ * every time the guest executes the instruction at address the breakpoints
+ * hit count goes up. Any other instruction on the same page is single
+ * stepped, which costs two exits, so breakpoints are best kept off pages
+ * that are executed in tight loops. flags only applies when setting one.
+ *
+ * Fails with STATUS_NOT_SUPPORTED if the processor lacks the EPT features
+ * we rely on, or HV_BREAKPOINT_FLAG_FREEZE is asked for and NMI exiting
+ * isn't available, or HV_BREAKPOINT_FLAG_TRACE and the monitor trap flag
+ * isn't.
+ *
+ * Input: HV_BREAKPOINT_REQUEST
+ */
+#define IOCTL_HV_SET_BREAKPOINT \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_BREAKPOINT_REQUEST {
+        UINT64 address;
+        UINT32 enable;
+        /* HV_BREAKPOINT_FLAG_* */
+        UINT32 flags;
+
+} HV_BREAKPOINT_REQUEST, *PHV_BREAKPOINT_REQUEST;
+
+/*
+ * Attaches a condition, compiled by tools/condcompile.c, to a breakpoint that
+ * is already set, or removes it if program has no instructions. The driver
+ * verifies the program and then evaluates it in VMX root on every hit, against
+ * the guest's registers at the breakpoint, and only counts the hit if it
+ * holds. A condition can only read resident kernel memory, a read of anything
+ * else faults it and the hit is counted as a fault instead. Setting or
+ * removing a condition zeroes the breakpoints counters.
+ *
+ * Fails with STATUS_INVALID_PARAMETER if the program doesn't verify.
+ *
+ * Input: HV_BREAKPOINT_CONDITION_REQUEST
+ */
+#define IOCTL_HV_SET_BREAKPOINT_CONDITION \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x810, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_BREAKPOINT_CONDITION_REQUEST {
+        UINT64       address;
+        COND_PROGRAM program;
+
+} HV_BREAKPOINT_CONDITION_REQUEST, *PHV_BREAKPOINT_CONDITION_REQUEST;
+
+/*
+ * Every breakpoint that is currently set, along with the number of
+ * instructions single stepped on their pages.
+ *
+ * Output: HV_BREAKPOINTS, sized with HV_BREAKPOINTS_SIZE
+ */
+#define IOCTL_HV_QUERY_BREAKPOINTS \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_BREAKPOINT {
+        UINT64 address;
+        UINT64 physical;
+        UINT64 hits;
+        /* hits whose condition was false, and that faulted evaluating it */
+        UINT64 misses;
+        UINT64 faults;
+        UINT32 conditional;
+        UINT32 flags;
+
+} HV_BREAKPOINT, *PHV_BREAKPOINT;
+
+typedef struct _HV_BREAKPOINTS {
+        UINT32        breakpoint_count;
+        UINT32        reserved;
+        UINT64        steps;
+        HV_BREAKPOINT breakpoints[1];
+
+} HV_BREAKPOINTS, *PHV_BREAKPOINTS;
+
+#define HV_BREAKPOINTS_SIZE(BreakpointCount)              \
+        (sizeof(HV_BREAKPOINTS) - sizeof(HV_BREAKPOINT) + \
+         (UINT64)(BreakpointCount) * sizeof(HV_BREAKPOINT))
+
+/*
+ * Longest a stop can be held for, in tsc cycles. Every other core spins in
+ * root with interrupts disabled for the duration, so this is kept well below
+ * anything that would trip a watchdog.
+ */
+#define HV_FREEZE_MAX_HOLD_CYCLES 0x4000000ull
+
+/*
+ * Stops every other virtualised core from the calling one, holds them in VMX
+ * root for hold_cycles and then resumes them all at once. The other cores are
+ * signalled with an NMI, so they stop within a few microseconds wherever they
+ * happen to be, and where that was is reported by IOCTL_HV_QUERY_FREEZE.
+ *
+ * Fails with STATUS_NOT_SUPPORTED if NMI exiting isn't available, and with
+ * STATUS_DEVICE_NOT_READY if the calling core isn't virtualised.
+ *
+ * Input: HV_FREEZE_REQUEST
+ */
+#define IOCTL_HV_FREEZE \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x811, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_FREEZE_REQUEST {
+        UINT64 hold_cycles;
+
+} HV_FREEZE_REQUEST, *PHV_FREEZE_REQUEST;
+
+/*
+ * Stop latency, in tsc cycles from the owner starting a stop until the last
+ * core parked, over every stop so far, including those from breakpoints with
+ * HV_BREAKPOINT_FLAG_FREEZE. The cores are as of the last stop.
+ *
+ * Output: HV_FREEZE_STATISTICS, sized with HV_FREEZE_STATISTICS_SIZE
+ */
+#define IOCTL_HV_QUERY_FREEZE \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x812, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/* arrival is HV_FREEZE_NOT_PARKED for a core that didn't park in time */
+#define HV_FREEZE_NOT_PARKED 0xFFFFFFFFFFFFFFFFull
+
+typedef struct _HV_FREEZE_CORE {
+        /* tsc cycles from the start of the stop until this core parked */
+        UINT64 arrival;
+        /* 0 if the NMI was taken in root, rather than the guest */
+        UINT64 guest_rip;
+
+} HV_FREEZE_CORE, *PHV_FREEZE_CORE;
+
+typedef struct _HV_FREEZE_STATISTICS {
+        UINT64         stops;
+        /* stops where some core never parked, left out of the latencies */
+        UINT64         timeouts;
+        UINT64         total_latency;
+        UINT64         min_latency;
+        UINT64         max_latency;
+        UINT64         last_latency;
+        UINT32         last_owner;
+        UINT32         last_parked;
+        UINT32         core_count;
+        UINT32         reserved;
+        HV_FREEZE_CORE cores[1];
+
+} HV_FREEZE_STATISTICS, *PHV_FREEZE_STATISTICS;
+
+#define HV_FREEZE_STATISTICS_SIZE(CoreCount)                   \
+        (sizeof(HV_FREEZE_STATISTICS) - sizeof(HV_FREEZE_CORE) + \
+         (UINT64)(CoreCount) * sizeof(HV_FREEZE_CORE))
+
+/*
+ * Arms the step tracer for breakpoints with HV_BREAKPOINT_FLAG_TRACE, or
+ * disarms it if max_steps is 0. Either stops any trace already running at
+ * its next step.
+ *
+ * A trace records up to max_steps instructions after the breakpoint, stopping
+ * early if rip leaves [range_start, range_end) when range_end isn't 0, or if
+ * the ring fills up with records that haven't been read. register_mask picks
+ * the gprs kept in each record, see STEP_RECORD. If operand has instructions
+ * it is evaluated, like a breakpoint condition, against every record's
+ * registers and the qword at the resulting address is kept as well, i.e
+ * "rsp" follows the top of the stack.
+ *
+ * Fails with STATUS_INVALID_PARAMETER if the request doesn't pass
+ * StepValidateRequest, and STATUS_NOT_SUPPORTED if the monitor trap flag
+ * isn't available.
+ *
+ * Input: HV_STEP_TRACE_REQUEST
+ */
+#define IOCTL_HV_SET_STEP_TRACE \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x813, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_STEP_TRACE_REQUEST {
+        UINT32       max_steps;
+        UINT32       register_mask;
+        UINT64       range_start;
+        UINT64       range_end;
+        COND_PROGRAM operand;
+
+} HV_STEP_TRACE_REQUEST, *PHV_STEP_TRACE_REQUEST;
+
+/*
+ * Copies the step records at or after cursor out of a single cores step ring,
+ * the same way IOCTL_HV_READ_SAMPLES does for samples. Reading also tells the
+ * tracer how far the reader has got, so a trace only stops for a full ring
+ * if its reader falls behind.
+ *
+ * Input:  HV_STEP_TRACE_READ_REQUEST
+ * Output: HV_STEP_TRACE_READ_RESPONSE, sized with
+ *         HV_STEP_TRACE_READ_RESPONSE_SIZE
+ */
+#define IOCTL_HV_READ_STEP_TRACE \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x814, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _HV_STEP_TRACE_READ_REQUEST {
+        UINT32 core;
+        UINT32 reserved;
+        UINT64 cursor;
+
+} HV_STEP_TRACE_READ_REQUEST, *PHV_STEP_TRACE_READ_REQUEST;
+
+typedef struct _HV_STEP_TRACE_READ_RESPONSE {
+        UINT64      cursor;
+        UINT64      lost;
+        UINT32      record_count;
+        UINT32      reserved;
+        STEP_RECORD records[1];
+
+} HV_STEP_TRACE_READ_RESPONSE, *PHV_STEP_TRACE_READ_RESPONSE;
+
+#define HV_STEP_TRACE_READ_RESPONSE_SIZE(RecordCount)                \
+        (sizeof(HV_STEP_TRACE_READ_RESPONSE) - sizeof(STEP_RECORD) + \
+         (UINT64)(RecordCount) * sizeof(STEP_RECORD))
+
+#endif
@@ -1,20 +1,78 @@
 #include "lock.h"
 
+/*
+ * Upper bound, in PAUSE iterations, of the delay between two reads of
+ * now_serving while waiting for our ticket.
+ */
+#define LOCK_MAX_BACKOFF 0x400
+
 VOID
 HighIrqlLockAcquire(_Inout_ PHIGH_IRQL_LOCK Lock)
 {
-        if (!InterlockedCompareExchange64(Lock, TRUE, FALSE))
-                YieldProcessor();
+        ULONG ticket  = LOCK_ATOMIC_FETCH_INCREMENT(&Lock->next_ticket);
+        ULONG backoff = 1;
+        ULONG waiting = 0;
+#if LOCK_STATISTICS
+        UINT64 start = 0;
+#endif
+
+        if (Lock->now_serving == ticket)
+                goto acquired;
+
+#if LOCK_STATISTICS
+        start = LOCK_READ_TSC();
+#endif
+
+        /*
+         * Every waiter polls now_serving, so back off exponentially to keep
+         * the cache line from bouncing between the waiters while the owner is
+         * trying to release it. Once we are next in line we poll every
+         * iteration instead so the hand off isn't delayed by our backoff.
+         */
+        while ((waiting = ticket - Lock->now_serving) != 0) {
+                if (waiting == 1) {
+                        LOCK_PAUSE();
+                        continue;
+                }
+
+                for (ULONG index = 0; index < backoff; index++)
+                        LOCK_PAUSE();
+
+                if (backoff < LOCK_MAX_BACKOFF)
+                        backoff <<= 1;
+        }
+
+#if LOCK_STATISTICS
+        Lock->statistics.contended++;
+        Lock->statistics.spin_cycles += LOCK_READ_TSC() - start;
+#endif
+
+acquired:
+        /* x64 doesn't reorder loads, only stop the compiler from doing so */
+        LOCK_COMPILER_BARRIER();
+#if LOCK_STATISTICS
+        Lock->statistics.acquisitions++;
+#endif
 }
 
 VOID
 HighIrqlLockRelease(_Inout_ PHIGH_IRQL_LOCK Lock)
 {
-        InterlockedExchange64(Lock, FALSE);
+        /*
+         * Only the owner ever writes to now_serving, the interlocked increment
+         * just gives us the release ordering for the protected data.
+         */
+        LOCK_ATOMIC_INCREMENT(&Lock->now_serving);
 }
 
 VOID
 HighIrqlLockInitialise(_Out_ PHIGH_IRQL_LOCK Lock)
 {
-        *Lock = 0;
-}
\ No newline at end of file
+        Lock->next_ticket = 0;
+        Lock->now_serving = 0;
+#if LOCK_STATISTICS
+        Lock->statistics.acquisitions = 0;
+        Lock->statistics.contended    = 0;
+        Lock->statistics.spin_cycles  = 0;
+#endif
+}
@@ -1,10 +1,89 @@
 #ifndef LOCK_H
 #define LOCK_H
 
-#include "common.h"
+/*
+ * The lock itself only depends on a handful of atomic primitives, which are
+ * shimmed below so lock.c can also be built in user mode, see
+ * tools/lockbench.c.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#        define LOCK_ATOMIC_FETCH_INCREMENT(Target) \
+                (InterlockedIncrement((volatile LONG*)(Target)) - 1)
+#        define LOCK_ATOMIC_INCREMENT(Target) \
+                InterlockedIncrement((volatile LONG*)(Target))
+#        define LOCK_PAUSE()            YieldProcessor()
+#        define LOCK_READ_TSC()         __rdtsc()
+#        define LOCK_COMPILER_BARRIER() KeMemoryBarrierWithoutFence()
+#elif defined(_WIN32)
+#        include <windows.h>
+#        include <intrin.h>
+#        define LOCK_ATOMIC_FETCH_INCREMENT(Target) \
+                (InterlockedIncrement((volatile LONG*)(Target)) - 1)
+#        define LOCK_ATOMIC_INCREMENT(Target) \
+                InterlockedIncrement((volatile LONG*)(Target))
+#        define LOCK_PAUSE()            YieldProcessor()
+#        define LOCK_READ_TSC()         __rdtsc()
+#        define LOCK_COMPILER_BARRIER() _ReadWriteBarrier()
+#else
+#        include <stdint.h>
+#        include <x86intrin.h>
+typedef void     VOID;
+typedef int32_t  LONG;
+typedef uint32_t ULONG;
+typedef uint64_t UINT64;
+#        define LOCK_ATOMIC_FETCH_INCREMENT(Target) \
+                __atomic_fetch_add((Target), 1, __ATOMIC_ACQ_REL)
+#        define LOCK_ATOMIC_INCREMENT(Target) \
+                __atomic_add_fetch((Target), 1, __ATOMIC_RELEASE)
+#        define LOCK_PAUSE()            _mm_pause()
+#        define LOCK_READ_TSC()         __rdtsc()
+#        define LOCK_COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+#        define _In_
+#        define _Out_
+#        define _Inout_
+#endif
+
+/*
+ * Contention counters are compiled in for debug builds only, define
+ * LOCK_STATISTICS to override this.
+ */
+#if !defined(LOCK_STATISTICS)
+#        if defined(DEBUG)
+#                define LOCK_STATISTICS 1
+#        else
+#                define LOCK_STATISTICS 0
+#        endif
+#endif
+
+/*
+ * Only ever written to by the current owner of the lock, so they are plain
+ * counters and must only be read while holding the lock (or once every core
+ * is done with it).
+ */
+typedef struct _HIGH_IRQL_LOCK_STATISTICS {
+        UINT64 acquisitions;
+        /* acquisitions that had to wait for at least one other owner */
+        UINT64 contended;
+        UINT64 spin_cycles;
+
+} HIGH_IRQL_LOCK_STATISTICS, *PHIGH_IRQL_LOCK_STATISTICS;
+
+/*
+ * Object that represents a lock to be used at irql >= DISPATCH_LEVEL.
+ *
+ * This is a ticket lock: each acquirer takes the next ticket and waits until
+ * it is being served, so the lock is handed out in FIFO order and no core can
+ * be starved by another repeatedly winning the race for it.
+ */
+typedef struct _HIGH_IRQL_LOCK {
+        volatile ULONG next_ticket;
+        volatile ULONG now_serving;
+#if LOCK_STATISTICS
+        HIGH_IRQL_LOCK_STATISTICS statistics;
+#endif
 
-/* Object that represents a lock to be used at irql >= DISPATCH_LEVEL */
-typedef ULONG_PTR HIGH_IRQL_LOCK, *PHIGH_IRQL_LOCK;
+} HIGH_IRQL_LOCK, *PHIGH_IRQL_LOCK;
 
 /*
  * Its assumed that when these functions are called, the irql >= DISPATCH_LEVEL.
@@ -22,4 +101,4 @@ HighIrqlLockRelease(_Inout_ PHIGH_IRQL_LOCK Lock);
 VOID
 HighIrqlLockInitialise(_Out_ PHIGH_IRQL_LOCK Lock);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,18 +1,120 @@
 #include "log.h"
 
 #include "common.h"
+#include "topology.h"
+#include "vmcs.h"
+#include "cap.h"
 
-#include <ntstrsafe.h>
 #include <stdarg.h>
 
-/* flush them every 1 second */
-#define LOGS_FLUSH_TIMER_INVOKE_TIME 1000
+/*
+ * flush them every 100 milliseconds, this also bounds how long an exported
+ * ring can go without its consumer being signalled.
+ */
+#define LOGS_FLUSH_TIMER_INVOKE_TIME 100
+
+#define POOL_TAG_LOG_EXPORT 'xgol'
+
+STATIC CONST TRACE_FORMAT trace_formats[] = {
+    TRACE_FORMAT_TABLE(TRACE_FORMAT_INITIALISER)};
+
+typedef struct _LOG_EXPORT_MAPPING {
+        PMDL  mdl;
+        PVOID address;
+
+} LOG_EXPORT_MAPPING, *PLOG_EXPORT_MAPPING;
+
+/*
+ * State for the single user mode consumer the rings can be exported to. Every
+ * field is protected by lock, apart from event which is also read by the
+ * flush DPCs.
+ */
+typedef struct _LOG_EXPORT_STATE {
+        KGUARDED_MUTEX      lock;
+        BOOLEAN             enabled;
+        PFILE_OBJECT        owner;
+        PEPROCESS           process;
+        PKEVENT volatile    event;
+        UINT32              mapping_count;
+        PLOG_EXPORT_MAPPING mappings;
+
+} LOG_EXPORT_STATE, *PLOG_EXPORT_STATE;
+
+STATIC LOG_EXPORT_STATE log_export = {0};
+
+/*
+ * Read by every core on every exit, only written with the export lock held.
+ */
+STATIC volatile LONG exit_recording = FALSE;
+STATIC volatile LONG exit_profiling = FALSE;
+STATIC volatile LONG cr3_accounting = FALSE;
+
+/*
+ * A snapshot of a sketch or accounting table is only torn if its core exits
+ * while it is being copied, so a few attempts are plenty unless that core is
+ * in an exit storm.
+ */
+#define LOG_SNAPSHOT_ATTEMPTS 16
+
+PTRACE_RING_HEADER
+TraceRingAllocate(_In_ UINT32 Capacity,
+                  _In_ UINT32 RecordSize,
+                  _In_ UINT32 Core,
+                  _In_ UINT32 Tag)
+{
+        PTRACE_RING_HEADER ring = NULL;
+
+        /* the index to slot mapping relies on the capacity being a power of 2 */
+        if (!Capacity || Capacity & (Capacity - 1))
+                return NULL;
+
+        /*
+         * Round the allocation up to a whole number of pages, allocations of
+         * at least a page in size are page aligned which allows the ring to be
+         * mapped elsewhere without exposing any neighbouring pool memory.
+         */
+        ring = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                               ROUND_TO_PAGES(
+                                   TRACE_RING_SIZE(Capacity, RecordSize)),
+                               Tag);
+
+        if (!ring)
+                return NULL;
+
+        ring->head        = 0;
+        ring->capacity    = Capacity;
+        ring->record_size = RecordSize;
+        ring->core        = Core;
 
-#if DEBUG
+        return ring;
+}
+
+VOID
+TraceRingFree(_In_ PTRACE_RING_HEADER Ring, _In_ UINT32 Tag)
+{
+        ExFreePoolWithTag(Ring, Tag);
+}
+
+/*
+ * Returns the slot for the next record. The producer never waits for the
+ * consumer, so this always succeeds and the oldest record is overwritten once
+ * the ring is full. Only the core that owns the ring may call this.
+ */
+PVOID
+TraceRingReserve(_In_ PTRACE_RING_HEADER Ring)
+{
+        return TRACE_RING_RECORD(Ring, Ring->head);
+}
+
+VOID
+TraceRingCommit(_In_ PTRACE_RING_HEADER Ring)
+{
+        TraceRingPublish(Ring);
+}
 
 STATIC
 VOID
-LogFlushLogsDpcRoutine(_In_ PKDPC*    Dpc,
+LogFlushLogsDpcRoutine(_In_ PKDPC     Dpc,
                        _In_opt_ PVOID DeferredContext,
                        _In_opt_ PVOID SystemArgument1,
                        _In_opt_ PVOID SystemArgument2)
@@ -21,116 +123,1050 @@ LogFlushLogsDpcRoutine(_In_ PKDPC*    Dpc,
         UNREFERENCED_PARAMETER(SystemArgument1);
         UNREFERENCED_PARAMETER(SystemArgument2);
 
-        PVCPU_LOG_STATE log  = (PVCPU_LOG_STATE)DeferredContext;
-        UINT32          core = KeGetCurrentProcessorNumber();
-        KIRQL           irql = {0};
+        PVCPU_LOG_STATE log    = (PVCPU_LOG_STATE)DeferredContext;
+        PKEVENT         event  = log_export.event;
+        TRACE_RECORD    record = {0};
+        UINT64          head   = 0;
 
-        if (!log)
+        if (!log || !log->ring)
                 return;
 
-        HighIrqlLockAcquire(&log->lock);
+        /*
+         * While a user mode consumer has the rings mapped it reads them
+         * directly, all we need to do is let it know there is something new to
+         * read.
+         */
+        if (event) {
+                head = log->ring->head;
 
-        if (!log->current_log_count)
-                goto unlock;
+                if (head != log->signalled) {
+                        log->signalled = head;
+                        KeSetEvent(event, IO_NO_INCREMENT, FALSE);
+                }
 
-        for (UINT64 index = 0; index < log->current_log_count; index++) {
-                PCSTR string = (UINT64)log->log_buffer +
-                               index * VMX_INIDIVIDUAL_LOG_MAX_SIZE;
-                DEBUG_LOG("%s", string);
+                log->flushed = head;
+                return;
         }
 
-        RtlZeroMemory(log->log_buffer, VMX_LOG_BUFFER_SIZE);
-        log->current_log_count = 0;
+        while (TraceRingNextRecord(
+            log->ring, &log->flushed, &log->lost, &record)) {
+                if (record.format_id >= TRACE_FORMAT_COUNT)
+                        continue;
 
-unlock:
-        HighIrqlLockRelease(&log->lock);
+                /*
+                 * On x64 a va_list is simply a pointer to an array of 8 byte
+                 * argument slots, which is exactly how our arguments are stored
+                 * in the record.
+                 */
+                vDbgPrintExWithPrefix("hv-root: ",
+                                      DPFLTR_IHVDRIVER_ID,
+                                      0,
+                                      trace_formats[record.format_id].format,
+                                      (va_list)record.arguments);
+        }
 }
 
 VOID
 CleanupLoggerOnUnload(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
+        PVCPU_LOG_STATE log = &Vcpu->cold.log_state;
+
+        KeCancelTimer(&log->timer);
         KeFlushQueuedDpcs();
-        KeCancelTimer(&Vcpu->log_state.timer);
+
+        if (log->ring) {
+                TraceRingFree(log->ring, VMX_LOG_BUFFER_POOL_TAG);
+                log->ring = NULL;
+        }
+
+        if (log->exit_ring) {
+                TraceRingFree(log->exit_ring, VMX_EXIT_RING_POOL_TAG);
+                log->exit_ring = NULL;
+        }
+
+        if (log->exit_sketch) {
+                ExFreePoolWithTag(log->exit_sketch, VMX_EXIT_SKETCH_POOL_TAG);
+                log->exit_sketch = NULL;
+        }
+
+        if (log->cr3_accounting) {
+                ExFreePoolWithTag(log->cr3_accounting, VMX_ACCOUNTING_POOL_TAG);
+                log->cr3_accounting = NULL;
+        }
+
+        if (log->sample_ring) {
+                TraceRingFree(log->sample_ring, VMX_SAMPLE_RING_POOL_TAG);
+                log->sample_ring = NULL;
+        }
 }
 
 NTSTATUS
 InitialiseVcpuLogger(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        LARGE_INTEGER due_time            = {.QuadPart = ABSOLUTE(SECONDS(1))};
-        Vcpu->log_state.current_log_count = 0;
+        PVCPU_LOG_STATE log      = &Vcpu->cold.log_state;
+        LARGE_INTEGER   due_time = {.QuadPart = ABSOLUTE(SECONDS(1))};
 
-        HighIrqlLockInitialise(&Vcpu->log_state.lock);
+        log->flushed   = 0;
+        log->lost      = 0;
+        log->signalled = 0;
 
-        Vcpu->log_state.log_buffer = ExAllocatePool2(
-            POOL_FLAG_NON_PAGED, VMX_LOG_BUFFER_SIZE, VMX_LOG_BUFFER_POOL_TAG);
+        log->ring = TraceRingAllocate(VMX_LOG_RING_CAPACITY,
+                                      sizeof(TRACE_RECORD),
+                                      Vcpu->cold.index,
+                                      VMX_LOG_BUFFER_POOL_TAG);
 
-        if (!Vcpu->log_state.log_buffer)
+        if (!log->ring)
                 return STATUS_MEMORY_NOT_ALLOCATED;
 
-        KeInitializeDpc(
-            &Vcpu->log_state.dpc, LogFlushLogsDpcRoutine, &Vcpu->log_state);
+        KeInitializeDpc(&log->dpc, LogFlushLogsDpcRoutine, log);
 
         /*
-         * Set our timer to flush the logs every DUE_TIME_SECONDS amount, in
-         * this case lets stick with 1 second.
+         * Set our timer to flush the logs every LOGS_FLUSH_TIMER_INVOKE_TIME
+         * milliseconds, starting 1 second from now.
          */
-        KeInitializeTimer(&Vcpu->log_state.timer);
-        KeSetTimerEx(&Vcpu->log_state.timer,
-                     due_time,
-                     LOGS_FLUSH_TIMER_INVOKE_TIME,
-                     &Vcpu->log_state.dpc);
+        KeInitializeTimer(&log->timer);
+        KeSetTimerEx(
+            &log->timer, due_time, LOGS_FLUSH_TIMER_INVOKE_TIME, &log->dpc);
 
         return STATUS_SUCCESS;
 }
 
-BOOLEAN
-CheckToFlushLogs(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
+/*
+ * Called from VMX root at HIGH_LEVEL. This used to format the message into a
+ * fixed size text slot under a lock, now we simply store the format id and the
+ * raw arguments, leaving the formatting to whoever consumes the ring. Since
+ * only the current core ever writes to its own ring, no lock is required.
+ */
+VOID
+LogToBuffer(_In_ PVIRTUAL_MACHINE_STATE Vcpu, _In_ TRACE_FORMAT_ID FormatId, ...)
 {
-        return Vcpu->log_state.current_log_count == VMX_MAX_LOG_ENTRIES_COUNT
-                   ? TRUE
-                   : FALSE;
+        PVCPU_LOG_STATE log    = &Vcpu->cold.log_state;
+        PTRACE_RECORD   record = NULL;
+        va_list         args   = {0};
+
+        if (!log->ring || FormatId >= TRACE_FORMAT_COUNT)
+                return;
+
+        record                 = TraceRingReserve(log->ring);
+        record->timestamp      = __rdtsc();
+        record->format_id      = (UINT16)FormatId;
+        record->argument_count = (UINT8)trace_formats[FormatId].argument_count;
+
+        va_start(args, FormatId);
+
+        for (UINT32 index = 0; index < record->argument_count; index++)
+                record->arguments[index] = va_arg(args, UINT64);
+
+        va_end(args);
+
+        TraceRingCommit(log->ring);
 }
 
 /*
- * Since I can't be bothered to write my own "safe" implementation of vsprintf,
- * I am opting to use RtlStringCbVPrintfA. Now RtlStringCbVPrintfA according to
- * the documentation can only be run at IRQL = PASSIVE_LEVEL. However, DbgPrint
- * can be used at IRQL <= DIRQL and I am assuming it uses RtlStringCbVPrintfA to
- * convert the variadic arguments into the final string to be logged. However,
- * this is only true for non wide string arguments. Now I am not sure why this
- * can't be used at HIGH_LEVEL but I am risking it since this is not a
- * production ready project anyway and more for just fun and learning purposes.
+ * Called on entry to the exit dispatcher. Returns NULL unless exit recording
+ * is enabled, in which case the record is filled in with everything known up
+ * front and is committed by LogExitRecordEnd once the exit has been handled.
  */
+PEXIT_TRACE_RECORD
+LogExitRecordBegin(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                   _In_ UINT32                 Reason,
+                   _In_ PGUEST_CONTEXT         Context)
+{
+        PTRACE_RING_HEADER ring   = Vcpu->cold.log_state.exit_ring;
+        PEXIT_TRACE_RECORD record = NULL;
+
+        if (!exit_recording || !ring)
+                return NULL;
+
+        record                     = TraceRingReserve(ring);
+        record->reason             = Reason;
+        record->instruction_length =
+            (UINT32)VmxVmRead(VMCS_VMEXIT_INSTRUCTION_LENGTH);
+        record->qualification = VmxVmRead(VMCS_EXIT_QUALIFICATION);
+        record->guest_rip     = VmxVmRead(VMCS_GUEST_RIP);
+        record->guest_rflags  = VmxVmRead(VMCS_GUEST_RFLAGS);
+        record->cycles        = 0;
+        record->reserved      = 0;
+
+        RtlCopyMemory(record->gprs, &Context->rax, sizeof(record->gprs));
+
+        /* taken last so the cost of recording isn't counted in cycles */
+        record->timestamp = __rdtsc();
+        return record;
+}
+
 VOID
-LogToBuffer(PCSTR Format, ...)
+LogExitRecordEnd(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                 _In_ PEXIT_TRACE_RECORD     Record)
 {
-        PVCPU_LOG_STATE log =
-            &vmm_state[KeGetCurrentProcessorNumber()].log_state;
-        UINT64   destination = 0;
-        NTSTATUS status      = STATUS_UNSUCCESSFUL;
-        va_list  args        = {0};
+        UINT64 cycles = __rdtsc() - Record->timestamp;
 
-        HighIrqlLockAcquire(&log->lock);
+        Record->cycles = cycles > MAXUINT32 ? MAXUINT32 : (UINT32)cycles;
+        TraceRingCommit(Vcpu->cold.log_state.exit_ring);
+}
 
-        if (log->current_log_count >= VMX_MAX_LOG_ENTRIES_COUNT)
+/*
+ * Exit rings are allocated the first time recording is enabled rather than
+ * along with the log rings, as most loads never record a single exit. Only
+ * cores that have a log ring get one, so excluded cores are skipped.
+ */
+NTSTATUS
+LogSetExitRecording(_In_ BOOLEAN Enable)
+{
+        NTSTATUS        status = STATUS_SUCCESS;
+        PVCPU_LOG_STATE log    = NULL;
+
+        KeAcquireGuardedMutex(&log_export.lock);
+
+        if (!log_export.enabled || !vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        if (!Enable) {
+                InterlockedExchange(&exit_recording, FALSE);
                 goto end;
+        }
 
-        destination =
-            (UINT64)log->log_buffer +
-            (UINT64)log->current_log_count * VMX_INIDIVIDUAL_LOG_MAX_SIZE;
+        for (UINT32 core = 0; core < TopologyVcpuCount(); core++) {
+                log = &vmm_state[core].cold.log_state;
 
-        va_start(args, Format);
-        status = RtlStringCbVPrintfA(
-            destination, VMX_INIDIVIDUAL_LOG_MAX_SIZE, Format, args);
-        va_end(args);
+                if (!log->ring || log->exit_ring)
+                        continue;
+
+                log->exit_ring =
+                    TraceRingAllocate(VMX_EXIT_RING_CAPACITY,
+                                      sizeof(EXIT_TRACE_RECORD),
+                                      core,
+                                      VMX_EXIT_RING_POOL_TAG);
+
+                if (!log->exit_ring) {
+                        status = STATUS_MEMORY_NOT_ALLOCATED;
+                        goto end;
+                }
+        }
+
+        InterlockedExchange(&exit_recording, TRUE);
+
+end:
+        KeReleaseGuardedMutex(&log_export.lock);
+        return status;
+}
+
+/*
+ * Called on every exit. Only reads the guest rip once profiling is enabled,
+ * so the cost while disabled is a single load.
+ */
+VOID
+LogExitProfile(_In_ PVIRTUAL_MACHINE_STATE Vcpu, _In_ UINT32 Reason)
+{
+        PVCPU_LOG_STATE log = &Vcpu->cold.log_state;
+
+        if (!exit_profiling || !log->exit_sketch)
+                return;
+
+        if (log->exit_sketch_reset &&
+            InterlockedExchange(&log->exit_sketch_reset, FALSE))
+                SketchInitialise(log->exit_sketch);
+
+        SketchUpdate(log->exit_sketch, VmxVmRead(VMCS_GUEST_RIP), Reason);
+}
+
+/*
+ * Sketches are allocated lazily for the same reason as the exit rings. A
+ * sketch is never reset from here, as its core may be halfway through an
+ * update, instead the core resets it itself on its next profiled exit.
+ */
+NTSTATUS
+LogSetExitProfiling(_In_ BOOLEAN Enable, _In_ BOOLEAN Reset)
+{
+        NTSTATUS        status = STATUS_SUCCESS;
+        PVCPU_LOG_STATE log    = NULL;
+
+        KeAcquireGuardedMutex(&log_export.lock);
+
+        if (!log_export.enabled || !vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        if (!Enable) {
+                InterlockedExchange(&exit_profiling, FALSE);
+                goto end;
+        }
+
+        for (UINT32 core = 0; core < TopologyVcpuCount(); core++) {
+                log = &vmm_state[core].cold.log_state;
+
+                if (!log->ring)
+                        continue;
+
+                if (log->exit_sketch) {
+                        if (Reset)
+                                InterlockedExchange(&log->exit_sketch_reset,
+                                                    TRUE);
+                        continue;
+                }
+
+                log->exit_sketch = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                                   sizeof(EXIT_SKETCH),
+                                                   VMX_EXIT_SKETCH_POOL_TAG);
+
+                if (!log->exit_sketch) {
+                        status = STATUS_MEMORY_NOT_ALLOCATED;
+                        goto end;
+                }
+
+                SketchInitialise(log->exit_sketch);
+        }
+
+        InterlockedExchange(&exit_profiling, TRUE);
+
+end:
+        KeReleaseGuardedMutex(&log_export.lock);
+        return status;
+}
+
+/*
+ * Takes a consistent copy of a cores sketch without stalling the core, then
+ * returns as many of its counters as fit, highest count first.
+ */
+NTSTATUS
+LogQueryExitHotspots(_In_ UINT32             Core,
+                     _Out_ PHV_EXIT_HOTSPOTS Response,
+                     _In_ UINT32             ResponseLength,
+                     _Out_ PUINT32           BytesWritten)
+{
+        NTSTATUS         status   = STATUS_SUCCESS;
+        PEXIT_SKETCH     snapshot = NULL;
+        PSKETCH_COUNTER  counter  = NULL;
+        PHV_EXIT_HOTSPOT hotspot  = NULL;
+        UINT32           capacity = 0;
+        UINT32           count    = 0;
+        UINT32           attempt  = 0;
+
+        *BytesWritten = 0;
+
+        if (ResponseLength < HV_EXIT_HOTSPOTS_SIZE(1))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        capacity =
+            (UINT32)((ResponseLength - HV_EXIT_HOTSPOTS_SIZE(0)) /
+                     sizeof(HV_EXIT_HOTSPOT));
+
+        snapshot = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                   sizeof(EXIT_SKETCH),
+                                   VMX_EXIT_SKETCH_POOL_TAG);
+
+        if (!snapshot)
+                return STATUS_MEMORY_NOT_ALLOCATED;
+
+        KeAcquireGuardedMutex(&log_export.lock);
+
+        if (!log_export.enabled || !vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        if (Core >= TopologyVcpuCount()) {
+                status = STATUS_INVALID_PARAMETER;
+                goto end;
+        }
+
+        if (!vmm_state[Core].cold.log_state.exit_sketch) {
+                status = STATUS_NOT_FOUND;
+                goto end;
+        }
+
+        while (!SketchSnapshot(vmm_state[Core].cold.log_state.exit_sketch,
+                               snapshot)) {
+                if (++attempt == LOG_SNAPSHOT_ATTEMPTS) {
+                        status = STATUS_DEVICE_BUSY;
+                        goto end;
+                }
+
+                YieldProcessor();
+        }
+
+        SketchSortCounters(snapshot->counters, snapshot->used);
+
+        for (; count < capacity && count < snapshot->used; count++) {
+                hotspot = &Response->hotspots[count];
+                counter = &snapshot->counters[count];
+
+                hotspot->guest_rip = counter->rip;
+                hotspot->count     = counter->count;
+                hotspot->error     = counter->error;
+                hotspot->reason    = counter->reason;
+                hotspot->reserved  = 0;
+        }
+
+        Response->total         = snapshot->total;
+        Response->hotspot_count = count;
+        Response->reserved      = 0;
+        *BytesWritten           = HV_EXIT_HOTSPOTS_SIZE(count);
+
+end:
+        KeReleaseGuardedMutex(&log_export.lock);
+        ExFreePoolWithTag(snapshot, VMX_EXIT_SKETCH_POOL_TAG);
+        return status;
+}
+
+/*
+ * Returns the tsc to pass to LogCr3AccountingEnd once the exit has been
+ * handled, or 0 if accounting is disabled.
+ */
+UINT64
+LogCr3AccountingBegin(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        if (!cr3_accounting || !Vcpu->cold.log_state.cr3_accounting)
+                return 0;
+
+        return __rdtsc();
+}
+
+/*
+ * guest cr3 is read after the exit has been handled, so a mov to cr3 is
+ * accounted to the address space being switched to.
+ */
+VOID
+LogCr3AccountingEnd(_In_ PVIRTUAL_MACHINE_STATE Vcpu, _In_ UINT64 Start)
+{
+        PVCPU_LOG_STATE log = &Vcpu->cold.log_state;
+
+        if (log->cr3_accounting_reset &&
+            InterlockedExchange(&log->cr3_accounting_reset, FALSE))
+                AccountingInitialise(log->cr3_accounting);
+
+        AccountingUpdate(log->cr3_accounting,
+                         VmxVmRead(VMCS_GUEST_CR3),
+                         __rdtsc() - Start);
+}
+
+NTSTATUS
+LogSetCr3Accounting(_In_ BOOLEAN Enable, _In_ BOOLEAN Reset)
+{
+        NTSTATUS        status = STATUS_SUCCESS;
+        PVCPU_LOG_STATE log    = NULL;
+
+        KeAcquireGuardedMutex(&log_export.lock);
+
+        if (!log_export.enabled || !vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        if (!Enable) {
+                InterlockedExchange(&cr3_accounting, FALSE);
+                goto end;
+        }
+
+        for (UINT32 core = 0; core < TopologyVcpuCount(); core++) {
+                log = &vmm_state[core].cold.log_state;
+
+                if (!log->ring)
+                        continue;
+
+                if (log->cr3_accounting) {
+                        if (Reset)
+                                InterlockedExchange(
+                                    &log->cr3_accounting_reset, TRUE);
+                        continue;
+                }
+
+                log->cr3_accounting =
+                    ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                    sizeof(CR3_ACCOUNTING),
+                                    VMX_ACCOUNTING_POOL_TAG);
+
+                if (!log->cr3_accounting) {
+                        status = STATUS_MEMORY_NOT_ALLOCATED;
+                        goto end;
+                }
+
+                AccountingInitialise(log->cr3_accounting);
+        }
+
+        InterlockedExchange(&cr3_accounting, TRUE);
+
+end:
+        KeReleaseGuardedMutex(&log_export.lock);
+        return status;
+}
+
+/*
+ * Merges the accounting of every core into Response. Like the exit hotspots
+ * each core is snapshotted rather than stopped, a core whose snapshot keeps
+ * getting torn fails the query rather than stalling it.
+ */
+NTSTATUS
+LogQueryCr3Accounting(_Out_ PHV_CR3_ACCOUNTING Response,
+                      _In_ UINT32              ResponseLength,
+                      _Out_ PUINT32            BytesWritten)
+{
+        NTSTATUS        status   = STATUS_SUCCESS;
+        PCR3_ACCOUNTING snapshot = NULL;
+        PCR3_ACCOUNTING source   = NULL;
+        UINT32          capacity = 0;
+        UINT32          count    = 0;
+        UINT32          attempt  = 0;
+
+        *BytesWritten = 0;
+
+        if (ResponseLength < HV_CR3_ACCOUNTING_SIZE(1))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        capacity = (UINT32)((ResponseLength - HV_CR3_ACCOUNTING_SIZE(0)) /
+                            sizeof(HV_CR3_ACCOUNTING_ENTRY));
+
+        snapshot = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                   sizeof(CR3_ACCOUNTING),
+                                   VMX_ACCOUNTING_POOL_TAG);
+
+        if (!snapshot)
+                return STATUS_MEMORY_NOT_ALLOCATED;
+
+        RtlZeroMemory(&Response->overflow, sizeof(HV_CR3_ACCOUNTING_ENTRY));
+
+        KeAcquireGuardedMutex(&log_export.lock);
+
+        if (!log_export.enabled || !vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        for (UINT32 core = 0; core < TopologyVcpuCount(); core++) {
+                source = vmm_state[core].cold.log_state.cr3_accounting;
+
+                if (!source)
+                        continue;
+
+                attempt = 0;
+
+                while (!AccountingSnapshot(source, snapshot)) {
+                        if (++attempt == LOG_SNAPSHOT_ATTEMPTS) {
+                                status = STATUS_DEVICE_BUSY;
+                                goto end;
+                        }
+
+                        YieldProcessor();
+                }
+
+                count = AccountingMerge(Response->entries,
+                                        count,
+                                        capacity,
+                                        &Response->overflow,
+                                        snapshot);
+        }
+
+        Response->entry_count = count;
+        Response->reserved    = 0;
+        *BytesWritten         = HV_CR3_ACCOUNTING_SIZE(count);
+
+end:
+        KeReleaseGuardedMutex(&log_export.lock);
+        ExFreePoolWithTag(snapshot, VMX_ACCOUNTING_POOL_TAG);
+        return status;
+}
+
+/*
+ * The preemption timer counts down once every 2^rate tsc cycles, where rate is
+ * reported in IA32_VMX_MISC.
+ */
+STATIC
+UINT32
+LogSampleTimerRate()
+{
+        return (UINT32)IA32_VMX_MISC_PREEMPTION_TIMER_TSC_RELATIONSHIP(
+            CapGetCapabilities()->misc);
+}
+
+UINT32
+LogSampleMinimumTicks()
+{
+        return HV_SAMPLING_MIN_INTERVAL >> LogSampleTimerRate();
+}
+
+/*
+ * Called from the preemption timer exit. Reading the guests stack from here is
+ * only safe because the host cr3 maps the same kernel half as every guest
+ * address space, and the page holding a kernel stack pointer is always
+ * resident, so the scan never leaves that page.
+ */
+VOID
+LogSample(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        PVCPU_LOG_STATE log    = &Vcpu->cold.log_state;
+        PSAMPLE_RECORD  record = NULL;
+        UINT64          ss     = 0;
+        UINT64          rsp    = 0;
+
+        if (!log->sample_ring)
+                return;
+
+        ss = VmxVmRead(VMCS_GUEST_SS_ACCESS_RIGHTS);
+
+        record              = TraceRingReserve(log->sample_ring);
+        record->timestamp   = __rdtsc();
+        record->guest_rip   = VmxVmRead(VMCS_GUEST_RIP);
+        record->guest_cr3   = VmxVmRead(VMCS_GUEST_CR3) & ACCOUNTING_CR3_MASK;
+        record->cpl =
+            (UINT8)VMX_SEGMENT_ACCESS_RIGHTS_DESCRIPTOR_PRIVILEGE_LEVEL(ss);
+        record->frame_count = 0;
+        record->reserved    = 0;
+        record->core        = Vcpu->cold.index;
+
+        RtlZeroMemory(record->frames, sizeof(record->frames));
+
+        if (log->sample_flags & HV_SAMPLING_STACKS && !record->cpl) {
+                rsp = VmxVmRead(VMCS_GUEST_RSP);
+
+                if (rsp >= SAMPLE_KERNEL_BASE)
+                        record->frame_count = (UINT8)SampleScanStack(
+                            (const UINT64*)rsp,
+                            SampleStackWindow(rsp),
+                            rsp,
+                            record->frames);
+        }
+
+        TraceRingCommit(log->sample_ring);
+}
+
+/*
+ * Sample rings are allocated lazily like the exit rings, then every
+ * virtualised core arms its own timer. If any core fails to, sampling is
+ * stopped everywhere again so no core is left sampling on its own.
+ */
+NTSTATUS
+LogSetSampling(_In_ UINT64 Interval, _In_ UINT32 Flags)
+{
+        NTSTATUS        status = STATUS_SUCCESS;
+        PVCPU_LOG_STATE log    = NULL;
+        UINT64          ticks  = 0;
+
+        if (!Interval)
+                return VmxSetSampling(0, 0);
+
+        if (Interval < HV_SAMPLING_MIN_INTERVAL)
+                return STATUS_INVALID_PARAMETER;
+
+        if (!(CapGetCapabilities()->pinbased_ctls >> 32 &
+              IA32_VMX_PINBASED_CTLS_ACTIVATE_VMX_PREEMPTION_TIMER_FLAG) ||
+            !(CapGetCapabilities()->exit_ctls >> 32 &
+              IA32_VMX_EXIT_CTLS_SAVE_VMX_PREEMPTION_TIMER_VALUE_FLAG))
+                return STATUS_NOT_SUPPORTED;
+
+        ticks = Interval >> LogSampleTimerRate();
+
+        if (ticks > MAXUINT32)
+                ticks = MAXUINT32;
+
+        KeAcquireGuardedMutex(&log_export.lock);
+
+        if (!log_export.enabled || !vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        for (UINT32 core = 0; core < TopologyVcpuCount(); core++) {
+                log = &vmm_state[core].cold.log_state;
+
+                if (!log->ring || log->sample_ring)
+                        continue;
+
+                log->sample_ring =
+                    TraceRingAllocate(VMX_SAMPLE_RING_CAPACITY,
+                                      sizeof(SAMPLE_RECORD),
+                                      core,
+                                      VMX_SAMPLE_RING_POOL_TAG);
+
+                if (!log->sample_ring) {
+                        status = STATUS_MEMORY_NOT_ALLOCATED;
+                        goto end;
+                }
+        }
+
+end:
+        KeReleaseGuardedMutex(&log_export.lock);
+
+        if (!NT_SUCCESS(status))
+                return status;
+
+        status = VmxSetSampling((UINT32)ticks, Flags);
 
         if (!NT_SUCCESS(status))
+                VmxSetSampling(0, 0);
+
+        return status;
+}
+
+NTSTATUS
+LogReadSamples(_In_ UINT32                    Core,
+               _In_ UINT64                    Cursor,
+               _Out_ PHV_SAMPLE_READ_RESPONSE Response,
+               _In_ UINT32                    ResponseLength,
+               _Out_ PUINT32                  BytesWritten)
+{
+        NTSTATUS           status   = STATUS_SUCCESS;
+        PTRACE_RING_HEADER ring     = NULL;
+        UINT32             capacity = 0;
+        UINT32             count    = 0;
+        UINT64             lost     = 0;
+
+        *BytesWritten = 0;
+
+        if (ResponseLength < HV_SAMPLE_READ_RESPONSE_SIZE(1))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        capacity = (UINT32)((ResponseLength - HV_SAMPLE_READ_RESPONSE_SIZE(0)) /
+                            sizeof(SAMPLE_RECORD));
+
+        KeAcquireGuardedMutex(&log_export.lock);
+
+        if (!log_export.enabled || !vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        if (Core >= TopologyVcpuCount()) {
+                status = STATUS_INVALID_PARAMETER;
+                goto end;
+        }
+
+        ring = vmm_state[Core].cold.log_state.sample_ring;
+
+        if (!ring) {
+                status = STATUS_NOT_FOUND;
+                goto end;
+        }
+
+        while (count < capacity &&
+               TraceRingNextRecord(
+                   ring, &Cursor, &lost, &Response->records[count]))
+                count++;
+
+        Response->cursor       = Cursor;
+        Response->lost         = lost;
+        Response->record_count = count;
+        Response->reserved     = 0;
+        *BytesWritten          = HV_SAMPLE_READ_RESPONSE_SIZE(count);
+
+end:
+        KeReleaseGuardedMutex(&log_export.lock);
+        return status;
+}
+
+/*
+ * Copies records out of a cores exit ring using the same reader protocol a
+ * mapped consumer would, so the core is never stalled while we read.
+ */
+NTSTATUS
+LogReadExitTrace(_In_ UINT32                        Core,
+                 _In_ UINT64                        Cursor,
+                 _Out_ PHV_EXIT_TRACE_READ_RESPONSE Response,
+                 _In_ UINT32                        ResponseLength,
+                 _Out_ PUINT32                      BytesWritten)
+{
+        NTSTATUS           status   = STATUS_SUCCESS;
+        PTRACE_RING_HEADER ring     = NULL;
+        UINT32             capacity = 0;
+        UINT32             count    = 0;
+        UINT64             lost     = 0;
+
+        *BytesWritten = 0;
+
+        if (ResponseLength < HV_EXIT_TRACE_READ_RESPONSE_SIZE(1))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        capacity = (UINT32)((ResponseLength -
+                             HV_EXIT_TRACE_READ_RESPONSE_SIZE(0)) /
+                            sizeof(EXIT_TRACE_RECORD));
+
+        KeAcquireGuardedMutex(&log_export.lock);
+
+        if (!log_export.enabled || !vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        if (Core >= TopologyVcpuCount()) {
+                status = STATUS_INVALID_PARAMETER;
+                goto end;
+        }
+
+        ring = vmm_state[Core].cold.log_state.exit_ring;
+
+        if (!ring) {
+                status = STATUS_NOT_FOUND;
+                goto end;
+        }
+
+        while (count < capacity &&
+               TraceRingNextRecord(
+                   ring, &Cursor, &lost, &Response->records[count]))
+                count++;
+
+        Response->cursor       = Cursor;
+        Response->lost         = lost;
+        Response->record_count = count;
+        Response->reserved     = 0;
+        *BytesWritten          = HV_EXIT_TRACE_READ_RESPONSE_SIZE(count);
+
+end:
+        KeReleaseGuardedMutex(&log_export.lock);
+        return status;
+}
+
+VOID
+LogExportInitialise()
+{
+        KeInitializeGuardedMutex(&log_export.lock);
+        log_export.enabled       = FALSE;
+        log_export.owner         = NULL;
+        log_export.process       = NULL;
+        log_export.event         = NULL;
+        log_export.mapping_count = 0;
+        log_export.mappings      = NULL;
+}
+
+/*
+ * User mode mappings can only be torn down from within the address space they
+ * were created in, which is not necessarily the one we are currently running
+ * in (i.e when called from the power callback), so attach to it first. Must
+ * be called with the export lock held.
+ */
+STATIC
+VOID
+LogExportReleaseMappings()
+{
+        KAPC_STATE apc_state = {0};
+        PKEVENT    event     = NULL;
+
+        /*
+         * Stop the flush DPCs from signalling the event before we drop our
+         * reference to it.
+         */
+        event = InterlockedExchangePointer(&log_export.event, NULL);
+        KeFlushQueuedDpcs();
+
+        if (event)
+                ObDereferenceObject(event);
+
+        if (log_export.mappings) {
+                KeStackAttachProcess(log_export.process, &apc_state);
+
+                for (UINT32 index = 0; index < log_export.mapping_count;
+                     index++) {
+                        PLOG_EXPORT_MAPPING mapping =
+                            &log_export.mappings[index];
+
+                        if (mapping->address)
+                                MmUnmapLockedPages(mapping->address,
+                                                   mapping->mdl);
+                        if (mapping->mdl)
+                                IoFreeMdl(mapping->mdl);
+                }
+
+                KeUnstackDetachProcess(&apc_state);
+
+                ExFreePoolWithTag(log_export.mappings, POOL_TAG_LOG_EXPORT);
+        }
+
+        if (log_export.process)
+                ObDereferenceObject(log_export.process);
+
+        log_export.owner         = NULL;
+        log_export.process       = NULL;
+        log_export.mapping_count = 0;
+        log_export.mappings      = NULL;
+}
+
+/*
+ * Maps the ring of each core read only into the current process. This must be
+ * called at PASSIVE_LEVEL in the context of the requesting process, which is
+ * always the case for a METHOD_BUFFERED IOCTL as we are a top level driver.
+ */
+NTSTATUS
+LogExportMapRings(_In_ PFILE_OBJECT          FileObject,
+                  _In_ HANDLE                Event,
+                  _Out_ PHV_LOG_MAP_RESPONSE Response,
+                  _In_ UINT32                ResponseLength,
+                  _Out_ PUINT32              BytesWritten)
+{
+        NTSTATUS status     = STATUS_UNSUCCESSFUL;
+        PKEVENT  event      = NULL;
+        BOOLEAN  mapped     = FALSE;
+        UINT32   core_count = TopologyVcpuCount();
+
+        *BytesWritten = 0;
+
+        if (ResponseLength < HV_LOG_MAP_RESPONSE_SIZE(core_count))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        if (Event) {
+                status = ObReferenceObjectByHandle(Event,
+                                                   EVENT_MODIFY_STATE,
+                                                   *ExEventObjectType,
+                                                   UserMode,
+                                                   (PVOID*)&event,
+                                                   NULL);
+
+                if (!NT_SUCCESS(status)) {
+                        DEBUG_ERROR(
+                            "ObReferenceObjectByHandle failed with status %x",
+                            status);
+                        return status;
+                }
+        }
+
+        KeAcquireGuardedMutex(&log_export.lock);
+
+        if (!log_export.enabled || !vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        if (log_export.mappings) {
+                status = STATUS_DEVICE_BUSY;
+                goto end;
+        }
+
+        log_export.mappings =
+            ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                            core_count * sizeof(LOG_EXPORT_MAPPING),
+                            POOL_TAG_LOG_EXPORT);
+
+        if (!log_export.mappings) {
+                status = STATUS_MEMORY_NOT_ALLOCATED;
                 goto end;
+        }
+
+        log_export.owner         = FileObject;
+        log_export.process       = PsGetCurrentProcess();
+        log_export.mapping_count = core_count;
+        ObReferenceObject(log_export.process);
+        mapped = TRUE;
+
+        for (UINT32 core = 0; core < core_count; core++) {
+                PLOG_EXPORT_MAPPING mapping = &log_export.mappings[core];
+                PTRACE_RING_HEADER  ring =
+                    vmm_state[core].cold.log_state.ring;
+
+                /* excluded cores never exit, so they have no ring */
+                if (vmm_state[core].state == VMX_VCPU_STATE_EXCLUDED) {
+                        Response->rings[core] = 0;
+                        continue;
+                }
+
+                if (!ring) {
+                        status = STATUS_DEVICE_NOT_READY;
+                        goto end;
+                }
+
+                /* rings are allocated in whole pages, see TraceRingAllocate */
+                mapping->mdl = IoAllocateMdl(
+                    ring,
+                    ROUND_TO_PAGES(
+                        TRACE_RING_SIZE(ring->capacity, ring->record_size)),
+                    FALSE,
+                    FALSE,
+                    NULL);
+
+                if (!mapping->mdl) {
+                        status = STATUS_MEMORY_NOT_ALLOCATED;
+                        goto end;
+                }
+
+                MmBuildMdlForNonPagedPool(mapping->mdl);
+
+                /* mapping into user mode raises an exception on failure */
+                __try {
+                        mapping->address = MmMapLockedPagesSpecifyCache(
+                            mapping->mdl,
+                            UserMode,
+                            MmCached,
+                            NULL,
+                            FALSE,
+                            NormalPagePriority | MdlMappingNoWrite |
+                                MdlMappingNoExecute);
+                }
+                __except (EXCEPTION_EXECUTE_HANDLER) {
+                        mapping->address = NULL;
+                }
+
+                if (!mapping->address) {
+                        status = STATUS_INSUFFICIENT_RESOURCES;
+                        goto end;
+                }
+
+                Response->rings[core] = (UINT64)mapping->address;
+        }
 
-        log->current_log_count++;
+        Response->ring_count = core_count;
+        Response->reserved   = 0;
+        *BytesWritten        = HV_LOG_MAP_RESPONSE_SIZE(core_count);
+
+        /* only publish the event once everything is in place */
+        InterlockedExchangePointer(&log_export.event, event);
+        event  = NULL;
+        status = STATUS_SUCCESS;
 
 end:
-        HighIrqlLockRelease(&log->lock);
+        if (!NT_SUCCESS(status) && mapped)
+                LogExportReleaseMappings();
+
+        KeReleaseGuardedMutex(&log_export.lock);
+
+        if (event)
+                ObDereferenceObject(event);
+
+        return status;
+}
+
+/*
+ * Unmaps the rings if they are currently mapped through FileObject. Called
+ * both for IOCTL_HV_UNMAP_LOG_RINGS and when the handle is cleaned up.
+ */
+NTSTATUS
+LogExportUnmapRings(_In_ PFILE_OBJECT FileObject)
+{
+        NTSTATUS status = STATUS_SUCCESS;
+
+        KeAcquireGuardedMutex(&log_export.lock);
+
+        if (log_export.mappings && log_export.owner == FileObject)
+                LogExportReleaseMappings();
+        else
+                status = STATUS_NOT_FOUND;
+
+        KeReleaseGuardedMutex(&log_export.lock);
+        return status;
+}
+
+/*
+ * The rings only live for as long as VMX operation does, so the export is
+ * enabled once every core has been virtualised, and disabled (forcing any
+ * existing mapping to be torn down) before the rings are freed.
+ */
+VOID
+LogExportEnable()
+{
+        KeAcquireGuardedMutex(&log_export.lock);
+        log_export.enabled = TRUE;
+        KeReleaseGuardedMutex(&log_export.lock);
 }
 
-#endif
\ No newline at end of file
+VOID
+LogExportDisable()
+{
+        KeAcquireGuardedMutex(&log_export.lock);
+        log_export.enabled = FALSE;
+        InterlockedExchange(&exit_recording, FALSE);
+        InterlockedExchange(&exit_profiling, FALSE);
+        InterlockedExchange(&cr3_accounting, FALSE);
+
+        if (log_export.mappings)
+                LogExportReleaseMappings();
+
+        KeReleaseGuardedMutex(&log_export.lock);
+}
@@ -4,24 +4,119 @@
 #include "common.h"
 
 #include "vmx.h"
+#include "trace.h"
+#include "ioctl.h"
 
-#ifdef DEBUG
-#        define HIGH_IRQL_LOG_SAFE(fmt, ...) \
-                LogToBuffer("hv-root: " fmt, ##__VA_ARGS__)
-#else
-#        define HIGH_IRQL_LOG_SAFE(fmt, ...)
-#endif
+/*
+ * Logging from VMX root only stores the format id, a timestamp and the raw
+ * arguments in the cores trace ring, so it is cheap enough to be left enabled
+ * in production. All arguments must be passed as UINT64 values.
+ */
+#define HIGH_IRQL_LOG_SAFE(vcpu, id, ...) \
+        LogToBuffer(vcpu, id, ##__VA_ARGS__)
 
 NTSTATUS
 InitialiseVcpuLogger(_In_ PVIRTUAL_MACHINE_STATE Vcpu);
 
 VOID
-LogToBuffer(PCSTR Format, ...);
-
-BOOLEAN
-CheckToFlushLogs(_In_ PVIRTUAL_MACHINE_STATE Vcpu);
+LogToBuffer(_In_ PVIRTUAL_MACHINE_STATE Vcpu, _In_ TRACE_FORMAT_ID FormatId, ...);
 
 VOID
 CleanupLoggerOnUnload(_In_ PVIRTUAL_MACHINE_STATE Vcpu);
 
-#endif
\ No newline at end of file
+PTRACE_RING_HEADER
+TraceRingAllocate(_In_ UINT32 Capacity,
+                  _In_ UINT32 RecordSize,
+                  _In_ UINT32 Core,
+                  _In_ UINT32 Tag);
+
+VOID
+TraceRingFree(_In_ PTRACE_RING_HEADER Ring, _In_ UINT32 Tag);
+
+PVOID
+TraceRingReserve(_In_ PTRACE_RING_HEADER Ring);
+
+VOID
+TraceRingCommit(_In_ PTRACE_RING_HEADER Ring);
+
+PEXIT_TRACE_RECORD
+LogExitRecordBegin(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                   _In_ UINT32                 Reason,
+                   _In_ PGUEST_CONTEXT         Context);
+
+VOID
+LogExitRecordEnd(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                 _In_ PEXIT_TRACE_RECORD     Record);
+
+NTSTATUS
+LogSetExitRecording(_In_ BOOLEAN Enable);
+
+NTSTATUS
+LogReadExitTrace(_In_ UINT32                        Core,
+                 _In_ UINT64                        Cursor,
+                 _Out_ PHV_EXIT_TRACE_READ_RESPONSE Response,
+                 _In_ UINT32                        ResponseLength,
+                 _Out_ PUINT32                      BytesWritten);
+
+VOID
+LogExitProfile(_In_ PVIRTUAL_MACHINE_STATE Vcpu, _In_ UINT32 Reason);
+
+NTSTATUS
+LogSetExitProfiling(_In_ BOOLEAN Enable, _In_ BOOLEAN Reset);
+
+NTSTATUS
+LogQueryExitHotspots(_In_ UINT32             Core,
+                     _Out_ PHV_EXIT_HOTSPOTS Response,
+                     _In_ UINT32             ResponseLength,
+                     _Out_ PUINT32           BytesWritten);
+
+UINT64
+LogCr3AccountingBegin(_In_ PVIRTUAL_MACHINE_STATE Vcpu);
+
+VOID
+LogCr3AccountingEnd(_In_ PVIRTUAL_MACHINE_STATE Vcpu, _In_ UINT64 Start);
+
+NTSTATUS
+LogSetCr3Accounting(_In_ BOOLEAN Enable, _In_ BOOLEAN Reset);
+
+NTSTATUS
+LogQueryCr3Accounting(_Out_ PHV_CR3_ACCOUNTING Response,
+                      _In_ UINT32              ResponseLength,
+                      _Out_ PUINT32            BytesWritten);
+
+UINT32
+LogSampleMinimumTicks();
+
+VOID
+LogSample(_In_ PVIRTUAL_MACHINE_STATE Vcpu);
+
+NTSTATUS
+LogSetSampling(_In_ UINT64 Interval, _In_ UINT32 Flags);
+
+NTSTATUS
+LogReadSamples(_In_ UINT32                    Core,
+               _In_ UINT64                    Cursor,
+               _Out_ PHV_SAMPLE_READ_RESPONSE Response,
+               _In_ UINT32                    ResponseLength,
+               _Out_ PUINT32                  BytesWritten);
+
+VOID
+LogExportInitialise();
+
+VOID
+LogExportEnable();
+
+VOID
+LogExportDisable();
+
+NTSTATUS
+LogExportMapRings(_In_ PFILE_OBJECT          FileObject,
+                  _In_ HANDLE                Event,
+                  _Out_ PHV_LOG_MAP_RESPONSE Response,
+                  _In_ UINT32                ResponseLength,
+                  _Out_ PUINT32              BytesWritten);
+
+NTSTATUS
+LogExportUnmapRings(_In_ PFILE_OBJECT FileObject);
+
+#endif
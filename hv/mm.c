@@ -1,13 +1,187 @@
 #include "mm.h"
 
-#include "ia32.h"
+typedef struct _EPT_POOL_CHUNK {
+        UINT64         base_pa;
+        UINT64         base_va;
+        PEPT_POOL_PAGE pages;
+
+} EPT_POOL_CHUNK, *PEPT_POOL_CHUNK;
+
+typedef struct _EPT_PAGE_POOL {
+        SLIST_HEADER   free_list;
+        volatile LONG  free_count;
+        volatile LONG  chunk_count;
+        volatile LONG  refill_pending;
+        EPT_POOL_CHUNK chunks[EPT_POOL_MAX_CHUNKS];
+
+} EPT_PAGE_POOL, *PEPT_PAGE_POOL;
+
+STATIC EPT_PAGE_POOL ept_pool = {0};
+
+VOID
+EptPoolReset()
+{
+        InitializeSListHead(&ept_pool.free_list);
+        ept_pool.free_count     = 0;
+        ept_pool.chunk_count    = 0;
+        ept_pool.refill_pending = FALSE;
+
+        memset(ept_pool.chunks, 0, sizeof(ept_pool.chunks));
+}
+
+BOOLEAN
+EptPoolAddPages(_In_ UINT64 Va, _In_ UINT64 Pa, _In_ PEPT_POOL_PAGE Pages)
+{
+        LONG            index = ept_pool.chunk_count;
+        PEPT_POOL_CHUNK chunk = NULL;
+
+        if (index >= EPT_POOL_MAX_CHUNKS)
+                return FALSE;
+
+        chunk          = &ept_pool.chunks[index];
+        chunk->base_va = Va;
+        chunk->base_pa = Pa;
+        chunk->pages   = Pages;
+
+        /*
+         * Publish the chunk before any of its pages can be popped, this way
+         * EptPoolPageFromPhysical will always find the chunk for a page that
+         * has been handed out.
+         */
+        EPT_POOL_ATOMIC_INCREMENT(&ept_pool.chunk_count);
+
+        for (UINT32 page = 0; page < EPT_POOL_CHUNK_PAGE_COUNT; page++) {
+                Pages[page].pa = Pa + page * PAGE_SIZE;
+                Pages[page].va = Va + page * PAGE_SIZE;
+                EptPoolFreePage(&Pages[page]);
+        }
+
+        return TRUE;
+}
+
+LONG
+EptPoolFreeCount()
+{
+        return ept_pool.free_count;
+}
+
+BOOLEAN
+EptPoolBeginRefill()
+{
+        if (ept_pool.free_count >= EPT_POOL_LOW_WATERMARK)
+                return FALSE;
+
+        /* only ever allow a single refill to be in flight */
+        if (EPT_POOL_ATOMIC_COMPARE_EXCHANGE(
+                &ept_pool.refill_pending, TRUE, FALSE))
+                return FALSE;
+
+        return TRUE;
+}
+
+VOID
+EptPoolEndRefill()
+{
+        EPT_POOL_ATOMIC_EXCHANGE(&ept_pool.refill_pending, FALSE);
+}
+
+/*
+ * Safe to call at any IRQL, including from VMX root. Returns NULL if the pool
+ * has been exhausted, in which case the caller must fail the operation and
+ * retry once the refill worker has run.
+ */
+PEPT_POOL_PAGE
+EptPoolAllocatePage()
+{
+        PEPT_POOL_PAGE page =
+            (PEPT_POOL_PAGE)InterlockedPopEntrySList(&ept_pool.free_list);
+
+        if (!page)
+                return NULL;
+
+        EPT_POOL_ATOMIC_DECREMENT(&ept_pool.free_count);
+        return page;
+}
+
+/*
+ * Pages are zeroed before being returned to the pool so that a freshly
+ * allocated page table never contains stale entries.
+ */
+VOID
+EptPoolFreePage(_In_ PEPT_POOL_PAGE Page)
+{
+        EPT_POOL_ZERO_PAGE(Page->va);
+        InterlockedPushEntrySList(&ept_pool.free_list, &Page->list_entry);
+        EPT_POOL_ATOMIC_INCREMENT(&ept_pool.free_count);
+}
+
+/*
+ * Given the physical address of a page table page (i.e taken from the page
+ * frame number of an EPT entry), return the pool page describing it. The
+ * number of chunks is bounded by EPT_POOL_MAX_CHUNKS so this is effectively
+ * constant time.
+ */
+PEPT_POOL_PAGE
+EptPoolPageFromPhysical(_In_ UINT64 PhysicalAddress)
+{
+        LONG count = ept_pool.chunk_count;
+
+        for (LONG index = 0; index < count; index++) {
+                PEPT_POOL_CHUNK chunk = &ept_pool.chunks[index];
+
+                if (PhysicalAddress < chunk->base_pa ||
+                    PhysicalAddress >= chunk->base_pa + EPT_POOL_CHUNK_SIZE)
+                        continue;
+
+                return &chunk->pages[(PhysicalAddress - chunk->base_pa) >>
+                                     PAGE_SHIFT];
+        }
+
+        return NULL;
+}
+
+UINT64
+EptPoolPhysicalToVirtual(_In_ UINT64 PhysicalAddress)
+{
+        PEPT_POOL_PAGE page = EptPoolPageFromPhysical(PhysicalAddress);
+
+        if (!page)
+                return 0;
+
+        return page->va + (PhysicalAddress & (PAGE_SIZE - 1));
+}
+
+#if defined(_KERNEL_MODE)
+
+#        include "ia32.h"
+#        include "hw.h"
+
+/* how often the pool is checked against the low watermark, in milliseconds */
+#        define EPT_POOL_REFILL_CHECK_INTERVAL 10
+
+#        define POOL_TAG_EPT_POOL 'lpte'
+
+/*
+ * We are unable to queue a work item from VMX root, so instead a timer
+ * periodically checks the watermark and queues the refill worker from its
+ * DPC.
+ */
+typedef struct _EPT_POOL_REFILL {
+        KTIMER          timer;
+        KDPC            dpc;
+        WORK_QUEUE_ITEM work_item;
+        KEVENT          refill_idle;
+
+} EPT_POOL_REFILL, *PEPT_POOL_REFILL;
+
+STATIC EPT_POOL_REFILL ept_pool_refill = {0};
 
 STATIC
 BOOLEAN
 MmIsMtrrEnabled()
 {
         IA32_MTRR_DEF_TYPE_REGISTER mtrr = {
-            .AsUInt = __readmsr(IA32_MTRR_CAPABILITIES)};
+            .AsUInt = HwReadMsr(IA32_MTRR_CAPABILITIES)};
         return mtrr.MtrrEnable ? TRUE : FALSE;
 }
 
@@ -16,6 +190,156 @@ BOOLEAN
 MmIsEptAvailable()
 {
         IA32_VMX_EPT_VPID_CAP_REGISTER cap = {
-            .AsUInt = __readmsr(IA32_VMX_EPT_VPID_CAP)};
+            .AsUInt = HwReadMsr(IA32_VMX_EPT_VPID_CAP)};
+}
+
+/*
+ * Allocates a new contiguous chunk and pushes each of its pages onto the free
+ * list. Must be called at IRQL <= DISPATCH_LEVEL, in practice this is only
+ * called at PASSIVE_LEVEL from either initialisation or the refill worker.
+ */
+STATIC
+NTSTATUS
+EptPoolAddChunk()
+{
+        PHYSICAL_ADDRESS physical_max = {.QuadPart = MAXULONG64};
+        PVOID            va           = NULL;
+        PEPT_POOL_PAGE   pages        = NULL;
+
+        if (ept_pool.chunk_count >= EPT_POOL_MAX_CHUNKS) {
+                DEBUG_ERROR("EPT pool has reached its maximum chunk count");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        va = MmAllocateContiguousMemory(EPT_POOL_CHUNK_SIZE, physical_max);
+
+        if (!va) {
+                DEBUG_ERROR("Failed to allocate EPT pool chunk");
+                return STATUS_MEMORY_NOT_ALLOCATED;
+        }
+
+        pages = ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                EPT_POOL_CHUNK_PAGE_COUNT *
+                                    sizeof(EPT_POOL_PAGE),
+                                POOL_TAG_EPT_POOL);
+
+        if (!pages) {
+                MmFreeContiguousMemory(va);
+                return STATUS_MEMORY_NOT_ALLOCATED;
+        }
+
+        RtlSecureZeroMemory(va, EPT_POOL_CHUNK_SIZE);
+
+        EptPoolAddPages((UINT64)va, MmGetPhysicalAddress(va).QuadPart, pages);
+        return STATUS_SUCCESS;
 }
 
+STATIC
+VOID
+EptPoolRefillWorker(_In_ PVOID Context)
+{
+        UNREFERENCED_PARAMETER(Context);
+
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+        while (EptPoolFreeCount() < EPT_POOL_LOW_WATERMARK) {
+                status = EptPoolAddChunk();
+
+                if (!NT_SUCCESS(status)) {
+                        DEBUG_ERROR("EptPoolAddChunk failed with status %x",
+                                    status);
+                        break;
+                }
+        }
+
+        EptPoolEndRefill();
+        KeSetEvent(&ept_pool_refill.refill_idle, IO_NO_INCREMENT, FALSE);
+}
+
+STATIC
+VOID
+EptPoolWatermarkDpcRoutine(_In_ PKDPC     Dpc,
+                           _In_opt_ PVOID DeferredContext,
+                           _In_opt_ PVOID SystemArgument1,
+                           _In_opt_ PVOID SystemArgument2)
+{
+        UNREFERENCED_PARAMETER(Dpc);
+        UNREFERENCED_PARAMETER(DeferredContext);
+        UNREFERENCED_PARAMETER(SystemArgument1);
+        UNREFERENCED_PARAMETER(SystemArgument2);
+
+        if (!EptPoolBeginRefill())
+                return;
+
+        KeClearEvent(&ept_pool_refill.refill_idle);
+        ExQueueWorkItem(&ept_pool_refill.work_item, DelayedWorkQueue);
+}
+
+NTSTATUS
+EptPoolInitialise()
+{
+        NTSTATUS      status   = STATUS_UNSUCCESSFUL;
+        LARGE_INTEGER due_time = {
+            .QuadPart = RELATIVE(MILLISECONDS(EPT_POOL_REFILL_CHECK_INTERVAL))};
+
+        EptPoolReset();
+
+        /*
+         * Everything EptPoolFree tears down is initialised before the first
+         * chunk is added, as a failure below has to go through it.
+         */
+        KeInitializeEvent(
+            &ept_pool_refill.refill_idle, NotificationEvent, TRUE);
+        ExInitializeWorkItem(
+            &ept_pool_refill.work_item, EptPoolRefillWorker, NULL);
+        KeInitializeDpc(
+            &ept_pool_refill.dpc, EptPoolWatermarkDpcRoutine, NULL);
+        KeInitializeTimer(&ept_pool_refill.timer);
+
+        for (UINT32 chunk = 0; chunk < EPT_POOL_INITIAL_CHUNKS; chunk++) {
+                status = EptPoolAddChunk();
+
+                if (!NT_SUCCESS(status)) {
+                        DEBUG_ERROR("EptPoolAddChunk failed with status %x",
+                                    status);
+                        EptPoolFree();
+                        return status;
+                }
+        }
+
+        KeSetTimerEx(&ept_pool_refill.timer,
+                     due_time,
+                     EPT_POOL_REFILL_CHECK_INTERVAL,
+                     &ept_pool_refill.dpc);
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Must be called at PASSIVE_LEVEL once VMX operation has been terminated on
+ * all cores, as at that point no page from the pool can still be referenced
+ * by an active EPT hierarchy.
+ */
+VOID
+EptPoolFree()
+{
+        KeCancelTimer(&ept_pool_refill.timer);
+        KeFlushQueuedDpcs();
+        KeWaitForSingleObject(&ept_pool_refill.refill_idle,
+                              Executive,
+                              KernelMode,
+                              FALSE,
+                              NULL);
+
+        for (LONG index = 0; index < ept_pool.chunk_count; index++) {
+                PEPT_POOL_CHUNK chunk = &ept_pool.chunks[index];
+
+                if (chunk->base_va)
+                        MmFreeContiguousMemory((PVOID)chunk->base_va);
+                if (chunk->pages)
+                        ExFreePoolWithTag(chunk->pages, POOL_TAG_EPT_POOL);
+        }
+
+        EptPoolReset();
+}
+#endif
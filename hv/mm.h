@@ -1,8 +1,123 @@
 #ifndef MM_H
 #define MM_H
 
-#include "common.h"
+/*
+ * The free list itself only depends on an interlocked singly linked list and
+ * a handful of atomic primitives, which ntshim.h provides in user mode so the
+ * pool can also be built and stress tested there, see tools/eptpool.c.
+ * Allocating the chunks and scheduling the refill is kernel only.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#        define EPT_POOL_ATOMIC_INCREMENT(Target) InterlockedIncrement(Target)
+#        define EPT_POOL_ATOMIC_DECREMENT(Target) InterlockedDecrement(Target)
+#        define EPT_POOL_ATOMIC_EXCHANGE(Target, Value) \
+                InterlockedExchange((Target), (Value))
+#        define EPT_POOL_ATOMIC_COMPARE_EXCHANGE(Target, Exchange, Comparand) \
+                InterlockedCompareExchange((Target), (Exchange), (Comparand))
+#        define EPT_POOL_ZERO_PAGE(Va) RtlZeroMemory((PVOID)(Va), PAGE_SIZE)
+#elif defined(_WIN32)
+#        include <windows.h>
+#        define EPT_POOL_ATOMIC_INCREMENT(Target) InterlockedIncrement(Target)
+#        define EPT_POOL_ATOMIC_DECREMENT(Target) InterlockedDecrement(Target)
+#        define EPT_POOL_ATOMIC_EXCHANGE(Target, Value) \
+                InterlockedExchange((Target), (Value))
+#        define EPT_POOL_ATOMIC_COMPARE_EXCHANGE(Target, Exchange, Comparand) \
+                InterlockedCompareExchange((Target), (Exchange), (Comparand))
+#        define EPT_POOL_ZERO_PAGE(Va) ZeroMemory((PVOID)(Va), PAGE_SIZE)
+#        define PAGE_SIZE              0x1000
+#        define PAGE_SHIFT             12
+#else
+/* the WDK subset used in user mode, including an SLIST on cmpxchg16b */
+#        include "ntshim.h"
+#        define EPT_POOL_ATOMIC_INCREMENT(Target) InterlockedIncrement(Target)
+#        define EPT_POOL_ATOMIC_DECREMENT(Target) InterlockedDecrement(Target)
+#        define EPT_POOL_ATOMIC_EXCHANGE(Target, Value) \
+                InterlockedExchange((Target), (Value))
+#        define EPT_POOL_ATOMIC_COMPARE_EXCHANGE(Target, Exchange, Comparand) \
+                InterlockedCompareExchange((Target), (Exchange), (Comparand))
+#        define EPT_POOL_ZERO_PAGE(Va) RtlZeroMemory((PVOID)(Va), PAGE_SIZE)
+#        define STATIC                 static
+#endif
 
+/*
+ * The pool is made up of a small number of physically contiguous chunks. Each
+ * chunk is split into pages which are pushed onto a lock free SLIST, meaning
+ * pages can be popped and pushed at any IRQL, including from VMX root.
+ */
+#define EPT_POOL_CHUNK_PAGE_COUNT 64
+#define EPT_POOL_CHUNK_SIZE       (EPT_POOL_CHUNK_PAGE_COUNT * PAGE_SIZE)
+#define EPT_POOL_MAX_CHUNKS       32
+#define EPT_POOL_INITIAL_CHUNKS   2
 
+/*
+ * Once the number of free pages drops below this value, a refill is scheduled
+ * at PASSIVE_LEVEL. It needs to comfortably cover the number of pages a burst
+ * of splits can consume before the worker gets to run.
+ */
+#define EPT_POOL_LOW_WATERMARK 32
 
-#endif
\ No newline at end of file
+/*
+ * A single page table page handed out by the EPT page pool. Each page carries
+ * both its physical and virtual address so the EPT split and merge paths never
+ * need to call MmGetPhysicalAddress or MmGetVirtualForPhysical from VMX root.
+ *
+ * The list entry must remain the first member as the free list is an
+ * SLIST_HEADER which requires 16 byte alignment of its entries.
+ */
+typedef struct _EPT_POOL_PAGE {
+        SLIST_ENTRY list_entry;
+        UINT64      pa;
+        UINT64      va;
+
+} EPT_POOL_PAGE, *PEPT_POOL_PAGE;
+
+/* Empties the pool and forgets every chunk, without freeing any of them. */
+VOID
+EptPoolReset();
+
+/*
+ * Hands the EPT_POOL_CHUNK_PAGE_COUNT pages of a zeroed chunk at Va and Pa to
+ * the pool, describing each with an entry in Pages. Only one chunk may be
+ * added at a time. Returns FALSE once the pool holds EPT_POOL_MAX_CHUNKS.
+ */
+BOOLEAN
+EptPoolAddPages(_In_ UINT64 Va, _In_ UINT64 Pa, _In_ PEPT_POOL_PAGE Pages);
+
+LONG
+EptPoolFreeCount();
+
+/*
+ * Returns TRUE if the pool has dropped below its low watermark and no refill
+ * is in flight, in which case the caller owns the refill and has to end it
+ * with EptPoolEndRefill.
+ */
+BOOLEAN
+EptPoolBeginRefill();
+
+VOID
+EptPoolEndRefill();
+
+PEPT_POOL_PAGE
+EptPoolAllocatePage();
+
+VOID
+EptPoolFreePage(_In_ PEPT_POOL_PAGE Page);
+
+PEPT_POOL_PAGE
+EptPoolPageFromPhysical(_In_ UINT64 PhysicalAddress);
+
+UINT64
+EptPoolPhysicalToVirtual(_In_ UINT64 PhysicalAddress);
+
+#if defined(_KERNEL_MODE)
+
+NTSTATUS
+EptPoolInitialise();
+
+VOID
+EptPoolFree();
+
+#endif
+
+#endif
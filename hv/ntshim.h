@@ -0,0 +1,784 @@
+#ifndef NTSHIM_H
+#define NTSHIM_H
+
+/*
+ * The subset of the WDK the driver is written against, so its sources can be
+ * built and run in user mode on Linux. common.h includes this in place of
+ * ntddk.h when HWSIM is defined, which is always together with _KERNEL_MODE
+ * so every header takes the same path it does in the driver.
+ *
+ * Types keep their LLP64 sizes and UINT64 is spelt the same as in ia32.h, so
+ * every structure has the same layout in both builds. The compiler intrinsics
+ * are mapped onto their gcc and clang equivalents, processor state is reached
+ * through hw.h and backed by tools/hwsim.c, and everything else the driver
+ * calls is implemented by tools/ntsim.c, only as far as the tests need.
+ */
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <x86intrin.h>
+
+typedef unsigned char      UINT8;
+typedef unsigned short     UINT16;
+typedef unsigned int       UINT32;
+typedef unsigned long long UINT64;
+typedef signed char        INT8;
+typedef short              INT16;
+typedef int                INT32;
+typedef long long          INT64;
+
+typedef UINT8*      PUINT8;
+typedef UINT16*     PUINT16;
+typedef UINT32*     PUINT32;
+typedef UINT64*     PUINT64;
+typedef int         INT;
+typedef UINT8       UCHAR, *PUCHAR;
+typedef UINT16      USHORT, *PUSHORT;
+typedef UINT32      ULONG, *PULONG;
+typedef INT32       LONG, *PLONG;
+typedef INT64       LONG64, *PLONG64;
+typedef UINT64      ULONG64, *PULONG64;
+typedef INT64       LONGLONG;
+typedef UINT64      ULONGLONG;
+typedef UINT64      ULONG_PTR, *PULONG_PTR;
+typedef UINT64      SIZE_T, *PSIZE_T;
+typedef UINT8       BOOLEAN, *PBOOLEAN;
+typedef ULONG       LOGICAL;
+typedef char        CHAR, *PCHAR;
+typedef UINT16      WCHAR, *PWCH;
+typedef void*       PVOID;
+typedef PVOID       HANDLE, *PHANDLE;
+typedef LONG        NTSTATUS;
+typedef UCHAR       KIRQL, *PKIRQL;
+typedef ULONG_PTR   KAFFINITY;
+typedef ULONG       ACCESS_MASK;
+typedef CHAR        KPROCESSOR_MODE;
+typedef const char* PCSTR;
+
+#define VOID  void
+#define CONST const
+#define TRUE  1
+#define FALSE 0
+
+#define __int64 long long
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _Out_writes_bytes_(Size)
+#define _In_reads_bytes_(Size)
+#define _IRQL_requires_max_(Irql)
+
+#define FORCEINLINE         inline __attribute__((always_inline))
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+
+/* structured exception handling, nothing in user mode ever raises */
+#define __try            if (1)
+#define __except(Filter) else
+
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define PAGE_SIZE                   0x1000
+#define PAGE_SHIFT                  12
+
+#define MAXUINT32    (~(UINT32)0)
+#define MAXULONG64   (~(ULONG64)0)
+#define MAXULONG_PTR (~(ULONG_PTR)0)
+
+#define ROUND_TO_PAGES(Size) \
+        (((ULONG_PTR)(Size) + PAGE_SIZE - 1) & ~((ULONG_PTR)PAGE_SIZE - 1))
+
+#define C_ASSERT(Expression)          _Static_assert((Expression), #Expression)
+#define FIELD_OFFSET(Type, Field)     ((LONG)offsetof(Type, Field))
+#define ARGUMENT_PRESENT(Argument)    ((Argument) != NULL)
+#define UNREFERENCED_PARAMETER(Value) ((void)(Value))
+
+#define min(A, B) ((A) < (B) ? (A) : (B))
+#define max(A, B) ((A) > (B) ? (A) : (B))
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+#define STATUS_SUCCESS                ((NTSTATUS)0x00000000L)
+#define STATUS_ABANDONED              ((NTSTATUS)0x00000080L)
+#define STATUS_TIMEOUT                ((NTSTATUS)0x00000102L)
+#define STATUS_BUFFER_OVERFLOW        ((NTSTATUS)0x80000005L)
+#define STATUS_DEVICE_BUSY            ((NTSTATUS)0x80000011L)
+#define STATUS_UNSUCCESSFUL           ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED        ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER      ((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST ((NTSTATUS)0xC0000010L)
+#define STATUS_ACCESS_DENIED          ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL       ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND  ((NTSTATUS)0xC0000034L)
+#define STATUS_OBJECT_NAME_COLLISION  ((NTSTATUS)0xC0000035L)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define STATUS_MEMORY_NOT_ALLOCATED   ((NTSTATUS)0xC00000A0L)
+#define STATUS_DEVICE_NOT_READY       ((NTSTATUS)0xC00000A3L)
+#define STATUS_NOT_SUPPORTED          ((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_ADDRESS        ((NTSTATUS)0xC0000141L)
+#define STATUS_INVALID_DEVICE_STATE   ((NTSTATUS)0xC0000184L)
+#define STATUS_INVALID_BUFFER_SIZE    ((NTSTATUS)0xC0000206L)
+#define STATUS_NOT_FOUND              ((NTSTATUS)0xC0000225L)
+#define STATUS_RETRY                  ((NTSTATUS)0xC000022DL)
+#define STATUS_FAIL_CHECK             ((NTSTATUS)0xC0000229L)
+#define STATUS_ALREADY_REGISTERED     ((NTSTATUS)0xC0000718L)
+#define STATUS_HV_FEATURE_UNAVAILABLE ((NTSTATUS)0xC035001EL)
+
+#define PASSIVE_LEVEL  0
+#define DISPATCH_LEVEL 2
+
+#define DPFLTR_IHVDRIVER_ID  77
+#define ALL_PROCESSOR_GROUPS 0xFFFF
+#define MM_ANY_NODE_OK       0x80000000
+#define IO_NO_INCREMENT      0
+
+#define PO_CB_SYSTEM_STATE_LOCK 3
+
+#define POOL_FLAG_NON_PAGED 0x0000000000000040ull
+#define POOL_FLAG_PAGED     0x0000000000000100ull
+
+#define PAGE_READWRITE 0x04
+#define PAGE_NOCACHE   0x200
+
+#define MdlMappingNoWrite   0x80000000
+#define MdlMappingNoExecute 0x40000000
+
+#define OBJ_CASE_INSENSITIVE 0x00000040L
+#define OBJ_KERNEL_HANDLE    0x00000200L
+#define KEY_READ             0x20019
+#define EVENT_MODIFY_STATE   0x0002
+#define REG_BINARY           3
+
+/* the trap numbers from ntddk.h */
+#define EXCEPTION_DIVIDED_BY_ZERO      0
+#define EXCEPTION_DEBUG                1
+#define EXCEPTION_NMI                  2
+#define EXCEPTION_INT3                 3
+#define EXCEPTION_BOUND_CHECK          5
+#define EXCEPTION_INVALID_OPCODE       6
+#define EXCEPTION_NPX_NOT_AVAILABLE    7
+#define EXCEPTION_DOUBLE_FAULT         8
+#define EXCEPTION_NPX_OVERRUN          9
+#define EXCEPTION_INVALID_TSS          0x0A
+#define EXCEPTION_SEGMENT_NOT_PRESENT  0x0B
+#define EXCEPTION_STACK_FAULT          0x0C
+#define EXCEPTION_GP_FAULT             0x0D
+#define EXCEPTION_RESERVED_TRAP        0x0F
+#define EXCEPTION_NPX_ERROR            0x10
+#define EXCEPTION_ALIGNMENT_CHECK      0x11
+#define EXCEPTION_VIRTUALIZATION_FAULT 0x14
+#define EXCEPTION_CP_FAULT             0x15
+#define EXCEPTION_SE_FAULT             0x17
+
+typedef enum _MODE { KernelMode, UserMode } MODE;
+typedef enum _KWAIT_REASON { Executive } KWAIT_REASON;
+typedef enum _EVENT_TYPE { NotificationEvent, SynchronizationEvent } EVENT_TYPE;
+typedef enum _WORK_QUEUE_TYPE { DelayedWorkQueue = 1 } WORK_QUEUE_TYPE;
+typedef enum _LOCK_OPERATION { IoReadAccess, IoWriteAccess } LOCK_OPERATION;
+typedef enum _MEMORY_CACHING_TYPE { MmNonCached, MmCached } MEMORY_CACHING_TYPE;
+typedef enum _MM_PAGE_PRIORITY { NormalPagePriority = 16 } MM_PAGE_PRIORITY;
+
+typedef enum _KEY_VALUE_INFORMATION_CLASS {
+        KeyValuePartialInformation = 2
+
+} KEY_VALUE_INFORMATION_CLASS;
+
+typedef union _LARGE_INTEGER {
+        struct {
+                ULONG LowPart;
+                LONG  HighPart;
+        };
+        LONGLONG QuadPart;
+
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef LARGE_INTEGER PHYSICAL_ADDRESS, *PPHYSICAL_ADDRESS;
+
+typedef struct _PHYSICAL_MEMORY_RANGE {
+        PHYSICAL_ADDRESS BaseAddress;
+        LARGE_INTEGER    NumberOfBytes;
+
+} PHYSICAL_MEMORY_RANGE, *PPHYSICAL_MEMORY_RANGE;
+
+typedef struct _PROCESSOR_NUMBER {
+        USHORT Group;
+        UCHAR  Number;
+        UCHAR  Reserved;
+
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+typedef struct _GROUP_AFFINITY {
+        KAFFINITY Mask;
+        USHORT    Group;
+        USHORT    Reserved[3];
+
+} GROUP_AFFINITY, *PGROUP_AFFINITY;
+
+typedef struct _UNICODE_STRING {
+        USHORT Length;
+        USHORT MaximumLength;
+        PWCH   Buffer;
+
+} UNICODE_STRING, *PUNICODE_STRING;
+
+/* wide literals are 4 bytes a character here, nothing reads the buffer */
+#define RTL_CONSTANT_STRING(String) {0, 0, (PWCH)(String)}
+
+typedef struct _OBJECT_ATTRIBUTES {
+        ULONG           Length;
+        HANDLE          RootDirectory;
+        PUNICODE_STRING ObjectName;
+        ULONG           Attributes;
+        PVOID           SecurityDescriptor;
+        PVOID           SecurityQualityOfService;
+
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define InitializeObjectAttributes(Object, Name, Flags, Root, Security) \
+        do {                                                           \
+                (Object)->Length             = sizeof(OBJECT_ATTRIBUTES); \
+                (Object)->RootDirectory      = (Root);                  \
+                (Object)->ObjectName         = (Name);                  \
+                (Object)->Attributes         = (Flags);                 \
+                (Object)->SecurityDescriptor = (Security);              \
+        } while (0)
+
+typedef struct _KEY_VALUE_PARTIAL_INFORMATION {
+        ULONG TitleIndex;
+        ULONG Type;
+        ULONG DataLength;
+        UCHAR Data[1];
+
+} KEY_VALUE_PARTIAL_INFORMATION, *PKEY_VALUE_PARTIAL_INFORMATION;
+
+typedef struct _MDL*             PMDL;
+typedef struct _CALLBACK_OBJECT* PCALLBACK_OBJECT;
+typedef struct _DEVICE_OBJECT*   PDEVICE_OBJECT;
+typedef struct _DRIVER_OBJECT*   PDRIVER_OBJECT;
+typedef struct _FILE_OBJECT*     PFILE_OBJECT;
+typedef struct _IRP*             PIRP;
+typedef struct _EPROCESS*        PEPROCESS;
+typedef struct _OBJECT_TYPE*     POBJECT_TYPE;
+
+/* the dispatcher objects below are only ever handed back to tools/ntsim.c */
+struct _KDPC;
+
+typedef VOID (*PKDEFERRED_ROUTINE)(_In_ struct _KDPC* Dpc,
+                                   _In_opt_ PVOID     DeferredContext,
+                                   _In_opt_ PVOID     SystemArgument1,
+                                   _In_opt_ PVOID     SystemArgument2);
+
+typedef struct _KDPC {
+        PKDEFERRED_ROUTINE routine;
+        PVOID              context;
+        UINT64             reserved[6];
+
+} KDPC, *PKDPC, *PRKDPC;
+
+typedef struct _KTIMER {
+        UINT64 reserved[8];
+
+} KTIMER, *PKTIMER;
+
+typedef struct _KEVENT {
+        volatile LONG signalled;
+        UINT64        reserved[2];
+
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+typedef struct _KGUARDED_MUTEX {
+        volatile LONG owned;
+        UINT64        reserved[6];
+
+} KGUARDED_MUTEX, *PKGUARDED_MUTEX;
+
+typedef struct _KAPC_STATE {
+        UINT64 reserved[6];
+
+} KAPC_STATE, *PKAPC_STATE, *PRKAPC_STATE;
+
+typedef VOID (*PWORKER_THREAD_ROUTINE)(_In_ PVOID Parameter);
+
+typedef struct _WORK_QUEUE_ITEM {
+        PWORKER_THREAD_ROUTINE routine;
+        PVOID                  parameter;
+        UINT64                 reserved[2];
+
+} WORK_QUEUE_ITEM, *PWORK_QUEUE_ITEM;
+
+#define ExInitializeWorkItem(Item, Routine, Parameter) \
+        do {                                          \
+                (Item)->routine   = (Routine);        \
+                (Item)->parameter = (Parameter);      \
+        } while (0)
+
+typedef BOOLEAN (*PNMI_CALLBACK)(_In_opt_ PVOID Context, _In_ BOOLEAN Handled);
+typedef ULONG_PTR (*PKIPI_BROADCAST_WORKER)(_In_ ULONG_PTR Argument);
+typedef VOID (*PCALLBACK_FUNCTION)(_In_opt_ PVOID CallbackContext,
+                                   _In_opt_ PVOID Argument1,
+                                   _In_opt_ PVOID Argument2);
+
+/*
+ * The same layout and guarantees as SLIST_HEADER: the first entry and a
+ * sequence number bumped on every push are swapped together with cmpxchg16b,
+ * so an entry that is popped and pushed back between another core reading the
+ * head and swapping it can't be mistaken for an unchanged list. Needs -mcx16.
+ */
+typedef struct _SLIST_ENTRY {
+        struct _SLIST_ENTRY* Next;
+
+} __attribute__((aligned(16))) SLIST_ENTRY, *PSLIST_ENTRY;
+
+typedef union _SLIST_HEADER {
+        struct {
+                PSLIST_ENTRY next;
+                UINT64       sequence;
+        };
+        unsigned __int128 value;
+
+} __attribute__((aligned(16))) SLIST_HEADER, *PSLIST_HEADER;
+
+static inline VOID
+InitializeSListHead(_Out_ PSLIST_HEADER Head)
+{
+        Head->value = 0;
+}
+
+/*
+ * The halves are read one at a time, a torn read only ever fails the swap
+ * that follows it.
+ */
+static inline SLIST_HEADER
+SListReadHead(_In_ PSLIST_HEADER Head)
+{
+        SLIST_HEADER head = {0};
+
+        head.sequence = ((volatile SLIST_HEADER*)Head)->sequence;
+        head.next     = ((volatile SLIST_HEADER*)Head)->next;
+        return head;
+}
+
+static inline PSLIST_ENTRY
+InterlockedPushEntrySList(_In_ PSLIST_HEADER Head, _In_ PSLIST_ENTRY Entry)
+{
+        SLIST_HEADER old     = {0};
+        SLIST_HEADER updated = {0};
+
+        do {
+                old              = SListReadHead(Head);
+                Entry->Next      = old.next;
+                updated.next     = Entry;
+                updated.sequence = old.sequence + 1;
+        } while (!__sync_bool_compare_and_swap(
+            &Head->value, old.value, updated.value));
+
+        return old.next;
+}
+
+static inline PSLIST_ENTRY
+InterlockedPopEntrySList(_In_ PSLIST_HEADER Head)
+{
+        SLIST_HEADER old     = {0};
+        SLIST_HEADER updated = {0};
+
+        do {
+                old = SListReadHead(Head);
+
+                if (!old.next)
+                        return NULL;
+
+                /* entries are never unmapped, so this is safe to read stale */
+                updated.next     = old.next->Next;
+                updated.sequence = old.sequence;
+        } while (!__sync_bool_compare_and_swap(
+            &Head->value, old.value, updated.value));
+
+        return old.next;
+}
+
+/* every interlocked operation is a full barrier on x64 */
+#define InterlockedIncrement(Target) \
+        __atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Target) \
+        __atomic_sub_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(Target) InterlockedIncrement(Target)
+#define InterlockedDecrement64(Target) InterlockedDecrement(Target)
+#define InterlockedExchange(Target, Value) \
+        __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(Target, Value) InterlockedExchange(Target, Value)
+#define InterlockedExchangePointer(Target, Value) \
+        InterlockedExchange(Target, Value)
+#define InterlockedExchangeAdd(Target, Value) \
+        __atomic_fetch_add((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(Target, Value) \
+        InterlockedExchangeAdd(Target, Value)
+#define InterlockedAdd(Target, Value) \
+        __atomic_add_fetch((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(Target, Value) InterlockedAdd(Target, Value)
+#define InterlockedOr(Target, Value) \
+        __atomic_fetch_or((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAnd(Target, Value) \
+        __atomic_fetch_and((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(Target, Exchange, Comparand) \
+        __sync_val_compare_and_swap((Target), (Comparand), (Exchange))
+#define InterlockedCompareExchange64(Target, Exchange, Comparand) \
+        InterlockedCompareExchange(Target, Exchange, Comparand)
+#define InterlockedCompareExchangePointer(Target, Exchange, Comparand) \
+        InterlockedCompareExchange(Target, Exchange, Comparand)
+
+#define KeMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define KeMemoryBarrierWithoutFence() \
+        __asm__ __volatile__("" ::: "memory")
+#define _ReadWriteBarrier() KeMemoryBarrierWithoutFence()
+#define YieldProcessor()    _mm_pause()
+
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define RtlSecureZeroMemory(Destination, Length) \
+        memset((Destination), 0, (Length))
+#define RtlCopyMemory(Destination, Source, Length) \
+        memcpy((Destination), (Source), (Length))
+#define RtlFillMemory(Destination, Length, Fill) \
+        memset((Destination), (Fill), (Length))
+
+/*
+ * The root log's records hold their arguments laid out as an msvc va_list,
+ * which nothing else can be made to take, so they are never printed here.
+ */
+#define vDbgPrintExWithPrefix(Prefix, Component, Level, Format, Arguments) \
+        ((void)0)
+
+ULONG
+DbgPrintEx(_In_ ULONG Component, _In_ ULONG Level, _In_ PCSTR Format, ...);
+
+extern PVOID         MmSystemRangeStart;
+extern POBJECT_TYPE* ExEventObjectType;
+
+/*
+ * Raised by the exit handlers on anything they can't recover from. Returns
+ * to the test through NtSimExpectBugCheck, or aborts when none is expected.
+ */
+__attribute__((noreturn)) VOID
+KeBugCheckEx(_In_ ULONG     BugCheckCode,
+             _In_ ULONG_PTR Parameter1,
+             _In_ ULONG_PTR Parameter2,
+             _In_ ULONG_PTR Parameter3,
+             _In_ ULONG_PTR Parameter4);
+
+/* the privileged instructions the exit path issues directly */
+VOID
+__debugbreak();
+
+VOID
+__wbinvd();
+
+VOID
+_disable();
+
+VOID
+_enable();
+
+VOID
+__lidt(_In_ PVOID Source);
+
+VOID
+__sidt(_Out_ PVOID Destination);
+
+ULONG
+__segmentlimit(_In_ ULONG Selector);
+
+UCHAR
+__inbyte(_In_ USHORT Port);
+
+USHORT
+__inword(_In_ USHORT Port);
+
+ULONG
+__indword(_In_ USHORT Port);
+
+VOID
+__inbytestring(_In_ USHORT Port, _Out_ PUCHAR Buffer, _In_ ULONG Count);
+
+VOID
+__inwordstring(_In_ USHORT Port, _Out_ PUSHORT Buffer, _In_ ULONG Count);
+
+VOID
+__indwordstring(_In_ USHORT Port, _Out_ PULONG Buffer, _In_ ULONG Count);
+
+VOID
+__outbyte(_In_ USHORT Port, _In_ UCHAR Data);
+
+VOID
+__outword(_In_ USHORT Port, _In_ USHORT Data);
+
+VOID
+__outdword(_In_ USHORT Port, _In_ ULONG Data);
+
+VOID
+__outbytestring(_In_ USHORT Port, _In_ PUCHAR Buffer, _In_ ULONG Count);
+
+VOID
+__outwordstring(_In_ USHORT Port, _In_ PUSHORT Buffer, _In_ ULONG Count);
+
+VOID
+__outdwordstring(_In_ USHORT Port, _In_ PULONG Buffer, _In_ ULONG Count);
+
+UCHAR
+__vmx_on(_In_ UINT64* VmsSupportPhysicalAddress);
+
+VOID
+__vmx_off();
+
+UCHAR
+__vmx_vmclear(_In_ UINT64* VmcsPhysicalAddress);
+
+UCHAR
+__vmx_vmptrld(_In_ UINT64* VmcsPhysicalAddress);
+
+UCHAR
+__vmx_vmlaunch();
+
+/* processors and groups, as set by NtSimSetTopology */
+USHORT
+KeQueryActiveGroupCount();
+
+ULONG
+KeQueryActiveProcessorCountEx(_In_ USHORT GroupNumber);
+
+ULONG
+KeQueryMaximumProcessorCountEx(_In_ USHORT GroupNumber);
+
+KAFFINITY
+KeQueryGroupAffinity(_In_ USHORT GroupNumber);
+
+NTSTATUS
+KeGetProcessorNumberFromIndex(_In_ ULONG               ProcIndex,
+                              _Out_ PPROCESSOR_NUMBER ProcNumber);
+
+ULONG
+KeGetCurrentProcessorNumberEx(_Out_opt_ PPROCESSOR_NUMBER ProcNumber);
+
+USHORT
+KeGetProcessorNodeNumber(_In_ PPROCESSOR_NUMBER ProcNumber);
+
+VOID
+KeSetSystemGroupAffinityThread(_In_ PGROUP_AFFINITY       Affinity,
+                               _Out_opt_ PGROUP_AFFINITY PreviousAffinity);
+
+VOID
+KeRevertToUserGroupAffinityThread(_In_ PGROUP_AFFINITY PreviousAffinity);
+
+VOID
+KeRaiseIrql(_In_ KIRQL NewIrql, _Out_ PKIRQL OldIrql);
+
+VOID
+KeLowerIrql(_In_ KIRQL NewIrql);
+
+ULONG_PTR
+KeIpiGenericCall(_In_ PKIPI_BROADCAST_WORKER BroadcastFunction,
+                 _In_ ULONG_PTR              Context);
+
+PVOID
+KeRegisterNmiCallback(_In_ PNMI_CALLBACK CallbackRoutine,
+                      _In_opt_ PVOID     Context);
+
+NTSTATUS
+KeDeregisterNmiCallback(_In_ PVOID Handle);
+
+/* dpcs and timers never fire, a test calls the routine itself */
+VOID
+KeInitializeDpc(_Out_ PRKDPC            Dpc,
+                _In_ PKDEFERRED_ROUTINE DeferredRoutine,
+                _In_opt_ PVOID          DeferredContext);
+
+VOID
+KeFlushQueuedDpcs();
+
+VOID
+KeInitializeTimer(_Out_ PKTIMER Timer);
+
+BOOLEAN
+KeSetTimerEx(_Inout_ PKTIMER    Timer,
+             _In_ LARGE_INTEGER DueTime,
+             _In_ LONG          Period,
+             _In_opt_ PKDPC     Dpc);
+
+BOOLEAN
+KeCancelTimer(_Inout_ PKTIMER Timer);
+
+VOID
+KeInitializeEvent(_Out_ PRKEVENT  Event,
+                  _In_ EVENT_TYPE Type,
+                  _In_ BOOLEAN    State);
+
+LONG
+KeSetEvent(_Inout_ PRKEVENT Event, _In_ LONG Increment, _In_ BOOLEAN Wait);
+
+VOID
+KeClearEvent(_Inout_ PRKEVENT Event);
+
+NTSTATUS
+KeWaitForSingleObject(_In_ PVOID           Object,
+                      _In_ KWAIT_REASON    WaitReason,
+                      _In_ KPROCESSOR_MODE WaitMode,
+                      _In_ BOOLEAN         Alertable,
+                      _In_opt_ PLARGE_INTEGER Timeout);
+
+VOID
+KeInitializeGuardedMutex(_Out_ PKGUARDED_MUTEX Mutex);
+
+VOID
+KeAcquireGuardedMutex(_Inout_ PKGUARDED_MUTEX Mutex);
+
+VOID
+KeReleaseGuardedMutex(_Inout_ PKGUARDED_MUTEX Mutex);
+
+/* runs the work item there and then */
+VOID
+ExQueueWorkItem(_Inout_ PWORK_QUEUE_ITEM WorkItem,
+                _In_ WORK_QUEUE_TYPE     QueueType);
+
+/* memory, every physical address is the virtual address it was given out at */
+PVOID
+ExAllocatePool2(_In_ UINT64 Flags, _In_ SIZE_T NumberOfBytes, _In_ ULONG Tag);
+
+VOID
+ExFreePool(_In_ PVOID P);
+
+VOID
+ExFreePoolWithTag(_In_ PVOID P, _In_ ULONG Tag);
+
+PVOID
+MmAllocateContiguousMemory(_In_ SIZE_T           NumberOfBytes,
+                           _In_ PHYSICAL_ADDRESS HighestAcceptableAddress);
+
+PVOID
+MmAllocateContiguousNodeMemory(_In_ SIZE_T           NumberOfBytes,
+                               _In_ PHYSICAL_ADDRESS LowestAcceptableAddress,
+                               _In_ PHYSICAL_ADDRESS HighestAcceptableAddress,
+                               _In_ PHYSICAL_ADDRESS BoundaryAddressMultiple,
+                               _In_ ULONG            Protect,
+                               _In_ ULONG            PreferredNode);
+
+VOID
+MmFreeContiguousMemory(_In_ PVOID BaseAddress);
+
+PHYSICAL_ADDRESS
+MmGetPhysicalAddress(_In_ PVOID BaseAddress);
+
+PPHYSICAL_MEMORY_RANGE
+MmGetPhysicalMemoryRanges();
+
+BOOLEAN
+MmIsAddressValid(_In_ PVOID VirtualAddress);
+
+PVOID
+MmMapIoSpaceEx(_In_ PHYSICAL_ADDRESS PhysicalAddress,
+               _In_ SIZE_T           NumberOfBytes,
+               _In_ ULONG            Protect);
+
+VOID
+MmUnmapIoSpace(_In_ PVOID BaseAddress, _In_ SIZE_T NumberOfBytes);
+
+PMDL
+IoAllocateMdl(_In_opt_ PVOID   VirtualAddress,
+              _In_ ULONG       Length,
+              _In_ BOOLEAN     SecondaryBuffer,
+              _In_ BOOLEAN     ChargeQuota,
+              _Inout_opt_ PIRP Irp);
+
+VOID
+IoFreeMdl(_In_ PMDL Mdl);
+
+VOID
+MmBuildMdlForNonPagedPool(_Inout_ PMDL MemoryDescriptorList);
+
+VOID
+MmProbeAndLockPages(_Inout_ PMDL         MemoryDescriptorList,
+                    _In_ KPROCESSOR_MODE AccessMode,
+                    _In_ LOCK_OPERATION  Operation);
+
+VOID
+MmUnlockPages(_Inout_ PMDL MemoryDescriptorList);
+
+PULONG_PTR
+MmGetMdlPfnArray(_In_ PMDL MemoryDescriptorList);
+
+PVOID
+MmMapLockedPagesSpecifyCache(_Inout_ PMDL             MemoryDescriptorList,
+                             _In_ KPROCESSOR_MODE     AccessMode,
+                             _In_ MEMORY_CACHING_TYPE CacheType,
+                             _In_opt_ PVOID           RequestedAddress,
+                             _In_ ULONG               BugCheckOnFailure,
+                             _In_ ULONG               Priority);
+
+VOID
+MmUnmapLockedPages(_In_ PVOID BaseAddress, _Inout_ PMDL MemoryDescriptorList);
+
+VOID
+RtlFillMemoryUlong(_Out_ PVOID Destination,
+                   _In_ SIZE_T Length,
+                   _In_ ULONG  Pattern);
+
+SIZE_T
+RtlCompareMemoryUlong(_In_ PVOID  Source,
+                      _In_ SIZE_T Length,
+                      _In_ ULONG  Pattern);
+
+/* objects, the registry and callbacks, none of which exist here */
+PEPROCESS
+PsGetCurrentProcess();
+
+VOID
+KeStackAttachProcess(_Inout_ PEPROCESS Process, _Out_ PRKAPC_STATE ApcState);
+
+VOID
+KeUnstackDetachProcess(_In_ PRKAPC_STATE ApcState);
+
+VOID
+ObReferenceObject(_In_ PVOID Object);
+
+VOID
+ObDereferenceObject(_In_ PVOID Object);
+
+NTSTATUS
+ObReferenceObjectByHandle(_In_ HANDLE           Handle,
+                          _In_ ACCESS_MASK      DesiredAccess,
+                          _In_opt_ POBJECT_TYPE ObjectType,
+                          _In_ KPROCESSOR_MODE  AccessMode,
+                          _Out_ PVOID*          Object,
+                          _Out_opt_ PVOID       HandleInformation);
+
+NTSTATUS
+ZwOpenKey(_Out_ PHANDLE           KeyHandle,
+          _In_ ACCESS_MASK        DesiredAccess,
+          _In_ OBJECT_ATTRIBUTES* ObjectAttributes);
+
+NTSTATUS
+ZwQueryValueKey(_In_ HANDLE                      KeyHandle,
+                _In_ PUNICODE_STRING             ValueName,
+                _In_ KEY_VALUE_INFORMATION_CLASS Class,
+                _Out_opt_ PVOID                  KeyValueInformation,
+                _In_ ULONG                       Length,
+                _Out_ PULONG                     ResultLength);
+
+NTSTATUS
+ZwClose(_In_ HANDLE Handle);
+
+NTSTATUS
+ExCreateCallback(_Out_ PCALLBACK_OBJECT* CallbackObject,
+                 _In_ OBJECT_ATTRIBUTES* ObjectAttributes,
+                 _In_ BOOLEAN            Create,
+                 _In_ BOOLEAN            AllowMultipleCallbacks);
+
+PVOID
+ExRegisterCallback(_Inout_ PCALLBACK_OBJECT CallbackObject,
+                   _In_ PCALLBACK_FUNCTION  CallbackFunction,
+                   _In_opt_ PVOID           CallbackContext);
+
+VOID
+ExUnregisterCallback(_Inout_ PVOID CallbackRegistration);
+
+#endif
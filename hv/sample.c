@@ -0,0 +1,138 @@
+#include "sample.h"
+
+#if !defined(_KERNEL_MODE)
+#        include <string.h>
+#endif
+
+#define SAMPLE_HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+
+/* anything this close to the stack pointer is a stack address, not code */
+#define SAMPLE_STACK_SPAN 0x10000
+
+/*
+ * x64 code doesn't keep frame pointers, so there is no chain to follow.
+ * Instead the stack is scanned for qwords that could be return addresses,
+ * i.e kernel addresses that don't point back into the stack itself. This is
+ * the same heuristic a debugger falls back to without unwind data, and can
+ * report stale frames left behind by earlier calls.
+ */
+UINT32
+SampleScanStack(_In_ const UINT64* Stack,
+                _In_ UINT32        Count,
+                _In_ UINT64        Rsp,
+                _Out_ UINT64*      Frames)
+{
+        UINT32 found = 0;
+        UINT64 value = 0;
+
+        for (UINT32 index = 0; index < Count && found < SAMPLE_MAX_FRAMES;
+             index++) {
+                value = Stack[index];
+
+                if (value < SAMPLE_KERNEL_BASE)
+                        continue;
+
+                if (value - Rsp < SAMPLE_STACK_SPAN ||
+                    Rsp - value < SAMPLE_STACK_SPAN)
+                        continue;
+
+                Frames[found++] = value;
+        }
+
+        return found;
+}
+
+VOID
+SampleProfileInitialise(_Out_ PSAMPLE_PROFILE Profile,
+                        _In_ PSAMPLE_BUCKET   Buckets,
+                        _In_ UINT32           Capacity)
+{
+        memset(Buckets, 0, (size_t)Capacity * sizeof(SAMPLE_BUCKET));
+
+        Profile->buckets  = Buckets;
+        Profile->capacity = Capacity;
+        Profile->used     = 0;
+        Profile->total    = 0;
+        Profile->dropped  = 0;
+}
+
+/* Capacity must be a power of 2. A bucket with a count of 0 is empty. */
+VOID
+SampleProfileAdd(_Inout_ PSAMPLE_PROFILE Profile,
+                 _In_ UINT64             Rip,
+                 _In_ UINT64             Cr3,
+                 _In_ UINT8              Cpl)
+{
+        PSAMPLE_BUCKET bucket = NULL;
+        UINT64         hash   = 0;
+        UINT32         slot   = 0;
+
+        Profile->total++;
+
+        hash = (Rip ^ ((Cr3 >> 12) * SAMPLE_HASH_MULTIPLIER) ^ Cpl) *
+               SAMPLE_HASH_MULTIPLIER;
+        slot = (UINT32)(hash >> 32) & (Profile->capacity - 1);
+
+        for (;;) {
+                bucket = &Profile->buckets[slot];
+
+                if (!bucket->count)
+                        break;
+
+                if (bucket->rip == Rip && bucket->cr3 == Cr3 &&
+                    bucket->cpl == Cpl) {
+                        bucket->count++;
+                        return;
+                }
+
+                slot = (slot + 1) & (Profile->capacity - 1);
+        }
+
+        if ((Profile->used + 1) * 4 > Profile->capacity * 3) {
+                Profile->dropped++;
+                return;
+        }
+
+        bucket->rip   = Rip;
+        bucket->cr3   = Cr3;
+        bucket->cpl   = Cpl;
+        bucket->count = 1;
+        Profile->used++;
+}
+
+/*
+ * A profile can hold far more buckets than a sketch has counters, so this is
+ * a shell sort rather than the insertion sort SketchSortCounters gets away
+ * with. Only the first used buckets are valid afterwards.
+ */
+VOID
+SampleProfileSort(_Inout_ PSAMPLE_PROFILE Profile)
+{
+        PSAMPLE_BUCKET buckets = Profile->buckets;
+        SAMPLE_BUCKET  bucket  = {0};
+        UINT32         used    = 0;
+        UINT32         gap     = 1;
+        UINT32         index   = 0;
+
+        for (index = 0; index < Profile->capacity; index++) {
+                if (buckets[index].count)
+                        buckets[used++] = buckets[index];
+        }
+
+        while (gap < used / 3)
+                gap = gap * 3 + 1;
+
+        for (; gap; gap /= 3) {
+                for (UINT32 next = gap; next < used; next++) {
+                        bucket = buckets[next];
+
+                        for (index = next;
+                             index >= gap &&
+                             buckets[index - gap].count < bucket.count;
+                             index -= gap)
+                                buckets[index] = buckets[index - gap];
+
+                        buckets[index] = bucket;
+                }
+        }
+}
@@ -0,0 +1,95 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+/*
+ * Helpers for the preemption timer sampling profiler. The driver uses
+ * SampleScanStack to pick likely return addresses off the guests stack, and
+ * the tools aggregate the SAMPLE_RECORDs it writes with a SAMPLE_PROFILE.
+ *
+ * Like sketch.h this has no kernel dependencies, see tools/sampleprof.c.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#elif defined(_WIN32)
+#        include <windows.h>
+#else
+#        include <stdint.h>
+typedef void VOID;
+#        define _In_
+#        define _Out_
+#        define _Inout_
+#endif
+
+#if !defined(_KERNEL_MODE)
+#        define STATIC static
+#endif
+
+#include "trace.h"
+
+/* the most qwords SampleScanStack is ever asked to look at */
+#define SAMPLE_SCAN_QWORDS 64
+
+/* start of the canonical upper half, where every kernel address lies */
+#define SAMPLE_KERNEL_BASE 0xFFFF800000000000ull
+
+typedef struct _SAMPLE_BUCKET {
+        UINT64 rip;
+        UINT64 cr3;
+        UINT64 count;
+        UINT8  cpl;
+        UINT8  reserved[7];
+
+} SAMPLE_BUCKET, *PSAMPLE_BUCKET;
+
+/*
+ * Open addressed table of samples keyed by (rip, cr3, cpl) over a caller
+ * supplied array of buckets. Samples that would fill the table beyond three
+ * quarters are counted in dropped instead, so probes stay short.
+ */
+typedef struct _SAMPLE_PROFILE {
+        PSAMPLE_BUCKET buckets;
+        UINT32         capacity;
+        UINT32         used;
+        UINT64         total;
+        UINT64         dropped;
+
+} SAMPLE_PROFILE, *PSAMPLE_PROFILE;
+
+/*
+ * Number of qwords that can be read starting at Rsp without leaving its page.
+ * The page holding the stack pointer is always present, the one after it
+ * need not be.
+ */
+static __inline UINT32
+SampleStackWindow(_In_ UINT64 Rsp)
+{
+        UINT32 window = (UINT32)((0x1000 - (Rsp & 0xFFF)) / sizeof(UINT64));
+
+        return window < SAMPLE_SCAN_QWORDS ? window : SAMPLE_SCAN_QWORDS;
+}
+
+UINT32
+SampleScanStack(_In_ const UINT64* Stack,
+                _In_ UINT32        Count,
+                _In_ UINT64        Rsp,
+                _Out_ UINT64*      Frames);
+
+VOID
+SampleProfileInitialise(_Out_ PSAMPLE_PROFILE Profile,
+                        _In_ PSAMPLE_BUCKET   Buckets,
+                        _In_ UINT32           Capacity);
+
+VOID
+SampleProfileAdd(_Inout_ PSAMPLE_PROFILE Profile,
+                 _In_ UINT64             Rip,
+                 _In_ UINT64             Cr3,
+                 _In_ UINT8              Cpl);
+
+/*
+ * Compacts the used buckets to the front of the array and orders them by
+ * count, highest first. Nothing may be added to the profile afterwards.
+ */
+VOID
+SampleProfileSort(_Inout_ PSAMPLE_PROFILE Profile);
+
+#endif
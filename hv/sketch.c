@@ -0,0 +1,170 @@
+#include "sketch.h"
+
+#if !defined(_KERNEL_MODE)
+#        include <string.h>
+#endif
+
+#define SKETCH_HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+
+static __inline UINT32
+SketchHome(_In_ UINT64 Rip, _In_ UINT32 Reason)
+{
+        UINT64 hash = (Rip ^ ((UINT64)Reason << 48)) * SKETCH_HASH_MULTIPLIER;
+
+        return (UINT32)(hash >> 32) & (SKETCH_SLOTS - 1);
+}
+
+static __inline UINT32
+SketchNext(_In_ UINT32 Slot)
+{
+        return (Slot + 1) & (SKETCH_SLOTS - 1);
+}
+
+VOID
+SketchInitialise(_Out_ PEXIT_SKETCH Sketch)
+{
+        memset((void*)Sketch, 0, sizeof(EXIT_SKETCH));
+}
+
+/*
+ * Linear probing removal by shifting back every entry in the cluster that can
+ * be moved closer to its home slot, so lookups never need tombstones.
+ */
+STATIC
+VOID
+SketchRemoveSlot(_Inout_ PEXIT_SKETCH Sketch, _In_ UINT32 Slot)
+{
+        UINT32          next    = Slot;
+        UINT32          home    = 0;
+        PSKETCH_COUNTER counter = NULL;
+
+        for (;;) {
+                next = SketchNext(next);
+
+                if (!Sketch->index[next])
+                        break;
+
+                counter = &Sketch->counters[Sketch->index[next] - 1];
+                home    = SketchHome(counter->rip, counter->reason);
+
+                /* leave it be if its home lies cyclically in (Slot, next] */
+                if (Slot <= next ? (Slot < home && home <= next) :
+                                   (Slot < home || home <= next))
+                        continue;
+
+                Sketch->index[Slot] = Sketch->index[next];
+                Slot                = next;
+        }
+
+        Sketch->index[Slot] = 0;
+}
+
+STATIC
+UINT32
+SketchFindSlot(_In_ PEXIT_SKETCH Sketch, _In_ UINT64 Rip, _In_ UINT32 Reason)
+{
+        UINT32 slot = SketchHome(Rip, Reason);
+
+        while (Sketch->index[slot]) {
+                PSKETCH_COUNTER counter =
+                    &Sketch->counters[Sketch->index[slot] - 1];
+
+                if (counter->rip == Rip && counter->reason == Reason)
+                        break;
+
+                slot = SketchNext(slot);
+        }
+
+        return slot;
+}
+
+/*
+ * On a miss with every counter in use, the counter with the lowest count is
+ * taken over by the new pair. Its count becomes the new pair's error, as
+ * that many of the exits now attributed to it may have been someone else's.
+ */
+VOID
+SketchUpdate(_Inout_ PEXIT_SKETCH Sketch, _In_ UINT64 Rip, _In_ UINT32 Reason)
+{
+        PSKETCH_COUNTER counter = NULL;
+        UINT32          slot    = 0;
+        UINT32          minimum = 0;
+
+        Sketch->sequence++;
+        SKETCH_COMPILER_BARRIER();
+
+        Sketch->total++;
+        slot = SketchFindSlot(Sketch, Rip, Reason);
+
+        if (Sketch->index[slot]) {
+                Sketch->counters[Sketch->index[slot] - 1].count++;
+                goto end;
+        }
+
+        if (Sketch->used < SKETCH_COUNTERS) {
+                counter        = &Sketch->counters[Sketch->used++];
+                counter->count = 0;
+                counter->error = 0;
+        }
+        else {
+                for (UINT32 index = 1; index < SKETCH_COUNTERS; index++) {
+                        if (Sketch->counters[index].count <
+                            Sketch->counters[minimum].count)
+                                minimum = index;
+                }
+
+                counter = &Sketch->counters[minimum];
+                SketchRemoveSlot(
+                    Sketch,
+                    SketchFindSlot(Sketch, counter->rip, counter->reason));
+
+                counter->error = counter->count;
+
+                /* the removal may have shifted our empty slot */
+                slot = SketchFindSlot(Sketch, Rip, Reason);
+        }
+
+        counter->rip    = Rip;
+        counter->reason = Reason;
+        counter->count++;
+
+        Sketch->index[slot] = (UINT8)(counter - Sketch->counters + 1);
+
+end:
+        SKETCH_COMPILER_BARRIER();
+        Sketch->sequence++;
+}
+
+int
+SketchSnapshot(_In_ const volatile EXIT_SKETCH* Sketch,
+               _Out_ PEXIT_SKETCH               Copy)
+{
+        UINT64 sequence = Sketch->sequence;
+
+        if (sequence & 1)
+                return 0;
+
+        SKETCH_COMPILER_BARRIER();
+        memcpy(Copy, (const void*)Sketch, sizeof(EXIT_SKETCH));
+        SKETCH_COMPILER_BARRIER();
+
+        return Sketch->sequence == sequence;
+}
+
+/* there are only ever SKETCH_COUNTERS entries, so insertion sort it is */
+VOID
+SketchSortCounters(_Inout_ PSKETCH_COUNTER Counters, _In_ UINT32 Count)
+{
+        for (UINT32 index = 1; index < Count; index++) {
+                SKETCH_COUNTER counter  = Counters[index];
+                UINT32         position = index;
+
+                while (position &&
+                       Counters[position - 1].count < counter.count) {
+                        Counters[position] = Counters[position - 1];
+                        position--;
+                }
+
+                Counters[position] = counter;
+        }
+}
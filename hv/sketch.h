@@ -0,0 +1,84 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+/*
+ * Per vcpu heavy hitters sketch of (guest rip, exit reason) pairs, using the
+ * Space-Saving algorithm with a fixed number of counters. Memory and the cost
+ * of an update are bounded no matter how many distinct instructions exit, and
+ * any pair making up more than 1 / SKETCH_COUNTERS of the exits is guaranteed
+ * to hold a counter. A counter's count overestimates the true number of exits
+ * by at most its error.
+ *
+ * Like topology.h this has no kernel dependencies, see tools/sketchbench.c.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#        define SKETCH_COMPILER_BARRIER() KeMemoryBarrierWithoutFence()
+#elif defined(_WIN32)
+#        include <windows.h>
+#        include <intrin.h>
+#        define SKETCH_COMPILER_BARRIER() _ReadWriteBarrier()
+#else
+#        include <stdint.h>
+typedef uint8_t  UINT8;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef void     VOID;
+#        define SKETCH_COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+#        define _In_
+#        define _Out_
+#        define _Inout_
+#endif
+
+#if !defined(_KERNEL_MODE)
+#        define STATIC static
+#endif
+
+/* must stay below 256 as the index stores counter + 1 in a byte */
+#define SKETCH_COUNTERS 64
+/* a power of 2, kept at least twice the counters so probes stay short */
+#define SKETCH_SLOTS    128
+
+typedef struct _SKETCH_COUNTER {
+        UINT64 rip;
+        UINT64 count;
+        UINT64 error;
+        UINT32 reason;
+        UINT32 reserved;
+
+} SKETCH_COUNTER, *PSKETCH_COUNTER;
+
+/*
+ * Only ever updated by the core that owns it. sequence is odd while an update
+ * is in progress, which is how SketchSnapshot detects a torn copy.
+ */
+typedef struct _EXIT_SKETCH {
+        volatile UINT64 sequence;
+        UINT64          total;
+        UINT32          used;
+        UINT32          reserved;
+        SKETCH_COUNTER  counters[SKETCH_COUNTERS];
+        /* open addressed, each slot holds a counter index + 1, or 0 */
+        UINT8           index[SKETCH_SLOTS];
+
+} EXIT_SKETCH, *PEXIT_SKETCH;
+
+VOID
+SketchInitialise(_Out_ PEXIT_SKETCH Sketch);
+
+VOID
+SketchUpdate(_Inout_ PEXIT_SKETCH Sketch, _In_ UINT64 Rip, _In_ UINT32 Reason);
+
+/*
+ * Returns 0 if the sketch was being updated while it was copied, in which case
+ * the copy must be discarded and the snapshot retried.
+ */
+int
+SketchSnapshot(_In_ const volatile EXIT_SKETCH* Sketch,
+               _Out_ PEXIT_SKETCH               Copy);
+
+/* orders the counters by count, highest first */
+VOID
+SketchSortCounters(_Inout_ PSKETCH_COUNTER Counters, _In_ UINT32 Count);
+
+#endif
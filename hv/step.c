@@ -0,0 +1,410 @@
+#include "step.h"
+
+/* the gprs, which come first in COND_REGISTER */
+#define STEP_GPR_MASK ((1u << COND_REGISTER_RFLAGS) - 1)
+
+STATIC
+UINT32
+StepCountRegisters(_In_ UINT32 Mask)
+{
+        UINT32 count = 0;
+
+        for (; Mask; Mask &= Mask - 1)
+                count++;
+
+        return count;
+}
+
+BOOLEAN
+StepValidateRequest(_In_ const HV_STEP_TRACE_REQUEST* Request)
+{
+        if (Request->register_mask & ~STEP_GPR_MASK ||
+            StepCountRegisters(Request->register_mask) > STEP_MAX_REGISTERS)
+                return FALSE;
+
+        if (Request->range_end && Request->range_start >= Request->range_end)
+                return FALSE;
+
+        if (Request->operand.instruction_count &&
+            CondVerify(&Request->operand) >= 0)
+                return FALSE;
+
+        return TRUE;
+}
+
+STEP_STOP_REASON
+StepCheckStop(_In_ const HV_STEP_TRACE_REQUEST* Request,
+              _In_ UINT32                       Step,
+              _In_ UINT64                       Rip,
+              _In_ UINT64                       Unconsumed,
+              _In_ UINT32                       Capacity)
+{
+        if (Request->range_end &&
+            (Rip < Request->range_start || Rip >= Request->range_end))
+                return STEP_STOP_RANGE;
+
+        if (Step >= Request->max_steps)
+                return STEP_STOP_STEPS;
+
+        /*
+         * This record takes the last slot the reader hasn't consumed. The
+         * slot at the head is never held, see TraceRingPublish, so that is
+         * one short of the capacity.
+         */
+        if (Unconsumed + 2 >= Capacity)
+                return STEP_STOP_FULL;
+
+        return STEP_STOP_NONE;
+}
+
+VOID
+StepWriteRecord(_Out_ PSTEP_RECORD                 Record,
+                _In_ const HV_STEP_TRACE_REQUEST* Request,
+                _In_ const UINT64*                Registers,
+                _In_ COND_READ_ROUTINE            Read,
+                _In_ UINT64                       Timestamp,
+                _In_ UINT32                       Step,
+                _In_ STEP_STOP_REASON             Reason)
+{
+        UINT32 count   = 0;
+        UINT64 address = 0;
+
+        Record->timestamp      = Timestamp;
+        Record->guest_rip      = Registers[COND_REGISTER_RIP];
+        Record->guest_rflags   = Registers[COND_REGISTER_RFLAGS];
+        Record->step           = Step;
+        Record->register_mask  = (UINT16)Request->register_mask;
+        Record->flags          = 0;
+        Record->stop_reason    = (UINT8)Reason;
+        Record->memory_address = 0;
+        Record->memory_value   = 0;
+
+        for (UINT32 index = 0; index < COND_REGISTER_RFLAGS; index++) {
+                if (Request->register_mask & (1u << index))
+                        Record->registers[count++] = Registers[index];
+        }
+
+        while (count < STEP_MAX_REGISTERS)
+                Record->registers[count++] = 0;
+
+        if (Request->operand.instruction_count) {
+                if (CondEvaluateValue(&Request->operand,
+                                      Registers,
+                                      Read,
+                                      NULL,
+                                      &address) == COND_RESULT_FAULT ||
+                    !Read(NULL,
+                          address,
+                          sizeof(UINT64),
+                          &Record->memory_value))
+                        Record->flags |= STEP_RECORD_MEMORY_FAULT;
+                else
+                        Record->flags |= STEP_RECORD_MEMORY;
+
+                Record->memory_address = address;
+        }
+
+        if (Reason != STEP_STOP_NONE)
+                Record->flags |= STEP_RECORD_LAST;
+}
+
+#if defined(_KERNEL_MODE)
+
+#        include "cap.h"
+#        include "ept.h"
+#        include "log.h"
+#        include "topology.h"
+#        include "vmcs.h"
+
+#        define POOL_TAG_STEP 'ptsv'
+
+/* only ever touched by its own core in root, besides ring and consumed */
+typedef struct _STEP_CORE {
+        PTRACE_RING_HEADER    ring;
+        /* the furthest cursor read so far, see StepReadTrace */
+        volatile UINT64       consumed;
+        BOOLEAN               active;
+        UINT32                step;
+        /* the sequence config was copied at */
+        LONG                  sequence;
+        HV_STEP_TRACE_REQUEST config;
+
+} STEP_CORE, *PSTEP_CORE;
+
+typedef struct _STEP_STATE {
+        KGUARDED_MUTEX        lock;
+        /*
+         * Odd while config is being written. A trace copies config when it
+         * starts, and stops once the sequence has moved on from the one it
+         * copied it at.
+         */
+        volatile LONG         sequence;
+        HV_STEP_TRACE_REQUEST config;
+        UINT32                core_count;
+        PSTEP_CORE            cores;
+        BOOLEAN               enabled;
+
+} STEP_STATE, *PSTEP_STATE;
+
+STATIC STEP_STATE step_state = {0};
+
+BOOLEAN
+StepIsEnabled()
+{
+        return step_state.enabled;
+}
+
+/*
+ * Must be called after EptInitialise, as traces are only ever started by a
+ * breakpoint. Failing here is not fatal, we simply run without tracing.
+ */
+NTSTATUS
+StepInitialise()
+{
+        const VMX_CAPABILITIES* cap = CapGetCapabilities();
+
+        KeInitializeGuardedMutex(&step_state.lock);
+
+        if (!EptIsEnabled() ||
+            !((cap->procbased_ctls >> 32) &
+              IA32_VMX_PROCBASED_CTLS_MONITOR_TRAP_FLAG_FLAG))
+                return STATUS_NOT_SUPPORTED;
+
+        /* indexed by the topology index, which never reaches this */
+        step_state.core_count =
+            KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+        step_state.cores =
+            ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                            step_state.core_count * sizeof(STEP_CORE),
+                            POOL_TAG_STEP);
+
+        if (!step_state.cores)
+                return STATUS_MEMORY_NOT_ALLOCATED;
+
+        step_state.enabled = TRUE;
+        return STATUS_SUCCESS;
+}
+
+/* Must be called once no core is in VMX operation any more. */
+VOID
+StepFree()
+{
+        step_state.enabled = FALSE;
+
+        if (!step_state.cores)
+                return;
+
+        for (UINT32 index = 0; index < step_state.core_count; index++) {
+                if (step_state.cores[index].ring)
+                        TraceRingFree(step_state.cores[index].ring,
+                                      STEP_RING_POOL_TAG);
+        }
+
+        ExFreePoolWithTag(step_state.cores, POOL_TAG_STEP);
+        step_state.cores = NULL;
+}
+
+/*
+ * The rings are only allocated the first time the tracer is armed, and then
+ * kept until unload, so a core in root never sees one go away.
+ */
+NTSTATUS
+StepSetTrace(_In_ const HV_STEP_TRACE_REQUEST* Request)
+{
+        NTSTATUS   status = STATUS_SUCCESS;
+        PSTEP_CORE core   = NULL;
+
+        if (!step_state.enabled)
+                return STATUS_NOT_SUPPORTED;
+
+        if (Request->max_steps && !StepValidateRequest(Request))
+                return STATUS_INVALID_PARAMETER;
+
+        KeAcquireGuardedMutex(&step_state.lock);
+
+        for (UINT32 index = 0;
+             Request->max_steps && index < TopologyVcpuCount();
+             index++) {
+                core = &step_state.cores[index];
+
+                if (core->ring)
+                        continue;
+
+                core->ring = TraceRingAllocate(STEP_RING_CAPACITY,
+                                               sizeof(STEP_RECORD),
+                                               index,
+                                               STEP_RING_POOL_TAG);
+
+                if (!core->ring) {
+                        status = STATUS_INSUFFICIENT_RESOURCES;
+                        goto end;
+                }
+        }
+
+        InterlockedIncrement(&step_state.sequence);
+        RtlCopyMemory(
+            &step_state.config, Request, sizeof(HV_STEP_TRACE_REQUEST));
+        InterlockedIncrement(&step_state.sequence);
+
+end:
+        KeReleaseGuardedMutex(&step_state.lock);
+        return status;
+}
+
+NTSTATUS
+StepReadTrace(_In_ UINT32                        Core,
+              _In_ UINT64                        Cursor,
+              _Out_ PHV_STEP_TRACE_READ_RESPONSE Response,
+              _In_ UINT32                        ResponseLength,
+              _Out_ PUINT32                      BytesWritten)
+{
+        NTSTATUS   status   = STATUS_SUCCESS;
+        PSTEP_CORE core     = NULL;
+        UINT32     capacity = 0;
+        UINT32     count    = 0;
+        UINT64     lost     = 0;
+
+        *BytesWritten = 0;
+
+        if (ResponseLength < HV_STEP_TRACE_READ_RESPONSE_SIZE(1))
+                return STATUS_BUFFER_TOO_SMALL;
+
+        capacity =
+            (UINT32)((ResponseLength - HV_STEP_TRACE_READ_RESPONSE_SIZE(0)) /
+                     sizeof(STEP_RECORD));
+
+        if (!step_state.enabled)
+                return STATUS_NOT_SUPPORTED;
+
+        if (Core >= TopologyVcpuCount())
+                return STATUS_INVALID_PARAMETER;
+
+        KeAcquireGuardedMutex(&step_state.lock);
+
+        core = &step_state.cores[Core];
+
+        if (!core->ring) {
+                status = STATUS_NOT_FOUND;
+                goto end;
+        }
+
+        while (count < capacity &&
+               TraceRingNextRecord(
+                   core->ring, &Cursor, &lost, &Response->records[count]))
+                count++;
+
+        /* a reader going back over old records doesn't free up the ring */
+        if (Cursor > core->consumed)
+                core->consumed = Cursor;
+
+        Response->cursor       = Cursor;
+        Response->lost         = lost;
+        Response->record_count = count;
+        Response->reserved     = 0;
+        *BytesWritten          = HV_STEP_TRACE_READ_RESPONSE_SIZE(count);
+
+end:
+        KeReleaseGuardedMutex(&step_state.lock);
+        return status;
+}
+
+/*
+ * Like EptEvaluateCondition the guest's rsp, rflags and rip come from the
+ * VMCS, the rest are laid out as COND_REGISTER in the guest context.
+ */
+STATIC
+BOOLEAN
+StepRecord(_In_ PSTEP_CORE       Core,
+           _In_ PGUEST_CONTEXT   Context,
+           _In_ UINT64           GuestRip,
+           _In_ STEP_STOP_REASON Reason)
+{
+        UINT64       registers[COND_REGISTER_COUNT] = {0};
+        PSTEP_RECORD record                         = NULL;
+
+        RtlCopyMemory(registers, Context, sizeof(GUEST_CONTEXT));
+        registers[COND_REGISTER_RSP]    = VmxVmRead(VMCS_GUEST_RSP);
+        registers[COND_REGISTER_RFLAGS] = VmxVmRead(VMCS_GUEST_RFLAGS);
+        registers[COND_REGISTER_RIP]    = GuestRip;
+
+        if (Reason == STEP_STOP_NONE)
+                Reason = StepCheckStop(&Core->config,
+                                       Core->step,
+                                       GuestRip,
+                                       Core->ring->head - Core->consumed,
+                                       Core->ring->capacity);
+
+        record = TraceRingReserve(Core->ring);
+
+        StepWriteRecord(record,
+                        &Core->config,
+                        registers,
+                        CondReadKernel,
+                        __rdtsc(),
+                        Core->step,
+                        Reason);
+
+        TraceRingCommit(Core->ring);
+        return Reason == STEP_STOP_NONE;
+}
+
+VOID
+StepBegin(_In_ UINT32 Core, _In_ PGUEST_CONTEXT Context, _In_ UINT64 GuestRip)
+{
+        PSTEP_CORE core     = NULL;
+        LONG       sequence = 0;
+
+        if (!step_state.enabled)
+                return;
+
+        core = &step_state.cores[Core];
+
+        if (core->active || !core->ring)
+                return;
+
+        /* a hit while the tracer is being rearmed doesn't get a trace */
+        sequence = step_state.sequence;
+
+        if (sequence & 1)
+                return;
+
+        KeMemoryBarrierWithoutFence();
+        RtlCopyMemory(
+            &core->config, &step_state.config, sizeof(HV_STEP_TRACE_REQUEST));
+        KeMemoryBarrierWithoutFence();
+
+        if (step_state.sequence != sequence || !core->config.max_steps)
+                return;
+
+        /* whatever is left unread of an earlier trace may be overwritten */
+        core->sequence = sequence;
+        core->step     = 0;
+        core->consumed = core->ring->head;
+        core->active   = StepRecord(core, Context, GuestRip, STEP_STOP_NONE);
+}
+
+BOOLEAN
+StepIsTracing(_In_ UINT32 Core)
+{
+        return step_state.enabled && step_state.cores[Core].active;
+}
+
+BOOLEAN
+StepNext(_In_ UINT32 Core, _In_ PGUEST_CONTEXT Context)
+{
+        PSTEP_CORE       core   = &step_state.cores[Core];
+        STEP_STOP_REASON reason = STEP_STOP_NONE;
+
+        core->step++;
+
+        if (core->sequence != step_state.sequence)
+                reason = STEP_STOP_CANCELLED;
+
+        core->active =
+            StepRecord(core, Context, VmxVmRead(VMCS_GUEST_RIP), reason);
+
+        return core->active;
+}
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef STEP_H
+#define STEP_H
+
+/*
+ * Instruction tracing with the monitor trap flag. A breakpoint set with
+ * HV_BREAKPOINT_FLAG_TRACE starts a trace on the core that hits it, which then
+ * takes an MTF exit after every instruction the guest retires and writes a
+ * STEP_RECORD for each to its step ring, until the trace stops at one of the
+ * limits it was armed with (see StepCheckStop). The rings are read in bulk
+ * with IOCTL_HV_READ_STEP_TRACE, and a reader that keeps up lets a trace run
+ * for as long as it likes.
+ *
+ * A trace follows the core, not the thread, so a context switch or an
+ * interrupt is traced like anything else, and is what the range is for.
+ *
+ * Filling in a record is kept free of kernel dependencies so the record
+ * format can be checked against the decoder in user mode, see
+ * tools/steptrace.c.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#endif
+
+#include "ioctl.h"
+
+#if !defined(_KERNEL_MODE)
+#        define STATIC static
+#        if !defined(_WIN32)
+#                define TRUE  1
+#                define FALSE 0
+#        endif
+#endif
+
+/*
+ * Returns TRUE if Request can be armed: the register mask only names gprs,
+ * and at most STEP_MAX_REGISTERS of them, the range isn't empty, and the
+ * memory operand, if there is one, verifies.
+ */
+BOOLEAN
+StepValidateRequest(_In_ const HV_STEP_TRACE_REQUEST* Request);
+
+/*
+ * Why, if at all, a trace armed with Request stops at the record for Step at
+ * Rip, given Unconsumed records the reader has yet to get to in a ring of
+ * Capacity. The record is always written, the one a trace stops at is the
+ * last.
+ */
+STEP_STOP_REASON
+StepCheckStop(_In_ const HV_STEP_TRACE_REQUEST* Request,
+              _In_ UINT32                       Step,
+              _In_ UINT64                       Rip,
+              _In_ UINT64                       Unconsumed,
+              _In_ UINT32                       Capacity);
+
+/*
+ * Fills in Record from Registers, which are laid out as COND_REGISTER, and
+ * reads the memory operand with Read.
+ */
+VOID
+StepWriteRecord(_Out_ PSTEP_RECORD                 Record,
+                _In_ const HV_STEP_TRACE_REQUEST* Request,
+                _In_ const UINT64*                Registers,
+                _In_ COND_READ_ROUTINE            Read,
+                _In_ UINT64                       Timestamp,
+                _In_ UINT32                       Step,
+                _In_ STEP_STOP_REASON             Reason);
+
+#if defined(_KERNEL_MODE)
+
+#        include "vmx.h"
+
+/*
+ * Every record of a trace has to fit in the ring unless the reader keeps up,
+ * so this bounds the trace of anything that isn't read while it runs.
+ */
+#        define STEP_RING_CAPACITY 0x800
+#        define STEP_RING_POOL_TAG 'rpts'
+
+NTSTATUS
+StepInitialise();
+
+VOID
+StepFree();
+
+BOOLEAN
+StepIsEnabled();
+
+NTSTATUS
+StepSetTrace(_In_ const HV_STEP_TRACE_REQUEST* Request);
+
+NTSTATUS
+StepReadTrace(_In_ UINT32                        Core,
+              _In_ UINT64                        Cursor,
+              _Out_ PHV_STEP_TRACE_READ_RESPONSE Response,
+              _In_ UINT32                        ResponseLength,
+              _Out_ PUINT32                      BytesWritten);
+
+/*
+ * VMX root only, from a breakpoint with HV_BREAKPOINT_FLAG_TRACE. Starts a
+ * trace on Core at GuestRip if the tracer is armed and Core isn't already
+ * tracing. The caller must leave the monitor trap flag set.
+ */
+VOID
+StepBegin(_In_ UINT32 Core, _In_ PGUEST_CONTEXT Context, _In_ UINT64 GuestRip);
+
+/* VMX root only. */
+BOOLEAN
+StepIsTracing(_In_ UINT32 Core);
+
+/*
+ * VMX root only, from an MTF exit while Core is tracing. Records the step and
+ * returns FALSE once the trace has stopped, when the caller has to clear the
+ * monitor trap flag.
+ */
+BOOLEAN
+StepNext(_In_ UINT32 Core, _In_ PGUEST_CONTEXT Context);
+
+#endif
+
+#endif
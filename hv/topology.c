@@ -0,0 +1,207 @@
+#include "topology.h"
+#include "hw.h"
+
+STATIC VCPU_TOPOLOGY vcpu_topology = {0};
+
+/* per group affinity of the processors we never virtualise */
+STATIC UINT64 excluded_affinity[TOPOLOGY_MAX_GROUPS] = {0};
+
+#define EXCLUSIONS_VALUE_SIZE                                \
+        (FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) + \
+         sizeof(excluded_affinity))
+
+/*
+ * Processors set in the optional ExcludedProcessors value, under the Parameters
+ * subkey of our service key, are left running natively. This lets cores that
+ * are isolated for latency critical work avoid any exit overhead. The value is
+ * a REG_BINARY holding one 64 bit affinity mask per processor group, starting
+ * with group 0. Only read when the driver loads.
+ */
+NTSTATUS
+TopologyReadExclusions(_In_ PUNICODE_STRING RegistryPath)
+{
+        UNICODE_STRING subkey = RTL_CONSTANT_STRING(L"Parameters");
+        UNICODE_STRING name   = RTL_CONSTANT_STRING(L"ExcludedProcessors");
+        OBJECT_ATTRIBUTES attributes                    = {0};
+        HANDLE            service                       = NULL;
+        HANDLE            parameters                    = NULL;
+        ULONG             length                        = 0;
+        NTSTATUS          status                        = STATUS_UNSUCCESSFUL;
+        UCHAR             buffer[EXCLUSIONS_VALUE_SIZE] = {0};
+        PKEY_VALUE_PARTIAL_INFORMATION value =
+            (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
+
+        RtlZeroMemory(excluded_affinity, sizeof(excluded_affinity));
+
+        InitializeObjectAttributes(&attributes,
+                                   RegistryPath,
+                                   OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                                   NULL,
+                                   NULL);
+
+        status = ZwOpenKey(&service, KEY_READ, &attributes);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("ZwOpenKey failed with status %x", status);
+                return status;
+        }
+
+        InitializeObjectAttributes(&attributes,
+                                   &subkey,
+                                   OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                                   service,
+                                   NULL);
+
+        status = ZwOpenKey(&parameters, KEY_READ, &attributes);
+
+        if (!NT_SUCCESS(status))
+                goto end;
+
+        status = ZwQueryValueKey(parameters,
+                                 &name,
+                                 KeyValuePartialInformation,
+                                 value,
+                                 sizeof(buffer),
+                                 &length);
+
+        if (!NT_SUCCESS(status))
+                goto end;
+
+        if (value->Type != REG_BINARY || !value->DataLength ||
+            value->DataLength % sizeof(UINT64)) {
+                DEBUG_ERROR("ExcludedProcessors must hold one 8 byte mask per "
+                            "processor group");
+                status = STATUS_INVALID_PARAMETER;
+                goto end;
+        }
+
+        RtlCopyMemory(excluded_affinity, value->Data, value->DataLength);
+
+end:
+        /* the key or value not existing simply means nothing is excluded */
+        if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+                status = STATUS_SUCCESS;
+
+        /* more masks than we support processor groups */
+        if (status == STATUS_BUFFER_OVERFLOW)
+                status = STATUS_INVALID_PARAMETER;
+
+        if (!NT_SUCCESS(status))
+                DEBUG_ERROR("Reading ExcludedProcessors failed with status %x",
+                            status);
+
+        if (parameters)
+                ZwClose(parameters);
+
+        ZwClose(service);
+        return status;
+}
+
+/*
+ * Snapshots the active processors of every group. This is rebuilt each time
+ * we begin VMX operation, so processors that became active in between (i.e
+ * across a sleep transition) are picked up.
+ */
+NTSTATUS
+TopologyInitialise()
+{
+        UINT64           active[TOPOLOGY_MAX_GROUPS] = {0};
+        UINT32           group_count = KeQueryActiveGroupCount();
+        PROCESSOR_NUMBER number      = {0};
+        NTSTATUS         status      = STATUS_UNSUCCESSFUL;
+        UINT32           excluded    = 0;
+
+        if (group_count > TOPOLOGY_MAX_GROUPS) {
+                DEBUG_ERROR("Unsupported processor group count: %lx",
+                            group_count);
+                return STATUS_NOT_SUPPORTED;
+        }
+
+        for (UINT32 group = 0; group < group_count; group++)
+                active[group] = KeQueryGroupAffinity((USHORT)group);
+
+        if (TopologyBuild(&vcpu_topology, active, group_count)) {
+                DEBUG_ERROR("Invalid processor topology");
+                return STATUS_NOT_SUPPORTED;
+        }
+
+        if (vcpu_topology.vcpu_count !=
+            KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS)) {
+                DEBUG_ERROR("Processor count changed while building topology");
+                return STATUS_RETRY;
+        }
+
+        /*
+         * The kernel assigns processor indices group by group as well, but
+         * make sure our mapping agrees with it so the index we hand out always
+         * matches KeGetCurrentProcessorIndex.
+         */
+        for (UINT32 index = 0; index < vcpu_topology.vcpu_count; index++) {
+                status = KeGetProcessorNumberFromIndex(index, &number);
+
+                if (!NT_SUCCESS(status)) {
+                        DEBUG_ERROR(
+                            "KeGetProcessorNumberFromIndex failed with status %x",
+                            status);
+                        return status;
+                }
+
+                if (TopologyIndexFromNumber(&vcpu_topology,
+                                            number.Group,
+                                            number.Number) != index) {
+                        DEBUG_ERROR("Processor %lx (group %hx, number %hhx) "
+                                    "does not match our topology",
+                                    index,
+                                    number.Group,
+                                    number.Number);
+                        return STATUS_NOT_SUPPORTED;
+                }
+        }
+
+        for (UINT32 index = 0; index < vcpu_topology.vcpu_count; index++) {
+                if (TopologyIsIndexExcluded(index))
+                        excluded++;
+        }
+
+        if (excluded == vcpu_topology.vcpu_count) {
+                DEBUG_ERROR("ExcludedProcessors leaves no processor to "
+                            "virtualise");
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        DEBUG_LOG("Topology: %lx vcpus across %lx groups, %lx excluded",
+                  vcpu_topology.vcpu_count,
+                  vcpu_topology.group_count,
+                  excluded);
+
+        return STATUS_SUCCESS;
+}
+
+UINT32
+TopologyVcpuCount()
+{
+        return vcpu_topology.vcpu_count;
+}
+
+/*
+ * Safe to call at any IRQL, including from VMX root.
+ */
+UINT32
+TopologyCurrentIndex()
+{
+        UINT16 group  = 0;
+        UINT8  number = 0;
+
+        HwCurrentProcessor(&group, &number);
+
+        return TopologyIndexFromNumber(&vcpu_topology, group, number);
+}
+
+BOOLEAN
+TopologyIsIndexExcluded(_In_ UINT32 Index)
+{
+        return TopologyIsIndexInAffinity(
+                   &vcpu_topology, excluded_affinity, Index)
+                   ? TRUE
+                   : FALSE;
+}
@@ -0,0 +1,171 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+/*
+ * Maps between a processors group relative number (group, number) and the
+ * system wide index we use for our vcpus. The mapping itself is kept free of
+ * any kernel dependencies so it can be exercised from user mode against a
+ * simulated topology.
+ */
+#if defined(_KERNEL_MODE)
+#        include "common.h"
+#elif defined(_WIN32)
+#        include <windows.h>
+#else
+#        include <stdint.h>
+typedef uint8_t  UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+#endif
+
+/* matches the kernels MAXIMUM_GROUPS for 64 bit builds */
+#define TOPOLOGY_MAX_GROUPS    32
+#define TOPOLOGY_INVALID_INDEX 0xFFFFFFFF
+
+/*
+ * Processors are indexed group by group, and within a group in order of their
+ * group relative number. A group's active mask needn't be contiguous, so the
+ * index of a processor is the index of the first processor in its group plus
+ * the number of active processors in the group below it.
+ */
+typedef struct _VCPU_TOPOLOGY {
+        UINT32 vcpu_count;
+        UINT32 group_count;
+        UINT32 group_base[TOPOLOGY_MAX_GROUPS];
+        UINT32 group_size[TOPOLOGY_MAX_GROUPS];
+        UINT64 group_active[TOPOLOGY_MAX_GROUPS];
+
+} VCPU_TOPOLOGY, *PVCPU_TOPOLOGY;
+
+/* Without relying on the popcnt instruction, which not every target has. */
+static __inline UINT32
+TopologyCountBits(UINT64 Mask)
+{
+        Mask = Mask - ((Mask >> 1) & 0x5555555555555555ull);
+        Mask = (Mask & 0x3333333333333333ull) +
+               ((Mask >> 2) & 0x3333333333333333ull);
+        Mask = (Mask + (Mask >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+        return (UINT32)((Mask * 0x0101010101010101ull) >> 56);
+}
+
+/*
+ * ActiveMasks holds one mask per group with bit n set if the group relative
+ * processor n is active. Returns 0 on success, or -1 if the masks describe an
+ * invalid system.
+ */
+static __inline int
+TopologyBuild(PVCPU_TOPOLOGY Topology,
+              const UINT64*  ActiveMasks,
+              UINT32         GroupCount)
+{
+        UINT32 base = 0;
+        UINT32 size = 0;
+
+        if (!GroupCount || GroupCount > TOPOLOGY_MAX_GROUPS)
+                return -1;
+
+        for (UINT32 group = 0; group < GroupCount; group++) {
+                size = TopologyCountBits(ActiveMasks[group]);
+
+                Topology->group_base[group]   = base;
+                Topology->group_size[group]   = size;
+                Topology->group_active[group] = ActiveMasks[group];
+                base += size;
+        }
+
+        if (!base)
+                return -1;
+
+        Topology->group_count = GroupCount;
+        Topology->vcpu_count  = base;
+        return 0;
+}
+
+static __inline UINT32
+TopologyIndexFromNumber(const VCPU_TOPOLOGY* Topology,
+                        UINT32               Group,
+                        UINT32               Number)
+{
+        UINT64 active = 0;
+
+        if (Group >= Topology->group_count || Number >= 64)
+                return TOPOLOGY_INVALID_INDEX;
+
+        active = Topology->group_active[Group];
+
+        if (!((active >> Number) & 1))
+                return TOPOLOGY_INVALID_INDEX;
+
+        return Topology->group_base[Group] +
+               TopologyCountBits(active & ((1ull << Number) - 1));
+}
+
+/* Returns 0 on success, or -1 if Index does not belong to any group. */
+static __inline int
+TopologyNumberFromIndex(const VCPU_TOPOLOGY* Topology,
+                        UINT32               Index,
+                        UINT32*              Group,
+                        UINT32*              Number)
+{
+        UINT64 active = 0;
+        UINT32 skip   = 0;
+
+        for (UINT32 group = 0; group < Topology->group_count; group++) {
+                if (Index - Topology->group_base[group] >=
+                    Topology->group_size[group])
+                        continue;
+
+                /* drop the active processors below it, it is then the lowest */
+                active = Topology->group_active[group];
+                skip   = Index - Topology->group_base[group];
+
+                while (skip--)
+                        active &= active - 1;
+
+                *Group  = group;
+                *Number = TopologyCountBits((active & (0 - active)) - 1);
+                return 0;
+        }
+
+        return -1;
+}
+
+/*
+ * Returns nonzero if the processor at Index is set in Affinity, which holds
+ * one mask per group with bit n covering the group relative processor n.
+ */
+static __inline int
+TopologyIsIndexInAffinity(const VCPU_TOPOLOGY* Topology,
+                          const UINT64*        Affinity,
+                          UINT32               Index)
+{
+        UINT32 group  = 0;
+        UINT32 number = 0;
+
+        if (TopologyNumberFromIndex(Topology, Index, &group, &number))
+                return 0;
+
+        return (Affinity[group] >> number) & 1;
+}
+
+#if defined(_KERNEL_MODE)
+
+NTSTATUS
+TopologyReadExclusions(_In_ PUNICODE_STRING RegistryPath);
+
+NTSTATUS
+TopologyInitialise();
+
+UINT32
+TopologyVcpuCount();
+
+UINT32
+TopologyCurrentIndex();
+
+BOOLEAN
+TopologyIsIndexExcluded(_In_ UINT32 Index);
+
+#endif
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * This header describes the binary layout of our per core trace rings and is
+ * shared between the driver and the user mode tools that decode them (see
+ * tools/tracedump.c). Because of that it must not pull in any kernel only
+ * headers.
+ */
+#if defined(HWSIM)
+#        include "ntshim.h"
+#elif defined(_KERNEL_MODE)
+#        include <ntdef.h>
+#elif defined(_WIN32)
+#        include <windows.h>
+#        include <string.h>
+#else
+#        include <stdint.h>
+#        include <string.h>
+typedef uint8_t  UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+#endif
+
+/*
+ * Rings are only ever read and written on x64, where stores are not reordered
+ * with other stores and loads are not reordered with other loads. All we need
+ * to prevent is the compiler reordering accesses to the ring.
+ */
+#if defined(_KERNEL_MODE)
+#        define TRACE_COMPILER_BARRIER() KeMemoryBarrierWithoutFence()
+#elif defined(_MSC_VER)
+#        include <intrin.h>
+#        define TRACE_COMPILER_BARRIER() _ReadWriteBarrier()
+#else
+#        define TRACE_COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/*
+ * The format table is the single source of truth for every message that can
+ * be logged from VMX root. Records only store the format id and the raw
+ * arguments, the string itself is only ever looked up by whoever decodes the
+ * record. Ids are positional, so only ever append new entries to the end of
+ * the table, otherwise previously captured traces will decode incorrectly.
+ *
+ * X(id, argument count, format)
+ *
+ * Arguments are always stored as 64 bit values, so formats must use the ll
+ * length modifier.
+ */
+#define TRACE_FORMAT_TABLE(X)                                                 \
+        X(TRACE_INVALID_HV_CPUID_FUNCTION,                                    \
+          0,                                                                  \
+          "Invalid HV CPUID Function identifier passed.\n")                   \
+        X(TRACE_EXCEPTION_OR_NMI_EXIT,                                        \
+          2,                                                                  \
+          "Vector: %llx, Interruption type: %llx\n")
+
+#define TRACE_FORMAT_ENUM(id, count, format) id,
+#define TRACE_FORMAT_INITIALISER(id, count, format) {count, format},
+
+typedef enum _TRACE_FORMAT_ID {
+        TRACE_FORMAT_TABLE(TRACE_FORMAT_ENUM)
+        TRACE_FORMAT_COUNT
+
+} TRACE_FORMAT_ID;
+
+typedef struct _TRACE_FORMAT {
+        UINT32      argument_count;
+        const char* format;
+
+} TRACE_FORMAT, *PTRACE_FORMAT;
+
+#define TRACE_RECORD_MAX_ARGUMENTS 6
+
+/* Each record occupies exactly one cache line. */
+typedef struct _TRACE_RECORD {
+        UINT64 timestamp;
+        UINT16 format_id;
+        UINT8  argument_count;
+        UINT8  reserved[5];
+        UINT64 arguments[TRACE_RECORD_MAX_ARGUMENTS];
+
+} TRACE_RECORD, *PTRACE_RECORD;
+
+/*
+ * While exit recording is enabled, every vm-exit is also written to a second
+ * per core ring made up of these records. The gprs are the guest's general
+ * purpose registers on entry to the dispatcher, in GUEST_CONTEXT order (rax,
+ * rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8 - r15), and cycles is the number of
+ * tsc ticks the dispatcher spent handling the exit.
+ */
+#define EXIT_TRACE_GPR_COUNT 16
+
+typedef struct _EXIT_TRACE_RECORD {
+        UINT64 timestamp;
+        UINT32 reason;
+        UINT32 instruction_length;
+        UINT64 qualification;
+        UINT64 guest_rip;
+        UINT64 guest_rflags;
+        UINT32 cycles;
+        UINT32 reserved;
+        UINT64 gprs[EXIT_TRACE_GPR_COUNT];
+        UINT64 padding[2];
+
+} EXIT_TRACE_RECORD, *PEXIT_TRACE_RECORD;
+
+/*
+ * While the sampling profiler is running, every expiry of a cores vmx
+ * preemption timer writes one of these to a third per core ring. cpl is the
+ * guests privilege level at the time, and frames holds up to
+ * SAMPLE_MAX_FRAMES likely return addresses found on the guests kernel stack
+ * if stack sampling was requested, see SampleScanStack.
+ */
+#define SAMPLE_MAX_FRAMES 4
+
+/* Each record occupies exactly one cache line. */
+typedef struct _SAMPLE_RECORD {
+        UINT64 timestamp;
+        UINT64 guest_rip;
+        UINT64 guest_cr3;
+        UINT8  cpl;
+        UINT8  frame_count;
+        UINT16 reserved;
+        UINT32 core;
+        UINT64 frames[SAMPLE_MAX_FRAMES];
+
+} SAMPLE_RECORD, *PSAMPLE_RECORD;
+
+/*
+ * While a core is being single stepped by the step tracer it writes one of
+ * these to a fourth per core ring for every instruction, see step.h. Each is
+ * the state of the guest as it arrives at guest_rip, before that instruction
+ * runs, so step 0 is the breakpoint that started the trace.
+ *
+ * Only the gprs selected by register_mask are kept, bit n being GUEST_CONTEXT
+ * register n (rax, rcx, rdx, rbx, rsp, ...), packed into registers in
+ * ascending bit order. memory_value is the qword at memory_address, which the
+ * traces memory operand expression evaluated to, if STEP_RECORD_MEMORY is set.
+ */
+#define STEP_MAX_REGISTERS 10
+
+/* memory_address and memory_value are valid */
+#define STEP_RECORD_MEMORY       0x1
+/* the memory operand faulted, either computing the address or reading it */
+#define STEP_RECORD_MEMORY_FAULT 0x2
+/* the trace stopped here, for stop_reason */
+#define STEP_RECORD_LAST         0x4
+
+typedef enum _STEP_STOP_REASON {
+        STEP_STOP_NONE,
+        /* the trace ran for as many steps as it was armed with */
+        STEP_STOP_STEPS,
+        /* guest_rip left the range the trace was armed with */
+        STEP_STOP_RANGE,
+        /* the ring is full of records the reader has yet to consume */
+        STEP_STOP_FULL,
+        /* the tracer was rearmed or disarmed while this trace was running */
+        STEP_STOP_CANCELLED,
+        STEP_STOP_REASON_COUNT
+
+} STEP_STOP_REASON;
+
+/* Each record occupies exactly two cache lines. */
+typedef struct _STEP_RECORD {
+        UINT64 timestamp;
+        UINT64 guest_rip;
+        UINT64 guest_rflags;
+        UINT32 step;
+        UINT16 register_mask;
+        UINT8  flags;
+        UINT8  stop_reason;
+        UINT64 memory_address;
+        UINT64 memory_value;
+        UINT64 registers[STEP_MAX_REGISTERS];
+
+} STEP_RECORD, *PSTEP_RECORD;
+
+/*
+ * Every ring starts with this header, and is directly followed by capacity
+ * records of record_size bytes. Rings are single producer: only the core that
+ * owns the ring ever writes to it, and it never waits for a consumer. Once the
+ * ring is full the oldest records are overwritten.
+ *
+ * head is the index of the next record to be written and only ever increases,
+ * the slot for a given index is (index & (capacity - 1)). tail is the index of
+ * the oldest record still held by the ring and is published alongside head so
+ * a reader can tell how far it has fallen behind without doing the math. The
+ * slot at head is the one being rewritten, so a full ring holds capacity - 1
+ * records.
+ *
+ * The same ring may be mapped read only into a user mode consumer, so nothing
+ * in the header may ever contain a kernel address.
+ */
+typedef struct _TRACE_RING_HEADER {
+        volatile UINT64 head;
+        volatile UINT64 tail;
+        UINT32          capacity;
+        UINT32          record_size;
+        UINT32          core;
+        UINT32          reserved;
+        UINT64          padding[4];
+
+} TRACE_RING_HEADER, *PTRACE_RING_HEADER;
+
+#define TRACE_RING_RECORD(Header, Index)                \
+        ((UINT8*)(Header) + sizeof(TRACE_RING_HEADER) + \
+         ((Index) & ((Header)->capacity - 1)) * (Header)->record_size)
+
+#define TRACE_RING_SIZE(Capacity, RecordSize) \
+        (sizeof(TRACE_RING_HEADER) + (UINT64)(Capacity) * (RecordSize))
+
+/*
+ * Producer protocol. Once the record at head has been written, publishes it.
+ * The slot for the new head is the next to be rewritten, so the record it
+ * holds is dropped from the ring here rather than while it is being torn.
+ */
+static __inline void
+TraceRingPublish(volatile TRACE_RING_HEADER* Ring)
+{
+        UINT64 head = Ring->head + 1;
+
+        /* ensure the record is written before the new head is published */
+        TRACE_COMPILER_BARRIER();
+
+        if (head >= Ring->capacity)
+                Ring->tail = head - Ring->capacity + 1;
+
+        Ring->head = head;
+}
+
+/*
+ * Reader protocol. This is the only way a consumer should ever read from a
+ * ring, regardless of whether it runs in the driver, in a user mode process
+ * with the ring mapped read only, or in a test harness with the ring placed in
+ * plain shared memory (see tools/ringstress.c).
+ *
+ * The producer writes the slot for index (head) before publishing head + 1,
+ * so the slot for Index can only have been overwritten during our copy if
+ * head has since advanced a full capacity past it. The record is therefore
+ * copied first, and only then validated against the current head.
+ */
+static __inline int
+TraceRingReadRecord(const volatile TRACE_RING_HEADER* Ring,
+                    UINT64                            Index,
+                    void*                             Record)
+{
+        memcpy(Record,
+               (const void*)TRACE_RING_RECORD(Ring, Index),
+               Ring->record_size);
+        TRACE_COMPILER_BARRIER();
+        return Ring->head - Index < Ring->capacity;
+}
+
+/*
+ * Copies out the next record at or after *Cursor and advances the cursor past
+ * it. Records that were overwritten before we got to them are skipped and
+ * counted in *Lost. Returns 0 once the reader has caught up with the producer.
+ */
+static __inline int
+TraceRingNextRecord(const volatile TRACE_RING_HEADER* Ring,
+                    UINT64*                           Cursor,
+                    UINT64*                           Lost,
+                    void*                             Record)
+{
+        for (;;) {
+                UINT64 head = Ring->head;
+                UINT64 tail = 0;
+
+                TRACE_COMPILER_BARRIER();
+                tail = Ring->tail;
+
+                if (*Cursor < tail) {
+                        *Lost += tail - *Cursor;
+                        *Cursor = tail;
+                }
+
+                if (*Cursor >= head)
+                        return 0;
+
+                if (TraceRingReadRecord(Ring, (*Cursor)++, Record))
+                        return 1;
+
+                (*Lost)++;
+        }
+}
+
+#endif
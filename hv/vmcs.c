@@ -3,9 +3,15 @@
 #include "ia32.h"
 #include "vmx.h"
 #include "arch.h"
-#include <intrin.h>
+#include "cap.h"
+#include "hw.h"
+#include "ept.h"
 
-/* Wrapper functions to read and write to and from the vmcs. */
+/*
+ * Wrapper functions to read and write to and from the vmcs, tools/hwsim.c has
+ * its own backed by an in memory vmcs.
+ */
+#if !defined(HWSIM)
 UINT64
 VmxVmRead(_In_ UINT64 VmcsField)
 {
@@ -19,6 +25,7 @@ VmxVmWrite(_In_ UINT64 VmcsField, _In_ UINT64 Value)
 {
         __vmx_vmwrite(VmcsField, Value);
 }
+#endif
 
 STATIC
 UINT32
@@ -48,19 +55,6 @@ __segmentar(SEGMENT_SELECTOR* Selector)
         return ar.AsUInt;
 }
 
-STATIC
-UINT32
-AdjustMsrControl(_In_ UINT32 Control, _In_ UINT32 Msr)
-{
-        ULARGE_INTEGER msr = {0};
-        msr.QuadPart       = __readmsr(Msr);
-
-        Control &= msr.HighPart;
-        Control |= msr.LowPart;
-
-        return Control;
-}
-
 /*
  * Given either the LDT or GDT base, return the segment descriptor given the
  * selector talble index. We do this by taking the Selectors Index value and
@@ -126,52 +120,98 @@ __segmentbase(_In_ SEGMENT_DESCRIPTOR_REGISTER_64* Gdtr,
         return GetSegmentDescriptorBase(descriptor);
 }
 
+/*
+ * Gathers the host state for this core into Values, indexed by
+ * VMCS_HOST_STATE_FIELD.
+ *
+ * HOST_CR3 is whatever address space the IPI happened to interrupt, so it
+ * rarely matches what was written the last time this vmcs was loaded.
+ */
 STATIC
 VOID
-VmcsWriteHostStateFields(_In_ PVIRTUAL_MACHINE_STATE GuestState)
+VmcsGatherHostState(_In_ PVIRTUAL_MACHINE_STATE Vcpu, _Out_ UINT64* Values)
 {
         SEGMENT_DESCRIPTOR_REGISTER_64 gdtr = {0};
         SEGMENT_DESCRIPTOR_REGISTER_64 idtr = {0};
+        SEGMENT_SELECTOR               tr   = {0};
 
         __sgdt(&gdtr);
         __sidt(&idtr);
 
-        SEGMENT_SELECTOR tr = {0};
-
         tr.AsUInt = __readtr();
 
-        VmxVmWrite(VMCS_HOST_ES_SELECTOR, __reades() & VMCS_HOST_SELECTOR_MASK);
-        VmxVmWrite(VMCS_HOST_CS_SELECTOR, __readcs() & VMCS_HOST_SELECTOR_MASK);
-        VmxVmWrite(VMCS_HOST_SS_SELECTOR, __readss() & VMCS_HOST_SELECTOR_MASK);
-        VmxVmWrite(VMCS_HOST_DS_SELECTOR, __readds() & VMCS_HOST_SELECTOR_MASK);
-        VmxVmWrite(VMCS_HOST_FS_SELECTOR, __readfs() & VMCS_HOST_SELECTOR_MASK);
-        VmxVmWrite(VMCS_HOST_GS_SELECTOR, __readgs() & VMCS_HOST_SELECTOR_MASK);
-        VmxVmWrite(VMCS_HOST_TR_SELECTOR, __readtr() & VMCS_HOST_SELECTOR_MASK);
+        Values[VMCS_FIELD_HOST_ES_SELECTOR] =
+            __reades() & VMCS_HOST_SELECTOR_MASK;
+        Values[VMCS_FIELD_HOST_CS_SELECTOR] =
+            __readcs() & VMCS_HOST_SELECTOR_MASK;
+        Values[VMCS_FIELD_HOST_SS_SELECTOR] =
+            __readss() & VMCS_HOST_SELECTOR_MASK;
+        Values[VMCS_FIELD_HOST_DS_SELECTOR] =
+            __readds() & VMCS_HOST_SELECTOR_MASK;
+        Values[VMCS_FIELD_HOST_FS_SELECTOR] =
+            __readfs() & VMCS_HOST_SELECTOR_MASK;
+        Values[VMCS_FIELD_HOST_GS_SELECTOR] =
+            __readgs() & VMCS_HOST_SELECTOR_MASK;
+        Values[VMCS_FIELD_HOST_TR_SELECTOR] =
+            tr.AsUInt & VMCS_HOST_SELECTOR_MASK;
+
+        Values[VMCS_FIELD_HOST_CR0] = HwReadCr0();
+        Values[VMCS_FIELD_HOST_CR3] = HwReadCr3();
+        Values[VMCS_FIELD_HOST_CR4] = HwReadCr4();
+
+        Values[VMCS_FIELD_HOST_FS_BASE] = HwReadMsr(IA32_FS_BASE);
+        Values[VMCS_FIELD_HOST_GS_BASE] = HwReadMsr(IA32_GS_BASE);
+        Values[VMCS_FIELD_HOST_TR_BASE] = __segmentbase(&gdtr, &tr);
+
+        Values[VMCS_FIELD_HOST_GDTR_BASE] = gdtr.BaseAddress;
+        Values[VMCS_FIELD_HOST_IDTR_BASE] = idtr.BaseAddress;
+
+        Values[VMCS_FIELD_HOST_SYSENTER_CS]  = HwReadMsr(IA32_SYSENTER_CS);
+        Values[VMCS_FIELD_HOST_SYSENTER_EIP] = HwReadMsr(IA32_SYSENTER_EIP);
+        Values[VMCS_FIELD_HOST_SYSENTER_ESP] = HwReadMsr(IA32_SYSENTER_ESP);
+
+        Values[VMCS_FIELD_HOST_RSP] = Vcpu->cold.vmm_stack_va +
+                                      VMX_HOST_STACK_SIZE -
+                                      sizeof(HOST_STACK_TOP);
+        Values[VMCS_FIELD_HOST_RIP] = (UINT64)VmExitHandler;
+}
 
-        VmxVmWrite(VMCS_HOST_CR0, __readcr0());
-        VmxVmWrite(VMCS_HOST_CR3, __readcr3());
-        VmxVmWrite(VMCS_HOST_CR4, __readcr4());
+/*
+ * The host state is never written by the processor, so it is applied through
+ * the vcpus host shadow. When a suspended vmcs is resumed only the fields that
+ * changed in between, typically just HOST_CR3, are rewritten.
+ */
+STATIC
+VOID
+VmcsWriteHostStateFields(_In_ PVIRTUAL_MACHINE_STATE GuestState)
+{
+        UINT64          values[VMCS_HOST_STATE_FIELD_COUNT] = {0};
+        PHOST_STACK_TOP top                                 = NULL;
 
-        VmxVmWrite(VMCS_HOST_GDTR_BASE, gdtr.BaseAddress);
-        VmxVmWrite(VMCS_HOST_IDTR_BASE, idtr.BaseAddress);
+        VmcsGatherHostState(GuestState, values);
 
-        VmxVmWrite(VMCS_HOST_RSP,
-                   GuestState->vmm_stack_va + VMX_HOST_STACK_SIZE);
-        VmxVmWrite(VMCS_HOST_RIP, VmExitHandler);
+        top = (PHOST_STACK_TOP)values[VMCS_FIELD_HOST_RSP];
 
-        VmxVmWrite(VMCS_HOST_FS_BASE, __readmsr(IA32_FS_BASE));
-        VmxVmWrite(VMCS_HOST_GS_BASE, __readmsr(IA32_GS_BASE));
-        VmxVmWrite(VMCS_HOST_TR_BASE, __segmentbase(&gdtr, &tr));
+        top->scratch = 0;
+        top->vcpu    = GuestState;
 
-        VmxVmWrite(VMCS_HOST_SYSENTER_CS, __readmsr(IA32_SYSENTER_CS));
-        VmxVmWrite(VMCS_HOST_SYSENTER_EIP, __readmsr(IA32_SYSENTER_EIP));
-        VmxVmWrite(VMCS_HOST_SYSENTER_ESP, __readmsr(IA32_SYSENTER_ESP));
+        VmcsApply(&vmcs_host_state_table,
+                  values,
+                  &GuestState->cold.host_shadow);
 }
 
+#define VMCS_GATHER_GUEST_SEGMENT(Values, Gdtr, Segment, Selector)             \
+        Values[VMCS_FIELD_GUEST_##Segment##_SELECTOR] = (Selector).AsUInt;     \
+        Values[VMCS_FIELD_GUEST_##Segment##_BASE] =                            \
+            __segmentbase((Gdtr), &(Selector));                                \
+        Values[VMCS_FIELD_GUEST_##Segment##_LIMIT] =                           \
+            __segmentlimit((Selector).AsUInt);                                 \
+        Values[VMCS_FIELD_GUEST_##Segment##_ACCESS_RIGHTS] =                   \
+            __segmentar(&(Selector));
+
 STATIC
 VOID
-VmcsWriteGuestStateFields(_In_ PVOID                  StackPointer,
-                          _In_ PVIRTUAL_MACHINE_STATE GuestState)
+VmcsGatherGuestState(_In_ PVOID StackPointer, _Out_ UINT64* Values)
 {
         SEGMENT_SELECTOR es   = {0};
         SEGMENT_SELECTOR cs   = {0};
@@ -197,59 +237,41 @@ VmcsWriteGuestStateFields(_In_ PVOID                  StackPointer,
         __sgdt(&gdtr);
         __sidt(&idtr);
 
-        VmxVmWrite(VMCS_GUEST_ES_SELECTOR, es.AsUInt);
-        VmxVmWrite(VMCS_GUEST_CS_SELECTOR, cs.AsUInt);
-        VmxVmWrite(VMCS_GUEST_SS_SELECTOR, ss.AsUInt);
-        VmxVmWrite(VMCS_GUEST_DS_SELECTOR, ds.AsUInt);
-        VmxVmWrite(VMCS_GUEST_FS_SELECTOR, fs.AsUInt);
-        VmxVmWrite(VMCS_GUEST_GS_SELECTOR, gs.AsUInt);
-        VmxVmWrite(VMCS_GUEST_TR_SELECTOR, tr.AsUInt);
-        VmxVmWrite(VMCS_GUEST_LDTR_SELECTOR, ldtr.AsUInt);
-
-        VmxVmWrite(VMCS_GUEST_ES_BASE, __segmentbase(&gdtr, &es));
-        VmxVmWrite(VMCS_GUEST_CS_BASE, __segmentbase(&gdtr, &cs));
-        VmxVmWrite(VMCS_GUEST_SS_BASE, __segmentbase(&gdtr, &ss));
-        VmxVmWrite(VMCS_GUEST_DS_BASE, __segmentbase(&gdtr, &ds));
-        VmxVmWrite(VMCS_GUEST_FS_BASE, __segmentbase(&gdtr, &fs));
-        VmxVmWrite(VMCS_GUEST_GS_BASE, __segmentbase(&gdtr, &gs));
-        VmxVmWrite(VMCS_GUEST_TR_BASE, __segmentbase(&gdtr, &tr));
-        VmxVmWrite(VMCS_GUEST_LDTR_BASE, __segmentbase(&gdtr, &ldtr));
-
-        VmxVmWrite(VMCS_GUEST_ES_LIMIT, __segmentlimit(es.AsUInt));
-        VmxVmWrite(VMCS_GUEST_CS_LIMIT, __segmentlimit(cs.AsUInt));
-        VmxVmWrite(VMCS_GUEST_SS_LIMIT, __segmentlimit(ss.AsUInt));
-        VmxVmWrite(VMCS_GUEST_DS_LIMIT, __segmentlimit(ds.AsUInt));
-        VmxVmWrite(VMCS_GUEST_FS_LIMIT, __segmentlimit(fs.AsUInt));
-        VmxVmWrite(VMCS_GUEST_GS_LIMIT, __segmentlimit(gs.AsUInt));
-        VmxVmWrite(VMCS_GUEST_TR_LIMIT, __segmentlimit(tr.AsUInt));
-        VmxVmWrite(VMCS_GUEST_LDTR_LIMIT, __segmentlimit(ldtr.AsUInt));
-
-        VmxVmWrite(VMCS_GUEST_ES_ACCESS_RIGHTS, __segmentar(&es));
-        VmxVmWrite(VMCS_GUEST_CS_ACCESS_RIGHTS, __segmentar(&cs));
-        VmxVmWrite(VMCS_GUEST_SS_ACCESS_RIGHTS, __segmentar(&ss));
-        VmxVmWrite(VMCS_GUEST_DS_ACCESS_RIGHTS, __segmentar(&ds));
-        VmxVmWrite(VMCS_GUEST_FS_ACCESS_RIGHTS, __segmentar(&fs));
-        VmxVmWrite(VMCS_GUEST_GS_ACCESS_RIGHTS, __segmentar(&gs));
-        VmxVmWrite(VMCS_GUEST_TR_ACCESS_RIGHTS, __segmentar(&tr));
-        VmxVmWrite(VMCS_GUEST_LDTR_ACCESS_RIGHTS, __segmentar(&ldtr));
-
-        VmxVmWrite(VMCS_GUEST_GDTR_LIMIT, gdtr.Limit);
-        VmxVmWrite(VMCS_GUEST_IDTR_LIMIT, idtr.Limit);
-        VmxVmWrite(VMCS_GUEST_GDTR_BASE, gdtr.BaseAddress);
-        VmxVmWrite(VMCS_GUEST_IDTR_BASE, idtr.BaseAddress);
-
-        VmxVmWrite(VMCS_GUEST_VMCS_LINK_POINTER, MAXULONG_PTR);
-
-        VmxVmWrite(VMCS_GUEST_CR0, __readcr0());
-        VmxVmWrite(VMCS_GUEST_CR3, __readcr3());
-        VmxVmWrite(VMCS_GUEST_CR4, __readcr4());
-
-        VmxVmWrite(VMCS_GUEST_RFLAGS, __readeflags());
-        VmxVmWrite(VMCS_GUEST_SYSENTER_CS, __readmsr(IA32_SYSENTER_CS));
-        VmxVmWrite(VMCS_GUEST_SYSENTER_EIP, __readmsr(IA32_SYSENTER_EIP));
-        VmxVmWrite(VMCS_GUEST_SYSENTER_ESP, __readmsr(IA32_SYSENTER_ESP));
-        VmxVmWrite(VMCS_GUEST_FS_BASE, __readmsr(IA32_FS_BASE));
-        VmxVmWrite(VMCS_GUEST_GS_BASE, __readmsr(IA32_GS_BASE));
+        VMCS_GATHER_GUEST_SEGMENT(Values, &gdtr, ES, es);
+        VMCS_GATHER_GUEST_SEGMENT(Values, &gdtr, CS, cs);
+        VMCS_GATHER_GUEST_SEGMENT(Values, &gdtr, SS, ss);
+        VMCS_GATHER_GUEST_SEGMENT(Values, &gdtr, DS, ds);
+        VMCS_GATHER_GUEST_SEGMENT(Values, &gdtr, FS, fs);
+        VMCS_GATHER_GUEST_SEGMENT(Values, &gdtr, GS, gs);
+        VMCS_GATHER_GUEST_SEGMENT(Values, &gdtr, TR, tr);
+        VMCS_GATHER_GUEST_SEGMENT(Values, &gdtr, LDTR, ldtr);
+
+        /* the descriptors of fs and gs don't hold their 64 bit bases */
+        Values[VMCS_FIELD_GUEST_FS_BASE] = HwReadMsr(IA32_FS_BASE);
+        Values[VMCS_FIELD_GUEST_GS_BASE] = HwReadMsr(IA32_GS_BASE);
+
+        Values[VMCS_FIELD_GUEST_GDTR_LIMIT] = gdtr.Limit;
+        Values[VMCS_FIELD_GUEST_IDTR_LIMIT] = idtr.Limit;
+        Values[VMCS_FIELD_GUEST_GDTR_BASE]  = gdtr.BaseAddress;
+        Values[VMCS_FIELD_GUEST_IDTR_BASE]  = idtr.BaseAddress;
+
+        Values[VMCS_FIELD_GUEST_VMCS_LINK_POINTER] = MAXULONG_PTR;
+
+        Values[VMCS_FIELD_GUEST_CR0] = HwReadCr0();
+        Values[VMCS_FIELD_GUEST_CR3] = HwReadCr3();
+        Values[VMCS_FIELD_GUEST_CR4] = HwReadCr4();
+
+        Values[VMCS_FIELD_GUEST_RFLAGS]       = __readeflags();
+        Values[VMCS_FIELD_GUEST_SYSENTER_CS]  = HwReadMsr(IA32_SYSENTER_CS);
+        Values[VMCS_FIELD_GUEST_SYSENTER_EIP] = HwReadMsr(IA32_SYSENTER_EIP);
+        Values[VMCS_FIELD_GUEST_SYSENTER_ESP] = HwReadMsr(IA32_SYSENTER_ESP);
+
+        Values[VMCS_FIELD_GUEST_DEBUGCTL] = HwReadMsr(IA32_DEBUGCTL);
+        Values[VMCS_FIELD_GUEST_DR7]      = HwReadDr(7);
+
+        /* the guest resumes active, with nothing blocked */
+        Values[VMCS_FIELD_GUEST_INTERRUPTIBILITY_STATE] = 0;
+        Values[VMCS_FIELD_GUEST_ACTIVITY_STATE]         = 0;
 
         /*
          * Since the goal of this hypervisor is to virtualise and already
@@ -259,24 +281,25 @@ VmcsWriteGuestStateFields(_In_ PVOID                  StackPointer,
          * been initiated, guest operation will continue as normal as if nothing
          * happened.
          */
-        VmxVmWrite(VMCS_GUEST_RSP, StackPointer);
-        VmxVmWrite(VMCS_GUEST_RIP, VmxRestoreState);
-}
-
-BOOLEAN
-IsLocalApicPresent()
-{
-        CPUID_EAX_01 features = {0};
-        __cpuid((INT*)&features, CPUID_VERSION_INFORMATION);
-        return features.CpuidFeatureInformationEdx.ApicOnChip ? TRUE : FALSE;
+        Values[VMCS_FIELD_GUEST_RSP] = (UINT64)StackPointer;
+        Values[VMCS_FIELD_GUEST_RIP] = (UINT64)VmxRestoreState;
 }
 
+/*
+ * The guest state is saved back into the vmcs on every exit, so it is always
+ * written in full rather than through a shadow.
+ */
 STATIC
-BOOLEAN
-IsApicInX2ApicMode()
+VOID
+VmcsWriteGuestStateFields(_In_ PVOID                  StackPointer,
+                          _In_ PVIRTUAL_MACHINE_STATE GuestState)
 {
-        IA32_APIC_BASE_REGISTER apic = {.AsUInt = __readmsr(IA32_APIC_BASE)};
-        return apic.EnableX2ApicMode ? TRUE : FALSE;
+        UINT64 values[VMCS_GUEST_STATE_FIELD_COUNT] = {0};
+
+        UNREFERENCED_PARAMETER(GuestState);
+
+        VmcsGatherGuestState(StackPointer, values);
+        VmcsApply(&vmcs_guest_state_table, values, NULL);
 }
 
 #define QWORD_BIT_COUNT 64
@@ -290,127 +313,86 @@ SetBitInBitmap(_Inout_ PUINT64 Bitmap, _In_ UINT32 Bit)
         Bitmap[index] |= (1ull << offset);
 }
 
+/*
+ * Replays the control fields precomputed by CapBuildVmcsTemplate. The vcpu
+ * keeps its own copy of the controls as handlers toggle them at runtime, i.e
+ * the monitor trap flag. That copy is the source of truth, so the template is
+ * loaded into it and flushed to the vmcs from there.
+ */
 STATIC
 VOID
 VmcsWriteControlStateFields(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        IA32_APIC_BASE_REGISTER apic = {.AsUInt = __readmsr(IA32_APIC_BASE)};
-
-        /*
-         * ActivateSecondaryControls activates the secondary processor-based
-         * VM-execution controls. If UseMsrBitmaps is not set, all RDMSR and
-         * WRMSR instructions cause vm-exits.
-         */
-        Vcpu->proc_ctls.ActivateSecondaryControls = TRUE;
-        Vcpu->proc_ctls.UseMsrBitmaps             = TRUE;
-        Vcpu->proc_ctls.Cr3LoadExiting            = FALSE;
-        Vcpu->proc_ctls.Cr3StoreExiting           = FALSE;
-        Vcpu->proc_ctls.UnconditionalIoExiting    = FALSE;
-        Vcpu->proc_ctls.MovDrExiting              = FALSE;
+        const VMCS_TEMPLATE* controls = CapGetVmcsTemplate();
+
+        VmcsControlsInvalidate(&Vcpu->controls, &Vcpu->cold.committed_controls);
+
+        VmcsControlWrite(
+            &Vcpu->controls, VMCS_CONTROL_PROC_CTLS, controls->proc_ctls);
+        VmcsControlWrite(
+            &Vcpu->controls, VMCS_CONTROL_PROC_CTLS2, controls->proc_ctls2);
+        VmcsControlWrite(
+            &Vcpu->controls, VMCS_CONTROL_PIN_CTLS, controls->pin_ctls);
+        VmcsControlWrite(
+            &Vcpu->controls, VMCS_CONTROL_EXIT_CTLS, controls->exit_ctls);
+        VmcsControlWrite(
+            &Vcpu->controls, VMCS_CONTROL_ENTRY_CTLS, controls->entry_ctls);
+        VmcsControlWrite(&Vcpu->controls,
+                         VMCS_CONTROL_EXCEPTION_BITMAP,
+                         controls->exception_bitmap);
+        VmcsControlWrite(
+            &Vcpu->controls, VMCS_CONTROL_ENTRY_INTERRUPTION_INFORMATION, 0);
+        VmcsControlWrite(
+            &Vcpu->controls, VMCS_CONTROL_ENTRY_EXCEPTION_ERROR_CODE, 0);
 
-        /*
-         * TPR shadowing is still quite buggy, so to allow us to work on further
-         * apic features we enable it aswell. (This is because TPR shadowing is
-         * required for further APIC virtualisation features.
-         */
 #if APIC
-        /*
-         * Currently LoadExiting is failing when false, StoreExiting works when
-         * false.
-         */
-        Vcpu->proc_ctls.Cr8LoadExiting  = FALSE;
-        Vcpu->proc_ctls.Cr8StoreExiting = FALSE;
-#endif
+        IA32_VMX_PROCBASED_CTLS_REGISTER proc = {.AsUInt =
+                                                     controls->proc_ctls};
+        IA32_VMX_PROCBASED_CTLS2_REGISTER proc2 = {.AsUInt =
+                                                       controls->proc_ctls2};
 
-#if APIC
-        if (IsLocalApicPresent()) {
-                Vcpu->proc_ctls.UseTprShadow = TRUE;
+        if (proc.UseTprShadow) {
                 VmxVmWrite(VMCS_CTRL_VIRTUAL_APIC_ADDRESS,
-                           Vcpu->virtual_apic_pa);
+                           Vcpu->cold.virtual_apic_pa);
                 VmxVmWrite(VMCS_CTRL_TPR_THRESHOLD, VMX_APIC_TPR_THRESHOLD);
         }
-#endif
-        VmxVmWrite(
-            VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS,
-            AdjustMsrControl(Vcpu->proc_ctls.AsUInt, IA32_VMX_PROCBASED_CTLS));
-
-        Vcpu->proc_ctls2.EnableRdtscp  = TRUE;
-        Vcpu->proc_ctls2.EnableInvpcid = TRUE;
-        Vcpu->proc_ctls2.EnableXsaves  = TRUE;
 
-#if APIC
-        if (IsLocalApicPresent()) {
-                Vcpu->proc_ctls2.ApicRegisterVirtualization = FALSE;
-                Vcpu->proc_ctls2.VirtualInterruptDelivery   = FALSE;
-
-                /*
-                 * If we are in X2 Apic Mode, disable MMIO apic register
-                 * access virtualization, and instead enable X2 Apic
-                 * Virtualization.
-                 */
-                if (IsApicInX2ApicMode()) {
-                        Vcpu->proc_ctls2.VirtualizeX2ApicMode = FALSE;
-                }
-                else {
-                        Vcpu->proc_ctls2.VirtualizeApicAccesses = TRUE;
-                        VmxVmWrite(VMCS_CTRL_APIC_ACCESS_ADDRESS,
-                                   apic.ApicBase);
-                }
-
-                // VmxVmWrite(VMCS_CTRL_EOI_EXIT_BITMAP_0, 0);
-                // VmxVmWrite(VMCS_CTRL_EOI_EXIT_BITMAP_1, 0);
-                // VmxVmWrite(VMCS_CTRL_EOI_EXIT_BITMAP_2, 0);
-                // VmxVmWrite(VMCS_CTRL_EOI_EXIT_BITMAP_3, 0);
-        }
-#endif
-
-        VmxVmWrite(VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS,
-                   AdjustMsrControl(Vcpu->proc_ctls2.AsUInt,
-                                    IA32_VMX_PROCBASED_CTLS2));
-
-        Vcpu->pin_ctls.NmiExiting = FALSE;
-#if APIC
-        Vcpu->pin_ctls.ProcessPostedInterrupts = FALSE;
+        if (proc2.VirtualizeApicAccesses)
+                VmxVmWrite(VMCS_CTRL_APIC_ACCESS_ADDRESS,
+                           controls->apic_access_address);
 #endif
 
-        VmxVmWrite(
-            VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS,
-            AdjustMsrControl(Vcpu->pin_ctls.AsUInt, IA32_VMX_PINBASED_CTLS));
-
-        Vcpu->exit_ctls.AcknowledgeInterruptOnExit = TRUE;
-        Vcpu->exit_ctls.HostAddressSpaceSize       = TRUE;
-        Vcpu->exit_ctls.SaveDebugControls          = TRUE;
-
-        VmxVmWrite(
-            VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS,
-            AdjustMsrControl(Vcpu->exit_ctls.AsUInt, IA32_VMX_EXIT_CTLS));
-
-        Vcpu->entry_ctls.Ia32EModeGuest    = TRUE;
-        Vcpu->entry_ctls.LoadDebugControls = TRUE;
-
-        VmxVmWrite(
-            VMCS_CTRL_VMENTRY_CONTROLS,
-            AdjustMsrControl(Vcpu->entry_ctls.AsUInt, IA32_VMX_ENTRY_CTLS));
+        /* every core starts out on the breakpoint view */
+        if (controls->proc_ctls2 & IA32_VMX_PROCBASED_CTLS2_ENABLE_EPT_FLAG) {
+                VmxVmWrite(VMCS_CTRL_EPT_POINTER,
+                           EptGetPointer(EPT_VIEW_BREAKPOINT));
+                Vcpu->cold.ept_step = FALSE;
+        }
 
-        Vcpu->exception_bitmap |= EXCEPTION_DIVIDED_BY_ZERO;
+        VmcsControlsFlush(&Vcpu->controls, &Vcpu->cold.committed_controls);
 
-        VmxVmWrite(VMCS_CTRL_EXCEPTION_BITMAP, Vcpu->exception_bitmap);
-        VmxVmWrite(VMCS_CTRL_MSR_BITMAP_ADDRESS, Vcpu->msr_bitmap_pa);
+        VmxVmWrite(VMCS_CTRL_CR0_GUEST_HOST_MASK,
+                   controls->cr0_guest_host_mask);
+        VmxVmWrite(VMCS_CTRL_CR4_GUEST_HOST_MASK,
+                   controls->cr4_guest_host_mask);
+        VmxVmWrite(VMCS_CTRL_MSR_BITMAP_ADDRESS,
+                   (UINT64)Vcpu->cold.msr_bitmap_pa);
 }
 
+STATIC
 NTSTATUS
-SetupVmcs(_In_ PVIRTUAL_MACHINE_STATE GuestState, _In_ PVOID StackPointer)
+LoadVmcs(_In_ PVIRTUAL_MACHINE_STATE GuestState)
 {
         UCHAR status = 0;
 
-        status = __vmx_vmclear(&GuestState->vmcs_region_pa);
+        status = __vmx_vmclear(&GuestState->cold.vmcs_region_pa);
 
         if (!VMX_OK(status)) {
                 DEBUG_ERROR("__vmx_vmclear failed with status %x", status);
                 return STATUS_UNSUCCESSFUL;
         }
 
-        status = __vmx_vmptrld(&GuestState->vmcs_region_pa);
+        status = __vmx_vmptrld(&GuestState->cold.vmcs_region_pa);
 
         if (!VMX_OK(status)) {
                 if (status == VMX_STATUS_OPERATION_FAILED) {
@@ -424,9 +406,43 @@ SetupVmcs(_In_ PVIRTUAL_MACHINE_STATE GuestState, _In_ PVOID StackPointer)
                 }
         }
 
+        return STATUS_SUCCESS;
+}
+
+NTSTATUS
+SetupVmcs(_In_ PVIRTUAL_MACHINE_STATE GuestState, _In_ PVOID StackPointer)
+{
+        NTSTATUS status = LoadVmcs(GuestState);
+
+        if (!NT_SUCCESS(status))
+                return status;
+
+        /* a freshly cleared vmcs holds none of the values we last wrote */
+        VmcsShadowInvalidate(&GuestState->cold.host_shadow);
+
         VmcsWriteControlStateFields(GuestState);
         VmcsWriteGuestStateFields(StackPointer, GuestState);
         VmcsWriteHostStateFields(GuestState);
 
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Reloads a vmcs that was cleared when we suspended VMX operation. The control
+ * fields we computed in SetupVmcs are still in the vmcs region, so only the
+ * guest state, which is captured from wherever the IPI interrupted this core,
+ * and whichever host fields changed in the meantime have to be written again.
+ */
+NTSTATUS
+ResumeVmcs(_In_ PVIRTUAL_MACHINE_STATE GuestState, _In_ PVOID StackPointer)
+{
+        NTSTATUS status = LoadVmcs(GuestState);
+
+        if (!NT_SUCCESS(status))
+                return status;
+
+        VmcsWriteGuestStateFields(StackPointer, GuestState);
+        VmcsWriteHostStateFields(GuestState);
+
         return STATUS_SUCCESS;
 }
\ No newline at end of file
@@ -7,6 +7,9 @@
 NTSTATUS
 SetupVmcs(_In_ PVIRTUAL_MACHINE_STATE GuestState, _In_ PVOID StackPointer);
 
+NTSTATUS
+ResumeVmcs(_In_ PVIRTUAL_MACHINE_STATE GuestState, _In_ PVOID StackPointer);
+
 UINT64
 VmxVmRead(_In_ UINT64 VmcsField);
 
@@ -14,15 +17,12 @@ VOID
 VmxVmWrite(_In_ UINT64 VmcsField, _In_ UINT64 Value);
 
 UINT64
-VmmReadGuestRip();
+VmmReadGuestRip(_In_ PVIRTUAL_MACHINE_STATE Vcpu);
 
 UINT64
-VmmReadGuestRsp();
+VmmReadGuestRsp(_In_ PVIRTUAL_MACHINE_STATE Vcpu);
 
 UINT64
 VmmGetCoresVcpu();
 
-BOOLEAN
-IsLocalApicPresent();
-
 #endif
\ No newline at end of file
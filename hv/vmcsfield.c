@@ -0,0 +1,288 @@
+#include "vmcsfield.h"
+
+#if defined(_KERNEL_MODE)
+#        include "vmcs.h"
+#endif
+
+/*
+ * A width that disagrees with the encoding would have VmcsApply truncate the
+ * value to the wrong size, so refuse to build rather than find out at runtime.
+ */
+#define VMCS_FIELD_CHECK_WIDTH(Name, Width, Scope, Source)                     \
+        typedef char vmcs_field_width_##Name                                   \
+            [VMCS_ENCODING_WIDTH(VMCS_##Name) == (Width) ? 1 : -1];
+
+VMCS_HOST_STATE_TABLE(VMCS_FIELD_CHECK_WIDTH)
+VMCS_GUEST_STATE_TABLE(VMCS_FIELD_CHECK_WIDTH)
+VMCS_CONTROL_TABLE(VMCS_FIELD_CHECK_WIDTH)
+VMCS_EXIT_INFORMATION_TABLE(VMCS_FIELD_CHECK_WIDTH)
+
+#define VMCS_CONTROL_CHECK_WIDTH(Control, Name)                                \
+        typedef char vmcs_control_width_##Control                              \
+            [VMCS_ENCODING_WIDTH(VMCS_##Name) == VMCS_WIDTH_32 ? 1 : -1];
+
+VMCS_CONTROLS_TABLE(VMCS_CONTROL_CHECK_WIDTH)
+
+typedef char vmcs_controls_table_size[VMCS_CONTROL_COUNT <= 32 ? 1 : -1];
+
+typedef char vmcs_host_state_table_size
+    [VMCS_HOST_STATE_FIELD_COUNT <= VMCS_TABLE_MAX_FIELDS ? 1 : -1];
+typedef char vmcs_guest_state_table_size
+    [VMCS_GUEST_STATE_FIELD_COUNT <= VMCS_TABLE_MAX_FIELDS ? 1 : -1];
+typedef char vmcs_control_table_size
+    [VMCS_CONTROL_FIELD_COUNT <= VMCS_TABLE_MAX_FIELDS ? 1 : -1];
+typedef char vmcs_exit_information_table_size
+    [VMCS_EXIT_INFORMATION_FIELD_COUNT <= VMCS_TABLE_MAX_FIELDS ? 1 : -1];
+
+#define VMCS_FIELD_DESCRIPTOR(Name, Width, Scope, Source)                      \
+        {#Name, VMCS_##Name, Width, Scope, Source},
+
+STATIC const VMCS_FIELD vmcs_host_state_fields[] = {
+    VMCS_HOST_STATE_TABLE(VMCS_FIELD_DESCRIPTOR)};
+
+STATIC const VMCS_FIELD vmcs_guest_state_fields[] = {
+    VMCS_GUEST_STATE_TABLE(VMCS_FIELD_DESCRIPTOR)};
+
+STATIC const VMCS_FIELD vmcs_control_fields[] = {
+    VMCS_CONTROL_TABLE(VMCS_FIELD_DESCRIPTOR)};
+
+STATIC const VMCS_FIELD vmcs_exit_information_fields[] = {
+    VMCS_EXIT_INFORMATION_TABLE(VMCS_FIELD_DESCRIPTOR)};
+
+#define VMCS_CONTROL_DESCRIPTOR(Control, Name)                                 \
+        VMCS_FIELD_DESCRIPTOR(Name, VMCS_WIDTH_32, VMCS_SCOPE_CORE,            \
+                              VMCS_SOURCE_VCPU)
+
+STATIC const VMCS_FIELD vmcs_controls_fields[] = {
+    VMCS_CONTROLS_TABLE(VMCS_CONTROL_DESCRIPTOR)};
+
+const VMCS_FIELD_TABLE vmcs_controls_table = {vmcs_controls_fields,
+                                              VMCS_CONTROL_COUNT};
+
+const VMCS_FIELD_TABLE vmcs_host_state_table = {vmcs_host_state_fields,
+                                                VMCS_HOST_STATE_FIELD_COUNT};
+
+const VMCS_FIELD_TABLE vmcs_guest_state_table = {
+    vmcs_guest_state_fields, VMCS_GUEST_STATE_FIELD_COUNT};
+
+const VMCS_FIELD_TABLE vmcs_control_table = {vmcs_control_fields,
+                                             VMCS_CONTROL_FIELD_COUNT};
+
+const VMCS_FIELD_TABLE vmcs_exit_information_table = {
+    vmcs_exit_information_fields, VMCS_EXIT_INFORMATION_FIELD_COUNT};
+
+STATIC
+UINT64
+VmcsTruncate(_In_ UINT8 Width, _In_ UINT64 Value)
+{
+        switch (Width) {
+        case VMCS_WIDTH_16: return Value & 0xFFFF;
+        case VMCS_WIDTH_32: return Value & 0xFFFFFFFF;
+        default: return Value;
+        }
+}
+
+/*
+ * Writes Values[i] to the i'th field of Table, truncated to the fields width.
+ * If a shadow is given, fields whose value matches the last one written
+ * through the same shadow are skipped. Returns the number of vmwrites issued.
+ */
+UINT32
+VmcsApply(_In_ const VMCS_FIELD_TABLE* Table,
+          _In_ const UINT64*           Values,
+          _Inout_opt_ PVMCS_SHADOW     Shadow)
+{
+        const VMCS_FIELD* field   = NULL;
+        UINT64            value   = 0;
+        UINT32            written = 0;
+
+        for (UINT32 index = 0; index < Table->count; index++) {
+                field = &Table->fields[index];
+                value = VmcsTruncate(field->width, Values[index]);
+
+                if (Shadow) {
+                        if (Shadow->valid & (1ull << index) &&
+                            Shadow->values[index] == value)
+                                continue;
+
+                        Shadow->values[index] = value;
+                        Shadow->valid |= 1ull << index;
+                }
+
+                VmxVmWrite(field->encoding, value);
+                written++;
+        }
+
+        return written;
+}
+
+VOID
+VmcsCapture(_In_ const VMCS_FIELD_TABLE* Table, _Out_ UINT64* Values)
+{
+        for (UINT32 index = 0; index < Table->count; index++)
+                Values[index] = VmxVmRead(Table->fields[index].encoding);
+}
+
+/*
+ * Must be called whenever the vmcs the shadow mirrors is cleared or replaced,
+ * so the next VmcsApply writes every field.
+ */
+VOID
+VmcsShadowInvalidate(_Out_ PVMCS_SHADOW Shadow)
+{
+        Shadow->valid = 0;
+}
+
+/* Calls Callback for each field that differs, returning how many did. */
+UINT32
+VmcsDiff(_In_ const VMCS_FIELD_TABLE* Table,
+         _In_ const UINT64*           Before,
+         _In_ const UINT64*           After,
+         _In_ VMCS_DIFF_CALLBACK      Callback,
+         _In_opt_ VOID*               Context)
+{
+        UINT32 changed = 0;
+
+        for (UINT32 index = 0; index < Table->count; index++) {
+                if (Before[index] == After[index])
+                        continue;
+
+                Callback(&Table->fields[index],
+                         Before[index],
+                         After[index],
+                         Context);
+                changed++;
+        }
+
+        return changed;
+}
+
+VOID
+VmcsSnapshot(_Out_ PVMCS_SNAPSHOT Snapshot)
+{
+        VmcsCapture(&vmcs_control_table, Snapshot->control);
+        VmcsCapture(&vmcs_exit_information_table, Snapshot->exit_information);
+        VmcsCapture(&vmcs_guest_state_table, Snapshot->guest);
+        VmcsCapture(&vmcs_host_state_table, Snapshot->host);
+}
+
+UINT32
+VmcsSnapshotDiff(_In_ const VMCS_SNAPSHOT* Before,
+                 _In_ const VMCS_SNAPSHOT* After,
+                 _In_ VMCS_DIFF_CALLBACK   Callback,
+                 _In_opt_ VOID*            Context)
+{
+        UINT32 changed = 0;
+
+        changed += VmcsDiff(&vmcs_control_table,
+                            Before->control,
+                            After->control,
+                            Callback,
+                            Context);
+        changed += VmcsDiff(&vmcs_exit_information_table,
+                            Before->exit_information,
+                            After->exit_information,
+                            Callback,
+                            Context);
+        changed += VmcsDiff(&vmcs_guest_state_table,
+                            Before->guest,
+                            After->guest,
+                            Callback,
+                            Context);
+        changed += VmcsDiff(&vmcs_host_state_table,
+                            Before->host,
+                            After->host,
+                            Callback,
+                            Context);
+
+        return changed;
+}
+
+/*
+ * For a freshly cleared vmcs, nothing it holds is known and every control has
+ * to be written on the next flush.
+ */
+VOID
+VmcsControlsInvalidate(_Out_ PVMCS_CONTROLS           Controls,
+                       _Out_ PVMCS_CONTROLS_COMMITTED Committed)
+{
+        Committed->valid = 0;
+        Controls->dirty  = (1U << VMCS_CONTROL_COUNT) - 1;
+}
+
+/*
+ * Every vm-exit clears the valid bit of the vm-entry interruption information
+ * field, so an event we injected on the last entry is no longer pending and
+ * must not be injected again on the next.
+ */
+VOID
+VmcsControlsOnExit(_Inout_ PVMCS_CONTROLS           Controls,
+                   _Inout_ PVMCS_CONTROLS_COMMITTED Committed)
+{
+        UINT32 intr = VMCS_CONTROL_ENTRY_INTERRUPTION_INFORMATION;
+
+        Committed->value[intr] &= ~VMENTRY_INTERRUPT_INFORMATION_VALID_FLAG;
+        Controls->value[intr] = Committed->value[intr];
+        Controls->dirty &= ~(1U << intr);
+}
+
+/* Returns the number of vmwrites issued. */
+UINT32
+VmcsControlsFlush(_Inout_ PVMCS_CONTROLS           Controls,
+                  _Inout_ PVMCS_CONTROLS_COMMITTED Committed)
+{
+        UINT32 dirty   = Controls->dirty;
+        UINT32 written = 0;
+
+        Controls->dirty = 0;
+
+        for (UINT32 index = 0; dirty; index++) {
+                if (!(dirty & (1U << index)))
+                        continue;
+
+                dirty &= ~(1U << index);
+
+                if (Committed->valid & (1U << index) &&
+                    Committed->value[index] == Controls->value[index])
+                        continue;
+
+                VmxVmWrite(vmcs_controls_fields[index].encoding,
+                           Controls->value[index]);
+
+                Committed->value[index] = Controls->value[index];
+                Committed->valid |= 1U << index;
+                written++;
+        }
+
+        return written;
+}
+
+#if defined(_KERNEL_MODE)
+
+STATIC
+VOID
+VmcsLogFieldDiff(_In_ const VMCS_FIELD* Field,
+                 _In_ UINT64            Before,
+                 _In_ UINT64            After,
+                 _In_opt_ VOID*         Context)
+{
+        UNREFERENCED_PARAMETER(Context);
+
+        DEBUG_LOG("VMCS %s: %llx -> %llx", Field->name, Before, After);
+}
+
+/*
+ * Debugging aid, i.e capture a snapshot before and after a handler runs and
+ * log whatever it changed. Not meant to be left in the exit path.
+ */
+VOID
+VmcsLogSnapshotDiff(_In_ const VMCS_SNAPSHOT* Before,
+                    _In_ const VMCS_SNAPSHOT* After)
+{
+        UINT32 changed =
+            VmcsSnapshotDiff(Before, After, VmcsLogFieldDiff, NULL);
+
+        DEBUG_LOG("VMCS snapshot diff: %lx fields changed", changed);
+}
+
+#endif
@@ -0,0 +1,370 @@
+#ifndef VMCSFIELD_H
+#define VMCSFIELD_H
+
+/*
+ * The guest, host and control fields we write or inspect are described by
+ * the tables below rather than by long runs of VmxVmWrite calls. A table is
+ * written in one pass by VmcsApply and read back by VmcsCapture, both of which
+ * only depend on VmxVmRead and VmxVmWrite. In user mode those come from hw.h,
+ * so the tables can be exercised against an in memory vmcs.
+ */
+#if !defined(_KERNEL_MODE)
+#        include <stddef.h>
+#endif
+
+#include "hw.h"
+
+/* bits 14:13 of a field encoding give its width, see SDM 25.11.2 */
+#define VMCS_WIDTH_16      0
+#define VMCS_WIDTH_64      1
+#define VMCS_WIDTH_32      2
+#define VMCS_WIDTH_NATURAL 3
+
+#define VMCS_ENCODING_WIDTH(Encoding) (((Encoding) >> 13) & 0x3)
+
+/* the value is the same on every core, or has to be captured on each core */
+#define VMCS_SCOPE_GLOBAL 0
+#define VMCS_SCOPE_CORE   1
+
+/* where the value written to, or read from, a field comes from */
+#define VMCS_SOURCE_PROCESSOR 0
+#define VMCS_SOURCE_VCPU      1
+#define VMCS_SOURCE_CONSTANT  2
+#define VMCS_SOURCE_TEMPLATE  3
+/* written by the processor on each exit, read only */
+#define VMCS_SOURCE_EXIT      4
+
+/* a table is limited to the number of bits in a shadows valid mask */
+#define VMCS_TABLE_MAX_FIELDS 64
+
+typedef struct _VMCS_FIELD {
+        const char* name;
+        UINT32      encoding;
+        UINT8       width;
+        UINT8       scope;
+        UINT8       source;
+
+} VMCS_FIELD, *PVMCS_FIELD;
+
+typedef struct _VMCS_FIELD_TABLE {
+        const VMCS_FIELD* fields;
+        UINT32            count;
+
+} VMCS_FIELD_TABLE, *PVMCS_FIELD_TABLE;
+
+/*
+ * The last value VmcsApply wrote to each field of a table, used to skip
+ * writes that wouldn't change anything. Only fields the processor never
+ * writes itself (i.e the host state) can be shadowed, the guest state is
+ * saved back into the vmcs on every exit.
+ */
+typedef struct _VMCS_SHADOW {
+        UINT64 valid;
+        UINT64 values[VMCS_TABLE_MAX_FIELDS];
+
+} VMCS_SHADOW, *PVMCS_SHADOW;
+
+/*
+ * X(Name, Width, Scope, Source), Name being the ia32.h encoding without its
+ * VMCS_ prefix. Each width is checked against the encoding at compile time in
+ * vmcsfield.c.
+ */
+#define VMCS_HOST_STATE_TABLE(X)                                               \
+        X(HOST_ES_SELECTOR, VMCS_WIDTH_16, VMCS_SCOPE_GLOBAL,                  \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_CS_SELECTOR, VMCS_WIDTH_16, VMCS_SCOPE_GLOBAL,                  \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_SS_SELECTOR, VMCS_WIDTH_16, VMCS_SCOPE_GLOBAL,                  \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_DS_SELECTOR, VMCS_WIDTH_16, VMCS_SCOPE_GLOBAL,                  \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_FS_SELECTOR, VMCS_WIDTH_16, VMCS_SCOPE_GLOBAL,                  \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_GS_SELECTOR, VMCS_WIDTH_16, VMCS_SCOPE_GLOBAL,                  \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_TR_SELECTOR, VMCS_WIDTH_16, VMCS_SCOPE_GLOBAL,                  \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_CR0, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,                     \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_CR3, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                       \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_CR4, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,                     \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_FS_BASE, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                   \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_GS_BASE, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                   \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_TR_BASE, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                   \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_GDTR_BASE, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                 \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_IDTR_BASE, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                 \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_SYSENTER_CS, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,                  \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_SYSENTER_EIP, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,            \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_SYSENTER_ESP, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,            \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(HOST_RSP, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE, VMCS_SOURCE_VCPU)     \
+        X(HOST_RIP, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,                     \
+          VMCS_SOURCE_CONSTANT)
+
+#define VMCS_GUEST_SEGMENT_FIELDS(X, Segment)                                  \
+        X(GUEST_##Segment##_SELECTOR, VMCS_WIDTH_16, VMCS_SCOPE_GLOBAL,        \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_##Segment##_BASE, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,         \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_##Segment##_LIMIT, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,           \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_##Segment##_ACCESS_RIGHTS, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,   \
+          VMCS_SOURCE_PROCESSOR)
+
+#define VMCS_GUEST_STATE_TABLE(X)                                              \
+        VMCS_GUEST_SEGMENT_FIELDS(X, ES)                                       \
+        VMCS_GUEST_SEGMENT_FIELDS(X, CS)                                       \
+        VMCS_GUEST_SEGMENT_FIELDS(X, SS)                                       \
+        VMCS_GUEST_SEGMENT_FIELDS(X, DS)                                       \
+        VMCS_GUEST_SEGMENT_FIELDS(X, FS)                                       \
+        VMCS_GUEST_SEGMENT_FIELDS(X, GS)                                       \
+        VMCS_GUEST_SEGMENT_FIELDS(X, TR)                                       \
+        VMCS_GUEST_SEGMENT_FIELDS(X, LDTR)                                     \
+        X(GUEST_GDTR_LIMIT, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,                  \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_IDTR_LIMIT, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,                  \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_GDTR_BASE, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_IDTR_BASE, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_VMCS_LINK_POINTER, VMCS_WIDTH_64, VMCS_SCOPE_GLOBAL,           \
+          VMCS_SOURCE_CONSTANT)                                                \
+        X(GUEST_CR0, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,                    \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_CR3, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                      \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_CR4, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,                    \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_RFLAGS, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                   \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_SYSENTER_CS, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,                 \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_SYSENTER_EIP, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,           \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_SYSENTER_ESP, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,           \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_RSP, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                      \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_RIP, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,                    \
+          VMCS_SOURCE_CONSTANT)                                                \
+        X(GUEST_DEBUGCTL, VMCS_WIDTH_64, VMCS_SCOPE_CORE,                      \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_DR7, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,                      \
+          VMCS_SOURCE_PROCESSOR)                                               \
+        X(GUEST_INTERRUPTIBILITY_STATE, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,      \
+          VMCS_SOURCE_CONSTANT)                                                \
+        X(GUEST_ACTIVITY_STATE, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,              \
+          VMCS_SOURCE_CONSTANT)
+
+#define VMCS_CONTROL_TABLE(X)                                                  \
+        X(CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, VMCS_WIDTH_32,                 \
+          VMCS_SCOPE_GLOBAL, VMCS_SOURCE_TEMPLATE)                             \
+        X(CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, VMCS_WIDTH_32,           \
+          VMCS_SCOPE_CORE, VMCS_SOURCE_VCPU)                                   \
+        X(CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, VMCS_WIDTH_32, \
+          VMCS_SCOPE_CORE, VMCS_SOURCE_VCPU)                                   \
+        X(CTRL_PRIMARY_VMEXIT_CONTROLS, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,      \
+          VMCS_SOURCE_TEMPLATE)                                                \
+        X(CTRL_VMENTRY_CONTROLS, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,             \
+          VMCS_SOURCE_TEMPLATE)                                                \
+        X(CTRL_EXCEPTION_BITMAP, VMCS_WIDTH_32, VMCS_SCOPE_CORE,               \
+          VMCS_SOURCE_VCPU)                                                    \
+        X(CTRL_CR0_GUEST_HOST_MASK, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,     \
+          VMCS_SOURCE_TEMPLATE)                                                \
+        X(CTRL_CR4_GUEST_HOST_MASK, VMCS_WIDTH_NATURAL, VMCS_SCOPE_GLOBAL,     \
+          VMCS_SOURCE_TEMPLATE)                                                \
+        X(CTRL_MSR_BITMAP_ADDRESS, VMCS_WIDTH_64, VMCS_SCOPE_CORE,             \
+          VMCS_SOURCE_VCPU)                                                    \
+        X(CTRL_VIRTUAL_APIC_ADDRESS, VMCS_WIDTH_64, VMCS_SCOPE_CORE,           \
+          VMCS_SOURCE_VCPU)                                                    \
+        X(CTRL_TPR_THRESHOLD, VMCS_WIDTH_32, VMCS_SCOPE_GLOBAL,                \
+          VMCS_SOURCE_CONSTANT)                                                \
+        X(CTRL_APIC_ACCESS_ADDRESS, VMCS_WIDTH_64, VMCS_SCOPE_GLOBAL,          \
+          VMCS_SOURCE_TEMPLATE)
+
+#define VMCS_EXIT_INFORMATION_TABLE(X)                                         \
+        X(VM_INSTRUCTION_ERROR, VMCS_WIDTH_32, VMCS_SCOPE_CORE,                \
+          VMCS_SOURCE_EXIT)                                                    \
+        X(EXIT_REASON, VMCS_WIDTH_32, VMCS_SCOPE_CORE, VMCS_SOURCE_EXIT)       \
+        X(EXIT_QUALIFICATION, VMCS_WIDTH_NATURAL, VMCS_SCOPE_CORE,             \
+          VMCS_SOURCE_EXIT)                                                    \
+        X(VMEXIT_INSTRUCTION_LENGTH, VMCS_WIDTH_32, VMCS_SCOPE_CORE,           \
+          VMCS_SOURCE_EXIT)
+
+/* the position of each field within its table, i.e VMCS_FIELD_HOST_CR3 */
+#define VMCS_FIELD_INDEX(Name, Width, Scope, Source) VMCS_FIELD_##Name,
+
+typedef enum _VMCS_HOST_STATE_FIELD {
+        VMCS_HOST_STATE_TABLE(VMCS_FIELD_INDEX) VMCS_HOST_STATE_FIELD_COUNT
+
+} VMCS_HOST_STATE_FIELD;
+
+typedef enum _VMCS_GUEST_STATE_FIELD {
+        VMCS_GUEST_STATE_TABLE(VMCS_FIELD_INDEX) VMCS_GUEST_STATE_FIELD_COUNT
+
+} VMCS_GUEST_STATE_FIELD;
+
+typedef enum _VMCS_CONTROL_FIELD {
+        VMCS_CONTROL_TABLE(VMCS_FIELD_INDEX) VMCS_CONTROL_FIELD_COUNT
+
+} VMCS_CONTROL_FIELD;
+
+typedef enum _VMCS_EXIT_INFORMATION_FIELD {
+        VMCS_EXIT_INFORMATION_TABLE(VMCS_FIELD_INDEX)
+            VMCS_EXIT_INFORMATION_FIELD_COUNT
+
+} VMCS_EXIT_INFORMATION_FIELD;
+
+extern const VMCS_FIELD_TABLE vmcs_host_state_table;
+extern const VMCS_FIELD_TABLE vmcs_guest_state_table;
+extern const VMCS_FIELD_TABLE vmcs_control_table;
+extern const VMCS_FIELD_TABLE vmcs_exit_information_table;
+
+/*
+ * Every field we know about, captured in one go so two points in time can be
+ * compared with VmcsSnapshotDiff.
+ */
+typedef struct _VMCS_SNAPSHOT {
+        UINT64 control[VMCS_CONTROL_FIELD_COUNT];
+        UINT64 exit_information[VMCS_EXIT_INFORMATION_FIELD_COUNT];
+        UINT64 guest[VMCS_GUEST_STATE_FIELD_COUNT];
+        UINT64 host[VMCS_HOST_STATE_FIELD_COUNT];
+
+} VMCS_SNAPSHOT, *PVMCS_SNAPSHOT;
+
+typedef VOID (*VMCS_DIFF_CALLBACK)(_In_ const VMCS_FIELD* Field,
+                                   _In_ UINT64            Before,
+                                   _In_ UINT64            After,
+                                   _In_opt_ VOID*         Context);
+
+/*
+ * The control fields exit handlers change at runtime. X(Control, Name), the
+ * vcpus copy of each lives in a VMCS_CONTROLS and is the source of truth,
+ * handlers only ever modify that copy. Anything left dirty is written by
+ * VmcsControlsFlush right before we resume the guest, and only if it differs
+ * from what the vmcs already holds, so a control that is toggled on and off
+ * within the same exit costs nothing.
+ *
+ * Every control is 32 bits wide, which is checked in vmcsfield.c.
+ */
+#define VMCS_CONTROLS_TABLE(X)                                                 \
+        X(PIN_CTLS, CTRL_PIN_BASED_VM_EXECUTION_CONTROLS)                      \
+        X(PROC_CTLS, CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS)               \
+        X(PROC_CTLS2, CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS)    \
+        X(EXIT_CTLS, CTRL_PRIMARY_VMEXIT_CONTROLS)                             \
+        X(ENTRY_CTLS, CTRL_VMENTRY_CONTROLS)                                   \
+        X(EXCEPTION_BITMAP, CTRL_EXCEPTION_BITMAP)                             \
+        X(ENTRY_INTERRUPTION_INFORMATION,                                      \
+          CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD)                         \
+        X(ENTRY_EXCEPTION_ERROR_CODE, CTRL_VMENTRY_EXCEPTION_ERROR_CODE)
+
+#define VMCS_CONTROL_INDEX(Control, Name) VMCS_CONTROL_##Control,
+
+typedef enum _VMCS_CONTROL {
+        VMCS_CONTROLS_TABLE(VMCS_CONTROL_INDEX) VMCS_CONTROL_COUNT
+
+} VMCS_CONTROL;
+
+extern const VMCS_FIELD_TABLE vmcs_controls_table;
+
+/*
+ * Kept small as it lives in the hot part of the vcpu, the values last written
+ * to the vmcs are tracked separately in a VMCS_CONTROLS_COMMITTED.
+ */
+typedef struct _VMCS_CONTROLS {
+        /* controls modified since the last flush */
+        UINT32 dirty;
+        UINT32 value[VMCS_CONTROL_COUNT];
+
+} VMCS_CONTROLS, *PVMCS_CONTROLS;
+
+typedef struct _VMCS_CONTROLS_COMMITTED {
+        /* controls whose value below is known to be in the vmcs */
+        UINT32 valid;
+        UINT32 value[VMCS_CONTROL_COUNT];
+
+} VMCS_CONTROLS_COMMITTED, *PVMCS_CONTROLS_COMMITTED;
+
+static __inline UINT32
+VmcsControlRead(const VMCS_CONTROLS* Controls, VMCS_CONTROL Control)
+{
+        return Controls->value[Control];
+}
+
+static __inline VOID
+VmcsControlWrite(PVMCS_CONTROLS Controls, VMCS_CONTROL Control, UINT32 Value)
+{
+        Controls->value[Control] = Value;
+        Controls->dirty |= 1U << Control;
+}
+
+static __inline VOID
+VmcsControlSet(PVMCS_CONTROLS Controls, VMCS_CONTROL Control, UINT32 Bits)
+{
+        VmcsControlWrite(Controls, Control, Controls->value[Control] | Bits);
+}
+
+static __inline VOID
+VmcsControlClear(PVMCS_CONTROLS Controls, VMCS_CONTROL Control, UINT32 Bits)
+{
+        VmcsControlWrite(Controls, Control, Controls->value[Control] & ~Bits);
+}
+
+UINT32
+VmcsApply(_In_ const VMCS_FIELD_TABLE* Table,
+          _In_ const UINT64*           Values,
+          _Inout_opt_ PVMCS_SHADOW     Shadow);
+
+VOID
+VmcsCapture(_In_ const VMCS_FIELD_TABLE* Table, _Out_ UINT64* Values);
+
+VOID
+VmcsShadowInvalidate(_Out_ PVMCS_SHADOW Shadow);
+
+UINT32
+VmcsDiff(_In_ const VMCS_FIELD_TABLE* Table,
+         _In_ const UINT64*           Before,
+         _In_ const UINT64*           After,
+         _In_ VMCS_DIFF_CALLBACK      Callback,
+         _In_opt_ VOID*               Context);
+
+VOID
+VmcsSnapshot(_Out_ PVMCS_SNAPSHOT Snapshot);
+
+UINT32
+VmcsSnapshotDiff(_In_ const VMCS_SNAPSHOT* Before,
+                 _In_ const VMCS_SNAPSHOT* After,
+                 _In_ VMCS_DIFF_CALLBACK   Callback,
+                 _In_opt_ VOID*            Context);
+
+VOID
+VmcsControlsInvalidate(_Out_ PVMCS_CONTROLS           Controls,
+                       _Out_ PVMCS_CONTROLS_COMMITTED Committed);
+
+VOID
+VmcsControlsOnExit(_Inout_ PVMCS_CONTROLS           Controls,
+                   _Inout_ PVMCS_CONTROLS_COMMITTED Committed);
+
+UINT32
+VmcsControlsFlush(_Inout_ PVMCS_CONTROLS           Controls,
+                  _Inout_ PVMCS_CONTROLS_COMMITTED Committed);
+
+#if defined(_KERNEL_MODE)
+
+VOID
+VmcsLogSnapshotDiff(_In_ const VMCS_SNAPSHOT* Before,
+                    _In_ const VMCS_SNAPSHOT* After);
+
+#endif
+
+#endif
@@ -6,32 +6,44 @@
 #include "vmcs.h"
 #include "log.h"
 #include "dispatch.h"
-
-#include <intrin.h>
+#include "topology.h"
+#include "arena.h"
+#include "cap.h"
+#include "hw.h"
+#include "ept.h"
 
 PDRIVER_STATE          driver_state = NULL;
 PVIRTUAL_MACHINE_STATE vmm_state    = NULL;
 
+/* cores that entered VMX operation, updated by ValidateVmxLaunch */
+STATIC UINT32 virtualised_core_count = 0;
+
 /*
  * Some wrapper functions to read from our vmm state structure so we dont have
  * to write as much assembly.
  */
 UINT64
-VmmReadGuestRip()
+VmmReadGuestRip(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        return vmm_state[KeGetCurrentProcessorNumber()].exit_state.guest_rip;
+        return Vcpu->exit_state.guest_rip;
 }
 
 UINT64
-VmmReadGuestRsp()
+VmmReadGuestRsp(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        return vmm_state[KeGetCurrentProcessorNumber()].exit_state.guest_rsp;
+        return Vcpu->exit_state.guest_rsp;
 }
 
+/*
+ * Only for use outside of VMX root, where the vcpu pointer at the top of the
+ * host stack isn't available. vmm_state is sized by the active processor count
+ * across all groups, so it must be indexed by the system wide processor index
+ * rather than the group relative processor number.
+ */
 UINT64
 VmmGetCoresVcpu()
 {
-        return &vmm_state[KeGetCurrentProcessorNumber()];
+        return (UINT64)&vmm_state[TopologyCurrentIndex()];
 }
 
 /*
@@ -42,13 +54,13 @@ NTSTATUS
 EnableVmxOperationOnCore()
 {
         CR4 cr4    = {0};
-        cr4.AsUInt = __readcr4();
+        cr4.AsUInt = HwReadCr4();
 
         if (cr4.VmxEnable)
                 return STATUS_SUCCESS;
 
         cr4.VmxEnable = TRUE;
-        __writecr4(cr4.AsUInt);
+        HwWriteCr4(cr4.AsUInt);
         return STATUS_SUCCESS;
 }
 
@@ -57,18 +69,18 @@ NTSTATUS
 IsVmxSupported()
 {
         CPUID_EAX_01 cpuid_features = {0};
-        __cpuid((INT*)&cpuid_features, CPUID_VERSION_INFORMATION);
+        HwCpuidEx((INT32*)&cpuid_features, CPUID_VERSION_INFORMATION, 0);
 
         if (!cpuid_features.CpuidFeatureInformationEcx.VirtualMachineExtensions)
                 return STATUS_NOT_SUPPORTED;
 
         IA32_FEATURE_CONTROL_REGISTER Control = {0};
-        Control.AsUInt                        = __readmsr(IA32_FEATURE_CONTROL);
+        Control.AsUInt                        = HwReadMsr(IA32_FEATURE_CONTROL);
 
         if (Control.LockBit == 0) {
                 Control.LockBit             = TRUE;
                 Control.EnableVmxOutsideSmx = TRUE;
-                __writemsr(IA32_FEATURE_CONTROL, Control.AsUInt);
+                HwWriteMsr(IA32_FEATURE_CONTROL, Control.AsUInt);
         }
         else if (Control.EnableVmxOutsideSmx == FALSE) {
                 DEBUG_LOG("VMX not enabled in the bios");
@@ -79,7 +91,43 @@ IsVmxSupported()
 }
 
 /*
- * VMCS region comprises up to 4096 bytes, with the following format:
+ * Every exit touches the vmcs, host stack and virtual apic page, so keep each
+ * vcpus structures on the node its core belongs to. If the node has run out of
+ * contiguous memory we fall back to any node rather than failing to virtualise
+ * the core, but count it so the placement can be reported.
+ */
+STATIC
+PVOID
+AllocateVcpuContiguousMemory(_In_ PVIRTUAL_MACHINE_STATE Vcpu,
+                             _In_ SIZE_T                 Size,
+                             _In_ ULONG                  Protect)
+{
+        PHYSICAL_ADDRESS low        = {0};
+        PHYSICAL_ADDRESS high       = {.QuadPart = MAXULONG64};
+        PHYSICAL_ADDRESS boundary   = {0};
+        PVOID            allocation = NULL;
+
+        allocation = MmAllocateContiguousNodeMemory(
+            Size, low, high, boundary, Protect, Vcpu->cold.node);
+
+        if (allocation)
+                return allocation;
+
+        allocation = MmAllocateContiguousNodeMemory(
+            Size, low, high, boundary, Protect, MM_ANY_NODE_OK);
+
+        if (allocation)
+                Vcpu->cold.remote_allocations++;
+
+        return allocation;
+}
+
+/*
+ * All of a vcpus VMX pages are carved out of a single contiguous allocation,
+ * see arena.h for the layout. As the arena is physically contiguous, the
+ * physical address of each region is the arenas plus the regions offset.
+ *
+ * Both the VMXON and VMCS regions begin with the VMCS revision identifier:
  *
  * offset 0: VMCS revision identifier
  * offset 4: VMX abort indicator
@@ -89,80 +137,72 @@ IsVmxSupported()
  */
 STATIC
 NTSTATUS
-AllocateVmcsRegion(_In_ PVIRTUAL_MACHINE_STATE VmmState)
+AllocateVcpuArena(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        INT                     status              = 0;
-        PVOID                   virtual_allocation  = NULL;
-        UINT64                  physical_allocation = NULL;
-        PHYSICAL_ADDRESS        physical_max        = {0};
-        PHYSICAL_ADDRESS        physical_address    = {0};
-        IA32_VMX_BASIC_REGISTER ia32_basic_msr      = {0};
+        VCPU_ARENA_LAYOUT       layout         = {0};
+        IA32_VMX_BASIC_REGISTER ia32_basic_msr = {0};
+        UINT64                  va             = 0;
+        UINT64                  pa             = 0;
 
-        physical_max.QuadPart = MAXULONG64;
+        if (ArenaLayoutBuild(&layout, PAGE_SIZE, VMX_HOST_STACK_SIZE))
+                return STATUS_INVALID_PARAMETER;
 
-        virtual_allocation =
-            MmAllocateContiguousMemory(PAGE_SIZE, physical_max);
+        va = (UINT64)AllocateVcpuContiguousMemory(
+            Vcpu, layout.size, PAGE_READWRITE);
 
-        if (!virtual_allocation) {
-                DEBUG_ERROR("Failed to allocate vmcs region");
+        if (!va) {
+                DEBUG_ERROR("Failed to allocate vcpu arena");
                 return STATUS_MEMORY_NOT_ALLOCATED;
         }
 
-        RtlSecureZeroMemory(virtual_allocation, PAGE_SIZE);
-
-        physical_allocation = MmGetPhysicalAddress(virtual_allocation).QuadPart;
-
-        if (!physical_allocation) {
-                DEBUG_LOG("Faield to get vmcs pa address");
-                MmFreeContiguousMemory(virtual_allocation);
-                return STATUS_MEMORY_NOT_ALLOCATED;
-        }
-
-        ia32_basic_msr.AsUInt = __readmsr(IA32_VMX_BASIC);
-
-        *(UINT64*)virtual_allocation = ia32_basic_msr.VmcsRevisionId;
-
-        VmmState->vmcs_region_pa = physical_allocation;
-        VmmState->vmcs_region_va = virtual_allocation;
+        RtlSecureZeroMemory((PVOID)va, layout.size);
+        RtlFillMemoryUlong(
+            (PVOID)(va + layout.guard), PAGE_SIZE, ARENA_GUARD_PATTERN);
+
+        pa = MmGetPhysicalAddress((PVOID)va).QuadPart;
+
+        ia32_basic_msr.AsUInt = CapGetCapabilities()->basic;
+
+        *(UINT32*)(va + layout.vmxon) = ia32_basic_msr.VmcsRevisionId;
+        *(UINT32*)(va + layout.vmcs)  = ia32_basic_msr.VmcsRevisionId;
+
+        Vcpu->cold.arena_va        = va;
+        Vcpu->cold.vmxon_region_va = va + layout.vmxon;
+        Vcpu->cold.vmxon_region_pa = pa + layout.vmxon;
+        Vcpu->cold.vmcs_region_va  = va + layout.vmcs;
+        Vcpu->cold.vmcs_region_pa  = pa + layout.vmcs;
+        Vcpu->cold.msr_bitmap_va   = (PMSR_BITMAP)(va + layout.msr_bitmap);
+        Vcpu->cold.msr_bitmap_pa   = (PMSR_BITMAP)(pa + layout.msr_bitmap);
+        Vcpu->virtual_apic_va      = va + layout.virtual_apic;
+        Vcpu->cold.virtual_apic_pa = pa + layout.virtual_apic;
+        Vcpu->cold.io_bitmap_va    = va + layout.io_bitmap;
+        Vcpu->cold.io_bitmap_pa    = pa + layout.io_bitmap;
+        Vcpu->cold.stack_guard_va  = va + layout.guard;
+        Vcpu->cold.vmm_stack_va    = va + layout.stack;
+
+        DEBUG_LOG("Core: %lx - arena: %llx, pa: %llx, size: %lx",
+                  Vcpu->cold.index,
+                  va,
+                  pa,
+                  layout.size);
 
         return STATUS_SUCCESS;
 }
 
 STATIC
-NTSTATUS
-AllocateVmxonRegion(_In_ PVIRTUAL_MACHINE_STATE VmmState)
+BOOLEAN
+IsHostStackGuardIntact(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        INT                     status              = 0;
-        PVOID                   virtual_allocation  = NULL;
-        UINT64                  physical_allocation = NULL;
-        PHYSICAL_ADDRESS        physical_max        = {0};
-        PHYSICAL_ADDRESS        physical_address    = {0};
-        IA32_VMX_BASIC_REGISTER ia32_basic_msr      = {0};
-
-        physical_max.QuadPart = MAXULONG64;
-
-        virtual_allocation =
-            MmAllocateContiguousMemory(PAGE_SIZE, physical_max);
-
-        if (!virtual_allocation) {
-                DEBUG_ERROR("MmAllocateContiguousMemory failed");
-                return STATUS_MEMORY_NOT_ALLOCATED;
-        }
-
-        RtlSecureZeroMemory(virtual_allocation, PAGE_SIZE);
-
-        physical_allocation = MmGetPhysicalAddress(virtual_allocation).QuadPart;
-
-        if (!physical_allocation) {
-                MmFreeContiguousMemory(virtual_allocation);
-                return STATUS_MEMORY_NOT_ALLOCATED;
-        }
-
-        ia32_basic_msr.AsUInt = __readmsr(IA32_VMX_BASIC);
-
-        *(UINT64*)virtual_allocation = ia32_basic_msr.VmcsRevisionId;
+        return RtlCompareMemoryUlong((PVOID)Vcpu->cold.stack_guard_va,
+                                     PAGE_SIZE,
+                                     ARENA_GUARD_PATTERN) == PAGE_SIZE;
+}
 
-        status = __vmx_on(&physical_allocation);
+STATIC
+NTSTATUS
+EnterVmxRootOperation(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        INT status = __vmx_on(&Vcpu->cold.vmxon_region_pa);
 
         /*
          * 0 : The operation succeeded
@@ -172,12 +212,12 @@ AllocateVmxonRegion(_In_ PVIRTUAL_MACHINE_STATE VmmState)
          */
         if (status) {
                 DEBUG_LOG("VmxOn failed with status: %i", status);
-                MmFreeContiguousMemory(virtual_allocation);
                 return STATUS_FAIL_CHECK;
         }
 
-        VmmState->vmxon_region_pa = physical_allocation;
-        VmmState->vmxon_region_va = virtual_allocation;
+        /* drop anything cached from a previous spell in VMX operation */
+        if (EptIsEnabled())
+                EptInvalidate();
 
         return STATUS_SUCCESS;
 }
@@ -191,21 +231,10 @@ AllocateDriverState()
         if (!driver_state)
                 return STATUS_MEMORY_NOT_ALLOCATED;
 
+        KeInitializeGuardedMutex(&driver_state->core_state_lock);
         return STATUS_SUCCESS;
 }
 
-STATIC
-VOID
-InitialiseExceptionBitmap(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
-{
-        /*
-         * When an exception occurs, the processor will check the exception
-         * bitmap to determine whether or not it should cause a vm-exit. To
-         * start off we will simply exit on divide by zero exceptions.
-         */
-        Vcpu->exception_bitmap = SET_FLAG_U32(EXCEPTION_DIVIDED_BY_ZERO);
-}
-
 STATIC
 NTSTATUS
 InitiateVmmState(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
@@ -214,56 +243,44 @@ InitiateVmmState(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
         Vcpu->exit_state.exit_vmx = FALSE;
         Vcpu->state               = VMX_VCPU_STATE_OFF;
 
-        InitialiseExceptionBitmap(Vcpu);
-        return STATUS_SUCCESS;
-}
-
-STATIC
-NTSTATUS
-AllocateVmmStack(_In_ PVIRTUAL_MACHINE_STATE VmmState)
-{
-        VmmState->vmm_stack_va = ExAllocatePool2(
-            POOL_FLAG_NON_PAGED, VMX_HOST_STACK_SIZE, POOL_TAG_VMM_STACK);
-
-        if (!VmmState->vmm_stack_va) {
-                DEBUG_LOG("Error in allocating VMM Stack.");
-                return STATUS_MEMORY_NOT_ALLOCATED;
-        }
-
         return STATUS_SUCCESS;
 }
 
+/*
+ * Sleep resets the core, so VMX operation has to be enabled and vmxon executed
+ * again, but the arena, log ring and vmcs contents from before we suspended
+ * are reused as is.
+ */
 STATIC
 NTSTATUS
-AllocateMsrBitmap(_In_ PVIRTUAL_MACHINE_STATE VmmState)
+ResumeCoreVmxState(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 {
-        PHYSICAL_ADDRESS physical_max = {0};
-        physical_max.QuadPart         = MAXULONG64;
+        NTSTATUS status = EnableVmxOperationOnCore();
 
-        VmmState->msr_bitmap_va =
-            MmAllocateContiguousMemory(PAGE_SIZE, physical_max);
-
-        if (!VmmState->msr_bitmap_va) {
-                DEBUG_LOG("Error in allocating MSRBitMap.");
-                return STATUS_MEMORY_NOT_ALLOCATED;
-        }
+        if (!NT_SUCCESS(status))
+                return status;
 
-        RtlSecureZeroMemory(VmmState->msr_bitmap_va, PAGE_SIZE);
+        status = InitiateVmmState(Vcpu);
 
-        VmmState->msr_bitmap_pa =
-            MmGetPhysicalAddress(VmmState->msr_bitmap_va).QuadPart;
+        if (!NT_SUCCESS(status))
+                return status;
 
-        return STATUS_SUCCESS;
+        return EnterVmxRootOperation(Vcpu);
 }
 
 STATIC
 NTSTATUS
 AllocateVmmStateStructure()
 {
-        vmm_state = ExAllocatePool2(POOL_FLAG_NON_PAGED,
-                                    sizeof(VIRTUAL_MACHINE_STATE) *
-                                        KeQueryActiveProcessorCount(0),
-                                    POOL_TAG_VMM_STATE);
+        /*
+         * Allocations of at least a page are page aligned, which guarantees
+         * the cache line alignment each vcpu entry relies on.
+         */
+        vmm_state = ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            ROUND_TO_PAGES(sizeof(VIRTUAL_MACHINE_STATE) *
+                           TopologyVcpuCount()),
+            POOL_TAG_VMM_STATE);
         if (!vmm_state) {
                 DEBUG_LOG("Failed to allocate vmm state");
                 return STATUS_MEMORY_NOT_ALLOCATED;
@@ -272,34 +289,6 @@ AllocateVmmStateStructure()
         return STATUS_SUCCESS;
 }
 
-STATIC
-NTSTATUS
-AllocateApicVirtualPage(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
-{
-        LARGE_INTEGER max = {.QuadPart = MAXULONG64};
-        LARGE_INTEGER low = {0};
-
-        Vcpu->virtual_apic_va = MmAllocateContiguousMemorySpecifyCache(
-            PAGE_SIZE, low, max, low, MmNonCached);
-
-        if (!Vcpu->virtual_apic_va) {
-                DEBUG_ERROR("Failed to allocate Virtual Apic Page");
-                return STATUS_INSUFFICIENT_RESOURCES;
-        }
-
-        RtlSecureZeroMemory(Vcpu->virtual_apic_va, PAGE_SIZE);
-        Vcpu->virtual_apic_pa =
-            MmGetPhysicalAddress(Vcpu->virtual_apic_va).QuadPart;
-
-        DEBUG_LOG("core: %lx - vapic: %llx",
-                  KeGetCurrentProcessorNumber(),
-                  Vcpu->virtual_apic_va);
-        DEBUG_LOG("core: %lx - vapic phys: %llx",
-                  KeGetCurrentProcessorNumber(),
-                  Vcpu->virtual_apic_pa);
-        return STATUS_SUCCESS;
-}
-
 /*
  * 30.1.1 Virtualized APIC Registers
  *
@@ -358,7 +347,7 @@ InitialiseVirtualApicPage(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
 
         // DEBUG_LOG("Initialising vapic page.");
 
-        __write_vapic_32(vapic, IA32_X2APIC_TPR, __readcr8() << 4);
+        __write_vapic_32(vapic, IA32_X2APIC_TPR, HwReadCr8() << 4);
 
         //__write_vapic_32(vapic, IA32_X2APIC_PPR, __readmsr(IA32_X2APIC_PPR));
         ////__write_vapic_32(vapic, IA32_X2APIC_EOI,
@@ -411,28 +400,24 @@ FreeCoreVmxState(_In_ UINT32 Core)
 {
         PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[Core];
 
-        if (vcpu->vmxon_region_va)
-                MmFreeContiguousMemory(vcpu->vmxon_region_va);
-        if (vcpu->vmcs_region_va)
-                MmFreeContiguousMemory(vcpu->vmcs_region_va);
-        if (vcpu->msr_bitmap_va)
-                MmFreeContiguousMemory(vcpu->msr_bitmap_va);
-        if (vcpu->vmm_stack_va)
-                ExFreePoolWithTag(vcpu->vmm_stack_va, POOL_TAG_VMM_STACK);
-#if APIC
-        if (vcpu->virtual_apic_va)
-                MmFreeContiguousMemory(vcpu->virtual_apic_va);
-#endif
-#if DEBUG
+        /* nothing was ever allocated for a core we left alone */
+        if (vcpu->state == VMX_VCPU_STATE_EXCLUDED)
+                return;
+
+        if (vcpu->cold.arena_va) {
+                if (!IsHostStackGuardIntact(vcpu))
+                        DEBUG_ERROR("Core: %lx - host stack overflowed into "
+                                    "its guard page",
+                                    Core);
+
+                MmFreeContiguousMemory((PVOID)vcpu->cold.arena_va);
+                vcpu->cold.arena_va = 0;
+        }
         CleanupLoggerOnUnload(vcpu);
-        if (vcpu->log_state.log_buffer)
-                ExFreePoolWithTag(vcpu->log_state.log_buffer,
-                                  VMX_LOG_BUFFER_POOL_TAG);
-#endif
 }
 
 VOID
-FreeVmxStateDpcRoutine(_In_ PKDPC*    Dpc,
+FreeVmxStateDpcRoutine(_In_ PKDPC     Dpc,
                        _In_opt_ PVOID DeferredContext,
                        _In_opt_ PVOID SystemArgument1,
                        _In_opt_ PVOID SystemArgument2)
@@ -441,7 +426,7 @@ FreeVmxStateDpcRoutine(_In_ PKDPC*    Dpc,
         UNREFERENCED_PARAMETER(DeferredContext);
         UNREFERENCED_PARAMETER(SystemArgument1);
         UNREFERENCED_PARAMETER(SystemArgument2);
-        FreeCoreVmxState(KeGetCurrentProcessorNumber());
+        FreeCoreVmxState(TopologyCurrentIndex());
 }
 
 VOID
@@ -451,18 +436,15 @@ FreeVmxState()
 }
 
 VOID
-InitialiseVmxOperation(_In_ PKDPC*    Dpc,
+InitialiseVmxOperation(_In_ PKDPC     Dpc,
                        _In_opt_ PVOID DeferredContext,
                        _In_opt_ PVOID SystemArgument1,
                        _In_opt_ PVOID SystemArgument2)
 {
-        NTSTATUS               status = STATUS_ABANDONED;
-        PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[KeGetCurrentProcessorNumber()];
+        NTSTATUS               status  = STATUS_ABANDONED;
+        UINT32                 core    = TopologyCurrentIndex();
+        PVIRTUAL_MACHINE_STATE vcpu    = &vmm_state[core];
         PDPC_CALL_CONTEXT      context = (PDPC_CALL_CONTEXT)DeferredContext;
-        UINT32                 core    = KeGetCurrentProcessorNumber();
-
-        DEBUG_LOG("Core: %lx - Initiating VMX Operation state.",
-                  KeGetCurrentProcessorNumber());
 
         if (!ARGUMENT_PRESENT(DeferredContext)) {
                 KeSignalCallDpcSynchronize(SystemArgument2);
@@ -470,57 +452,70 @@ InitialiseVmxOperation(_In_ PKDPC*    Dpc,
                 return;
         }
 
-#ifdef DEBUG
+        if (vcpu->cold.suspended) {
+                status = ResumeCoreVmxState(vcpu);
 
-        status = InitialiseVcpuLogger(vcpu);
+                if (!NT_SUCCESS(status)) {
+                        DEBUG_ERROR("ResumeCoreVmxState failed with status %x",
+                                    status);
+                        vcpu->cold.suspended = FALSE;
+                        FreeCoreVmxState(core);
+                }
 
-        if (!NT_SUCCESS(status)) {
-                DEBUG_ERROR("InitialiseVcpuLogger failed with status %x",
-                            status);
-                FreeCoreVmxState(core);
                 goto end;
         }
 
-#endif
-
-        status = EnableVmxOperationOnCore();
-
-        if (!NT_SUCCESS(status)) {
-                DEBUG_ERROR("EnableVmxOperationOnCore failed with status %x",
-                            status);
-                FreeCoreVmxState(core);
+        vcpu->cold.index = core;
+        KeGetCurrentProcessorNumberEx(&vcpu->cold.processor);
+        vcpu->cold.node = KeGetProcessorNodeNumber(&vcpu->cold.processor);
+        vcpu->cold.remote_allocations = 0;
+
+        DEBUG_LOG("Core: %lx (group %hx, number %hhx, node %hx) - Initiating "
+                  "VMX Operation state.",
+                  core,
+                  vcpu->cold.processor.Group,
+                  vcpu->cold.processor.Number,
+                  vcpu->cold.node);
+
+        if (TopologyIsIndexExcluded(core)) {
+                DEBUG_LOG("Core: %lx - Excluded, leaving it unvirtualised.",
+                          core);
+                vcpu->state = VMX_VCPU_STATE_EXCLUDED;
+                status      = STATUS_SUCCESS;
                 goto end;
         }
 
-        status = AllocateVmxonRegion(vcpu);
+        status = InitialiseVcpuLogger(vcpu);
 
         if (!NT_SUCCESS(status)) {
-                DEBUG_ERROR("AllocateVmxonRegion failed with status %x",
+                DEBUG_ERROR("InitialiseVcpuLogger failed with status %x",
                             status);
                 FreeCoreVmxState(core);
                 goto end;
         }
 
-        status = AllocateVmcsRegion(vcpu);
+        status = EnableVmxOperationOnCore();
 
         if (!NT_SUCCESS(status)) {
-                DEBUG_ERROR("AllocateVmcsRegion failed with status %x", status);
+                DEBUG_ERROR("EnableVmxOperationOnCore failed with status %x",
+                            status);
                 FreeCoreVmxState(core);
                 goto end;
         }
 
-        status = AllocateVmmStack(vcpu);
+        status = AllocateVcpuArena(vcpu);
 
         if (!NT_SUCCESS(status)) {
-                DEBUG_ERROR("AllocateVmmStack failed with status %x", status);
+                DEBUG_ERROR("AllocateVcpuArena failed with status %x", status);
                 FreeCoreVmxState(core);
                 goto end;
         }
 
-        status = AllocateMsrBitmap(vcpu);
+        status = EnterVmxRootOperation(vcpu);
 
         if (!NT_SUCCESS(status)) {
-                DEBUG_ERROR("AllocateMsrBitmap failed with status %x", status);
+                DEBUG_ERROR("EnterVmxRootOperation failed with status %x",
+                            status);
                 FreeCoreVmxState(core);
                 goto end;
         }
@@ -534,24 +529,21 @@ InitialiseVmxOperation(_In_ PKDPC*    Dpc,
         }
 
 #if APIC
-        if (!IsLocalApicPresent()) {
+        if (!CapHasLocalApic(CapGetCapabilities())) {
                 DEBUG_ERROR("Local APIC is not present.");
                 goto end;
         }
-
-        status = AllocateApicVirtualPage(vcpu);
-
-        if (!NT_SUCCESS(status)) {
-                DEBUG_ERROR("AllocateApicVirtualPage failed with status %x",
-                            status);
-                FreeCoreVmxState(core);
-                return status;
-        }
 #endif
 
 end:
+        if (vcpu->cold.remote_allocations)
+                DEBUG_ERROR("Core: %lx - %lx allocations fell back from node %hx",
+                            core,
+                            vcpu->cold.remote_allocations,
+                            vcpu->cold.node);
+
         DEBUG_LOG("Core: %lx - Initiation Status: %lx", core, status);
-        context->status[KeGetCurrentProcessorNumber()] = status;
+        context->status[core] = status;
         KeSignalCallDpcSynchronize(SystemArgument2);
         KeSignalCallDpcDone(SystemArgument1);
 }
@@ -562,12 +554,21 @@ VirtualizeCore(_In_ PDPC_CALL_CONTEXT Context, _In_ PVOID StackPointer)
         UNREFERENCED_PARAMETER(Context);
 
         NTSTATUS               status = STATUS_UNSUCCESSFUL;
-        PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[KeGetCurrentProcessorNumber()];
+        PVIRTUAL_MACHINE_STATE vcpu   = &vmm_state[TopologyCurrentIndex()];
 
-        status = SetupVmcs(vcpu, StackPointer);
+        if (vcpu->state == VMX_VCPU_STATE_EXCLUDED)
+                return;
+
+        if (vcpu->cold.suspended) {
+                vcpu->cold.suspended = FALSE;
+                status               = ResumeVmcs(vcpu, StackPointer);
+        }
+        else {
+                status = SetupVmcs(vcpu, StackPointer);
+        }
 
         if (!NT_SUCCESS(status)) {
-                DEBUG_ERROR("SetupVmcs failed with status %x", status);
+                DEBUG_ERROR("Failed to load vmcs with status %x", status);
                 return;
         }
 
@@ -586,18 +587,67 @@ VirtualizeCore(_In_ PDPC_CALL_CONTEXT Context, _In_ PVOID StackPointer)
 NTSTATUS
 ValidateVmxLaunch()
 {
-        for (UINT32 core = 0; core < KeQueryActiveProcessorCount(NULL);
-             core++) {
+        UINT32 count = 0;
+
+        for (UINT32 core = 0; core < TopologyVcpuCount(); core++) {
                 PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[core];
 
+                if (vcpu->state == VMX_VCPU_STATE_EXCLUDED)
+                        continue;
+
                 if (vcpu->state != VMX_VCPU_STATE_RUNNING) {
                         DEBUG_LOG("Core: %lx failed to enter VMX operation.",
                                   core);
                         return STATUS_UNSUCCESSFUL;
                 }
+
+                count++;
+        }
+
+        virtualised_core_count = count;
+
+        DEBUG_LOG("%lx of %lx cores succesfully entered VMX operation.",
+                  count,
+                  TopologyVcpuCount());
+        return STATUS_SUCCESS;
+}
+
+UINT32
+VmxVirtualisedCoreCount()
+{
+        return virtualised_core_count;
+}
+
+/*
+ * Reports the cores that are currently in VMX operation, grouped the same way
+ * as a GROUP_AFFINITY.
+ */
+NTSTATUS
+VmxQueryVirtualisedCores(_Out_ PHV_VIRTUALISED_CORES Cores)
+{
+        PVIRTUAL_MACHINE_STATE vcpu = NULL;
+
+        C_ASSERT(HV_MAX_PROCESSOR_GROUPS == TOPOLOGY_MAX_GROUPS);
+
+        RtlZeroMemory(Cores, sizeof(HV_VIRTUALISED_CORES));
+
+        if (!vmm_state)
+                return STATUS_DEVICE_NOT_READY;
+
+        Cores->core_count  = TopologyVcpuCount();
+        Cores->group_count = KeQueryActiveGroupCount();
+
+        for (UINT32 core = 0; core < Cores->core_count; core++) {
+                vcpu = &vmm_state[core];
+
+                if (vcpu->state != VMX_VCPU_STATE_RUNNING)
+                        continue;
+
+                Cores->virtualised[vcpu->cold.processor.Group] |=
+                    1ull << vcpu->cold.processor.Number;
+                Cores->virtualised_count++;
         }
 
-        DEBUG_LOG("All cores succesfully entered VMX operation.");
         return STATUS_SUCCESS;
 }
 
@@ -612,19 +662,20 @@ BeginVmxOperation(_In_ PDPC_CALL_CONTEXT Context)
         }
 
         /* What happens if something fails? TODO: think. */
-        KeIpiGenericCall(SaveStateAndVirtualizeCore, Context);
+        KeIpiGenericCall((PKIPI_BROADCAST_WORKER)SaveStateAndVirtualizeCore,
+                         (ULONG_PTR)Context);
 
 #if DEBUG
-        UINT64 vapic = vmm_state[KeGetCurrentProcessorNumber()].virtual_apic_va;
+        UINT64 vapic = vmm_state[TopologyCurrentIndex()].virtual_apic_va;
 
-        DEBUG_LOG("cr8: %llx", __readcr8());
+        DEBUG_LOG("cr8: %llx", HwReadCr8());
         DEBUG_LOG("vapic: %lx", __read_vapic_32(vapic, IA32_X2APIC_TPR) >> 4);
-        __writecr8(5);
-        UINT64 test = __readcr8();
+        HwWriteCr8(5);
+        UINT64 test = HwReadCr8();
         DEBUG_LOG("raised cr8: %llx", test);
         DEBUG_LOG("vapic: %lx", __read_vapic_32(vapic, IA32_X2APIC_TPR) >> 4);
-        __writecr8(0);
-        DEBUG_LOG("cr8 post: %llx", __readcr8());
+        HwWriteCr8(0);
+        DEBUG_LOG("cr8 post: %llx", HwReadCr8());
         DEBUG_LOG("vapic: %lx", __read_vapic_32(vapic, IA32_X2APIC_TPR) >> 4);
         __debugbreak();
 #endif
@@ -650,6 +701,239 @@ VmxVmCall(_In_ UINT64     VmCallId,
         return status;
 }
 
+/*
+ * Both of the below run on the target core at DISPATCH_LEVEL with interrupts
+ * disabled, matching what TerminateVmxDpcRoutine and an IPI broadcast of
+ * SaveStateAndVirtualizeCore see.
+ */
+STATIC
+NTSTATUS
+DevirtualiseCurrentCore(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        NTSTATUS status = VmxVmCall(VMX_HYPERCALL_TERMINATE_VMX, 0, 0, 0);
+
+        if (!NT_SUCCESS(status))
+                return status;
+
+        if (Vcpu->state != VMX_VCPU_STATE_TERMINATED)
+                return STATUS_UNSUCCESSFUL;
+
+        /* keep the arena, log ring and vmcs for RevirtualiseCurrentCore */
+        Vcpu->cold.suspended = TRUE;
+        return STATUS_SUCCESS;
+}
+
+STATIC
+NTSTATUS
+RevirtualiseCurrentCore(_In_ PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        NTSTATUS status = ResumeCoreVmxState(Vcpu);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("ResumeCoreVmxState failed with status %x",
+                            status);
+                return status;
+        }
+
+        /* only returns here once the core is running as a guest again */
+        SaveStateAndVirtualizeCore(NULL);
+
+        if (Vcpu->state != VMX_VCPU_STATE_RUNNING) {
+                /* leave the state intact so the transition can be retried */
+                __vmx_off();
+                Vcpu->cold.suspended = TRUE;
+                return STATUS_UNSUCCESSFUL;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Takes a single core out of, or back into, VMX operation without touching
+ * any other core. The cores allocations are kept while it is devirtualised, so
+ * turning it back on only has to execute vmxon and reload its vmcs.
+ *
+ * Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS
+VmxSetCoreVirtualised(_In_ UINT32 Core, _In_ BOOLEAN Virtualise)
+{
+        NTSTATUS               status   = STATUS_UNSUCCESSFUL;
+        PVIRTUAL_MACHINE_STATE vcpu     = NULL;
+        GROUP_AFFINITY         affinity = {0};
+        GROUP_AFFINITY         previous = {0};
+        KIRQL                  irql     = 0;
+
+        KeAcquireGuardedMutex(&driver_state->core_state_lock);
+
+        if (!vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        if (Core >= TopologyVcpuCount()) {
+                status = STATUS_INVALID_PARAMETER;
+                goto end;
+        }
+
+        vcpu = &vmm_state[Core];
+
+        if (vcpu->state == VMX_VCPU_STATE_EXCLUDED) {
+                status = STATUS_NOT_SUPPORTED;
+                goto end;
+        }
+
+        if (Virtualise == (vcpu->state == VMX_VCPU_STATE_RUNNING)) {
+                status = STATUS_SUCCESS;
+                goto end;
+        }
+
+        /* a core that failed to launch has nothing to resume from */
+        if (Virtualise && !vcpu->cold.suspended) {
+                status = STATUS_INVALID_DEVICE_STATE;
+                goto end;
+        }
+
+        affinity.Group = vcpu->cold.processor.Group;
+        affinity.Mask  = 1ull << vcpu->cold.processor.Number;
+
+        KeSetSystemGroupAffinityThread(&affinity, &previous);
+        KeRaiseIrql(DISPATCH_LEVEL, &irql);
+        _disable();
+
+        if (Virtualise)
+                status = RevirtualiseCurrentCore(vcpu);
+        else
+                status = DevirtualiseCurrentCore(vcpu);
+
+        _enable();
+        KeLowerIrql(irql);
+        KeRevertToUserGroupAffinityThread(&previous);
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("Core: %lx - Failed to %s with status %x",
+                            Core,
+                            Virtualise ? "revirtualise" : "devirtualise",
+                            status);
+                goto end;
+        }
+
+        if (Virtualise)
+                virtualised_core_count++;
+        else
+                virtualised_core_count--;
+
+        DEBUG_LOG("Core: %lx - %s",
+                  Core,
+                  Virtualise ? "Revirtualised." : "Devirtualised.");
+
+end:
+        KeReleaseGuardedMutex(&driver_state->core_state_lock);
+        return status;
+}
+
+/*
+ * Issues a hypercall on every virtualised core, for state only a core can
+ * change for itself such as its vmcs. Holding the core state lock keeps any
+ * core from being devirtualised in between, where the vmcall would #UD.
+ *
+ * Must be called at PASSIVE_LEVEL.
+ */
+STATIC
+NTSTATUS
+VmxBroadcastVmCall(_In_ UINT64 Hypercall,
+                   _In_ UINT64 Parameter1,
+                   _In_ UINT64 Parameter2)
+{
+        NTSTATUS               status   = STATUS_SUCCESS;
+        PVIRTUAL_MACHINE_STATE vcpu     = NULL;
+        GROUP_AFFINITY         affinity = {0};
+        GROUP_AFFINITY         previous = {0};
+        KIRQL                  irql     = 0;
+
+        KeAcquireGuardedMutex(&driver_state->core_state_lock);
+
+        if (!vmm_state) {
+                status = STATUS_DEVICE_NOT_READY;
+                goto end;
+        }
+
+        for (UINT32 core = 0; core < TopologyVcpuCount(); core++) {
+                vcpu = &vmm_state[core];
+
+                if (vcpu->state != VMX_VCPU_STATE_RUNNING)
+                        continue;
+
+                affinity.Group = vcpu->cold.processor.Group;
+                affinity.Mask  = 1ull << vcpu->cold.processor.Number;
+
+                KeSetSystemGroupAffinityThread(&affinity, &previous);
+                KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+                status = VmxVmCall(Hypercall, Parameter1, Parameter2, 0);
+
+                KeLowerIrql(irql);
+                KeRevertToUserGroupAffinityThread(&previous);
+
+                if (!NT_SUCCESS(status)) {
+                        DEBUG_ERROR("Core: %lx - Hypercall %llx failed with "
+                                    "status %x",
+                                    core,
+                                    Hypercall,
+                                    status);
+                        goto end;
+                }
+        }
+
+end:
+        KeReleaseGuardedMutex(&driver_state->core_state_lock);
+        return status;
+}
+
+/* Must be called at PASSIVE_LEVEL. */
+NTSTATUS
+VmxSetSampling(_In_ UINT32 Ticks, _In_ UINT32 Flags)
+{
+        return VmxBroadcastVmCall(VMX_HYPERCALL_SET_SAMPLING, Ticks, Flags);
+}
+
+/*
+ * Once this returns every virtualised core has flushed its translations of
+ * the breakpoint view, and has made a vmcall from outside VMX root, so none
+ * are still in an exit handler that started before the call.
+ *
+ * Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS
+VmxInvalidateEpt()
+{
+        return VmxBroadcastVmCall(VMX_HYPERCALL_INVALIDATE_EPT, 0, 0);
+}
+
+/*
+ * Stops every other core from whichever core we are running on, which has to
+ * be virtualised itself as the stop is made from its VMX root, see freeze.h.
+ *
+ * Must be called at PASSIVE_LEVEL.
+ */
+NTSTATUS
+VmxFreezeWorld(_In_ UINT64 HoldCycles)
+{
+        NTSTATUS status = STATUS_DEVICE_NOT_READY;
+        KIRQL    irql   = 0;
+
+        KeAcquireGuardedMutex(&driver_state->core_state_lock);
+        KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+        if (vmm_state && vmm_state[TopologyCurrentIndex()].state ==
+                             VMX_VCPU_STATE_RUNNING)
+                status = VmxVmCall(VMX_HYPERCALL_FREEZE, HoldCycles, 0, 0);
+
+        KeLowerIrql(irql);
+        KeReleaseGuardedMutex(&driver_state->core_state_lock);
+        return status;
+}
+
 VOID
 FreeGlobalVmmState()
 {
@@ -668,23 +952,44 @@ FreeGlobalDriverState()
         }
 }
 
+/*
+ * DeferredContext is non NULL when we are suspending for sleep, in which case
+ * the per core state is kept for ResumeCoreVmxState rather than freed.
+ */
 STATIC
 VOID
-TerminateVmxDpcRoutine(_In_ PKDPC*    Dpc,
+TerminateVmxDpcRoutine(_In_ PKDPC     Dpc,
                        _In_opt_ PVOID DeferredContext,
                        _In_opt_ PVOID SystemArgument1,
                        _In_opt_ PVOID SystemArgument2)
 {
         UNREFERENCED_PARAMETER(Dpc);
-        UNREFERENCED_PARAMETER(DeferredContext);
 
-        UINT32                 core = KeGetCurrentProcessorNumber();
-        PVIRTUAL_MACHINE_STATE vcpu = &vmm_state[core];
+        UINT32                 core    = TopologyCurrentIndex();
+        PVIRTUAL_MACHINE_STATE vcpu    = &vmm_state[core];
+        BOOLEAN                suspend = DeferredContext != NULL;
 
-        if (!NT_SUCCESS(VmxVmCall(VMX_HYPERCALL_TERMINATE_VMX, 0, 0, 0))) {
-                return STATUS_UNSUCCESSFUL;
+        /* never entered VMX operation, so a vmcall would #UD */
+        if (vcpu->state == VMX_VCPU_STATE_EXCLUDED)
+                goto end;
+
+        /*
+         * Already left VMX operation through VmxSetCoreVirtualised. Its state
+         * is kept when suspending, in which case it will be virtualised again
+         * along with every other core once we resume.
+         */
+        if (vcpu->cold.suspended) {
+                if (!suspend) {
+                        vcpu->cold.suspended = FALSE;
+                        FreeCoreVmxState(core);
+                }
+
+                goto end;
         }
 
+        if (!NT_SUCCESS(VmxVmCall(VMX_HYPERCALL_TERMINATE_VMX, 0, 0, 0)))
+                goto end;
+
         /* TODO: how should we handle this? */
         if (vcpu->state != VMX_VCPU_STATE_TERMINATED) {
                 DEBUG_ERROR("Core: %lx - Failed to terminate VMX operation.",
@@ -692,6 +997,12 @@ TerminateVmxDpcRoutine(_In_ PKDPC*    Dpc,
                 goto end;
         }
 
+        if (suspend) {
+                vcpu->cold.suspended = TRUE;
+                DEBUG_LOG("Core: %lx - Suspended VMX Operation.", core);
+                goto end;
+        }
+
         /*
          * At this point, we have exited VMX operation and we can safely free
          * our per core allocations.
@@ -708,6 +1019,9 @@ end:
 NTSTATUS
 BroadcastVmxTermination()
 {
+        /* each cores log ring is about to be freed, so unmap it first */
+        LogExportDisable();
+
         /* Our routine blocks until all DPCs have executed. */
         KeGenericCallDpc(TerminateVmxDpcRoutine, NULL);
 
@@ -720,6 +1034,104 @@ BroadcastVmxTermination()
         return STATUS_SUCCESS;
 }
 
+/*
+ * Leaves VMX operation on every core ahead of a sleep transition. Unlike
+ * BroadcastVmxTermination, the per core allocations and vmcs contents are
+ * kept, so SetupVmxOperation can resume without allocating contiguous memory
+ * or recomputing the vmcs controls.
+ */
+NTSTATUS
+SuspendVmxOperation()
+{
+        if (!vmm_state)
+                return STATUS_SUCCESS;
+
+        KeGenericCallDpc(TerminateVmxDpcRoutine, (PVOID)TRUE);
+
+        for (UINT32 core = 0; core < TopologyVcpuCount(); core++) {
+                if (vmm_state[core].state == VMX_VCPU_STATE_EXCLUDED)
+                        continue;
+
+                if (!vmm_state[core].cold.suspended) {
+                        DEBUG_ERROR("Core: %lx failed to suspend VMX operation.",
+                                    core);
+                        return STATUS_UNSUCCESSFUL;
+                }
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Suspended state can only be resumed if every core suspended and the same set
+ * of processors came back, as vmm_state is indexed by the system wide index.
+ */
+STATIC
+BOOLEAN
+CanResumeVmxOperation(_In_ UINT32 SuspendedCoreCount)
+{
+        if (SuspendedCoreCount != TopologyVcpuCount())
+                return FALSE;
+
+        for (UINT32 core = 0; core < SuspendedCoreCount; core++) {
+                if (vmm_state[core].state == VMX_VCPU_STATE_EXCLUDED)
+                        continue;
+
+                if (!vmm_state[core].cold.suspended)
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+/*
+ * Only called once we've come back from sleep, at which point no core is in
+ * VMX operation anymore, so the per core state can be freed from here.
+ */
+STATIC
+VOID
+DiscardSuspendedVmxState(_In_ UINT32 SuspendedCoreCount)
+{
+        LogExportDisable();
+
+        for (UINT32 core = 0; core < SuspendedCoreCount; core++) {
+                vmm_state[core].cold.suspended = FALSE;
+                FreeCoreVmxState(core);
+        }
+
+        FreeGlobalVmmState();
+}
+
+/*
+ * Undoes InitialiseVmxOperation on every core once any one of them has failed.
+ * Each core that succeeded, whether it resumed or started afresh, has executed
+ * vmxon but not launched, so it only has to leave VMX operation before its
+ * state is freed. A core that failed has already freed its own.
+ */
+STATIC
+VOID
+AbandonVmxOperation(_In_ PKDPC     Dpc,
+                    _In_opt_ PVOID DeferredContext,
+                    _In_opt_ PVOID SystemArgument1,
+                    _In_opt_ PVOID SystemArgument2)
+{
+        UNREFERENCED_PARAMETER(Dpc);
+
+        UINT32                 core    = TopologyCurrentIndex();
+        PVIRTUAL_MACHINE_STATE vcpu    = &vmm_state[core];
+        PDPC_CALL_CONTEXT      context = (PDPC_CALL_CONTEXT)DeferredContext;
+
+        if (vcpu->state != VMX_VCPU_STATE_EXCLUDED &&
+            NT_SUCCESS(context->status[core])) {
+                __vmx_off();
+                vcpu->cold.suspended = FALSE;
+                FreeCoreVmxState(core);
+        }
+
+        KeSignalCallDpcSynchronize(SystemArgument2);
+        KeSignalCallDpcDone(SystemArgument1);
+}
+
 STATIC
 NTSTATUS
 ValidateSuccessVmxInitiation(PDPC_CALL_CONTEXT Context)
@@ -742,8 +1154,33 @@ SetupVmxOperation()
         PDPC_CALL_CONTEXT context    = NULL;
         EPT_POINTER*      pept       = NULL;
         UINT32            core_count = 0;
+        UINT32            suspended  = TopologyVcpuCount();
+
+        /*
+         * KeQueryActiveProcessorCount only reports processors in group 0,
+         * whereas the generic DPC and IPI calls below run on every active
+         * processor in every group, so size our per core state from the full
+         * topology instead.
+         */
+        status = TopologyInitialise();
+
+        if (!NT_SUCCESS(status)) {
+                DEBUG_ERROR("TopologyInitialise failed with status %x", status);
+                return status;
+        }
 
-        core_count = KeQueryActiveProcessorCount(NULL);
+        status     = STATUS_UNSUCCESSFUL;
+        core_count = TopologyVcpuCount();
+
+        /*
+         * vmm_state only outlives BroadcastVmxTermination if we suspended for
+         * sleep, in which case InitialiseVmxOperation resumes each core with
+         * its existing state.
+         */
+        if (vmm_state && !CanResumeVmxOperation(suspended)) {
+                DEBUG_LOG("Discarding suspended VMX state.");
+                DiscardSuspendedVmxState(suspended);
+        }
 
         context = ExAllocatePool2(POOL_FLAG_NON_PAGED,
                                   core_count * sizeof(DPC_CALL_CONTEXT),
@@ -760,18 +1197,21 @@ SetupVmxOperation()
         if (!context->status)
                 goto end;
 
-        for (INT core = 0; core < KeQueryActiveProcessorCount(NULL); core++) {
+        for (UINT32 core = 0; core < core_count; core++) {
                 context[core].eptp        = NULL;
                 context[core].guest_stack = NULL;
                 context->status[core]     = STATUS_UNSUCCESSFUL;
         }
 
-        status = AllocateVmmStateStructure();
+        if (!vmm_state) {
+                status = AllocateVmmStateStructure();
 
-        if (!NT_SUCCESS(status)) {
-                DEBUG_ERROR("AllocateVmmStateStructure failed with status %x",
+                if (!NT_SUCCESS(status)) {
+                        DEBUG_ERROR(
+                            "AllocateVmmStateStructure failed with status %x",
                             status);
-                return status;
+                        return status;
+                }
         }
 
         /*
@@ -791,6 +1231,15 @@ SetupVmxOperation()
         if (!NT_SUCCESS(status)) {
                 DEBUG_ERROR("InitialiseVmxOperation failed with status %x",
                             status);
+
+                /*
+                 * Every other core is still in VMX root, and if we were
+                 * resuming still holds its suspended state, so take them all
+                 * back out and start from nothing next time.
+                 */
+                LogExportDisable();
+                KeGenericCallDpc(AbandonVmxOperation, context);
+                FreeGlobalVmmState();
                 goto end;
         }
 
@@ -806,6 +1255,8 @@ SetupVmxOperation()
                 goto end;
         }
 
+        LogExportEnable();
+
 end:
         if (context && context->status)
                 ExFreePoolWithTag(context->status, POOL_TAG_STATUS_ARRAY);
@@ -848,6 +1299,8 @@ PowerCallbackRoutine(_In_ PVOID CallbackContext,
         if (Argument1 != (PVOID)PO_CB_SYSTEM_STATE_LOCK)
                 return;
 
+        KeAcquireGuardedMutex(&driver_state->core_state_lock);
+
         if (Argument2) {
                 DEBUG_LOG("Resuming VMX operation after sleep..");
 
@@ -858,15 +1311,16 @@ PowerCallbackRoutine(_In_ PVOID CallbackContext,
                                     status);
         }
         else {
-                DEBUG_LOG("Exiting VMX operation for sleep...");
+                DEBUG_LOG("Suspending VMX operation for sleep...");
 
-                status = BroadcastVmxTermination();
+                status = SuspendVmxOperation();
 
                 if (!NT_SUCCESS(status))
-                        DEBUG_ERROR(
-                            "BroadcastVmxTermination failed with status %x",
-                            status);
+                        DEBUG_ERROR("SuspendVmxOperation failed with status %x",
+                                    status);
         }
+
+        KeReleaseGuardedMutex(&driver_state->core_state_lock);
 }
 
 VOID
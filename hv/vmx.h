@@ -4,6 +4,13 @@
 #include "driver.h"
 #include "ia32.h"
 #include "lock.h"
+#include "trace.h"
+#include "sketch.h"
+#include "accounting.h"
+#include "sample.h"
+#include "vmcsfield.h"
+#include "arena.h"
+#include "ioctl.h"
 
 typedef struct _DPC_CALL_CONTEXT {
         EPT_POINTER* eptp;
@@ -42,28 +49,67 @@ typedef struct _EXIT_STATE {
 #define VMX_VCPU_STATE_OFF        0
 #define VMX_VCPU_STATE_RUNNING    1
 #define VMX_VCPU_STATE_TERMINATED 2
+/* left unvirtualised, see TopologyReadExclusions */
+#define VMX_VCPU_STATE_EXCLUDED   3
 
-typedef enum _VCPU_STATE { off, running, terminated } VCPU_STATE;
+typedef enum _VCPU_STATE { off, running, terminated, excluded } VCPU_STATE;
 
-#define VMX_LOG_BUFFER_SIZE          0x100000
-#define VMX_INIDIVIDUAL_LOG_MAX_SIZE 0x100
-#define VMX_MAX_LOG_ENTRIES_COUNT \
-        VMX_LOG_BUFFER_SIZE / VMX_INIDIVIDUAL_LOG_MAX_SIZE
+/* number of TRACE_RECORDs in each cores log ring, must be a power of 2 */
+#define VMX_LOG_RING_CAPACITY   0x1000
 #define VMX_LOG_BUFFER_POOL_TAG 'rgol'
 
+/* number of EXIT_TRACE_RECORDs in each cores exit ring */
+#define VMX_EXIT_RING_CAPACITY  0x400
+#define VMX_EXIT_RING_POOL_TAG  'rtxe'
+
+#define VMX_EXIT_SKETCH_POOL_TAG 'ksxe'
+#define VMX_ACCOUNTING_POOL_TAG  'tcca'
+
+/* number of SAMPLE_RECORDs in each cores sample ring */
+#define VMX_SAMPLE_RING_CAPACITY 0x800
+#define VMX_SAMPLE_RING_POOL_TAG 'rpms'
+
 #define VMX_APIC_TPR_THRESHOLD 0
 
 typedef struct _VCPU_LOG_STATE {
-        volatile HIGH_IRQL_LOCK lock;
+        /* only ever written to by the core that owns it */
+        PTRACE_RING_HEADER ring;
+        /*
+         * Records are flushed by a periodic timer, flushed is the index of the
+         * next record the timer DPC will consume and lost counts the records
+         * that were overwritten before the DPC got to them. While the rings
+         * are exported to user mode the DPC only signals the consumers event,
+         * signalled being the head at the time it was last signalled.
+         */
+        UINT64             flushed;
+        UINT64             lost;
+        UINT64             signalled;
+        KTIMER             timer;
+        KDPC               dpc;
         /*
-         * Given that our core flushing mechanism only flushes when the buffer
-         * is full, lets create a timer that flushes the logs every X period
-         * regardless of the state of the buffer.
+         * Only allocated once exit recording is first enabled, after which it
+         * lives as long as ring does.
          */
-        KTIMER          timer;
-        KDPC            dpc;
-        PVOID           log_buffer;
-        volatile UINT32 current_log_count;
+        PTRACE_RING_HEADER exit_ring;
+        /*
+         * Same again for the exit profiler. The sketch is only ever written
+         * by its own core, so a reset is requested through exit_sketch_reset
+         * and carried out on that cores next exit.
+         */
+        PEXIT_SKETCH       exit_sketch;
+        volatile LONG      exit_sketch_reset;
+        /* and for cr3 accounting */
+        PCR3_ACCOUNTING    cr3_accounting;
+        volatile LONG      cr3_accounting_reset;
+        /*
+         * Allocated the first time sampling is enabled. sample_ticks is the
+         * preemption timer value to re-arm with, 0 while sampling is off,
+         * and only ever written by the core itself, see
+         * VMX_HYPERCALL_SET_SAMPLING.
+         */
+        PTRACE_RING_HEADER sample_ring;
+        UINT32             sample_ticks;
+        UINT32             sample_flags;
 
 } VCPU_LOG_STATE, *PVCPU_LOG_STATE;
 
@@ -128,35 +174,97 @@ typedef struct _HOST_DEBUG_STATE {
 
 } HOST_DEBUG_STATE, *PHOST_DEBUG_STATE;
 
-typedef struct _VIRTUAL_MACHINE_STATE {
-        VCPU_STATE                        state;
-        VMM_CACHE                         cache;
-        EXIT_STATE                        exit_state;
-        PGUEST_CONTEXT                    guest_context;
-        UINT64                            vmxon_region_pa;
-        UINT64                            vmxon_region_va;
-        UINT64                            vmcs_region_pa;
-        UINT64                            vmcs_region_va;
-        UINT64                            eptp_va;
-        UINT64                            vmm_stack_va;
-        PMSR_BITMAP                       msr_bitmap_va;
-        PMSR_BITMAP                       msr_bitmap_pa;
-        UINT64                            virtual_apic_va;
-        UINT64                            virtual_apic_pa;
-        UINT32                            exception_bitmap;
-        UINT32                            exception_bitmap_mask;
-        HOST_DEBUG_STATE                  debug_state;
-        IA32_VMX_PROCBASED_CTLS_REGISTER  proc_ctls;
-        IA32_VMX_PROCBASED_CTLS2_REGISTER proc_ctls2;
-        IA32_VMX_PINBASED_CTLS_REGISTER   pin_ctls;
-        IA32_VMX_EXIT_CTLS_REGISTER       exit_ctls;
-        IA32_VMX_ENTRY_CTLS_REGISTER      entry_ctls;
-#ifdef DEBUG
-        VCPU_LOG_STATE log_state;
-#endif
+/*
+ * Per vcpu state that is only used during initialisation and teardown, or from
+ * outside of VMX root (i.e the log flush DPC). Keeping it out of the hot block
+ * stops the timer and DPC bookkeeping in log_state from sharing a cache line
+ * with state we touch on every exit.
+ */
+typedef struct _VCPU_COLD_STATE {
+        /* system wide index, see topology.h */
+        UINT32                  index;
+        PROCESSOR_NUMBER        processor;
+        /* numa node our per core structures are allocated from */
+        USHORT                  node;
+        /* allocations that had to fall back to another node */
+        UINT32                  remote_allocations;
+        /* left VMX operation for sleep with all of the below kept intact */
+        BOOLEAN                 suspended;
+        /*
+         * Stepping over an instruction on a breakpoint page in the execute
+         * view, see ept.h. Only the exits on those pages touch it.
+         */
+        BOOLEAN                 ept_step;
+        /* vmxon, vmcs, msr bitmap, vapic, io bitmaps and stack, see arena.h */
+        UINT64                  arena_va;
+        UINT64                  vmxon_region_pa;
+        UINT64                  vmxon_region_va;
+        UINT64                  vmcs_region_pa;
+        UINT64                  vmcs_region_va;
+        UINT64                  eptp_va;
+        UINT64                  vmm_stack_va;
+        PMSR_BITMAP             msr_bitmap_va;
+        PMSR_BITMAP             msr_bitmap_pa;
+        UINT64                  virtual_apic_pa;
+        /* io bitmaps A and B, unused until io exiting is enabled */
+        UINT64                  io_bitmap_va;
+        UINT64                  io_bitmap_pa;
+        UINT64                  stack_guard_va;
+        /* last host state written to the vmcs, see VmcsWriteHostStateFields */
+        VMCS_SHADOW             host_shadow;
+        /* the controls as last written to the vmcs */
+        VMCS_CONTROLS_COMMITTED committed_controls;
+        HOST_DEBUG_STATE        debug_state;
+        VCPU_LOG_STATE          log_state;
+
+} VCPU_COLD_STATE, *PVCPU_COLD_STATE;
+
+/*
+ * Each vcpu is cache line aligned and padded, so no two cores ever share a
+ * line. The fields used by the exit path are packed into the first two lines,
+ * roughly ordered by how often they are accessed, with everything else
+ * pushed out into the cold block.
+ *
+ * state must remain the first field, arch.asm writes to it directly.
+ */
+typedef struct DECLSPEC_CACHEALIGN _VIRTUAL_MACHINE_STATE {
+        VCPU_STATE     state;
+        UINT32         exception_bitmap_mask;
+        EXIT_STATE     exit_state;
+        PGUEST_CONTEXT guest_context;
+        UINT64         virtual_apic_va;
+        /* flushed before each vm-entry, see VmcsControlsFlush */
+        VMCS_CONTROLS  controls;
+        VMM_CACHE      cache;
+
+        DECLSPEC_CACHEALIGN VCPU_COLD_STATE cold;
 
 } VIRTUAL_MACHINE_STATE, *PVIRTUAL_MACHINE_STATE;
 
+C_ASSERT(FIELD_OFFSET(VIRTUAL_MACHINE_STATE, state) == 0);
+C_ASSERT(FIELD_OFFSET(VIRTUAL_MACHINE_STATE, cold) <=
+         2 * SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(VIRTUAL_MACHINE_STATE) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+
+/*
+ * Lives at the very top of each cores host stack, VMCS_HOST_RSP points at it.
+ * This lets VmExitHandler load the current vcpu from a fixed offset off its
+ * stack pointer and pass it to VmExitDispatcher, rather than every handler
+ * having to look it up. Kept at 16 bytes so the host stack stays aligned.
+ *
+ * The offsets are mirrored in arch.asm.
+ */
+typedef struct _HOST_STACK_TOP {
+        /* used by ExitVmx to stage the guests stack pointer */
+        UINT64                 scratch;
+        PVIRTUAL_MACHINE_STATE vcpu;
+
+} HOST_STACK_TOP, *PHOST_STACK_TOP;
+
+C_ASSERT(sizeof(GUEST_CONTEXT) == 0x88);
+C_ASSERT(FIELD_OFFSET(HOST_STACK_TOP, vcpu) == 0x8);
+C_ASSERT(sizeof(HOST_STACK_TOP) == ARENA_HOST_STACK_TOP_SIZE);
+
 #define SET_FLAG_U32(n) (1U << (n))
 
 extern PVIRTUAL_MACHINE_STATE vmm_state;
@@ -164,6 +272,11 @@ extern PVIRTUAL_MACHINE_STATE vmm_state;
 typedef struct _DRIVER_STATE {
         PVOID             power_callback;
         PCALLBACK_OBJECT  power_callback_object;
+        /*
+         * Serialises per core transitions against each other and against
+         * the system wide ones made from the power callback.
+         */
+        KGUARDED_MUTEX    core_state_lock;
         //EPT_CONFIGURATION ept_configuration;
 
 } DRIVER_STATE, *PDRIVER_STATE;
@@ -179,7 +292,7 @@ typedef union {
 } VTPR, *PVTPR;
 
 VOID
-InitialiseVmxOperation(_In_ PKDPC*    Dpc,
+InitialiseVmxOperation(_In_ PKDPC     Dpc,
                        _In_opt_ PVOID DeferredContext,
                        _In_opt_ PVOID SystemArgument1,
                        _In_opt_ PVOID SystemArgument2);
@@ -190,12 +303,33 @@ BeginVmxOperation(_In_ PDPC_CALL_CONTEXT Context);
 NTSTATUS
 BroadcastVmxTermination();
 
+NTSTATUS
+SuspendVmxOperation();
+
 VOID
 VirtualizeCore(_In_ PDPC_CALL_CONTEXT Context, _In_ PVOID StackPointer);
 
 NTSTATUS
 SetupVmxOperation();
 
+UINT32
+VmxVirtualisedCoreCount();
+
+NTSTATUS
+VmxQueryVirtualisedCores(_Out_ PHV_VIRTUALISED_CORES Cores);
+
+NTSTATUS
+VmxSetCoreVirtualised(_In_ UINT32 Core, _In_ BOOLEAN Virtualise);
+
+NTSTATUS
+VmxSetSampling(_In_ UINT32 Ticks, _In_ UINT32 Flags);
+
+NTSTATUS
+VmxInvalidateEpt();
+
+NTSTATUS
+VmxFreezeWorld(_In_ UINT64 HoldCycles);
+
 NTSTATUS
 InitialisePowerCallback();
 
@@ -0,0 +1,236 @@
+/*
+ * arena - prints and checks the layout of a vcpu arena, see hv/arena.h.
+ *
+ * With no arguments the layout the driver uses is printed. "selftest" checks
+ * every region is page aligned, in order and clear of the others, that the
+ * host stack top sits where VMCS_HOST_RSP points and is 16 byte aligned, and
+ * that an overflow off the bottom of the host stack lands in the guard page
+ * and is caught by the same check the driver makes on teardown.
+ *
+ * Builds with any C99 compiler on either Windows or Linux:
+ *
+ *   cc -O2 -I../hv -o arena arena.c
+ *
+ * usage: arena
+ *        arena selftest
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_PAGE_SIZE 0x1000
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s\n", What);
+        failures++;
+}
+
+/* RtlFillMemoryUlong */
+static void
+FillUlong(void* Destination, size_t Length, UINT32 Pattern)
+{
+        for (size_t offset = 0; offset < Length; offset += sizeof(UINT32))
+                memcpy((unsigned char*)Destination + offset,
+                       &Pattern,
+                       sizeof(UINT32));
+}
+
+/* RtlCompareMemoryUlong, the number of bytes matching before a mismatch */
+static size_t
+CompareUlong(const void* Source, size_t Length, UINT32 Pattern)
+{
+        size_t offset = 0;
+
+        for (; offset < Length; offset += sizeof(UINT32)) {
+                if (memcmp((const unsigned char*)Source + offset,
+                           &Pattern,
+                           sizeof(UINT32)))
+                        break;
+        }
+
+        return offset;
+}
+
+static void
+SelfTestLayout(void)
+{
+        VCPU_ARENA_LAYOUT layout    = {0};
+        UINT32            regions[] = {0, 0, 0, 0, 0, 0, 0};
+        UINT32            sizes[]   = {ARENA_PAGE_SIZE,
+                                       ARENA_PAGE_SIZE,
+                                       ARENA_PAGE_SIZE,
+                                       ARENA_PAGE_SIZE,
+                                       2 * ARENA_PAGE_SIZE,
+                                       ARENA_PAGE_SIZE,
+                                       VMX_HOST_STACK_SIZE};
+        int               aligned   = 1;
+        int               packed    = 1;
+        UINT32            top       = 0;
+
+        Check(!ArenaLayoutBuild(&layout, ARENA_PAGE_SIZE, VMX_HOST_STACK_SIZE),
+              "the driver's layout builds");
+
+        regions[0] = layout.vmxon;
+        regions[1] = layout.vmcs;
+        regions[2] = layout.msr_bitmap;
+        regions[3] = layout.virtual_apic;
+        regions[4] = layout.io_bitmap;
+        regions[5] = layout.guard;
+        regions[6] = layout.stack;
+
+        /* each region starts where the one before it ends */
+        for (UINT32 index = 0; index < 7; index++) {
+                aligned &= !(regions[index] & (ARENA_PAGE_SIZE - 1));
+
+                if (index)
+                        packed &= regions[index] ==
+                                  regions[index - 1] + sizes[index - 1];
+        }
+
+        Check(aligned, "every region is page aligned");
+        Check(packed && !layout.vmxon, "regions are in order and clear");
+        Check(layout.io_bitmap + ARENA_PAGE_SIZE ==
+                  layout.guard - ARENA_PAGE_SIZE,
+              "io bitmap B is the page after io bitmap A");
+        Check(layout.guard + ARENA_PAGE_SIZE == layout.stack,
+              "the guard page is directly below the host stack");
+        Check(layout.stack + layout.stack_size == layout.size &&
+                  layout.stack_size == VMX_HOST_STACK_SIZE,
+              "the host stack is the last region");
+        Check(layout.size == 7 * ARENA_PAGE_SIZE + VMX_HOST_STACK_SIZE,
+              "the arena is seven pages and the host stack");
+
+        top = ArenaHostStackTop(&layout);
+
+        Check(ARENA_HOST_STACK_TOP_SIZE % 16 == 0 && !(top & 0xF),
+              "VMCS_HOST_RSP is 16 byte aligned");
+        Check(top >= layout.stack &&
+                  top + ARENA_HOST_STACK_TOP_SIZE == layout.size,
+              "HOST_STACK_TOP is the top of the host stack");
+        Check(VMX_HOST_STACK_SIZE % ARENA_PAGE_SIZE == 0,
+              "the host stack is a whole number of pages");
+
+        Check(ArenaLayoutBuild(&layout, 0, VMX_HOST_STACK_SIZE) &&
+                  ArenaLayoutBuild(&layout, 0x1800, VMX_HOST_STACK_SIZE),
+              "a page size that isn't a power of two is refused");
+        Check(ArenaLayoutBuild(&layout, ARENA_PAGE_SIZE, 0) &&
+                  ArenaLayoutBuild(&layout, ARENA_PAGE_SIZE, 0x8010),
+              "a partial page of stack is refused");
+        Check(!ArenaLayoutBuild(&layout, 0x10000, 0x10000) &&
+                  layout.stack == 7 * 0x10000 &&
+                  layout.size == 7 * 0x10000 + 0x10000,
+              "the layout scales with the page size");
+}
+
+static void
+SelfTestGuard(void)
+{
+        VCPU_ARENA_LAYOUT layout    = {0};
+        unsigned char*    arena     = NULL;
+        unsigned char*    guard     = NULL;
+        const UINT32      pattern   = ARENA_GUARD_PATTERN;
+        const UINT64      rip       = 0xFFFFF80012345678ull;
+        int               caught    = 1;
+        int               untouched = 1;
+
+        for (unsigned byte = 0; byte < sizeof(pattern); byte++)
+                untouched &= ((const unsigned char*)&pattern)[byte] != 0;
+
+        Check(untouched, "every byte of the guard pattern is set");
+
+        ArenaLayoutBuild(&layout, ARENA_PAGE_SIZE, VMX_HOST_STACK_SIZE);
+        arena = calloc(1, layout.size);
+
+        if (!arena) {
+                Check(0, "arena allocation");
+                return;
+        }
+
+        /* as AllocateVcpuArena leaves it */
+        guard = arena + layout.guard;
+        FillUlong(guard, ARENA_PAGE_SIZE, ARENA_GUARD_PATTERN);
+
+        Check(CompareUlong(guard, ARENA_PAGE_SIZE, ARENA_GUARD_PATTERN) ==
+                  ARENA_PAGE_SIZE,
+              "a fresh guard page is intact");
+
+        /* a stack that only just overflows, by a zero written to any byte */
+        for (unsigned depth = 1; depth <= 16; depth++) {
+                FillUlong(guard, ARENA_PAGE_SIZE, ARENA_GUARD_PATTERN);
+                arena[layout.stack - depth] = 0;
+                caught &= CompareUlong(guard,
+                                       ARENA_PAGE_SIZE,
+                                       ARENA_GUARD_PATTERN) != ARENA_PAGE_SIZE;
+        }
+
+        Check(caught, "a single zero byte below the stack is caught");
+
+        /* a return address pushed just below the bottom of the stack */
+        FillUlong(guard, ARENA_PAGE_SIZE, ARENA_GUARD_PATTERN);
+        memcpy(arena + layout.stack - sizeof(rip), &rip, sizeof(rip));
+
+        Check(CompareUlong(guard, ARENA_PAGE_SIZE, ARENA_GUARD_PATTERN) !=
+                  ARENA_PAGE_SIZE,
+              "a push off the bottom of the stack is caught");
+
+        /* writes anywhere in the stack itself leave the guard alone */
+        FillUlong(guard, ARENA_PAGE_SIZE, ARENA_GUARD_PATTERN);
+        memset(arena + layout.stack, 0, layout.stack_size);
+
+        Check(CompareUlong(guard, ARENA_PAGE_SIZE, ARENA_GUARD_PATTERN) ==
+                  ARENA_PAGE_SIZE,
+              "a full stack that doesn't overflow is left intact");
+
+        free(arena);
+}
+
+static void
+PrintLayout(void)
+{
+        VCPU_ARENA_LAYOUT layout = {0};
+
+        ArenaLayoutBuild(&layout, ARENA_PAGE_SIZE, VMX_HOST_STACK_SIZE);
+
+        printf("vmxon          %#7x\n", layout.vmxon);
+        printf("vmcs           %#7x\n", layout.vmcs);
+        printf("msr bitmap     %#7x\n", layout.msr_bitmap);
+        printf("virtual apic   %#7x\n", layout.virtual_apic);
+        printf("io bitmaps     %#7x\n", layout.io_bitmap);
+        printf("guard          %#7x\n", layout.guard);
+        printf("host stack     %#7x\n", layout.stack);
+        printf("host rsp       %#7x\n", ArenaHostStackTop(&layout));
+        printf("size           %#7x\n", layout.size);
+}
+
+int
+main(int argc, char** argv)
+{
+        if (argc == 1) {
+                PrintLayout();
+                return 0;
+        }
+
+        if (argc == 2 && !strcmp(argv[1], "selftest")) {
+                SelfTestLayout();
+                SelfTestGuard();
+
+                printf("selftest: %u checks, %u failures\n", checks, failures);
+                return failures ? 1 : 0;
+        }
+
+        fprintf(stderr, "usage: %s\n", argv[0]);
+        fprintf(stderr, "       %s selftest\n", argv[0]);
+        return 1;
+}
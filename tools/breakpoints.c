@@ -0,0 +1,486 @@
+/*
+ * breakpoints - manages the hypervisor's EPT execute breakpoints and
+ * benchmarks the index behind them.
+ *
+ * Every page holding a breakpoint is made non executable, so every
+ * instruction fetched from it exits and has to be looked up in the breakpoint
+ * index (see hv/bpindex.h) before it can be counted or stepped over.
+ *
+ * "bench" builds the driver's bpindex.c as is against a synthetic set of
+ * breakpoints and times a mix of lookups that hit, that land on a breakpoint
+ * page but miss, and that land on no breakpoint page at all. Every lookup is
+ * checked against a linear scan of the breakpoints, and the time per lookup
+ * of both is reported. Runs on Linux or Windows.
+ *
+ * On Windows, "set" and "clear" add and remove a breakpoint on a kernel
+ * virtual address, with "freeze" making every hit stop the other cores (see
+ * tools/freeze.c) and "trace" making it start a step trace (see
+ * tools/steptrace.c), "condition" compiles an expression (see condcompile.h)
+ * and attaches it to a breakpoint, or removes its condition if none is given,
+ * and "list" prints every breakpoint with its counts.
+ *
+ *   cc -O2 -I../hv -o breakpoints breakpoints.c condcompile.c ../hv/cond.c \
+ *       ../hv/bpindex.c
+ *
+ * usage: breakpoints bench [breakpoints] [pages] [lookups]
+ *        breakpoints set <address> [freeze] [trace]
+ *        breakpoints clear <address>
+ *        breakpoints condition <address> [expression]
+ *        breakpoints list
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bpindex.h"
+#include "ioctl.h"
+#include "condcompile.h"
+
+#ifdef _WIN32
+#        include <windows.h>
+#endif
+
+/* xorshift, the C library rand is too slow and too short on some platforms */
+static UINT64 random_state = 0x2545F4914F6CDD1Dull;
+
+static UINT64
+NextRandom(void)
+{
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        return random_state;
+}
+
+static double
+NowSeconds(void)
+{
+        return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static int
+CompareSites(const void* Left, const void* Right)
+{
+        const BP_INDEX_SITE* left  = Left;
+        const BP_INDEX_SITE* right = Right;
+
+        if (left->address != right->address)
+                return left->address < right->address ? -1 : 1;
+
+        return 0;
+}
+
+static UINT32
+LinearLookup(const BP_INDEX_SITE* Sites, UINT32 Count, UINT64 Address)
+{
+        for (UINT32 index = 0; index < Count; index++) {
+                if (Sites[index].address == Address)
+                        return Sites[index].id;
+        }
+
+        return BP_INDEX_MISS;
+}
+
+/*
+ * Breakpoints are spread over Pages random guest physical pages, below 512GB
+ * like the driver's, at random offsets. Returns the number of unique sites.
+ */
+static UINT32
+GenerateSites(PBP_INDEX_SITE Sites,
+              UINT32         Count,
+              UINT64*        Frames,
+              UINT32         Pages)
+{
+        UINT32 unique = 0;
+
+        for (UINT32 page = 0; page < Pages; page++)
+                Frames[page] = NextRandom() % (1ull << 27);
+
+        for (UINT32 site = 0; site < Count; site++) {
+                Sites[site].address =
+                    (Frames[site % Pages] << BP_INDEX_PAGE_SHIFT) |
+                    (NextRandom() & BP_INDEX_PAGE_MASK);
+                Sites[site].reserved = 0;
+        }
+
+        qsort(Sites, Count, sizeof(BP_INDEX_SITE), CompareSites);
+
+        for (UINT32 site = 0; site < Count; site++) {
+                if (unique && Sites[unique - 1].address == Sites[site].address)
+                        continue;
+
+                Sites[unique]    = Sites[site];
+                Sites[unique].id = unique;
+                unique++;
+        }
+
+        return unique;
+}
+
+/* half hit, a quarter miss on a breakpoint page and a quarter miss outright */
+static void
+GenerateLookups(UINT64*              Lookups,
+                UINT32               Count,
+                const BP_INDEX_SITE* Sites,
+                UINT32               SiteCount,
+                const UINT64*        Frames,
+                UINT32               Pages)
+{
+        for (UINT32 index = 0; index < Count; index++) {
+                switch (NextRandom() % 4) {
+                case 0:
+                case 1:
+                        Lookups[index] =
+                            Sites[NextRandom() % SiteCount].address;
+                        break;
+                case 2:
+                        Lookups[index] =
+                            (Frames[NextRandom() % Pages]
+                             << BP_INDEX_PAGE_SHIFT) |
+                            (NextRandom() & BP_INDEX_PAGE_MASK);
+                        break;
+                default: Lookups[index] = NextRandom() % (1ull << 39); break;
+                }
+        }
+}
+
+static int
+Bench(UINT32 Count, UINT32 Pages, UINT32 LookupCount)
+{
+        PBP_INDEX_SITE sites      = malloc(Count * sizeof(BP_INDEX_SITE));
+        PBP_INDEX_SITE build      = malloc(Count * sizeof(BP_INDEX_SITE));
+        UINT64*        frames     = malloc(Pages * sizeof(UINT64));
+        UINT64*        lookups    = malloc(LookupCount * sizeof(UINT64));
+        UINT32*        expected   = malloc(LookupCount * sizeof(UINT32));
+        VOID*          buffer     = NULL;
+        PBP_INDEX      index      = NULL;
+        UINT32         unique     = 0;
+        UINT32         hits       = 0;
+        UINT32         mismatches = 0;
+        UINT32         id         = 0;
+        double         start      = 0;
+        double         linear     = 0;
+        double         indexed    = 0;
+        int            status     = -1;
+
+        if (!sites || !build || !frames || !lookups || !expected)
+                goto end;
+
+        unique = GenerateSites(sites, Count, frames, Pages);
+        buffer = malloc(BpIndexSize(unique));
+
+        if (!buffer)
+                goto end;
+
+        /* BpIndexBuild sorts its input, keep our copy for the linear scan */
+        memcpy(build, sites, unique * sizeof(BP_INDEX_SITE));
+        index = BpIndexBuild(build, unique, buffer);
+
+        GenerateLookups(lookups, LookupCount, sites, unique, frames, Pages);
+
+        start = NowSeconds();
+
+        for (UINT32 lookup = 0; lookup < LookupCount; lookup++)
+                expected[lookup] =
+                    LinearLookup(sites, unique, lookups[lookup]);
+
+        linear = NowSeconds() - start;
+        start  = NowSeconds();
+
+        for (UINT32 lookup = 0; lookup < LookupCount; lookup++) {
+                id = BpIndexLookup(index, lookups[lookup]);
+
+                if (id != expected[lookup])
+                        mismatches++;
+
+                if (id != BP_INDEX_MISS)
+                        hits++;
+        }
+
+        indexed = NowSeconds() - start;
+
+        printf("breakpoints: %u breakpoints on %u pages, %u lookups, %u hits\n",
+               unique,
+               index->page_count,
+               LookupCount,
+               hits);
+        printf("  linear scan: %8.1f ns per lookup\n",
+               linear * 1e9 / LookupCount);
+        printf("  index:       %8.1f ns per lookup\n",
+               indexed * 1e9 / LookupCount);
+
+        if (mismatches) {
+                printf("breakpoints: FAILED, %u lookups disagree with the "
+                       "linear scan\n",
+                       mismatches);
+                goto end;
+        }
+
+        status = 0;
+
+end:
+        free(sites);
+        free(build);
+        free(frames);
+        free(lookups);
+        free(expected);
+        free(buffer);
+        return status;
+}
+
+#ifdef _WIN32
+static HANDLE
+OpenDevice(void)
+{
+        HANDLE device = CreateFileA(HV_DEVICE_PATH,
+                                    GENERIC_READ | GENERIC_WRITE,
+                                    0,
+                                    NULL,
+                                    OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL,
+                                    NULL);
+
+        if (device == INVALID_HANDLE_VALUE)
+                fprintf(stderr,
+                        "breakpoints: unable to open %s (%lu)\n",
+                        HV_DEVICE_PATH,
+                        GetLastError());
+
+        return device;
+}
+
+static int
+SetBreakpoint(UINT64 Address, BOOL Enable, UINT32 Flags)
+{
+        HV_BREAKPOINT_REQUEST request  = {0};
+        DWORD                 returned = 0;
+        HANDLE                device   = OpenDevice();
+
+        if (device == INVALID_HANDLE_VALUE)
+                return -1;
+
+        request.address = Address;
+        request.enable  = Enable;
+        request.flags   = Flags;
+
+        if (!DeviceIoControl(device,
+                             IOCTL_HV_SET_BREAKPOINT,
+                             &request,
+                             sizeof(request),
+                             NULL,
+                             0,
+                             &returned,
+                             NULL)) {
+                fprintf(stderr,
+                        "breakpoints: unable to %s %#llx (%lu)\n",
+                        Enable ? "set" : "clear",
+                        (unsigned long long)Address,
+                        GetLastError());
+                CloseHandle(device);
+                return -1;
+        }
+
+        CloseHandle(device);
+        return 0;
+}
+
+static int
+SetCondition(UINT64 Address, const char* Expression)
+{
+        HV_BREAKPOINT_CONDITION_REQUEST request  = {0};
+        CONDC_ERROR                     error    = {0};
+        DWORD                           returned = 0;
+        HANDLE                          device   = INVALID_HANDLE_VALUE;
+
+        request.address = Address;
+
+        if (Expression &&
+            CondCompile(Expression, &request.program, &error)) {
+                fprintf(stderr,
+                        "breakpoints: %s at offset %zu\n  %s\n  %*s^\n",
+                        error.message,
+                        error.position,
+                        Expression,
+                        (int)error.position,
+                        "");
+                return -1;
+        }
+
+        device = OpenDevice();
+
+        if (device == INVALID_HANDLE_VALUE)
+                return -1;
+
+        if (!DeviceIoControl(device,
+                             IOCTL_HV_SET_BREAKPOINT_CONDITION,
+                             &request,
+                             sizeof(request),
+                             NULL,
+                             0,
+                             &returned,
+                             NULL)) {
+                fprintf(stderr,
+                        "breakpoints: unable to set the condition of %#llx "
+                        "(%lu)\n",
+                        (unsigned long long)Address,
+                        GetLastError());
+                CloseHandle(device);
+                return -1;
+        }
+
+        CloseHandle(device);
+        return 0;
+}
+
+static const char*
+FlagNames(UINT32 Flags)
+{
+        switch (Flags) {
+        case 0: return "-";
+        case HV_BREAKPOINT_FLAG_FREEZE: return "freeze";
+        case HV_BREAKPOINT_FLAG_TRACE: return "trace";
+        default: return "freeze,trace";
+        }
+}
+
+static int
+ListBreakpoints(void)
+{
+        PHV_BREAKPOINTS response = NULL;
+        DWORD           size     = 0;
+        DWORD           returned = 0;
+        int             status   = -1;
+        HANDLE          device   = OpenDevice();
+
+        if (device == INVALID_HANDLE_VALUE)
+                return -1;
+
+        size     = (DWORD)HV_BREAKPOINTS_SIZE(HV_MAX_BREAKPOINTS);
+        response = malloc(size);
+
+        if (!response)
+                goto end;
+
+        if (!DeviceIoControl(device,
+                             IOCTL_HV_QUERY_BREAKPOINTS,
+                             NULL,
+                             0,
+                             response,
+                             size,
+                             &returned,
+                             NULL)) {
+                fprintf(stderr,
+                        "breakpoints: unable to query breakpoints (%lu)\n",
+                        GetLastError());
+                goto end;
+        }
+
+        printf("%u breakpoints, %llu instructions stepped\n",
+               response->breakpoint_count,
+               (unsigned long long)response->steps);
+        printf("%-20s %-14s %12s %12s %8s %s\n",
+               "address",
+               "physical",
+               "hits",
+               "misses",
+               "faults",
+               "flags");
+
+        /* a breakpoint without a condition never misses or faults */
+        for (UINT32 index = 0; index < response->breakpoint_count; index++) {
+                const HV_BREAKPOINT* breakpoint = &response->breakpoints[index];
+
+                printf("%#-20llx %#-14llx %12llu",
+                       (unsigned long long)breakpoint->address,
+                       (unsigned long long)breakpoint->physical,
+                       (unsigned long long)breakpoint->hits);
+
+                if (breakpoint->conditional)
+                        printf(" %12llu %8llu",
+                               (unsigned long long)breakpoint->misses,
+                               (unsigned long long)breakpoint->faults);
+                else
+                        printf(" %12s %8s", "-", "-");
+
+                printf(" %s\n", FlagNames(breakpoint->flags));
+        }
+
+        status = 0;
+
+end:
+        free(response);
+        CloseHandle(device);
+        return status;
+}
+#endif
+
+int
+main(int argc, char** argv)
+{
+        if (argc >= 2 && argc <= 5 && !strcmp(argv[1], "bench")) {
+                UINT32 count   = argc > 2 ? (UINT32)atoi(argv[2]) : 1024;
+                UINT32 pages   = argc > 3 ? (UINT32)atoi(argv[3]) : 64;
+                UINT32 lookups = argc > 4 ? (UINT32)atoi(argv[4]) : 200000;
+
+                if (!count || !pages || !lookups || pages > count) {
+                        fprintf(stderr,
+                                "breakpoints: need 0 < pages <= breakpoints "
+                                "and at least one lookup\n");
+                        return 1;
+                }
+
+                return Bench(count, pages, lookups) ? 1 : 0;
+        }
+
+#ifdef _WIN32
+        if (argc >= 3 && argc <= 5 && !strcmp(argv[1], "set")) {
+                UINT32 flags = 0;
+                int    index = 3;
+
+                for (; index < argc; index++) {
+                        if (!strcmp(argv[index], "freeze"))
+                                flags |= HV_BREAKPOINT_FLAG_FREEZE;
+                        else if (!strcmp(argv[index], "trace"))
+                                flags |= HV_BREAKPOINT_FLAG_TRACE;
+                        else
+                                break;
+                }
+
+                if (index == argc)
+                        return SetBreakpoint(
+                                   strtoull(argv[2], NULL, 0), TRUE, flags) ?
+                                   1 :
+                                   0;
+        }
+
+        if (argc == 3 && !strcmp(argv[1], "clear"))
+                return SetBreakpoint(strtoull(argv[2], NULL, 0), FALSE, 0) ?
+                           1 :
+                           0;
+
+        if ((argc == 3 || argc == 4) && !strcmp(argv[1], "condition"))
+                return SetCondition(strtoull(argv[2], NULL, 0),
+                                    argc == 4 ? argv[3] : NULL) ?
+                           1 :
+                           0;
+
+        if (argc == 2 && !strcmp(argv[1], "list"))
+                return ListBreakpoints() ? 1 : 0;
+#endif
+
+        fprintf(stderr,
+                "usage: %s bench [breakpoints] [pages] [lookups]\n",
+                argv[0]);
+#ifdef _WIN32
+        fprintf(stderr,
+                "       %s set <address> [freeze] [trace]\n",
+                argv[0]);
+        fprintf(stderr, "       %s clear <address>\n", argv[0]);
+        fprintf(stderr,
+                "       %s condition <address> [expression]\n",
+                argv[0]);
+        fprintf(stderr, "       %s list\n", argv[0]);
+#endif
+        return 1;
+}
@@ -0,0 +1,481 @@
+/*
+ * captemplate - runs CapBuildVmcsTemplate over captured capability msrs.
+ *
+ * Each dump in capdumps/ holds the msrs and cpuid bits CapInitialise reads on
+ * one processor, along with the template the driver is expected to build from
+ * them for a set of template flags. Given a dump, the template is printed for
+ * every combination of flags, in the same form the dumps record it.
+ *
+ * "selftest" builds the template for every combination of flags over each dump
+ * and checks that every control keeps the bits its capability msr requires
+ * and none it doesn't allow, that every feature the driver asks for is on
+ * exactly when both the flags and the processor allow it, and that the
+ * template matches what the dump expects.
+ *
+ * Builds with any C99 compiler on either Windows or Linux:
+ *
+ *   cc -O2 -I../hv -o captemplate captemplate.c ../hv/cap.c
+ *
+ * usage: captemplate <dump>
+ *        captemplate selftest <dump> [dump ...]
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cap.h"
+
+/* the CAP_TEMPLATE_ flags, named in bit order by flag_names */
+#define CAP_FLAG_COUNT        3
+#define CAP_FLAG_COMBINATIONS (1U << CAP_FLAG_COUNT)
+#define CAP_MAX_EXPECTED      CAP_FLAG_COMBINATIONS
+
+typedef struct _CAP_EXPECTED {
+        UINT32        flags;
+        VMCS_TEMPLATE template;
+
+} CAP_EXPECTED, *PCAP_EXPECTED;
+
+typedef struct _CAP_DUMP {
+        VMX_CAPABILITIES capabilities;
+        CAP_EXPECTED     expected[CAP_MAX_EXPECTED];
+        unsigned         expected_count;
+
+} CAP_DUMP, *PCAP_DUMP;
+
+typedef struct _CAP_FIELD {
+        const char* name;
+        size_t      offset;
+        size_t      size;
+
+} CAP_FIELD, *PCAP_FIELD;
+
+#define CAP_FIELD_ENTRY(Name, Member)                         \
+        {Name,                                                \
+         offsetof(VMX_CAPABILITIES, Member),                  \
+         sizeof(((VMX_CAPABILITIES*)0)->Member)}
+
+static const CAP_FIELD fields[] = {
+    CAP_FIELD_ENTRY("IA32_VMX_BASIC", basic),
+    CAP_FIELD_ENTRY("IA32_VMX_PINBASED_CTLS", pinbased_ctls),
+    CAP_FIELD_ENTRY("IA32_VMX_PROCBASED_CTLS", procbased_ctls),
+    CAP_FIELD_ENTRY("IA32_VMX_EXIT_CTLS", exit_ctls),
+    CAP_FIELD_ENTRY("IA32_VMX_ENTRY_CTLS", entry_ctls),
+    CAP_FIELD_ENTRY("IA32_VMX_MISC", misc),
+    CAP_FIELD_ENTRY("IA32_VMX_CR0_FIXED0", cr0_fixed0),
+    CAP_FIELD_ENTRY("IA32_VMX_CR0_FIXED1", cr0_fixed1),
+    CAP_FIELD_ENTRY("IA32_VMX_CR4_FIXED0", cr4_fixed0),
+    CAP_FIELD_ENTRY("IA32_VMX_CR4_FIXED1", cr4_fixed1),
+    CAP_FIELD_ENTRY("IA32_VMX_PROCBASED_CTLS2", procbased_ctls2),
+    CAP_FIELD_ENTRY("IA32_VMX_EPT_VPID_CAP", ept_vpid_cap),
+    CAP_FIELD_ENTRY("IA32_APIC_BASE", apic_base),
+    CAP_FIELD_ENTRY("CPUID_01_ECX", cpuid_01_ecx),
+    CAP_FIELD_ENTRY("CPUID_01_EDX", cpuid_01_edx),
+};
+
+static const char* flag_names[CAP_FLAG_COUNT] = {"apic", "ept", "nmi"};
+
+static unsigned    checks   = 0;
+static unsigned    failures = 0;
+static const char* current  = "";
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s: %s\n", current, What);
+        failures++;
+}
+
+/* "none", or the flag names joined by '+', as the dumps spell them */
+static void
+FormatFlags(char* Buffer, size_t Size, UINT32 Flags)
+{
+        Buffer[0] = '\0';
+
+        for (unsigned index = 0; index < CAP_FLAG_COUNT; index++) {
+                if (!(Flags & (1U << index)))
+                        continue;
+
+                if (Buffer[0])
+                        strncat(Buffer, "+", Size - strlen(Buffer) - 1);
+
+                strncat(Buffer, flag_names[index], Size - strlen(Buffer) - 1);
+        }
+
+        if (!Buffer[0])
+                snprintf(Buffer, Size, "none");
+}
+
+static int
+ParseFlags(const char* Text, UINT32* Flags)
+{
+        char  copy[64] = {0};
+        char* token    = NULL;
+
+        *Flags = 0;
+
+        if (!strcmp(Text, "none"))
+                return 1;
+
+        snprintf(copy, sizeof(copy), "%s", Text);
+
+        for (token = strtok(copy, "+"); token; token = strtok(NULL, "+")) {
+                unsigned index = 0;
+
+                while (index < CAP_FLAG_COUNT &&
+                       strcmp(token, flag_names[index]))
+                        index++;
+
+                if (index == CAP_FLAG_COUNT)
+                        return 0;
+
+                *Flags |= 1U << index;
+        }
+
+        return 1;
+}
+
+static int
+ParseExpected(const char* Line, PCAP_DUMP Dump)
+{
+        PCAP_EXPECTED      expected  = NULL;
+        char               flags[64] = {0};
+        unsigned int       pin       = 0;
+        unsigned int       proc      = 0;
+        unsigned int       proc2     = 0;
+        unsigned int       exits     = 0;
+        unsigned int       entry     = 0;
+        unsigned long long apic      = 0;
+
+        if (Dump->expected_count == CAP_MAX_EXPECTED)
+                return 0;
+
+        if (sscanf(Line,
+                   "expect %63s %x %x %x %x %x %llx",
+                   flags,
+                   &pin,
+                   &proc,
+                   &proc2,
+                   &exits,
+                   &entry,
+                   &apic) != 7)
+                return 0;
+
+        expected = &Dump->expected[Dump->expected_count];
+
+        if (!ParseFlags(flags, &expected->flags))
+                return 0;
+
+        expected->template.pin_ctls            = pin;
+        expected->template.proc_ctls           = proc;
+        expected->template.proc_ctls2          = proc2;
+        expected->template.exit_ctls           = exits;
+        expected->template.entry_ctls          = entry;
+        expected->template.apic_access_address = apic;
+
+        Dump->expected_count++;
+        return 1;
+}
+
+static int
+ParseField(const char* Line, PCAP_DUMP Dump)
+{
+        char               name[64] = {0};
+        unsigned long long value    = 0;
+        unsigned char*     base     = (unsigned char*)&Dump->capabilities;
+
+        if (sscanf(Line, "%63s %llx", name, &value) != 2)
+                return 0;
+
+        for (size_t index = 0; index < sizeof(fields) / sizeof(fields[0]);
+             index++) {
+                if (strcmp(name, fields[index].name))
+                        continue;
+
+                if (fields[index].size == sizeof(UINT32)) {
+                        UINT32 narrow = (UINT32)value;
+                        memcpy(base + fields[index].offset, &narrow, 4);
+                } else {
+                        memcpy(base + fields[index].offset, &value, 8);
+                }
+
+                return 1;
+        }
+
+        return 0;
+}
+
+/*
+ * One msr or expected template per line, '#' starts a comment. Returns 0 and
+ * names the line if anything can't be parsed.
+ */
+static int
+LoadDump(const char* Path, PCAP_DUMP Dump)
+{
+        FILE*    file      = fopen(Path, "r");
+        char     line[256] = {0};
+        unsigned number    = 0;
+
+        memset(Dump, 0, sizeof(CAP_DUMP));
+
+        if (!file) {
+                perror(Path);
+                return 0;
+        }
+
+        while (fgets(line, sizeof(line), file)) {
+                char* start = line + strspn(line, " \t");
+                int   ok    = 0;
+
+                number++;
+
+                if (*start == '#' || *start == '\n' || !*start)
+                        continue;
+
+                if (!strncmp(start, "expect ", 7))
+                        ok = ParseExpected(start, Dump);
+                else
+                        ok = ParseField(start, Dump);
+
+                if (!ok) {
+                        fprintf(stderr, "%s:%u: bad line\n", Path, number);
+                        fclose(file);
+                        return 0;
+                }
+        }
+
+        fclose(file);
+        return 1;
+}
+
+static int
+Allowed(UINT64 Capability, UINT32 Bit)
+{
+        return ((Capability >> 32) & Bit) != 0;
+}
+
+/* Bit is on in Control exactly when it was asked for and is allowed. */
+static int
+OnWhen(UINT32 Control, UINT64 Capability, UINT32 Bit, int Requested)
+{
+        int on = (Control & Bit) != 0;
+
+        if ((UINT32)Capability & Bit)
+                return on;
+
+        return on == (Requested && Allowed(Capability, Bit));
+}
+
+static int
+Respects(UINT32 Control, UINT64 Capability)
+{
+        return (Control & (UINT32)Capability) == (UINT32)Capability &&
+               !(Control & ~(UINT32)(Capability >> 32));
+}
+
+static void
+CheckTemplate(const VMX_CAPABILITIES* Capabilities, UINT32 Flags)
+{
+        VMCS_TEMPLATE template    = {0};
+        UINT64        proc2_cap   = Capabilities->procbased_ctls2;
+        UINT64        apic_page   = Capabilities->apic_base & ~0xFFFull;
+        int           apic        = 0;
+        int           xapic       = 0;
+        int           virtualised = 0;
+
+        /* stale values from a previous build must not leak through */
+        memset(&template, 0xA5, sizeof(template));
+        CapBuildVmcsTemplate(Capabilities, Flags, &template);
+
+        apic  = (Flags & CAP_TEMPLATE_APIC) && CapHasLocalApic(Capabilities);
+        xapic = apic && !CapIsX2ApicEnabled(Capabilities);
+
+        /* without the secondary controls their msr isn't even read */
+        if (!Allowed(Capabilities->procbased_ctls,
+                     IA32_VMX_PROCBASED_CTLS_ACTIVATE_SECONDARY_CONTROLS_FLAG))
+                proc2_cap = 0;
+
+        virtualised =
+            (template.proc_ctls2 &
+             IA32_VMX_PROCBASED_CTLS2_VIRTUALIZE_APIC_ACCESSES_FLAG) != 0;
+
+        Check(Respects(template.pin_ctls, Capabilities->pinbased_ctls),
+              "pin controls respect their capability msr");
+        Check(Respects(template.proc_ctls, Capabilities->procbased_ctls),
+              "processor controls respect their capability msr");
+        Check(Respects(template.proc_ctls2, proc2_cap),
+              "secondary controls respect their capability msr");
+        Check(Respects(template.exit_ctls, Capabilities->exit_ctls),
+              "exit controls respect their capability msr");
+        Check(Respects(template.entry_ctls, Capabilities->entry_ctls),
+              "entry controls respect their capability msr");
+
+        Check(OnWhen(template.pin_ctls,
+                     Capabilities->pinbased_ctls,
+                     IA32_VMX_PINBASED_CTLS_NMI_EXITING_FLAG,
+                     Flags & CAP_TEMPLATE_NMI),
+              "nmi exiting follows CAP_TEMPLATE_NMI");
+        Check(OnWhen(template.proc_ctls,
+                     Capabilities->procbased_ctls,
+                     IA32_VMX_PROCBASED_CTLS_ACTIVATE_SECONDARY_CONTROLS_FLAG,
+                     1),
+              "secondary controls are activated where allowed");
+        Check(OnWhen(template.proc_ctls,
+                     Capabilities->procbased_ctls,
+                     IA32_VMX_PROCBASED_CTLS_USE_MSR_BITMAPS_FLAG,
+                     1),
+              "msr bitmaps are used where allowed");
+        Check(OnWhen(template.proc_ctls,
+                     Capabilities->procbased_ctls,
+                     IA32_VMX_PROCBASED_CTLS_USE_TPR_SHADOW_FLAG,
+                     apic),
+              "the tpr shadow follows CAP_TEMPLATE_APIC");
+        Check(OnWhen(template.proc_ctls2,
+                     proc2_cap,
+                     IA32_VMX_PROCBASED_CTLS2_ENABLE_EPT_FLAG,
+                     Flags & CAP_TEMPLATE_EPT),
+              "ept follows CAP_TEMPLATE_EPT");
+        Check(OnWhen(template.proc_ctls2,
+                     proc2_cap,
+                     IA32_VMX_PROCBASED_CTLS2_ENABLE_RDTSCP_FLAG,
+                     1) &&
+                  OnWhen(template.proc_ctls2,
+                         proc2_cap,
+                         IA32_VMX_PROCBASED_CTLS2_ENABLE_INVPCID_FLAG,
+                         1) &&
+                  OnWhen(template.proc_ctls2,
+                         proc2_cap,
+                         IA32_VMX_PROCBASED_CTLS2_ENABLE_XSAVES_FLAG,
+                         1),
+              "rdtscp, invpcid and xsaves pass through where allowed");
+        Check(OnWhen(template.proc_ctls2,
+                     proc2_cap,
+                     IA32_VMX_PROCBASED_CTLS2_VIRTUALIZE_APIC_ACCESSES_FLAG,
+                     xapic),
+              "apic accesses are only virtualised in xapic mode");
+        Check(template.apic_access_address == (virtualised ? apic_page : 0),
+              "the apic access page is the apic base, only if used");
+
+        Check(template.exit_ctls &
+                  IA32_VMX_EXIT_CTLS_HOST_ADDRESS_SPACE_SIZE_FLAG,
+              "the host is 64 bit");
+        Check(template.entry_ctls & IA32_VMX_ENTRY_CTLS_IA32E_MODE_GUEST_FLAG,
+              "the guest is 64 bit");
+        Check(OnWhen(template.exit_ctls,
+                     Capabilities->exit_ctls,
+                     IA32_VMX_EXIT_CTLS_ACKNOWLEDGE_INTERRUPT_ON_EXIT_FLAG,
+                     1),
+              "interrupts are acknowledged on exit where allowed");
+        Check(OnWhen(template.exit_ctls,
+                     Capabilities->exit_ctls,
+                     IA32_VMX_EXIT_CTLS_SAVE_DEBUG_CONTROLS_FLAG,
+                     1) &&
+                  OnWhen(template.entry_ctls,
+                         Capabilities->entry_ctls,
+                         IA32_VMX_ENTRY_CTLS_LOAD_DEBUG_CONTROLS_FLAG,
+                         1),
+              "debug controls are saved and loaded where allowed");
+
+        Check(template.exception_bitmap == 1U << DivideError,
+              "only divide errors are intercepted");
+        Check(!template.cr0_guest_host_mask && !template.cr4_guest_host_mask,
+              "the guest owns all of cr0 and cr4");
+}
+
+static int
+SameTemplate(const VMCS_TEMPLATE* Left, const VMCS_TEMPLATE* Right)
+{
+        return Left->pin_ctls == Right->pin_ctls &&
+               Left->proc_ctls == Right->proc_ctls &&
+               Left->proc_ctls2 == Right->proc_ctls2 &&
+               Left->exit_ctls == Right->exit_ctls &&
+               Left->entry_ctls == Right->entry_ctls &&
+               Left->apic_access_address == Right->apic_access_address;
+}
+
+static void
+SelfTestDump(const char* Path)
+{
+        CAP_DUMP dump = {0};
+
+        current = Path;
+
+        if (!LoadDump(Path, &dump)) {
+                Check(0, "the dump loads");
+                return;
+        }
+
+        Check(dump.capabilities.basic && dump.capabilities.procbased_ctls,
+              "the dump holds the capability msrs");
+        Check(dump.expected_count, "the dump expects at least one template");
+
+        for (UINT32 flags = 0; flags < CAP_FLAG_COMBINATIONS; flags++)
+                CheckTemplate(&dump.capabilities, flags);
+
+        for (unsigned index = 0; index < dump.expected_count; index++) {
+                PCAP_EXPECTED expected = &dump.expected[index];
+                VMCS_TEMPLATE template = {0};
+
+                CapBuildVmcsTemplate(
+                    &dump.capabilities, expected->flags, &template);
+
+                Check(SameTemplate(&template, &expected->template),
+                      "the template matches the one the dump expects");
+        }
+}
+
+static int
+PrintTemplates(const char* Path)
+{
+        CAP_DUMP dump = {0};
+
+        if (!LoadDump(Path, &dump))
+                return 1;
+
+        printf("#      flags          pin      proc     proc2      exit     "
+               "entry  apic access\n");
+
+        for (UINT32 flags = 0; flags < CAP_FLAG_COMBINATIONS; flags++) {
+                VMCS_TEMPLATE template  = {0};
+                char          name[64] = {0};
+
+                CapBuildVmcsTemplate(&dump.capabilities, flags, &template);
+                FormatFlags(name, sizeof(name), flags);
+
+                printf("expect %-12s %08x %08x %08x %08x %08x %llx\n",
+                       name,
+                       template.pin_ctls,
+                       template.proc_ctls,
+                       template.proc_ctls2,
+                       template.exit_ctls,
+                       template.entry_ctls,
+                       (unsigned long long)template.apic_access_address);
+        }
+
+        return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+        if (argc == 2 && strcmp(argv[1], "selftest"))
+                return PrintTemplates(argv[1]);
+
+        if (argc > 2 && !strcmp(argv[1], "selftest")) {
+                for (int index = 2; index < argc; index++)
+                        SelfTestDump(argv[index]);
+
+                printf("selftest: %u checks, %u failures\n", checks, failures);
+                return failures ? 1 : 0;
+        }
+
+        fprintf(stderr, "usage: %s <dump>\n", argv[0]);
+        fprintf(stderr, "       %s selftest <dump> [dump ...]\n", argv[0]);
+        return 1;
+}
@@ -0,0 +1,389 @@
+/*
+ * condcompile - recursive descent compiler for breakpoint conditions, see
+ * condcompile.h.
+ */
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "condcompile.h"
+
+typedef struct _CONDC_PARSER {
+        const char*   source;
+        const char*   cursor;
+        PCOND_PROGRAM program;
+        PCONDC_ERROR  error;
+
+} CONDC_PARSER, *PCONDC_PARSER;
+
+typedef struct _CONDC_OPERATOR {
+        const char* token;
+        COND_OPCODE opcode;
+
+} CONDC_OPERATOR;
+
+static const char* register_names[COND_REGISTER_COUNT] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8",
+    "r9",  "r10", "r11", "r12", "r13", "r14", "r15", "rflags", "rip"};
+
+static const char* opcode_names[COND_OP_COUNT] = {
+    "const", "reg", "load", "add", "sub", "mul", "and",
+    "or",    "xor", "shl",  "shr", "eq",  "ne",  "lt",
+    "le",    "gt",  "ge",   "test", "jz", "jnz"};
+
+/*
+ * Binary operators from the loosest binding level to the tightest, below the
+ * short circuiting && and ||. Longer tokens come first within a level so that
+ * "<=" isn't taken for "<".
+ */
+static const CONDC_OPERATOR operator_levels[][4] = {
+    {{"|", COND_OP_OR}},
+    {{"^", COND_OP_XOR}},
+    {{"&", COND_OP_AND}},
+    {{"==", COND_OP_EQ}, {"!=", COND_OP_NE}},
+    {{"<=", COND_OP_LE},
+     {">=", COND_OP_GE},
+     {"<", COND_OP_LT},
+     {">", COND_OP_GT}},
+    {{"<<", COND_OP_SHL}, {">>", COND_OP_SHR}},
+    {{"+", COND_OP_ADD}, {"-", COND_OP_SUB}},
+    {{"*", COND_OP_MUL}}};
+
+#define CONDC_OPERATOR_LEVELS \
+        (sizeof(operator_levels) / sizeof(operator_levels[0]))
+
+static int
+Fail(PCONDC_PARSER Parser, const char* Message)
+{
+        Parser->error->position = (size_t)(Parser->cursor - Parser->source);
+        Parser->error->message  = Message;
+        return -1;
+}
+
+static void
+SkipSpace(PCONDC_PARSER Parser)
+{
+        while (isspace((unsigned char)*Parser->cursor))
+                Parser->cursor++;
+}
+
+/*
+ * Consumes Token if it is next. A single & or | must not be the start of &&
+ * or ||, and < or > must not be the start of a shift.
+ */
+static int
+Accept(PCONDC_PARSER Parser, const char* Token)
+{
+        size_t length = strlen(Token);
+
+        SkipSpace(Parser);
+
+        if (strncmp(Parser->cursor, Token, length))
+                return 0;
+
+        if (length == 1 && strchr("&|<>", Token[0]) &&
+            Parser->cursor[1] == Token[0])
+                return 0;
+
+        Parser->cursor += length;
+        return 1;
+}
+
+static int
+Emit(PCONDC_PARSER Parser, COND_OPCODE Opcode, UINT8 Operand, UINT64 Immediate)
+{
+        PCOND_PROGRAM     program     = Parser->program;
+        PCOND_INSTRUCTION instruction = NULL;
+        UINT32            count       = program->instruction_count;
+
+        if (count == COND_MAX_INSTRUCTIONS)
+                return Fail(Parser, "expression is too long");
+
+        instruction            = &program->instructions[count];
+        instruction->opcode    = (UINT8)Opcode;
+        instruction->operand   = Operand;
+        instruction->immediate = Immediate;
+        program->instruction_count++;
+        return 0;
+}
+
+/* makes the jump at Jump skip to the next instruction to be emitted */
+static void
+PatchJump(PCONDC_PARSER Parser, UINT32 Jump)
+{
+        Parser->program->instructions[Jump].immediate =
+            Parser->program->instruction_count - Jump - 1;
+}
+
+static int
+ParseOr(PCONDC_PARSER Parser);
+
+static int
+ParseUnary(PCONDC_PARSER Parser);
+
+static int
+ParseMemory(PCONDC_PARSER Parser, UINT8 Width)
+{
+        if (ParseOr(Parser))
+                return -1;
+
+        if (!Accept(Parser, "]"))
+                return Fail(Parser, "expected ]");
+
+        return Emit(Parser, COND_OP_LOAD, Width, 0);
+}
+
+static int
+ParseIdentifier(PCONDC_PARSER Parser)
+{
+        static const struct {
+                const char* name;
+                UINT8       width;
+        } widths[] = {{"byte", 1}, {"word", 2}, {"dword", 4}, {"qword", 8}};
+
+        const char* start  = Parser->cursor;
+        size_t      length = 0;
+
+        while (isalnum((unsigned char)Parser->cursor[length]))
+                length++;
+
+        for (UINT32 index = 0; index < COND_REGISTER_COUNT; index++) {
+                if (strlen(register_names[index]) == length &&
+                    !strncmp(start, register_names[index], length)) {
+                        Parser->cursor += length;
+                        return Emit(Parser, COND_OP_REGISTER, (UINT8)index, 0);
+                }
+        }
+
+        for (UINT32 index = 0; index < sizeof(widths) / sizeof(widths[0]);
+             index++) {
+                if (strlen(widths[index].name) == length &&
+                    !strncmp(start, widths[index].name, length)) {
+                        Parser->cursor += length;
+
+                        if (!Accept(Parser, "["))
+                                return Fail(Parser, "expected [");
+
+                        return ParseMemory(Parser, widths[index].width);
+                }
+        }
+
+        return Fail(Parser, "unknown register");
+}
+
+static int
+ParsePrimary(PCONDC_PARSER Parser)
+{
+        UINT64 value = 0;
+        char*  end   = NULL;
+
+        SkipSpace(Parser);
+
+        if (Accept(Parser, "(")) {
+                if (ParseOr(Parser))
+                        return -1;
+
+                return Accept(Parser, ")") ? 0 : Fail(Parser, "expected )");
+        }
+
+        if (Accept(Parser, "["))
+                return ParseMemory(Parser, 8);
+
+        if (isdigit((unsigned char)*Parser->cursor)) {
+                value = strtoull(Parser->cursor, &end, 0);
+
+                if (isalnum((unsigned char)*end))
+                        return Fail(Parser, "malformed number");
+
+                Parser->cursor = end;
+                return Emit(Parser, COND_OP_CONST, 0, value);
+        }
+
+        if (isalpha((unsigned char)*Parser->cursor))
+                return ParseIdentifier(Parser);
+
+        return Fail(Parser, "expected a value");
+}
+
+/* there are no unary opcodes, these are 0 - x, x ^ ~0 and x == 0 */
+static int
+ParseUnary(PCONDC_PARSER Parser)
+{
+        if (Accept(Parser, "-")) {
+                if (Emit(Parser, COND_OP_CONST, 0, 0) || ParseUnary(Parser))
+                        return -1;
+
+                return Emit(Parser, COND_OP_SUB, 0, 0);
+        }
+
+        if (Accept(Parser, "~")) {
+                if (ParseUnary(Parser) ||
+                    Emit(Parser, COND_OP_CONST, 0, ~0ull))
+                        return -1;
+
+                return Emit(Parser, COND_OP_XOR, 0, 0);
+        }
+
+        if (Accept(Parser, "!")) {
+                if (ParseUnary(Parser) || Emit(Parser, COND_OP_CONST, 0, 0))
+                        return -1;
+
+                return Emit(Parser, COND_OP_EQ, 0, 0);
+        }
+
+        return ParsePrimary(Parser);
+}
+
+static int
+ParseBinary(PCONDC_PARSER Parser, UINT32 Level)
+{
+        const CONDC_OPERATOR* operators = NULL;
+        COND_OPCODE           opcode    = COND_OP_COUNT;
+
+        if (Level == CONDC_OPERATOR_LEVELS)
+                return ParseUnary(Parser);
+
+        if (ParseBinary(Parser, Level + 1))
+                return -1;
+
+        operators = operator_levels[Level];
+
+        for (;;) {
+                opcode = COND_OP_COUNT;
+
+                for (UINT32 index = 0; index < 4 && operators[index].token;
+                     index++) {
+                        if (Accept(Parser, operators[index].token)) {
+                                opcode = operators[index].opcode;
+                                break;
+                        }
+                }
+
+                if (opcode == COND_OP_COUNT)
+                        return 0;
+
+                if (ParseBinary(Parser, Level + 1) ||
+                    Emit(Parser, opcode, 0, 0))
+                        return -1;
+        }
+}
+
+static int
+ParseAnd(PCONDC_PARSER Parser)
+{
+        UINT32 jump = 0;
+
+        if (ParseBinary(Parser, 0))
+                return -1;
+
+        while (Accept(Parser, "&&")) {
+                jump = Parser->program->instruction_count;
+
+                if (Emit(Parser, COND_OP_JZ, 0, 0) || ParseBinary(Parser, 0) ||
+                    Emit(Parser, COND_OP_TEST, 0, 0))
+                        return -1;
+
+                PatchJump(Parser, jump);
+        }
+
+        return 0;
+}
+
+static int
+ParseOr(PCONDC_PARSER Parser)
+{
+        UINT32 jump = 0;
+
+        if (ParseAnd(Parser))
+                return -1;
+
+        while (Accept(Parser, "||")) {
+                if (Emit(Parser, COND_OP_TEST, 0, 0))
+                        return -1;
+
+                jump = Parser->program->instruction_count;
+
+                if (Emit(Parser, COND_OP_JNZ, 0, 0) || ParseAnd(Parser) ||
+                    Emit(Parser, COND_OP_TEST, 0, 0))
+                        return -1;
+
+                PatchJump(Parser, jump);
+        }
+
+        return 0;
+}
+
+int
+CondCompile(const char* Source, PCOND_PROGRAM Program, PCONDC_ERROR Error)
+{
+        CONDC_PARSER parser = {0};
+        INT32        failed = 0;
+
+        memset(Program, 0, sizeof(COND_PROGRAM));
+
+        parser.source  = Source;
+        parser.cursor  = Source;
+        parser.program = Program;
+        parser.error   = Error;
+
+        if (ParseOr(&parser))
+                return -1;
+
+        SkipSpace(&parser);
+
+        if (*parser.cursor)
+                return Fail(&parser, "unexpected input");
+
+        /* only the stack depth can still be wrong, which is our limit */
+        failed = CondVerify(Program);
+
+        if (failed >= 0)
+                return Fail(&parser, "expression nests too deeply");
+
+        return 0;
+}
+
+VOID
+CondPrintProgram(const COND_PROGRAM* Program, FILE* File)
+{
+        for (UINT32 pc = 0; pc < Program->instruction_count; pc++) {
+                const COND_INSTRUCTION* instruction =
+                    &Program->instructions[pc];
+                const char* name = opcode_names[instruction->opcode];
+                int         pad  = 7 - (int)strlen(name);
+
+                fprintf(File, "%4u  %s", pc, name);
+
+                switch (instruction->opcode) {
+                case COND_OP_CONST:
+                        fprintf(File,
+                                "%*s%#llx",
+                                pad,
+                                "",
+                                (unsigned long long)instruction->immediate);
+                        break;
+                case COND_OP_REGISTER:
+                        fprintf(File,
+                                "%*s%s",
+                                pad,
+                                "",
+                                register_names[instruction->operand]);
+                        break;
+                case COND_OP_LOAD:
+                        fprintf(File, "%*s%u", pad, "", instruction->operand);
+                        break;
+                case COND_OP_JZ:
+                case COND_OP_JNZ:
+                        fprintf(File,
+                                "%*s%llu",
+                                pad,
+                                "",
+                                (unsigned long long)(pc + 1 +
+                                                     instruction->immediate));
+                        break;
+                default: break;
+                }
+
+                fprintf(File, "\n");
+        }
+}
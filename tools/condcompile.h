@@ -0,0 +1,39 @@
+#ifndef CONDCOMPILE_H
+#define CONDCOMPILE_H
+
+/*
+ * condcompile - compiles breakpoint condition expressions to the bytecode run
+ * by hv/cond.c.
+ *
+ * The expression language is a subset of C over unsigned 64 bit values:
+ *
+ *   - numbers in decimal or 0x prefixed hex
+ *   - registers by name, rax to r15, rip and rflags
+ *   - memory as [expr] for a qword, or byte/word/dword/qword[expr]
+ *   - || && | ^ & == != < <= > >= << >> + - * and unary ! ~ -, with C's
+ *     precedence, and parentheses
+ *
+ * && and || short circuit, so "rdx && [rdx + 8] > 5" never reads address 8.
+ * Every comparison is unsigned.
+ *
+ *   cc -O2 -I../hv -I. -c condcompile.c ../hv/cond.c
+ */
+#include <stdio.h>
+
+#include "cond.h"
+
+typedef struct _CONDC_ERROR {
+        /* offset into the source */
+        size_t      position;
+        const char* message;
+
+} CONDC_ERROR, *PCONDC_ERROR;
+
+/* returns 0 on success, otherwise -1 with Error describing why */
+int
+CondCompile(const char* Source, PCOND_PROGRAM Program, PCONDC_ERROR Error);
+
+VOID
+CondPrintProgram(const COND_PROGRAM* Program, FILE* File);
+
+#endif
@@ -0,0 +1,634 @@
+/*
+ * condition - compiles, tests and benchmarks breakpoint conditions.
+ *
+ * A breakpoint can carry a condition (see hv/cond.h) that the driver evaluates
+ * in VMX root on every hit, so hits that don't match never leave the exit
+ * handler. Conditions are compiled from expressions by condcompile.c, and the
+ * driver's cond.c is built here as is.
+ *
+ * "compile" prints the program an expression compiles to. "selftest" checks
+ * the compiler and the interpreter against expressions with known values,
+ * checks that the verifier rejects malformed programs, and runs random
+ * programs that pass it through a bounds checked reference interpreter, which
+ * must agree with CondEvaluate and never leave the stack. "bench" reports the
+ * time per evaluation of a few typical conditions. Runs on Linux or Windows:
+ *
+ *   cc -O2 -I../hv -o condition condition.c condcompile.c ../hv/cond.c
+ *
+ * usage: condition compile <expression>
+ *        condition selftest
+ *        condition bench [evaluations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "condcompile.h"
+
+/* guest memory as seen by the tests, anything outside of it faults */
+#define TEST_MEMORY_BASE 0x10000ull
+#define TEST_MEMORY_SIZE 0x100
+
+static UINT8 test_memory[TEST_MEMORY_SIZE];
+
+/* xorshift, the C library rand is too slow and too short on some platforms */
+static UINT64 random_state = 0x2545F4914F6CDD1Dull;
+
+static UINT64
+NextRandom(void)
+{
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        return random_state;
+}
+
+static double
+NowSeconds(void)
+{
+        return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static BOOLEAN
+TestRead(VOID* Context, UINT64 Address, UINT32 Size, UINT64* Value)
+{
+        UINT64* reads = Context;
+
+        if (reads)
+                (*reads)++;
+
+        /* written so that no address can wrap around */
+        if (Address < TEST_MEMORY_BASE ||
+            Address - TEST_MEMORY_BASE > TEST_MEMORY_SIZE - Size)
+                return 0;
+
+        memcpy(Value, &test_memory[Address - TEST_MEMORY_BASE], Size);
+        return 1;
+}
+
+static void
+SeedRegisters(UINT64* Registers)
+{
+        for (UINT32 index = 0; index < COND_REGISTER_COUNT; index++)
+                Registers[index] = 0;
+
+        Registers[COND_REGISTER_RAX]    = 1;
+        Registers[COND_REGISTER_RCX]    = 0x1234;
+        Registers[COND_REGISTER_RDX]    = TEST_MEMORY_BASE + 0x10;
+        Registers[COND_REGISTER_RSP]    = 0xFFFFF80012345000ull;
+        Registers[COND_REGISTER_R15]    = 0xFFFFFFFFFFFFFFFFull;
+        Registers[COND_REGISTER_RFLAGS] = 0x246;
+        Registers[COND_REGISTER_RIP]    = 0xFFFFF80000401000ull;
+
+        memset(test_memory, 0, sizeof(test_memory));
+
+        /* [rdx + 8] is 7, and dword[rdx + 8] covers it and the byte after */
+        test_memory[0x18] = 7;
+        test_memory[0x19] = 0;
+        test_memory[0x1A] = 1;
+}
+
+typedef struct _KNOWN_ANSWER {
+        const char* expression;
+        COND_RESULT result;
+
+} KNOWN_ANSWER;
+
+static const KNOWN_ANSWER known_answers[] = {
+    {"rcx == 0x1234", COND_RESULT_TRUE},
+    {"rcx == 4660", COND_RESULT_TRUE},
+    {"rcx != 0x1234", COND_RESULT_FALSE},
+    {"rcx == 0x1234 && [rdx + 8] > 5", COND_RESULT_TRUE},
+    {"rcx == 0x1234 && byte[rdx + 8] > 7", COND_RESULT_FALSE},
+    /* the read of address 0 is never made */
+    {"rcx != 0x1234 && [0] > 5", COND_RESULT_FALSE},
+    {"rcx == 0x1234 || [0]", COND_RESULT_TRUE},
+    {"rdx && byte[rdx + 8] == 7", COND_RESULT_TRUE},
+    {"[0]", COND_RESULT_FAULT},
+    {"rcx == 0x1234 && [0]", COND_RESULT_FAULT},
+    {"[rdx + 0xF0]", COND_RESULT_FAULT},
+    {"byte[rdx + 8] == 7", COND_RESULT_TRUE},
+    {"word[rdx + 8] == 7", COND_RESULT_TRUE},
+    {"dword[rdx + 8] == 0x10007", COND_RESULT_TRUE},
+    {"qword[rdx + 8] == [rdx + 8]", COND_RESULT_TRUE},
+    {"[[rdx - 0x10 + 0x100 - 0x100] + 0]", COND_RESULT_FAULT},
+    {"1 + 2 * 3 == 7", COND_RESULT_TRUE},
+    {"(1 + 2) * 3 == 9", COND_RESULT_TRUE},
+    /* == binds tighter than &, as in C */
+    {"6 & 3 == 2", COND_RESULT_FALSE},
+    {"(6 & 3) == 2", COND_RESULT_TRUE},
+    {"1 | 2 ^ 3 & 4 == 3", COND_RESULT_TRUE},
+    {"1 << 4 == 16 && 256 >> 4 == 16", COND_RESULT_TRUE},
+    {"1 << 64 == 1", COND_RESULT_TRUE},
+    {"10 - 3 - 2 == 5", COND_RESULT_TRUE},
+    {"-1 == 0xFFFFFFFFFFFFFFFF && -1 == r15", COND_RESULT_TRUE},
+    {"~0 == -1 && ~rax == -2", COND_RESULT_TRUE},
+    {"!rax == 0 && !0 && !!rcx == 1", COND_RESULT_TRUE},
+    /* unsigned */
+    {"-1 > 0", COND_RESULT_TRUE},
+    {"rax > 0 && rax < 2 && rax >= 1 && rax <= 1", COND_RESULT_TRUE},
+    {"rax < 1 || rax > 1", COND_RESULT_FALSE},
+    {"rflags & 0x200 || rflags & 0x40", COND_RESULT_TRUE},
+    {"rsp >> 47 == 0x1FFFF && rip == 0xFFFFF80000401000", COND_RESULT_TRUE},
+    {"(rax || 0) + (0 || 0) + (rcx && rdx) == 2", COND_RESULT_TRUE},
+    {"r8 || r9 || r10 || r11 || r12 || r13 || r14", COND_RESULT_FALSE},
+    {"0", COND_RESULT_FALSE},
+    {"  rax\t", COND_RESULT_TRUE}};
+
+static const char* compile_errors[] = {
+    "",
+    "rzx == 1",
+    "(1",
+    "[rax",
+    "dword rax",
+    "1 +",
+    "1 2",
+    "12ab",
+    "rax === 1",
+    "rax & & 1",
+    "1 $ 2"};
+
+static int
+CheckKnownAnswers(void)
+{
+        COND_PROGRAM program                        = {0};
+        CONDC_ERROR  error                          = {0};
+        UINT64       registers[COND_REGISTER_COUNT] = {0};
+        COND_RESULT  result                         = COND_RESULT_FALSE;
+        int          failures                       = 0;
+
+        SeedRegisters(registers);
+
+        for (UINT32 index = 0;
+             index < sizeof(known_answers) / sizeof(known_answers[0]);
+             index++) {
+                const KNOWN_ANSWER* answer = &known_answers[index];
+
+                if (CondCompile(answer->expression, &program, &error)) {
+                        printf("FAILED: \"%s\" didn't compile, %s at %zu\n",
+                               answer->expression,
+                               error.message,
+                               error.position);
+                        failures++;
+                        continue;
+                }
+
+                result = CondEvaluate(&program, registers, TestRead, NULL);
+
+                if (result != answer->result) {
+                        printf("FAILED: \"%s\" evaluated to %d, expected %d\n",
+                               answer->expression,
+                               result,
+                               answer->result);
+                        CondPrintProgram(&program, stdout);
+                        failures++;
+                }
+        }
+
+        for (UINT32 index = 0;
+             index < sizeof(compile_errors) / sizeof(compile_errors[0]);
+             index++) {
+                if (!CondCompile(compile_errors[index], &program, &error)) {
+                        printf("FAILED: \"%s\" compiled\n",
+                               compile_errors[index]);
+                        failures++;
+                }
+        }
+
+        return failures;
+}
+
+/* the compiler has to refuse what the verifier would */
+static int
+CheckLimits(void)
+{
+        char         source[1024] = {0};
+        COND_PROGRAM program      = {0};
+        CONDC_ERROR  error        = {0};
+        int          failures     = 0;
+        size_t       length       = 0;
+
+        /* 1 + 1 + ... needs 2 instructions per term */
+        length = (size_t)snprintf(source, sizeof(source), "1");
+
+        for (UINT32 term = 0; term < COND_MAX_INSTRUCTIONS / 2; term++)
+                length += (size_t)snprintf(
+                    source + length, sizeof(source) - length, " + 1");
+
+        if (!CondCompile(source, &program, &error) ||
+            strcmp(error.message, "expression is too long")) {
+                printf("FAILED: %u terms compiled\n",
+                       COND_MAX_INSTRUCTIONS / 2 + 1);
+                failures++;
+        }
+
+        /* 1 + (1 + (... keeps one value per level on the stack */
+        length = 0;
+
+        for (UINT32 level = 0; level < COND_MAX_STACK; level++)
+                length += (size_t)snprintf(
+                    source + length, sizeof(source) - length, "1 + (");
+
+        length += (size_t)snprintf(
+            source + length, sizeof(source) - length, "1");
+
+        for (UINT32 level = 0; level < COND_MAX_STACK; level++)
+                length += (size_t)snprintf(
+                    source + length, sizeof(source) - length, ")");
+
+        if (!CondCompile(source, &program, &error) ||
+            strcmp(error.message, "expression nests too deeply")) {
+                printf("FAILED: %u levels of nesting compiled\n",
+                       COND_MAX_STACK + 1);
+                failures++;
+        }
+
+        return failures;
+}
+
+typedef struct _BAD_PROGRAM {
+        const char*      reason;
+        UINT32           count;
+        COND_INSTRUCTION instructions[4];
+
+} BAD_PROGRAM;
+
+#define OP(Opcode, Operand, Immediate) {(Opcode), (Operand), 0, 0, (Immediate)}
+
+static const BAD_PROGRAM bad_programs[] = {
+    {"empty", 0, {OP(COND_OP_CONST, 0, 0)}},
+    {"unknown opcode", 1, {OP(COND_OP_COUNT, 0, 0)}},
+    {"underflow", 2, {OP(COND_OP_CONST, 0, 0), OP(COND_OP_ADD, 0, 0)}},
+    {"two results", 2, {OP(COND_OP_CONST, 0, 0), OP(COND_OP_CONST, 0, 0)}},
+    /* not taken pops the only value */
+    {"no result", 2, {OP(COND_OP_CONST, 0, 0), OP(COND_OP_JZ, 0, 0)}},
+    {"register out of range",
+     1,
+     {OP(COND_OP_REGISTER, COND_REGISTER_COUNT, 0)}},
+    {"load width", 2, {OP(COND_OP_CONST, 0, 0), OP(COND_OP_LOAD, 3, 0)}},
+    {"reserved", 1, {{COND_OP_CONST, 0, 1, 0, 0}}},
+    {"operand on const", 1, {OP(COND_OP_CONST, 1, 0)}},
+    {"jump past the end",
+     3,
+     {OP(COND_OP_CONST, 0, 0),
+      OP(COND_OP_JZ, 0, 2),
+      OP(COND_OP_CONST, 0, 0)}},
+    /* taken leaves 1 value, not taken leaves 2 */
+    {"depth mismatch",
+     4,
+     {OP(COND_OP_CONST, 0, 0),
+      OP(COND_OP_JZ, 0, 2),
+      OP(COND_OP_CONST, 0, 0),
+      OP(COND_OP_CONST, 0, 0)}}};
+
+#undef OP
+
+static int
+CheckVerifier(void)
+{
+        COND_PROGRAM program  = {0};
+        int          failures = 0;
+
+        for (UINT32 index = 0;
+             index < sizeof(bad_programs) / sizeof(bad_programs[0]);
+             index++) {
+                memset(&program, 0, sizeof(program));
+                program.instruction_count = bad_programs[index].count;
+                memcpy(program.instructions,
+                       bad_programs[index].instructions,
+                       sizeof(bad_programs[index].instructions));
+
+                if (CondVerify(&program) < 0) {
+                        printf("FAILED: verifier accepted %s\n",
+                               bad_programs[index].reason);
+                        failures++;
+                }
+        }
+
+        /* COND_MAX_STACK + 1 constants, then enough adds to fold them */
+        memset(&program, 0, sizeof(program));
+
+        for (UINT32 index = 0; index <= COND_MAX_STACK; index++)
+                program.instructions[index].opcode = COND_OP_CONST;
+
+        for (UINT32 index = 0; index < COND_MAX_STACK; index++)
+                program.instructions[COND_MAX_STACK + 1 + index].opcode =
+                    COND_OP_ADD;
+
+        program.instruction_count = 2 * COND_MAX_STACK + 1;
+
+        if (CondVerify(&program) != COND_MAX_STACK) {
+                printf("FAILED: verifier accepted a stack overflow\n");
+                failures++;
+        }
+
+        return failures;
+}
+
+/*
+ * The reference interpreter checks every stack access and every jump, if the
+ * verifier lets through anything CondEvaluate would run off the end of its
+ * stack or program with, this catches it.
+ */
+static int
+ReferenceEvaluate(const COND_PROGRAM* Program,
+                  const UINT64*       Registers,
+                  COND_RESULT*        Result)
+{
+        UINT64 stack[COND_MAX_STACK] = {0};
+        UINT64 value                 = 0;
+        UINT64 right                 = 0;
+        int    top                   = 0;
+        UINT32 pc                    = 0;
+
+#define REFERENCE_NEED(Condition) \
+        do {                      \
+                if (!(Condition)) \
+                        return -1; \
+        } while (0)
+
+        while (pc < Program->instruction_count) {
+                const COND_INSTRUCTION* instruction =
+                    &Program->instructions[pc++];
+
+                switch (instruction->opcode) {
+                case COND_OP_CONST:
+                case COND_OP_REGISTER:
+                        REFERENCE_NEED(top < COND_MAX_STACK);
+                        stack[top++] = instruction->opcode == COND_OP_CONST ?
+                                           instruction->immediate :
+                                           Registers[instruction->operand];
+                        break;
+                case COND_OP_LOAD:
+                        REFERENCE_NEED(top >= 1);
+                        value = 0;
+
+                        if (!TestRead(NULL,
+                                      stack[top - 1],
+                                      instruction->operand,
+                                      &value)) {
+                                *Result = COND_RESULT_FAULT;
+                                return 0;
+                        }
+
+                        stack[top - 1] = value;
+                        break;
+                case COND_OP_TEST:
+                        REFERENCE_NEED(top >= 1);
+                        stack[top - 1] = !!stack[top - 1];
+                        break;
+                case COND_OP_JZ:
+                case COND_OP_JNZ:
+                        REFERENCE_NEED(top >= 1);
+
+                        if (!stack[top - 1] ==
+                            (instruction->opcode == COND_OP_JZ)) {
+                                REFERENCE_NEED(instruction->immediate <=
+                                               Program->instruction_count - pc);
+                                pc += (UINT32)instruction->immediate;
+                        }
+                        else {
+                                top--;
+                        }
+
+                        break;
+                default:
+                        REFERENCE_NEED(top >= 2);
+                        right = stack[--top];
+                        value = stack[top - 1];
+
+                        switch (instruction->opcode) {
+                        case COND_OP_ADD: value += right; break;
+                        case COND_OP_SUB: value -= right; break;
+                        case COND_OP_MUL: value *= right; break;
+                        case COND_OP_AND: value &= right; break;
+                        case COND_OP_OR: value |= right; break;
+                        case COND_OP_XOR: value ^= right; break;
+                        case COND_OP_SHL: value <<= right % 64; break;
+                        case COND_OP_SHR: value >>= right % 64; break;
+                        case COND_OP_EQ: value = value == right; break;
+                        case COND_OP_NE: value = value != right; break;
+                        case COND_OP_LT: value = value < right; break;
+                        case COND_OP_LE: value = value <= right; break;
+                        case COND_OP_GT: value = value > right; break;
+                        case COND_OP_GE: value = value >= right; break;
+                        default: return -1;
+                        }
+
+                        stack[top - 1] = value;
+                        break;
+                }
+        }
+
+#undef REFERENCE_NEED
+
+        if (top != 1)
+                return -1;
+
+        *Result = stack[0] ? COND_RESULT_TRUE : COND_RESULT_FALSE;
+        return 0;
+}
+
+/* mostly pushes early on and mostly pops later, so some programs verify */
+static void
+RandomProgram(PCOND_PROGRAM Program)
+{
+        UINT32 count = 1 + (UINT32)(NextRandom() % 12);
+
+        memset(Program, 0, sizeof(COND_PROGRAM));
+        Program->instruction_count = count;
+
+        for (UINT32 pc = 0; pc < count; pc++) {
+                PCOND_INSTRUCTION instruction = &Program->instructions[pc];
+                UINT64            pick        = NextRandom();
+
+                if (pc < count / 2 && pick % 3)
+                        instruction->opcode = (UINT8)(pick % 4 ?
+                                                          COND_OP_CONST :
+                                                          COND_OP_REGISTER);
+                else
+                        instruction->opcode = (UINT8)(pick % COND_OP_COUNT);
+
+                switch (instruction->opcode) {
+                case COND_OP_CONST:
+                        instruction->immediate =
+                            pick % 5 ? TEST_MEMORY_BASE + (pick >> 8) % 0x108 :
+                                       NextRandom();
+                        break;
+                case COND_OP_REGISTER:
+                        instruction->operand =
+                            (UINT8)((pick >> 8) % COND_REGISTER_COUNT);
+                        break;
+                case COND_OP_LOAD:
+                        instruction->operand = (UINT8)(1 << ((pick >> 8) % 4));
+                        break;
+                case COND_OP_JZ:
+                case COND_OP_JNZ:
+                        instruction->immediate = (pick >> 8) % 4;
+                        break;
+                default: break;
+                }
+        }
+}
+
+static int
+CheckRandomPrograms(UINT32 Count)
+{
+        COND_PROGRAM program                        = {0};
+        UINT64       registers[COND_REGISTER_COUNT] = {0};
+        COND_RESULT  expected                       = COND_RESULT_FALSE;
+        COND_RESULT  result                         = COND_RESULT_FALSE;
+        UINT32       verified                       = 0;
+        int          failures                       = 0;
+
+        SeedRegisters(registers);
+
+        for (UINT32 index = 0; index < Count && failures < 8; index++) {
+                RandomProgram(&program);
+
+                if (CondVerify(&program) >= 0)
+                        continue;
+
+                verified++;
+
+                if (ReferenceEvaluate(&program, registers, &expected)) {
+                        printf("FAILED: verified program left its bounds\n");
+                        CondPrintProgram(&program, stdout);
+                        failures++;
+                        continue;
+                }
+
+                result = CondEvaluate(&program, registers, TestRead, NULL);
+
+                if (result != expected) {
+                        printf("FAILED: random program evaluated to %d, "
+                               "expected %d\n",
+                               result,
+                               expected);
+                        CondPrintProgram(&program, stdout);
+                        failures++;
+                }
+        }
+
+        printf("condition: %u of %u random programs verified\n",
+               verified,
+               Count);
+
+        if (!verified) {
+                printf("FAILED: no random program verified\n");
+                failures++;
+        }
+
+        return failures;
+}
+
+static int
+SelfTest(void)
+{
+        int failures = 0;
+
+        failures += CheckKnownAnswers();
+        failures += CheckLimits();
+        failures += CheckVerifier();
+        failures += CheckRandomPrograms(1000000);
+
+        printf("condition: selftest %s\n", failures ? "FAILED" : "passed");
+        return failures ? -1 : 0;
+}
+
+static const char* bench_expressions[] = {
+    "rcx == 0x1234",
+    "rcx == 0x1234 && [rdx + 8] > 5",
+    "rcx != 0x1234 && [rdx + 8] > 5",
+    "(rax & 0xFF) == 1 && (dword[rdx + 8] & 0xFFFF) == 7 && rsp > rdx"};
+
+static int
+Bench(UINT32 Evaluations)
+{
+        COND_PROGRAM program                        = {0};
+        CONDC_ERROR  error                          = {0};
+        UINT64       registers[COND_REGISTER_COUNT] = {0};
+        UINT64       reads                          = 0;
+        UINT64       matches                        = 0;
+        double       start                          = 0;
+        double       elapsed                        = 0;
+
+        SeedRegisters(registers);
+
+        for (UINT32 index = 0;
+             index < sizeof(bench_expressions) / sizeof(bench_expressions[0]);
+             index++) {
+                if (CondCompile(bench_expressions[index], &program, &error)) {
+                        printf("condition: \"%s\" didn't compile, %s at %zu\n",
+                               bench_expressions[index],
+                               error.message,
+                               error.position);
+                        return -1;
+                }
+
+                reads   = 0;
+                matches = 0;
+                start   = NowSeconds();
+
+                /* vary rcx so roughly half of the hits match */
+                for (UINT32 evaluation = 0; evaluation < Evaluations;
+                     evaluation++) {
+                        registers[COND_REGISTER_RCX] =
+                            0x1234 ^ (evaluation & 1);
+                        matches += CondEvaluate(&program,
+                                                registers,
+                                                TestRead,
+                                                &reads) == COND_RESULT_TRUE;
+                }
+
+                elapsed = NowSeconds() - start;
+
+                printf("%-66s %2u ops %6.1f ns, %3.0f%% match, %.2f reads\n",
+                       bench_expressions[index],
+                       program.instruction_count,
+                       elapsed * 1e9 / Evaluations,
+                       100.0 * matches / Evaluations,
+                       (double)reads / Evaluations);
+        }
+
+        return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+        COND_PROGRAM program = {0};
+        CONDC_ERROR  error   = {0};
+
+        if (argc == 2 && !strcmp(argv[1], "selftest"))
+                return SelfTest() ? 1 : 0;
+
+        if ((argc == 2 || argc == 3) && !strcmp(argv[1], "bench")) {
+                UINT32 evaluations =
+                    argc == 3 ? (UINT32)atoi(argv[2]) : 10000000;
+
+                return evaluations && !Bench(evaluations) ? 0 : 1;
+        }
+
+        if (argc == 3 && !strcmp(argv[1], "compile")) {
+                if (CondCompile(argv[2], &program, &error)) {
+                        fprintf(stderr,
+                                "condition: %s at offset %zu\n  %s\n  %*s^\n",
+                                error.message,
+                                error.position,
+                                argv[2],
+                                (int)error.position,
+                                "");
+                        return 1;
+                }
+
+                CondPrintProgram(&program, stdout);
+                return 0;
+        }
+
+        fprintf(stderr, "usage: %s compile <expression>\n", argv[0]);
+        fprintf(stderr, "       %s selftest\n", argv[0]);
+        fprintf(stderr, "       %s bench [evaluations]\n", argv[0]);
+        return 1;
+}
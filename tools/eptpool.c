@@ -0,0 +1,324 @@
+/*
+ * eptpool - user mode stress test for the EPT page pool.
+ *
+ * Builds the driver's mm.c as is against the user mode shims in mm.h, with
+ * the chunks taken from the heap and given made up physical addresses. A
+ * number of threads then allocate and free pages as the split and merge paths
+ * do, while two more play the watermark timer, each handing the refill to a
+ * worker thread whenever EptPoolBeginRefill says so, as the DPC does.
+ *
+ * Every page is checked to be handed to one thread at a time, to come back
+ * zeroed and to translate both ways, only one refill may ever be in flight,
+ * and once everything is freed the pool has to hold every page of every chunk
+ * exactly once.
+ *
+ * Linux only, as it is built around pthreads:
+ *
+ *   cc -O2 -pthread -mcx16 -I../hv -o eptpool eptpool.c ../hv/mm.c
+ *
+ * usage: eptpool [threads] [iterations per thread] [pages held per thread]
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm.h"
+
+/* far from anything the heap hands out, so a va is never taken for a pa */
+#define STRESS_PHYSICAL_BASE 0x4000000000ull
+#define STRESS_PAGE_COUNT    (EPT_POOL_MAX_CHUNKS * EPT_POOL_CHUNK_PAGE_COUNT)
+
+typedef struct _STRESS_CONTEXT {
+        unsigned long     iterations;
+        unsigned long     held;
+        volatile int      done;
+        pthread_barrier_t start;
+        /* set while a page is handed out, indexed by its page number */
+        volatile UINT8    owned[STRESS_PAGE_COUNT];
+        volatile LONG     refills_active;
+        volatile LONG     refills_overlapped;
+        volatile LONG     refills;
+        volatile LONG     chunks_added;
+        volatile LONG     double_allocations;
+        volatile LONG     stale_pages;
+        volatile LONG     bad_translations;
+        volatile LONG     empty;
+
+} STRESS_CONTEXT, *PSTRESS_CONTEXT;
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s\n", What);
+        failures++;
+}
+
+/* The same steps as EptPoolAddChunk, with the chunk taken from the heap. */
+static int
+AddChunk(void)
+{
+        static volatile LONG next  = 0;
+        LONG                 chunk = __atomic_fetch_add(&next, 1, 0);
+        size_t               size  = 0;
+        void*                va    = NULL;
+        PEPT_POOL_PAGE       pages = NULL;
+        UINT64               pa    = 0;
+
+        if (chunk >= EPT_POOL_MAX_CHUNKS)
+                return 0;
+
+        size  = EPT_POOL_CHUNK_PAGE_COUNT * sizeof(EPT_POOL_PAGE);
+        va    = aligned_alloc(PAGE_SIZE, EPT_POOL_CHUNK_SIZE);
+        pages = aligned_alloc(16, size);
+        pa    = STRESS_PHYSICAL_BASE + (UINT64)chunk * EPT_POOL_CHUNK_SIZE;
+
+        if (!va || !pages) {
+                free(va);
+                free(pages);
+                return 0;
+        }
+
+        memset(va, 0, EPT_POOL_CHUNK_SIZE);
+        return EptPoolAddPages((UINT64)va, pa, pages);
+}
+
+static unsigned long
+PageNumber(PEPT_POOL_PAGE Page)
+{
+        return (Page->pa - STRESS_PHYSICAL_BASE) >> PAGE_SHIFT;
+}
+
+/* As EptPoolRefillWorker does, minus the event EptPoolFree waits on. */
+static void*
+RefillThread(void* Argument)
+{
+        PSTRESS_CONTEXT context = Argument;
+
+        if (__atomic_add_fetch(&context->refills_active, 1, 0) != 1)
+                __atomic_add_fetch(&context->refills_overlapped, 1, 0);
+
+        __atomic_add_fetch(&context->refills, 1, 0);
+
+        while (EptPoolFreeCount() < EPT_POOL_LOW_WATERMARK) {
+                if (!AddChunk())
+                        break;
+
+                __atomic_add_fetch(&context->chunks_added, 1, 0);
+        }
+
+        __atomic_sub_fetch(&context->refills_active, 1, 0);
+        EptPoolEndRefill();
+        return NULL;
+}
+
+/* As EptPoolWatermarkDpcRoutine does on every expiry of the timer. */
+static void*
+TimerThread(void* Argument)
+{
+        PSTRESS_CONTEXT context = Argument;
+        pthread_t       worker  = {0};
+
+        pthread_barrier_wait(&context->start);
+
+        while (!context->done) {
+                if (EptPoolBeginRefill()) {
+                        if (pthread_create(
+                                &worker, NULL, RefillThread, context)) {
+                                EptPoolEndRefill();
+                                continue;
+                        }
+
+                        pthread_detach(worker);
+                }
+
+                usleep(100);
+        }
+
+        return NULL;
+}
+
+static void
+CheckPage(PSTRESS_CONTEXT Context, PEPT_POOL_PAGE Page)
+{
+        const UINT64* entries = (const UINT64*)Page->va;
+        unsigned long number  = PageNumber(Page);
+
+        if (__atomic_exchange_n(&Context->owned[number], 1, 0))
+                __atomic_add_fetch(&Context->double_allocations, 1, 0);
+
+        for (unsigned entry = 0; entry < PAGE_SIZE / sizeof(UINT64); entry++) {
+                if (entries[entry]) {
+                        __atomic_add_fetch(&Context->stale_pages, 1, 0);
+                        break;
+                }
+        }
+
+        if (EptPoolPageFromPhysical(Page->pa + 0x123) != Page ||
+            EptPoolPhysicalToVirtual(Page->pa + 0x123) != Page->va + 0x123)
+                __atomic_add_fetch(&Context->bad_translations, 1, 0);
+}
+
+static void*
+AllocateThread(void* Argument)
+{
+        PSTRESS_CONTEXT context = Argument;
+        PEPT_POOL_PAGE* held    = calloc(context->held, sizeof(*held));
+
+        if (!held)
+                return NULL;
+
+        pthread_barrier_wait(&context->start);
+
+        for (unsigned long index = 0; index < context->iterations; index++) {
+                unsigned long count = 1 + index % context->held;
+
+                for (unsigned long page = 0; page < count; page++) {
+                        held[page] = EptPoolAllocatePage();
+
+                        if (!held[page]) {
+                                __atomic_add_fetch(&context->empty, 1, 0);
+                                count = page;
+                                break;
+                        }
+
+                        CheckPage(context, held[page]);
+
+                        /* the page is now a page table, as a split fills it */
+                        memset((void*)held[page]->va, 0xEE, 64);
+                }
+
+                for (unsigned long page = 0; page < count; page++) {
+                        context->owned[PageNumber(held[page])] = 0;
+                        EptPoolFreePage(held[page]);
+                }
+        }
+
+        free(held);
+        return NULL;
+}
+
+/* The watermark on its own, without any other thread involved. */
+static void
+SelfTestWatermark(void)
+{
+        PEPT_POOL_PAGE pages[EPT_POOL_CHUNK_PAGE_COUNT] = {0};
+        LONG           count                            = 0;
+
+        EptPoolReset();
+
+        Check(EptPoolBeginRefill(), "an empty pool asks for a refill");
+        Check(!EptPoolBeginRefill(), "only one refill is ever in flight");
+        EptPoolEndRefill();
+
+        Check(AddChunk(), "a chunk can be added");
+        Check(EptPoolFreeCount() == EPT_POOL_CHUNK_PAGE_COUNT,
+              "every page of a chunk is free");
+        Check(!EptPoolBeginRefill(), "a pool above its watermark is left be");
+
+        /* drain down to one page short of the watermark */
+        while (EptPoolFreeCount() >= EPT_POOL_LOW_WATERMARK)
+                pages[count++] = EptPoolAllocatePage();
+
+        Check(EptPoolBeginRefill(), "dropping below the watermark refills");
+
+        while (count)
+                EptPoolFreePage(pages[--count]);
+
+        EptPoolEndRefill();
+
+        Check(EptPoolPageFromPhysical(STRESS_PHYSICAL_BASE - 1) == NULL &&
+                  EptPoolPhysicalToVirtual(STRESS_PHYSICAL_BASE +
+                                           EPT_POOL_MAX_CHUNKS *
+                                               EPT_POOL_CHUNK_SIZE) == 0,
+              "addresses outside the pool don't translate");
+}
+
+int
+main(int argc, char** argv)
+{
+        PSTRESS_CONTEXT context = calloc(1, sizeof(STRESS_CONTEXT));
+        unsigned long   count   = argc > 1 ? strtoul(argv[1], NULL, 0) : 8;
+        pthread_t*      threads = NULL;
+        pthread_t       timers[2];
+        LONG            free    = 0;
+        LONG            popped  = 0;
+        int             unique  = 1;
+
+        if (!context)
+                return 1;
+
+        context->iterations = argc > 2 ? strtoul(argv[2], NULL, 0) : 50000;
+        context->held       = argc > 3 ? strtoul(argv[3], NULL, 0) : 24;
+        threads             = calloc(count, sizeof(pthread_t));
+
+        if (!threads || !count || !context->held)
+                return 1;
+
+        SelfTestWatermark();
+
+        /* as EptPoolInitialise leaves it, on top of the chunk from above */
+        while (EptPoolFreeCount() <
+               EPT_POOL_INITIAL_CHUNKS * EPT_POOL_CHUNK_PAGE_COUNT)
+                AddChunk();
+
+        pthread_barrier_init(&context->start, NULL, count + 2);
+
+        for (unsigned long index = 0; index < count; index++)
+                pthread_create(&threads[index], NULL, AllocateThread, context);
+
+        for (unsigned long index = 0; index < 2; index++)
+                pthread_create(&timers[index], NULL, TimerThread, context);
+
+        for (unsigned long index = 0; index < count; index++)
+                pthread_join(threads[index], NULL);
+
+        context->done = 1;
+
+        for (unsigned long index = 0; index < 2; index++)
+                pthread_join(timers[index], NULL);
+
+        /* wait out a refill that was handed off as the timers stopped */
+        while (context->refills_active)
+                usleep(1000);
+
+        free = EptPoolFreeCount();
+
+        /* with everything returned, every page has to come back exactly once */
+        for (PEPT_POOL_PAGE page; (page = EptPoolAllocatePage()) != NULL;) {
+                unique &= !context->owned[PageNumber(page)]++;
+                popped++;
+        }
+
+        printf("stress: %lu threads, %ld refills adding %ld chunks, "
+               "%ld allocations found the pool empty\n",
+               count,
+               (long)context->refills,
+               (long)context->chunks_added,
+               (long)context->empty);
+
+        Check(!context->double_allocations,
+              "no page is handed to two threads at once");
+        Check(!context->stale_pages, "every allocated page is zeroed");
+        Check(!context->bad_translations,
+              "every allocated page translates both ways");
+        Check(!context->refills_overlapped, "refills never overlap");
+        Check(popped <= STRESS_PAGE_COUNT, "the pool stops at its chunk limit");
+        Check(popped == free && free % EPT_POOL_CHUNK_PAGE_COUNT == 0,
+              "the free count matches the free list");
+        Check(unique, "every page is on the free list exactly once");
+        Check(!EptPoolFreeCount(), "an emptied pool counts no free pages");
+
+        printf("selftest: %u checks, %u failures\n", checks, failures);
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,431 @@
+/*
+ * exitbench - guest side round trip cost of the exits we care about.
+ *
+ * Each operation is executed a large number of times from a thread pinned to
+ * a single core, timing every execution with lfence fenced tsc reads, and the
+ * distribution of cycles per operation is reported. The "none" operation
+ * times an empty pair of tsc reads and is the overhead included in every
+ * other row.
+ *
+ * cpuid and the hypervisor cpuid leaf are measured from user mode on every
+ * platform.
+ *
+ * On Windows with the driver loaded, every operation is also measured from
+ * kernel mode through IOCTL_HV_RUN_EXIT_BENCHMARK, which adds a
+ * VMX_HYPERCALL_PING vmcall, rdmsr and wrmsr of IA32_TSC_AUX, port io and cr8
+ * accesses.
+ *
+ * On Linux, which is where the exit costs of another hypervisor (i.e KVM) are
+ * taken as a baseline, a ping vmcall is issued from user mode and reported as
+ * unsupported if it faults. Port io is measured through ioperm and rdmsr
+ * through the msr device, so both need root and the latter includes the cost
+ * of the pread system call.
+ *
+ *   cc -O2 -I../hv -o exitbench exitbench.c
+ *
+ * usage: exitbench [-n iterations] [-c core]
+ */
+#ifndef _WIN32
+#        define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ioctl.h"
+
+#ifdef _WIN32
+#        include <windows.h>
+#        include <intrin.h>
+#else
+#        include <fcntl.h>
+#        include <sched.h>
+#        include <setjmp.h>
+#        include <signal.h>
+#        include <unistd.h>
+#        include <x86intrin.h>
+#        include <sys/io.h>
+#endif
+
+#define BENCH_DEFAULT_ITERATIONS 1000000
+#define BENCH_IO_PORT            0x80
+#define BENCH_HYPERVISOR_LEAF    0x40000000
+#define BENCH_VMCALL_PING        1
+#define BENCH_IA32_TSC_AUX       0xC0000103
+
+typedef struct _BENCH_RESULT {
+        UINT32* cycles;
+        size_t  count;
+
+} BENCH_RESULT, *PBENCH_RESULT;
+
+typedef void (*BENCH_OPERATION)(void);
+
+static volatile UINT64 sink;
+
+static inline void
+Cpuid(unsigned Leaf)
+{
+#ifdef _WIN32
+        int registers[4];
+
+        __cpuidex(registers, (int)Leaf, 0);
+        sink = (UINT64)registers[0];
+#else
+        unsigned eax = Leaf, ebx, ecx = 0, edx;
+
+        __asm__ __volatile__("cpuid"
+                             : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        sink = eax;
+#endif
+}
+
+static void
+OperationNone(void)
+{
+}
+
+static void
+OperationCpuid(void)
+{
+        Cpuid(0);
+}
+
+static void
+OperationCpuidHypervisor(void)
+{
+        Cpuid(BENCH_HYPERVISOR_LEAF);
+}
+
+#ifndef _WIN32
+/* same register convention as __vmx_vmcall in the driver */
+static void
+OperationVmcallPing(void)
+{
+        UINT64 rax = 0;
+
+        __asm__ __volatile__("vmcall"
+                             : "+a"(rax)
+                             : "c"((UINT64)BENCH_VMCALL_PING), "d"(0ull)
+                             : "r8", "r9", "memory");
+        sink = rax;
+}
+
+static void
+OperationPortIo(void)
+{
+        sink = inb(BENCH_IO_PORT);
+}
+
+static int msr_device = -1;
+
+static void
+OperationRdmsr(void)
+{
+        UINT64 value = 0;
+
+        if (pread(msr_device, &value, sizeof(value), BENCH_IA32_TSC_AUX) ==
+            sizeof(value))
+                sink = value;
+}
+
+static sigjmp_buf fault_jump;
+
+static void
+FaultHandler(int Signal)
+{
+        siglongjmp(fault_jump, Signal);
+}
+
+/* returns 0 if a single execution of the operation faults */
+static int
+Probe(BENCH_OPERATION Operation)
+{
+        struct sigaction action   = {0};
+        struct sigaction old_ill  = {0};
+        struct sigaction old_segv = {0};
+        int              faulted  = 0;
+
+        action.sa_handler = FaultHandler;
+        sigaction(SIGILL, &action, &old_ill);
+        sigaction(SIGSEGV, &action, &old_segv);
+
+        if (!sigsetjmp(fault_jump, 1))
+                Operation();
+        else
+                faulted = 1;
+
+        sigaction(SIGILL, &old_ill, NULL);
+        sigaction(SIGSEGV, &old_segv, NULL);
+        return !faulted;
+}
+#endif
+
+static int
+PinToCore(unsigned Core)
+{
+#ifdef _WIN32
+        return SetThreadAffinityMask(GetCurrentThread(), 1ull << Core) ? 0 :
+                                                                          -1;
+#else
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(Core, &set);
+        return sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+static int
+CompareCycles(const void* Left, const void* Right)
+{
+        UINT32 left  = *(const UINT32*)Left;
+        UINT32 right = *(const UINT32*)Right;
+
+        return left < right ? -1 : left > right;
+}
+
+/* nearest rank, Result->cycles must already be sorted */
+static UINT32
+Percentile(const BENCH_RESULT* Result, unsigned PerMille)
+{
+        size_t rank = (Result->count * PerMille + 999) / 1000;
+
+        return Result->cycles[rank ? rank - 1 : 0];
+}
+
+static void
+PrintHeader(const char* Title)
+{
+        printf("\n%s\n%-24s %10s %8s %8s %8s %8s %8s %8s\n",
+               Title,
+               "operation",
+               "samples",
+               "min",
+               "p50",
+               "p90",
+               "p99",
+               "p99.9",
+               "mean");
+}
+
+static void
+PrintResult(const char* Name, PBENCH_RESULT Result)
+{
+        UINT64 total = 0;
+
+        qsort(Result->cycles, Result->count, sizeof(UINT32), CompareCycles);
+
+        for (size_t index = 0; index < Result->count; index++)
+                total += Result->cycles[index];
+
+        printf("%-24s %10zu %8u %8u %8u %8u %8u %8llu\n",
+               Name,
+               Result->count,
+               Result->cycles[0],
+               Percentile(Result, 500),
+               Percentile(Result, 900),
+               Percentile(Result, 990),
+               Percentile(Result, 999),
+               (unsigned long long)(total / Result->count));
+}
+
+static void
+PrintUnsupported(const char* Name, const char* Reason)
+{
+        printf("%-24s unsupported (%s)\n", Name, Reason);
+}
+
+static void
+TimeOperation(BENCH_OPERATION Operation, PBENCH_RESULT Result)
+{
+        UINT64 start = 0;
+        UINT64 end   = 0;
+
+        /* warm up the caches and predictors before taking any samples */
+        for (size_t index = 0; index < Result->count / 100; index++)
+                Operation();
+
+        for (size_t index = 0; index < Result->count; index++) {
+                _mm_lfence();
+                start = __rdtsc();
+                _mm_lfence();
+                Operation();
+                _mm_lfence();
+                end = __rdtsc();
+
+                Result->cycles[index] = end - start > 0xFFFFFFFF ?
+                                            0xFFFFFFFF :
+                                            (UINT32)(end - start);
+        }
+}
+
+static void
+RunUserBenchmarks(PBENCH_RESULT Result, unsigned Core)
+{
+#ifndef _WIN32
+        char path[64];
+#endif
+
+        PrintHeader("user mode");
+
+        TimeOperation(OperationNone, Result);
+        PrintResult("none", Result);
+
+        TimeOperation(OperationCpuid, Result);
+        PrintResult("cpuid 0", Result);
+
+        TimeOperation(OperationCpuidHypervisor, Result);
+        PrintResult("cpuid 0x40000000", Result);
+
+#ifndef _WIN32
+        if (Probe(OperationVmcallPing)) {
+                TimeOperation(OperationVmcallPing, Result);
+                PrintResult("vmcall ping", Result);
+        }
+        else {
+                PrintUnsupported("vmcall ping", "faulted");
+        }
+
+        if (!ioperm(BENCH_IO_PORT, 1, 1)) {
+                TimeOperation(OperationPortIo, Result);
+                PrintResult("in 0x80", Result);
+        }
+        else {
+                PrintUnsupported("in 0x80", "ioperm failed, needs root");
+        }
+
+        snprintf(path, sizeof(path), "/dev/cpu/%u/msr", Core);
+        msr_device = open(path, O_RDONLY);
+
+        if (msr_device >= 0) {
+                TimeOperation(OperationRdmsr, Result);
+                PrintResult("rdmsr (msr device)", Result);
+                close(msr_device);
+        }
+        else {
+                PrintUnsupported("rdmsr (msr device)",
+                                 "needs root and the msr module");
+        }
+#else
+        UNREFERENCED_PARAMETER(Core);
+#endif
+}
+
+#ifdef _WIN32
+static const char* kernel_operation_names[] = {
+    "none",
+    "cpuid 0",
+    "cpuid 0x40000000",
+    "vmcall ping",
+    "rdmsr IA32_TSC_AUX",
+    "wrmsr IA32_TSC_AUX",
+    "in 0x80",
+    "mov from cr8",
+    "mov to cr8",
+};
+
+static void
+RunKernelBenchmarks(PBENCH_RESULT Result)
+{
+        HV_EXIT_BENCHMARK_REQUEST request  = {0};
+        DWORD                     returned = 0;
+        DWORD                     chunk    = 0;
+        HANDLE                    device   = CreateFileA(HV_DEVICE_PATH,
+                                     GENERIC_READ | GENERIC_WRITE,
+                                     0,
+                                     NULL,
+                                     OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL,
+                                     NULL);
+
+        if (device == INVALID_HANDLE_VALUE) {
+                printf("\nkernel mode: unable to open %s (%lu), skipped\n",
+                       HV_DEVICE_PATH,
+                       GetLastError());
+                return;
+        }
+
+        PrintHeader("kernel mode");
+
+        for (UINT32 operation = 0;
+             operation < HV_EXIT_BENCHMARK_OPERATION_COUNT;
+             operation++) {
+                size_t taken = 0;
+
+                request.operation = operation;
+
+                /* each call returns at most HV_EXIT_BENCHMARK_MAX_SAMPLES */
+                while (taken < Result->count) {
+                        chunk = (DWORD)min(Result->count - taken,
+                                           HV_EXIT_BENCHMARK_MAX_SAMPLES);
+
+                        if (!DeviceIoControl(device,
+                                             IOCTL_HV_RUN_EXIT_BENCHMARK,
+                                             &request,
+                                             sizeof(request),
+                                             Result->cycles + taken,
+                                             chunk * sizeof(UINT32),
+                                             &returned,
+                                             NULL))
+                                break;
+
+                        taken += returned / sizeof(UINT32);
+                }
+
+                if (taken < Result->count) {
+                        PrintUnsupported(kernel_operation_names[operation],
+                                         "rejected by the driver");
+                        continue;
+                }
+
+                PrintResult(kernel_operation_names[operation], Result);
+        }
+
+        CloseHandle(device);
+}
+#endif
+
+int
+main(int argc, char** argv)
+{
+        BENCH_RESULT result     = {0};
+        unsigned     core       = 0;
+        size_t       iterations = BENCH_DEFAULT_ITERATIONS;
+
+        for (int index = 1; index < argc; index++) {
+                if (!strcmp(argv[index], "-n") && index + 1 < argc)
+                        iterations = strtoul(argv[++index], NULL, 0);
+                else if (!strcmp(argv[index], "-c") && index + 1 < argc)
+                        core = (unsigned)strtoul(argv[++index], NULL, 0);
+                else {
+                        fprintf(stderr,
+                                "usage: %s [-n iterations] [-c core]\n",
+                                argv[0]);
+                        return 1;
+                }
+        }
+
+        if (!iterations || PinToCore(core)) {
+                fprintf(stderr, "exitbench: unable to pin to core %u\n", core);
+                return 1;
+        }
+
+        result.count  = iterations;
+        result.cycles = malloc(iterations * sizeof(UINT32));
+
+        if (!result.cycles)
+                return 1;
+
+        printf("exitbench: %zu iterations on core %u, cycles are tsc ticks\n",
+               iterations,
+               core);
+
+        RunUserBenchmarks(&result, core);
+#ifdef _WIN32
+        RunKernelBenchmarks(&result);
+#endif
+
+        free(result.cycles);
+        return 0;
+}
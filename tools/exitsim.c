@@ -0,0 +1,619 @@
+/*
+ * exitsim - drives vm-exits through the driver's own VmExitDispatcher.
+ *
+ * The driver is built whole in user mode (see hv/ntshim.h and ntsim.h), with
+ * the vmcs, msrs and cpuid leaves held by hwsim. Each exit is set up the way
+ * the processor would leave it, the exit reason, qualification and
+ * instruction length in the vmcs and the guest's registers in a
+ * GUEST_CONTEXT, exactly as VmExitHandler hands them over.
+ *
+ * "selftest" checks what each handler does to the guest: the registers it
+ * returns, the vmcs fields it writes, whether the guest rip is advanced past
+ * the instruction, the events it injects and the bugchecks it raises.
+ *
+ * "bench" runs each exit a number of times and prints the time the
+ * dispatcher took in ns per exit, along with the vmreads and vmwrites each
+ * exit cost. The time is only for comparing two builds on the same machine,
+ * the vmcs accesses are deterministic and are checked against what each exit
+ * is known to cost, so an extra vmread on the exit path fails the run.
+ *
+ * Linux only, see the exitsim target in CMakeLists.txt:
+ *
+ *   cmake -S .. -B build && cmake --build build --target exitsim
+ *
+ * usage: exitsim selftest
+ *        exitsim bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dispatch.h"
+#include "log.h"
+#include "topology.h"
+#include "hwsim.h"
+#include "ntsim.h"
+
+#define SIM_CORES           4
+#define SIM_CORE            2
+#define SIM_GUEST_RIP       0xFFFFF80012340000ull
+#define SIM_KERNEL_CS       0x10
+#define SIM_USER_CS         0x33
+#define SIM_HYPERVISOR_LEAF 0x40000000
+#define SIM_CORES_LEAF      0x40000001
+
+/* the bugcheck codes the dispatcher raises, see dispatch.c */
+#define SIM_BUGCHECK_INVALID_MTF_EXIT     0x0
+#define SIM_BUGCHECK_EPT_MISCONFIGURATION 0x2
+
+#define SIM_BENCH_ITERATIONS 1000000
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s\n", What);
+        failures++;
+}
+
+/* One vcpu, as AllocateVcpuArena and the vmcs setup leave it. */
+static PVIRTUAL_MACHINE_STATE
+SimInitialise(void)
+{
+        PVIRTUAL_MACHINE_STATE vcpu = NULL;
+        size_t                 size = 0;
+
+        HwSimReset();
+        NtSimReset();
+        NtSimSetProcessorCount(SIM_CORES);
+
+        if (!NT_SUCCESS(TopologyInitialise()))
+                return NULL;
+
+        size      = SIM_CORES * sizeof(VIRTUAL_MACHINE_STATE);
+        vmm_state = aligned_alloc(SYSTEM_CACHE_ALIGNMENT_SIZE, size);
+
+        if (!vmm_state)
+                return NULL;
+
+        memset(vmm_state, 0, size);
+
+        vcpu                  = &vmm_state[SIM_CORE];
+        vcpu->cold.index      = SIM_CORE;
+        vcpu->virtual_apic_va = (UINT64)aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+        vcpu->cold.log_state.ring =
+            TraceRingAllocate(VMX_LOG_RING_CAPACITY,
+                              sizeof(TRACE_RECORD),
+                              SIM_CORE,
+                              VMX_LOG_BUFFER_POOL_TAG);
+
+        if (!vcpu->virtual_apic_va || !vcpu->cold.log_state.ring)
+                return NULL;
+
+        memset((PVOID)vcpu->virtual_apic_va, 0, PAGE_SIZE);
+        HwSimSetProcessor(0, SIM_CORE);
+
+        VmcsControlsInvalidate(&vcpu->controls, &vcpu->cold.committed_controls);
+        VmcsControlsFlush(&vcpu->controls, &vcpu->cold.committed_controls);
+
+        HwSimSetVmcsField(VMCS_GUEST_CS_SELECTOR, SIM_KERNEL_CS);
+        HwSimSetVmcsField(VMCS_GUEST_RIP, SIM_GUEST_RIP);
+        return vcpu;
+}
+
+static void
+SimFree(PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        if (Vcpu) {
+                TraceRingFree(Vcpu->cold.log_state.ring,
+                              VMX_LOG_BUFFER_POOL_TAG);
+                free((PVOID)Vcpu->virtual_apic_va);
+        }
+
+        free(vmm_state);
+        vmm_state = NULL;
+}
+
+/* As the processor leaves the vmcs on a vm-exit. */
+static void
+SimExit(UINT32 Reason, UINT64 Qualification, UINT32 Length)
+{
+        UINT64 intr  = VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD;
+        UINT64 valid = VMENTRY_INTERRUPT_INFORMATION_VALID_FLAG;
+
+        HwSimSetVmcsField(intr, HwSimGetVmcsField(intr) & ~valid);
+        HwSimSetVmcsField(VMCS_EXIT_REASON, Reason);
+        HwSimSetVmcsField(VMCS_EXIT_QUALIFICATION, Qualification);
+        HwSimSetVmcsField(VMCS_VMEXIT_INSTRUCTION_LENGTH, Length);
+}
+
+/* Returns whether the guest rip moved on by exactly Length. */
+static int
+SimDispatch(PVIRTUAL_MACHINE_STATE Vcpu,
+            PGUEST_CONTEXT         Context,
+            UINT32                 Length)
+{
+        UINT64 rip = HwSimGetVmcsField(VMCS_GUEST_RIP);
+
+        VmExitDispatcher(Vcpu, Context);
+
+        return HwSimGetVmcsField(VMCS_GUEST_RIP) == rip + Length;
+}
+
+static UINT32
+SimInjected(void)
+{
+        return (UINT32)HwSimGetVmcsField(
+            VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD);
+}
+
+static UINT32
+SimEvent(UINT32 Vector, UINT32 Type)
+{
+        return VMENTRY_INTERRUPT_INFORMATION_VALID_FLAG | Type << 8 | Vector;
+}
+
+/* The code of the bugcheck the exit raised, or -1 if it returned. */
+static long
+SimDispatchBugCheck(PVIRTUAL_MACHINE_STATE Vcpu, PGUEST_CONTEXT Context)
+{
+        jmp_buf        target;
+        NTSIM_BUGCHECK bugcheck = {0};
+
+        if (setjmp(target)) {
+                NtSimGetBugCheck(&bugcheck);
+                return bugcheck.code;
+        }
+
+        NtSimExpectBugCheck(&target);
+        VmExitDispatcher(Vcpu, Context);
+        NtSimExpectBugCheck(NULL);
+        return -1;
+}
+
+static void
+SelfTestCpuid(PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        GUEST_CONTEXT      context = {0};
+        INT32              leaf[4] = {0x806F8, 0x1800800, 0x7FFAFBBF, 0};
+        PTRACE_RING_HEADER ring    = Vcpu->cold.log_state.ring;
+        PTRACE_RECORD      record  = NULL;
+        UINT64             logged  = 0;
+
+        HwSimSetCpuid(1, 0, leaf);
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_CPUID, 0, 2);
+        context.rax = 1;
+        context.rbx = 0xAAAA;
+        Check(SimDispatch(Vcpu, &context, 2),
+              "cpuid advances the guest rip past the instruction");
+        Check(context.rax == (UINT32)leaf[0] &&
+                  context.rbx == (UINT32)leaf[1] &&
+                  context.rcx == (UINT32)leaf[2] && !context.rdx,
+              "cpuid returns the leaf the processor reports");
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_CPUID, 0, 2);
+        context.rax = SIM_HYPERVISOR_LEAF;
+        SimDispatch(Vcpu, &context, 2);
+        Check(context.rax == 'i' && context.rbx == 'evol' &&
+                  context.rcx == 'trof' && context.rdx == 'etin',
+              "the hypervisor leaf returns our vendor");
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_CPUID, 0, 2);
+        context.rax = SIM_CORES_LEAF;
+        SimDispatch(Vcpu, &context, 2);
+        Check(context.rax == SIM_CORE && context.rcx == SIM_CORES,
+              "the cores leaf returns this vcpu's index and the core count");
+
+        /* anything else in our range is logged and returns the last leaf */
+        logged = ring->head;
+        SimExit(VMX_EXIT_REASON_EXECUTE_CPUID, 0, 2);
+        context.rax = SIM_HYPERVISOR_LEAF + 0x80;
+        Check(SimDispatch(Vcpu, &context, 2) && ring->head == logged + 1,
+              "an unknown hypervisor leaf is logged");
+
+        record = (PTRACE_RECORD)TRACE_RING_RECORD(ring, logged);
+        Check(record->format_id == TRACE_INVALID_HV_CPUID_FUNCTION,
+              "with the invalid leaf format");
+}
+
+static void
+SelfTestMsr(PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        GUEST_CONTEXT context = {0};
+
+        HwSimSetMsr(IA32_TSC_AUX, 0x1122334455667788ull);
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_RDMSR, 0, 2);
+        context.rcx = IA32_TSC_AUX;
+        Check(SimDispatch(Vcpu, &context, 2),
+              "rdmsr advances the guest rip");
+        Check(context.rax == 0x55667788 && context.rdx == 0x11223344,
+              "rdmsr splits the msr across edx:eax");
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_WRMSR, 0, 2);
+        context.rcx = IA32_TSC_AUX;
+        context.rax = 0xCAFEF00D;
+        context.rdx = 0x7;
+        Check(SimDispatch(Vcpu, &context, 2),
+              "wrmsr advances the guest rip");
+        Check(HwSimGetMsr(IA32_TSC_AUX) == 0x7CAFEF00Dull,
+              "wrmsr writes edx:eax to the msr");
+
+        /* only the kernel may touch an msr */
+        SimExit(VMX_EXIT_REASON_EXECUTE_RDMSR, 0, 2);
+        HwSimSetVmcsField(VMCS_GUEST_CS_SELECTOR, SIM_USER_CS);
+        context.rax = 0;
+        SimDispatch(Vcpu, &context, 2);
+        HwSimSetVmcsField(VMCS_GUEST_CS_SELECTOR, SIM_KERNEL_CS);
+        Check(SimInjected() == SimEvent(GeneralProtection, HardwareException),
+              "rdmsr from user mode injects a #GP");
+        Check(!context.rax, "and returns nothing");
+}
+
+static void
+SelfTestVmCall(PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        GUEST_CONTEXT context = {0};
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_VMCALL, 0, 3);
+        context.rax = 0xDEAD;
+        context.rcx = VMX_HYPERCALL_PING;
+        Check(SimDispatch(Vcpu, &context, 3), "vmcall advances the guest rip");
+        Check(context.rax == STATUS_SUCCESS, "a ping returns success");
+
+        /* without a sample ring the guest can't arm the preemption timer */
+        SimExit(VMX_EXIT_REASON_EXECUTE_VMCALL, 0, 3);
+        context.rcx = VMX_HYPERCALL_SET_SAMPLING;
+        context.rdx = 100000;
+        SimDispatch(Vcpu, &context, 3);
+        Check(context.rax == (UINT64)STATUS_INVALID_PARAMETER,
+              "sampling is refused on a core with no sample ring");
+
+        /* anything but a ping has to come from the kernel */
+        HwSimSetVmcsField(VMCS_GUEST_CS_SELECTOR, SIM_USER_CS);
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_VMCALL, 0, 3);
+        context.rcx = VMX_HYPERCALL_PING;
+        SimDispatch(Vcpu, &context, 3);
+        Check(context.rax == STATUS_SUCCESS, "user mode can ping");
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_VMCALL, 0, 3);
+        context.rcx = VMX_HYPERCALL_SET_SAMPLING;
+        context.rdx = 0;
+        SimDispatch(Vcpu, &context, 3);
+        Check(context.rax == (UINT64)STATUS_ACCESS_DENIED,
+              "user mode can't change sampling");
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_VMCALL, 0, 3);
+        context.rcx = VMX_HYPERCALL_FREEZE;
+        context.rdx = ~0ull;
+        SimDispatch(Vcpu, &context, 3);
+        Check(context.rax == (UINT64)STATUS_ACCESS_DENIED,
+              "user mode can't stop the world");
+
+        HwSimSetVmcsField(VMCS_GUEST_CS_SELECTOR, SIM_KERNEL_CS);
+}
+
+static void
+SelfTestControlRegisters(PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        GUEST_CONTEXT                 context       = {0};
+        VMX_EXIT_QUALIFICATION_MOV_CR qualification = {0};
+
+        /* mov cr3, rbx */
+        qualification.ControlRegister = VMX_EXIT_QUALIFICATION_REGISTER_CR3;
+        qualification.AccessType = VMX_EXIT_QUALIFICATION_ACCESS_MOV_TO_CR;
+        qualification.GeneralPurposeRegister =
+            VMX_EXIT_QUALIFICATION_GENREG_RBX;
+
+        SimExit(VMX_EXIT_REASON_MOV_CR, qualification.AsUInt, 3);
+        context.rbx = (1ull << 63) | 0x1AB000;
+        Check(SimDispatch(Vcpu, &context, 3), "mov to cr3 advances the rip");
+        Check(HwSimGetVmcsField(VMCS_GUEST_CR3) == 0x1AB000,
+              "mov to cr3 loads the guest cr3 without the no flush bit");
+
+        /* mov r9, cr3 */
+        qualification.AccessType = VMX_EXIT_QUALIFICATION_ACCESS_MOV_FROM_CR;
+        qualification.GeneralPurposeRegister =
+            VMX_EXIT_QUALIFICATION_GENREG_R9;
+
+        SimExit(VMX_EXIT_REASON_MOV_CR, qualification.AsUInt, 3);
+        Check(SimDispatch(Vcpu, &context, 3) && context.r9 == 0x1AB000,
+              "mov from cr3 returns the guest cr3");
+
+        /* clearing cr0.pg in long mode */
+        qualification.ControlRegister = VMX_EXIT_QUALIFICATION_REGISTER_CR0;
+        qualification.AccessType = VMX_EXIT_QUALIFICATION_ACCESS_MOV_TO_CR;
+        qualification.GeneralPurposeRegister =
+            VMX_EXIT_QUALIFICATION_GENREG_RAX;
+
+        HwSimSetVmcsField(VMCS_GUEST_CR0, 0x80050033);
+        SimExit(VMX_EXIT_REASON_MOV_CR, qualification.AsUInt, 3);
+        context.rax = 0x50033;
+        SimDispatch(Vcpu, &context, 3);
+        Check(SimInjected() == SimEvent(GeneralProtection, HardwareException),
+              "clearing cr0.pg injects a #GP");
+        Check(HwSimGetVmcsField(VMCS_GUEST_CR0) == 0x80050033,
+              "and leaves cr0 as it was");
+}
+
+static void
+SelfTestExceptions(PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        GUEST_CONTEXT                context = {0};
+        VMEXIT_INTERRUPT_INFORMATION intr    = {0};
+
+        /* a #DE is handed straight back to the guest */
+        intr.Vector           = EXCEPTION_DIVIDED_BY_ZERO;
+        intr.InterruptionType = HardwareException;
+        intr.Valid            = TRUE;
+
+        SimExit(VMX_EXIT_REASON_EXCEPTION_OR_NMI, 0, 2);
+        HwSimSetVmcsField(VMCS_VMEXIT_INTERRUPTION_INFORMATION, intr.AsUInt);
+        SimDispatch(Vcpu, &context, 2);
+        Check(SimInjected() ==
+                  SimEvent(EXCEPTION_DIVIDED_BY_ZERO, HardwareException),
+              "a #DE is reinjected");
+
+        /* anything else is a bugcheck */
+        intr.Vector = EXCEPTION_GP_FAULT;
+        SimExit(VMX_EXIT_REASON_EXCEPTION_OR_NMI, 0, 2);
+        HwSimSetVmcsField(VMCS_VMEXIT_INTERRUPTION_INFORMATION, intr.AsUInt);
+        Check(SimDispatchBugCheck(Vcpu, &context) ==
+                  (ULONG)STATUS_NOT_IMPLEMENTED,
+              "an unhandled exception bugchecks");
+}
+
+static void
+SelfTestTraps(PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        GUEST_CONTEXT context = {0};
+        UINT32        mtf     = IA32_VMX_PROCBASED_CTLS_MONITOR_TRAP_FLAG_FLAG;
+        UINT64        rip     = 0;
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_INVD, 0, 2);
+        Check(SimDispatch(Vcpu, &context, 2), "invd advances the guest rip");
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_WBINVD, 0, 2);
+        Check(SimDispatch(Vcpu, &context, 2), "wbinvd advances the guest rip");
+
+        /* a pending debug trap left over from an injected event */
+        SimExit(VMX_EXIT_REASON_MONITOR_TRAP_FLAG, 0, 0);
+        context.rflags = RFLAGS_TRAP_FLAG_FLAG | RFLAGS_READ_AS_1_FLAG;
+        Check(SimDispatch(Vcpu, &context, 0),
+              "an mtf exit leaves the guest rip where it is");
+        Check(context.rflags == RFLAGS_READ_AS_1_FLAG,
+              "an mtf exit nobody asked for clears the trap flag");
+
+        SimExit(VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED, 0, 0);
+        Vcpu->cold.log_state.sample_ticks = 5000;
+        Check(SimDispatch(Vcpu, &context, 0),
+              "the preemption timer leaves the guest rip where it is");
+        Check(HwSimGetVmcsField(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE) == 5000,
+              "the preemption timer is rearmed");
+        Vcpu->cold.log_state.sample_ticks = 0;
+
+        /* neither of these can be the guest's doing */
+        rip = HwSimGetVmcsField(VMCS_GUEST_RIP);
+        SimExit(VMX_EXIT_REASON_EPT_MISCONFIGURATION, 0, 0);
+        Check(SimDispatchBugCheck(Vcpu, &context) ==
+                  SIM_BUGCHECK_EPT_MISCONFIGURATION,
+              "an ept misconfiguration bugchecks");
+
+        VmcsControlSet(&Vcpu->controls, VMCS_CONTROL_PROC_CTLS, mtf);
+        VmcsControlsFlush(&Vcpu->controls, &Vcpu->cold.committed_controls);
+        SimExit(VMX_EXIT_REASON_MONITOR_TRAP_FLAG, 0, 0);
+        Check(SimDispatchBugCheck(Vcpu, &context) ==
+                  SIM_BUGCHECK_INVALID_MTF_EXIT,
+              "an mtf exit with the trap flag control set by nobody bugchecks");
+        Check(HwSimGetVmcsField(VMCS_GUEST_RIP) == rip,
+              "neither moves the guest rip");
+
+        VmcsControlClear(&Vcpu->controls, VMCS_CONTROL_PROC_CTLS, mtf);
+        VmcsControlsFlush(&Vcpu->controls, &Vcpu->cold.committed_controls);
+}
+
+/* VMX_HYPERCALL_TERMINATE_VMX hands the guest its own state back. */
+static void
+SelfTestTerminate(PVIRTUAL_MACHINE_STATE Vcpu)
+{
+        GUEST_CONTEXT context = {0};
+        BOOLEAN       exited  = FALSE;
+
+        HwSimSetVmcsField(VMCS_GUEST_RSP, 0xFFFFF80000AB0000ull);
+        HwSimSetVmcsField(VMCS_GUEST_CR3, 0x1AD000);
+        HwSimSetVmcsField(VMCS_GUEST_GS_BASE, 0xFFFFF80000CD0000ull);
+
+        SimExit(VMX_EXIT_REASON_EXECUTE_VMCALL, 0, 3);
+        context.rcx = VMX_HYPERCALL_TERMINATE_VMX;
+        exited      = VmExitDispatcher(Vcpu, &context);
+
+        Check(exited, "terminating leaves vmx operation");
+        Check(Vcpu->exit_state.guest_rip == HwSimGetVmcsField(VMCS_GUEST_RIP) &&
+                  Vcpu->exit_state.guest_rsp == 0xFFFFF80000AB0000ull,
+              "the guest resumes after the vmcall on its own stack");
+        Check(HwReadCr3() == 0x1AD000 &&
+                  HwSimGetMsr(IA32_GS_BASE) == 0xFFFFF80000CD0000ull,
+              "the guest's cr3 and gs base are loaded");
+
+        Vcpu->exit_state.exit_vmx = FALSE;
+}
+
+typedef struct _SIM_BENCH {
+        const char* name;
+        UINT32      reason;
+        UINT64      qualification;
+        UINT32      length;
+        UINT64      rax;
+        UINT64      rcx;
+        /* the vmcs accesses the exit is known to cost */
+        UINT64      vmreads;
+        UINT64      vmwrites;
+
+} SIM_BENCH, *PSIM_BENCH;
+
+/*
+ * Every exit reads the exit reason, then the rip and the instruction length
+ * to step over the instruction, which is a single vmwrite. Any other access
+ * is the handler's own.
+ */
+static const SIM_BENCH benches[] = {
+    {"cpuid", VMX_EXIT_REASON_EXECUTE_CPUID, 0, 2, 1, 0, 3, 1},
+    {"cpuid 0x40000000",
+     VMX_EXIT_REASON_EXECUTE_CPUID,
+     0,
+     2,
+     SIM_HYPERVISOR_LEAF,
+     0,
+     3,
+     1},
+    {"rdmsr", VMX_EXIT_REASON_EXECUTE_RDMSR, 0, 2, 0, IA32_TSC_AUX, 4, 1},
+    {"wrmsr", VMX_EXIT_REASON_EXECUTE_WRMSR, 0, 2, 0, IA32_TSC_AUX, 4, 1},
+    {"vmcall ping",
+     VMX_EXIT_REASON_EXECUTE_VMCALL,
+     0,
+     3,
+     0,
+     VMX_HYPERCALL_PING,
+     3,
+     1},
+    /* mov cr3, rcx */
+    {"mov to cr3", VMX_EXIT_REASON_MOV_CR, 0x103, 3, 0, 0x1AB000, 5, 2},
+    {"wbinvd", VMX_EXIT_REASON_EXECUTE_WBINVD, 0, 2, 0, 0, 3, 1},
+    {"preemption timer",
+     VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED,
+     0,
+     0,
+     0,
+     0,
+     1,
+     1},
+};
+
+static UINT64
+Nanoseconds(void)
+{
+        struct timespec now = {0};
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (UINT64)now.tv_sec * 1000000000ull + (UINT64)now.tv_nsec;
+}
+
+/*
+ * The guest context is put back before every exit, as most handlers write
+ * their results to it, so the time includes copying it.
+ */
+static int
+Bench(PVIRTUAL_MACHINE_STATE Vcpu, unsigned long Iterations)
+{
+        HWSIM_COUNTERS counters = {0};
+        GUEST_CONTEXT  initial  = {0};
+        GUEST_CONTEXT  context  = {0};
+        UINT64         start    = 0;
+        UINT64         elapsed  = 0;
+        int            expected = 1;
+
+        printf("%-18s %10s %8s %8s\n",
+               "exit",
+               "ns/exit",
+               "vmreads",
+               "vmwrites");
+
+        for (UINT32 index = 0; index < sizeof(benches) / sizeof(benches[0]);
+             index++) {
+                PSIM_BENCH bench = (PSIM_BENCH)&benches[index];
+
+                initial.rax = bench->rax;
+                initial.rcx = bench->rcx;
+
+                SimExit(bench->reason, bench->qualification, bench->length);
+                HwSimResetCounters();
+
+                start = Nanoseconds();
+
+                for (unsigned long count = 0; count < Iterations; count++) {
+                        context = initial;
+                        VmExitDispatcher(Vcpu, &context);
+                }
+
+                elapsed = Nanoseconds() - start;
+                HwSimGetCounters(&counters);
+
+                printf("%-18s %10.1f %8.2f %8.2f\n",
+                       bench->name,
+                       (double)elapsed / Iterations,
+                       (double)counters.vmreads / Iterations,
+                       (double)counters.vmwrites / Iterations);
+
+                if (counters.vmreads != bench->vmreads * Iterations ||
+                    counters.vmwrites != bench->vmwrites * Iterations) {
+                        printf("FAIL: %s costs %llu vmreads and %llu vmwrites "
+                               "rather than %llu and %llu\n",
+                               bench->name,
+                               counters.vmreads / Iterations,
+                               counters.vmwrites / Iterations,
+                               bench->vmreads,
+                               bench->vmwrites);
+                        expected = 0;
+                }
+        }
+
+        return expected ? 0 : 1;
+}
+
+int
+main(int argc, char** argv)
+{
+        PVIRTUAL_MACHINE_STATE vcpu       = NULL;
+        unsigned long          iterations = SIM_BENCH_ITERATIONS;
+        int                    result     = 1;
+
+        if (argc == 2 && !strcmp(argv[1], "selftest")) {
+                vcpu = SimInitialise();
+                Check(vcpu != NULL, "the simulated vcpu is set up");
+
+                if (vcpu) {
+                        SelfTestCpuid(vcpu);
+                        SelfTestMsr(vcpu);
+                        SelfTestVmCall(vcpu);
+                        SelfTestControlRegisters(vcpu);
+                        SelfTestExceptions(vcpu);
+                        SelfTestTraps(vcpu);
+                        SelfTestTerminate(vcpu);
+                }
+
+                SimFree(vcpu);
+
+                printf("selftest: %u checks, %u failures\n", checks, failures);
+                return failures ? 1 : 0;
+        }
+
+        if ((argc == 2 || argc == 3) && !strcmp(argv[1], "bench")) {
+                if (argc == 3)
+                        iterations = strtoul(argv[2], NULL, 0);
+
+                vcpu = SimInitialise();
+
+                if (!vcpu || !iterations) {
+                        SimFree(vcpu);
+                        return 1;
+                }
+
+                result = Bench(vcpu, iterations);
+                SimFree(vcpu);
+                return result;
+        }
+
+        fprintf(stderr, "usage: %s selftest\n", argv[0]);
+        fprintf(stderr, "       %s bench [iterations]\n", argv[0]);
+        return 1;
+}
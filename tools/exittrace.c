@@ -0,0 +1,1322 @@
+/*
+ * exittrace - records and summarises the hypervisor's per exit trace.
+ *
+ * While exit recording is enabled (IOCTL_HV_SET_EXIT_RECORDING) the driver
+ * writes an EXIT_TRACE_RECORD for every vm-exit to a per core ring, holding
+ * the exit reason, qualification, guest rip and gprs along with the number of
+ * cycles the dispatcher spent on it (see hv/trace.h).
+ *
+ * On Windows, "record" enables recording for the given number of seconds and
+ * drains every cores ring into a trace file. "report" reads one or more trace
+ * files on either Windows or Linux and prints the exit mix along with the
+ * p50 and p99 dispatch cycles of each exit reason, so the cost of a change to
+ * the dispatcher can be compared on a captured workload.
+ *
+ * "replay" feeds the recorded exits back through the driver's own
+ * VmExitDispatcher, built in user mode over hwsim and ntsim as exitsim is, and
+ * prints the dispatcher's throughput along with the p50 and p99 cycles and the
+ * vmreads and vmwrites per exit of each reason. The vmcs accesses come from
+ * the hwsim counters and don't depend on the machine, so a change to the
+ * dispatcher can be measured against a real workload's exit mix without
+ * loading it. Only the exit reason, qualification, instruction length, guest
+ * rip, rflags and gprs are in a record, everything else in the vmcs is left as
+ * the vcpu was set up, and every core's exits run on the one vcpu in the order
+ * they were drained. EPT violations aren't replayed as the breakpoint pages
+ * they were taken on aren't part of the trace, and an exit that bugchecks is
+ * counted rather than timed.
+ *
+ * Also on Windows, "hotspots" enables the exit profiler
+ * (IOCTL_HV_SET_EXIT_PROFILING) for the given number of seconds and prints
+ * the top exit causing instructions across every core. Each core only keeps a
+ * bounded number of counters, so a count may overestimate the true number of
+ * exits by up to its error column, see hv/sketch.h.
+ *
+ * "processes" does the same with cr3 accounting (IOCTL_HV_SET_CR3_ACCOUNTING)
+ * and prints the exits and root mode cycles of every address space, matched
+ * to a process through IOCTL_HV_QUERY_PROCESS_CR3 where possible. With kva
+ * shadowing, exits a process takes in user mode show up as an unknown cr3.
+ *
+ *   cc -O2 -I../hv -o exittrace exittrace.c
+ *
+ * which leaves out "replay" and its "selftest", only the exittrace target in
+ * CMakeLists.txt builds those, on Linux and linked with the driver:
+ *
+ *   cmake -S .. -B build && cmake --build build --target exittrace
+ *
+ * usage: exittrace record <trace file> <seconds>
+ *        exittrace report <trace file> [trace file ...]
+ *        exittrace replay <trace file> [trace file ...]
+ *        exittrace selftest
+ *        exittrace hotspots <seconds> [top n]
+ *        exittrace processes <seconds>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "ioctl.h"
+
+#ifdef _WIN32
+#        include <windows.h>
+#        include <tlhelp32.h>
+#endif
+
+#if defined(HWSIM)
+#        include <time.h>
+
+#        include "dispatch.h"
+#        include "log.h"
+#        include "topology.h"
+#        include "hwsim.h"
+#        include "ntsim.h"
+#endif
+
+#define EXIT_TRACE_FILE_MAGIC   0x54585648 /* HVXT */
+#define EXIT_TRACE_FILE_VERSION 1
+
+/* basic exit reasons are 16 bits, but none are defined past 0x44 */
+#define EXIT_REASON_COUNT 0x80
+
+/*
+ * A trace file is this header followed by any number of file records, in the
+ * order they were drained from the driver. Records of different cores are not
+ * interleaved by timestamp.
+ */
+typedef struct _EXIT_TRACE_FILE_HEADER {
+        UINT32 magic;
+        UINT16 version;
+        UINT16 record_size;
+        UINT32 core_count;
+        UINT32 reserved;
+
+} EXIT_TRACE_FILE_HEADER, *PEXIT_TRACE_FILE_HEADER;
+
+typedef struct _EXIT_TRACE_FILE_RECORD {
+        UINT32            core;
+        UINT32            reserved;
+        EXIT_TRACE_RECORD record;
+
+} EXIT_TRACE_FILE_RECORD, *PEXIT_TRACE_FILE_RECORD;
+
+typedef struct _EXIT_REASON_STATS {
+        UINT32* cycles;
+        size_t  count;
+        size_t  allocated;
+        UINT64  total;
+
+} EXIT_REASON_STATS, *PEXIT_REASON_STATS;
+
+static const char*
+ExitReasonName(UINT32 Reason)
+{
+        switch (Reason) {
+        case 0: return "EXCEPTION_OR_NMI";
+        case 1: return "EXTERNAL_INTERRUPT";
+        case 2: return "TRIPLE_FAULT";
+        case 7: return "INTERRUPT_WINDOW";
+        case 10: return "CPUID";
+        case 12: return "HLT";
+        case 13: return "INVD";
+        case 14: return "INVLPG";
+        case 16: return "RDTSC";
+        case 18: return "VMCALL";
+        case 28: return "MOV_CR";
+        case 29: return "MOV_DR";
+        case 30: return "IO_INSTRUCTION";
+        case 31: return "RDMSR";
+        case 32: return "WRMSR";
+        case 37: return "MONITOR_TRAP_FLAG";
+        case 43: return "TPR_BELOW_THRESHOLD";
+        case 44: return "APIC_ACCESS";
+        case 45: return "VIRTUALIZED_EOI";
+        case 48: return "EPT_VIOLATION";
+        case 49: return "EPT_MISCONFIGURATION";
+        case 51: return "RDTSCP";
+        case 52: return "PREEMPTION_TIMER";
+        case 54: return "WBINVD";
+        case 55: return "XSETBV";
+        case 58: return "INVPCID";
+        default: return "OTHER";
+        }
+}
+
+static int
+AppendCycles(PEXIT_REASON_STATS Stats, UINT32 Cycles)
+{
+        if (Stats->count == Stats->allocated) {
+                size_t  allocated = Stats->allocated ? Stats->allocated * 2 :
+                                                       1024;
+                UINT32* cycles    = realloc(Stats->cycles,
+                                         allocated * sizeof(UINT32));
+
+                if (!cycles)
+                        return -1;
+
+                Stats->cycles    = cycles;
+                Stats->allocated = allocated;
+        }
+
+        Stats->cycles[Stats->count++] = Cycles;
+        Stats->total += Cycles;
+        return 0;
+}
+
+static int
+CompareCycles(const void* Left, const void* Right)
+{
+        UINT32 left  = *(const UINT32*)Left;
+        UINT32 right = *(const UINT32*)Right;
+
+        return left < right ? -1 : left > right;
+}
+
+/* nearest rank, Stats->cycles must already be sorted */
+static UINT32
+Percentile(const EXIT_REASON_STATS* Stats, unsigned Percent)
+{
+        size_t rank = (Stats->count * Percent + 99) / 100;
+
+        return Stats->cycles[rank ? rank - 1 : 0];
+}
+
+static int
+ReadTraceHeader(FILE* File, const char* Path)
+{
+        EXIT_TRACE_FILE_HEADER header = {0};
+
+        if (fread(&header, sizeof(header), 1, File) != 1 ||
+            header.magic != EXIT_TRACE_FILE_MAGIC ||
+            header.version != EXIT_TRACE_FILE_VERSION ||
+            header.record_size != sizeof(EXIT_TRACE_RECORD)) {
+                fprintf(stderr, "exittrace: %s: invalid trace file\n", Path);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int
+LoadTraceFile(const char*        Path,
+              PEXIT_REASON_STATS Stats,
+              UINT64*            First,
+              UINT64*            Last)
+{
+        FILE*                  file   = fopen(Path, "rb");
+        EXIT_TRACE_FILE_RECORD entry  = {0};
+        UINT32                 reason = 0;
+
+        if (!file) {
+                fprintf(stderr, "exittrace: unable to open %s\n", Path);
+                return -1;
+        }
+
+        if (ReadTraceHeader(file, Path)) {
+                fclose(file);
+                return -1;
+        }
+
+        while (fread(&entry, sizeof(entry), 1, file) == 1) {
+                reason = entry.record.reason & 0xFFFF;
+
+                if (reason >= EXIT_REASON_COUNT)
+                        reason = EXIT_REASON_COUNT - 1;
+
+                if (AppendCycles(&Stats[reason], entry.record.cycles)) {
+                        fclose(file);
+                        return -1;
+                }
+
+                if (!*First || entry.record.timestamp < *First)
+                        *First = entry.record.timestamp;
+                if (entry.record.timestamp > *Last)
+                        *Last = entry.record.timestamp;
+        }
+
+        fclose(file);
+        return 0;
+}
+
+static int
+Report(int Count, char** Paths)
+{
+        EXIT_REASON_STATS stats[EXIT_REASON_COUNT] = {0};
+        UINT64            first                    = 0;
+        UINT64            last                     = 0;
+        UINT64            exits                    = 0;
+        UINT64            cycles                   = 0;
+
+        for (int index = 0; index < Count; index++) {
+                if (LoadTraceFile(Paths[index], stats, &first, &last))
+                        return -1;
+        }
+
+        for (UINT32 reason = 0; reason < EXIT_REASON_COUNT; reason++) {
+                exits += stats[reason].count;
+                cycles += stats[reason].total;
+        }
+
+        if (!exits) {
+                fprintf(stderr, "exittrace: no exits recorded\n");
+                return -1;
+        }
+
+        printf("%llu exits over %llu cycles, %llu dispatch cycles in total\n\n",
+               (unsigned long long)exits,
+               (unsigned long long)(last - first),
+               (unsigned long long)cycles);
+        printf("%-4s %-22s %10s %7s %8s %8s %8s\n",
+               "id",
+               "reason",
+               "count",
+               "share",
+               "mean",
+               "p50",
+               "p99");
+
+        for (UINT32 reason = 0; reason < EXIT_REASON_COUNT; reason++) {
+                PEXIT_REASON_STATS entry = &stats[reason];
+
+                if (!entry->count)
+                        continue;
+
+                qsort(entry->cycles,
+                      entry->count,
+                      sizeof(UINT32),
+                      CompareCycles);
+
+                printf("%-4u %-22s %10llu %6.2f%% %8llu %8u %8u\n",
+                       reason,
+                       ExitReasonName(reason),
+                       (unsigned long long)entry->count,
+                       100.0 * entry->count / exits,
+                       (unsigned long long)(entry->total / entry->count),
+                       Percentile(entry, 50),
+                       Percentile(entry, 99));
+
+                free(entry->cycles);
+        }
+
+        return 0;
+}
+
+#if defined(HWSIM)
+#        define REPLAY_CORES     4
+#        define REPLAY_CORE      2
+#        define REPLAY_KERNEL_CS 0x10
+#        define REPLAY_USER_CS   0x33
+
+typedef struct _REPLAY_STATE {
+        PVIRTUAL_MACHINE_STATE vcpu;
+        PVOID                  kpcr;
+        EXIT_REASON_STATS      stats[EXIT_REASON_COUNT];
+        UINT64                 vmreads[EXIT_REASON_COUNT];
+        UINT64                 vmwrites[EXIT_REASON_COUNT];
+        UINT64                 bugchecks[EXIT_REASON_COUNT];
+        UINT64                 skipped;
+
+} REPLAY_STATE, *PREPLAY_STATE;
+
+static UINT64
+Nanoseconds(void)
+{
+        struct timespec now = {0};
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (UINT64)now.tv_sec * 1000000000ull + (UINT64)now.tv_nsec;
+}
+
+/*
+ * One vcpu, as AllocateVcpuArena and the vmcs setup leave it. The guest's
+ * kpcr is a zeroed page, so io exits find no tss and every port is available.
+ */
+static int
+ReplayInitialise(PREPLAY_STATE State)
+{
+        PVIRTUAL_MACHINE_STATE vcpu = NULL;
+        size_t                 size = REPLAY_CORES * sizeof(*vcpu);
+
+        memset(State, 0, sizeof(*State));
+
+        HwSimReset();
+        NtSimReset();
+        NtSimSetProcessorCount(REPLAY_CORES);
+
+        if (!NT_SUCCESS(TopologyInitialise()))
+                return -1;
+
+        vmm_state   = aligned_alloc(SYSTEM_CACHE_ALIGNMENT_SIZE, size);
+        State->kpcr = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+
+        if (!vmm_state || !State->kpcr)
+                return -1;
+
+        memset(vmm_state, 0, size);
+        memset(State->kpcr, 0, PAGE_SIZE);
+
+        vcpu                  = &vmm_state[REPLAY_CORE];
+        vcpu->cold.index      = REPLAY_CORE;
+        vcpu->virtual_apic_va = (UINT64)aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+        vcpu->cold.log_state.ring =
+            TraceRingAllocate(VMX_LOG_RING_CAPACITY,
+                              sizeof(TRACE_RECORD),
+                              REPLAY_CORE,
+                              VMX_LOG_BUFFER_POOL_TAG);
+        State->vcpu = vcpu;
+
+        if (!vcpu->virtual_apic_va || !vcpu->cold.log_state.ring)
+                return -1;
+
+        memset((PVOID)vcpu->virtual_apic_va, 0, PAGE_SIZE);
+        HwSimSetProcessor(0, REPLAY_CORE);
+
+        VmcsControlsInvalidate(&vcpu->controls, &vcpu->cold.committed_controls);
+        VmcsControlsFlush(&vcpu->controls, &vcpu->cold.committed_controls);
+
+        HwSimSetVmcsField(VMCS_GUEST_GS_BASE, (UINT64)State->kpcr);
+        return 0;
+}
+
+static void
+ReplayFree(PREPLAY_STATE State)
+{
+        if (State->vcpu) {
+                TraceRingFree(State->vcpu->cold.log_state.ring,
+                              VMX_LOG_BUFFER_POOL_TAG);
+                free((PVOID)State->vcpu->virtual_apic_va);
+        }
+
+        for (UINT32 reason = 0; reason < EXIT_REASON_COUNT; reason++)
+                free(State->stats[reason].cycles);
+
+        free(State->kpcr);
+        free(vmm_state);
+        vmm_state = NULL;
+}
+
+/*
+ * Leaves the vmcs as the processor would have on the recorded exit, the cs
+ * selector going by which half of the address space the rip is in, and times
+ * the dispatcher on it. The counters are reset outside of the timed region.
+ */
+static int
+ReplayExit(PREPLAY_STATE State, const EXIT_TRACE_RECORD* Record)
+{
+        UINT32         reason   = Record->reason & 0xFFFF;
+        GUEST_CONTEXT  context  = {0};
+        HWSIM_COUNTERS counters = {0};
+        UINT64         start    = 0;
+        UINT64         cycles   = 0;
+        jmp_buf        target;
+
+        if (reason == VMX_EXIT_REASON_EPT_VIOLATION) {
+                State->skipped++;
+                return 0;
+        }
+
+        if (reason >= EXIT_REASON_COUNT)
+                reason = EXIT_REASON_COUNT - 1;
+
+        /* nothing is left pending for the entry from the exit before */
+        HwSimSetVmcsField(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, 0);
+        HwSimSetVmcsField(VMCS_EXIT_REASON, Record->reason);
+        HwSimSetVmcsField(VMCS_EXIT_QUALIFICATION, Record->qualification);
+        HwSimSetVmcsField(VMCS_VMEXIT_INSTRUCTION_LENGTH,
+                          Record->instruction_length);
+        HwSimSetVmcsField(VMCS_GUEST_RIP, Record->guest_rip);
+        HwSimSetVmcsField(VMCS_GUEST_RFLAGS, Record->guest_rflags);
+        HwSimSetVmcsField(VMCS_GUEST_CS_SELECTOR,
+                          (INT64)Record->guest_rip < 0 ? REPLAY_KERNEL_CS :
+                                                         REPLAY_USER_CS);
+
+        memcpy(&context.rax, Record->gprs, sizeof(Record->gprs));
+        context.rflags = Record->guest_rflags;
+
+        if (setjmp(target)) {
+                State->bugchecks[reason]++;
+                State->vcpu->exit_state.exit_vmx = FALSE;
+                return 0;
+        }
+
+        NtSimExpectBugCheck(&target);
+        HwSimResetCounters();
+
+        start = __rdtsc();
+        VmExitDispatcher(State->vcpu, &context);
+        cycles = __rdtsc() - start;
+
+        NtSimExpectBugCheck(NULL);
+        HwSimGetCounters(&counters);
+
+        /* a terminate hypercall doesn't get to leave vmx operation here */
+        State->vcpu->exit_state.exit_vmx = FALSE;
+        State->vmreads[reason] += counters.vmreads;
+        State->vmwrites[reason] += counters.vmwrites;
+
+        return AppendCycles(&State->stats[reason],
+                            cycles > UINT32_MAX ? UINT32_MAX : (UINT32)cycles);
+}
+
+/* File must already be past its header, see ReadTraceHeader. */
+static int
+ReplayFile(PREPLAY_STATE State, FILE* File)
+{
+        EXIT_TRACE_FILE_RECORD entry = {0};
+
+        while (fread(&entry, sizeof(entry), 1, File) == 1) {
+                if (ReplayExit(State, &entry.record))
+                        return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * The throughput is of the dispatcher alone, its cycles converted to time by
+ * the tsc rate measured across the whole replay.
+ */
+static int
+ReplayReport(PREPLAY_STATE State, UINT64 Elapsed, UINT64 Ticks)
+{
+        UINT64 exits     = 0;
+        UINT64 cycles    = 0;
+        UINT64 bugchecks = 0;
+        double dispatch  = 0;
+
+        for (UINT32 reason = 0; reason < EXIT_REASON_COUNT; reason++) {
+                exits += State->stats[reason].count;
+                cycles += State->stats[reason].total;
+                bugchecks += State->bugchecks[reason];
+        }
+
+        if (!exits) {
+                fprintf(stderr, "exittrace: no exits replayed\n");
+                return -1;
+        }
+
+        dispatch = Ticks ? (double)cycles * Elapsed / Ticks : 0;
+
+        printf("%llu exits replayed in %llu dispatch cycles, %.1f ns per exit, "
+               "%.0f exits/s\n",
+               (unsigned long long)exits,
+               (unsigned long long)cycles,
+               dispatch / exits,
+               dispatch ? exits * 1e9 / dispatch : 0);
+        printf("%llu ept violations skipped, %llu exits bugchecked\n\n",
+               (unsigned long long)State->skipped,
+               (unsigned long long)bugchecks);
+        printf("%-4s %-22s %10s %8s %8s %8s %8s %8s %9s\n",
+               "id",
+               "reason",
+               "count",
+               "mean",
+               "p50",
+               "p99",
+               "vmreads",
+               "vmwrites",
+               "bugchecks");
+
+        for (UINT32 reason = 0; reason < EXIT_REASON_COUNT; reason++) {
+                PEXIT_REASON_STATS entry = &State->stats[reason];
+
+                if (!entry->count && !State->bugchecks[reason])
+                        continue;
+
+                if (!entry->count) {
+                        printf("%-4u %-22s %10u %8s %8s %8s %8s %8s %9llu\n",
+                               reason,
+                               ExitReasonName(reason),
+                               0,
+                               "-",
+                               "-",
+                               "-",
+                               "-",
+                               "-",
+                               (unsigned long long)State->bugchecks[reason]);
+                        continue;
+                }
+
+                qsort(entry->cycles,
+                      entry->count,
+                      sizeof(UINT32),
+                      CompareCycles);
+
+                printf("%-4u %-22s %10llu %8llu %8u %8u %8.2f %8.2f %9llu\n",
+                       reason,
+                       ExitReasonName(reason),
+                       (unsigned long long)entry->count,
+                       (unsigned long long)(entry->total / entry->count),
+                       Percentile(entry, 50),
+                       Percentile(entry, 99),
+                       (double)State->vmreads[reason] / entry->count,
+                       (double)State->vmwrites[reason] / entry->count,
+                       (unsigned long long)State->bugchecks[reason]);
+        }
+
+        return 0;
+}
+
+static int
+Replay(int Count, char** Paths)
+{
+        REPLAY_STATE state  = {0};
+        FILE*        file   = NULL;
+        UINT64       start  = 0;
+        UINT64       ticks  = 0;
+        int          status = -1;
+
+        if (ReplayInitialise(&state))
+                goto end;
+
+        start = Nanoseconds();
+        ticks = __rdtsc();
+
+        for (int index = 0; index < Count; index++) {
+                file = fopen(Paths[index], "rb");
+
+                if (!file) {
+                        fprintf(stderr,
+                                "exittrace: unable to open %s\n",
+                                Paths[index]);
+                        goto end;
+                }
+
+                if (ReadTraceHeader(file, Paths[index]) ||
+                    ReplayFile(&state, file)) {
+                        fclose(file);
+                        goto end;
+                }
+
+                fclose(file);
+        }
+
+        ticks  = __rdtsc() - ticks;
+        status = ReplayReport(&state, Nanoseconds() - start, ticks);
+
+end:
+        ReplayFree(&state);
+        return status;
+}
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s\n", What);
+        failures++;
+}
+
+#        define REPLAY_KERNEL_RIP 0xFFFFF80012340000ull
+#        define REPLAY_USER_RIP   0x00007FF612340000ull
+#        define REPLAY_RFLAGS     RFLAGS_READ_AS_1_FLAG
+
+/* out 0x80, al */
+#        define REPLAY_IO_OUT_PORT_80 0x800000
+
+/*
+ * A trace as the driver would have drained it, replayed from a temporary
+ * file. The vmreads and vmwrites are what exitsim's bench expects of each.
+ */
+static const EXIT_TRACE_FILE_RECORD replay_trace[] = {
+    {.record = {.reason             = VMX_EXIT_REASON_EXECUTE_CPUID,
+                .instruction_length = 2,
+                .guest_rip          = REPLAY_KERNEL_RIP,
+                .guest_rflags       = REPLAY_RFLAGS,
+                .gprs               = {1}}},
+    {.record = {.reason             = VMX_EXIT_REASON_EXECUTE_CPUID,
+                .instruction_length = 2,
+                .guest_rip          = REPLAY_USER_RIP,
+                .guest_rflags       = REPLAY_RFLAGS}},
+    {.record = {.reason             = VMX_EXIT_REASON_EXECUTE_RDMSR,
+                .instruction_length = 2,
+                .guest_rip          = REPLAY_KERNEL_RIP,
+                .guest_rflags       = REPLAY_RFLAGS,
+                .gprs               = {0, IA32_TSC_AUX}}},
+    {.record = {.reason             = VMX_EXIT_REASON_EXECUTE_VMCALL,
+                .instruction_length = 3,
+                .guest_rip          = REPLAY_KERNEL_RIP,
+                .guest_rflags       = REPLAY_RFLAGS,
+                .gprs               = {0, VMX_HYPERCALL_PING}}},
+    {.record = {.reason             = VMX_EXIT_REASON_EXECUTE_IO_INSTRUCTION,
+                .instruction_length = 2,
+                .qualification      = REPLAY_IO_OUT_PORT_80,
+                .guest_rip          = REPLAY_KERNEL_RIP,
+                .guest_rflags       = REPLAY_RFLAGS}},
+    {.record = {.reason             = VMX_EXIT_REASON_EPT_VIOLATION,
+                .guest_rip          = REPLAY_KERNEL_RIP,
+                .guest_rflags       = REPLAY_RFLAGS}},
+    {.record = {.reason             = VMX_EXIT_REASON_EPT_MISCONFIGURATION,
+                .guest_rip          = REPLAY_KERNEL_RIP,
+                .guest_rflags       = REPLAY_RFLAGS}},
+};
+
+static int
+SelfTest(void)
+{
+        EXIT_TRACE_FILE_HEADER header = {0};
+        REPLAY_STATE           state  = {0};
+        FILE*                  file   = tmpfile();
+        UINT32                 cpuid  = VMX_EXIT_REASON_EXECUTE_CPUID;
+        UINT32                 rdmsr  = VMX_EXIT_REASON_EXECUTE_RDMSR;
+        UINT32                 vmcall = VMX_EXIT_REASON_EXECUTE_VMCALL;
+        UINT32                 io     = VMX_EXIT_REASON_EXECUTE_IO_INSTRUCTION;
+        UINT32                 ept    = VMX_EXIT_REASON_EPT_MISCONFIGURATION;
+        UINT64                 start  = 0;
+        UINT64                 ticks  = 0;
+
+        header.magic       = EXIT_TRACE_FILE_MAGIC;
+        header.version     = EXIT_TRACE_FILE_VERSION;
+        header.record_size = sizeof(EXIT_TRACE_RECORD);
+        header.core_count  = 1;
+
+        Check(file && fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(replay_trace, sizeof(replay_trace), 1, file) == 1,
+              "the trace is written");
+        Check(!ReplayInitialise(&state), "the replayed vcpu is set up");
+
+        if (!failures) {
+                rewind(file);
+
+                start = Nanoseconds();
+                ticks = __rdtsc();
+                Check(!ReadTraceHeader(file, "selftest") &&
+                          !ReplayFile(&state, file),
+                      "the trace is replayed");
+                ticks = __rdtsc() - ticks;
+                start = Nanoseconds() - start;
+
+                Check(state.stats[cpuid].count == 2 &&
+                          state.stats[rdmsr].count == 1 &&
+                          state.stats[vmcall].count == 1 &&
+                          state.stats[io].count == 1,
+                      "every exit but the ept ones is timed");
+                Check(state.vmreads[cpuid] == 6 && state.vmwrites[cpuid] == 2,
+                      "a cpuid exit costs 3 vmreads and a vmwrite");
+                Check(state.vmreads[rdmsr] == 4 && state.vmwrites[rdmsr] == 1,
+                      "an rdmsr exit costs 4 vmreads and a vmwrite");
+                Check(state.vmreads[vmcall] == 3 &&
+                          state.vmwrites[vmcall] == 1,
+                      "a vmcall exit costs 3 vmreads and a vmwrite");
+                Check(state.skipped == 1, "the ept violation is skipped");
+                Check(state.bugchecks[ept] == 1 && !state.stats[ept].count,
+                      "the ept misconfiguration is counted as a bugcheck");
+                Check(HwSimGetVmcsField(VMCS_GUEST_CS_SELECTOR) ==
+                          REPLAY_KERNEL_CS,
+                      "a kernel rip replays with a kernel cs");
+                Check(!ReplayReport(&state, start, ticks),
+                      "the replay is reported");
+        }
+
+        if (file)
+                fclose(file);
+
+        ReplayFree(&state);
+
+        printf("selftest: %u checks, %u failures\n", checks, failures);
+        return failures ? 1 : 0;
+}
+#endif
+
+#ifdef _WIN32
+#        define RECORD_BATCH 256
+/* no core ever holds more counters than this, see SKETCH_COUNTERS */
+#        define HOTSPOT_BATCH 64
+#        define CR3_BATCH     4096
+
+static BOOL
+SetRecording(HANDLE Device, UINT32 Enable)
+{
+        HV_EXIT_RECORDING_REQUEST request  = {0};
+        DWORD                     returned = 0;
+
+        request.enable = Enable;
+
+        return DeviceIoControl(Device,
+                               IOCTL_HV_SET_EXIT_RECORDING,
+                               &request,
+                               sizeof(request),
+                               NULL,
+                               0,
+                               &returned,
+                               NULL);
+}
+
+/* returns the number of records written, or -1 on failure */
+static long
+DrainCore(HANDLE                       Device,
+          UINT32                       Core,
+          UINT64*                      Cursor,
+          UINT64*                      Lost,
+          PHV_EXIT_TRACE_READ_RESPONSE Response,
+          DWORD                        Size,
+          FILE*                        File)
+{
+        HV_EXIT_TRACE_READ_REQUEST request  = {0};
+        EXIT_TRACE_FILE_RECORD     entry    = {0};
+        DWORD                      returned = 0;
+
+        request.core   = Core;
+        request.cursor = *Cursor;
+
+        if (!DeviceIoControl(Device,
+                             IOCTL_HV_READ_EXIT_TRACE,
+                             &request,
+                             sizeof(request),
+                             Response,
+                             Size,
+                             &returned,
+                             NULL))
+                return GetLastError() == ERROR_NOT_FOUND ? 0 : -1;
+
+        *Cursor = Response->cursor;
+        *Lost += Response->lost;
+
+        entry.core = Core;
+
+        for (UINT32 index = 0; index < Response->record_count; index++) {
+                entry.record = Response->records[index];
+
+                if (fwrite(&entry, sizeof(entry), 1, File) != 1)
+                        return -1;
+        }
+
+        return (long)Response->record_count;
+}
+
+static int
+Record(const char* Path, unsigned Seconds)
+{
+        EXIT_TRACE_FILE_HEADER       header   = {0};
+        PHV_EXIT_TRACE_READ_RESPONSE response = NULL;
+        UINT64*                      cursors  = NULL;
+        UINT64                       lost     = 0;
+        UINT64                       written  = 0;
+        DWORD                        size     = 0;
+        DWORD                        start    = 0;
+        long                         drained  = 0;
+        int                          status   = -1;
+        UINT32                       cores    = 0;
+        FILE*                        file     = NULL;
+        HANDLE                       device   = CreateFileA(HV_DEVICE_PATH,
+                                     GENERIC_READ | GENERIC_WRITE,
+                                     0,
+                                     NULL,
+                                     OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL,
+                                     NULL);
+
+        if (device == INVALID_HANDLE_VALUE) {
+                fprintf(stderr,
+                        "exittrace: unable to open %s (%lu)\n",
+                        HV_DEVICE_PATH,
+                        GetLastError());
+                return -1;
+        }
+
+        cores    = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+        size     = (DWORD)HV_EXIT_TRACE_READ_RESPONSE_SIZE(RECORD_BATCH);
+        response = malloc(size);
+        cursors  = calloc(cores, sizeof(UINT64));
+        file     = fopen(Path, "wb");
+
+        if (!response || !cursors || !file)
+                goto end;
+
+        header.magic       = EXIT_TRACE_FILE_MAGIC;
+        header.version     = EXIT_TRACE_FILE_VERSION;
+        header.record_size = sizeof(EXIT_TRACE_RECORD);
+        header.core_count  = cores;
+
+        if (fwrite(&header, sizeof(header), 1, file) != 1)
+                goto end;
+
+        if (!SetRecording(device, 1)) {
+                fprintf(stderr,
+                        "exittrace: unable to enable recording (%lu)\n",
+                        GetLastError());
+                goto end;
+        }
+
+        /*
+         * Each exit ring only holds VMX_EXIT_RING_CAPACITY records, so drain
+         * often enough that a busy core doesn't overwrite what we haven't read.
+         */
+        start = GetTickCount();
+
+        do {
+                for (UINT32 core = 0; core < cores; core++) {
+                        drained = DrainCore(device,
+                                            core,
+                                            &cursors[core],
+                                            &lost,
+                                            response,
+                                            size,
+                                            file);
+
+                        if (drained < 0) {
+                                SetRecording(device, 0);
+                                goto end;
+                        }
+
+                        written += drained;
+                }
+
+                Sleep(1);
+        } while (GetTickCount() - start < Seconds * 1000);
+
+        SetRecording(device, 0);
+        status = 0;
+
+        printf("exittrace: %llu exits recorded, %llu lost\n",
+               (unsigned long long)written,
+               (unsigned long long)lost);
+
+end:
+        if (file)
+                fclose(file);
+
+        free(response);
+        free(cursors);
+        CloseHandle(device);
+        return status;
+}
+
+static BOOL
+SetProfiling(HANDLE Device, UINT32 Enable, UINT32 Reset)
+{
+        HV_EXIT_PROFILING_REQUEST request  = {0};
+        DWORD                     returned = 0;
+
+        request.enable = Enable;
+        request.reset  = Reset;
+
+        return DeviceIoControl(Device,
+                               IOCTL_HV_SET_EXIT_PROFILING,
+                               &request,
+                               sizeof(request),
+                               NULL,
+                               0,
+                               &returned,
+                               NULL);
+}
+
+static int
+CompareHotspots(const void* Left, const void* Right)
+{
+        const HV_EXIT_HOTSPOT* left  = Left;
+        const HV_EXIT_HOTSPOT* right = Right;
+
+        if (left->count != right->count)
+                return left->count < right->count ? 1 : -1;
+
+        return 0;
+}
+
+/*
+ * The same instruction can exit on several cores, so the per core counters
+ * are merged by (rip, reason). The errors are summed along with the counts,
+ * which keeps the merged count an upper bound on the true one.
+ */
+static size_t
+MergeHotspots(PHV_EXIT_HOTSPOT        Merged,
+              size_t                  Count,
+              const HV_EXIT_HOTSPOTS* Response)
+{
+        for (UINT32 index = 0; index < Response->hotspot_count; index++) {
+                const HV_EXIT_HOTSPOT* hotspot = &Response->hotspots[index];
+                size_t                 entry   = 0;
+
+                for (; entry < Count; entry++) {
+                        if (Merged[entry].guest_rip == hotspot->guest_rip &&
+                            Merged[entry].reason == hotspot->reason)
+                                break;
+                }
+
+                if (entry == Count) {
+                        Merged[Count++] = *hotspot;
+                        continue;
+                }
+
+                Merged[entry].count += hotspot->count;
+                Merged[entry].error += hotspot->error;
+        }
+
+        return Count;
+}
+
+static int
+Hotspots(unsigned Seconds, unsigned Top)
+{
+        HV_EXIT_HOTSPOTS_REQUEST request  = {0};
+        PHV_EXIT_HOTSPOTS        response = NULL;
+        PHV_EXIT_HOTSPOT         merged   = NULL;
+        UINT64                   total    = 0;
+        size_t                   count    = 0;
+        DWORD                    size     = 0;
+        DWORD                    returned = 0;
+        int                      status   = -1;
+        UINT32                   cores    = 0;
+        HANDLE                   device   = CreateFileA(HV_DEVICE_PATH,
+                                     GENERIC_READ | GENERIC_WRITE,
+                                     0,
+                                     NULL,
+                                     OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL,
+                                     NULL);
+
+        if (device == INVALID_HANDLE_VALUE) {
+                fprintf(stderr,
+                        "exittrace: unable to open %s (%lu)\n",
+                        HV_DEVICE_PATH,
+                        GetLastError());
+                return -1;
+        }
+
+        cores    = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+        size     = (DWORD)HV_EXIT_HOTSPOTS_SIZE(HOTSPOT_BATCH);
+        response = malloc(size);
+        merged   = calloc((size_t)cores * HOTSPOT_BATCH,
+                        sizeof(HV_EXIT_HOTSPOT));
+
+        if (!response || !merged)
+                goto end;
+
+        if (!SetProfiling(device, 1, 1)) {
+                fprintf(stderr,
+                        "exittrace: unable to enable profiling (%lu)\n",
+                        GetLastError());
+                goto end;
+        }
+
+        Sleep(Seconds * 1000);
+        SetProfiling(device, 0, 0);
+
+        for (UINT32 core = 0; core < cores; core++) {
+                request.core = core;
+
+                /* excluded cores have no sketch */
+                if (!DeviceIoControl(device,
+                                     IOCTL_HV_QUERY_EXIT_HOTSPOTS,
+                                     &request,
+                                     sizeof(request),
+                                     response,
+                                     size,
+                                     &returned,
+                                     NULL)) {
+                        if (GetLastError() == ERROR_NOT_FOUND)
+                                continue;
+
+                        fprintf(stderr,
+                                "exittrace: unable to query core %u (%lu)\n",
+                                core,
+                                GetLastError());
+                        goto end;
+                }
+
+                total += response->total;
+                count = MergeHotspots(merged, count, response);
+        }
+
+        qsort(merged, count, sizeof(HV_EXIT_HOTSPOT), CompareHotspots);
+
+        printf("%llu exits profiled over %u seconds\n\n",
+               (unsigned long long)total,
+               Seconds);
+        printf("%-20s %-22s %12s %12s %8s\n",
+               "guest rip",
+               "reason",
+               "count",
+               "error",
+               "share");
+
+        for (size_t index = 0; index < count && index < Top; index++)
+                printf("%#-20llx %-22s %12llu %12llu %7.2f%%\n",
+                       (unsigned long long)merged[index].guest_rip,
+                       ExitReasonName(merged[index].reason),
+                       (unsigned long long)merged[index].count,
+                       (unsigned long long)merged[index].error,
+                       total ? 100.0 * merged[index].count / total : 0.0);
+
+        status = 0;
+
+end:
+        free(response);
+        free(merged);
+        CloseHandle(device);
+        return status;
+}
+
+static BOOL
+SetAccounting(HANDLE Device, UINT32 Enable, UINT32 Reset)
+{
+        HV_CR3_ACCOUNTING_REQUEST request  = {0};
+        DWORD                     returned = 0;
+
+        request.enable = Enable;
+        request.reset  = Reset;
+
+        return DeviceIoControl(Device,
+                               IOCTL_HV_SET_CR3_ACCOUNTING,
+                               &request,
+                               sizeof(request),
+                               NULL,
+                               0,
+                               &returned,
+                               NULL);
+}
+
+static int
+CompareAccounting(const void* Left, const void* Right)
+{
+        const HV_CR3_ACCOUNTING_ENTRY* left  = Left;
+        const HV_CR3_ACCOUNTING_ENTRY* right = Right;
+
+        if (left->cycles != right->cycles)
+                return left->cycles < right->cycles ? 1 : -1;
+
+        return 0;
+}
+
+typedef struct _PROCESS_CR3 {
+        UINT64 cr3;
+        UINT32 process_id;
+        char   name[MAX_PATH];
+
+} PROCESS_CR3, *PPROCESS_CR3;
+
+/* returns the number of processes whose cr3 could be queried */
+static size_t
+LoadProcessCr3s(HANDLE Device, PPROCESS_CR3* Processes)
+{
+        HV_PROCESS_CR3_REQUEST  request   = {0};
+        HV_PROCESS_CR3_RESPONSE response  = {0};
+        PROCESSENTRY32          entry     = {0};
+        PPROCESS_CR3            processes = NULL;
+        PPROCESS_CR3            grown     = NULL;
+        size_t                  count     = 0;
+        size_t                  allocated = 0;
+        DWORD                   returned  = 0;
+        HANDLE                  snapshot  =
+            CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+
+        *Processes = NULL;
+
+        if (snapshot == INVALID_HANDLE_VALUE)
+                return 0;
+
+        entry.dwSize = sizeof(entry);
+
+        if (!Process32First(snapshot, &entry))
+                goto end;
+
+        do {
+                request.process_id = entry.th32ProcessID;
+
+                if (!DeviceIoControl(Device,
+                                     IOCTL_HV_QUERY_PROCESS_CR3,
+                                     &request,
+                                     sizeof(request),
+                                     &response,
+                                     sizeof(response),
+                                     &returned,
+                                     NULL))
+                        continue;
+
+                if (count == allocated) {
+                        allocated = allocated ? allocated * 2 : 256;
+                        grown =
+                            realloc(processes, allocated * sizeof(PROCESS_CR3));
+
+                        if (!grown)
+                                break;
+
+                        processes = grown;
+                }
+
+                processes[count].cr3        = response.cr3;
+                processes[count].process_id = entry.th32ProcessID;
+                strncpy(processes[count].name,
+                        entry.szExeFile,
+                        sizeof(processes[count].name) - 1);
+                processes[count].name[sizeof(processes[count].name) - 1] = 0;
+                count++;
+        } while (Process32Next(snapshot, &entry));
+
+end:
+        CloseHandle(snapshot);
+        *Processes = processes;
+        return count;
+}
+
+static void
+PrintAccounting(const char*                    Name,
+                UINT32                         ProcessId,
+                const HV_CR3_ACCOUNTING_ENTRY* Entry,
+                UINT64                         TotalCycles)
+{
+        printf("%-28.28s %8lu %#-18llx %12llu %16llu %7.2f%%\n",
+               Name,
+               (unsigned long)ProcessId,
+               (unsigned long long)Entry->cr3,
+               (unsigned long long)Entry->exits,
+               (unsigned long long)Entry->cycles,
+               TotalCycles ? 100.0 * Entry->cycles / TotalCycles : 0.0);
+}
+
+static int
+Processes(unsigned Seconds)
+{
+        PHV_CR3_ACCOUNTING response  = NULL;
+        PPROCESS_CR3       processes = NULL;
+        size_t             count     = 0;
+        size_t             process   = 0;
+        UINT64             total     = 0;
+        DWORD              size      = 0;
+        DWORD              returned  = 0;
+        int                status    = -1;
+        HANDLE             device    = CreateFileA(HV_DEVICE_PATH,
+                                     GENERIC_READ | GENERIC_WRITE,
+                                     0,
+                                     NULL,
+                                     OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL,
+                                     NULL);
+
+        if (device == INVALID_HANDLE_VALUE) {
+                fprintf(stderr,
+                        "exittrace: unable to open %s (%lu)\n",
+                        HV_DEVICE_PATH,
+                        GetLastError());
+                return -1;
+        }
+
+        size     = (DWORD)HV_CR3_ACCOUNTING_SIZE(CR3_BATCH);
+        response = malloc(size);
+
+        if (!response)
+                goto end;
+
+        if (!SetAccounting(device, 1, 1)) {
+                fprintf(stderr,
+                        "exittrace: unable to enable accounting (%lu)\n",
+                        GetLastError());
+                goto end;
+        }
+
+        Sleep(Seconds * 1000);
+        SetAccounting(device, 0, 0);
+
+        if (!DeviceIoControl(device,
+                             IOCTL_HV_QUERY_CR3_ACCOUNTING,
+                             NULL,
+                             0,
+                             response,
+                             size,
+                             &returned,
+                             NULL)) {
+                fprintf(stderr,
+                        "exittrace: unable to query accounting (%lu)\n",
+                        GetLastError());
+                goto end;
+        }
+
+        qsort(response->entries,
+              response->entry_count,
+              sizeof(HV_CR3_ACCOUNTING_ENTRY),
+              CompareAccounting);
+
+        total = response->overflow.cycles;
+
+        for (UINT32 index = 0; index < response->entry_count; index++)
+                total += response->entries[index].cycles;
+
+        printf("%-28s %8s %-18s %12s %16s %8s\n",
+               "process",
+               "pid",
+               "cr3",
+               "exits",
+               "root cycles",
+               "share");
+
+        /* processes that exited while we were accounting stay unknown */
+        count = LoadProcessCr3s(device, &processes);
+
+        for (UINT32 index = 0; index < response->entry_count; index++) {
+                for (process = 0; process < count; process++) {
+                        if (processes[process].cr3 ==
+                            response->entries[index].cr3)
+                                break;
+                }
+
+                if (process == count)
+                        PrintAccounting("<unknown>",
+                                        0,
+                                        &response->entries[index],
+                                        total);
+                else
+                        PrintAccounting(processes[process].name,
+                                        processes[process].process_id,
+                                        &response->entries[index],
+                                        total);
+        }
+
+        if (response->overflow.exits)
+                PrintAccounting("<overflow>", 0, &response->overflow, total);
+
+        status = 0;
+
+end:
+        free(response);
+        free(processes);
+        CloseHandle(device);
+        return status;
+}
+#endif
+
+int
+main(int argc, char** argv)
+{
+        if (argc >= 3 && !strcmp(argv[1], "report"))
+                return Report(argc - 2, &argv[2]) ? 1 : 0;
+
+#if defined(HWSIM)
+        if (argc >= 3 && !strcmp(argv[1], "replay"))
+                return Replay(argc - 2, &argv[2]) ? 1 : 0;
+
+        if (argc == 2 && !strcmp(argv[1], "selftest"))
+                return SelfTest();
+#endif
+
+#ifdef _WIN32
+        if (argc == 4 && !strcmp(argv[1], "record"))
+                return Record(argv[2], (unsigned)atoi(argv[3])) ? 1 : 0;
+
+        if ((argc == 3 || argc == 4) && !strcmp(argv[1], "hotspots")) {
+                unsigned top = argc == 4 ? (unsigned)atoi(argv[3]) : 16;
+
+                return Hotspots((unsigned)atoi(argv[2]), top) ? 1 : 0;
+        }
+
+        if (argc == 3 && !strcmp(argv[1], "processes"))
+                return Processes((unsigned)atoi(argv[2])) ? 1 : 0;
+#endif
+
+        fprintf(stderr, "usage: %s report <trace file> [...]\n", argv[0]);
+#if defined(HWSIM)
+        fprintf(stderr, "       %s replay <trace file> [...]\n", argv[0]);
+        fprintf(stderr, "       %s selftest\n", argv[0]);
+#endif
+#ifdef _WIN32
+        fprintf(stderr, "       %s record <trace file> <seconds>\n", argv[0]);
+        fprintf(stderr, "       %s hotspots <seconds> [top n]\n", argv[0]);
+        fprintf(stderr, "       %s processes <seconds>\n", argv[0]);
+#endif
+        return 1;
+}
@@ -0,0 +1,481 @@
+/*
+ * freeze - exercises the hypervisor's stop the world protocol, see
+ * hv/freeze.h.
+ *
+ * "stress" builds the driver's freeze.c as is against the user mode shims in
+ * freeze.h, with a pinned thread standing in for each core. Every thread
+ * counts its progress and, as a core taking the owners NMI would, parks
+ * whenever it finds itself signalled, and every so often stops the world
+ * itself. The owner of each stop checks that it is the only owner, that every
+ * other thread parked for it and that none of them make any progress until
+ * they are resumed. Any violation or timeout fails the run, and the stop
+ * latencies are reported along with how long each thread took to park on
+ * average. Linux only, as it is built around pthreads.
+ *
+ * On Windows, "stop" stops every other core from the calling one through the
+ * driver, holding them for the given number of tsc cycles, and "stats" prints
+ * the stop latencies and where each core was when it parked for the last one.
+ *
+ *   cc -O2 -pthread -I../hv -o freeze freeze.c ../hv/freeze.c
+ *
+ * usage: freeze stress [threads] [stops per thread]
+ *        freeze stop [hold cycles]
+ *        freeze stats
+ */
+#ifndef _WIN32
+#        define _GNU_SOURCE
+#        include <pthread.h>
+#        include <sched.h>
+#        include <time.h>
+#        include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freeze.h"
+
+#ifdef _WIN32
+#        include "ioctl.h"
+#else
+
+/* one in this many iterations of a thread tries to stop the world */
+#        define STRESS_STOP_ODDS 0x1000
+
+/* how long an owner watches the others for progress while they are parked */
+#        define STRESS_HOLD_PAUSES 0x100
+
+typedef struct _STRESS_CONTEXT STRESS_CONTEXT, *PSTRESS_CONTEXT;
+
+typedef struct _STRESS_THREAD {
+        /* only ever written by the thread itself, so kept to its own line */
+        volatile UINT64 progress;
+        UINT8           reserved[56];
+        pthread_t       thread;
+        UINT32          index;
+        unsigned long   cpu;
+        PSTRESS_CONTEXT context;
+        UINT64          stops;
+        UINT64          parks;
+        /* written by the owner of each stop, see StressStop */
+        UINT64          arrival_total;
+        UINT64          arrivals;
+
+} STRESS_THREAD, *PSTRESS_THREAD;
+
+struct _STRESS_CONTEXT {
+        FREEZE_STATE      state;
+        PFREEZE_CORE      cores;
+        PSTRESS_THREAD    threads;
+        UINT32            count;
+        UINT64            stops;
+        UINT64            timeout;
+        volatile UINT32   finished;
+        volatile UINT32   owners;
+        volatile UINT64   violations;
+        pthread_barrier_t start;
+};
+
+static UINT64
+NextRandom(UINT64* State)
+{
+        *State ^= *State << 13;
+        *State ^= *State >> 7;
+        *State ^= *State << 17;
+        return *State;
+}
+
+static void
+Violation(PSTRESS_CONTEXT Context, const char* Message, UINT32 Core)
+{
+        __atomic_add_fetch(&Context->violations, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "freeze: %s (thread %u)\n", Message, Core);
+}
+
+/* the same shape as FreezeWorld, with the hold spent checking on everyone */
+static void
+StressStop(PSTRESS_CONTEXT Context, PSTRESS_THREAD Self)
+{
+        PFREEZE_STATE state      = &Context->state;
+        UINT64*       snapshot   = NULL;
+        UINT32        parked     = 0;
+        UINT32        generation = 0;
+
+        snapshot = calloc(Context->count, sizeof(UINT64));
+
+        if (!snapshot) {
+                Violation(Context, "out of memory", Self->index);
+                return;
+        }
+
+        while (!FreezeTryBegin(state, Self->index, Context->count)) {
+                if (FreezePark(state, Self->index, Self->progress))
+                        Self->parks++;
+
+                FREEZE_PAUSE();
+        }
+
+        if (__atomic_add_fetch(&Context->owners, 1, __ATOMIC_ACQ_REL) != 1)
+                Violation(Context, "two owners at once", Self->index);
+
+        parked = FreezeWaitForCores(
+            state, Context->count - 1, Context->timeout);
+
+        if (parked != Context->count - 1)
+                Violation(Context, "timed out waiting to park", Self->index);
+
+        generation = FREEZE_GENERATION(state->word);
+
+        for (UINT32 index = 0; index < Context->count; index++)
+                snapshot[index] = Context->threads[index].progress;
+
+        for (UINT32 pause = 0; pause < STRESS_HOLD_PAUSES; pause++)
+                FREEZE_PAUSE();
+
+        /* with fewer cpus than threads, the others only run if we let them */
+        sched_yield();
+
+        for (UINT32 index = 0; index < Context->count; index++) {
+                if (index == Self->index)
+                        continue;
+
+                if (Context->threads[index].progress != snapshot[index])
+                        Violation(Context, "ran while stopped", index);
+
+                if (Context->cores[index].parked_generation != generation)
+                        Violation(Context, "counted but not parked", index);
+
+                Context->threads[index].arrival_total +=
+                    Context->cores[index].arrival;
+                Context->threads[index].arrivals++;
+        }
+
+        if (__atomic_sub_fetch(&Context->owners, 1, __ATOMIC_ACQ_REL))
+                Violation(Context, "two owners at once", Self->index);
+
+        FreezeEnd(state);
+        free(snapshot);
+}
+
+static void*
+StressThread(void* Argument)
+{
+        PSTRESS_THREAD  self    = Argument;
+        PSTRESS_CONTEXT context = self->context;
+        UINT64          random  = 0x2545F4914F6CDD1Dull * (self->index + 1);
+        cpu_set_t       set;
+
+        CPU_ZERO(&set);
+        CPU_SET(self->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+        pthread_barrier_wait(&context->start);
+
+        /* keep answering signals until the last thread is done stopping */
+        while (context->finished < context->count) {
+                self->progress = self->progress + 1;
+
+                if (FreezeClaimSignal(&context->state, self->index) &&
+                    FreezePark(&context->state, self->index, self->progress))
+                        self->parks++;
+
+                if (self->stops == context->stops ||
+                    NextRandom(&random) % STRESS_STOP_ODDS)
+                        continue;
+
+                StressStop(context, self);
+
+                if (++self->stops == context->stops)
+                        __atomic_add_fetch(
+                            &context->finished, 1, __ATOMIC_RELEASE);
+        }
+
+        return NULL;
+}
+
+static double
+NowSeconds(void)
+{
+        struct timespec now = {0};
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/* tsc cycles per microsecond, measured against the monotonic clock */
+static double
+TscPerMicrosecond(void)
+{
+        double start = NowSeconds();
+        UINT64 tsc   = FREEZE_READ_TSC();
+
+        while (NowSeconds() - start < 0.05)
+                ;
+
+        return (double)(FREEZE_READ_TSC() - tsc) /
+               ((NowSeconds() - start) * 1e6);
+}
+
+static int
+Stress(UINT32 Count, UINT64 Stops)
+{
+        STRESS_CONTEXT     context    = {0};
+        PFREEZE_STATISTICS statistics = &context.state.statistics;
+        long               cpus       = sysconf(_SC_NPROCESSORS_ONLN);
+        double             tsc_per_us = TscPerMicrosecond();
+        double             start      = 0;
+        double             elapsed    = 0;
+        UINT64             completed  = 0;
+
+        context.cores   = calloc(Count, sizeof(FREEZE_CORE));
+        context.threads = calloc(Count, sizeof(STRESS_THREAD));
+
+        if (!context.cores || !context.threads) {
+                fprintf(stderr, "freeze: out of memory\n");
+                return -1;
+        }
+
+        /* a preempted thread can take a whole time slice to park */
+        context.count   = Count;
+        context.stops   = Stops;
+        context.timeout = (UINT64)(tsc_per_us * 10e6);
+
+        FreezeInitialiseState(&context.state, context.cores, Count);
+        pthread_barrier_init(&context.start, NULL, Count);
+
+        if (cpus < (long)Count)
+                printf("freeze: only %ld cpus for %u threads, parking will "
+                       "wait on the scheduler\n",
+                       cpus,
+                       Count);
+
+        start = NowSeconds();
+
+        for (UINT32 index = 0; index < Count; index++) {
+                context.threads[index].index   = index;
+                context.threads[index].cpu     = index % (unsigned long)cpus;
+                context.threads[index].context = &context;
+                pthread_create(&context.threads[index].thread,
+                               NULL,
+                               StressThread,
+                               &context.threads[index]);
+        }
+
+        for (UINT32 index = 0; index < Count; index++)
+                pthread_join(context.threads[index].thread, NULL);
+
+        elapsed   = NowSeconds() - start;
+        completed = statistics->stops - statistics->timeouts;
+
+        printf("%u threads, %llu stops in %.2fs, %llu timeouts, "
+               "%llu violations\n",
+               Count,
+               (unsigned long long)statistics->stops,
+               elapsed,
+               (unsigned long long)statistics->timeouts,
+               (unsigned long long)context.violations);
+
+        if (completed)
+                printf("stop latency: min %.2fus, mean %.2fus, max %.2fus\n",
+                       (double)statistics->min_latency / tsc_per_us,
+                       (double)statistics->total_latency / completed /
+                           tsc_per_us,
+                       (double)statistics->max_latency / tsc_per_us);
+
+        printf("%-8s %12s %12s %12s\n", "thread", "stops", "parks", "arrival");
+
+        for (UINT32 index = 0; index < Count; index++) {
+                PSTRESS_THREAD thread = &context.threads[index];
+
+                printf("%-8u %12llu %12llu",
+                       index,
+                       (unsigned long long)thread->stops,
+                       (unsigned long long)thread->parks);
+
+                if (thread->arrivals)
+                        printf(" %10.2fus\n",
+                               (double)thread->arrival_total /
+                                   thread->arrivals / tsc_per_us);
+                else
+                        printf(" %12s\n", "-");
+        }
+
+        pthread_barrier_destroy(&context.start);
+        free(context.threads);
+        free(context.cores);
+
+        return context.violations || statistics->timeouts ? -1 : 0;
+}
+#endif
+
+#ifdef _WIN32
+static HANDLE
+OpenDevice(void)
+{
+        HANDLE device = CreateFileA(HV_DEVICE_PATH,
+                                    GENERIC_READ | GENERIC_WRITE,
+                                    0,
+                                    NULL,
+                                    OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL,
+                                    NULL);
+
+        if (device == INVALID_HANDLE_VALUE)
+                fprintf(stderr,
+                        "freeze: unable to open %s (%lu)\n",
+                        HV_DEVICE_PATH,
+                        GetLastError());
+
+        return device;
+}
+
+static int
+Stop(UINT64 HoldCycles)
+{
+        HV_FREEZE_REQUEST request  = {0};
+        DWORD             returned = 0;
+        HANDLE            device   = OpenDevice();
+
+        if (device == INVALID_HANDLE_VALUE)
+                return -1;
+
+        request.hold_cycles = HoldCycles;
+
+        if (!DeviceIoControl(device,
+                             IOCTL_HV_FREEZE,
+                             &request,
+                             sizeof(request),
+                             NULL,
+                             0,
+                             &returned,
+                             NULL)) {
+                fprintf(stderr,
+                        "freeze: unable to stop the world (%lu)\n",
+                        GetLastError());
+                CloseHandle(device);
+                return -1;
+        }
+
+        CloseHandle(device);
+        return 0;
+}
+
+static int
+Stats(void)
+{
+        PHV_FREEZE_STATISTICS response  = NULL;
+        DWORD                 size      = 0;
+        DWORD                 returned  = 0;
+        UINT64                completed = 0;
+        int                   status    = -1;
+        HANDLE                device    = OpenDevice();
+
+        if (device == INVALID_HANDLE_VALUE)
+                return -1;
+
+        /* more than enough, the driver only fills in the cores it has */
+        size = (DWORD)HV_FREEZE_STATISTICS_SIZE(
+            GetMaximumProcessorCount(ALL_PROCESSOR_GROUPS));
+        response = malloc(size);
+
+        if (!response)
+                goto end;
+
+        if (!DeviceIoControl(device,
+                             IOCTL_HV_QUERY_FREEZE,
+                             NULL,
+                             0,
+                             response,
+                             size,
+                             &returned,
+                             NULL)) {
+                fprintf(stderr,
+                        "freeze: unable to query stops (%lu)\n",
+                        GetLastError());
+                goto end;
+        }
+
+        completed = response->stops - response->timeouts;
+
+        printf("%llu stops, %llu timeouts\n",
+               (unsigned long long)response->stops,
+               (unsigned long long)response->timeouts);
+
+        if (completed)
+                printf("stop latency in tsc cycles: min %llu, mean %llu, "
+                       "max %llu, last %llu\n",
+                       (unsigned long long)response->min_latency,
+                       (unsigned long long)(response->total_latency /
+                                            completed),
+                       (unsigned long long)response->max_latency,
+                       (unsigned long long)response->last_latency);
+
+        if (!response->stops)
+                goto done;
+
+        printf("last stop by core %u, %u cores parked\n",
+               response->last_owner,
+               response->last_parked);
+        printf("%-6s %12s %20s\n", "core", "arrival", "guest rip");
+
+        /* the owner arrives at 0, and a guest rip of 0 means root */
+        for (UINT32 index = 0; index < response->core_count; index++) {
+                const HV_FREEZE_CORE* core = &response->cores[index];
+
+                if (core->arrival == HV_FREEZE_NOT_PARKED)
+                        printf("%-6u %12s %20s\n", index, "-", "-");
+                else
+                        printf("%-6u %12llu %#20llx\n",
+                               index,
+                               (unsigned long long)core->arrival,
+                               (unsigned long long)core->guest_rip);
+        }
+
+done:
+        status = 0;
+
+end:
+        free(response);
+        CloseHandle(device);
+        return status;
+}
+#endif
+
+int
+main(int argc, char** argv)
+{
+#ifndef _WIN32
+        if (argc >= 2 && argc <= 4 && !strcmp(argv[1], "stress")) {
+                long   cpus  = sysconf(_SC_NPROCESSORS_ONLN);
+                UINT32 count = argc > 2 ? (UINT32)atoi(argv[2]) :
+                                          (UINT32)(cpus < 2 ? 2 : cpus);
+                UINT64 stops = argc > 3 ? strtoull(argv[3], NULL, 0) : 1000;
+
+                if (count < 2 || !stops) {
+                        fprintf(stderr,
+                                "freeze: need at least 2 threads and 1 "
+                                "stop\n");
+                        return 1;
+                }
+
+                return Stress(count, stops) ? 1 : 0;
+        }
+#else
+        if ((argc == 2 || argc == 3) && !strcmp(argv[1], "stop"))
+                return Stop(argc == 3 ? strtoull(argv[2], NULL, 0) : 0) ? 1 :
+                                                                          0;
+
+        if (argc == 2 && !strcmp(argv[1], "stats"))
+                return Stats() ? 1 : 0;
+#endif
+
+#ifndef _WIN32
+        fprintf(stderr,
+                "usage: %s stress [threads] [stops per thread]\n",
+                argv[0]);
+#else
+        fprintf(stderr, "usage: %s stop [hold cycles]\n", argv[0]);
+        fprintf(stderr, "       %s stats\n", argv[0]);
+#endif
+        return 1;
+}
@@ -0,0 +1,269 @@
+/*
+ * hwsim - in memory processor state behind hv/hw.h, see hwsim.h.
+ *
+ * Linked into user mode builds of the driver's portable sources in place of
+ * the real intrinsics, for example the vmcs field tables and the capability
+ * template:
+ *
+ *   cc -O2 -I../hv -I. -c hwsim.c ../hv/vmcsfield.c ../hv/cap.c
+ *
+ * Single threaded, every simulated core shares the same state.
+ */
+#include <string.h>
+
+#include "hwsim.h"
+
+typedef struct _HWSIM_MSR {
+        UINT32 msr;
+        UINT32 used;
+        UINT64 value;
+
+} HWSIM_MSR, *PHWSIM_MSR;
+
+typedef struct _HWSIM_CPUID {
+        INT32 leaf;
+        INT32 subleaf;
+        INT32 registers[4];
+
+} HWSIM_CPUID, *PHWSIM_CPUID;
+
+typedef struct _HWSIM_STATE {
+        UINT64         vmcs[HWSIM_VMCS_FIELDS];
+        HWSIM_MSR      msrs[HWSIM_MSR_SLOTS];
+        HWSIM_CPUID    cpuid[HWSIM_CPUID_SLOTS];
+        UINT32         cpuid_count;
+        UINT64         cr[9];
+        UINT64         dr[8];
+        UINT16         group;
+        UINT8          number;
+        HWSIM_COUNTERS counters;
+
+} HWSIM_STATE, *PHWSIM_STATE;
+
+STATIC HWSIM_STATE sim = {0};
+
+STATIC
+PHWSIM_MSR
+HwSimFindMsr(_In_ UINT32 Msr, _In_ int Insert)
+{
+        UINT32 slot = (Msr ^ (Msr >> 16)) & (HWSIM_MSR_SLOTS - 1);
+
+        for (UINT32 probe = 0; probe < HWSIM_MSR_SLOTS; probe++) {
+                PHWSIM_MSR entry = &sim.msrs[slot];
+
+                if (entry->used && entry->msr == Msr)
+                        return entry;
+
+                if (!entry->used) {
+                        if (!Insert)
+                                return NULL;
+
+                        entry->used = 1;
+                        entry->msr  = Msr;
+                        return entry;
+                }
+
+                slot = (slot + 1) & (HWSIM_MSR_SLOTS - 1);
+        }
+
+        return NULL;
+}
+
+VOID
+HwSimReset()
+{
+        memset(&sim, 0, sizeof(sim));
+}
+
+VOID
+HwSimSetVmcsField(_In_ UINT64 Field, _In_ UINT64 Value)
+{
+        sim.vmcs[Field & (HWSIM_VMCS_FIELDS - 1)] = Value;
+}
+
+UINT64
+HwSimGetVmcsField(_In_ UINT64 Field)
+{
+        return sim.vmcs[Field & (HWSIM_VMCS_FIELDS - 1)];
+}
+
+int
+HwSimSetMsr(_In_ UINT32 Msr, _In_ UINT64 Value)
+{
+        PHWSIM_MSR entry = HwSimFindMsr(Msr, 1);
+
+        if (!entry)
+                return -1;
+
+        entry->value = Value;
+        return 0;
+}
+
+UINT64
+HwSimGetMsr(_In_ UINT32 Msr)
+{
+        PHWSIM_MSR entry = HwSimFindMsr(Msr, 0);
+        return entry ? entry->value : 0;
+}
+
+VOID
+HwSimSetCr(_In_ UINT32 Cr, _In_ UINT64 Value)
+{
+        if (Cr < 9)
+                sim.cr[Cr] = Value;
+}
+
+int
+HwSimSetCpuid(_In_ INT32 Leaf, _In_ INT32 Subleaf, _In_ const INT32* Registers)
+{
+        PHWSIM_CPUID entry = NULL;
+
+        for (UINT32 index = 0; index < sim.cpuid_count; index++) {
+                if (sim.cpuid[index].leaf == Leaf &&
+                    sim.cpuid[index].subleaf == Subleaf) {
+                        entry = &sim.cpuid[index];
+                        break;
+                }
+        }
+
+        if (!entry) {
+                if (sim.cpuid_count == HWSIM_CPUID_SLOTS)
+                        return -1;
+
+                entry          = &sim.cpuid[sim.cpuid_count++];
+                entry->leaf    = Leaf;
+                entry->subleaf = Subleaf;
+        }
+
+        memcpy(entry->registers, Registers, sizeof(entry->registers));
+        return 0;
+}
+
+VOID
+HwSimSetProcessor(_In_ UINT16 Group, _In_ UINT8 Number)
+{
+        sim.group  = Group;
+        sim.number = Number;
+}
+
+VOID
+HwSimGetCounters(_Out_ PHWSIM_COUNTERS Counters)
+{
+        *Counters = sim.counters;
+}
+
+VOID
+HwSimResetCounters()
+{
+        memset(&sim.counters, 0, sizeof(sim.counters));
+}
+
+UINT64
+VmxVmRead(_In_ UINT64 VmcsField)
+{
+        sim.counters.vmreads++;
+        return HwSimGetVmcsField(VmcsField);
+}
+
+VOID
+VmxVmWrite(_In_ UINT64 VmcsField, _In_ UINT64 Value)
+{
+        sim.counters.vmwrites++;
+        HwSimSetVmcsField(VmcsField, Value);
+}
+
+UINT64
+HwReadMsr(_In_ UINT32 Msr)
+{
+        sim.counters.msr_reads++;
+        return HwSimGetMsr(Msr);
+}
+
+VOID
+HwWriteMsr(_In_ UINT32 Msr, _In_ UINT64 Value)
+{
+        sim.counters.msr_writes++;
+        HwSimSetMsr(Msr, Value);
+}
+
+/* leaves that were never set read as zero */
+VOID
+HwCpuidEx(_Out_ INT32* Registers, _In_ INT32 Leaf, _In_ INT32 Subleaf)
+{
+        sim.counters.cpuid++;
+        memset(Registers, 0, 4 * sizeof(INT32));
+
+        for (UINT32 index = 0; index < sim.cpuid_count; index++) {
+                if (sim.cpuid[index].leaf == Leaf &&
+                    sim.cpuid[index].subleaf == Subleaf) {
+                        memcpy(Registers,
+                               sim.cpuid[index].registers,
+                               4 * sizeof(INT32));
+                        return;
+                }
+        }
+}
+
+UINT64
+HwReadCr0()
+{
+        return sim.cr[0];
+}
+
+UINT64
+HwReadCr3()
+{
+        return sim.cr[3];
+}
+
+UINT64
+HwReadCr4()
+{
+        return sim.cr[4];
+}
+
+UINT64
+HwReadCr8()
+{
+        return sim.cr[8];
+}
+
+VOID
+HwWriteCr3(_In_ UINT64 Value)
+{
+        sim.counters.cr_writes++;
+        sim.cr[3] = Value;
+}
+
+VOID
+HwWriteCr4(_In_ UINT64 Value)
+{
+        sim.counters.cr_writes++;
+        sim.cr[4] = Value;
+}
+
+VOID
+HwWriteCr8(_In_ UINT64 Value)
+{
+        sim.counters.cr_writes++;
+        sim.cr[8] = Value;
+}
+
+UINT64
+HwReadDr(_In_ UINT32 Dr)
+{
+        return sim.dr[Dr & 7];
+}
+
+VOID
+HwWriteDr(_In_ UINT32 Dr, _In_ UINT64 Value)
+{
+        sim.dr[Dr & 7] = Value;
+}
+
+VOID
+HwCurrentProcessor(_Out_ UINT16* Group, _Out_ UINT8* Number)
+{
+        *Group  = sim.group;
+        *Number = sim.number;
+}
@@ -0,0 +1,67 @@
+#ifndef HWSIM_H
+#define HWSIM_H
+
+/*
+ * hwsim - user mode backend for the accessors declared in hv/hw.h.
+ *
+ * The vmcs is a flat array indexed by field encoding, msrs live in a small
+ * open addressed table and the control and debug registers in plain arrays.
+ * Nothing is validated the way the processor would, i.e reading an msr that
+ * was never set returns 0 rather than raising #GP, so whoever drives the
+ * simulation is responsible for seeding the state the code under test reads.
+ *
+ * Every access through hw.h is counted, which gives a deterministic measure
+ * of how many vmreads and vmwrites a code path costs independent of timing.
+ */
+#include "hw.h"
+
+/* field encodings are 15 bits wide, see SDM 25.11.2 */
+#define HWSIM_VMCS_FIELDS 0x8000
+#define HWSIM_MSR_SLOTS   256
+#define HWSIM_CPUID_SLOTS 32
+
+typedef struct _HWSIM_COUNTERS {
+        UINT64 vmreads;
+        UINT64 vmwrites;
+        UINT64 msr_reads;
+        UINT64 msr_writes;
+        UINT64 cr_writes;
+        UINT64 cpuid;
+
+} HWSIM_COUNTERS, *PHWSIM_COUNTERS;
+
+/* clears the vmcs, every register and the counters */
+VOID
+HwSimReset();
+
+/* the below bypass the counters */
+VOID
+HwSimSetVmcsField(_In_ UINT64 Field, _In_ UINT64 Value);
+
+UINT64
+HwSimGetVmcsField(_In_ UINT64 Field);
+
+/* returns -1 if the msr table is full */
+int
+HwSimSetMsr(_In_ UINT32 Msr, _In_ UINT64 Value);
+
+UINT64
+HwSimGetMsr(_In_ UINT32 Msr);
+
+VOID
+HwSimSetCr(_In_ UINT32 Cr, _In_ UINT64 Value);
+
+/* returns -1 if the cpuid table is full */
+int
+HwSimSetCpuid(_In_ INT32 Leaf, _In_ INT32 Subleaf, _In_ const INT32* Registers);
+
+VOID
+HwSimSetProcessor(_In_ UINT16 Group, _In_ UINT8 Number);
+
+VOID
+HwSimGetCounters(_Out_ PHWSIM_COUNTERS Counters);
+
+VOID
+HwSimResetCounters();
+
+#endif
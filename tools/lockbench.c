@@ -0,0 +1,167 @@
+/*
+ * lockbench - user mode contention benchmark for HIGH_IRQL_LOCK.
+ *
+ * Builds the driver's lock.c as is against the user mode shims in lock.h and
+ * hammers a single lock from a number of threads, each one incrementing a
+ * shared counter inside the critical section. The final counter value is
+ * checked to catch any broken mutual exclusion, and the lock's contention
+ * statistics are reported alongside the throughput.
+ *
+ * Linux only, as it is built around pthreads:
+ *
+ *   cc -O2 -pthread -DLOCK_STATISTICS=1 -I../hv -o lockbench lockbench.c \
+ *      ../hv/lock.c
+ *
+ * The thread count defaults to, and is capped at, the number of online cpus.
+ *
+ * usage: lockbench [threads] [iterations per thread] [critical section pauses]
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lock.h"
+
+typedef struct _BENCH_CONTEXT {
+        HIGH_IRQL_LOCK    lock;
+        volatile UINT64   counter;
+        unsigned long     iterations;
+        unsigned long     pauses;
+        pthread_barrier_t start;
+
+} BENCH_CONTEXT, *PBENCH_CONTEXT;
+
+typedef struct _BENCH_THREAD {
+        pthread_t      thread;
+        unsigned long  cpu;
+        PBENCH_CONTEXT context;
+
+} BENCH_THREAD, *PBENCH_THREAD;
+
+static void*
+BenchThread(void* Argument)
+{
+        PBENCH_THREAD  self    = Argument;
+        PBENCH_CONTEXT context = self->context;
+        cpu_set_t      set;
+
+        /* pin each thread to its own cpu, as the driver's callers would be */
+        CPU_ZERO(&set);
+        CPU_SET(self->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+        pthread_barrier_wait(&context->start);
+
+        for (unsigned long index = 0; index < context->iterations; index++) {
+                HighIrqlLockAcquire(&context->lock);
+                context->counter = context->counter + 1;
+
+                for (unsigned long pause = 0; pause < context->pauses; pause++)
+                        LOCK_PAUSE();
+
+                HighIrqlLockRelease(&context->lock);
+        }
+
+        return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+        BENCH_CONTEXT   context  = {0};
+        PBENCH_THREAD   threads  = NULL;
+        unsigned long   count    = 0;
+        struct timespec start    = {0};
+        struct timespec end      = {0};
+        double          elapsed  = 0;
+        UINT64          expected = 0;
+        long            cpus     = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (cpus < 1)
+                cpus = 1;
+
+        count              = argc > 1 ? strtoul(argv[1], NULL, 0) : cpus;
+        context.iterations = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000000;
+        context.pauses     = argc > 3 ? strtoul(argv[3], NULL, 0) : 0;
+
+        if (!count) {
+                fprintf(stderr, "lockbench: need at least one thread\n");
+                return 1;
+        }
+
+        /*
+         * Waiters in the driver run at raised IRQL and are never preempted.
+         * Once there are more threads than cpus a preempted waiter stalls
+         * every ticket behind it for whole timeslices, which is not something
+         * this measures, so there is never more than one thread per cpu.
+         */
+        if (count > (unsigned long)cpus) {
+                fprintf(stderr,
+                        "lockbench: %lu threads on %ld cpus, using %ld\n",
+                        count,
+                        cpus,
+                        cpus);
+                count = (unsigned long)cpus;
+        }
+
+        expected = (UINT64)count * context.iterations;
+
+        threads = calloc(count, sizeof(BENCH_THREAD));
+
+        if (!threads)
+                return 1;
+
+        HighIrqlLockInitialise(&context.lock);
+        pthread_barrier_init(&context.start, NULL, (unsigned)count + 1);
+
+        for (unsigned long index = 0; index < count; index++) {
+                threads[index].cpu     = index;
+                threads[index].context = &context;
+                pthread_create(
+                    &threads[index].thread, NULL, BenchThread, &threads[index]);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_barrier_wait(&context.start);
+
+        for (unsigned long index = 0; index < count; index++)
+                pthread_join(threads[index].thread, NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        elapsed = (end.tv_sec - start.tv_sec) * 1e9 +
+                  (end.tv_nsec - start.tv_nsec);
+
+        printf("threads: %lu, acquisitions: %llu, %.1f ns per acquisition\n",
+               count,
+               (unsigned long long)expected,
+               elapsed / (double)expected);
+
+#if LOCK_STATISTICS
+        printf("contended: %llu (%.1f%%), spin cycles: %llu (%.1f per "
+               "contended acquisition)\n",
+               (unsigned long long)context.lock.statistics.contended,
+               100.0 * context.lock.statistics.contended / expected,
+               (unsigned long long)context.lock.statistics.spin_cycles,
+               context.lock.statistics.contended ?
+                   (double)context.lock.statistics.spin_cycles /
+                       context.lock.statistics.contended :
+                   0.0);
+#endif
+
+        free(threads);
+
+        if (context.counter != expected) {
+                fprintf(stderr,
+                        "lockbench: counter is %llu, expected %llu\n",
+                        (unsigned long long)context.counter,
+                        (unsigned long long)expected);
+                return 1;
+        }
+
+        return 0;
+}
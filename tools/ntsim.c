@@ -0,0 +1,1075 @@
+/*
+ * ntsim - the kernel routines and arch.asm entry points the driver calls,
+ * for the user mode build described in ntsim.h.
+ *
+ * Linked with hwsim.c and every driver source but driver.c and bench.c, all
+ * of them bar hwsim.c built with _KERNEL_MODE and HWSIM defined, see the
+ * hvsim library in CMakeLists.txt. Linux only, for the sysv calling
+ * convention the shim assumes:
+ *
+ *   cc -O2 -D_KERNEL_MODE -DHWSIM -mcx16 -Wno-multichar -I../hv -I. -c \
+ *       ntsim.c
+ *
+ * Single threaded, as is hwsim.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arch.h"
+#include "hwsim.h"
+#include "ntsim.h"
+
+/* where the heap hands out memory, all of it taken to be physical memory */
+#define NTSIM_PHYSICAL_LIMIT (1ull << 47)
+
+/* matches the kernels MAXIMUM_GROUPS for 64 bit builds */
+#define NTSIM_MAX_GROUPS 32
+
+typedef struct _NTSIM_STATE {
+        UINT64         active[NTSIM_MAX_GROUPS];
+        UINT32         group_count;
+        UINT32         processors;
+        KIRQL          irql;
+        jmp_buf*       bugcheck_target;
+        NTSIM_BUGCHECK bugcheck;
+        BOOLEAN        verbose;
+        PNMI_CALLBACK  nmi_callback;
+        PVOID          nmi_context;
+
+} NTSIM_STATE, *PNTSIM_STATE;
+
+STATIC NTSIM_STATE  ntsim      = {{1}, 1, 1};
+STATIC UINT8        process    = 0;
+STATIC POBJECT_TYPE event_type = NULL;
+
+/* every address the heap hands out counts as system space */
+PVOID         MmSystemRangeStart = NULL;
+POBJECT_TYPE* ExEventObjectType  = &event_type;
+
+VOID
+NtSimReset()
+{
+        memset(&ntsim, 0, sizeof(ntsim));
+        ntsim.active[0]   = 1;
+        ntsim.group_count = 1;
+        ntsim.processors  = 1;
+}
+
+int
+NtSimSetTopology(_In_ const UINT64* ActiveMasks, _In_ UINT32 GroupCount)
+{
+        UINT32 processors = 0;
+
+        if (!GroupCount || GroupCount > NTSIM_MAX_GROUPS)
+                return -1;
+
+        for (UINT32 group = 0; group < GroupCount; group++)
+                processors += __builtin_popcountll(ActiveMasks[group]);
+
+        if (!processors)
+                return -1;
+
+        memset(ntsim.active, 0, sizeof(ntsim.active));
+        memcpy(ntsim.active, ActiveMasks, GroupCount * sizeof(UINT64));
+        ntsim.group_count = GroupCount;
+        ntsim.processors  = processors;
+        return 0;
+}
+
+int
+NtSimSetProcessorCount(_In_ UINT32 Count)
+{
+        UINT64 active = Count < 64 ? (1ull << Count) - 1 : ~0ull;
+
+        if (Count > 64)
+                return -1;
+
+        return NtSimSetTopology(&active, 1);
+}
+
+VOID
+NtSimExpectBugCheck(_In_opt_ jmp_buf* Target)
+{
+        ntsim.bugcheck_target = Target;
+}
+
+VOID
+NtSimGetBugCheck(_Out_ PNTSIM_BUGCHECK BugCheck)
+{
+        *BugCheck = ntsim.bugcheck;
+}
+
+VOID
+NtSimSetVerbose(_In_ BOOLEAN Verbose)
+{
+        ntsim.verbose = Verbose;
+}
+
+/* the kernel numbers processors group by group, lowest number first */
+STATIC
+BOOLEAN
+NtSimNumberFromIndex(_In_ UINT32 Index, _Out_ PPROCESSOR_NUMBER Number)
+{
+        UINT64 active = 0;
+
+        for (UINT32 group = 0; group < ntsim.group_count; group++) {
+                active = ntsim.active[group];
+
+                if (Index >= (UINT32)__builtin_popcountll(active)) {
+                        Index -= __builtin_popcountll(active);
+                        continue;
+                }
+
+                while (Index--)
+                        active &= active - 1;
+
+                Number->Group    = (USHORT)group;
+                Number->Number   = (UCHAR)__builtin_ctzll(active);
+                Number->Reserved = 0;
+                return TRUE;
+        }
+
+        return FALSE;
+}
+
+STATIC
+VOID
+NtSimCurrentNumber(_Out_ PPROCESSOR_NUMBER Number)
+{
+        UINT16 group  = 0;
+        UINT8  number = 0;
+
+        HwCurrentProcessor(&group, &number);
+
+        Number->Group    = group;
+        Number->Number   = number;
+        Number->Reserved = 0;
+}
+
+ULONG
+DbgPrintEx(_In_ ULONG Component, _In_ ULONG Level, _In_ PCSTR Format, ...)
+{
+        va_list arguments;
+
+        UNREFERENCED_PARAMETER(Component);
+        UNREFERENCED_PARAMETER(Level);
+
+        if (!ntsim.verbose)
+                return STATUS_SUCCESS;
+
+        va_start(arguments, Format);
+        vfprintf(stderr, Format, arguments);
+        va_end(arguments);
+        return STATUS_SUCCESS;
+}
+
+VOID
+KeBugCheckEx(_In_ ULONG     BugCheckCode,
+             _In_ ULONG_PTR Parameter1,
+             _In_ ULONG_PTR Parameter2,
+             _In_ ULONG_PTR Parameter3,
+             _In_ ULONG_PTR Parameter4)
+{
+        jmp_buf* target = ntsim.bugcheck_target;
+
+        ntsim.bugcheck.code          = BugCheckCode;
+        ntsim.bugcheck.parameters[0] = Parameter1;
+        ntsim.bugcheck.parameters[1] = Parameter2;
+        ntsim.bugcheck.parameters[2] = Parameter3;
+        ntsim.bugcheck.parameters[3] = Parameter4;
+
+        if (target) {
+                ntsim.bugcheck_target = NULL;
+                longjmp(*target, 1);
+        }
+
+        fprintf(stderr,
+                "bugcheck %#x (%#llx, %#llx, %#llx, %#llx)\n",
+                BugCheckCode,
+                Parameter1,
+                Parameter2,
+                Parameter3,
+                Parameter4);
+        abort();
+}
+
+/*
+ * The privileged instructions. There is no debugger to break into, no cache
+ * to write back and nothing decodes a port, so reads float high.
+ */
+VOID
+__debugbreak()
+{
+}
+
+VOID
+__wbinvd()
+{
+}
+
+VOID
+_disable()
+{
+}
+
+VOID
+_enable()
+{
+}
+
+VOID
+__lidt(_In_ PVOID Source)
+{
+        UNREFERENCED_PARAMETER(Source);
+}
+
+VOID
+__sidt(_Out_ PVOID Destination)
+{
+        memset(Destination, 0, sizeof(SEGMENT_DESCRIPTOR_REGISTER_64));
+}
+
+ULONG
+__segmentlimit(_In_ ULONG Selector)
+{
+        UNREFERENCED_PARAMETER(Selector);
+        return 0;
+}
+
+UCHAR
+__inbyte(_In_ USHORT Port)
+{
+        UNREFERENCED_PARAMETER(Port);
+        return 0xFF;
+}
+
+USHORT
+__inword(_In_ USHORT Port)
+{
+        UNREFERENCED_PARAMETER(Port);
+        return 0xFFFF;
+}
+
+ULONG
+__indword(_In_ USHORT Port)
+{
+        UNREFERENCED_PARAMETER(Port);
+        return MAXUINT32;
+}
+
+VOID
+__inbytestring(_In_ USHORT Port, _Out_ PUCHAR Buffer, _In_ ULONG Count)
+{
+        UNREFERENCED_PARAMETER(Port);
+        memset(Buffer, 0xFF, Count * sizeof(UCHAR));
+}
+
+VOID
+__inwordstring(_In_ USHORT Port, _Out_ PUSHORT Buffer, _In_ ULONG Count)
+{
+        UNREFERENCED_PARAMETER(Port);
+        memset(Buffer, 0xFF, Count * sizeof(USHORT));
+}
+
+VOID
+__indwordstring(_In_ USHORT Port, _Out_ PULONG Buffer, _In_ ULONG Count)
+{
+        UNREFERENCED_PARAMETER(Port);
+        memset(Buffer, 0xFF, Count * sizeof(ULONG));
+}
+
+VOID
+__outbyte(_In_ USHORT Port, _In_ UCHAR Data)
+{
+        UNREFERENCED_PARAMETER(Port);
+        UNREFERENCED_PARAMETER(Data);
+}
+
+VOID
+__outword(_In_ USHORT Port, _In_ USHORT Data)
+{
+        UNREFERENCED_PARAMETER(Port);
+        UNREFERENCED_PARAMETER(Data);
+}
+
+VOID
+__outdword(_In_ USHORT Port, _In_ ULONG Data)
+{
+        UNREFERENCED_PARAMETER(Port);
+        UNREFERENCED_PARAMETER(Data);
+}
+
+VOID
+__outbytestring(_In_ USHORT Port, _In_ PUCHAR Buffer, _In_ ULONG Count)
+{
+        UNREFERENCED_PARAMETER(Port);
+        UNREFERENCED_PARAMETER(Buffer);
+        UNREFERENCED_PARAMETER(Count);
+}
+
+VOID
+__outwordstring(_In_ USHORT Port, _In_ PUSHORT Buffer, _In_ ULONG Count)
+{
+        UNREFERENCED_PARAMETER(Port);
+        UNREFERENCED_PARAMETER(Buffer);
+        UNREFERENCED_PARAMETER(Count);
+}
+
+VOID
+__outdwordstring(_In_ USHORT Port, _In_ PULONG Buffer, _In_ ULONG Count)
+{
+        UNREFERENCED_PARAMETER(Port);
+        UNREFERENCED_PARAMETER(Buffer);
+        UNREFERENCED_PARAMETER(Count);
+}
+
+/* vmx operation always succeeds, the vmcs itself is hwsim's */
+UCHAR
+__vmx_on(_In_ UINT64* VmsSupportPhysicalAddress)
+{
+        UNREFERENCED_PARAMETER(VmsSupportPhysicalAddress);
+        return 0;
+}
+
+VOID
+__vmx_off()
+{
+}
+
+UCHAR
+__vmx_vmclear(_In_ UINT64* VmcsPhysicalAddress)
+{
+        UNREFERENCED_PARAMETER(VmcsPhysicalAddress);
+        return 0;
+}
+
+UCHAR
+__vmx_vmptrld(_In_ UINT64* VmcsPhysicalAddress)
+{
+        UNREFERENCED_PARAMETER(VmcsPhysicalAddress);
+        return 0;
+}
+
+UCHAR
+__vmx_vmlaunch()
+{
+        return 0;
+}
+
+/* arch.asm, none of which can run outside of vmx root operation */
+VOID
+VmxRestoreState()
+{
+}
+
+UINT64
+SaveStateAndVirtualizeCore(_In_ PDPC_CALL_CONTEXT Context)
+{
+        UNREFERENCED_PARAMETER(Context);
+        return 0;
+}
+
+VOID
+VmExitHandler()
+{
+}
+
+VOID
+__lgdt(_In_ PVOID Value)
+{
+        UNREFERENCED_PARAMETER(Value);
+}
+
+VOID
+__sgdt(_In_ SEGMENT_DESCRIPTOR_REGISTER_64* Gdtr)
+{
+        memset(Gdtr, 0, sizeof(*Gdtr));
+}
+
+/* there's no hypervisor underneath to call */
+NTSTATUS
+__vmx_vmcall(_In_ UINT64 VmCallNumber,
+             _In_ UINT64 OptionalParam1,
+             _In_ UINT64 OptionalParam2,
+             _In_ UINT64 OptionalParam3)
+{
+        UNREFERENCED_PARAMETER(VmCallNumber);
+        UNREFERENCED_PARAMETER(OptionalParam1);
+        UNREFERENCED_PARAMETER(OptionalParam2);
+        UNREFERENCED_PARAMETER(OptionalParam3);
+        return STATUS_NOT_SUPPORTED;
+}
+
+UINT64
+__lar(_In_ UINT64 Selector)
+{
+        UNREFERENCED_PARAMETER(Selector);
+        return 0;
+}
+
+UINT8
+__invept(_In_ UINT32 Type, _In_ PVOID Descriptor)
+{
+        UNREFERENCED_PARAMETER(Type);
+        UNREFERENCED_PARAMETER(Descriptor);
+        return 0;
+}
+
+UINT16
+__readcs(VOID)
+{
+        return 0;
+}
+
+UINT16
+__readds(VOID)
+{
+        return 0;
+}
+
+UINT16
+__reades(VOID)
+{
+        return 0;
+}
+
+UINT16
+__readss(VOID)
+{
+        return 0;
+}
+
+UINT16
+__readfs(VOID)
+{
+        return 0;
+}
+
+UINT16
+__readgs(VOID)
+{
+        return 0;
+}
+
+UINT16
+__readldtr(VOID)
+{
+        return 0;
+}
+
+UINT16
+__readtr(VOID)
+{
+        return 0;
+}
+
+USHORT
+KeQueryActiveGroupCount()
+{
+        return (USHORT)ntsim.group_count;
+}
+
+ULONG
+KeQueryActiveProcessorCountEx(_In_ USHORT GroupNumber)
+{
+        if (GroupNumber == ALL_PROCESSOR_GROUPS)
+                return ntsim.processors;
+
+        return __builtin_popcountll(KeQueryGroupAffinity(GroupNumber));
+}
+
+ULONG
+KeQueryMaximumProcessorCountEx(_In_ USHORT GroupNumber)
+{
+        return KeQueryActiveProcessorCountEx(GroupNumber);
+}
+
+KAFFINITY
+KeQueryGroupAffinity(_In_ USHORT GroupNumber)
+{
+        if (GroupNumber >= ntsim.group_count)
+                return 0;
+
+        return ntsim.active[GroupNumber];
+}
+
+NTSTATUS
+KeGetProcessorNumberFromIndex(_In_ ULONG               ProcIndex,
+                              _Out_ PPROCESSOR_NUMBER ProcNumber)
+{
+        if (!NtSimNumberFromIndex(ProcIndex, ProcNumber))
+                return STATUS_INVALID_PARAMETER;
+
+        return STATUS_SUCCESS;
+}
+
+/* the system wide index of the current processor */
+ULONG
+KeGetCurrentProcessorNumberEx(_Out_opt_ PPROCESSOR_NUMBER ProcNumber)
+{
+        PROCESSOR_NUMBER current = {0};
+        ULONG            index   = 0;
+
+        NtSimCurrentNumber(&current);
+
+        if (ProcNumber)
+                *ProcNumber = current;
+
+        for (UINT32 group = 0; group < current.Group; group++)
+                index += __builtin_popcountll(ntsim.active[group]);
+
+        return index + __builtin_popcountll(ntsim.active[current.Group] &
+                                            ((1ull << current.Number) - 1));
+}
+
+USHORT
+KeGetProcessorNodeNumber(_In_ PPROCESSOR_NUMBER ProcNumber)
+{
+        UNREFERENCED_PARAMETER(ProcNumber);
+        return 0;
+}
+
+/* the thread moves to the lowest core in the mask, as it would run there */
+VOID
+KeSetSystemGroupAffinityThread(_In_ PGROUP_AFFINITY       Affinity,
+                               _Out_opt_ PGROUP_AFFINITY PreviousAffinity)
+{
+        PROCESSOR_NUMBER current = {0};
+
+        NtSimCurrentNumber(&current);
+
+        if (PreviousAffinity) {
+                memset(PreviousAffinity, 0, sizeof(GROUP_AFFINITY));
+                PreviousAffinity->Mask  = 1ull << current.Number;
+                PreviousAffinity->Group = current.Group;
+        }
+
+        if (Affinity->Mask)
+                HwSimSetProcessor(Affinity->Group,
+                                  (UINT8)__builtin_ctzll(Affinity->Mask));
+}
+
+VOID
+KeRevertToUserGroupAffinityThread(_In_ PGROUP_AFFINITY PreviousAffinity)
+{
+        KeSetSystemGroupAffinityThread(PreviousAffinity, NULL);
+}
+
+VOID
+KeRaiseIrql(_In_ KIRQL NewIrql, _Out_ PKIRQL OldIrql)
+{
+        *OldIrql   = ntsim.irql;
+        ntsim.irql = NewIrql;
+}
+
+VOID
+KeLowerIrql(_In_ KIRQL NewIrql)
+{
+        ntsim.irql = NewIrql;
+}
+
+/* runs on each core in turn, then back on the one that asked */
+ULONG_PTR
+KeIpiGenericCall(_In_ PKIPI_BROADCAST_WORKER BroadcastFunction,
+                 _In_ ULONG_PTR              Context)
+{
+        PROCESSOR_NUMBER current = {0};
+        PROCESSOR_NUMBER number  = {0};
+        ULONG_PTR        result  = 0;
+
+        NtSimCurrentNumber(&current);
+
+        for (UINT32 core = 0; NtSimNumberFromIndex(core, &number); core++) {
+                HwSimSetProcessor(number.Group, number.Number);
+                result = BroadcastFunction(Context);
+        }
+
+        HwSimSetProcessor(current.Group, current.Number);
+        return result;
+}
+
+VOID
+KeGenericCallDpc(_In_ PKDEFERRED_ROUTINE Routine, _In_opt_ PVOID Context)
+{
+        PROCESSOR_NUMBER current = {0};
+        PROCESSOR_NUMBER number  = {0};
+        KDPC             dpc     = {0};
+        LONG             done    = 0;
+        LONG             barrier = 0;
+
+        dpc.routine = Routine;
+        dpc.context = Context;
+
+        NtSimCurrentNumber(&current);
+
+        for (UINT32 core = 0; NtSimNumberFromIndex(core, &number); core++) {
+                HwSimSetProcessor(number.Group, number.Number);
+                Routine(&dpc, Context, &done, &barrier);
+        }
+
+        HwSimSetProcessor(current.Group, current.Number);
+}
+
+/* every other core has long since arrived, the callers run one by one */
+LOGICAL
+KeSignalCallDpcSynchronize(_In_ PVOID SystemArgument2)
+{
+        UNREFERENCED_PARAMETER(SystemArgument2);
+        return TRUE;
+}
+
+VOID
+KeSignalCallDpcDone(_In_ PVOID SystemArgument1)
+{
+        InterlockedIncrement((volatile LONG*)SystemArgument1);
+}
+
+PVOID
+KeRegisterNmiCallback(_In_ PNMI_CALLBACK CallbackRoutine,
+                      _In_opt_ PVOID     Context)
+{
+        if (ntsim.nmi_callback)
+                return NULL;
+
+        ntsim.nmi_callback = CallbackRoutine;
+        ntsim.nmi_context  = Context;
+        return &ntsim.nmi_callback;
+}
+
+NTSTATUS
+KeDeregisterNmiCallback(_In_ PVOID Handle)
+{
+        if (Handle != &ntsim.nmi_callback)
+                return STATUS_INVALID_PARAMETER;
+
+        ntsim.nmi_callback = NULL;
+        ntsim.nmi_context  = NULL;
+        return STATUS_SUCCESS;
+}
+
+VOID
+KeInitializeDpc(_Out_ PRKDPC            Dpc,
+                _In_ PKDEFERRED_ROUTINE DeferredRoutine,
+                _In_opt_ PVOID          DeferredContext)
+{
+        memset(Dpc, 0, sizeof(KDPC));
+        Dpc->routine = DeferredRoutine;
+        Dpc->context = DeferredContext;
+}
+
+VOID
+KeFlushQueuedDpcs()
+{
+}
+
+VOID
+KeInitializeTimer(_Out_ PKTIMER Timer)
+{
+        memset(Timer, 0, sizeof(KTIMER));
+}
+
+BOOLEAN
+KeSetTimerEx(_Inout_ PKTIMER    Timer,
+             _In_ LARGE_INTEGER DueTime,
+             _In_ LONG          Period,
+             _In_opt_ PKDPC     Dpc)
+{
+        UNREFERENCED_PARAMETER(Timer);
+        UNREFERENCED_PARAMETER(DueTime);
+        UNREFERENCED_PARAMETER(Period);
+        UNREFERENCED_PARAMETER(Dpc);
+        return FALSE;
+}
+
+BOOLEAN
+KeCancelTimer(_Inout_ PKTIMER Timer)
+{
+        UNREFERENCED_PARAMETER(Timer);
+        return FALSE;
+}
+
+VOID
+KeInitializeEvent(_Out_ PRKEVENT  Event,
+                  _In_ EVENT_TYPE Type,
+                  _In_ BOOLEAN    State)
+{
+        UNREFERENCED_PARAMETER(Type);
+
+        memset(Event, 0, sizeof(KEVENT));
+        Event->signalled = State;
+}
+
+LONG
+KeSetEvent(_Inout_ PRKEVENT Event, _In_ LONG Increment, _In_ BOOLEAN Wait)
+{
+        UNREFERENCED_PARAMETER(Increment);
+        UNREFERENCED_PARAMETER(Wait);
+        return InterlockedExchange(&Event->signalled, 1);
+}
+
+VOID
+KeClearEvent(_Inout_ PRKEVENT Event)
+{
+        InterlockedExchange(&Event->signalled, 0);
+}
+
+/* with nothing else running, whatever is waited on is already signalled */
+NTSTATUS
+KeWaitForSingleObject(_In_ PVOID           Object,
+                      _In_ KWAIT_REASON    WaitReason,
+                      _In_ KPROCESSOR_MODE WaitMode,
+                      _In_ BOOLEAN         Alertable,
+                      _In_opt_ PLARGE_INTEGER Timeout)
+{
+        UNREFERENCED_PARAMETER(Object);
+        UNREFERENCED_PARAMETER(WaitReason);
+        UNREFERENCED_PARAMETER(WaitMode);
+        UNREFERENCED_PARAMETER(Alertable);
+        UNREFERENCED_PARAMETER(Timeout);
+        return STATUS_SUCCESS;
+}
+
+VOID
+KeInitializeGuardedMutex(_Out_ PKGUARDED_MUTEX Mutex)
+{
+        memset(Mutex, 0, sizeof(KGUARDED_MUTEX));
+}
+
+/* a single thread acquiring an owned mutex never gets it back */
+VOID
+KeAcquireGuardedMutex(_Inout_ PKGUARDED_MUTEX Mutex)
+{
+        if (InterlockedExchange(&Mutex->owned, 1)) {
+                fprintf(stderr, "guarded mutex %p acquired twice\n", Mutex);
+                abort();
+        }
+}
+
+VOID
+KeReleaseGuardedMutex(_Inout_ PKGUARDED_MUTEX Mutex)
+{
+        InterlockedExchange(&Mutex->owned, 0);
+}
+
+VOID
+ExQueueWorkItem(_Inout_ PWORK_QUEUE_ITEM WorkItem,
+                _In_ WORK_QUEUE_TYPE     QueueType)
+{
+        UNREFERENCED_PARAMETER(QueueType);
+        WorkItem->routine(WorkItem->parameter);
+}
+
+PVOID
+ExAllocatePool2(_In_ UINT64 Flags, _In_ SIZE_T NumberOfBytes, _In_ ULONG Tag)
+{
+        UNREFERENCED_PARAMETER(Flags);
+        UNREFERENCED_PARAMETER(Tag);
+        return calloc(1, NumberOfBytes);
+}
+
+VOID
+ExFreePool(_In_ PVOID P)
+{
+        free(P);
+}
+
+VOID
+ExFreePoolWithTag(_In_ PVOID P, _In_ ULONG Tag)
+{
+        UNREFERENCED_PARAMETER(Tag);
+        free(P);
+}
+
+PVOID
+MmAllocateContiguousMemory(_In_ SIZE_T           NumberOfBytes,
+                           _In_ PHYSICAL_ADDRESS HighestAcceptableAddress)
+{
+        UNREFERENCED_PARAMETER(HighestAcceptableAddress);
+        return aligned_alloc(PAGE_SIZE, ROUND_TO_PAGES(NumberOfBytes));
+}
+
+PVOID
+MmAllocateContiguousNodeMemory(_In_ SIZE_T           NumberOfBytes,
+                               _In_ PHYSICAL_ADDRESS LowestAcceptableAddress,
+                               _In_ PHYSICAL_ADDRESS HighestAcceptableAddress,
+                               _In_ PHYSICAL_ADDRESS BoundaryAddressMultiple,
+                               _In_ ULONG            Protect,
+                               _In_ ULONG            PreferredNode)
+{
+        UNREFERENCED_PARAMETER(LowestAcceptableAddress);
+        UNREFERENCED_PARAMETER(BoundaryAddressMultiple);
+        UNREFERENCED_PARAMETER(Protect);
+        UNREFERENCED_PARAMETER(PreferredNode);
+        return MmAllocateContiguousMemory(NumberOfBytes,
+                                          HighestAcceptableAddress);
+}
+
+VOID
+MmFreeContiguousMemory(_In_ PVOID BaseAddress)
+{
+        free(BaseAddress);
+}
+
+PHYSICAL_ADDRESS
+MmGetPhysicalAddress(_In_ PVOID BaseAddress)
+{
+        PHYSICAL_ADDRESS pa = {0};
+        pa.QuadPart         = (LONGLONG)BaseAddress;
+        return pa;
+}
+
+/* a single range covering the user half of the address space */
+PPHYSICAL_MEMORY_RANGE
+MmGetPhysicalMemoryRanges()
+{
+        PPHYSICAL_MEMORY_RANGE ranges =
+                ExAllocatePool2(POOL_FLAG_NON_PAGED,
+                                2 * sizeof(PHYSICAL_MEMORY_RANGE),
+                                0);
+
+        if (!ranges)
+                return NULL;
+
+        ranges[0].NumberOfBytes.QuadPart = NTSIM_PHYSICAL_LIMIT;
+        return ranges;
+}
+
+BOOLEAN
+MmIsAddressValid(_In_ PVOID VirtualAddress)
+{
+        return VirtualAddress != NULL;
+}
+
+PVOID
+MmMapIoSpaceEx(_In_ PHYSICAL_ADDRESS PhysicalAddress,
+               _In_ SIZE_T           NumberOfBytes,
+               _In_ ULONG            Protect)
+{
+        UNREFERENCED_PARAMETER(NumberOfBytes);
+        UNREFERENCED_PARAMETER(Protect);
+        return (PVOID)PhysicalAddress.QuadPart;
+}
+
+VOID
+MmUnmapIoSpace(_In_ PVOID BaseAddress, _In_ SIZE_T NumberOfBytes)
+{
+        UNREFERENCED_PARAMETER(BaseAddress);
+        UNREFERENCED_PARAMETER(NumberOfBytes);
+}
+
+/* mdls are never handed out, so the rest is never reached */
+PMDL
+IoAllocateMdl(_In_opt_ PVOID   VirtualAddress,
+              _In_ ULONG       Length,
+              _In_ BOOLEAN     SecondaryBuffer,
+              _In_ BOOLEAN     ChargeQuota,
+              _Inout_opt_ PIRP Irp)
+{
+        UNREFERENCED_PARAMETER(VirtualAddress);
+        UNREFERENCED_PARAMETER(Length);
+        UNREFERENCED_PARAMETER(SecondaryBuffer);
+        UNREFERENCED_PARAMETER(ChargeQuota);
+        UNREFERENCED_PARAMETER(Irp);
+        return NULL;
+}
+
+VOID
+IoFreeMdl(_In_ PMDL Mdl)
+{
+        UNREFERENCED_PARAMETER(Mdl);
+}
+
+VOID
+MmBuildMdlForNonPagedPool(_Inout_ PMDL MemoryDescriptorList)
+{
+        UNREFERENCED_PARAMETER(MemoryDescriptorList);
+}
+
+VOID
+MmProbeAndLockPages(_Inout_ PMDL         MemoryDescriptorList,
+                    _In_ KPROCESSOR_MODE AccessMode,
+                    _In_ LOCK_OPERATION  Operation)
+{
+        UNREFERENCED_PARAMETER(MemoryDescriptorList);
+        UNREFERENCED_PARAMETER(AccessMode);
+        UNREFERENCED_PARAMETER(Operation);
+}
+
+VOID
+MmUnlockPages(_Inout_ PMDL MemoryDescriptorList)
+{
+        UNREFERENCED_PARAMETER(MemoryDescriptorList);
+}
+
+PULONG_PTR
+MmGetMdlPfnArray(_In_ PMDL MemoryDescriptorList)
+{
+        UNREFERENCED_PARAMETER(MemoryDescriptorList);
+        return NULL;
+}
+
+PVOID
+MmMapLockedPagesSpecifyCache(_Inout_ PMDL             MemoryDescriptorList,
+                             _In_ KPROCESSOR_MODE     AccessMode,
+                             _In_ MEMORY_CACHING_TYPE CacheType,
+                             _In_opt_ PVOID           RequestedAddress,
+                             _In_ ULONG               BugCheckOnFailure,
+                             _In_ ULONG               Priority)
+{
+        UNREFERENCED_PARAMETER(MemoryDescriptorList);
+        UNREFERENCED_PARAMETER(AccessMode);
+        UNREFERENCED_PARAMETER(CacheType);
+        UNREFERENCED_PARAMETER(RequestedAddress);
+        UNREFERENCED_PARAMETER(BugCheckOnFailure);
+        UNREFERENCED_PARAMETER(Priority);
+        return NULL;
+}
+
+VOID
+MmUnmapLockedPages(_In_ PVOID BaseAddress, _Inout_ PMDL MemoryDescriptorList)
+{
+        UNREFERENCED_PARAMETER(BaseAddress);
+        UNREFERENCED_PARAMETER(MemoryDescriptorList);
+}
+
+VOID
+RtlFillMemoryUlong(_Out_ PVOID Destination,
+                   _In_ SIZE_T Length,
+                   _In_ ULONG  Pattern)
+{
+        for (SIZE_T offset = 0; offset < Length; offset += sizeof(ULONG))
+                memcpy((PUCHAR)Destination + offset, &Pattern, sizeof(ULONG));
+}
+
+/* the number of bytes matching before a mismatch */
+SIZE_T
+RtlCompareMemoryUlong(_In_ PVOID  Source,
+                      _In_ SIZE_T Length,
+                      _In_ ULONG  Pattern)
+{
+        SIZE_T offset = 0;
+
+        for (; offset < Length; offset += sizeof(ULONG)) {
+                if (memcmp((PUCHAR)Source + offset, &Pattern, sizeof(ULONG)))
+                        break;
+        }
+
+        return offset;
+}
+
+PEPROCESS
+PsGetCurrentProcess()
+{
+        return (PEPROCESS)&process;
+}
+
+VOID
+KeStackAttachProcess(_Inout_ PEPROCESS Process, _Out_ PRKAPC_STATE ApcState)
+{
+        UNREFERENCED_PARAMETER(Process);
+        memset(ApcState, 0, sizeof(KAPC_STATE));
+}
+
+VOID
+KeUnstackDetachProcess(_In_ PRKAPC_STATE ApcState)
+{
+        UNREFERENCED_PARAMETER(ApcState);
+}
+
+VOID
+ObReferenceObject(_In_ PVOID Object)
+{
+        UNREFERENCED_PARAMETER(Object);
+}
+
+VOID
+ObDereferenceObject(_In_ PVOID Object)
+{
+        UNREFERENCED_PARAMETER(Object);
+}
+
+NTSTATUS
+ObReferenceObjectByHandle(_In_ HANDLE           Handle,
+                          _In_ ACCESS_MASK      DesiredAccess,
+                          _In_opt_ POBJECT_TYPE ObjectType,
+                          _In_ KPROCESSOR_MODE  AccessMode,
+                          _Out_ PVOID*          Object,
+                          _Out_opt_ PVOID       HandleInformation)
+{
+        UNREFERENCED_PARAMETER(Handle);
+        UNREFERENCED_PARAMETER(DesiredAccess);
+        UNREFERENCED_PARAMETER(ObjectType);
+        UNREFERENCED_PARAMETER(AccessMode);
+        UNREFERENCED_PARAMETER(HandleInformation);
+
+        *Object = NULL;
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+NTSTATUS
+ZwOpenKey(_Out_ PHANDLE           KeyHandle,
+          _In_ ACCESS_MASK        DesiredAccess,
+          _In_ OBJECT_ATTRIBUTES* ObjectAttributes)
+{
+        UNREFERENCED_PARAMETER(DesiredAccess);
+        UNREFERENCED_PARAMETER(ObjectAttributes);
+
+        *KeyHandle = NULL;
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+NTSTATUS
+ZwQueryValueKey(_In_ HANDLE                      KeyHandle,
+                _In_ PUNICODE_STRING             ValueName,
+                _In_ KEY_VALUE_INFORMATION_CLASS Class,
+                _Out_opt_ PVOID                  KeyValueInformation,
+                _In_ ULONG                       Length,
+                _Out_ PULONG                     ResultLength)
+{
+        UNREFERENCED_PARAMETER(KeyHandle);
+        UNREFERENCED_PARAMETER(ValueName);
+        UNREFERENCED_PARAMETER(Class);
+        UNREFERENCED_PARAMETER(KeyValueInformation);
+        UNREFERENCED_PARAMETER(Length);
+
+        *ResultLength = 0;
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+NTSTATUS
+ZwClose(_In_ HANDLE Handle)
+{
+        UNREFERENCED_PARAMETER(Handle);
+        return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ExCreateCallback(_Out_ PCALLBACK_OBJECT* CallbackObject,
+                 _In_ OBJECT_ATTRIBUTES* ObjectAttributes,
+                 _In_ BOOLEAN            Create,
+                 _In_ BOOLEAN            AllowMultipleCallbacks)
+{
+        UNREFERENCED_PARAMETER(ObjectAttributes);
+        UNREFERENCED_PARAMETER(Create);
+        UNREFERENCED_PARAMETER(AllowMultipleCallbacks);
+
+        *CallbackObject = NULL;
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+PVOID
+ExRegisterCallback(_Inout_ PCALLBACK_OBJECT CallbackObject,
+                   _In_ PCALLBACK_FUNCTION  CallbackFunction,
+                   _In_opt_ PVOID           CallbackContext)
+{
+        UNREFERENCED_PARAMETER(CallbackObject);
+        UNREFERENCED_PARAMETER(CallbackFunction);
+        UNREFERENCED_PARAMETER(CallbackContext);
+        return NULL;
+}
+
+VOID
+ExUnregisterCallback(_Inout_ PVOID CallbackRegistration)
+{
+        UNREFERENCED_PARAMETER(CallbackRegistration);
+}
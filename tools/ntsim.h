@@ -0,0 +1,56 @@
+#ifndef NTSIM_H
+#define NTSIM_H
+
+/*
+ * ntsim - the kernel behind hv/ntshim.h, for the driver built whole in user
+ * mode with HWSIM defined.
+ *
+ * Memory comes from the heap with every physical address the same as its
+ * virtual address, the processor groups are whatever NtSimSetTopology said
+ * with the current core the one hwsim was last pointed at, dpcs broadcast to
+ * each core in turn on the calling thread and nothing is ever deferred.
+ * Whatever the driver asks of the rest of the system, the registry, callbacks
+ * or other processes, fails the same way it would if the object didn't exist.
+ */
+#include <setjmp.h>
+
+#include "common.h"
+
+typedef struct _NTSIM_BUGCHECK {
+        ULONG     code;
+        ULONG_PTR parameters[4];
+
+} NTSIM_BUGCHECK, *PNTSIM_BUGCHECK;
+
+/* one core, no bugcheck expected and debug output off */
+VOID
+NtSimReset();
+
+/*
+ * One active mask per group, bit n set if the group relative processor n is
+ * active. Returns -1 for more groups than the kernel supports or no active
+ * processor at all.
+ */
+int
+NtSimSetTopology(_In_ const UINT64* ActiveMasks, _In_ UINT32 GroupCount);
+
+/* Count cores in group 0, returns -1 for a count a single group can't hold */
+int
+NtSimSetProcessorCount(_In_ UINT32 Count);
+
+/*
+ * The next KeBugCheckEx longjmps to Target with a value of 1 rather than
+ * aborting, once. NULL disarms it again.
+ */
+VOID
+NtSimExpectBugCheck(_In_opt_ jmp_buf* Target);
+
+/* the code and parameters of the last bugcheck taken */
+VOID
+NtSimGetBugCheck(_Out_ PNTSIM_BUGCHECK BugCheck);
+
+/* DEBUG_LOG and DEBUG_ERROR are written to stderr when set */
+VOID
+NtSimSetVerbose(_In_ BOOLEAN Verbose);
+
+#endif
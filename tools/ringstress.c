@@ -0,0 +1,268 @@
+/*
+ * ringstress - shared memory harness for the trace ring protocol in trace.h.
+ *
+ * A producer thread publishes records into a ring exactly as the driver does,
+ * through TraceRingPublish, while a reader drains it through
+ * TraceRingNextRecord from a second, read only mapping of the same memory,
+ * the way tracedump reads the rings the driver maps into it. The reader stalls
+ * every so often so the producer laps it. Every record carries its own index
+ * and a pattern derived from it, so the reader can check that records arrive
+ * in order and untorn, and that what it is told was lost is exactly the gap it
+ * sees. Once the producer is done, read and lost have to add up to everything
+ * that was written.
+ *
+ * Linux only, as it is built around pthreads and memfd:
+ *
+ *   cc -O2 -pthread -I../hv -o ringstress ringstress.c
+ *
+ * usage: ringstress [records] [capacity] [records between reader stalls]
+ *
+ * A stall interval of 0 lets the reader run flat out.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define STRESS_PATTERN_COUNT 7
+
+typedef struct _STRESS_RECORD {
+        UINT64 index;
+        UINT64 pattern[STRESS_PATTERN_COUNT];
+
+} STRESS_RECORD, *PSTRESS_RECORD;
+
+typedef struct _STRESS_CONTEXT {
+        PTRACE_RING_HEADER ring;
+        UINT64             records;
+        volatile int       done;
+
+} STRESS_CONTEXT, *PSTRESS_CONTEXT;
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s\n", What);
+        failures++;
+}
+
+static UINT64
+Pattern(UINT64 Index, unsigned Word)
+{
+        return (Index + 1) * 0x9E3779B97F4A7C15ull ^ Word;
+}
+
+static void
+Produce(PTRACE_RING_HEADER Ring)
+{
+        PSTRESS_RECORD record =
+            (PSTRESS_RECORD)TRACE_RING_RECORD(Ring, Ring->head);
+
+        record->index = Ring->head;
+
+        for (unsigned word = 0; word < STRESS_PATTERN_COUNT; word++)
+                record->pattern[word] = Pattern(Ring->head, word);
+
+        TraceRingPublish(Ring);
+}
+
+static int
+Intact(const STRESS_RECORD* Record)
+{
+        for (unsigned word = 0; word < STRESS_PATTERN_COUNT; word++) {
+                if (Record->pattern[word] != Pattern(Record->index, word))
+                        return 0;
+        }
+
+        return 1;
+}
+
+static void*
+ProducerThread(void* Argument)
+{
+        PSTRESS_CONTEXT context = Argument;
+
+        for (UINT64 index = 0; index < context->records; index++)
+                Produce(context->ring);
+
+        TRACE_COMPILER_BARRIER();
+        context->done = 1;
+        return NULL;
+}
+
+/*
+ * Maps Size bytes of shared memory twice, writable for the producer and read
+ * only for the reader, as the driver and tracedump see a ring.
+ */
+static int
+MapRing(size_t Size, PTRACE_RING_HEADER* Producer, PTRACE_RING_HEADER* Reader)
+{
+        int fd = memfd_create("ringstress", 0);
+
+        if (fd < 0 || ftruncate(fd, Size)) {
+                perror("memfd_create");
+                return 0;
+        }
+
+        *Producer = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        *Reader   = mmap(NULL, Size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (*Producer == MAP_FAILED || *Reader == MAP_FAILED) {
+                perror("mmap");
+                return 0;
+        }
+
+        return 1;
+}
+
+/* A reader that starts from zero after the producer has lapped it. */
+static void
+CheckLapped(PTRACE_RING_HEADER Producer, PTRACE_RING_HEADER Reader)
+{
+        STRESS_RECORD record   = {0};
+        UINT64        capacity = Producer->capacity;
+        UINT64        cursor   = 0;
+        UINT64        lost     = 0;
+        UINT64        read     = 0;
+        int           ordered  = 1;
+
+        for (UINT64 index = 0; index < 3 * capacity; index++)
+                Produce(Producer);
+
+        Check(Reader->tail == 2 * capacity + 1,
+              "tail is one past the slot being rewritten");
+
+        while (TraceRingNextRecord(Reader, &cursor, &lost, &record)) {
+                ordered &= record.index == 2 * capacity + 1 + read;
+                read++;
+        }
+
+        Check(read == capacity - 1, "a full ring holds capacity - 1 records");
+        Check(lost == 2 * capacity + 1, "everything before tail is lost");
+        Check(ordered, "a lapped reader resumes at tail, in order");
+
+        /* a reader that starts at tail has lost nothing */
+        cursor = Reader->tail;
+        lost   = 0;
+        read   = 0;
+
+        while (TraceRingNextRecord(Reader, &cursor, &lost, &record))
+                read++;
+
+        Check(read == capacity - 1 && !lost,
+              "catching up from tail reports nothing lost");
+}
+
+static void
+CheckConcurrent(PTRACE_RING_HEADER Producer,
+                PTRACE_RING_HEADER Reader,
+                UINT64             Records,
+                UINT64             StallEvery)
+{
+        STRESS_CONTEXT context = {.ring = Producer, .records = Records};
+        STRESS_RECORD  record  = {0};
+        pthread_t      thread  = {0};
+        UINT64         start   = Producer->head;
+        UINT64         cursor  = start;
+        UINT64         lost    = 0;
+        UINT64         before  = 0;
+        UINT64         read    = 0;
+        UINT64         stalls  = 0;
+        UINT64         next    = start;
+        int            ordered = 1;
+        int            intact  = 1;
+        int            counted = 1;
+
+        if (pthread_create(&thread, NULL, ProducerThread, &context)) {
+                Check(0, "producer thread creation");
+                return;
+        }
+
+        for (;;) {
+                int done = context.done;
+
+                TRACE_COMPILER_BARRIER();
+
+                while (TraceRingNextRecord(Reader, &cursor, &lost, &record)) {
+                        /*
+                         * whatever was skipped since the last record, even by
+                         * a call that then found nothing, is exactly the gap
+                         */
+                        counted &= record.index - next == lost - before;
+                        ordered &= record.index >= next;
+                        intact &= Intact(&record);
+                        next   = record.index + 1;
+                        before = lost;
+                        read++;
+
+                        if (!StallEvery || read % StallEvery)
+                                continue;
+
+                        stalls++;
+                        usleep(50);
+                }
+
+                if (done)
+                        break;
+        }
+
+        pthread_join(thread, NULL);
+
+        printf("concurrent: %llu written, %llu read, %llu lost, %llu stalls\n",
+               (unsigned long long)Records,
+               (unsigned long long)read,
+               (unsigned long long)lost,
+               (unsigned long long)stalls);
+
+        Check(ordered, "records arrive in the order they were written");
+        Check(intact, "no record that passes validation is torn");
+        Check(counted, "lost counts match the gaps the reader sees");
+        Check(read + lost == Records, "every record is read or counted lost");
+        Check(cursor == Producer->head, "the reader catches up with head");
+}
+
+int
+main(int argc, char** argv)
+{
+        UINT64 records  = argc > 1 ? strtoull(argv[1], NULL, 0) : 10000000;
+        UINT64 capacity = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x1000;
+        UINT64 stall    = argc > 3 ? strtoull(argv[3], NULL, 0) : 10000;
+        PTRACE_RING_HEADER producer = NULL;
+        PTRACE_RING_HEADER reader   = NULL;
+        size_t             size     = 0;
+
+        if (capacity < 2 || capacity & (capacity - 1)) {
+                fprintf(stderr, "the capacity must be a power of two\n");
+                return 1;
+        }
+
+        size = TRACE_RING_SIZE(capacity, sizeof(STRESS_RECORD));
+
+        if (!MapRing(size, &producer, &reader))
+                return 1;
+
+        producer->capacity    = (UINT32)capacity;
+        producer->record_size = sizeof(STRESS_RECORD);
+
+        CheckLapped(producer, reader);
+        CheckConcurrent(producer, reader, records, stall);
+
+        printf("selftest: %u checks, %u failures\n", checks, failures);
+
+        munmap(reader, size);
+        munmap(producer, size);
+        return failures ? 1 : 0;
+}
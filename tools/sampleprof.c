@@ -0,0 +1,540 @@
+/*
+ * sampleprof - records and reports the hypervisor's sampling profiler.
+ *
+ * While sampling is enabled (IOCTL_HV_SET_SAMPLING) every virtualised core
+ * arms its vmx preemption timer, and each expiry writes a SAMPLE_RECORD with
+ * the guest rip, cr3 and cpl to a per core ring (see hv/trace.h). As the timer
+ * runs below the guest, samples land in code running with interrupts disabled
+ * or at high irql just as well as anywhere else.
+ *
+ * On Windows, "record" samples every core at the given frequency for the
+ * given number of seconds and drains the rings into a sample file, -s also
+ * scanning the guests kernel stack on each sample. "report" reads a sample
+ * file on either Windows or Linux and prints the hottest (rip, cr3, cpl)
+ * triples, along with the hottest callers if stacks were sampled.
+ *
+ * "selftest" runs the sample ring, the stack scan and the aggregation in
+ * sample.c against synthetic input with known answers, on any platform.
+ *
+ *   cc -O2 -I../hv -o sampleprof sampleprof.c ../hv/sample.c
+ *
+ * usage: sampleprof record <sample file> <seconds> <hz> [-s]
+ *        sampleprof report <sample file> [top n]
+ *        sampleprof selftest
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sample.h"
+#include "ioctl.h"
+
+#ifdef _WIN32
+#        include <windows.h>
+#        include <intrin.h>
+#endif
+
+#define SAMPLE_FILE_MAGIC   0x50535648 /* HVSP */
+#define SAMPLE_FILE_VERSION 1
+
+/* a power of 2, enough distinct rips for a few minutes of sampling */
+#define REPORT_BUCKETS 0x40000
+
+typedef struct _SAMPLE_FILE_HEADER {
+        UINT32 magic;
+        UINT16 version;
+        UINT16 record_size;
+        UINT32 core_count;
+        UINT32 reserved;
+
+} SAMPLE_FILE_HEADER, *PSAMPLE_FILE_HEADER;
+
+static void
+PrintProfile(const char* Title, const SAMPLE_PROFILE* Profile, unsigned Top)
+{
+        printf("\n%s: %llu samples, %u distinct, %llu dropped\n",
+               Title,
+               (unsigned long long)Profile->total,
+               Profile->used,
+               (unsigned long long)Profile->dropped);
+        printf("%-20s %-18s %3s %12s %8s\n",
+               "rip",
+               "cr3",
+               "cpl",
+               "samples",
+               "share");
+
+        for (UINT32 index = 0; index < Profile->used && index < Top; index++) {
+                const SAMPLE_BUCKET* bucket = &Profile->buckets[index];
+
+                printf("%#-20llx %#-18llx %3u %12llu %7.2f%%\n",
+                       (unsigned long long)bucket->rip,
+                       (unsigned long long)bucket->cr3,
+                       bucket->cpl,
+                       (unsigned long long)bucket->count,
+                       100.0 * bucket->count / Profile->total);
+        }
+}
+
+static int
+Report(const char* Path, unsigned Top)
+{
+        SAMPLE_FILE_HEADER header  = {0};
+        SAMPLE_RECORD      record  = {0};
+        SAMPLE_PROFILE     rips    = {0};
+        SAMPLE_PROFILE     callers = {0};
+        PSAMPLE_BUCKET     buckets = NULL;
+        int                status  = -1;
+        FILE*              file    = fopen(Path, "rb");
+
+        if (!file) {
+                fprintf(stderr, "sampleprof: unable to open %s\n", Path);
+                return -1;
+        }
+
+        if (fread(&header, sizeof(header), 1, file) != 1 ||
+            header.magic != SAMPLE_FILE_MAGIC ||
+            header.version != SAMPLE_FILE_VERSION ||
+            header.record_size != sizeof(SAMPLE_RECORD)) {
+                fprintf(stderr, "sampleprof: %s is not a sample file\n", Path);
+                goto end;
+        }
+
+        buckets = malloc(2 * REPORT_BUCKETS * sizeof(SAMPLE_BUCKET));
+
+        if (!buckets)
+                goto end;
+
+        SampleProfileInitialise(&rips, buckets, REPORT_BUCKETS);
+        SampleProfileInitialise(
+            &callers, buckets + REPORT_BUCKETS, REPORT_BUCKETS);
+
+        while (fread(&record, sizeof(record), 1, file) == 1) {
+                SampleProfileAdd(
+                    &rips, record.guest_rip, record.guest_cr3, record.cpl);
+
+                if (record.frame_count)
+                        SampleProfileAdd(&callers,
+                                         record.frames[0],
+                                         record.guest_cr3,
+                                         record.cpl);
+        }
+
+        SampleProfileSort(&rips);
+        SampleProfileSort(&callers);
+
+        printf("%s: %u cores\n", Path, header.core_count);
+        PrintProfile("rips", &rips, Top);
+
+        if (callers.total)
+                PrintProfile("callers", &callers, Top);
+
+        status = 0;
+
+end:
+        free(buckets);
+        fclose(file);
+        return status;
+}
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s\n", What);
+        failures++;
+}
+
+/* the same steps as TraceRingReserve and TraceRingCommit in the driver */
+static void
+Produce(PTRACE_RING_HEADER Ring, UINT64 Rip, UINT8 Cpl)
+{
+        PSAMPLE_RECORD record = (PSAMPLE_RECORD)TRACE_RING_RECORD(Ring,
+                                                                  Ring->head);
+
+        memset(record, 0, sizeof(SAMPLE_RECORD));
+        record->guest_rip = Rip;
+        record->guest_cr3 = 0x1AD000;
+        record->cpl       = Cpl;
+
+        TraceRingPublish(Ring);
+}
+
+static UINT64
+Drain(PTRACE_RING_HEADER Ring,
+      UINT64*            Cursor,
+      UINT64*            Lost,
+      PSAMPLE_PROFILE    Profile)
+{
+        SAMPLE_RECORD record = {0};
+        UINT64        count  = 0;
+
+        while (TraceRingNextRecord(Ring, Cursor, Lost, &record)) {
+                SampleProfileAdd(
+                    Profile, record.guest_rip, record.guest_cr3, record.cpl);
+                count++;
+        }
+
+        return count;
+}
+
+static void
+SelfTestRing(void)
+{
+        SAMPLE_BUCKET      buckets[64] = {0};
+        SAMPLE_PROFILE     profile     = {0};
+        PTRACE_RING_HEADER ring        = NULL;
+        UINT64             cursor      = 0;
+        UINT64             lost        = 0;
+        UINT64             drained     = 0;
+
+        ring = calloc(1, TRACE_RING_SIZE(64, sizeof(SAMPLE_RECORD)));
+
+        if (!ring) {
+                Check(0, "ring allocation");
+                return;
+        }
+
+        ring->capacity    = 64;
+        ring->record_size = sizeof(SAMPLE_RECORD);
+
+        /* 7 rips, the nth taken n + 1 times per round, drained every 28 */
+        SampleProfileInitialise(&profile, buckets, 64);
+
+        for (unsigned round = 0; round < 100; round++) {
+                for (unsigned rip = 0; rip < 7; rip++) {
+                        for (unsigned repeat = 0; repeat <= rip; repeat++)
+                                Produce(ring, 0xFFFFF80000001000ull + rip, 0);
+                }
+
+                drained += Drain(ring, &cursor, &lost, &profile);
+        }
+
+        SampleProfileSort(&profile);
+
+        Check(drained == 2800 && !lost, "every sample drained in time");
+        Check(profile.used == 7, "one bucket per rip");
+        Check(profile.buckets[0].rip == 0xFFFFF80000001006ull &&
+                  profile.buckets[0].count == 700,
+              "hottest rip first with its exact count");
+        Check(profile.buckets[6].rip == 0xFFFFF80000001000ull &&
+                  profile.buckets[6].count == 100,
+              "coldest rip last with its exact count");
+
+        /* a reader that falls behind loses the oldest samples, and says so */
+        lost    = 0;
+        drained = 0;
+        SampleProfileInitialise(&profile, buckets, 64);
+
+        for (unsigned index = 0; index < 200; index++)
+                Produce(ring, 0x7FF600001000ull, 3);
+
+        drained = Drain(ring, &cursor, &lost, &profile);
+        SampleProfileSort(&profile);
+
+        /* the oldest slot is the one the producer writes next, so it is lost */
+        Check(drained == 63, "a full ring holds capacity - 1 readable samples");
+        Check(lost == 137, "overwritten samples are counted as lost");
+        Check(profile.used == 1 && profile.buckets[0].cpl == 3,
+              "user mode samples keep their cpl");
+
+        free(ring);
+}
+
+static void
+SelfTestStackScan(void)
+{
+        const UINT64 rsp       = 0xFFFFA00012345FC0ull;
+        UINT64       stack[8]  = {0};
+        UINT64       frames[SAMPLE_MAX_FRAMES] = {0};
+        UINT32       found     = 0;
+
+        Check(SampleStackWindow(rsp) == 8, "window stops at the page end");
+        Check(SampleStackWindow(0xFFFFA00012345000ull) == SAMPLE_SCAN_QWORDS,
+              "window is capped at SAMPLE_SCAN_QWORDS");
+
+        stack[0] = 0x10;                   /* a spilled integer */
+        stack[1] = 0xFFFFF80012340010ull;  /* return address */
+        stack[2] = rsp + 0x40;             /* saved frame within the stack */
+        stack[3] = 0x7FF612340000ull;      /* user mode address */
+        stack[4] = 0xFFFFF80012350020ull;  /* return address */
+        stack[5] = rsp - 0x100;            /* below the stack pointer */
+        stack[6] = 0xFFFFF80012360030ull;  /* return address */
+        stack[7] = 0xFFFFF80012370040ull;  /* return address */
+
+        found = SampleScanStack(stack, SampleStackWindow(rsp), rsp, frames);
+
+        Check(found == 4, "stack scan finds every return address");
+        Check(frames[0] == stack[1] && frames[1] == stack[4] &&
+                  frames[2] == stack[6] && frames[3] == stack[7],
+              "stack scan keeps the order frames were found in");
+
+        found = SampleScanStack(stack, 2, rsp, frames);
+        Check(found == 1, "stack scan stays within count");
+}
+
+static void
+SelfTestProfile(void)
+{
+        SAMPLE_BUCKET  buckets[16] = {0};
+        SAMPLE_PROFILE profile     = {0};
+
+        SampleProfileInitialise(&profile, buckets, 16);
+
+        for (UINT64 rip = 0; rip < 20; rip++)
+                for (UINT64 repeat = 0; repeat < rip + 1; repeat++)
+                        SampleProfileAdd(&profile, 0x1000 + rip, 0, 0);
+
+        SampleProfileSort(&profile);
+
+        Check(profile.used == 12, "profile stops at three quarters full");
+        Check(profile.total == 210, "every sample is counted in total");
+        Check(profile.dropped == 210 - 78, "samples without a bucket drop");
+        Check(profile.buckets[0].count == 12 &&
+                  profile.buckets[11].count == 1,
+              "profile sorts highest count first");
+
+        SampleProfileInitialise(&profile, buckets, 16);
+        SampleProfileAdd(&profile, 0x1000, 0x1000, 0);
+        SampleProfileAdd(&profile, 0x1000, 0x2000, 0);
+        SampleProfileAdd(&profile, 0x1000, 0x1000, 3);
+
+        Check(profile.used == 3, "cr3 and cpl are part of the key");
+}
+
+static int
+SelfTest(void)
+{
+        SelfTestRing();
+        SelfTestStackScan();
+        SelfTestProfile();
+
+        printf("selftest: %u checks, %u failures\n", checks, failures);
+        return failures ? -1 : 0;
+}
+
+#ifdef _WIN32
+#        define RECORD_BATCH 256
+
+/* tsc ticks per second, measured against the performance counter */
+static UINT64
+CalibrateTsc(void)
+{
+        LARGE_INTEGER frequency = {0};
+        LARGE_INTEGER start     = {0};
+        LARGE_INTEGER end       = {0};
+        UINT64        tsc       = 0;
+
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+        tsc = __rdtsc();
+        Sleep(100);
+        tsc = __rdtsc() - tsc;
+        QueryPerformanceCounter(&end);
+
+        return tsc * frequency.QuadPart / (end.QuadPart - start.QuadPart);
+}
+
+static BOOL
+SetSampling(HANDLE Device, UINT64 Interval, UINT32 Flags)
+{
+        HV_SAMPLING_REQUEST request  = {0};
+        DWORD               returned = 0;
+
+        request.interval = Interval;
+        request.flags    = Flags;
+
+        return DeviceIoControl(Device,
+                               IOCTL_HV_SET_SAMPLING,
+                               &request,
+                               sizeof(request),
+                               NULL,
+                               0,
+                               &returned,
+                               NULL);
+}
+
+/* returns the number of samples written, or -1 on failure */
+static long
+DrainCore(HANDLE                   Device,
+          UINT32                   Core,
+          UINT64*                  Cursor,
+          UINT64*                  Lost,
+          PHV_SAMPLE_READ_RESPONSE Response,
+          DWORD                    Size,
+          FILE*                    File)
+{
+        HV_SAMPLE_READ_REQUEST request  = {0};
+        DWORD                  returned = 0;
+
+        request.core   = Core;
+        request.cursor = *Cursor;
+
+        /* excluded cores have no ring */
+        if (!DeviceIoControl(Device,
+                             IOCTL_HV_READ_SAMPLES,
+                             &request,
+                             sizeof(request),
+                             Response,
+                             Size,
+                             &returned,
+                             NULL))
+                return GetLastError() == ERROR_NOT_FOUND ? 0 : -1;
+
+        *Cursor = Response->cursor;
+        *Lost += Response->lost;
+
+        if (fwrite(Response->records,
+                   sizeof(SAMPLE_RECORD),
+                   Response->record_count,
+                   File) != Response->record_count)
+                return -1;
+
+        return (long)Response->record_count;
+}
+
+static int
+Record(const char* Path, unsigned Seconds, unsigned Hz, UINT32 Flags)
+{
+        SAMPLE_FILE_HEADER       header   = {0};
+        PHV_SAMPLE_READ_RESPONSE response = NULL;
+        UINT64*                  cursors  = NULL;
+        UINT64                   interval = 0;
+        UINT64                   lost     = 0;
+        UINT64                   written  = 0;
+        DWORD                    size     = 0;
+        DWORD                    start    = 0;
+        long                     drained  = 0;
+        int                      status   = -1;
+        UINT32                   cores    = 0;
+        FILE*                    file     = NULL;
+        HANDLE                   device   = CreateFileA(HV_DEVICE_PATH,
+                                     GENERIC_READ | GENERIC_WRITE,
+                                     0,
+                                     NULL,
+                                     OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL,
+                                     NULL);
+
+        if (device == INVALID_HANDLE_VALUE) {
+                fprintf(stderr,
+                        "sampleprof: unable to open %s (%lu)\n",
+                        HV_DEVICE_PATH,
+                        GetLastError());
+                return -1;
+        }
+
+        cores    = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+        size     = (DWORD)HV_SAMPLE_READ_RESPONSE_SIZE(RECORD_BATCH);
+        response = malloc(size);
+        cursors  = calloc(cores, sizeof(UINT64));
+        file     = fopen(Path, "wb");
+
+        if (!response || !cursors || !file)
+                goto end;
+
+        header.magic       = SAMPLE_FILE_MAGIC;
+        header.version     = SAMPLE_FILE_VERSION;
+        header.record_size = sizeof(SAMPLE_RECORD);
+        header.core_count  = cores;
+
+        if (fwrite(&header, sizeof(header), 1, file) != 1)
+                goto end;
+
+        interval = CalibrateTsc() / Hz;
+
+        if (!SetSampling(device, interval, Flags)) {
+                fprintf(stderr,
+                        "sampleprof: unable to sample every %llu cycles "
+                        "(%lu)\n",
+                        (unsigned long long)interval,
+                        GetLastError());
+                goto end;
+        }
+
+        start = GetTickCount();
+
+        do {
+                for (UINT32 core = 0; core < cores; core++) {
+                        drained = DrainCore(device,
+                                            core,
+                                            &cursors[core],
+                                            &lost,
+                                            response,
+                                            size,
+                                            file);
+
+                        if (drained < 0) {
+                                SetSampling(device, 0, 0);
+                                goto end;
+                        }
+
+                        written += drained;
+                }
+
+                Sleep(10);
+        } while (GetTickCount() - start < Seconds * 1000);
+
+        SetSampling(device, 0, 0);
+        status = 0;
+
+        printf("sampleprof: %llu samples recorded, %llu lost\n",
+               (unsigned long long)written,
+               (unsigned long long)lost);
+
+end:
+        if (file)
+                fclose(file);
+
+        free(response);
+        free(cursors);
+        CloseHandle(device);
+        return status;
+}
+#endif
+
+int
+main(int argc, char** argv)
+{
+        if (argc == 2 && !strcmp(argv[1], "selftest"))
+                return SelfTest() ? 1 : 0;
+
+        if ((argc == 3 || argc == 4) && !strcmp(argv[1], "report")) {
+                unsigned top = argc == 4 ? (unsigned)atoi(argv[3]) : 32;
+
+                return Report(argv[2], top) ? 1 : 0;
+        }
+
+#ifdef _WIN32
+        if ((argc == 5 || argc == 6) && !strcmp(argv[1], "record") &&
+            atoi(argv[4]) > 0) {
+                UINT32 flags = 0;
+
+                if (argc == 6 && !strcmp(argv[5], "-s"))
+                        flags |= HV_SAMPLING_STACKS;
+
+                return Record(argv[2],
+                              (unsigned)atoi(argv[3]),
+                              (unsigned)atoi(argv[4]),
+                              flags) ?
+                           1 :
+                           0;
+        }
+#endif
+
+        fprintf(stderr, "usage: %s report <sample file> [top n]\n", argv[0]);
+        fprintf(stderr, "       %s selftest\n", argv[0]);
+#ifdef _WIN32
+        fprintf(stderr,
+                "       %s record <sample file> <seconds> <hz> [-s]\n",
+                argv[0]);
+#endif
+        return 1;
+}
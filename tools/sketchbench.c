@@ -0,0 +1,256 @@
+/*
+ * sketchbench - accuracy and throughput of the exit hotspot sketch.
+ *
+ * Builds the driver's sketch.c as is and feeds it a synthetic stream of
+ * (rip, exit reason) pairs whose frequencies follow a Zipf distribution, which
+ * is roughly what a guest with a handful of hot exiting instructions looks
+ * like. Every pair is also counted exactly, so the sketch can be checked
+ * against the truth:
+ *
+ *   - every counter must satisfy count - error <= true count <= count
+ *   - every pair above total / SKETCH_COUNTERS must hold a counter
+ *   - the recall of the top N, and the worst overestimate seen
+ *
+ * Runs on Linux or Windows:
+ *
+ *   cc -O2 -I../hv -o sketchbench sketchbench.c ../hv/sketch.c -lm
+ *
+ * usage: sketchbench [updates] [distinct pairs] [zipf exponent] [top n]
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sketch.h"
+
+typedef struct _EXACT_PAIR {
+        UINT64 rip;
+        UINT32 reason;
+        UINT64 count;
+
+} EXACT_PAIR, *PEXACT_PAIR;
+
+/* xorshift, the C library rand is too slow and too short on some platforms */
+static UINT64 random_state = 0x2545F4914F6CDD1Dull;
+
+static UINT64
+NextRandom(void)
+{
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        return random_state;
+}
+
+static double
+NowSeconds(void)
+{
+        return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static int
+CompareExact(const void* Left, const void* Right)
+{
+        const EXACT_PAIR* left  = Left;
+        const EXACT_PAIR* right = Right;
+
+        if (left->count != right->count)
+                return left->count < right->count ? 1 : -1;
+
+        return 0;
+}
+
+static const SKETCH_COUNTER*
+FindCounter(const EXIT_SKETCH* Sketch, const EXACT_PAIR* Pair)
+{
+        for (UINT32 index = 0; index < Sketch->used; index++) {
+                const SKETCH_COUNTER* counter = &Sketch->counters[index];
+
+                if (counter->rip == Pair->rip &&
+                    counter->reason == Pair->reason)
+                        return counter;
+        }
+
+        return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+        size_t       updates  = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000000;
+        size_t       distinct = argc > 2 ? strtoul(argv[2], NULL, 0) : 10000;
+        double       exponent = argc > 3 ? atof(argv[3]) : 1.1;
+        UINT32       top      = argc > 4 ? strtoul(argv[4], NULL, 0) : 16;
+        PEXACT_PAIR  pairs    = NULL;
+        double*      cdf      = NULL;
+        UINT32*      stream   = NULL;
+        EXIT_SKETCH  sketch   = {0};
+        EXIT_SKETCH  sorted   = {0};
+        double       total    = 0;
+        double       start    = 0;
+        double       elapsed  = 0;
+        UINT64       bound    = 0;
+        UINT64       worst    = 0;
+        UINT32       found    = 0;
+        unsigned     failures = 0;
+
+        if (!updates || !distinct || top > SKETCH_COUNTERS) {
+                fprintf(stderr,
+                        "usage: %s [updates] [distinct pairs] [zipf exponent] "
+                        "[top n <= %u]\n",
+                        argv[0],
+                        SKETCH_COUNTERS);
+                return 1;
+        }
+
+        pairs  = calloc(distinct, sizeof(EXACT_PAIR));
+        cdf    = calloc(distinct, sizeof(double));
+        stream = calloc(updates, sizeof(UINT32));
+
+        if (!pairs || !cdf || !stream)
+                return 1;
+
+        for (size_t index = 0; index < distinct; index++) {
+                pairs[index].rip =
+                    0xFFFFF80000000000ull + NextRandom() % 0x1000000;
+                pairs[index].reason = (UINT32)(NextRandom() % 64);
+                total += 1.0 / pow((double)(index + 1), exponent);
+                cdf[index] = total;
+        }
+
+        /* draw the stream up front so only the sketch itself is timed */
+        for (size_t index = 0; index < updates; index++) {
+                double draw =
+                    (double)(NextRandom() >> 11) / (1ull << 53) * total;
+                size_t low  = 0;
+                size_t high = distinct - 1;
+
+                while (low < high) {
+                        size_t middle = (low + high) / 2;
+
+                        if (cdf[middle] < draw)
+                                low = middle + 1;
+                        else
+                                high = middle;
+                }
+
+                stream[index] = (UINT32)low;
+                pairs[low].count++;
+        }
+
+        SketchInitialise(&sketch);
+
+        start = NowSeconds();
+
+        for (size_t index = 0; index < updates; index++)
+                SketchUpdate(&sketch,
+                             pairs[stream[index]].rip,
+                             pairs[stream[index]].reason);
+
+        elapsed = NowSeconds() - start;
+
+        bound = sketch.total / SKETCH_COUNTERS;
+
+        for (size_t index = 0; index < distinct; index++) {
+                const SKETCH_COUNTER* counter =
+                    FindCounter(&sketch, &pairs[index]);
+
+                if (!counter) {
+                        if (pairs[index].count > bound) {
+                                printf("FAIL: pair %zu with %llu exits has no "
+                                       "counter\n",
+                                       index,
+                                       (unsigned long long)pairs[index].count);
+                                failures++;
+                        }
+                        continue;
+                }
+
+                if (counter->count < pairs[index].count ||
+                    counter->count - counter->error > pairs[index].count) {
+                        printf("FAIL: pair %zu true %llu, count %llu, error "
+                               "%llu\n",
+                               index,
+                               (unsigned long long)pairs[index].count,
+                               (unsigned long long)counter->count,
+                               (unsigned long long)counter->error);
+                        failures++;
+                }
+
+                if (counter->count - pairs[index].count > worst)
+                        worst = counter->count - pairs[index].count;
+        }
+
+        /* sorting the counters invalidates the index, so sort a snapshot */
+        if (!SketchSnapshot(&sketch, &sorted)) {
+                printf("FAIL: snapshot of an idle sketch was torn\n");
+                failures++;
+        }
+
+        SketchSortCounters(sorted.counters, sorted.used);
+        qsort(pairs, distinct, sizeof(EXACT_PAIR), CompareExact);
+
+        for (UINT32 rank = 0; rank < top && rank < distinct; rank++) {
+                for (UINT32 index = 0; index < top && index < sorted.used;
+                     index++) {
+                        if (sorted.counters[index].rip == pairs[rank].rip &&
+                            sorted.counters[index].reason ==
+                                pairs[rank].reason) {
+                                found++;
+                                break;
+                        }
+                }
+        }
+
+        printf("%zu updates over %zu distinct pairs, zipf %.2f, %u counters\n",
+               updates,
+               distinct,
+               exponent,
+               SKETCH_COUNTERS);
+        printf("throughput:         %.1f ns per update\n",
+               elapsed * 1e9 / updates);
+        printf("top %u recall:      %u / %u\n", top, found, top);
+        printf("worst overestimate: %llu exits (bound %llu)\n",
+               (unsigned long long)worst,
+               (unsigned long long)bound);
+
+        printf("\n%-4s %-20s %-6s %12s %12s %12s\n",
+               "rank",
+               "rip",
+               "reason",
+               "true",
+               "count",
+               "error");
+
+        for (UINT32 rank = 0; rank < top && rank < sorted.used; rank++) {
+                const SKETCH_COUNTER* counter = &sorted.counters[rank];
+                UINT64                truth   = 0;
+
+                for (size_t index = 0; index < distinct; index++) {
+                        if (pairs[index].rip == counter->rip &&
+                            pairs[index].reason == counter->reason) {
+                                truth = pairs[index].count;
+                                break;
+                        }
+                }
+
+                printf("%-4u %#-20llx %-6u %12llu %12llu %12llu\n",
+                       rank,
+                       (unsigned long long)counter->rip,
+                       counter->reason,
+                       (unsigned long long)truth,
+                       (unsigned long long)counter->count,
+                       (unsigned long long)counter->error);
+        }
+
+        free(pairs);
+        free(cdf);
+        free(stream);
+
+        if (failures)
+                printf("\n%u failures\n", failures);
+
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,762 @@
+/*
+ * steptrace - records and decodes the hypervisor's step traces.
+ *
+ * Once the tracer is armed (IOCTL_HV_SET_STEP_TRACE), a breakpoint set with
+ * "breakpoints set <address> trace" starts a trace on the core that hits it,
+ * which then writes a STEP_RECORD (see hv/trace.h) for every instruction it
+ * runs to its step ring, single stepped with the monitor trap flag, until the
+ * trace stops at max steps, rip leaving the range, or a full ring.
+ *
+ * On Windows, "record" arms the tracer for the given number of seconds and
+ * drains every cores step ring in bulk into a trace file, which also keeps
+ * the rings from filling up. -r limits traces to [start, end), -g picks the
+ * registers kept in each record, i.e "rax,rcx,rsp", and -m an expression (see
+ * condcompile.h) whose address is read on every step, i.e "rsp" for the top
+ * of the stack. "dump" decodes a trace file on either Windows or Linux.
+ *
+ * "selftest" runs the record format, the stop conditions and a ring being
+ * drained while a trace fills it through the driver's step.c, on any
+ * platform.
+ *
+ *   cc -O2 -I../hv -o steptrace steptrace.c condcompile.c ../hv/step.c \
+ *       ../hv/cond.c
+ *
+ * usage: steptrace record <trace file> <seconds> <max steps> [-r start end]
+ *                         [-g registers] [-m expression]
+ *        steptrace dump <trace file>
+ *        steptrace selftest
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "step.h"
+#include "condcompile.h"
+
+#ifdef _WIN32
+#        include <windows.h>
+#endif
+
+#define STEP_FILE_MAGIC   0x54535648 /* HVST */
+#define STEP_FILE_VERSION 1
+
+typedef struct _STEP_FILE_HEADER {
+        UINT32 magic;
+        UINT16 version;
+        UINT16 record_size;
+        UINT32 core_count;
+        UINT32 reserved;
+
+} STEP_FILE_HEADER, *PSTEP_FILE_HEADER;
+
+/* every read from a core is written as one of these, then its records */
+typedef struct _STEP_FILE_BATCH {
+        UINT32 core;
+        UINT32 record_count;
+        UINT64 lost;
+
+} STEP_FILE_BATCH, *PSTEP_FILE_BATCH;
+
+#define STEP_GPR_COUNT 16
+
+static const char* gpr_names[STEP_GPR_COUNT] = {"rax",
+                                                "rcx",
+                                                "rdx",
+                                                "rbx",
+                                                "rsp",
+                                                "rbp",
+                                                "rsi",
+                                                "rdi",
+                                                "r8",
+                                                "r9",
+                                                "r10",
+                                                "r11",
+                                                "r12",
+                                                "r13",
+                                                "r14",
+                                                "r15"};
+
+static const char* stop_reasons[STEP_STOP_REASON_COUNT] = {
+    "none", "steps", "range", "full", "cancelled"};
+
+/* returns 0 if Record didn't keep Register */
+static int
+RecordRegister(const STEP_RECORD* Record, UINT32 Register, UINT64* Value)
+{
+        UINT32 slot = 0;
+
+        if (Register >= STEP_GPR_COUNT ||
+            !(Record->register_mask & (1u << Register)))
+                return 0;
+
+        for (UINT32 index = 0; index < Register; index++) {
+                if (Record->register_mask & (1u << index))
+                        slot++;
+        }
+
+        if (slot >= STEP_MAX_REGISTERS)
+                return 0;
+
+        *Value = Record->registers[slot];
+        return 1;
+}
+
+static void
+PrintRecord(UINT32 Core, const STEP_RECORD* Record)
+{
+        UINT64 value = 0;
+
+        printf("%3u %8u %#018llx %#8llx",
+               Core,
+               Record->step,
+               (unsigned long long)Record->guest_rip,
+               (unsigned long long)Record->guest_rflags);
+
+        for (UINT32 index = 0; index < STEP_GPR_COUNT; index++) {
+                if (RecordRegister(Record, index, &value))
+                        printf(" %s=%#llx",
+                               gpr_names[index],
+                               (unsigned long long)value);
+        }
+
+        if (Record->flags & STEP_RECORD_MEMORY)
+                printf(" [%#llx]=%#llx",
+                       (unsigned long long)Record->memory_address,
+                       (unsigned long long)Record->memory_value);
+        else if (Record->flags & STEP_RECORD_MEMORY_FAULT)
+                printf(" [%#llx]=fault",
+                       (unsigned long long)Record->memory_address);
+
+        printf("\n");
+
+        if (Record->flags & STEP_RECORD_LAST)
+                printf("--- core %u stopped after %u steps: %s\n",
+                       Core,
+                       Record->step,
+                       Record->stop_reason < STEP_STOP_REASON_COUNT ?
+                           stop_reasons[Record->stop_reason] :
+                           "unknown");
+}
+
+static int
+Dump(const char* Path)
+{
+        STEP_FILE_HEADER header  = {0};
+        STEP_FILE_BATCH  batch   = {0};
+        STEP_RECORD      record  = {0};
+        UINT64           records = 0;
+        UINT64           traces  = 0;
+        UINT64           lost    = 0;
+        int              status  = -1;
+        FILE*            file    = fopen(Path, "rb");
+
+        if (!file) {
+                fprintf(stderr, "steptrace: unable to open %s\n", Path);
+                return -1;
+        }
+
+        if (fread(&header, sizeof(header), 1, file) != 1 ||
+            header.magic != STEP_FILE_MAGIC ||
+            header.version != STEP_FILE_VERSION ||
+            header.record_size != sizeof(STEP_RECORD)) {
+                fprintf(stderr, "steptrace: %s is not a trace file\n", Path);
+                goto end;
+        }
+
+        printf("%3s %8s %-18s %8s registers\n", "cpu", "step", "rip", "rflags");
+
+        while (fread(&batch, sizeof(batch), 1, file) == 1) {
+                if (batch.lost)
+                        printf("--- core %u lost %llu records\n",
+                               batch.core,
+                               (unsigned long long)batch.lost);
+
+                lost += batch.lost;
+
+                for (UINT32 index = 0; index < batch.record_count; index++) {
+                        if (fread(&record, sizeof(record), 1, file) != 1) {
+                                fprintf(stderr,
+                                        "steptrace: %s is truncated\n",
+                                        Path);
+                                goto end;
+                        }
+
+                        PrintRecord(batch.core, &record);
+                        records++;
+                        traces += record.step == 0;
+                }
+        }
+
+        printf("%s: %u cores, %llu traces, %llu records, %llu lost\n",
+               Path,
+               header.core_count,
+               (unsigned long long)traces,
+               (unsigned long long)records,
+               (unsigned long long)lost);
+
+        status = 0;
+
+end:
+        fclose(file);
+        return status;
+}
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s\n", What);
+        failures++;
+}
+
+/* guest memory for the selftest, a qword at every 8 bytes from its base */
+#define TEST_MEMORY_BASE  0xFFFF800000001000ull
+#define TEST_MEMORY_WORDS 64
+
+static UINT64 test_memory[TEST_MEMORY_WORDS];
+
+static BOOLEAN
+TestRead(VOID* Context, UINT64 Address, UINT32 Size, UINT64* Value)
+{
+        (void)Context;
+
+        if (Address < TEST_MEMORY_BASE ||
+            Address + Size > TEST_MEMORY_BASE + sizeof(test_memory))
+                return FALSE;
+
+        memcpy(Value,
+               (UINT8*)test_memory + (Address - TEST_MEMORY_BASE),
+               Size);
+        return TRUE;
+}
+
+static void
+Compile(const char* Source, PCOND_PROGRAM Program)
+{
+        CONDC_ERROR error = {0};
+
+        Check(!CondCompile(Source, Program, &error), Source);
+}
+
+static void
+SelfTestValidate(void)
+{
+        HV_STEP_TRACE_REQUEST request = {0};
+
+        request.max_steps = 100;
+        Check(StepValidateRequest(&request), "empty request validates");
+
+        request.register_mask = 0x3FF;
+        Check(StepValidateRequest(&request), "10 registers validate");
+
+        request.register_mask = 0x7FF;
+        Check(!StepValidateRequest(&request), "11 registers are refused");
+
+        request.register_mask = 1u << COND_REGISTER_RIP;
+        Check(!StepValidateRequest(&request), "only gprs can be kept");
+
+        request.register_mask = 0;
+        request.range_start   = 0x2000;
+        request.range_end     = 0x1000;
+        Check(!StepValidateRequest(&request), "an empty range is refused");
+
+        request.range_end = 0x3000;
+        Check(StepValidateRequest(&request), "a range validates");
+
+        request.operand.instruction_count = 1;
+        request.operand.instructions[0].opcode = COND_OP_ADD;
+        Check(!StepValidateRequest(&request), "a bad operand is refused");
+
+        Compile("rsp + 8", &request.operand);
+        Check(StepValidateRequest(&request), "an operand validates");
+}
+
+static void
+SelfTestStop(void)
+{
+        HV_STEP_TRACE_REQUEST request = {0};
+
+        request.max_steps   = 10;
+        request.range_start = 0x1000;
+        request.range_end   = 0x2000;
+
+        Check(StepCheckStop(&request, 0, 0x1000, 0, 16) == STEP_STOP_NONE,
+              "the start of the range is in it");
+        Check(StepCheckStop(&request, 3, 0x2000, 0, 16) == STEP_STOP_RANGE,
+              "the end of the range isn't");
+        Check(StepCheckStop(&request, 3, 0xFFF, 0, 16) == STEP_STOP_RANGE,
+              "neither is below it");
+        Check(StepCheckStop(&request, 10, 0x1800, 0, 16) == STEP_STOP_STEPS,
+              "max steps stops the trace");
+        Check(StepCheckStop(&request, 10, 0x2800, 0, 16) == STEP_STOP_RANGE,
+              "leaving the range wins over max steps");
+        Check(StepCheckStop(&request, 5, 0x1800, 13, 16) == STEP_STOP_NONE,
+              "a record short of filling the ring carries on");
+        Check(StepCheckStop(&request, 5, 0x1800, 14, 16) == STEP_STOP_FULL,
+              "the record that fills the ring is the last");
+
+        request.range_end = 0;
+        Check(StepCheckStop(&request, 5, 0x10, 0, 16) == STEP_STOP_NONE,
+              "no range lets rip go anywhere");
+}
+
+static void
+SelfTestRecord(void)
+{
+        HV_STEP_TRACE_REQUEST request                        = {0};
+        STEP_RECORD           record                         = {0};
+        UINT64                registers[COND_REGISTER_COUNT] = {0};
+        UINT64                value                          = 0;
+        int                   decoded                        = 1;
+
+        for (UINT32 index = 0; index < COND_REGISTER_COUNT; index++)
+                registers[index] = 0x1111 * (index + 1);
+
+        for (UINT32 index = 0; index < TEST_MEMORY_WORDS; index++)
+                test_memory[index] = 0xA0A0000000000000ull | index;
+
+        registers[COND_REGISTER_RSP] = TEST_MEMORY_BASE + 0x40;
+        registers[COND_REGISTER_RIP] = 0xFFFFF80000401000ull;
+
+        request.max_steps     = 10;
+        request.register_mask = (1u << COND_REGISTER_RAX) |
+                                (1u << COND_REGISTER_RSP) |
+                                (1u << COND_REGISTER_R8) |
+                                (1u << COND_REGISTER_R15);
+        Compile("rsp + 8", &request.operand);
+
+        StepWriteRecord(
+            &record, &request, registers, TestRead, 1234, 7, STEP_STOP_NONE);
+
+        Check(record.timestamp == 1234 && record.step == 7,
+              "the timestamp and step are kept");
+        Check(record.guest_rip == registers[COND_REGISTER_RIP] &&
+                  record.guest_rflags == registers[COND_REGISTER_RFLAGS],
+              "rip and rflags are kept");
+        Check(record.flags == STEP_RECORD_MEMORY,
+              "the operand is read, and the record isn't the last");
+        Check(record.memory_address == TEST_MEMORY_BASE + 0x48 &&
+                  record.memory_value == test_memory[9],
+              "the operand reads the qword at its address");
+
+        for (UINT32 index = 0; index < STEP_GPR_COUNT; index++) {
+                if (request.register_mask & (1u << index))
+                        decoded &= RecordRegister(&record, index, &value) &&
+                                   value == registers[index];
+                else
+                        decoded &= !RecordRegister(&record, index, &value);
+        }
+
+        Check(decoded, "the kept registers, and only them, decode");
+        Check(!record.registers[4], "unused register slots are zeroed");
+
+        Compile("[rax]", &request.operand);
+        StepWriteRecord(
+            &record, &request, registers, TestRead, 0, 8, STEP_STOP_RANGE);
+
+        Check(record.flags == (STEP_RECORD_MEMORY_FAULT | STEP_RECORD_LAST),
+              "an unreadable operand faults");
+        Check(record.stop_reason == STEP_STOP_RANGE,
+              "the last record says why");
+
+        request.register_mask = 0x3FF;
+        memset(&request.operand, 0, sizeof(request.operand));
+        StepWriteRecord(
+            &record, &request, registers, TestRead, 0, 9, STEP_STOP_NONE);
+
+        Check(!record.flags && !record.memory_address,
+              "no operand, nothing read");
+        Check(RecordRegister(&record, 9, &value) && value == registers[9],
+              "all 10 slots decode");
+}
+
+#define TEST_RING_CAPACITY 16
+
+/*
+ * Runs a trace of Steps instructions as StepNext would, draining the ring
+ * every DrainEvery records as a reader would, if at all. Returns the number
+ * of records the reader got, checking they are the trace in order.
+ */
+static UINT32
+RunTrace(PTRACE_RING_HEADER Ring,
+         UINT32             Steps,
+         UINT32             DrainEvery,
+         STEP_STOP_REASON*  Reason)
+{
+        HV_STEP_TRACE_REQUEST request                        = {0};
+        STEP_RECORD           record                         = {0};
+        UINT64                registers[COND_REGISTER_COUNT] = {0};
+        UINT64                consumed                       = Ring->head;
+        UINT64                cursor                         = Ring->head;
+        UINT64                lost                           = 0;
+        UINT32                read                           = 0;
+        int                   ordered                        = 1;
+
+        request.max_steps = Steps;
+        *Reason           = STEP_STOP_NONE;
+
+        for (UINT32 step = 0; *Reason == STEP_STOP_NONE; step++) {
+                PSTEP_RECORD slot =
+                    (PSTEP_RECORD)TRACE_RING_RECORD(Ring, Ring->head);
+
+                registers[COND_REGISTER_RIP] = 0x1000 + step;
+
+                *Reason = StepCheckStop(&request,
+                                        step,
+                                        registers[COND_REGISTER_RIP],
+                                        Ring->head - consumed,
+                                        Ring->capacity);
+
+                StepWriteRecord(
+                    slot, &request, registers, TestRead, 0, step, *Reason);
+
+                TraceRingPublish(Ring);
+
+                if (*Reason == STEP_STOP_NONE &&
+                    (!DrainEvery || (step + 1) % DrainEvery))
+                        continue;
+
+                while (TraceRingNextRecord(Ring, &cursor, &lost, &record)) {
+                        ordered &= record.step == read &&
+                                   record.guest_rip == 0x1000 + read;
+                        read++;
+                }
+
+                /* what StepReadTrace tells the tracer */
+                if (DrainEvery)
+                        consumed = cursor;
+        }
+
+        Check(!lost, "a trace never overwrites its own records");
+        Check(ordered, "the reader gets every step in order");
+        return read;
+}
+
+static void
+SelfTestRing(void)
+{
+        PTRACE_RING_HEADER ring   = NULL;
+        STEP_STOP_REASON   reason = STEP_STOP_NONE;
+        UINT32             read   = 0;
+
+        ring = calloc(
+            1, TRACE_RING_SIZE(TEST_RING_CAPACITY, sizeof(STEP_RECORD)));
+
+        if (!ring) {
+                Check(0, "allocating the ring");
+                return;
+        }
+
+        ring->capacity    = TEST_RING_CAPACITY;
+        ring->record_size = sizeof(STEP_RECORD);
+
+        read = RunTrace(ring, 1000, 0, &reason);
+        Check(reason == STEP_STOP_FULL && read == TEST_RING_CAPACITY - 1,
+              "a trace nobody reads stops once the ring is full");
+
+        read = RunTrace(ring, 1000, 5, &reason);
+        Check(reason == STEP_STOP_STEPS && read == 1001,
+              "a reader keeping up lets a trace outgrow the ring");
+
+        read = RunTrace(ring, 3, 0, &reason);
+        Check(reason == STEP_STOP_STEPS && read == 4,
+              "a later trace starts at the head");
+
+        free(ring);
+}
+
+static int
+SelfTest(void)
+{
+        SelfTestValidate();
+        SelfTestStop();
+        SelfTestRecord();
+        SelfTestRing();
+
+        printf("selftest: %u checks, %u failures\n", checks, failures);
+        return failures ? -1 : 0;
+}
+
+#ifdef _WIN32
+#        define RECORD_BATCH 512
+
+static BOOL
+SetStepTrace(HANDLE Device, const HV_STEP_TRACE_REQUEST* Request)
+{
+        DWORD returned = 0;
+
+        return DeviceIoControl(Device,
+                               IOCTL_HV_SET_STEP_TRACE,
+                               (PVOID)Request,
+                               sizeof(HV_STEP_TRACE_REQUEST),
+                               NULL,
+                               0,
+                               &returned,
+                               NULL);
+}
+
+/* returns the number of records written, or -1 on failure */
+static long
+DrainCore(HANDLE                       Device,
+          UINT32                       Core,
+          UINT64*                      Cursor,
+          PHV_STEP_TRACE_READ_RESPONSE Response,
+          DWORD                        Size,
+          FILE*                        File)
+{
+        HV_STEP_TRACE_READ_REQUEST request  = {0};
+        STEP_FILE_BATCH            batch    = {0};
+        DWORD                      returned = 0;
+
+        request.core   = Core;
+        request.cursor = *Cursor;
+
+        /* excluded cores have no ring */
+        if (!DeviceIoControl(Device,
+                             IOCTL_HV_READ_STEP_TRACE,
+                             &request,
+                             sizeof(request),
+                             Response,
+                             Size,
+                             &returned,
+                             NULL))
+                return GetLastError() == ERROR_NOT_FOUND ? 0 : -1;
+
+        *Cursor = Response->cursor;
+
+        if (!Response->record_count && !Response->lost)
+                return 0;
+
+        batch.core         = Core;
+        batch.record_count = Response->record_count;
+        batch.lost         = Response->lost;
+
+        if (fwrite(&batch, sizeof(batch), 1, File) != 1 ||
+            fwrite(Response->records,
+                   sizeof(STEP_RECORD),
+                   Response->record_count,
+                   File) != Response->record_count)
+                return -1;
+
+        return (long)Response->record_count;
+}
+
+/* returns -1 if Names isn't a comma separated list of gprs */
+static int
+ParseRegisters(const char* Names, UINT32* Mask)
+{
+        const char* name   = Names;
+        size_t      length = 0;
+        UINT32      index  = 0;
+
+        *Mask = 0;
+
+        while (*name) {
+                length = strcspn(name, ",");
+
+                for (index = 0; index < STEP_GPR_COUNT; index++) {
+                        if (strlen(gpr_names[index]) == length &&
+                            !strncmp(name, gpr_names[index], length))
+                                break;
+                }
+
+                if (index == STEP_GPR_COUNT)
+                        return -1;
+
+                *Mask |= 1u << index;
+                name += length;
+
+                if (*name == ',')
+                        name++;
+        }
+
+        return 0;
+}
+
+static int
+Record(const char*                  Path,
+       unsigned                     Seconds,
+       const HV_STEP_TRACE_REQUEST* Request)
+{
+        HV_STEP_TRACE_REQUEST        disarm   = {0};
+        STEP_FILE_HEADER             header   = {0};
+        PHV_STEP_TRACE_READ_RESPONSE response = NULL;
+        UINT64*                      cursors  = NULL;
+        UINT64                       written  = 0;
+        DWORD                        size     = 0;
+        DWORD                        start    = 0;
+        long                         drained  = 0;
+        int                          status   = -1;
+        int                          armed    = 1;
+        UINT32                       cores    = 0;
+        FILE*                        file     = NULL;
+        HANDLE                       device   = CreateFileA(HV_DEVICE_PATH,
+                                         GENERIC_READ | GENERIC_WRITE,
+                                         0,
+                                         NULL,
+                                         OPEN_EXISTING,
+                                         FILE_ATTRIBUTE_NORMAL,
+                                         NULL);
+
+        if (device == INVALID_HANDLE_VALUE) {
+                fprintf(stderr,
+                        "steptrace: unable to open %s (%lu)\n",
+                        HV_DEVICE_PATH,
+                        GetLastError());
+                return -1;
+        }
+
+        cores    = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+        size     = (DWORD)HV_STEP_TRACE_READ_RESPONSE_SIZE(RECORD_BATCH);
+        response = malloc(size);
+        cursors  = calloc(cores, sizeof(UINT64));
+        file     = fopen(Path, "wb");
+
+        if (!response || !cursors || !file)
+                goto end;
+
+        header.magic       = STEP_FILE_MAGIC;
+        header.version     = STEP_FILE_VERSION;
+        header.record_size = sizeof(STEP_RECORD);
+        header.core_count  = cores;
+
+        if (fwrite(&header, sizeof(header), 1, file) != 1)
+                goto end;
+
+        if (!SetStepTrace(device, Request)) {
+                fprintf(stderr,
+                        "steptrace: unable to arm the tracer (%lu)\n",
+                        GetLastError());
+                goto end;
+        }
+
+        start = GetTickCount();
+
+        /* one last drain once disarmed, for whatever stopped on the way */
+        while (armed) {
+                if (GetTickCount() - start >= Seconds * 1000) {
+                        SetStepTrace(device, &disarm);
+                        armed = 0;
+                }
+
+                for (UINT32 core = 0; core < cores; core++) {
+                        drained = DrainCore(device,
+                                            core,
+                                            &cursors[core],
+                                            response,
+                                            size,
+                                            file);
+
+                        if (drained < 0) {
+                                SetStepTrace(device, &disarm);
+                                goto end;
+                        }
+
+                        written += drained;
+                }
+
+                if (armed)
+                        Sleep(1);
+        }
+
+        status = 0;
+
+        printf("steptrace: %llu records recorded\n",
+               (unsigned long long)written);
+
+end:
+        if (file)
+                fclose(file);
+
+        free(response);
+        free(cursors);
+        CloseHandle(device);
+        return status;
+}
+
+static int
+RecordCommand(int argc, char** argv)
+{
+        HV_STEP_TRACE_REQUEST request = {0};
+        CONDC_ERROR           error   = {0};
+        int                   index   = 5;
+
+        request.max_steps = (UINT32)strtoul(argv[4], NULL, 0);
+
+        for (; index < argc; index++) {
+                if (!strcmp(argv[index], "-r") && index + 2 < argc) {
+                        request.range_start =
+                            strtoull(argv[++index], NULL, 0);
+                        request.range_end = strtoull(argv[++index], NULL, 0);
+                }
+                else if (!strcmp(argv[index], "-g") && index + 1 < argc) {
+                        if (ParseRegisters(argv[++index],
+                                           &request.register_mask)) {
+                                fprintf(stderr,
+                                        "steptrace: unknown register in %s\n",
+                                        argv[index]);
+                                return -1;
+                        }
+                }
+                else if (!strcmp(argv[index], "-m") && index + 1 < argc) {
+                        if (CondCompile(
+                                argv[++index], &request.operand, &error)) {
+                                fprintf(stderr,
+                                        "steptrace: %s at %zu in %s\n",
+                                        error.message,
+                                        error.position,
+                                        argv[index]);
+                                return -1;
+                        }
+                }
+                else {
+                        fprintf(stderr,
+                                "steptrace: unexpected %s\n",
+                                argv[index]);
+                        return -1;
+                }
+        }
+
+        if (!request.max_steps || !StepValidateRequest(&request)) {
+                fprintf(stderr,
+                        "steptrace: need max steps, at most %u registers "
+                        "and a non empty range\n",
+                        STEP_MAX_REGISTERS);
+                return -1;
+        }
+
+        return Record(argv[2], (unsigned)atoi(argv[3]), &request);
+}
+#endif
+
+int
+main(int argc, char** argv)
+{
+        if (argc == 2 && !strcmp(argv[1], "selftest"))
+                return SelfTest() ? 1 : 0;
+
+        if (argc == 3 && !strcmp(argv[1], "dump"))
+                return Dump(argv[2]) ? 1 : 0;
+
+#ifdef _WIN32
+        if (argc >= 5 && !strcmp(argv[1], "record"))
+                return RecordCommand(argc, argv) ? 1 : 0;
+#endif
+
+        fprintf(stderr, "usage: %s dump <trace file>\n", argv[0]);
+        fprintf(stderr, "       %s selftest\n", argv[0]);
+#ifdef _WIN32
+        fprintf(stderr,
+                "       %s record <trace file> <seconds> <max steps> "
+                "[-r start end] [-g registers] [-m expression]\n",
+                argv[0]);
+#endif
+        return 1;
+}
@@ -0,0 +1,294 @@
+/*
+ * topology - checks the processor mapping in hv/topology.h.
+ *
+ * Builds a set of made up topologies, a single group, several full groups,
+ * groups of uneven size and groups whose active processors aren't contiguous,
+ * and round trips every vcpu index through its group relative number and
+ * back. Numbers that aren't active and indices past the last vcpu have to be
+ * refused, and an affinity has to select exactly the processors it names.
+ *
+ * The mapping has no kernel dependencies, so builds with any C99 compiler on
+ * either Windows or Linux:
+ *
+ *   cc -O2 -I../hv -o topology topology.c
+ *
+ * which leaves out the half of the selftest that drives TopologyInitialise
+ * through the kernel's view of the same topologies, only the topology target
+ * in CMakeLists.txt builds that, on Linux and linked with the driver:
+ *
+ *   cmake -S .. -B build && cmake --build build --target topology
+ *
+ * usage: topology
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "topology.h"
+
+#if defined(HWSIM)
+#        include "hwsim.h"
+#        include "ntsim.h"
+#endif
+
+typedef struct _FAKE_TOPOLOGY {
+        const char* name;
+        UINT32      group_count;
+        UINT64      active[TOPOLOGY_MAX_GROUPS];
+
+} FAKE_TOPOLOGY, *PFAKE_TOPOLOGY;
+
+static const FAKE_TOPOLOGY topologies[] = {
+    {"one core", 1, {0x1}},
+    {"one group", 1, {0xFF}},
+    {"one full group", 1, {~0ull}},
+    {"two full groups", 2, {~0ull, ~0ull}},
+    {"uneven groups", 3, {~0ull, 0xFFFFFFFFull, 0x3F}},
+    {"uneven small groups", 4, {0x7, 0x1, 0xFFFF, 0x3}},
+    {"sparse group", 1, {0xF0F0}},
+    {"sparse groups", 3, {0x5, 0xF0F0F0F0F0F0F0F0ull, 1ull << 63}},
+    {"empty group", 3, {0xF, 0, 0xF0}},
+    {"highest only", 2, {1ull << 63, 1ull << 63}},
+};
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* Topology, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s: %s\n", Topology, What);
+        failures++;
+}
+
+static UINT32
+CountActive(const FAKE_TOPOLOGY* Fake)
+{
+        UINT32 count = 0;
+
+        for (UINT32 group = 0; group < Fake->group_count; group++) {
+                for (UINT32 number = 0; number < 64; number++)
+                        count += (Fake->active[group] >> number) & 1;
+        }
+
+        return count;
+}
+
+/*
+ * Every active processor gets the next index in turn, so walking the groups
+ * in order visits every index in order.
+ */
+static void
+SelfTestMapping(const FAKE_TOPOLOGY* Fake)
+{
+        VCPU_TOPOLOGY topology = {0};
+        UINT32        expected = 0;
+        UINT32        group    = 0;
+        UINT32        number   = 0;
+        int           ordered  = 1;
+        int           refused  = 1;
+        int           inverse  = 1;
+
+        Check(!TopologyBuild(&topology, Fake->active, Fake->group_count),
+              Fake->name,
+              "builds");
+        Check(topology.vcpu_count == CountActive(Fake),
+              Fake->name,
+              "a vcpu per active processor");
+
+        for (group = 0; group < Fake->group_count; group++) {
+                for (number = 0; number < 64; number++) {
+                        if (!((Fake->active[group] >> number) & 1)) {
+                                refused &= TopologyIndexFromNumber(
+                                               &topology, group, number) ==
+                                           TOPOLOGY_INVALID_INDEX;
+                                continue;
+                        }
+
+                        ordered &= TopologyIndexFromNumber(
+                                       &topology, group, number) == expected;
+                        expected++;
+                }
+        }
+
+        Check(ordered, Fake->name, "active processors are indexed in order");
+        Check(refused, Fake->name, "inactive processors have no index");
+
+        for (UINT32 index = 0; index < topology.vcpu_count; index++) {
+                if (TopologyNumberFromIndex(
+                        &topology, index, &group, &number)) {
+                        inverse = 0;
+                        continue;
+                }
+
+                inverse &= TopologyIndexFromNumber(
+                               &topology, group, number) == index;
+        }
+
+        Check(inverse, Fake->name, "every index round trips to its number");
+        Check(TopologyNumberFromIndex(
+                  &topology, topology.vcpu_count, &group, &number) &&
+                  TopologyNumberFromIndex(
+                      &topology, TOPOLOGY_INVALID_INDEX, &group, &number),
+              Fake->name,
+              "indices past the last vcpu are refused");
+        Check(TopologyIndexFromNumber(&topology, Fake->group_count, 0) ==
+                      TOPOLOGY_INVALID_INDEX &&
+                  TopologyIndexFromNumber(&topology, 0, 64) ==
+                      TOPOLOGY_INVALID_INDEX,
+              Fake->name,
+              "numbers outside of any group are refused");
+}
+
+/* An affinity of every other active processor selects exactly those. */
+static void
+SelfTestAffinity(const FAKE_TOPOLOGY* Fake)
+{
+        VCPU_TOPOLOGY topology                      = {0};
+        UINT64        affinity[TOPOLOGY_MAX_GROUPS] = {0};
+        UINT32        index                         = 0;
+        int           selected                      = 1;
+
+        TopologyBuild(&topology, Fake->active, Fake->group_count);
+
+        for (UINT32 group = 0; group < Fake->group_count; group++) {
+                for (UINT32 number = 0; number < 64; number++) {
+                        if (!((Fake->active[group] >> number) & 1))
+                                continue;
+
+                        if (index++ & 1)
+                                affinity[group] |= 1ull << number;
+                }
+        }
+
+        for (index = 0; index < topology.vcpu_count; index++) {
+                selected &= !TopologyIsIndexInAffinity(
+                                &topology, affinity, index) == !(index & 1);
+        }
+
+        Check(selected, Fake->name, "an affinity selects what it names");
+        Check(!TopologyIsIndexInAffinity(
+                  &topology, affinity, topology.vcpu_count),
+              Fake->name,
+              "no affinity covers an index past the last vcpu");
+}
+
+static void
+SelfTestInvalid()
+{
+        VCPU_TOPOLOGY topology                        = {0};
+        UINT64        active[TOPOLOGY_MAX_GROUPS + 1] = {0};
+
+        active[0] = 1;
+
+        Check(TopologyBuild(&topology, active, 0) == -1,
+              "invalid",
+              "no groups is refused");
+        Check(TopologyBuild(&topology, active, TOPOLOGY_MAX_GROUPS + 1) == -1,
+              "invalid",
+              "more groups than the kernel supports is refused");
+
+        active[0] = 0;
+
+        Check(TopologyBuild(&topology, active, 2) == -1,
+              "invalid",
+              "no active processor is refused");
+}
+
+#if defined(HWSIM)
+
+static UINT32 visits[TOPOLOGY_MAX_GROUPS * 64] = {0};
+
+static ULONG_PTR
+Visit(ULONG_PTR Context)
+{
+        UINT32 index = TopologyCurrentIndex();
+
+        UNREFERENCED_PARAMETER(Context);
+
+        if (index < TOPOLOGY_MAX_GROUPS * 64)
+                visits[index]++;
+
+        return 0;
+}
+
+/*
+ * The driver's own view, built from what the simulated kernel reports, has to
+ * agree with the kernel's processor indices on every core a broadcast runs on.
+ */
+static void
+SelfTestKernel(const FAKE_TOPOLOGY* Fake)
+{
+        UINT32 count = CountActive(Fake);
+        int    once  = 1;
+
+        NtSimReset();
+        HwSimReset();
+
+        if (NtSimSetTopology(Fake->active, Fake->group_count)) {
+                Check(0, Fake->name, "the simulated kernel takes the topology");
+                return;
+        }
+
+        Check(NT_SUCCESS(TopologyInitialise()),
+              Fake->name,
+              "initialises against the kernel");
+        Check(TopologyVcpuCount() == count,
+              Fake->name,
+              "the driver sees every active processor");
+
+        memset(visits, 0, sizeof(visits));
+        KeIpiGenericCall(Visit, 0);
+
+        for (UINT32 index = 0; index < TOPOLOGY_MAX_GROUPS * 64; index++)
+                once &= visits[index] == (index < count);
+
+        Check(once,
+              Fake->name,
+              "a broadcast runs once on each vcpu index, by the current index");
+}
+
+#endif
+
+static void
+SelfTest(const FAKE_TOPOLOGY* Fake)
+{
+        SelfTestMapping(Fake);
+        SelfTestAffinity(Fake);
+#if defined(HWSIM)
+        SelfTestKernel(Fake);
+#endif
+}
+
+int
+main(int argc, char** argv)
+{
+        UINT32        count = sizeof(topologies) / sizeof(topologies[0]);
+        FAKE_TOPOLOGY every = {0};
+
+        if (argc != 1) {
+                fprintf(stderr, "usage: %s\n", argv[0]);
+                return 1;
+        }
+
+        for (UINT32 index = 0; index < count; index++)
+                SelfTest(&topologies[index]);
+
+        /* as many groups as there can be, each shaped differently */
+        every.name        = "every group";
+        every.group_count = TOPOLOGY_MAX_GROUPS;
+
+        for (UINT32 group = 0; group < TOPOLOGY_MAX_GROUPS; group++)
+                every.active[group] = (0x9ull << group) | (1ull << 63);
+
+        SelfTest(&every);
+
+        SelfTestInvalid();
+
+        printf("selftest: %u checks, %u failures\n", checks, failures);
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,694 @@
+/*
+ * tracedump - offline decoder for the hypervisor's binary trace rings.
+ *
+ * The driver never formats log messages in VMX root, it only stores a format
+ * id, a timestamp and the raw arguments (see hv/trace.h). This tool takes one
+ * or more raw ring images (the TRACE_RING_HEADER followed by its records, as
+ * written out by a debugger or the log export interface) and renders them as
+ * text, interleaving the records of every ring by timestamp.
+ *
+ * On Windows it can also attach to the running driver, in which case every
+ * cores ring is mapped read only into this process (IOCTL_HV_MAP_LOG_RINGS)
+ * and records are printed as they are committed. Both modes consume the rings
+ * through the reader protocol in trace.h.
+ *
+ * "selftest" renders a record for every entry in TRACE_FORMAT_TABLE and
+ * decodes a set of good, truncated and corrupt ring images, checking the
+ * output against what each should produce.
+ *
+ * Builds with any C99 compiler on either Windows or Linux:
+ *
+ *   cc -O2 -I../hv -o tracedump tracedump.c
+ *
+ * usage: tracedump <ring image> [ring image ...]
+ *        tracedump --live
+ *        tracedump selftest
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "ioctl.h"
+
+static const TRACE_FORMAT trace_formats[] = {
+    TRACE_FORMAT_TABLE(TRACE_FORMAT_INITIALISER)};
+
+typedef struct _DECODED_RECORD {
+        UINT32       core;
+        UINT64       index;
+        TRACE_RECORD record;
+
+} DECODED_RECORD, *PDECODED_RECORD;
+
+typedef struct _DECODED_RECORDS {
+        PDECODED_RECORD entries;
+        size_t          count;
+        size_t          allocated;
+
+} DECODED_RECORDS, *PDECODED_RECORDS;
+
+static int
+AppendRecord(PDECODED_RECORDS Records,
+             UINT32           Core,
+             UINT64           Index,
+             const void*      Record)
+{
+        if (Records->count == Records->allocated) {
+                size_t          allocated = Records->allocated ?
+                                                Records->allocated * 2 :
+                                                1024;
+                PDECODED_RECORD entries   = realloc(
+                    Records->entries, allocated * sizeof(DECODED_RECORD));
+
+                if (!entries)
+                        return -1;
+
+                Records->entries   = entries;
+                Records->allocated = allocated;
+        }
+
+        Records->entries[Records->count].core  = Core;
+        Records->entries[Records->count].index = Index;
+        memcpy(&Records->entries[Records->count].record,
+               Record,
+               sizeof(TRACE_RECORD));
+        Records->count++;
+        return 0;
+}
+
+/*
+ * A ring image may contain several rings back to back, each one sized by the
+ * capacity and record size found in its header.
+ */
+static int
+DecodeRingStream(FILE* File, const char* Path, PDECODED_RECORDS Records)
+{
+        TRACE_RING_HEADER header = {0};
+        unsigned char*    body   = NULL;
+        size_t            read   = 0;
+        int               status = 0;
+
+        while ((read = fread(&header, 1, sizeof(header), File)) != 0) {
+                size_t size = 0;
+
+                if (read != sizeof(header)) {
+                        fprintf(stderr,
+                                "tracedump: %s: truncated ring header\n",
+                                Path);
+                        status = -1;
+                        break;
+                }
+
+                /* a ring never holds more than capacity - 1 records */
+                if (!header.capacity ||
+                    header.capacity & (header.capacity - 1) ||
+                    header.record_size != sizeof(TRACE_RECORD) ||
+                    header.tail > header.head ||
+                    header.head - header.tail >= header.capacity) {
+                        fprintf(stderr,
+                                "tracedump: %s: invalid ring header\n",
+                                Path);
+                        status = -1;
+                        break;
+                }
+
+                size = (size_t)header.capacity * header.record_size;
+                body = malloc(size);
+
+                if (!body || fread(body, size, 1, File) != 1) {
+                        fprintf(stderr, "tracedump: %s: truncated ring\n", Path);
+                        status = -1;
+                        break;
+                }
+
+                for (UINT64 index = header.tail; index < header.head; index++) {
+                        const unsigned char* record =
+                            body + (index & (header.capacity - 1)) *
+                                       header.record_size;
+
+                        if (AppendRecord(Records, header.core, index, record)) {
+                                status = -1;
+                                break;
+                        }
+                }
+
+                free(body);
+                body = NULL;
+        }
+
+        free(body);
+        return status;
+}
+
+static int
+DecodeRingImage(const char* Path, PDECODED_RECORDS Records)
+{
+        FILE* file   = fopen(Path, "rb");
+        int   status = 0;
+
+        if (!file) {
+                fprintf(stderr, "tracedump: unable to open %s\n", Path);
+                return -1;
+        }
+
+        status = DecodeRingStream(file, Path, Records);
+        fclose(file);
+        return status;
+}
+
+static int
+CompareRecords(const void* Left, const void* Right)
+{
+        const DECODED_RECORD* left  = Left;
+        const DECODED_RECORD* right = Right;
+
+        if (left->record.timestamp != right->record.timestamp)
+                return left->record.timestamp < right->record.timestamp ? -1 :
+                                                                          1;
+        if (left->core != right->core)
+                return left->core < right->core ? -1 : 1;
+
+        return left->index < right->index ? -1 : left->index > right->index;
+}
+
+static void
+FormatRecord(char* Buffer, size_t Size, const DECODED_RECORD* Entry)
+{
+        const TRACE_RECORD* record = &Entry->record;
+        unsigned long long  args[TRACE_RECORD_MAX_ARGUMENTS];
+        int                 length = 0;
+
+        for (int index = 0; index < TRACE_RECORD_MAX_ARGUMENTS; index++)
+                args[index] = (unsigned long long)record->arguments[index];
+
+        length = snprintf(Buffer,
+                          Size,
+                          "[core %u] %016llx: ",
+                          Entry->core,
+                          (unsigned long long)record->timestamp);
+
+        if (length < 0 || (size_t)length >= Size)
+                return;
+
+        if (record->format_id >= TRACE_FORMAT_COUNT) {
+                snprintf(Buffer + length,
+                         Size - length,
+                         "unknown format id %u\n",
+                         record->format_id);
+                return;
+        }
+
+        /* unused trailing arguments are simply ignored by snprintf */
+        snprintf(Buffer + length,
+                 Size - length,
+                 trace_formats[record->format_id].format,
+                 args[0],
+                 args[1],
+                 args[2],
+                 args[3],
+                 args[4],
+                 args[5]);
+}
+
+static void
+PrintRecord(const DECODED_RECORD* Entry)
+{
+        char line[512];
+
+        FormatRecord(line, sizeof(line), Entry);
+        fputs(line, stdout);
+}
+
+#ifdef _WIN32
+/*
+ * Records are printed per ring in the order they were committed, rings are
+ * not interleaved by timestamp as new records can arrive at any time.
+ */
+static int
+LiveTail(void)
+{
+        HV_LOG_MAP_REQUEST   request  = {0};
+        PHV_LOG_MAP_RESPONSE response = NULL;
+        UINT64*              cursors  = NULL;
+        UINT64               lost     = 0;
+        DWORD                size     = 0;
+        DWORD                returned = 0;
+        HANDLE               event    = NULL;
+        DWORD                cores    = 0;
+        HANDLE               device   = CreateFileA(HV_DEVICE_PATH,
+                                     GENERIC_READ | GENERIC_WRITE,
+                                     0,
+                                     NULL,
+                                     OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL,
+                                     NULL);
+
+        if (device == INVALID_HANDLE_VALUE) {
+                fprintf(stderr,
+                        "tracedump: unable to open %s (%lu)\n",
+                        HV_DEVICE_PATH,
+                        GetLastError());
+                return -1;
+        }
+
+        /* the driver maps a ring per core across every processor group */
+        cores    = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+        size     = (DWORD)HV_LOG_MAP_RESPONSE_SIZE(cores);
+        response = calloc(1, size);
+        cursors  = calloc(cores, sizeof(UINT64));
+        event    = CreateEventA(NULL, FALSE, FALSE, NULL);
+
+        if (!response || !cursors || !event) {
+                CloseHandle(device);
+                return -1;
+        }
+
+        request.event = (UINT64)(ULONG_PTR)event;
+
+        if (!DeviceIoControl(device,
+                             IOCTL_HV_MAP_LOG_RINGS,
+                             &request,
+                             sizeof(request),
+                             response,
+                             size,
+                             &returned,
+                             NULL)) {
+                fprintf(stderr,
+                        "tracedump: unable to map log rings (%lu)\n",
+                        GetLastError());
+                CloseHandle(device);
+                return -1;
+        }
+
+        /*
+         * start from the oldest record each ring still holds, cores left
+         * unvirtualised have no ring
+         */
+        for (UINT32 core = 0; core < response->ring_count; core++) {
+                const TRACE_RING_HEADER* ring =
+                    (const TRACE_RING_HEADER*)response->rings[core];
+
+                if (ring)
+                        cursors[core] = ring->tail;
+        }
+
+        /* runs until killed, closing the handle tears down the mapping */
+        for (;;) {
+                WaitForSingleObject(event, 1000);
+
+                for (UINT32 core = 0; core < response->ring_count; core++) {
+                        const volatile TRACE_RING_HEADER* ring =
+                            (const TRACE_RING_HEADER*)response->rings[core];
+                        DECODED_RECORD entry = {0};
+
+                        if (!ring)
+                                continue;
+
+                        entry.core = ring->core;
+
+                        while (TraceRingNextRecord(
+                            ring, &cursors[core], &lost, &entry.record)) {
+                                entry.index = cursors[core] - 1;
+                                PrintRecord(&entry);
+                        }
+                }
+
+                if (lost) {
+                        fprintf(stderr,
+                                "tracedump: %llu records lost\n",
+                                (unsigned long long)lost);
+                        lost = 0;
+                }
+
+                fflush(stdout);
+        }
+}
+#endif
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s\n", What);
+        failures++;
+}
+
+/*
+ * Renders Format with Arguments independently of printf, knowing only the
+ * conversions a trace format may use. Every argument is stored as a UINT64
+ * and passed on as an unsigned long long, so anything other than an ll
+ * conversion is a bug in the table. Returns the number of conversions, or -1
+ * if the format uses one it may not.
+ */
+static int
+RenderFormat(char*         Buffer,
+             size_t        Size,
+             const char*   Format,
+             const UINT64* Arguments)
+{
+        size_t length      = 0;
+        int    conversions = 0;
+
+        for (const char* c = Format; *c && length + 1 < Size; c++) {
+                UINT64 value = 0;
+
+                if (*c != '%') {
+                        Buffer[length++] = *c;
+                        continue;
+                }
+
+                if (c[1] == '%') {
+                        Buffer[length++] = '%';
+                        c++;
+                        continue;
+                }
+
+                if (c[1] != 'l' || c[2] != 'l' ||
+                    conversions == TRACE_RECORD_MAX_ARGUMENTS)
+                        return -1;
+
+                value = Arguments[conversions++];
+                c += 3;
+
+                switch (*c) {
+                case 'x':
+                case 'X': {
+                        const char* digits = *c == 'x' ? "0123456789abcdef" :
+                                                         "0123456789ABCDEF";
+                        char        reversed[16];
+                        int         count = 0;
+
+                        do {
+                                reversed[count++] = digits[value & 0xF];
+                                value >>= 4;
+                        } while (value);
+
+                        while (count && length + 1 < Size)
+                                Buffer[length++] = reversed[--count];
+                        break;
+                }
+                case 'u': {
+                        char reversed[20];
+                        int  count = 0;
+
+                        do {
+                                reversed[count++] = '0' + value % 10;
+                                value /= 10;
+                        } while (value);
+
+                        while (count && length + 1 < Size)
+                                Buffer[length++] = reversed[--count];
+                        break;
+                }
+                default: return -1;
+                }
+        }
+
+        Buffer[length] = 0;
+        return conversions;
+}
+
+static void
+SelfTestFormats(void)
+{
+        DECODED_RECORD entry = {0};
+        char           rendered[512];
+        char           expected[512];
+        char           what[128];
+
+        for (UINT16 id = 0; id < TRACE_FORMAT_COUNT; id++) {
+                const TRACE_FORMAT* format      = &trace_formats[id];
+                int                 conversions = 0;
+                int                 prefix      = 0;
+
+                memset(&entry, 0, sizeof(entry));
+                entry.core                  = 3;
+                entry.record.timestamp      = 0x1234 + id;
+                entry.record.format_id      = id;
+                entry.record.argument_count = (UINT8)format->argument_count;
+
+                for (int index = 0; index < TRACE_RECORD_MAX_ARGUMENTS; index++)
+                        entry.record.arguments[index] =
+                            0xFFFFF80000000000ull + id * 0x100 + index;
+
+                prefix = snprintf(expected,
+                                  sizeof(expected),
+                                  "[core 3] %016llx: ",
+                                  (unsigned long long)entry.record.timestamp);
+
+                conversions = RenderFormat(expected + prefix,
+                                           sizeof(expected) - prefix,
+                                           format->format,
+                                           entry.record.arguments);
+
+                FormatRecord(rendered, sizeof(rendered), &entry);
+
+                snprintf(what,
+                         sizeof(what),
+                         "format %u only uses ll conversions",
+                         id);
+                Check(conversions >= 0, what);
+
+                snprintf(what,
+                         sizeof(what),
+                         "format %u consumes its %u arguments",
+                         id,
+                         format->argument_count);
+                Check(conversions == (int)format->argument_count &&
+                          format->argument_count <= TRACE_RECORD_MAX_ARGUMENTS,
+                      what);
+
+                snprintf(what, sizeof(what), "format %u renders", id);
+                Check(conversions >= 0 && !strcmp(rendered, expected), what);
+
+                snprintf(what, sizeof(what), "format %u ends its line", id);
+                Check(strlen(rendered) &&
+                          rendered[strlen(rendered) - 1] == '\n',
+                      what);
+        }
+
+        /* a record from a newer driver, or a corrupt one */
+        memset(&entry, 0, sizeof(entry));
+        entry.core             = 1;
+        entry.record.timestamp = 0xABC;
+        entry.record.format_id = TRACE_FORMAT_COUNT;
+
+        snprintf(expected,
+                 sizeof(expected),
+                 "[core 1] 0000000000000abc: unknown format id %u\n",
+                 TRACE_FORMAT_COUNT);
+        FormatRecord(rendered, sizeof(rendered), &entry);
+
+        Check(!strcmp(rendered, expected), "an unknown format id is reported");
+}
+
+/*
+ * Writes a ring holding the records from Tail up to Head to File, where the
+ * record for each index is stamped with Base plus twice its index.
+ */
+static void
+WriteRing(FILE*  File,
+          UINT32 Capacity,
+          UINT32 RecordSize,
+          UINT32 Core,
+          UINT64 Head,
+          UINT64 Tail,
+          UINT64 Base)
+{
+        TRACE_RING_HEADER header = {0};
+        TRACE_RECORD      record = {0};
+
+        header.head        = Head;
+        header.tail        = Tail;
+        header.capacity    = Capacity;
+        header.record_size = RecordSize;
+        header.core        = Core;
+
+        fwrite(&header, sizeof(header), 1, File);
+
+        for (UINT64 slot = 0; slot < Capacity; slot++) {
+                /* the index last written to this slot */
+                UINT64 index = slot;
+
+                if (Head > slot)
+                        index = Head - 1 - ((Head - 1 - slot) & (Capacity - 1));
+
+                memset(&record, 0, sizeof(record));
+                record.timestamp    = Base + index * 2;
+                record.format_id    = (UINT16)(index % TRACE_FORMAT_COUNT);
+                record.arguments[0] = index;
+
+                fwrite(&record, sizeof(record), 1, File);
+        }
+}
+
+/* Decodes the first Size bytes of File, as an image of that size would be. */
+static int
+DecodeImage(FILE* File, long Size, const char* What, PDECODED_RECORDS Records)
+{
+        FILE* image  = tmpfile();
+        int   status = -1;
+        int   c      = 0;
+
+        if (!image)
+                return -1;
+
+        rewind(File);
+
+        for (long offset = 0; offset < Size && (c = fgetc(File)) != EOF;
+             offset++)
+                fputc(c, image);
+
+        rewind(image);
+        Records->count = 0;
+        status         = DecodeRingStream(image, What, Records);
+        fclose(image);
+        return status;
+}
+
+static void
+SelfTestImages(void)
+{
+        DECODED_RECORDS records = {0};
+        FILE*           file    = tmpfile();
+        long            size    = 0;
+        int             ordered = 1;
+
+        if (!file) {
+                Check(0, "temporary ring image");
+                return;
+        }
+
+        /* a ring that has wrapped, holding the 7 records before head */
+        WriteRing(file, 8, sizeof(TRACE_RECORD), 2, 21, 14, 0x100);
+        size = ftell(file);
+
+        Check(!DecodeImage(file, size, "wrapped", &records) &&
+                  records.count == 7,
+              "a wrapped ring decodes every record it holds");
+
+        for (size_t index = 0; index < records.count; index++) {
+                const DECODED_RECORD* entry = &records.entries[index];
+
+                ordered &= entry->index == 14 + index && entry->core == 2 &&
+                           entry->record.arguments[0] == entry->index &&
+                           entry->record.timestamp ==
+                               0x100 + entry->index * 2;
+        }
+
+        Check(ordered, "a wrapped ring decodes from tail in order");
+
+        /* a partial header or body, as a dump cut short would leave */
+        Check(DecodeImage(file, sizeof(TRACE_RING_HEADER) / 2, "short header",
+                          &records),
+              "a truncated header is an error");
+        Check(DecodeImage(file, size - 1, "short body", &records),
+              "a truncated body is an error");
+        Check(!DecodeImage(file, 0, "empty", &records) && !records.count,
+              "an empty image holds no records");
+
+        /* headers that can't have come from the driver */
+        rewind(file);
+        WriteRing(file, 12, sizeof(TRACE_RECORD), 0, 4, 0, 0);
+        Check(DecodeImage(file, ftell(file), "capacity", &records),
+              "a capacity that isn't a power of two is an error");
+
+        rewind(file);
+        WriteRing(file, 8, sizeof(TRACE_RECORD) * 2, 0, 4, 0, 0);
+        Check(DecodeImage(file, ftell(file), "record size", &records),
+              "a foreign record size is an error");
+
+        rewind(file);
+        WriteRing(file, 8, sizeof(TRACE_RECORD), 0, 21, 13, 0);
+        Check(DecodeImage(file, ftell(file), "overfull", &records),
+              "a ring claiming capacity records is an error");
+
+        rewind(file);
+        WriteRing(file, 8, sizeof(TRACE_RECORD), 0, 4, 5, 0);
+        Check(DecodeImage(file, ftell(file), "tail past head", &records),
+              "a tail past head is an error");
+
+        /* two cores back to back interleave by timestamp */
+        rewind(file);
+        WriteRing(file, 8, sizeof(TRACE_RECORD), 0, 5, 0, 0x1000);
+        WriteRing(file, 8, sizeof(TRACE_RECORD), 1, 5, 0, 0x1001);
+        Check(!DecodeImage(file, ftell(file), "interleaved", &records) &&
+                  records.count == 10,
+              "every ring in an image is decoded");
+
+        qsort(records.entries,
+              records.count,
+              sizeof(DECODED_RECORD),
+              CompareRecords);
+
+        ordered = 1;
+
+        for (size_t index = 0; index < records.count; index++) {
+                const DECODED_RECORD* entry = &records.entries[index];
+
+                ordered &= entry->core == index % 2 &&
+                           entry->record.timestamp == 0x1000 + index;
+        }
+
+        Check(ordered, "records of different cores interleave by timestamp");
+
+        free(records.entries);
+        fclose(file);
+}
+
+static int
+SelfTest(void)
+{
+        SelfTestFormats();
+        SelfTestImages();
+
+        printf("selftest: %u checks, %u failures\n", checks, failures);
+        return failures ? -1 : 0;
+}
+
+int
+main(int argc, char** argv)
+{
+        DECODED_RECORDS records = {0};
+
+        if (argc < 2) {
+                fprintf(stderr, "usage: %s <ring image> [...]\n", argv[0]);
+#ifdef _WIN32
+                fprintf(stderr, "       %s --live\n", argv[0]);
+#endif
+                fprintf(stderr, "       %s selftest\n", argv[0]);
+                return 1;
+        }
+
+        if (argc == 2 && !strcmp(argv[1], "selftest"))
+                return SelfTest() ? 1 : 0;
+
+#ifdef _WIN32
+        if (!strcmp(argv[1], "--live"))
+                return LiveTail() ? 1 : 0;
+#endif
+
+        for (int index = 1; index < argc; index++) {
+                if (DecodeRingImage(argv[index], &records))
+                        return 1;
+        }
+
+        qsort(records.entries,
+              records.count,
+              sizeof(DECODED_RECORD),
+              CompareRecords);
+
+        for (size_t index = 0; index < records.count; index++)
+                PrintRecord(&records.entries[index]);
+
+        free(records.entries);
+        return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * vmcscontrols - checks the deferred control writes in hv/vmcsfield.c.
+ *
+ * Drives a VMCS_CONTROLS and its VMCS_CONTROLS_COMMITTED through the same
+ * sequence of calls the exit path makes, VmcsControlsOnExit on the way in,
+ * VmcsControlSet, VmcsControlClear and VmcsControlWrite from the handlers and
+ * VmcsControlsFlush on the way out, against the in memory vmcs in hwsim. The
+ * vmwrite counter then says exactly what each exit cost: nothing for a
+ * control that ends the exit where it started, one write for each control
+ * that actually changed, and never a read.
+ *
+ * Builds with any C99 compiler on either Windows or Linux:
+ *
+ *   cc -O2 -I../hv -I. -o vmcscontrols vmcscontrols.c hwsim.c \
+ *       ../hv/vmcsfield.c
+ *
+ * usage: vmcscontrols
+ */
+#include <stdio.h>
+
+#include "hwsim.h"
+#include "vmcsfield.h"
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s\n", What);
+        failures++;
+}
+
+static UINT64
+Encoding(VMCS_CONTROL Control)
+{
+        return vmcs_controls_table.fields[Control].encoding;
+}
+
+/* The vmwrites a flush issued, which also has to be what it returned. */
+static UINT64
+Flush(PVMCS_CONTROLS Controls, PVMCS_CONTROLS_COMMITTED Committed)
+{
+        HWSIM_COUNTERS counters = {0};
+        UINT32         written  = 0;
+
+        HwSimResetCounters();
+        written = VmcsControlsFlush(Controls, Committed);
+        HwSimGetCounters(&counters);
+
+        Check(written == counters.vmwrites,
+              "a flush returns the number of vmwrites it issued");
+        Check(!counters.vmreads, "a flush never reads the vmcs");
+        Check(!Controls->dirty, "nothing is left dirty after a flush");
+
+        return counters.vmwrites;
+}
+
+/* As the processor leaves the interruption information on a vm-exit. */
+static void
+Exit(PVMCS_CONTROLS Controls, PVMCS_CONTROLS_COMMITTED Committed)
+{
+        UINT64 field = Encoding(VMCS_CONTROL_ENTRY_INTERRUPTION_INFORMATION);
+        UINT64 valid = VMENTRY_INTERRUPT_INFORMATION_VALID_FLAG;
+
+        HwSimSetVmcsField(field, HwSimGetVmcsField(field) & ~valid);
+
+        VmcsControlsOnExit(Controls, Committed);
+}
+
+static int
+InVmcs(const VMCS_CONTROLS* Controls)
+{
+        for (UINT32 index = 0; index < VMCS_CONTROL_COUNT; index++) {
+                if (HwSimGetVmcsField(Encoding(index)) !=
+                    Controls->value[index])
+                        return 0;
+        }
+
+        return 1;
+}
+
+static void
+SelfTestInvalidate(PVMCS_CONTROLS           Controls,
+                   PVMCS_CONTROLS_COMMITTED Committed)
+{
+        int distinct = 1;
+
+        VmcsControlsInvalidate(Controls, Committed);
+
+        /* a distinct value per control, to catch one landing in another */
+        for (UINT32 index = 0; index < VMCS_CONTROL_COUNT; index++) {
+                VmcsControlWrite(Controls, index, 0x1000 + index);
+
+                for (UINT32 other = 0; other < index; other++)
+                        distinct &= Encoding(index) != Encoding(other);
+        }
+
+        Check(distinct, "every control has its own encoding");
+        Check(Flush(Controls, Committed) == VMCS_CONTROL_COUNT,
+              "a cleared vmcs has every control written once");
+        Check(InVmcs(Controls), "every control lands in its own field");
+        Check(Committed->valid == (1U << VMCS_CONTROL_COUNT) - 1,
+              "every control is committed");
+
+        /* a cleared vmcs could hold anything, unchanged values included */
+        VmcsControlsInvalidate(Controls, Committed);
+        Check(Flush(Controls, Committed) == VMCS_CONTROL_COUNT,
+              "invalidating writes everything again, unchanged or not");
+        Check(!Flush(Controls, Committed), "a second flush writes nothing");
+}
+
+static void
+SelfTestDeferred(PVMCS_CONTROLS Controls, PVMCS_CONTROLS_COMMITTED Committed)
+{
+        UINT32 msr_bitmaps = IA32_VMX_PROCBASED_CTLS_USE_MSR_BITMAPS_FLAG;
+        UINT32 mtf         = IA32_VMX_PROCBASED_CTLS_MONITOR_TRAP_FLAG_FLAG;
+        UINT32 proc        = VmcsControlRead(Controls, VMCS_CONTROL_PROC_CTLS);
+        UINT64 field       = Encoding(VMCS_CONTROL_PROC_CTLS);
+
+        /* an exit that doesn't touch any control */
+        Exit(Controls, Committed);
+        Check(!Flush(Controls, Committed), "an idle exit writes nothing");
+
+        /* set then cleared in the same exit, i.e a single step abandoned */
+        Exit(Controls, Committed);
+        VmcsControlSet(Controls, VMCS_CONTROL_PROC_CTLS, mtf);
+        VmcsControlClear(Controls, VMCS_CONTROL_PROC_CTLS, mtf);
+        Check(Controls->dirty == 1U << VMCS_CONTROL_PROC_CTLS,
+              "toggling a control marks it dirty");
+        Check(!Flush(Controls, Committed),
+              "set then clear within one exit costs no vmwrite");
+        Check(HwSimGetVmcsField(field) == proc,
+              "the vmcs is left as it was");
+
+        /* rewriting the value already there */
+        Exit(Controls, Committed);
+        VmcsControlWrite(Controls, VMCS_CONTROL_PROC_CTLS, proc);
+        VmcsControlSet(Controls, VMCS_CONTROL_PROC_CTLS, 0);
+        Check(!Flush(Controls, Committed),
+              "writing the committed value costs no vmwrite");
+
+        /* three controls changed, one of them several times */
+        Exit(Controls, Committed);
+        VmcsControlSet(Controls, VMCS_CONTROL_PROC_CTLS, mtf);
+        VmcsControlSet(Controls, VMCS_CONTROL_PROC_CTLS, msr_bitmaps);
+        VmcsControlClear(Controls, VMCS_CONTROL_PROC_CTLS, mtf);
+        VmcsControlClear(Controls, VMCS_CONTROL_PROC_CTLS, msr_bitmaps);
+        VmcsControlSet(Controls, VMCS_CONTROL_PROC_CTLS, mtf);
+        VmcsControlSet(Controls, VMCS_CONTROL_EXCEPTION_BITMAP, 1U << 3);
+        VmcsControlWrite(Controls, VMCS_CONTROL_ENTRY_EXCEPTION_ERROR_CODE, 7);
+        Check(Flush(Controls, Committed) == 3,
+              "one vmwrite per changed control, however often it changed");
+        Check(InVmcs(Controls), "the vmcs holds the final values");
+
+        /* back to where it was, a single write undoes it */
+        Exit(Controls, Committed);
+        VmcsControlClear(Controls, VMCS_CONTROL_PROC_CTLS, mtf);
+        Check(Flush(Controls, Committed) == 1 &&
+                  HwSimGetVmcsField(field) == proc,
+              "clearing on a later exit is a single vmwrite");
+}
+
+/*
+ * The processor clears the valid bit of the interruption information on every
+ * exit, behind the committed copy's back.
+ */
+static void
+SelfTestOnExit(PVMCS_CONTROLS Controls, PVMCS_CONTROLS_COMMITTED Committed)
+{
+        VMCS_CONTROL intr  = VMCS_CONTROL_ENTRY_INTERRUPTION_INFORMATION;
+        UINT64       field = Encoding(intr);
+        UINT32       valid = VMENTRY_INTERRUPT_INFORMATION_VALID_FLAG;
+        UINT32       event = valid | (3U << 8) | 3;
+
+        Exit(Controls, Committed);
+        VmcsControlWrite(Controls, intr, event);
+        Check(Flush(Controls, Committed) == 1 &&
+                  HwSimGetVmcsField(field) == event,
+              "an injected event is written");
+
+        Exit(Controls, Committed);
+        Check(!(VmcsControlRead(Controls, intr) & valid),
+              "the event is no longer pending after the exit");
+        Check(!(Controls->dirty & (1U << intr)),
+              "the exit itself doesn't dirty the field");
+        Check(!Flush(Controls, Committed),
+              "an event is never injected twice");
+        Check(InVmcs(Controls), "the vmcs and the controls agree");
+
+        /* the same event again, which the vmcs no longer holds */
+        VmcsControlWrite(Controls, intr, event);
+        Check(Flush(Controls, Committed) == 1 &&
+                  HwSimGetVmcsField(field) == event,
+              "the same event injected on the next exit is written again");
+
+        /* injected and withdrawn by the same exit */
+        Exit(Controls, Committed);
+        VmcsControlWrite(Controls, intr, event);
+        VmcsControlClear(Controls, intr, valid);
+        Check(!Flush(Controls, Committed) &&
+                  !(HwSimGetVmcsField(field) & valid),
+              "an event withdrawn in the same exit costs no vmwrite");
+}
+
+int
+main(int argc, char** argv)
+{
+        VMCS_CONTROLS           controls  = {0};
+        VMCS_CONTROLS_COMMITTED committed = {0};
+
+        if (argc != 1) {
+                fprintf(stderr, "usage: %s\n", argv[0]);
+                return 1;
+        }
+
+        HwSimReset();
+
+        SelfTestInvalidate(&controls, &committed);
+        SelfTestDeferred(&controls, &committed);
+        SelfTestOnExit(&controls, &committed);
+
+        printf("selftest: %u checks, %u failures\n", checks, failures);
+        return failures ? 1 : 0;
+}
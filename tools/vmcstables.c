@@ -0,0 +1,279 @@
+/*
+ * vmcstables - checks the vmcs field tables and snapshots in hv/vmcsfield.c.
+ *
+ * Applies each table to the in memory vmcs in hwsim and captures it back,
+ * which has to round trip every field at its own width with one vmwrite per
+ * field applied and one vmread per field captured. Then takes a snapshot,
+ * changes a guest and a control field behind its back and checks the diff
+ * reports exactly those two, by name, with the values either side.
+ *
+ * Builds with any C99 compiler on either Windows or Linux:
+ *
+ *   cc -O2 -I../hv -I. -o vmcstables vmcstables.c hwsim.c ../hv/vmcsfield.c
+ *
+ * usage: vmcstables
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "hwsim.h"
+#include "vmcsfield.h"
+
+#define DIFF_MAX_CHANGES 8
+
+typedef struct _DIFF_RECORD {
+        UINT32 count;
+        UINT32 encoding[DIFF_MAX_CHANGES];
+        UINT64 before[DIFF_MAX_CHANGES];
+        UINT64 after[DIFF_MAX_CHANGES];
+        char   name[DIFF_MAX_CHANGES][64];
+
+} DIFF_RECORD, *PDIFF_RECORD;
+
+static unsigned checks   = 0;
+static unsigned failures = 0;
+
+static void
+Check(int Condition, const char* What)
+{
+        checks++;
+
+        if (Condition)
+                return;
+
+        printf("FAIL: %s\n", What);
+        failures++;
+}
+
+static UINT64
+Truncate(UINT8 Width, UINT64 Value)
+{
+        switch (Width) {
+        case VMCS_WIDTH_16: return Value & 0xFFFF;
+        case VMCS_WIDTH_32: return Value & 0xFFFFFFFF;
+        default: return Value;
+        }
+}
+
+static void
+Record(_In_ const VMCS_FIELD* Field,
+       _In_ UINT64            Before,
+       _In_ UINT64            After,
+       _In_opt_ VOID*         Context)
+{
+        PDIFF_RECORD record = Context;
+
+        if (record->count == DIFF_MAX_CHANGES)
+                return;
+
+        record->encoding[record->count] = Field->encoding;
+        record->before[record->count]   = Before;
+        record->after[record->count]    = After;
+        snprintf(record->name[record->count],
+                 sizeof(record->name[0]),
+                 "%s",
+                 Field->name);
+        record->count++;
+}
+
+/* Every field in every table has an encoding of its own. */
+static void
+SelfTestEncodings()
+{
+        const VMCS_FIELD_TABLE* tables[] = {&vmcs_control_table,
+                                            &vmcs_exit_information_table,
+                                            &vmcs_guest_state_table,
+                                            &vmcs_host_state_table};
+        UINT32                  count    = sizeof(tables) / sizeof(tables[0]);
+        const VMCS_FIELD*       fields   = NULL;
+        int                     distinct = 1;
+
+        /* tag every field, a shared encoding loses all but the last tag */
+        for (UINT32 table = 0; table < count; table++) {
+                fields = tables[table]->fields;
+
+                for (UINT32 index = 0; index < tables[table]->count; index++)
+                        HwSimSetVmcsField(fields[index].encoding,
+                                          (table << 8) | index);
+        }
+
+        for (UINT32 table = 0; table < count; table++) {
+                fields = tables[table]->fields;
+
+                for (UINT32 index = 0; index < tables[table]->count; index++)
+                        distinct &= HwSimGetVmcsField(fields[index].encoding) ==
+                                    ((table << 8) | index);
+        }
+
+        Check(distinct, "no two fields share an encoding");
+}
+
+/*
+ * Applies a table with values wider than any field and captures it back, each
+ * field should come back truncated to its own width.
+ */
+static void
+SelfTestApply(const VMCS_FIELD_TABLE* Table)
+{
+        UINT64         values[VMCS_TABLE_MAX_FIELDS]   = {0};
+        UINT64         captured[VMCS_TABLE_MAX_FIELDS] = {0};
+        HWSIM_COUNTERS counters                        = {0};
+        UINT32         written                         = 0;
+        UINT64         value                           = 0;
+        int            truncated                       = 1;
+
+        for (UINT32 index = 0; index < Table->count; index++)
+                values[index] = 0xAAAAAAAAAAAAAAA0ull | index;
+
+        HwSimResetCounters();
+        written = VmcsApply(Table, values, NULL);
+        HwSimGetCounters(&counters);
+
+        Check(written == Table->count,
+              "without a shadow every field is written");
+        Check(counters.vmwrites == written,
+              "an apply returns the number of vmwrites it issued");
+        Check(!counters.vmreads, "an apply never reads the vmcs");
+
+        HwSimResetCounters();
+        VmcsCapture(Table, captured);
+        HwSimGetCounters(&counters);
+
+        Check(counters.vmreads == Table->count,
+              "a capture is one vmread per field");
+        Check(!counters.vmwrites, "a capture never writes the vmcs");
+
+        for (UINT32 index = 0; index < Table->count; index++) {
+                value = Truncate(Table->fields[index].width, values[index]);
+                truncated &= captured[index] == value;
+        }
+
+        Check(truncated, "every field round trips at its own width");
+}
+
+static void
+SelfTestShadow()
+{
+        const VMCS_FIELD_TABLE* table    = &vmcs_host_state_table;
+        UINT64                  values[VMCS_TABLE_MAX_FIELDS] = {0};
+        VMCS_SHADOW             shadow   = {0};
+        HWSIM_COUNTERS          counters = {0};
+
+        for (UINT32 index = 0; index < table->count; index++)
+                values[index] = 0x1000 + index;
+
+        VmcsShadowInvalidate(&shadow);
+
+        Check(VmcsApply(table, values, &shadow) == table->count,
+              "an invalidated shadow has every field written");
+        Check(!VmcsApply(table, values, &shadow),
+              "applying the same values again writes nothing");
+
+        values[3] = 0x2000;
+        HwSimResetCounters();
+        Check(VmcsApply(table, values, &shadow) == 1,
+              "only the changed field is written");
+        HwSimGetCounters(&counters);
+        Check(counters.vmwrites == 1 &&
+                  HwSimGetVmcsField(table->fields[3].encoding) == 0x2000,
+              "the changed field lands in the vmcs");
+
+        /* the upper bits of a 16 bit field are dropped before comparing */
+        values[0] += 0x10000;
+        Check(!VmcsApply(table, values, &shadow),
+              "a change outside of the fields width writes nothing");
+
+        /* a cleared vmcs could hold anything */
+        VmcsShadowInvalidate(&shadow);
+        Check(VmcsApply(table, values, &shadow) == table->count,
+              "invalidating writes everything again, unchanged or not");
+}
+
+static const VMCS_FIELD*
+FindField(const VMCS_FIELD_TABLE* Table, const char* Name)
+{
+        for (UINT32 index = 0; index < Table->count; index++) {
+                if (!strcmp(Table->fields[index].name, Name))
+                        return &Table->fields[index];
+        }
+
+        return NULL;
+}
+
+static void
+SelfTestSnapshotDiff()
+{
+        const VMCS_FIELD* rip    = NULL;
+        const VMCS_FIELD* bitmap = NULL;
+        VMCS_SNAPSHOT     before = {0};
+        VMCS_SNAPSHOT     after  = {0};
+        DIFF_RECORD       record = {0};
+
+        rip    = FindField(&vmcs_guest_state_table, "GUEST_RIP");
+        bitmap = FindField(&vmcs_control_table, "CTRL_EXCEPTION_BITMAP");
+
+        Check(rip && bitmap, "the fields the diff changes are in the tables");
+
+        if (!rip || !bitmap)
+                return;
+
+        HwSimSetVmcsField(rip->encoding, 0xFFFFF80000001000ull);
+        HwSimSetVmcsField(bitmap->encoding, 1U << 3);
+
+        VmcsSnapshot(&before);
+        VmcsSnapshot(&after);
+
+        Check(!VmcsSnapshotDiff(&before, &after, Record, &record) &&
+                  !record.count,
+              "an unchanged vmcs diffs to nothing");
+
+        HwSimSetVmcsField(rip->encoding, 0xFFFFF80000001003ull);
+        HwSimSetVmcsField(bitmap->encoding, (1U << 3) | (1U << 14));
+        VmcsSnapshot(&after);
+
+        Check(VmcsSnapshotDiff(&before, &after, Record, &record) == 2 &&
+                  record.count == 2,
+              "the diff reports the two fields changed");
+
+        /* the controls are diffed first */
+        Check(!strcmp(record.name[0], "CTRL_EXCEPTION_BITMAP") &&
+                  record.encoding[0] == bitmap->encoding &&
+                  record.before[0] == 1U << 3 &&
+                  record.after[0] == ((1U << 3) | (1U << 14)),
+              "the control is reported with its values either side");
+
+        Check(!strcmp(record.name[1], "GUEST_RIP") &&
+                  record.encoding[1] == rip->encoding &&
+                  record.before[1] == 0xFFFFF80000001000ull &&
+                  record.after[1] == 0xFFFFF80000001003ull,
+              "the guest rip is reported with its values either side");
+
+        memset(&record, 0, sizeof(record));
+        Check(VmcsSnapshotDiff(&after, &before, Record, &record) == 2 &&
+                  record.before[0] == ((1U << 3) | (1U << 14)),
+              "diffing the other way round swaps before and after");
+}
+
+int
+main(int argc, char** argv)
+{
+        if (argc != 1) {
+                fprintf(stderr, "usage: %s\n", argv[0]);
+                return 1;
+        }
+
+        HwSimReset();
+
+        SelfTestEncodings();
+        SelfTestApply(&vmcs_host_state_table);
+        SelfTestApply(&vmcs_guest_state_table);
+        SelfTestApply(&vmcs_control_table);
+        SelfTestApply(&vmcs_exit_information_table);
+        SelfTestShadow();
+
+        HwSimReset();
+        SelfTestSnapshotDiff();
+
+        printf("selftest: %u checks, %u failures\n", checks, failures);
+        return failures ? 1 : 0;
+}